@@ -152,7 +152,8 @@ int NvDecoder::HandleVideoSequence(CUVIDEOFORMAT *pVideoFormat)
     ;
     m_videoInfo << std::endl;
 
-    int nDecodeSurface = pVideoFormat->min_num_decode_surfaces;
+    // Pictures held by the caller in async display mode must not be overwritten
+    int nDecodeSurface = pVideoFormat->min_num_decode_surfaces + m_nExtraDecodeSurfaces;
 
     CUVIDDECODECAPS decodecaps;
     memset(&decodecaps, 0, sizeof(decodecaps));
@@ -200,6 +201,8 @@ int NvDecoder::HandleVideoSequence(CUVIDEOFORMAT *pVideoFormat)
     if (m_nWidth && m_nLumaHeight && m_nChromaHeight) {
 
         // cuvidCreateDecoder() has been called before, and now there's possible config change
+        // Pictures queued in async display mode refer to the current configuration
+        if (m_fnDrain) m_fnDrain();
         return ReconfigureDecoder(pVideoFormat);
     }
 
@@ -307,7 +310,7 @@ int NvDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
     bool bDisplayRectChange = !(pVideoFormat->display_area.bottom == m_videoFormat.display_area.bottom && pVideoFormat->display_area.top == m_videoFormat.display_area.top \
         && pVideoFormat->display_area.left == m_videoFormat.display_area.left && pVideoFormat->display_area.right == m_videoFormat.display_area.right);
 
-    int nDecodeSurface = pVideoFormat->min_num_decode_surfaces;
+    int nDecodeSurface = pVideoFormat->min_num_decode_surfaces + m_nExtraDecodeSurfaces;
 
     if ((pVideoFormat->coded_width > m_nMaxWidth) || (pVideoFormat->coded_height > m_nMaxHeight)) {
         // For VP9, let driver  handle the change if new width/height > maxwidth/maxheight
@@ -464,6 +467,12 @@ int NvDecoder::HandlePictureDecode(CUVIDPICPARAMS *pPicParams) {
 *  0: fail, >=1: succeeded
 */
 int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
+    if (m_fnDisplay)
+    {
+        m_fnDisplay(*pDispInfo);
+        return 1;
+    }
+
     CUVIDPROCPARAMS videoProcessingParameters = {};
     videoProcessingParameters.progressive_frame = pDispInfo->progressive_frame;
     videoProcessingParameters.second_field = pDispInfo->repeat_first_field + 1;
@@ -657,6 +666,36 @@ bool NvDecoder::Decode(const uint8_t *pData, int nSize, uint8_t ***pppFrame, int
     return true;
 }
 
+void NvDecoder::SetAsyncDisplay(int nExtraDecodeSurfaces, std::function<void(const CUVIDPARSERDISPINFO &)> fnDisplay, std::function<void()> fnDrain)
+{
+    m_nExtraDecodeSurfaces = nExtraDecodeSurfaces;
+    m_fnDisplay = fnDisplay;
+    m_fnDrain = fnDrain;
+}
+
+bool NvDecoder::MapFrame(const CUVIDPARSERDISPINFO &dispInfo, CUdeviceptr *pdpFrame, unsigned int *pnPitch, CUstream stream)
+{
+    CUVIDPROCPARAMS videoProcessingParameters = {};
+    videoProcessingParameters.progressive_frame = dispInfo.progressive_frame;
+    videoProcessingParameters.second_field = dispInfo.repeat_first_field + 1;
+    videoProcessingParameters.top_field_first = dispInfo.top_field_first;
+    videoProcessingParameters.unpaired_field = dispInfo.repeat_first_field < 0;
+    videoProcessingParameters.output_stream = stream;
+
+    CUDA_DRVAPI_CALL(dyn::cuCtxPushCurrent(m_cuContext));
+    CUresult result = dyn::cuvidMapVideoFrame(m_hDecoder, dispInfo.picture_index, pdpFrame,
+        pnPitch, &videoProcessingParameters);
+    CUDA_DRVAPI_CALL(dyn::cuCtxPopCurrent(nullptr));
+    return result == CUDA_SUCCESS;
+}
+
+void NvDecoder::UnmapFrame(CUdeviceptr dpFrame)
+{
+    dyn::cuCtxPushCurrent(m_cuContext);
+    dyn::cuvidUnmapVideoFrame(m_hDecoder, dpFrame);
+    dyn::cuCtxPopCurrent(nullptr);
+}
+
 bool NvDecoder::DecodeLockFrame(const uint8_t *pData, int nSize, uint8_t ***pppFrame, int *pnFrameReturned, uint32_t flags, int64_t **ppTimestamp, int64_t timestamp, CUstream stream)
 {
     bool ret = Decode(pData, nSize, pppFrame, pnFrameReturned, flags, ppTimestamp, timestamp, stream);
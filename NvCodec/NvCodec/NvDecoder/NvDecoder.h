@@ -13,6 +13,7 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <functional>
 #include <mutex>
 #include <vector>
 #include <string>
@@ -138,6 +139,40 @@ public:
     */
     int GetBPP() { assert(m_nWidth); return m_nBPP; }
 
+    /**
+    *   @brief  This function is used to get the height of the surface returned by MapFrame().
+    *   The chroma plane starts at pitch * GetSurfaceHeight() in a mapped surface.
+    */
+    int GetSurfaceHeight() { assert(m_nSurfaceHeight); return m_nSurfaceHeight; }
+
+    /**
+    *   @brief  Hands pictures ready for display to fnDisplay instead of mapping and copying them in Decode().
+    *   Must be called before the first call to Decode().
+    *   The caller maps the pictures later with MapFrame(), possibly from another thread.
+    *   nExtraDecodeSurfaces surfaces are added to the decoder so that the parser does not
+    *   overwrite up to that many pictures waiting to be mapped; the caller must not hold more.
+    *   fnDrain is called from Decode() before the decoder is reconfigured, and must return
+    *   only after every picture passed to fnDisplay has been unmapped.
+    *   @param  nExtraDecodeSurfaces - number of pictures the caller may hold
+    *   @param  fnDisplay - called for each picture ready for display
+    *   @param  fnDrain - called before reconfiguration
+    */
+    void SetAsyncDisplay(int nExtraDecodeSurfaces, std::function<void(const CUVIDPARSERDISPINFO &)> fnDisplay, std::function<void()> fnDrain);
+
+    /**
+    *   @brief  Maps a picture passed to fnDisplay of SetAsyncDisplay(). Blocks until the picture is decoded.
+    *   @param  dispInfo - picture to map
+    *   @param  pdpFrame - device pointer of the mapped surface
+    *   @param  pnPitch - pitch of the mapped surface
+    *   @param  stream - CUstream to be used for post-processing operations
+    */
+    bool MapFrame(const CUVIDPARSERDISPINFO &dispInfo, CUdeviceptr *pdpFrame, unsigned int *pnPitch, CUstream stream = 0);
+
+    /**
+    *   @brief  Unmaps a surface returned by MapFrame()
+    */
+    void UnmapFrame(CUdeviceptr dpFrame);
+
     /**
     *   @brief  This function is used to get the YUV chroma format
     */
@@ -277,4 +312,7 @@ private:
     unsigned int m_nMaxWidth = 0, m_nMaxHeight = 0;
     bool m_bReconfigExternal = false;
     bool m_bReconfigExtPPChange = false;
+    int m_nExtraDecodeSurfaces = 0;
+    std::function<void(const CUVIDPARSERDISPINFO &)> m_fnDisplay;
+    std::function<void()> m_fnDrain;
 };
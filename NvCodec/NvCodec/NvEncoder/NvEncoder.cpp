@@ -10,6 +10,9 @@
 */
 
 #include "NvEncoder/NvEncoder.h"
+
+#include <exception>
+
 #if !defined(_WIN32)
 #include <dlfcn.h>
 #endif
@@ -62,7 +65,9 @@ NvEncoder::NvEncoder(NV_ENC_DEVICE_TYPE eDeviceType,
   m_hEncoder = hEncoder;
 }
 
-void NvEncoder::TryLoadNvEncApi() {
+// nvEncodeAPI のロードとドライバのバージョン確認は重いので、プロセスで 1 回だけ行う。
+// ライブラリは解放せずに持ち続け、関数テーブルを各エンコーダにコピーする。
+static void LoadNvEncApiOnce(NV_ENCODE_API_FUNCTION_LIST* functions) {
 #if defined(_WIN32)
 #if defined(_WIN64)
   HMODULE hModule = LoadLibrary(TEXT("nvEncodeAPI64.dll"));
@@ -79,59 +84,6 @@ void NvEncoder::TryLoadNvEncApi() {
         NV_ENC_ERR_NO_ENCODE_DEVICE);
   }
 
-  typedef NVENCSTATUS(NVENCAPI *
-                      NvEncodeAPIGetMaxSupportedVersion_Type)(uint32_t*);
-#if defined(_WIN32)
-  NvEncodeAPIGetMaxSupportedVersion_Type NvEncodeAPIGetMaxSupportedVersion =
-      (NvEncodeAPIGetMaxSupportedVersion_Type)GetProcAddress(
-          hModule, "NvEncodeAPIGetMaxSupportedVersion");
-#else
-  NvEncodeAPIGetMaxSupportedVersion_Type NvEncodeAPIGetMaxSupportedVersion =
-      (NvEncodeAPIGetMaxSupportedVersion_Type)dlsym(
-          hModule, "NvEncodeAPIGetMaxSupportedVersion");
-#endif
-
-  uint32_t version = 0;
-  uint32_t currentVersion =
-      (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
-  NVENC_API_CALL(NvEncodeAPIGetMaxSupportedVersion(&version));
-  if (currentVersion > version) {
-#if defined(_WIN32)
-    FreeLibrary((HMODULE)hModule);
-#else
-    dlclose(hModule);
-#endif
-    NVENC_THROW_ERROR(
-        "Current Driver Version does not support this NvEncodeAPI version, "
-        "please upgrade driver",
-        NV_ENC_ERR_INVALID_VERSION);
-  }
-#if defined(_WIN32)
-  FreeLibrary((HMODULE)hModule);
-#else
-  dlclose(hModule);
-#endif
-}
-
-void NvEncoder::LoadNvEncApi() {
-#if defined(_WIN32)
-#if defined(_WIN64)
-  HMODULE hModule = LoadLibrary(TEXT("nvEncodeAPI64.dll"));
-#else
-  HMODULE hModule = LoadLibrary(TEXT("nvEncodeAPI.dll"));
-#endif
-#else
-  void* hModule = dlopen("libnvidia-encode.so.1", RTLD_LAZY);
-#endif
-
-  if (hModule == NULL) {
-    NVENC_THROW_ERROR(
-        "NVENC library file is not found. Please ensure NV driver is installed",
-        NV_ENC_ERR_NO_ENCODE_DEVICE);
-  }
-
-  m_hModule = hModule;
-
   typedef NVENCSTATUS(NVENCAPI *
                       NvEncodeAPIGetMaxSupportedVersion_Type)(uint32_t*);
 #if defined(_WIN32)
@@ -173,21 +125,39 @@ void NvEncoder::LoadNvEncApi() {
         NV_ENC_ERR_NO_ENCODE_DEVICE);
   }
 
-  m_nvenc = {NV_ENCODE_API_FUNCTION_LIST_VER};
-  NVENC_API_CALL(NvEncodeAPICreateInstance(&m_nvenc));
+  *functions = {NV_ENCODE_API_FUNCTION_LIST_VER};
+  NVENC_API_CALL(NvEncodeAPICreateInstance(functions));
+}
+
+// 失敗した場合も結果を覚えておき、呼ばれる度に同じ例外を投げる
+static const NV_ENCODE_API_FUNCTION_LIST& GetNvEncApi() {
+  static std::once_flag once;
+  static NV_ENCODE_API_FUNCTION_LIST functions = {
+      NV_ENCODE_API_FUNCTION_LIST_VER};
+  static std::exception_ptr error;
+  std::call_once(once, []() {
+    try {
+      LoadNvEncApiOnce(&functions);
+    } catch (...) {
+      error = std::current_exception();
+    }
+  });
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return functions;
+}
+
+void NvEncoder::TryLoadNvEncApi() {
+  GetNvEncApi();
+}
+
+void NvEncoder::LoadNvEncApi() {
+  m_nvenc = GetNvEncApi();
 }
 
 NvEncoder::~NvEncoder() {
   DestroyHWEncoder();
-
-  if (m_hModule) {
-#if defined(_WIN32)
-    FreeLibrary((HMODULE)m_hModule);
-#else
-    dlclose(m_hModule);
-#endif
-    m_hModule = nullptr;
-  }
 }
 
 void NvEncoder::CreateDefaultEncoderParams(
@@ -468,6 +438,14 @@ void NvEncoder::MapResources(uint32_t bfrIdx) {
   }
 }
 
+NV_ENC_INPUT_PTR NvEncoder::GetEncodeInputBuffer(uint32_t bfrIdx) {
+  if (m_vRegisteredResources.empty()) {
+    return (NV_ENC_INPUT_PTR)m_vInputFrames[bfrIdx].inputPtr;
+  }
+  MapResources(bfrIdx);
+  return m_vMappedInputBuffers[bfrIdx];
+}
+
 void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>>& vPacket,
                             NV_ENC_PIC_PARAMS* pPicParams) {
   vPacket.clear();
@@ -477,9 +455,7 @@ void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>>& vPacket,
 
   int bfrIdx = m_iToSend % m_nEncoderBuffer;
 
-  MapResources(bfrIdx);
-
-  NVENCSTATUS nvStatus = DoEncode(m_vMappedInputBuffers[bfrIdx],
+  NVENCSTATUS nvStatus = DoEncode(GetEncodeInputBuffer(bfrIdx),
                                   m_vBitstreamOutputBuffer[bfrIdx], pPicParams);
 
   if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT) {
@@ -490,6 +466,75 @@ void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>>& vPacket,
   }
 }
 
+void NvEncoder::SubmitFrame(NV_ENC_PIC_PARAMS* pPicParams) {
+  if (!IsHWEncoderInitialized()) {
+    NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
+  }
+
+  int bfrIdx = m_iToSend % m_nEncoderBuffer;
+
+  NVENCSTATUS nvStatus = DoEncode(GetEncodeInputBuffer(bfrIdx),
+                                  m_vBitstreamOutputBuffer[bfrIdx], pPicParams);
+
+  if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT) {
+    m_iToSend++;
+  } else {
+    NVENC_THROW_ERROR("nvEncEncodePicture API failed", nvStatus);
+  }
+}
+
+void NvEncoder::GetSubmittedPacket(std::vector<uint8_t>& packet) {
+  GetSubmittedPacket([&packet](size_t size) {
+    packet.resize(size);
+    return packet.data();
+  });
+}
+
+void NvEncoder::GetSubmittedPacket(
+    const std::function<uint8_t*(size_t)>& allocator,
+    PacketInfo* pInfo) {
+  int bfrIdx = m_iGot % m_nEncoderBuffer;
+
+  // Completion events are only signaled in async mode. Otherwise
+  // nvEncLockBitstream() blocks until the output is ready.
+#if defined(_WIN32)
+  if (m_initializeParams.enableEncodeAsync) {
+    if (WaitForSingleObject(m_vpCompletionEvent[bfrIdx], 20000) ==
+        WAIT_FAILED) {
+      NVENC_THROW_ERROR("Failed to encode frame", NV_ENC_ERR_GENERIC);
+    }
+  }
+#endif
+
+  NV_ENC_LOCK_BITSTREAM lockBitstreamData = {NV_ENC_LOCK_BITSTREAM_VER};
+  lockBitstreamData.outputBitstream = m_vBitstreamOutputBuffer[bfrIdx];
+  lockBitstreamData.doNotWait = false;
+  NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
+
+  uint8_t* pData = (uint8_t*)lockBitstreamData.bitstreamBufferPtr;
+  size_t nSize = lockBitstreamData.bitstreamSizeInBytes;
+  uint8_t* pDst = allocator(nSize);
+  if (pDst != nullptr && nSize > 0) {
+    memcpy(pDst, pData, nSize);
+  }
+  if (pInfo != nullptr) {
+    pInfo->pictureType = lockBitstreamData.pictureType;
+    pInfo->frameAvgQP = lockBitstreamData.frameAvgQP;
+    pInfo->frameSatd = lockBitstreamData.frameSatd;
+  }
+
+  NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(
+      m_hEncoder, lockBitstreamData.outputBitstream));
+
+  if (m_vMappedInputBuffers[bfrIdx]) {
+    NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(
+        m_hEncoder, m_vMappedInputBuffers[bfrIdx]));
+    m_vMappedInputBuffers[bfrIdx] = nullptr;
+  }
+
+  m_iGot++;
+}
+
 void NvEncoder::RunMotionEstimation(std::vector<uint8_t>& mvData) {
   if (!m_hEncoder) {
     NVENC_THROW_ERROR("Encoder Initialization failed",
@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <functional>
 #include <iostream>
 #include <mutex>
 #include <sstream>
@@ -130,6 +131,44 @@ class NvEncoder {
   void EncodeFrame(std::vector<std::vector<uint8_t>>& vPacket,
                    NV_ENC_PIC_PARAMS* pPicParams = nullptr);
 
+  /**
+    *  @brief  This function is used to submit a frame without waiting for the output.
+    *  The application must call GetSubmittedPacket() once for each submitted
+    *  frame, in submission order. GetSubmittedPacket() may be called from a
+    *  different thread, but not more than GetEncoderBufferCount() frames may be
+    *  in flight, because the next submit reuses the oldest input buffer.
+    */
+  void SubmitFrame(NV_ENC_PIC_PARAMS* pPicParams = nullptr);
+
+  /**
+    *  @brief  Per-frame statistics reported by NVENC in NV_ENC_LOCK_BITSTREAM.
+    */
+  struct PacketInfo {
+    NV_ENC_PIC_TYPE pictureType = NV_ENC_PIC_TYPE_UNKNOWN;
+    uint32_t frameAvgQP = 0;
+    uint32_t frameSatd = 0;
+  };
+
+  /**
+    *  @brief  This function is used to wait for the oldest submitted frame and get its packet.
+    */
+  void GetSubmittedPacket(std::vector<uint8_t>& packet);
+
+  /**
+    *  @brief  This function works like GetSubmittedPacket(), but copies the bitstream
+    *  directly into the memory returned by the allocator. The allocator is called
+    *  with the bitstream size while the bitstream is locked. If it returns nullptr,
+    *  the packet is dropped. If pInfo is not null, the statistics of the frame
+    *  are stored in it.
+    */
+  void GetSubmittedPacket(const std::function<uint8_t*(size_t)>& allocator,
+                          PacketInfo* pInfo = nullptr);
+
+  /**
+    *  @brief  This function returns the number of input/output buffers.
+    */
+  int32_t GetEncoderBufferCount() const { return m_nEncoderBuffer; }
+
   /**
     *  @brief  This function to flush the encoder queue.
     *  The encoder might be queuing frames for B picture encoding or lookahead;
@@ -360,6 +399,13 @@ class NvEncoder {
     */
   void MapResources(uint32_t bfrIdx);
 
+  /**
+    *  @brief This function is used to get the input buffer passed to NvEncodeAPI.
+    *  Input buffers allocated by nvEncCreateInputBuffer() are passed as is,
+    *  registered resources are mapped first.
+    */
+  NV_ENC_INPUT_PTR GetEncodeInputBuffer(uint32_t bfrIdx);
+
   /**
     *  @brief This function is used to wait for completion of encode command.
     */
@@ -474,5 +520,4 @@ class NvEncoder {
   std::vector<NV_ENC_OUTPUT_PTR> m_vMVDataOutputBuffer;
   uint32_t m_nMaxEncodeWidth = 0;
   uint32_t m_nMaxEncodeHeight = 0;
-  void* m_hModule = nullptr;
 };
@@ -45,7 +45,7 @@ void NvEncoderCuda::AllocateInputBuffers(int32_t numInputBuffers)
 
     for (int count = 0; count < numCount; count++)
     {
-        CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
+        CUDA_DRVAPI_CALL(dyn::cuCtxPushCurrent(m_cuContext));
         std::vector<void*> inputFrames;
         for (int i = 0; i < numInputBuffers; i++)
         {
@@ -53,13 +53,13 @@ void NvEncoderCuda::AllocateInputBuffers(int32_t numInputBuffers)
             uint32_t chromaHeight = GetNumChromaPlanes(GetPixelFormat()) * GetChromaHeight(GetPixelFormat(), GetMaxEncodeHeight());
             if (GetPixelFormat() == NV_ENC_BUFFER_FORMAT_YV12 || GetPixelFormat() == NV_ENC_BUFFER_FORMAT_IYUV)
                 chromaHeight = GetChromaHeight(GetPixelFormat(), GetMaxEncodeHeight());
-            CUDA_DRVAPI_CALL(cuMemAllocPitch((CUdeviceptr *)&pDeviceFrame,
+            CUDA_DRVAPI_CALL(dyn::cuMemAllocPitch((CUdeviceptr *)&pDeviceFrame,
                 &m_cudaPitch,
                 GetWidthInBytes(GetPixelFormat(), GetMaxEncodeWidth()),
                 GetMaxEncodeHeight() + chromaHeight, 16));
             inputFrames.push_back((void*)pDeviceFrame);
         }
-        CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+        CUDA_DRVAPI_CALL(dyn::cuCtxPopCurrent(NULL));
 
         RegisterInputResources(inputFrames,
             NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
@@ -95,13 +95,13 @@ void NvEncoderCuda::ReleaseCudaResources()
 
     UnregisterInputResources();
 
-    cuCtxPushCurrent(m_cuContext);
+    dyn::cuCtxPushCurrent(m_cuContext);
 
     for (uint32_t i = 0; i < m_vInputFrames.size(); ++i)
     {
         if (m_vInputFrames[i].inputPtr)
         {
-            cuMemFree(reinterpret_cast<CUdeviceptr>(m_vInputFrames[i].inputPtr));
+            dyn::cuMemFree(reinterpret_cast<CUdeviceptr>(m_vInputFrames[i].inputPtr));
         }
     }
     m_vInputFrames.clear();
@@ -110,12 +110,12 @@ void NvEncoderCuda::ReleaseCudaResources()
     {
         if (m_vReferenceFrames[i].inputPtr)
         {
-            cuMemFree(reinterpret_cast<CUdeviceptr>(m_vReferenceFrames[i].inputPtr));
+            dyn::cuMemFree(reinterpret_cast<CUdeviceptr>(m_vReferenceFrames[i].inputPtr));
         }
     }
     m_vReferenceFrames.clear();
 
-    cuCtxPopCurrent(NULL);
+    dyn::cuCtxPopCurrent(NULL);
     m_cuContext = nullptr;
 }
 
@@ -138,7 +138,7 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
         NVENC_THROW_ERROR("Invalid source memory type for copy", NV_ENC_ERR_INVALID_PARAM);
     }
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(device));
+    CUDA_DRVAPI_CALL(dyn::cuCtxPushCurrent(device));
 
     uint32_t srcPitch = nSrcPitch ? nSrcPitch : NvEncoder::GetWidthInBytes(pixelFormat, width);
     CUDA_MEMCPY2D m = { 0 };
@@ -159,11 +159,11 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
     m.Height = height;
     if (bUnAlignedDeviceCopy && srcMemoryType == CU_MEMORYTYPE_DEVICE)
     {
-        CUDA_DRVAPI_CALL(cuMemcpy2DUnaligned(&m));
+        CUDA_DRVAPI_CALL(dyn::cuMemcpy2DUnaligned(&m));
     }
     else
     {
-        CUDA_DRVAPI_CALL(stream == NULL? cuMemcpy2D(&m) : cuMemcpy2DAsync(&m, stream));
+        CUDA_DRVAPI_CALL(stream == NULL? dyn::cuMemcpy2D(&m) : dyn::cuMemcpy2DAsync(&m, stream));
     }
 
     std::vector<uint32_t> srcChromaOffsets;
@@ -193,15 +193,15 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
             m.Height = chromaHeight;
             if (bUnAlignedDeviceCopy && srcMemoryType == CU_MEMORYTYPE_DEVICE)
             {
-                CUDA_DRVAPI_CALL(cuMemcpy2DUnaligned(&m));
+                CUDA_DRVAPI_CALL(dyn::cuMemcpy2DUnaligned(&m));
             }
             else
             {
-                CUDA_DRVAPI_CALL(stream == NULL? cuMemcpy2D(&m) : cuMemcpy2DAsync(&m, stream));
+                CUDA_DRVAPI_CALL(stream == NULL? dyn::cuMemcpy2D(&m) : dyn::cuMemcpy2DAsync(&m, stream));
             }
         }
     }
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    CUDA_DRVAPI_CALL(dyn::cuCtxPopCurrent(NULL));
 }
 
 void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
@@ -223,7 +223,7 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
         NVENC_THROW_ERROR("Invalid source memory type for copy", NV_ENC_ERR_INVALID_PARAM);
     }
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(device));
+    CUDA_DRVAPI_CALL(dyn::cuCtxPushCurrent(device));
 
     uint32_t srcPitch = nSrcPitch ? nSrcPitch : NvEncoder::GetWidthInBytes(pixelFormat, width);
     CUDA_MEMCPY2D m = { 0 };
@@ -244,11 +244,11 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
     m.Height = height;
     if (bUnAlignedDeviceCopy && srcMemoryType == CU_MEMORYTYPE_DEVICE)
     {
-        CUDA_DRVAPI_CALL(cuMemcpy2DUnaligned(&m));
+        CUDA_DRVAPI_CALL(dyn::cuMemcpy2DUnaligned(&m));
     }
     else
     {
-        CUDA_DRVAPI_CALL(cuMemcpy2D(&m));
+        CUDA_DRVAPI_CALL(dyn::cuMemcpy2D(&m));
     }
 
     std::vector<uint32_t> srcChromaOffsets;
@@ -277,13 +277,13 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
             m.Height = chromaHeight;
             if (bUnAlignedDeviceCopy && srcMemoryType == CU_MEMORYTYPE_DEVICE)
             {
-                CUDA_DRVAPI_CALL(cuMemcpy2DUnaligned(&m));
+                CUDA_DRVAPI_CALL(dyn::cuMemcpy2DUnaligned(&m));
             }
             else
             {
-                CUDA_DRVAPI_CALL(cuMemcpy2D(&m));
+                CUDA_DRVAPI_CALL(dyn::cuMemcpy2D(&m));
             }
         }
     }
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    CUDA_DRVAPI_CALL(dyn::cuCtxPopCurrent(NULL));
 }
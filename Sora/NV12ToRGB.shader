@@ -0,0 +1,58 @@
+// Sora.RenderTrackToTextureNV12 で転送した Y/UV プレーンを RGB に変換して描画するシェーダ
+// _MainTex に Y プレーン、_UVTex に UV プレーンを指定する
+Shader "Sora/NV12ToRGB"
+{
+    Properties
+    {
+        _MainTex ("Y", 2D) = "black" {}
+        _UVTex ("UV", 2D) = "gray" {}
+    }
+    SubShader
+    {
+        Tags { "RenderType"="Opaque" }
+        Pass
+        {
+            CGPROGRAM
+            #pragma vertex vert
+            #pragma fragment frag
+            #include "UnityCG.cginc"
+
+            sampler2D _MainTex;
+            float4 _MainTex_ST;
+            sampler2D _UVTex;
+
+            struct v2f
+            {
+                float4 pos : SV_POSITION;
+                float2 uv : TEXCOORD0;
+            };
+
+            v2f vert(appdata_base v)
+            {
+                v2f o;
+                o.pos = UnityObjectToClipPos(v.vertex);
+                o.uv = TRANSFORM_TEX(v.texcoord, _MainTex);
+                return o;
+            }
+
+            fixed4 frag(v2f i) : SV_Target
+            {
+                // libyuv の I420ToABGR と同じ BT.601 (limited range) で変換する
+                float y = (tex2D(_MainTex, i.uv).r - 16.0 / 255.0) * 1.164;
+                float2 uv = tex2D(_UVTex, i.uv).rg - 128.0 / 255.0;
+                float u = uv.x;
+                float v = uv.y;
+                float3 rgb = float3(
+                    y + 1.596 * v,
+                    y - 0.391 * u - 0.813 * v,
+                    y + 2.018 * u);
+                fixed4 col = fixed4(saturate(rgb), 1.0);
+#ifndef UNITY_COLORSPACE_GAMMA
+                col.rgb = GammaToLinearSpace(col.rgb);
+#endif
+                return col;
+            }
+            ENDCG
+        }
+    }
+}
@@ -1,4 +1,5 @@
 ﻿using System;
+using System.Collections.Generic;
 using System.Runtime.InteropServices;
 
 public class Sora : IDisposable
@@ -13,6 +14,9 @@ public class Sora : IDisposable
     {
         DeviceCamera = 0,
         UnityCamera = 1,
+        // アプリがエンコードした H.264 を PushEncodedFrame で渡す。VideoWidth, VideoHeight には実際の解像度を指定する。
+        // Windows と Ubuntu だけ対応していて、VideoCodec.H264 で Simulcast と Spotlight を使わない場合だけ使える
+        EncodedFrame = 2,
     }
     public enum VideoCodec
     {
@@ -24,6 +28,106 @@ public class Sora : IDisposable
     {
         OPUS,
     }
+    public enum VideoFec
+    {
+        // offer と WebRTC の既定のまま変更しない
+        Default,
+        // FEC を使わず、パケットロスは再送だけで回復する
+        None,
+        // ULPFEC を RED に包んで送る
+        Ulpfec,
+        // FlexFEC を別のストリームで送る
+        Flexfec,
+    }
+    public enum LogLevel
+    {
+        Verbose = 0,
+        Info = 1,
+        Warning = 2,
+        Error = 3,
+        None = 4,
+    }
+    public enum IceTransportPolicy
+    {
+        // 全ての ICE の候補を使う
+        All,
+        // TURN サーバーを経由する候補だけを使う
+        Relay,
+        // TURN over TLS (turns:) の候補だけを使う。UDP や TCP が塞がれているネットワーク向け
+        RelayTls,
+    }
+    // 送受信する音声の用途。用途に合わせて音声処理とビットレートを決める
+    public enum AudioProfile
+    {
+        // 通話向け。エコーキャンセルやノイズ抑制など全ての処理を行う
+        Voice,
+        // 楽器や BGM 向け。エコーキャンセル以外の処理を行わず、高めのビットレートで送る
+        Music,
+        // UnityAudioInput で送るゲームの合成音向け。音声処理を一切行わず、高めのビットレートで送る
+        RawGameAudio,
+    }
+    // SDK が作るスレッドの種類
+    public enum ThreadType
+    {
+        // WebRTC のネットワーク処理を行うスレッド
+        Network = 0,
+        // WebRTC のエンコードやデコード、音声処理を行うスレッド
+        Worker = 1,
+        Signaling = 2,
+        // シグナリングの WebSocket を処理するスレッド
+        IO = 3,
+        // 受信した音声を 10 ミリ秒ごとに WebRTC から取り出すスレッド
+        AudioPlayout = 4,
+        // UnityAudioInput の音声を 10 ミリ秒ごとに WebRTC に渡すスレッド
+        AudioRecording = 5,
+    }
+    public enum ThreadPriority
+    {
+        // OS の既定のまま変更しない
+        Default = 0,
+        Low = 1,
+        Normal = 2,
+        High = 3,
+        // 権限が無くて設定できない場合は High になる
+        Realtime = 4,
+    }
+    public enum LocalPreview
+    {
+        // 受信した映像と同じく OnAddTrack で通知されるので、RenderTrackToTexture で描画する
+        Renderer = 0,
+        // Unity のカメラの場合は OnAddTrack で通知せず、LocalPreviewTexture をそのまま表示する。
+        // GPU から読み出した映像をもう一度テクスチャに転送しないので CPU を使わない。
+        // 実カメラの場合は Renderer と同じ
+        Texture = 1,
+        // 自分の映像を表示しない
+        None = 2,
+    }
+    public enum DataChannelDirection
+    {
+        Sendrecv,
+        Sendonly,
+        Recvonly,
+    }
+    // Sora に作ってもらうメッセージング用の DataChannel
+    public class DataChannel
+    {
+        // # で始めること
+        public string Label = "";
+        public DataChannelDirection Direction = DataChannelDirection.Sendrecv;
+        // false にすると順番を待たずに届いたものから受け取る
+        public bool Ordered = true;
+        // 再送を打ち切るまでの時間（ミリ秒）と回数。片方だけ指定でき、どちらも -1 の場合は届くまで再送する。
+        // ゲームの状態の同期など、古いメッセージが要らない場合は Ordered = false と MaxRetransmits = 0 にすると遅延が減る
+        public int MaxPacketLifeTime = -1;
+        public int MaxRetransmits = -1;
+    }
+    public class ThreadConfig
+    {
+        public ThreadPriority Priority = ThreadPriority.Default;
+        // 動かしてもいい CPU のビットマスク。0 の場合は固定しない。
+        // macOS と iOS では無視される。
+        public ulong AffinityMask = 0;
+    }
     public class Config
     {
         public string SignalingUrl = "";
@@ -31,29 +135,187 @@ public class Sora : IDisposable
         public string Metadata = "";
         public Role Role = Sora.Role.Sendonly;
         public bool Multistream = false;
+        // false にすると音声だけで接続する。カメラやレンダラ、映像のコーデックを用意しないので、
+        // ボイスチャットだけの場合に接続までの時間とメモリが減る。
+        // SharedEngine の場合、映像のコーデックは最初に接続した Sora の設定で決まる
+        public bool Video = true;
         public CapturerType CapturerType = Sora.CapturerType.DeviceCamera;
         public UnityEngine.Camera UnityCamera = null;
         public int UnityCameraRenderTargetDepthBuffer = 16;
+        // Unity カメラの映像を GPU から読み出すのを何フレーム遅らせるか。
+        // 0 の場合は GPU の処理が終わるのを待つので、レンダリングスレッドが止まる。
+        public int UnityCameraReadbackLatency = 1;
+        // メニューや一時停止中の画面など、Unity のカメラの映像がほとんど動かない場合に true にする。
+        // MarkUnityCameraDirty を呼んだフレームだけ GPU から読み出して送信し、
+        // 呼ばなかったフレームは UnityCameraStaticRefreshMs ごとに 1 回だけ送る。
+        // 解像度を落とさずにフレームレートで帯域を調整するので、文字などがくっきり送られる。
+        public bool UnityCameraStaticContent = false;
+        public int UnityCameraStaticRefreshMs = 1000;
+        // Unity のカメラの映像を送るフレームレート。0 の場合は OnRender を呼んだ毎フレーム送る。
+        // 120fps で描画していても、指定したフレームレートの刻みに当たるフレームだけ GPU から読み出すので、
+        // 読み出しとエンコードの負荷が減る。描画の間隔がばらついても、送る映像の時刻は等間隔になる。
+        public int UnityCameraCaptureFps = 0;
         public string VideoCapturerDevice = "";
         public int VideoWidth = 640;
         public int VideoHeight = 480;
+        // 実カメラのフレームレート。
+        // Unity のカメラの場合は Unity の描画に合わせて送るので使わない
+        public int VideoFps = 30;
         public VideoCodec VideoCodec = VideoCodec.VP9;
         public int VideoBitrate = 0;
         public bool UnityAudioInput = false;
         public bool UnityAudioOutput = false;
+        // Unity の音声のサンプリングレートとチャンネル数。
+        // 0 の場合は AudioSettings.outputSampleRate と AudioSettings.speakerMode を使う。
+        // ProcessAudio と PullAudio はこの形式で受け渡しし、WebRTC との変換は SDK の中で行う。
+        public int UnityAudioSampleRate = 0;
+        public int UnityAudioChannels = 0;
+        // UnityAudioOutput が有効な場合に、受信した音声をミックスせずにトラックごとに取り出す。
+        // OnAddAudioTrack で受け取ったトラック ID を PullTrackAudio に渡して、
+        // トラックごとの AudioSource から再生すること。
+        public bool UnityAudioOutputPerTrack = false;
         public string AudioRecordingDevice = "";
         public string AudioPlayoutDevice = "";
         public AudioCodec AudioCodec = AudioCodec.OPUS;
         public int AudioBitrate = 0;
+        public AudioProfile AudioProfile = AudioProfile.Voice;
+        // Opus の DTX。無音の間は音声のパケットを送らないので、
+        // 大人数の通話で話していない参加者の帯域と受信側のデコードの負荷が無くなる。
+        public bool AudioOpusDtx = false;
+        // Opus の in-band FEC。パケットロスした音声を次のパケットから復元できるようにする。
+        public bool AudioOpusFec = true;
+        // 1 パケットに入れる音声の長さ（ミリ秒）。0 の場合は 20 ミリ秒。
+        // 長くするとパケット数が減る代わりに遅延が増える。
+        public int AudioOpusPtime = 0;
+        public bool AudioOpusStereo = false;
+        // Opus の符号化の複雑さ（0-10）。-1 の場合は WebRTC の既定値を使う。
+        // 低性能な Android 端末などでは下げるとエンコードの CPU 負荷が減る。
+        public int AudioOpusComplexity = -1;
+        // 映像の FEC。パケットロスした映像を再送を待たずに復元できるようにする。
+        // ロスの多い Wi-Fi やモバイル回線で、再送による 1 RTT の遅延を避けたい場合に使う。
+        // Flexfec はプロセス全体の field trial で有効にするので、最初に接続した Sora で指定すること。
+        public VideoFec VideoFec = VideoFec.Default;
+        // Opus を RED で冗長化して送る。音声の帯域は倍近くになるが、1 パケットのロスなら再送を待たずに復元できる。
+        // プロセス全体の field trial で有効にするので、最初に接続した Sora で指定すること。
+        public bool AudioRed = false;
+        // 統計情報を取得する間隔（ミリ秒）。
+        // GetRtpStats や GetStats、Sora への統計情報の送信は、この間隔で取得したものを使う。
+        public int StatsInterval = 1000;
+        // シグナリングの接続が切れた時に再接続を試みる最大回数。0 の場合は再接続しない。
+        // 再接続中もそれまでの PeerConnection は切断せずに残しておき、新しい offer を受け取った時に置き換える。
+        public int ReconnectMaxAttempts = 5;
+        // 接続後の update や notify、統計情報のやりとりを WebSocket ではなく DataChannel で行う。
+        // IgnoreDisconnectWebsocket の場合は、DataChannel に切り替えた後に WebSocket を切断する。
+        public bool DataChannelSignaling = false;
+        public bool IgnoreDisconnectWebsocket = false;
+        // 送信側は Sora から指定された複数の解像度とビットレートで同時に送る。
+        // 受信側は SimulcastRid で受け取るレイヤーを選べる ("r0" が最も低く、"r2" が最も高い)。
+        // 空の場合は Sora に任せる。
+        public bool Simulcast = false;
+        public string SimulcastRid = "";
+        // Multistream でスポットライトを使う。音声の大きい SpotlightNumber 人だけが高画質で届き、
+        // 他の参加者は低画質になるので、参加者が多くても受信帯域とデコードの負荷が増えにくい。
+        // SpotlightNumber が 0 の場合は Sora の設定に任せる。
+        public bool Spotlight = false;
+        public int SpotlightNumber = 0;
+        // 送信する映像の解像度とフレームレートを自動で調整する。
+        // 毎フレーム ReportFrameTime を呼ぶと、ゲームのフレーム時間が AdaptiveQualityTargetFrameTime を
+        // 超えた時に送信する映像を落とし、余裕が戻ったら元に戻す。
+        // エンコードがフレーム間隔に間に合っていない場合も落とす。
+        // AdaptiveQualityTargetFrameTime が 0 の場合は Application.targetFrameRate から決める。
+        public bool AdaptiveQuality = false;
+        public float AdaptiveQualityTargetFrameTime = 0;
+        // 送信する帯域の推定の開始値と最小値、最大値 (kbps)。0 の場合は WebRTC の既定値を使う。
+        // VideoStartBitrate を高めにすると、接続直後に映像が粗い時間が短くなる。
+        public int VideoStartBitrate = 0;
+        public int VideoMinBitrate = 0;
+        public int VideoMaxBitrate = 0;
+        // WebRTC の field trial。"WebRTC-Foo/Enabled/WebRTC-Bar/Disabled/" の形式で指定する。
+        // プロセス全体の設定なので、最初に接続した Sora のものだけが使われる。
+        public string FieldTrials = "";
+        // 自分の映像の表示方法
+        public LocalPreview LocalPreview = LocalPreview.Renderer;
+        // 受信した映像の変換を Unity のレンダリングスレッドではなく、
+        // 指定した数の変換用スレッドで行う。0 の場合はレンダリングスレッドで行う。
+        public int RendererConvertThreads = 0;
+        // Windows で NVENC を使う場合に、エンコード中のフレームとは別に何フレームまで入力を受け付けるか。
+        // 0 が最も遅延が少なく、1440p や 4K などの高解像度では 1～2 にするとスループットが上がる。
+        public int VideoEncoderOutputDelay = 0;
+        // Windows で NVENC を使う場合に、キーフレーム要求に IDR ではなくイントラリフレッシュで応える。
+        // IDR によるビットレートの急増を避けられるが、回復に数フレームかかる。
+        public bool VideoEncoderIntraRefresh = false;
+        // VP8 と VP9 のエンコーダが使うスレッド数の上限。0 の場合は CPU のコア数から決める。
+        // 1080p の VP9 など CPU で重いエンコードをする場合は増やし、ゲームの処理を優先する場合は減らす。
+        public int VideoEncoderThreads = 0;
+        // VP9 を SVC で送る場合の空間レイヤーと時間レイヤーの数を "L3T3" のように指定する。
+        // 空の場合は SVC にしない。VideoCodec が VP9 で、Simulcast と Spotlight が無効な場合だけ使われる。
+        public string VideoScalabilityMode = "";
+        // Windows で NVDEC を使う場合に、デコード結果を CPU に読み出さずに GPU に置いたままにする。
+        // RenderTrackToNativeTextureNV12 と組み合わせて使うこと。
+        // Android では MediaCodec のデコード結果を SurfaceTexture に出力させる。
+        // RenderTrackToNativeTexture と組み合わせて使うこと。
+        public bool VideoDecoderTextureOutput = false;
+        // Windows で NVDEC を使う場合に、デコード結果のコピーと出力を別スレッドで行う。
+        // 4K などの高解像度で、コピーを待たずに次のフレームのデコードを始められる。
+        public bool VideoDecoderAsyncOutput = false;
+        // 受信した映像を表示するまでの遅延の下限と上限、音声のジッタバッファの遅延の下限（ミリ秒）。
+        // -1 の場合は WebRTC に任せる。映像の上限はプロセス全体で最初に接続した Sora の設定になる。
+        public int VideoPlayoutDelayMinMs = -1;
+        public int VideoPlayoutDelayMaxMs = -1;
+        public int AudioJitterBufferMinDelayMs = -1;
+        // 遠隔操作やクラウドゲームなど、滑らかさより遅延を優先する場合に true にする。
+        // 上の値で指定しなかったものは、映像はジッタバッファで待たずに表示し、音声は溜まった分を早送りする。
+        public bool LowLatency = false;
+        // Windows で NVENC と NVDEC を動かすアダプタの番号。
+        // -1 の場合は Unity が描画に使っているアダプタを使う。
+        // Unity と別のアダプタを指定した場合、Unity のカメラ映像はテクスチャのままエンコードできない。
+        public int GpuAdapterIndex = -1;
+        // 同じプロセスの他の Sora と PeerConnectionFactory やスレッドを共有する。
+        // 複数のチャンネルに同時に接続する場合に、接続数が増えてもスレッドやメモリが増えないようにする。
+        // コーデックや音声デバイスの設定は最初に接続した Sora のものが使われ、OnHandleAudio は使えない。
+        public bool SharedEngine = false;
+        // スレッドごとの優先度と動かす CPU。指定しなかったスレッドは
+        // AudioPlayout が Realtime、AudioRecording が High、それ以外は Default になる。
+        // SharedEngine の場合、IO 以外のスレッドは最初に接続した Sora の設定が使われる。
+        public Dictionary<ThreadType, ThreadConfig> ThreadConfigs = new Dictionary<ThreadType, ThreadConfig>();
+        // メッセージング用の DataChannel。指定した場合は DataChannelSignaling も有効になる
+        public List<DataChannel> DataChannels = new List<DataChannel>();
+        // 指定すると、送受信する映像をエンコードされたまま、このディレクトリにストリームごとの IVF ファイルで書き出す。
+        // 再エンコードしないので、録画にかかるのはファイルへの書き込みだけになる。
+        // ファイル名は send_<SSRC>.ivf と recv_<SSRC>.ivf で、ffmpeg などで再生や変換ができる
+        public string RecordingDirectory = "";
+        // offer を受け取って PeerConnection を作った時点から、指定した数の ICE の候補を集めておく。
+        // answer を作っている間に TURN の割り当てが進むので、TURN が必要なネットワークで接続が早くなる。
+        public int IceCandidatePoolSize = 0;
+        // TURN が必須のネットワークでは Relay や RelayTls にすると、つながらない候補の確認を待たずに済む。
+        public IceTransportPolicy IceTransportPolicy = Sora.IceTransportPolicy.All;
+        // 接続後もネットワークの変化に合わせて ICE の候補を集め続ける。Wi-Fi とモバイル回線を行き来する端末向け。
+        public bool IceContinualGathering = false;
     }
 
     IntPtr p;
     GCHandle onAddTrackHandle;
     GCHandle onRemoveTrackHandle;
+    GCHandle onAddAudioTrackHandle;
+    GCHandle onRemoveAudioTrackHandle;
     GCHandle onNotifyHandle;
+    GCHandle onDataChannelMessageHandle;
+    GCHandle onKeyFrameRequestHandle;
     GCHandle onHandleAudioHandle;
     UnityEngine.Rendering.CommandBuffer commandBuffer;
+    UnityEngine.Rendering.CommandBuffer boundCommandBuffer;
+    List<KeyValuePair<uint, UnityEngine.Texture>> boundTextures = new List<KeyValuePair<uint, UnityEngine.Texture>>();
+    bool boundTexturesChanged = false;
     UnityEngine.Camera unityCamera;
+    UnityEngine.RenderTexture unityCameraTexture;
+    bool prepared = false;
+
+    // Unity のカメラから送信している場合の、カメラの描画先のテクスチャ。
+    // LocalPreview.Texture の場合はこれを自分の映像として表示する
+    public UnityEngine.RenderTexture LocalPreviewTexture
+    {
+        get { return unityCameraTexture; }
+    }
 
     public void Dispose()
     {
@@ -67,11 +329,31 @@ public class Sora : IDisposable
             onRemoveTrackHandle.Free();
         }
 
+        if (onAddAudioTrackHandle.IsAllocated)
+        {
+            onAddAudioTrackHandle.Free();
+        }
+
+        if (onRemoveAudioTrackHandle.IsAllocated)
+        {
+            onRemoveAudioTrackHandle.Free();
+        }
+
         if (onNotifyHandle.IsAllocated)
         {
             onNotifyHandle.Free();
         }
 
+        if (onDataChannelMessageHandle.IsAllocated)
+        {
+            onDataChannelMessageHandle.Free();
+        }
+
+        if (onKeyFrameRequestHandle.IsAllocated)
+        {
+            onKeyFrameRequestHandle.Free();
+        }
+
         if (p != IntPtr.Zero)
         {
             sora_destroy(p);
@@ -90,24 +372,53 @@ public class Sora : IDisposable
     {
         p = sora_create();
         commandBuffer = new UnityEngine.Rendering.CommandBuffer();
+        boundCommandBuffer = new UnityEngine.Rendering.CommandBuffer();
     }
 
-    public bool Connect(Config config)
+    // 接続に必要なスレッドやコーデック、カメラ、シグナリングの WebSocket の接続を先に用意しておく。
+    // ロード画面の間などに呼んでおくと、Connect してから映像が届くまでの時間が減る。
+    // Prepare した場合、Connect に渡した config は使われない。
+    public bool Prepare(Config config)
     {
+        if (prepared)
+        {
+            return false;
+        }
+
         IntPtr unityCameraTexture = IntPtr.Zero;
-        if (config.CapturerType == CapturerType.UnityCamera)
+        if (config.Video && config.CapturerType == CapturerType.UnityCamera)
         {
             unityCamera = config.UnityCamera;
             var texture = new UnityEngine.RenderTexture(config.VideoWidth, config.VideoHeight, config.UnityCameraRenderTargetDepthBuffer, UnityEngine.RenderTextureFormat.BGRA32);
             unityCamera.targetTexture = texture;
             unityCamera.enabled = true;
+            this.unityCameraTexture = texture;
             unityCameraTexture = texture.GetNativeTexturePtr();
         }
 
+        foreach (var kv in config.ThreadConfigs)
+        {
+            if (sora_set_thread_config(p, (int)kv.Key, (int)kv.Value.Priority, kv.Value.AffinityMask) != 0)
+            {
+                return false;
+            }
+        }
+
+        foreach (var dc in config.DataChannels)
+        {
+            var direction =
+                dc.Direction == DataChannelDirection.Sendonly ? "sendonly" :
+                dc.Direction == DataChannelDirection.Recvonly ? "recvonly" : "sendrecv";
+            if (sora_add_data_channel(p, dc.Label, direction, dc.Ordered ? 1 : 0, dc.MaxPacketLifeTime, dc.MaxRetransmits) != 0)
+            {
+                return false;
+            }
+        }
+
         var role =
             config.Role == Role.Sendonly ? "sendonly" :
             config.Role == Role.Recvonly ? "recvonly" : "sendrecv";
-        return sora_connect(
+        prepared = sora_prepare(
             p,
             UnityEngine.Application.unityVersion,
             config.SignalingUrl,
@@ -115,19 +426,102 @@ public class Sora : IDisposable
             config.Metadata,
             role,
             config.Multistream ? 1 : 0,
+            config.Video ? 1 : 0,
             (int)config.CapturerType,
             unityCameraTexture,
+            config.UnityCameraReadbackLatency,
+            config.UnityCameraStaticContent ? 1 : 0,
+            config.UnityCameraStaticRefreshMs,
+            config.UnityCameraCaptureFps,
             config.VideoCapturerDevice,
             config.VideoWidth,
             config.VideoHeight,
+            config.VideoFps,
             config.VideoCodec.ToString(),
             config.VideoBitrate,
             config.UnityAudioInput ? 1 : 0,
             config.UnityAudioOutput ? 1 : 0,
+            config.UnityAudioSampleRate > 0 ? config.UnityAudioSampleRate : UnityEngine.AudioSettings.outputSampleRate,
+            config.UnityAudioChannels > 0 ? config.UnityAudioChannels : GetSpeakerModeChannels(UnityEngine.AudioSettings.speakerMode),
+            config.UnityAudioOutputPerTrack ? 1 : 0,
             config.AudioRecordingDevice,
             config.AudioPlayoutDevice,
             config.AudioCodec.ToString(),
-            config.AudioBitrate) == 0;
+            config.AudioBitrate,
+            config.AudioProfile.ToString(),
+            config.AudioOpusDtx ? 1 : 0,
+            config.AudioOpusFec ? 1 : 0,
+            config.AudioOpusPtime,
+            config.AudioOpusStereo ? 1 : 0,
+            config.AudioOpusComplexity,
+            config.VideoFec.ToString(),
+            config.AudioRed ? 1 : 0,
+            config.StatsInterval,
+            config.ReconnectMaxAttempts,
+            config.DataChannelSignaling ? 1 : 0,
+            config.IgnoreDisconnectWebsocket ? 1 : 0,
+            config.Simulcast ? 1 : 0,
+            config.SimulcastRid,
+            config.Spotlight ? 1 : 0,
+            config.SpotlightNumber,
+            config.AdaptiveQuality ? 1 : 0,
+            GetTargetFrameTime(config.AdaptiveQualityTargetFrameTime),
+            config.VideoStartBitrate,
+            config.VideoMinBitrate,
+            config.VideoMaxBitrate,
+            config.FieldTrials,
+            (int)config.LocalPreview,
+            config.RendererConvertThreads,
+            config.VideoEncoderOutputDelay,
+            config.VideoEncoderIntraRefresh ? 1 : 0,
+            config.VideoEncoderThreads,
+            config.VideoScalabilityMode,
+            config.VideoDecoderTextureOutput ? 1 : 0,
+            config.VideoDecoderAsyncOutput ? 1 : 0,
+            config.VideoPlayoutDelayMinMs,
+            config.VideoPlayoutDelayMaxMs,
+            config.AudioJitterBufferMinDelayMs,
+            config.LowLatency ? 1 : 0,
+            config.GpuAdapterIndex,
+            config.SharedEngine ? 1 : 0,
+            config.RecordingDirectory,
+            config.IceCandidatePoolSize,
+            config.IceTransportPolicy.ToString(),
+            config.IceContinualGathering ? 1 : 0) == 0;
+        return prepared;
+    }
+
+    public bool Connect(Config config)
+    {
+        if (!prepared && !Prepare(config))
+        {
+            return false;
+        }
+        return sora_connect(p) == 0;
+    }
+
+    static float GetTargetFrameTime(float targetFrameTime)
+    {
+        if (targetFrameTime > 0)
+        {
+            return targetFrameTime;
+        }
+        // targetFrameRate が指定されていない場合は 60fps とみなす
+        int frameRate = UnityEngine.Application.targetFrameRate > 0 ? UnityEngine.Application.targetFrameRate : 60;
+        return 1000.0f / frameRate;
+    }
+
+    static int GetSpeakerModeChannels(UnityEngine.AudioSpeakerMode mode)
+    {
+        switch (mode)
+        {
+            case UnityEngine.AudioSpeakerMode.Mono: return 1;
+            case UnityEngine.AudioSpeakerMode.Quad: return 4;
+            case UnityEngine.AudioSpeakerMode.Surround: return 5;
+            case UnityEngine.AudioSpeakerMode.Mode5point1: return 6;
+            case UnityEngine.AudioSpeakerMode.Mode7point1: return 8;
+            default: return 2;
+        }
     }
 
     // Unity 側でレンダリングが完了した時（yield return new WaitForEndOfFrame() の後）に呼ぶイベント
@@ -145,6 +539,417 @@ public class Sora : IDisposable
         commandBuffer.Clear();
     }
 
+    // trackId で受信した映像を RenderBoundTracks で texture にレンダリングするように登録する。
+    // トラック毎に RenderTrackToTexture を呼ぶより、コマンドバッファの実行が１回で済む。
+    public void BindTrackTexture(uint trackId, UnityEngine.Texture texture)
+    {
+        boundTextures.Add(new KeyValuePair<uint, UnityEngine.Texture>(trackId, texture));
+        boundTexturesChanged = true;
+    }
+
+    // BindTrackTexture で登録した trackId の texture を全て解除する
+    public void UnbindTrackTexture(uint trackId)
+    {
+        if (boundTextures.RemoveAll(x => x.Key == trackId) != 0)
+        {
+            boundTexturesChanged = true;
+        }
+    }
+
+    // BindTrackTexture で登録した全てのトラックを、まとめて texture にレンダリングする。
+    // 新しいフレームが来ていないトラックのテクスチャは更新されない。
+    public void RenderBoundTracks()
+    {
+        if (boundTexturesChanged)
+        {
+            // 登録内容が変わった時だけコマンドバッファを作り直す
+            boundCommandBuffer.Clear();
+            // SetRenderBudget で設定した転送の予算を、このフレームの分に戻す
+            boundCommandBuffer.IssuePluginEvent(sora_get_render_frame_begin_callback(), 0);
+            var callback = sora_get_texture_update_callback();
+            foreach (var bound in boundTextures)
+            {
+                boundCommandBuffer.IssuePluginCustomTextureUpdateV2(callback, bound.Value, bound.Key);
+            }
+            boundTexturesChanged = false;
+        }
+        if (boundTextures.Count == 0)
+        {
+            return;
+        }
+        UnityEngine.Graphics.ExecuteCommandBuffer(boundCommandBuffer);
+    }
+
+    // trackId で受信した映像に、最後にテクスチャにレンダリングしてから新しいフレームが来ているかどうか。
+    // false の場合は RenderTrackToTexture を呼んでもテクスチャは更新されないので、呼ぶ必要は無い。
+    public static bool TrackHasNewFrame(uint trackId)
+    {
+        return sora_track_has_new_frame(trackId) != 0;
+    }
+
+    // trackId で受信した映像の最大フレームレートを指定する。0 の場合は制限しない。
+    // レンダリング先のテクスチャのサイズと合わせて、受信側の映像の調整に使われる。
+    public static void SetTrackMaxFramerate(uint trackId, int maxFramerate)
+    {
+        sora_track_set_max_framerate(trackId, maxFramerate);
+    }
+
+    // trackId で受信した映像を一時停止する。画面外のトラックなどに使う。
+    // 一時停止中はフレームを Unity 向けに変換せず、テクスチャには最後のフレームが残る。
+    public static void SetTrackPaused(uint trackId, bool paused)
+    {
+        sora_track_set_paused(trackId, paused ? 1 : 0);
+    }
+
+    // 受信した映像のテクスチャ転送に、1 フレームあたりの時間（マイクロ秒）とバイト数の上限を設ける。
+    // 両方 0 の場合は制限しない。上限を超えたトラックは次のフレームに回すが、
+    // maxStaleFrames フレームより長くは待たせない。
+    // RenderBoundTracks は自動でフレームの区切りを通知する。
+    // RenderTrackToTexture を使う場合は、フレームの最初に BeginRenderFrame を呼ぶこと。
+    public static void SetRenderBudget(long timeUs, long bytes, int maxStaleFrames)
+    {
+        sora_set_render_budget(timeUs, bytes, maxStaleFrames);
+    }
+
+    // ログファイルに出力する重要度の下限。既定は Info。
+    // ログの書き込みは専用のスレッドで行うので、Verbose にしてもエンコードや描画は止まらない。
+    public static void SetLogLevel(LogLevel level)
+    {
+        sora_set_log_level((int)level);
+    }
+
+    // SetRenderBudget の予算を、このフレームの分に戻す
+    public static void BeginRenderFrame()
+    {
+        UnityEngine.GL.IssuePluginEvent(sora_get_render_frame_begin_callback(), 0);
+    }
+
+    // 複数の受信した映像を 1 枚のテクスチャに columns x rows のタイルで並べて転送するアトラスを作る。
+    // ギャラリー表示などで、テクスチャの転送と描画がトラックごとではなく 1 回で済む。
+    // タイルのサイズは受信する映像の解像度の調整に使われる。作れない場合は 0 を返す
+    public static uint CreateTextureAtlas(int columns, int rows)
+    {
+        return sora_create_texture_atlas(columns, rows);
+    }
+
+    public static void DestroyTextureAtlas(uint atlasId)
+    {
+        sora_destroy_texture_atlas(atlasId);
+    }
+
+    // tile 番目のタイルに trackId の映像を転送する。trackId に 0 を指定するとタイルを空ける。
+    // タイルの番号は左から右、行ごとに数える
+    public static bool SetTextureAtlasTrack(uint atlasId, int tile, uint trackId)
+    {
+        return sora_texture_atlas_set_track(atlasId, tile, trackId) != 0;
+    }
+
+    // tile 番目のタイルの UV 矩形。マテリアルの mainTextureOffset, mainTextureScale などに使う。
+    // 上下の向きは RenderTrackToTexture で転送したテクスチャと同じ
+    public static UnityEngine.Rect GetTextureAtlasUVRect(uint atlasId, int tile)
+    {
+        var rect = new float[4];
+        if (sora_texture_atlas_get_uv_rect(atlasId, tile, rect) == 0)
+        {
+            return UnityEngine.Rect.zero;
+        }
+        return new UnityEngine.Rect(rect[0], rect[1], rect[2], rect[3]);
+    }
+
+    // 転送の上限を超えた時に、priority が大きいトラックから先に転送する。
+    // 同じ priority の場合は、待たされているトラック、テクスチャが大きいトラックの順になる
+    public static void SetTrackRenderPriority(uint trackId, int priority)
+    {
+        sora_track_set_render_priority(trackId, priority);
+    }
+
+    // 受信した映像トラックのレンダリングに関する統計情報
+    [StructLayout(LayoutKind.Sequential)]
+    public struct TrackRenderStats
+    {
+        // OnFrame で受け取ったフレーム数
+        public ulong FramesReceived;
+        // テクスチャに転送される前に次のフレームで上書きされたフレーム数
+        public ulong FramesDropped;
+        // テクスチャに転送したフレーム数
+        public ulong FramesRendered;
+        // kNative から I420 への変換回数と合計時間（マイクロ秒）
+        public ulong NativeConvertCount;
+        public long NativeConvertTimeUs;
+        // スケーリングと色変換の回数と合計時間（マイクロ秒）
+        public ulong ConvertCount;
+        public long ConvertTimeUs;
+        // 最後に受け取ったフレームのサイズ
+        public int LastFrameWidth;
+        public int LastFrameHeight;
+        // 送信側でキャプチャしてから、デコードされるまでと
+        // テクスチャに転送するまでの遅延（ミリ秒）の 50/95/99 パーセンタイル。
+        // abs-capture-time ヘッダ拡張が付いたフレームが無い場合は -1
+        public int CaptureToDecodeP50Ms;
+        public int CaptureToDecodeP95Ms;
+        public int CaptureToDecodeP99Ms;
+        public int CaptureToRenderP50Ms;
+        public int CaptureToRenderP95Ms;
+        public int CaptureToRenderP99Ms;
+        // 遅延を計測したフレーム数と、キャプチャ時刻が付いていなかったフレーム数
+        public ulong LatencySampleCount;
+        public ulong FramesWithoutCaptureTime;
+        // 転送の予算を超えたために、次のフレームに転送を回したフレーム数
+        public ulong FramesDeferred;
+    }
+
+    // trackId で受信した映像トラックのレンダリングに関する統計情報を取得する
+    public static bool GetTrackRenderStats(uint trackId, out TrackRenderStats stats)
+    {
+        return sora_get_track_render_stats(trackId, out stats) != 0;
+    }
+
+    // 送受信している RTP ストリームごとの統計情報。
+    // GetStats の JSON から主な値だけを取り出したもの
+    [StructLayout(LayoutKind.Sequential)]
+    public struct RtpStats
+    {
+        // 0: 音声, 1: 映像
+        public int Kind;
+        // 0: 受信, 1: 送信
+        public int Direction;
+        public uint Ssrc;
+        // 映像の場合のエンコーダ・デコーダの名前。GetStatsImplementationName で文字列にする
+        public int Implementation;
+        // 送信または受信したバイト数とパケット数
+        public ulong Bytes;
+        public ulong Packets;
+        // 送信の場合は相手から報告された値
+        public long PacketsLost;
+        public double Jitter;
+        public double RoundTripTime;
+        // 以下は映像の場合だけ
+        public double FramesPerSecond;
+        public int FrameWidth;
+        public int FrameHeight;
+        // エンコードまたはデコードしたフレーム数と、その QP の合計
+        public ulong Frames;
+        public ulong QpSum;
+        // 統計情報を取得した時刻（マイクロ秒）
+        public long TimestampUs;
+        // 前回取得した時からの差分で求めたビットレート (bps) とフレームレート
+        public double Bitrate;
+        public double FrameRate;
+    }
+
+    // 最新の統計情報を stats に書き込み、ストリームの数を返す。
+    // 戻り値が stats.Length より大きい場合は、入り切らなかった分は書き込まれない。
+    // JSON を使わず確保もしないので、毎フレーム呼んで HUD などに使える。
+    // 統計情報は Config.StatsInterval ごとに裏で取得している。
+    public int GetRtpStats(RtpStats[] stats)
+    {
+        return sora_get_rtp_stats(p, stats, stats.Length);
+    }
+
+    // age 回前に取得した統計情報を stats に書き込み、ストリームの数を返す。
+    // 履歴に残っていない場合は -1 を返す。
+    public int GetRtpStatsHistory(int age, RtpStats[] stats)
+    {
+        return sora_get_rtp_stats_history(p, age, stats, stats.Length);
+    }
+
+    // Config.AdaptiveQuality の場合に、毎フレーム Time.unscaledDeltaTime などを渡す
+    public void ReportFrameTime(float frameTimeSeconds)
+    {
+        sora_report_frame_time(p, frameTimeSeconds * 1000.0f);
+    }
+
+    // Config.UnityCameraStaticContent の場合に、カメラの映像が変わるフレームで呼ぶ
+    public void MarkUnityCameraDirty()
+    {
+        sora_mark_unity_camera_dirty(p);
+    }
+
+    // CapturerType.EncodedFrame の場合に、Annex B 形式の H.264 のアクセスユニットを 1 つ送る。
+    // キーフレームには SPS と PPS を含める。data は呼び出しの中でコピーするので、すぐに再利用していい。
+    // timestampUs はキャプチャした時刻で、単調増加していればどの時計でもいい
+    public bool PushEncodedFrame(byte[] data, int size, long timestampUs, bool isKeyFrame)
+    {
+        if (data == null)
+        {
+            throw new ArgumentNullException(nameof(data));
+        }
+        if (size < 0 || size > data.Length)
+        {
+            throw new ArgumentOutOfRangeException(nameof(size), "size exceeds data.Length");
+        }
+        return sora_push_encoded_frame(p, data, size, timestampUs, isKeyFrame ? 1 : 0) != 0;
+    }
+
+    public bool PushEncodedFrame(IntPtr data, int size, long timestampUs, bool isKeyFrame)
+    {
+        return sora_push_encoded_frame(p, data, size, timestampUs, isKeyFrame ? 1 : 0) != 0;
+    }
+
+    // Config.AdaptiveQuality で送信する映像を落としている段階。0 が最高品質
+    public int GetQualityLevel()
+    {
+        return sora_get_quality_level(p);
+    }
+
+    static Dictionary<int, string> implementationNames = new Dictionary<int, string>();
+
+    // RtpStats.Implementation を文字列にする
+    public static string GetStatsImplementationName(int id)
+    {
+        string name;
+        if (implementationNames.TryGetValue(id, out name))
+        {
+            return name;
+        }
+        var buf = new byte[256];
+        int size = sora_get_stats_implementation_name(id, buf, buf.Length);
+        name = System.Text.Encoding.UTF8.GetString(buf, 0, Math.Min(size, buf.Length - 1));
+        // 同じ番号は常に同じ名前なので覚えておく
+        implementationNames[id] = name;
+        return name;
+    }
+
+    // 時間を計測する処理
+    public enum PerfStage
+    {
+        CameraRender,
+        CameraCapture,
+        SourceCapturedFrame,
+        Encode,
+        Decode,
+        TextureUpdate,
+        AudioProcess,
+        AudioHandle,
+    }
+
+    // 処理ごとの回数と時間（マイクロ秒）
+    [StructLayout(LayoutKind.Sequential)]
+    public struct PerfCounter
+    {
+        public PerfStage Stage;
+        public ulong Count;
+        public long TotalUs;
+        public long MaxUs;
+        public long LastUs;
+    }
+
+    // 処理ごとの時間の計測を有効にする。無効な場合はほぼコストがかからない
+    public static void SetPerfCountersEnabled(bool enabled)
+    {
+        sora_set_perf_counters_enabled(enabled ? 1 : 0);
+    }
+
+    // 処理ごとの計測結果を counters に書き込み、処理の数を返す。
+    // 確保しないので毎フレーム呼んでもよい
+    public static int GetPerfCounters(PerfCounter[] counters)
+    {
+        return sora_get_perf_counters(counters, counters.Length);
+    }
+
+    public static void ResetPerfCounters()
+    {
+        sora_reset_perf_counters();
+    }
+
+    // chrome://tracing で開ける形式のイベントを溜め始める。
+    // SetPerfCountersEnabled(true) にしておくこと
+    public static void StartPerfTrace()
+    {
+        sora_start_perf_trace();
+    }
+
+    // 溜めるのを止めて、溜めたイベントを path に書き出す
+    public static bool StopPerfTrace(string path)
+    {
+        return sora_stop_perf_trace(path) != 0;
+    }
+
+    // TextureUpdateCallback の userData の上位ビットで転送するプレーンを指定する
+    const int RenderPlaneShift = 29;
+    const uint RenderPlaneY = 1;
+    const uint RenderPlaneU = 2;
+    const uint RenderPlaneV = 3;
+    const uint RenderPlaneUV = 4;
+    const uint RenderPlaneAtlas = 5;
+
+    // trackId で受信した映像の Y/U/V 各プレーンをそのままテクスチャに転送する。
+    // RGBA に変換して転送するより転送量が少なくて済む。
+    // yTexture は映像と同じサイズ、uTexture, vTexture は幅と高さが半分の
+    // TextureFormat.R8 のテクスチャを指定し、Sora/YUVToRGB シェーダで描画すること。
+    public void RenderTrackToTextureYUV(uint trackId, UnityEngine.Texture yTexture, UnityEngine.Texture uTexture, UnityEngine.Texture vTexture)
+    {
+        var callback = sora_get_texture_update_callback();
+        commandBuffer.IssuePluginCustomTextureUpdateV2(callback, yTexture, trackId | (RenderPlaneY << RenderPlaneShift));
+        commandBuffer.IssuePluginCustomTextureUpdateV2(callback, uTexture, trackId | (RenderPlaneU << RenderPlaneShift));
+        commandBuffer.IssuePluginCustomTextureUpdateV2(callback, vTexture, trackId | (RenderPlaneV << RenderPlaneShift));
+        UnityEngine.Graphics.ExecuteCommandBuffer(commandBuffer);
+        commandBuffer.Clear();
+    }
+
+    // trackId で受信した映像を NV12 の Y プレーンと UV プレーンに分けてテクスチャに転送する。
+    // yTexture は映像と同じサイズの TextureFormat.R8、uvTexture は幅と高さが半分の
+    // TextureFormat.RG16 のテクスチャを指定し、Sora/NV12ToRGB シェーダで描画すること。
+    public void RenderTrackToTextureNV12(uint trackId, UnityEngine.Texture yTexture, UnityEngine.Texture uvTexture)
+    {
+        var callback = sora_get_texture_update_callback();
+        commandBuffer.IssuePluginCustomTextureUpdateV2(callback, yTexture, trackId | (RenderPlaneY << RenderPlaneShift));
+        commandBuffer.IssuePluginCustomTextureUpdateV2(callback, uvTexture, trackId | (RenderPlaneUV << RenderPlaneShift));
+        UnityEngine.Graphics.ExecuteCommandBuffer(commandBuffer);
+        commandBuffer.Clear();
+    }
+
+    // CreateTextureAtlas で作ったアトラスに登録した全てのトラックを、1 回の転送で texture に書き込む。
+    // texture は TextureFormat.RGBA32 で、新しいフレームが来ているタイルが無ければ更新しない
+    public void RenderTextureAtlas(uint atlasId, UnityEngine.Texture texture)
+    {
+        commandBuffer.IssuePluginCustomTextureUpdateV2(sora_get_texture_update_callback(), texture, atlasId | (RenderPlaneAtlas << RenderPlaneShift));
+        UnityEngine.Graphics.ExecuteCommandBuffer(commandBuffer);
+        commandBuffer.Clear();
+    }
+
+    // RenderTrackToTextureNV12 と同じだが、Config.VideoDecoderTextureOutput が有効な場合は
+    // デコード結果を CPU を経由せずに GPU 上でテクスチャにコピーする。
+    // テクスチャは映像と同じサイズで作ること。Windows 以外では RenderTrackToTextureNV12 と同じ動作になる。
+    // テクスチャを破棄する前に ClearTrackNativeTextures を呼ぶこと。
+    public void RenderTrackToNativeTextureNV12(uint trackId, UnityEngine.Texture yTexture, UnityEngine.Texture uvTexture)
+    {
+        if (sora_set_track_native_textures(trackId, yTexture.GetNativeTexturePtr(), uvTexture.GetNativeTexturePtr()) == 0)
+        {
+            RenderTrackToTextureNV12(trackId, yTexture, uvTexture);
+            return;
+        }
+        commandBuffer.IssuePluginEvent(sora_get_native_texture_render_callback(), (int)trackId);
+        UnityEngine.Graphics.ExecuteCommandBuffer(commandBuffer);
+        commandBuffer.Clear();
+    }
+
+    public static void ClearTrackNativeTextures(uint trackId)
+    {
+        sora_set_track_native_textures(trackId, IntPtr.Zero, IntPtr.Zero);
+    }
+
+    // RenderTrackToTexture と同じだが、Android で Config.VideoDecoderTextureOutput が有効な場合は
+    // MediaCodec のデコード結果を CPU を経由せずに GPU 上でテクスチャにコピーする。
+    // GPU 上でコピーできなかったフレームは RenderTrackToTexture と同じく CPU から転送する。
+    // Unity が Vulkan の場合だけ有効で、それ以外では RenderTrackToTexture と同じ動作になる。
+    // テクスチャを破棄する前に ClearTrackNativeTexture を呼ぶこと。
+    public void RenderTrackToNativeTexture(uint trackId, UnityEngine.Texture texture)
+    {
+        if (sora_set_track_native_texture(trackId, texture.GetNativeTexturePtr()) != 0)
+        {
+            commandBuffer.IssuePluginEvent(sora_get_native_texture_render_callback(), (int)trackId);
+        }
+        commandBuffer.IssuePluginCustomTextureUpdateV2(sora_get_texture_update_callback(), texture, trackId);
+        UnityEngine.Graphics.ExecuteCommandBuffer(commandBuffer);
+        commandBuffer.Clear();
+    }
+
+    public static void ClearTrackNativeTexture(uint trackId)
+    {
+        sora_set_track_native_texture(trackId, IntPtr.Zero);
+    }
+
     private delegate void TrackCallbackDelegate(uint track_id, IntPtr userdata);
 
     [AOT.MonoPInvokeCallback(typeof(TrackCallbackDelegate))]
@@ -180,6 +985,33 @@ public class Sora : IDisposable
             sora_set_on_remove_track(p, TrackCallback, GCHandle.ToIntPtr(onRemoveTrackHandle));
         }
     }
+    // UnityAudioOutputPerTrack が有効な場合に、受信した音声トラックが追加・削除された時に呼ばれる
+    public Action<uint> OnAddAudioTrack
+    {
+        set
+        {
+            if (onAddAudioTrackHandle.IsAllocated)
+            {
+                onAddAudioTrackHandle.Free();
+            }
+
+            onAddAudioTrackHandle = GCHandle.Alloc(value);
+            sora_set_on_add_audio_track(p, TrackCallback, GCHandle.ToIntPtr(onAddAudioTrackHandle));
+        }
+    }
+    public Action<uint> OnRemoveAudioTrack
+    {
+        set
+        {
+            if (onRemoveAudioTrackHandle.IsAllocated)
+            {
+                onRemoveAudioTrackHandle.Free();
+            }
+
+            onRemoveAudioTrackHandle = GCHandle.Alloc(value);
+            sora_set_on_remove_audio_track(p, TrackCallback, GCHandle.ToIntPtr(onRemoveAudioTrackHandle));
+        }
+    }
 
     private delegate void NotifyCallbackDelegate(string json, int size, IntPtr userdata);
 
@@ -204,11 +1036,88 @@ public class Sora : IDisposable
         }
     }
 
+    private delegate void DataChannelMessageCallbackDelegate(string label, IntPtr data, int size, IntPtr userdata);
+
+    // DispatchEvents は Unity のメインスレッドから呼ばれるので、受け取ったメッセージを渡す配列は使い回す
+    static byte[] dataChannelMessageBuffer = new byte[0];
+
+    [AOT.MonoPInvokeCallback(typeof(DataChannelMessageCallbackDelegate))]
+    static private void DataChannelMessageCallback(string label, IntPtr data, int size, IntPtr userdata)
+    {
+        var callback = GCHandle.FromIntPtr(userdata).Target as Action<string, byte[], int>;
+        if (dataChannelMessageBuffer.Length < size)
+        {
+            dataChannelMessageBuffer = new byte[Math.Max(size, dataChannelMessageBuffer.Length * 2)];
+        }
+        Marshal.Copy(data, dataChannelMessageBuffer, 0, size);
+        callback(label, dataChannelMessageBuffer, size);
+    }
+
+    // メッセージング用の DataChannel で受信した時に、DispatchEvents の中で (label, data, size) で呼ばれる。
+    // 渡される配列は使い回していて size より長いことがあるので、コールバックの外で使う場合はコピーすること
+    public Action<string, byte[], int> OnDataChannelMessage
+    {
+        set
+        {
+            if (onDataChannelMessageHandle.IsAllocated)
+            {
+                onDataChannelMessageHandle.Free();
+            }
+
+            onDataChannelMessageHandle = GCHandle.Alloc(value);
+            sora_set_on_data_channel_message(p, DataChannelMessageCallback, GCHandle.ToIntPtr(onDataChannelMessageHandle));
+        }
+    }
+
+    private delegate void KeyFrameRequestCallbackDelegate(IntPtr userdata);
+
+    [AOT.MonoPInvokeCallback(typeof(KeyFrameRequestCallbackDelegate))]
+    static private void KeyFrameRequestCallback(IntPtr userdata)
+    {
+        var callback = GCHandle.FromIntPtr(userdata).Target as Action;
+        callback();
+    }
+
+    // CapturerType.EncodedFrame の場合に、受信側がキーフレームを必要としている時に DispatchEvents の中で呼ばれる。
+    // 次のキーフレームを PushEncodedFrame で渡すまでは、1 秒に 1 回まで呼ばれる
+    public Action OnKeyFrameRequest
+    {
+        set
+        {
+            if (onKeyFrameRequestHandle.IsAllocated)
+            {
+                onKeyFrameRequestHandle.Free();
+            }
+
+            onKeyFrameRequestHandle = GCHandle.Alloc(value);
+            sora_set_on_key_frame_request(p, KeyFrameRequestCallback, GCHandle.ToIntPtr(onKeyFrameRequestHandle));
+        }
+    }
+
+    // メッセージング用の DataChannel で data の offset から size バイトを送る。
+    // 配列は呼び出しの間だけ固定されて、中間のコピー無しで送信キューに渡される。
+    // まだ DataChannel が開いていない場合は false を返す
+    public bool SendDataChannelMessage(string label, byte[] data, int offset, int size)
+    {
+        if (data == null)
+        {
+            throw new ArgumentNullException(nameof(data));
+        }
+        // ネイティブ側は配列の長さを知らないので、範囲外を読まないようにここで弾く
+        if (offset < 0 || size < 0 || offset > data.Length - size)
+        {
+            throw new ArgumentOutOfRangeException(nameof(size), "offset + size exceeds data.Length");
+        }
+        return sora_send_data_channel_message(p, label, data, offset, size) != 0;
+    }
+
     public void DispatchEvents()
     {
         sora_dispatch_events(p);
     }
 
+    // UnityAudioInput が有効な場合に、Unity の音声を送信する。
+    // data は Config.UnityAudioSampleRate と Config.UnityAudioChannels の形式で、samples はフレーム数。
     public void ProcessAudio(float[] data, int offset, int samples)
     {
         sora_process_audio(p, data, offset, samples);
@@ -216,15 +1125,45 @@ public class Sora : IDisposable
 
     private delegate void HandleAudioCallbackDelegate(IntPtr buf, int samples, int channels, IntPtr userdata);
 
+    // 再生スレッドは 1 つなので、受け取った音声を渡す配列は使い回す
+    static short[] handleAudioBuffer = new short[0];
+
     [AOT.MonoPInvokeCallback(typeof(HandleAudioCallbackDelegate))]
     static private void HandleAudioCallback(IntPtr buf, int samples, int channels, IntPtr userdata)
     {
         var callback = GCHandle.FromIntPtr(userdata).Target as Action<short[], int, int>;
-        short[] buf2 = new short[samples * channels];
-        Marshal.Copy(buf, buf2, 0, samples * channels);
-        callback(buf2, samples, channels);
+        if (handleAudioBuffer.Length != samples * channels)
+        {
+            handleAudioBuffer = new short[samples * channels];
+        }
+        Marshal.Copy(buf, handleAudioBuffer, 0, samples * channels);
+        callback(handleAudioBuffer, samples, channels);
     }
 
+    // UnityAudioOutput が有効で OnHandleAudio を設定していない場合に、
+    // 受信した音声を data に書き込む。MonoBehaviour.OnAudioFilterRead から呼ぶこと。
+    // Unity の DSP の時計に合わせて取り出すので、音のずれや余分なバッファリングが起きない。
+    public void PullAudio(float[] data, int channels)
+    {
+        sora_pull_audio(p, data, data.Length / channels, channels);
+    }
+
+    // UnityAudioOutputPerTrack が有効な場合に、trackId のトラックの音声を data に書き込む。
+    // トラックごとの AudioSource の MonoBehaviour.OnAudioFilterRead から呼ぶこと。
+    // AudioSource の位置に合わせて Unity 側で空間化できる。
+    public void PullTrackAudio(uint trackId, float[] data, int channels)
+    {
+        sora_pull_track_audio(p, trackId, data, data.Length / channels, channels);
+    }
+
+    // OnHandleAudio で受け取ったサンプルを AudioClip などに渡すための float に変換する。
+    // samples はチャンネル数を掛けたサンプル数。
+    public static void ConvertAudioToFloat(short[] src, float[] dst, int samples)
+    {
+        sora_convert_audio_to_float(src, dst, samples);
+    }
+
+    // 渡される配列は使い回しているので、コールバックの外で使う場合はコピーすること
     public Action<short[], int, int> OnHandleAudio
     {
         set
@@ -369,6 +1308,18 @@ public class Sora : IDisposable
     [DllImport("__Internal")]
 #else
     [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_set_on_add_audio_track(IntPtr p, TrackCallbackDelegate on_add_audio_track, IntPtr userdata);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_set_on_remove_audio_track(IntPtr p, TrackCallbackDelegate on_remove_audio_track, IntPtr userdata);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
 #endif
     private static extern void sora_set_on_notify(IntPtr p, NotifyCallbackDelegate on_notify, IntPtr userdata);
 #if UNITY_IOS && !UNITY_EDITOR
@@ -382,7 +1333,37 @@ public class Sora : IDisposable
 #else
     [DllImport("SoraUnitySdk")]
 #endif
-    private static extern int sora_connect(
+    private static extern void sora_set_on_data_channel_message(IntPtr p, DataChannelMessageCallbackDelegate on_message, IntPtr userdata);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_set_on_key_frame_request(IntPtr p, KeyFrameRequestCallbackDelegate on_key_frame_request, IntPtr userdata);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_add_data_channel(IntPtr p, string label, string direction, int ordered, int max_packet_life_time, int max_retransmits);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_send_data_channel_message(IntPtr p, string label, [In] byte[] data, int offset, int size);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_set_thread_config(IntPtr p, int thread_type, int priority, ulong affinity_mask);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_prepare(
         IntPtr p,
         string unity_version,
         string signaling_url,
@@ -390,19 +1371,74 @@ public class Sora : IDisposable
         string metadata,
         string role,
         int multistream,
+        int video,
         int capturer_type,
         IntPtr unity_camera_texture,
+        int unity_camera_readback_latency,
+        int unity_camera_static_content,
+        int unity_camera_static_refresh_ms,
+        int unity_camera_capture_fps,
         string video_capturer_device,
         int video_width,
         int video_height,
+        int video_fps,
         string video_codec,
         int video_bitrate,
         int unity_audio_input,
         int unity_audio_output,
+        int unity_audio_sample_rate,
+        int unity_audio_channels,
+        int unity_audio_output_per_track,
         string audio_recording_device,
         string audio_playout_device,
         string audio_codec,
-        int audio_bitrate);
+        int audio_bitrate,
+        string audio_profile,
+        int audio_opus_dtx,
+        int audio_opus_fec,
+        int audio_opus_ptime,
+        int audio_opus_stereo,
+        int audio_opus_complexity,
+        string video_fec,
+        int audio_red,
+        int stats_interval_ms,
+        int reconnect_max_attempts,
+        int data_channel_signaling,
+        int ignore_disconnect_websocket,
+        int simulcast,
+        string simulcast_rid,
+        int spotlight,
+        int spotlight_number,
+        int adaptive_quality,
+        float adaptive_quality_target_frame_ms,
+        int video_start_bitrate,
+        int video_min_bitrate,
+        int video_max_bitrate,
+        string field_trials,
+        int local_preview,
+        int renderer_convert_threads,
+        int video_encoder_output_delay,
+        int video_encoder_intra_refresh,
+        int video_encoder_threads,
+        string video_scalability_mode,
+        int video_decoder_texture_output,
+        int video_decoder_async_output,
+        int video_playout_delay_min_ms,
+        int video_playout_delay_max_ms,
+        int audio_jitter_buffer_min_delay_ms,
+        int low_latency,
+        int gpu_adapter_index,
+        int shared_engine,
+        string recording_directory,
+        int ice_candidate_pool_size,
+        string ice_transport_policy,
+        int ice_continual_gathering);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_connect(IntPtr p);
 #if UNITY_IOS && !UNITY_EDITOR
     [DllImport("__Internal")]
 #else
@@ -413,6 +1449,174 @@ public class Sora : IDisposable
     [DllImport("__Internal")]
 #else
     [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_set_track_native_textures(uint track_id, IntPtr y_texture, IntPtr uv_texture);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern IntPtr sora_get_native_texture_render_callback();
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_set_track_native_texture(uint track_id, IntPtr texture);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_track_has_new_frame(uint track_id);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_track_set_max_framerate(uint track_id, int max_framerate);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_track_set_paused(uint track_id, int paused);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_set_render_budget(long time_us, long bytes, int max_stale_frames);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern IntPtr sora_get_render_frame_begin_callback();
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_set_log_level(int level);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_track_set_render_priority(uint track_id, int priority);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern uint sora_create_texture_atlas(int columns, int rows);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_destroy_texture_atlas(uint atlas_id);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_texture_atlas_set_track(uint atlas_id, int tile, uint track_id);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_texture_atlas_get_uv_rect(uint atlas_id, int tile, [Out] float[] rect);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_get_track_render_stats(uint track_id, out TrackRenderStats stats);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_get_rtp_stats(IntPtr p, [Out] RtpStats[] stats, int max_count);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_get_rtp_stats_history(IntPtr p, int age, [Out] RtpStats[] stats, int max_count);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_report_frame_time(IntPtr p, float frame_time_ms);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_mark_unity_camera_dirty(IntPtr p);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_push_encoded_frame(IntPtr p, [In] byte[] data, int size, long timestamp_us, int is_key_frame);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_push_encoded_frame(IntPtr p, IntPtr data, int size, long timestamp_us, int is_key_frame);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_get_quality_level(IntPtr p);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_get_stats_implementation_name(int id, [Out] byte[] buf, int size);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_set_perf_counters_enabled(int enabled);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_get_perf_counters([Out] PerfCounter[] counters, int max_count);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_reset_perf_counters();
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_start_perf_trace();
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern int sora_stop_perf_trace(string path);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
 #endif
     private static extern void sora_destroy(IntPtr p);
 #if UNITY_IOS && !UNITY_EDITOR
@@ -443,6 +1647,24 @@ public class Sora : IDisposable
     [DllImport("__Internal")]
 #else
     [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_pull_audio(IntPtr p, [Out] float[] dst, int frames, int channels);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_pull_track_audio(IntPtr p, uint track_id, [Out] float[] dst, int frames, int channels);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
+#endif
+    private static extern void sora_convert_audio_to_float([In] short[] src, [Out] float[] dst, int samples);
+#if UNITY_IOS && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("SoraUnitySdk")]
 #endif
     private static extern void sora_get_stats(IntPtr p, StatsCallbackDelegate on_get_stats, IntPtr userdata);
 #if UNITY_IOS && !UNITY_EDITOR
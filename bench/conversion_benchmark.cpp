@@ -0,0 +1,247 @@
+// SDK の中で毎フレーム行っている画素とサンプルの変換にかかる時間を測るベンチマーク。
+// Unity を使わずに単体で実行できるようにしている。
+//
+// 使い方: SoraUnitySdkConversionBenchmark [計測時間(ミリ秒)]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <functional>
+#include <string>
+#include <vector>
+
+// WebRTC
+#include <api/video/i420_buffer.h>
+#include <api/video/nv12_buffer.h>
+#include <third_party/libyuv/include/libyuv.h>
+
+#include "audio_sample_conversion.h"
+
+namespace {
+
+struct Resolution {
+  const char* name;
+  int width;
+  int height;
+};
+
+const Resolution kResolutions[] = {
+    {"480p", 640, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"4K", 3840, 2160},
+};
+
+int g_duration_ms = 1000;
+
+// f を g_duration_ms の間繰り返して、1 回あたりの時間を出力する。
+// bytes は 1 回の処理で読み書きするバイト数で、GB/s の計算に使う
+void Run(const std::string& name,
+         const std::string& resolution,
+         size_t bytes,
+         const std::function<void()>& f) {
+  // キャッシュやページフォールトの影響を除くために一度空打ちする
+  f();
+
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::milliseconds(g_duration_ms);
+  int64_t count = 0;
+  std::chrono::steady_clock::time_point now;
+  do {
+    f();
+    count++;
+    now = std::chrono::steady_clock::now();
+  } while (now < end);
+
+  double elapsed_ns =
+      std::chrono::duration<double, std::nano>(now - start).count();
+  double ns_per_frame = elapsed_ns / count;
+  double gb_per_sec = bytes / ns_per_frame;
+  printf("%-24s %-6s %12.0f ns/frame %8.2f GB/s %8lld frames\n", name.c_str(),
+         resolution.c_str(), ns_per_frame, gb_per_sec, (long long)count);
+}
+
+void FillRandom(uint8_t* data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (uint8_t)rand();
+  }
+}
+
+rtc::scoped_refptr<webrtc::I420Buffer> CreateRandomI420(int width,
+                                                         int height) {
+  rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+      webrtc::I420Buffer::Create(width, height);
+  FillRandom(buffer->MutableDataY(), buffer->StrideY() * height);
+  FillRandom(buffer->MutableDataU(),
+             buffer->StrideU() * buffer->ChromaHeight());
+  FillRandom(buffer->MutableDataV(),
+             buffer->StrideV() * buffer->ChromaHeight());
+  return buffer;
+}
+
+size_t I420Size(int width, int height) {
+  return (size_t)width * height + 2 * (size_t)((width + 1) / 2) *
+                                      ((height + 1) / 2);
+}
+
+// UnityCameraCapturer: カメラの BGRA を上下反転しながら I420 に変換する
+void BenchARGBToI420(const Resolution& r) {
+  std::vector<uint8_t> argb((size_t)r.width * r.height * 4);
+  FillRandom(argb.data(), argb.size());
+  rtc::scoped_refptr<webrtc::I420Buffer> i420 =
+      webrtc::I420Buffer::Create(r.width, r.height);
+  Run("ARGBToI420 (flip)", r.name, argb.size() + I420Size(r.width, r.height),
+      [&]() {
+        libyuv::ARGBToI420(argb.data(), r.width * 4, i420->MutableDataY(),
+                           i420->StrideY(), i420->MutableDataU(),
+                           i420->StrideU(), i420->MutableDataV(),
+                           i420->StrideV(), r.width, -r.height);
+      });
+}
+
+// UnityRenderer: 受信したフレームを半分に縮小して ABGR に変換する
+void BenchScaleI420ToABGR(const Resolution& r) {
+  rtc::scoped_refptr<webrtc::I420Buffer> src =
+      CreateRandomI420(r.width, r.height);
+  int width = r.width / 2;
+  int height = r.height / 2;
+  rtc::scoped_refptr<webrtc::I420Buffer> scale =
+      webrtc::I420Buffer::Create(width, height);
+  std::vector<uint8_t> abgr((size_t)width * height * 4);
+  Run("ScaleFrom+I420ToABGR", r.name,
+      I420Size(r.width, r.height) + 2 * I420Size(width, height) + abgr.size(),
+      [&]() {
+        scale->ScaleFrom(*src);
+        libyuv::I420ToABGR(scale->DataY(), scale->StrideY(), scale->DataU(),
+                           scale->StrideU(), scale->DataV(), scale->StrideV(),
+                           abgr.data(), width * 4, width, height);
+      });
+}
+
+// UnityRenderer: 縮小せずに ABGR に変換する
+void BenchI420ToABGR(const Resolution& r) {
+  rtc::scoped_refptr<webrtc::I420Buffer> src =
+      CreateRandomI420(r.width, r.height);
+  std::vector<uint8_t> abgr((size_t)r.width * r.height * 4);
+  Run("I420ToABGR", r.name, I420Size(r.width, r.height) + abgr.size(), [&]() {
+    libyuv::I420ToABGR(src->DataY(), src->StrideY(), src->DataU(),
+                       src->StrideU(), src->DataV(), src->StrideV(),
+                       abgr.data(), r.width * 4, r.width, r.height);
+  });
+}
+
+// 以前の NvCodecVideoDecoder: NVDEC の出力の NV12 を I420 に変換する。
+// NV12ToABGR と比較するために残している
+void BenchNV12ToI420(const Resolution& r) {
+  // NVDEC の出力はピッチが 256 バイト単位になる
+  int pitch = (r.width + 255) / 256 * 256;
+  std::vector<uint8_t> nv12((size_t)pitch * r.height * 3 / 2);
+  FillRandom(nv12.data(), nv12.size());
+  rtc::scoped_refptr<webrtc::I420Buffer> i420 =
+      webrtc::I420Buffer::Create(r.width, r.height);
+  Run("NV12ToI420", r.name, 2 * I420Size(r.width, r.height), [&]() {
+    libyuv::NV12ToI420(nv12.data(), pitch, nv12.data() + r.height * pitch,
+                       pitch, i420->MutableDataY(), i420->StrideY(),
+                       i420->MutableDataU(), i420->StrideU(),
+                       i420->MutableDataV(), i420->StrideV(), r.width,
+                       r.height);
+  });
+}
+
+// UnityRenderer: NVDEC から受け取った NV12 を縮小せずに ABGR に変換する
+void BenchNV12ToABGR(const Resolution& r) {
+  rtc::scoped_refptr<webrtc::NV12Buffer> src =
+      webrtc::NV12Buffer::Create(r.width, r.height);
+  FillRandom(src->MutableDataY(), src->StrideY() * r.height);
+  FillRandom(src->MutableDataUV(), src->StrideUV() * src->ChromaHeight());
+  std::vector<uint8_t> abgr((size_t)r.width * r.height * 4);
+  Run("NV12ToABGR", r.name, I420Size(r.width, r.height) + abgr.size(), [&]() {
+    libyuv::NV12ToABGR(src->DataY(), src->StrideY(), src->DataUV(),
+                       src->StrideUV(), abgr.data(), r.width * 4, r.width,
+                       r.height);
+  });
+}
+
+// NvCodecH264Encoder: I420 を NVENC の入力バッファの NV12 に変換する
+void BenchI420ToNV12(const Resolution& r) {
+  rtc::scoped_refptr<webrtc::I420Buffer> src =
+      CreateRandomI420(r.width, r.height);
+  int pitch = (r.width + 255) / 256 * 256;
+  std::vector<uint8_t> nv12((size_t)pitch * r.height * 3 / 2);
+  Run("I420ToNV12", r.name, 2 * I420Size(r.width, r.height), [&]() {
+    libyuv::I420ToNV12(src->DataY(), src->StrideY(), src->DataU(),
+                       src->StrideU(), src->DataV(), src->StrideV(),
+                       nv12.data(), pitch, nv12.data() + r.height * pitch,
+                       pitch, r.width, r.height);
+  });
+}
+
+// 以前の UnityAudioDevice::ProcessAudioData: Unity の float のサンプルを
+// 1 サンプルずつ int16 に変換する。FloatToInt16 と比較するために残している。
+// 48kHz ステレオの 10 ミリ秒分を 1 フレームとする
+void BenchFloatToInt16Scalar() {
+  const int kSamples = 48000 / 100 * 2;
+  std::vector<float> src(kSamples);
+  for (int i = 0; i < kSamples; i++) {
+    src[i] = (float)rand() / RAND_MAX * 2.0f - 1.0f;
+  }
+  std::vector<int16_t> dst;
+  dst.reserve(kSamples);
+  Run("float->int16 (scalar)", "10ms", kSamples * (sizeof(float) + sizeof(int16_t)),
+      [&]() {
+        dst.clear();
+        for (int i = 0; i < kSamples; i++) {
+          dst.push_back((int16_t)(src[i] >= 0 ? src[i] * SHRT_MAX
+                                              : src[i] * -SHRT_MIN));
+        }
+      });
+}
+
+// UnityAudioDevice::ProcessAudioData: Unity の float のサンプルを int16 に変換する
+void BenchFloatToInt16() {
+  const int kSamples = 48000 / 100 * 2;
+  std::vector<float> src(kSamples);
+  for (int i = 0; i < kSamples; i++) {
+    src[i] = (float)rand() / RAND_MAX * 2.0f - 1.0f;
+  }
+  std::vector<int16_t> dst(kSamples);
+  Run("FloatToInt16", "10ms", kSamples * (sizeof(float) + sizeof(int16_t)),
+      [&]() { sora::FloatToInt16(src.data(), dst.data(), kSamples); });
+}
+
+// 受信した int16 のサンプルを Unity の float に変換する
+void BenchInt16ToFloat() {
+  const int kSamples = 48000 / 100 * 2;
+  std::vector<int16_t> src(kSamples);
+  for (int i = 0; i < kSamples; i++) {
+    src[i] = (int16_t)rand();
+  }
+  std::vector<float> dst(kSamples);
+  Run("Int16ToFloat", "10ms", kSamples * (sizeof(float) + sizeof(int16_t)),
+      [&]() { sora::Int16ToFloat(src.data(), dst.data(), kSamples); });
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc >= 2) {
+    g_duration_ms = std::max(atoi(argv[1]), 1);
+  }
+
+  for (const Resolution& r : kResolutions) {
+    BenchARGBToI420(r);
+    BenchScaleI420ToABGR(r);
+    BenchI420ToABGR(r);
+    BenchNV12ToI420(r);
+    BenchNV12ToABGR(r);
+    BenchI420ToNV12(r);
+  }
+  BenchFloatToInt16Scalar();
+  BenchFloatToInt16();
+  BenchInt16ToFloat();
+  return 0;
+}
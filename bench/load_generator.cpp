@@ -0,0 +1,641 @@
+// 1 つのプロセスから Sora に複数のクライアントを接続して、SFU やクライアントの負荷を測るツール。
+// Unity を使わずに、SDK と同じ RTCManager と SoraSignaling で接続する。
+// PeerConnectionFactory とスレッド、ADM、シグナリングの io_context は全クライアントで共有する。
+//
+// 送信側は合成した映像と音声を送り、受信側はデコードだけしてレンダリングはしない。
+//
+// 使い方: SoraUnitySdkLoadGenerator <シグナリング URL> <チャンネル ID> [オプション]
+//   --role sendonly|recvonly  (既定: recvonly)
+//   --clients <数>            (既定: 1)
+//   --duration <秒>           (既定: 30)
+//   --interval <秒>           結果を出力する間隔 (既定: 5)
+//   --video-codec <コーデック> (既定: VP8)
+//   --video-bitrate <kbps>
+//   --resolution <幅>x<高さ>  (既定: 640x480)
+//   --fps <フレームレート>    (既定: 30)
+//   --multistream
+//   --metadata <JSON>
+//   --insecure
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/resource.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+// boost
+#include <boost/asio/post.hpp>
+#include <boost/json.hpp>
+
+// WebRTC
+#include <api/task_queue/default_task_queue_factory.h>
+#include <api/video/i420_buffer.h>
+#include <common_video/include/video_frame_buffer_pool.h>
+#include <modules/audio_device/include/audio_device.h>
+#include <rtc_base/event.h>
+#include <rtc_base/logging.h>
+#include <rtc_base/ref_counted_object.h>
+#include <rtc_base/task_utils/to_queued_task.h>
+#include <rtc_base/thread.h>
+#include <rtc_base/time_utils.h>
+#include <third_party/libyuv/include/libyuv.h>
+
+#include "memory_stats.h"
+#include "rtc/rtc_manager.h"
+#include "rtc/scalable_track_source.h"
+#include "shared_engine.h"
+#include "sora_signaling.h"
+#include "unity_audio_device.h"
+
+namespace {
+
+struct Options {
+  std::string signaling_url;
+  std::string channel_id;
+  bool sendonly = false;
+  int clients = 1;
+  int duration_sec = 30;
+  int interval_sec = 5;
+  std::string video_codec = "VP8";
+  int video_bitrate = 0;
+  int width = 640;
+  int height = 480;
+  int fps = 30;
+  bool multistream = false;
+  std::string metadata;
+  bool insecure = false;
+};
+
+const int kAudioSampleRate = 48000;
+const int kAudioChannels = 2;
+// 1 つのクライアントが持つ RTP ストリームの数の上限
+const int kMaxStreams = 64;
+const double kPi = 3.14159265358979323846;
+
+int64_t GetProcessCpuTimeUs() {
+#if defined(_WIN32)
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel,
+                       &user)) {
+    return 0;
+  }
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  return (int64_t)((k.QuadPart + u.QuadPart) / 10);
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return (int64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec +
+         (int64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+#endif
+}
+
+// プロセスが使っている物理メモリのバイト数
+int64_t GetProcessResidentBytes() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    return 0;
+  }
+  return (int64_t)pmc.WorkingSetSize;
+#elif defined(__APPLE__)
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info,
+                &count) != KERN_SUCCESS) {
+    return 0;
+  }
+  return (int64_t)info.resident_size;
+#else
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (fp == nullptr) {
+    return 0;
+  }
+  long pages = 0;
+  long resident = 0;
+  int n = fscanf(fp, "%ld %ld", &pages, &resident);
+  fclose(fp);
+  if (n != 2) {
+    return 0;
+  }
+  return (int64_t)resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// スレッドを指定した間隔で回す。間隔は前回の予定時刻から数えるので、
+// 処理に時間がかかってもフレームレートがずれない。
+class PeriodicThread {
+ public:
+  PeriodicThread(const char* name, int interval_us, std::function<void()> f)
+      : interval_us_(interval_us), f_(std::move(f)) {
+    thread_ = rtc::Thread::Create();
+    thread_->SetName(name, nullptr);
+    thread_->Start();
+  }
+  ~PeriodicThread() { Stop(); }
+
+  void Start() {
+    running_.store(true);
+    next_us_ = rtc::TimeMicros();
+    thread_->PostTask(webrtc::ToQueuedTask([this]() { Tick(); }));
+  }
+  void Stop() {
+    running_.store(false);
+    thread_->Stop();
+  }
+
+ private:
+  void Tick() {
+    if (!running_.load()) {
+      return;
+    }
+    f_();
+    next_us_ += interval_us_;
+    int64_t delay_ms = (next_us_ - rtc::TimeMicros()) / 1000;
+    thread_->PostDelayedTask(webrtc::ToQueuedTask([this]() { Tick(); }),
+                             (uint32_t)std::max<int64_t>(delay_ms, 0));
+  }
+
+  int interval_us_;
+  std::function<void()> f_;
+  std::unique_ptr<rtc::Thread> thread_;
+  std::atomic<bool> running_{false};
+  int64_t next_us_ = 0;
+};
+
+// 動く模様の I420 を ScalableVideoTrackSource に渡す。
+// 全ての送信クライアントで同じソースを使うので、キャプチャの負荷はクライアント数に比例しない
+class SyntheticVideoCapturer {
+ public:
+  SyntheticVideoCapturer(
+      rtc::scoped_refptr<sora::ScalableVideoTrackSource> source,
+      int width,
+      int height)
+      : source_(source), width_(width), height_(height) {
+    // 行ごとにずらして切り出すと、斜めに流れる模様になる
+    pattern_.resize(width + 256);
+    for (size_t i = 0; i < pattern_.size(); i++) {
+      pattern_[i] = (uint8_t)(16 + (i * 7 % 220));
+    }
+  }
+
+  void Capture() {
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+        pool_.CreateI420Buffer(width_, height_);
+    if (!buffer) {
+      buffer = webrtc::I420Buffer::Create(width_, height_);
+    }
+    for (int y = 0; y < height_; y++) {
+      int offset = (int)((y + frame_ * 4) & 255);
+      memcpy(buffer->MutableDataY() + y * buffer->StrideY(),
+             pattern_.data() + offset, width_);
+    }
+    libyuv::SetPlane(buffer->MutableDataU(), buffer->StrideU(),
+                     buffer->ChromaWidth(), buffer->ChromaHeight(), 128);
+    libyuv::SetPlane(buffer->MutableDataV(), buffer->StrideV(),
+                     buffer->ChromaWidth(), buffer->ChromaHeight(), 128);
+    frame_++;
+
+    source_->OnCapturedFrame(webrtc::VideoFrame::Builder()
+                                 .set_video_frame_buffer(buffer)
+                                 .set_rotation(webrtc::kVideoRotation_0)
+                                 .set_timestamp_us(rtc::TimeMicros())
+                                 .build());
+  }
+
+ private:
+  rtc::scoped_refptr<sora::ScalableVideoTrackSource> source_;
+  int width_;
+  int height_;
+  uint64_t frame_ = 0;
+  std::vector<uint8_t> pattern_;
+  webrtc::VideoFrameBufferPool pool_{false, 8};
+};
+
+// 440Hz の正弦波を Unity のオーディオスレッドの代わりに ADM に渡す
+class SyntheticAudioCapturer {
+ public:
+  explicit SyntheticAudioCapturer(rtc::scoped_refptr<sora::UnityAudioDevice> adm)
+      : adm_(adm), samples_(kAudioSampleRate / 100 * kAudioChannels) {}
+
+  // 10 ミリ秒ごとに呼ぶ
+  void Capture() {
+    const int frames = kAudioSampleRate / 100;
+    for (int i = 0; i < frames; i++) {
+      float v = 0.1f * (float)std::sin(2 * kPi * 440 * (double)(frame_ + i) /
+                                       kAudioSampleRate);
+      for (int c = 0; c < kAudioChannels; c++) {
+        samples_[i * kAudioChannels + c] = v;
+      }
+    }
+    frame_ += frames;
+    adm_->ProcessAudioData(samples_.data(), frames);
+  }
+
+ private:
+  rtc::scoped_refptr<sora::UnityAudioDevice> adm_;
+  std::vector<float> samples_;
+  uint64_t frame_ = 0;
+};
+
+// 受信した映像をデコードさせるだけのシンク。届いたフレームを数える
+class DecodeOnlyReceiver : public VideoTrackReceiver {
+ public:
+  ~DecodeOnlyReceiver() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto& kv : sinks_) {
+      kv.first->RemoveSink(kv.second.get());
+    }
+  }
+
+  void AddTrack(webrtc::VideoTrackInterface* track) override {
+    std::unique_ptr<Sink> sink(new Sink(this));
+    track->AddOrUpdateSink(sink.get(), rtc::VideoSinkWants());
+    std::lock_guard<std::mutex> guard(mutex_);
+    sinks_[track] = std::move(sink);
+  }
+  void RemoveTrack(webrtc::VideoTrackInterface* track) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = sinks_.find(track);
+    if (it == sinks_.end()) {
+      return;
+    }
+    track->RemoveSink(it->second.get());
+    sinks_.erase(it);
+  }
+
+  uint64_t frames() const { return frames_.load(); }
+  int tracks() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return (int)sinks_.size();
+  }
+
+ private:
+  class Sink : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+   public:
+    explicit Sink(DecodeOnlyReceiver* receiver) : receiver_(receiver) {}
+    void OnFrame(const webrtc::VideoFrame& frame) override {
+      receiver_->frames_++;
+    }
+
+   private:
+    DecodeOnlyReceiver* receiver_;
+  };
+
+  std::mutex mutex_;
+  std::map<webrtc::VideoTrackInterface*, std::unique_ptr<Sink>> sinks_;
+  std::atomic<uint64_t> frames_{0};
+};
+
+struct Client {
+  int index;
+  std::unique_ptr<DecodeOnlyReceiver> receiver;
+  std::unique_ptr<sora::RTCManager> manager;
+  std::shared_ptr<sora::SoraSignaling> signaling;
+  uint64_t last_frames = 0;
+};
+
+void PrintUsage() {
+  printf(
+      "usage: SoraUnitySdkLoadGenerator <signaling_url> <channel_id> "
+      "[--role sendonly|recvonly] [--clients N] [--duration SEC] "
+      "[--interval SEC] [--video-codec CODEC] [--video-bitrate KBPS] "
+      "[--resolution WxH] [--fps FPS] [--multistream] [--metadata JSON] "
+      "[--insecure]\n");
+}
+
+bool ParseOptions(int argc, char* argv[], Options* opts) {
+  if (argc < 3) {
+    return false;
+  }
+  opts->signaling_url = argv[1];
+  opts->channel_id = argv[2];
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--multistream") {
+      opts->multistream = true;
+    } else if (arg == "--insecure") {
+      opts->insecure = true;
+    } else if (arg == "--role" && has_value) {
+      std::string role = argv[++i];
+      if (role != "sendonly" && role != "recvonly") {
+        return false;
+      }
+      opts->sendonly = role == "sendonly";
+    } else if (arg == "--clients" && has_value) {
+      opts->clients = std::max(atoi(argv[++i]), 1);
+    } else if (arg == "--duration" && has_value) {
+      opts->duration_sec = std::max(atoi(argv[++i]), 1);
+    } else if (arg == "--interval" && has_value) {
+      opts->interval_sec = std::max(atoi(argv[++i]), 1);
+    } else if (arg == "--video-codec" && has_value) {
+      opts->video_codec = argv[++i];
+      std::transform(opts->video_codec.begin(), opts->video_codec.end(),
+                     opts->video_codec.begin(), ::toupper);
+    } else if (arg == "--video-bitrate" && has_value) {
+      opts->video_bitrate = atoi(argv[++i]);
+    } else if (arg == "--resolution" && has_value) {
+      if (sscanf(argv[++i], "%dx%d", &opts->width, &opts->height) != 2 ||
+          opts->width <= 0 || opts->height <= 0) {
+        return false;
+      }
+    } else if (arg == "--fps" && has_value) {
+      opts->fps = std::max(atoi(argv[++i]), 1);
+    } else if (arg == "--metadata" && has_value) {
+      opts->metadata = argv[++i];
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<sora::SharedEngine> CreateEngine(const Options& opts) {
+  std::unique_ptr<rtc::Thread> worker_thread = rtc::Thread::Create();
+  worker_thread->Start();
+  auto task_queue_factory = webrtc::CreateDefaultTaskQueueFactory();
+
+  // 実際のデバイスは使わず、録音は合成した音声を渡し、再生はデコードだけして捨てる
+  rtc::scoped_refptr<sora::UnityAudioDevice> adm =
+      worker_thread->Invoke<rtc::scoped_refptr<sora::UnityAudioDevice> >(
+          RTC_FROM_HERE, [&] {
+            rtc::scoped_refptr<webrtc::AudioDeviceModule> dummy =
+                webrtc::AudioDeviceModule::Create(
+                    webrtc::AudioDeviceModule::kDummyAudio,
+                    task_queue_factory.get());
+            return sora::UnityAudioDevice::Create(
+                dummy, false, false, [](const int16_t*, int, int) {},
+                kAudioSampleRate, kAudioChannels, false,
+                task_queue_factory.get());
+          });
+
+  sora::RTCManagerConfig config;
+  config.no_recording = !opts.sendonly;
+  config.no_playout = opts.sendonly;
+  config.no_video = !opts.sendonly;
+  config.insecure = opts.insecure;
+  std::shared_ptr<sora::RTCEngine> rtc_engine = sora::RTCEngine::Create(
+      config, adm, std::move(task_queue_factory), rtc::Thread::Create(),
+      std::move(worker_thread));
+  if (rtc_engine == nullptr) {
+    return nullptr;
+  }
+  auto engine = std::make_shared<sora::SharedEngine>(rtc_engine, adm);
+  if (!engine->Start(sora::ThreadConfig())) {
+    return nullptr;
+  }
+  return engine;
+}
+
+bool ConnectClient(const Options& opts,
+                   sora::SharedEngine* engine,
+                   rtc::scoped_refptr<sora::ScalableVideoTrackSource> source,
+                   Client* client) {
+  sora::RTCManagerConfig config;
+  config.no_recording = !opts.sendonly;
+  config.no_playout = opts.sendonly;
+  config.no_video = !opts.sendonly;
+  config.insecure = opts.insecure;
+  config.local_preview = false;
+
+  client->receiver.reset(new DecodeOnlyReceiver());
+  client->manager = sora::RTCManager::Create(
+      config, source, client->receiver.get(), engine->rtc_engine());
+  if (client->manager == nullptr) {
+    return false;
+  }
+
+  sora::SoraSignalingConfig sconfig;
+  sconfig.unity_version = "load-generator";
+  sconfig.signaling_url = opts.signaling_url;
+  sconfig.channel_id = opts.channel_id;
+  sconfig.role = opts.sendonly ? sora::SoraSignalingConfig::Role::Sendonly
+                               : sora::SoraSignalingConfig::Role::Recvonly;
+  sconfig.multistream = opts.multistream;
+  sconfig.video_codec = opts.video_codec;
+  sconfig.video_bitrate = opts.video_bitrate;
+  sconfig.insecure = opts.insecure;
+  if (!opts.metadata.empty()) {
+    boost::json::error_code ec;
+    auto md = boost::json::parse(opts.metadata, ec);
+    if (ec) {
+      printf("invalid metadata: %s\n", opts.metadata.c_str());
+      return false;
+    }
+    sconfig.metadata = md;
+  }
+
+  client->signaling = sora::SoraSignaling::Create(
+      engine->ioc(), client->manager.get(), sconfig, nullptr);
+  if (client->signaling == nullptr) {
+    return false;
+  }
+  return client->signaling->Connect();
+}
+
+void ReleaseClient(sora::SharedEngine* engine, Client* client) {
+  if (client->signaling) {
+    // io_context は動いたままなので、そのスレッドで Release する
+    rtc::Event released;
+    auto signaling = client->signaling;
+    boost::asio::post(engine->ioc(), [signaling, &released]() {
+      signaling->Release();
+      released.Set();
+    });
+    released.Wait(rtc::Event::kForever);
+  }
+  client->signaling.reset();
+  client->manager.reset();
+  client->receiver.reset();
+}
+
+const char* StateName(
+    webrtc::PeerConnectionInterface::IceConnectionState state) {
+  switch (state) {
+    case webrtc::PeerConnectionInterface::kIceConnectionNew:
+      return "new";
+    case webrtc::PeerConnectionInterface::kIceConnectionChecking:
+      return "checking";
+    case webrtc::PeerConnectionInterface::kIceConnectionConnected:
+      return "connected";
+    case webrtc::PeerConnectionInterface::kIceConnectionCompleted:
+      return "completed";
+    case webrtc::PeerConnectionInterface::kIceConnectionFailed:
+      return "failed";
+    case webrtc::PeerConnectionInterface::kIceConnectionDisconnected:
+      return "disconnected";
+    case webrtc::PeerConnectionInterface::kIceConnectionClosed:
+      return "closed";
+    default:
+      return "?";
+  }
+}
+
+// クライアントごとの送受信のビットレートとフレーム数、プロセス全体の CPU とメモリを出力する
+void PrintReport(std::vector<Client>& clients,
+                 double elapsed_sec,
+                 double cpu_percent) {
+  printf("[%.0fs] cpu %.1f%% of one core, rss %.1f MB\n", elapsed_sec,
+         cpu_percent, GetProcessResidentBytes() / 1e6);
+  for (int i = 0; i < (int)sora::MemoryCategory::kCount; i++) {
+    auto usage =
+        sora::MemoryStats::Instance().Get((sora::MemoryCategory)i);
+    if (usage.peak_bytes == 0) {
+      continue;
+    }
+    printf("  memory %-20s %8.2f MB (peak %8.2f MB)\n",
+           sora::GetMemoryCategoryName((sora::MemoryCategory)i),
+           usage.bytes / 1e6, usage.peak_bytes / 1e6);
+  }
+
+  double total_video_kbps = 0;
+  double total_audio_kbps = 0;
+  int connected = 0;
+  sora_rtp_stats_t stats[kMaxStreams];
+  for (auto& client : clients) {
+    auto state = client.signaling->getRTCConnectionState();
+    if (state == webrtc::PeerConnectionInterface::kIceConnectionConnected ||
+        state == webrtc::PeerConnectionInterface::kIceConnectionCompleted) {
+      connected++;
+    }
+
+    int n = std::max(
+        client.signaling->GetStatsSampler()->GetRtpStats(0, stats, kMaxStreams),
+        0);
+    n = std::min(n, kMaxStreams);
+    double video_kbps = 0;
+    double audio_kbps = 0;
+    double video_fps = 0;
+    uint64_t packets_lost = 0;
+    for (int i = 0; i < n; i++) {
+      if (stats[i].kind == 1) {
+        video_kbps += stats[i].bitrate / 1000;
+        video_fps += stats[i].frame_rate;
+      } else {
+        audio_kbps += stats[i].bitrate / 1000;
+      }
+      packets_lost += std::max<int64_t>(stats[i].packets_lost, 0);
+    }
+    total_video_kbps += video_kbps;
+    total_audio_kbps += audio_kbps;
+
+    uint64_t frames = client.receiver->frames();
+    printf("  client %3d %-12s video %8.1f kbps %5.1f fps, audio %6.1f kbps, "
+           "lost %llu, %d tracks delivered %llu frames (+%llu)\n",
+           client.index, StateName(state), video_kbps, video_fps, audio_kbps,
+           (unsigned long long)packets_lost, client.receiver->tracks(),
+           (unsigned long long)frames,
+           (unsigned long long)(frames - client.last_frames));
+    client.last_frames = frames;
+  }
+  printf("  total %d/%d connected, video %.1f kbps, audio %.1f kbps\n",
+         connected, (int)clients.size(), total_video_kbps, total_audio_kbps);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  rtc::LogMessage::LogToDebug(rtc::LS_WARNING);
+
+  Options opts;
+  if (!ParseOptions(argc, argv, &opts)) {
+    PrintUsage();
+    return 2;
+  }
+
+  std::shared_ptr<sora::SharedEngine> engine = CreateEngine(opts);
+  if (engine == nullptr) {
+    printf("failed to create engine\n");
+    return 1;
+  }
+
+  rtc::scoped_refptr<sora::ScalableVideoTrackSource> source;
+  std::unique_ptr<SyntheticVideoCapturer> video_capturer;
+  std::unique_ptr<SyntheticAudioCapturer> audio_capturer;
+  std::unique_ptr<PeriodicThread> video_thread;
+  std::unique_ptr<PeriodicThread> audio_thread;
+  if (opts.sendonly) {
+    source = new rtc::RefCountedObject<sora::ScalableVideoTrackSource>();
+    video_capturer.reset(
+        new SyntheticVideoCapturer(source, opts.width, opts.height));
+    audio_capturer.reset(new SyntheticAudioCapturer(engine->adm()));
+    video_thread.reset(new PeriodicThread("Video Capture", 1000000 / opts.fps,
+                                          [&]() { video_capturer->Capture(); }));
+    audio_thread.reset(new PeriodicThread("Audio Capture", 10000,
+                                          [&]() { audio_capturer->Capture(); }));
+  }
+
+  printf("connecting %d %s clients to %s (channel %s)\n", opts.clients,
+         opts.sendonly ? "sendonly" : "recvonly", opts.signaling_url.c_str(),
+         opts.channel_id.c_str());
+  std::vector<Client> clients(opts.clients);
+  for (int i = 0; i < opts.clients; i++) {
+    clients[i].index = i;
+    if (!ConnectClient(opts, engine.get(), source, &clients[i])) {
+      printf("client %d: failed to connect\n", i);
+      for (int j = 0; j <= i; j++) {
+        ReleaseClient(engine.get(), &clients[j]);
+      }
+      return 1;
+    }
+  }
+
+  if (video_thread) {
+    video_thread->Start();
+    audio_thread->Start();
+  }
+
+  int64_t start_us = rtc::TimeMicros();
+  int64_t end_us = start_us + (int64_t)opts.duration_sec * 1000000;
+  int64_t last_report_us = start_us;
+  int64_t last_cpu_us = GetProcessCpuTimeUs();
+  while (rtc::TimeMicros() < end_us) {
+    rtc::Thread::SleepMs(100);
+    int64_t now_us = rtc::TimeMicros();
+    if (now_us - last_report_us < (int64_t)opts.interval_sec * 1000000 &&
+        now_us < end_us) {
+      continue;
+    }
+    int64_t cpu_us = GetProcessCpuTimeUs();
+    PrintReport(clients, (now_us - start_us) / 1e6,
+                (cpu_us - last_cpu_us) * 100.0 / (now_us - last_report_us));
+    last_report_us = now_us;
+    last_cpu_us = cpu_us;
+  }
+
+  if (video_thread) {
+    video_thread->Stop();
+    audio_thread->Stop();
+  }
+  for (auto& client : clients) {
+    ReleaseClient(engine.get(), &client);
+  }
+  return 0;
+}
@@ -0,0 +1,853 @@
+// 送信側と受信側の RTCManager をプロセス内で作ってループバックで接続し、
+// キャプチャ → エンコード → 送受信 → デコード → UnityRenderer までを通して計測するベンチマーク。
+// シグナリングサーバや Unity を使わずに実行できるようにしている。
+//
+// 使い方: SoraUnitySdkLoopbackBenchmark [計測時間(秒)] [コーデック...]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/resource.h>
+#endif
+
+// WebRTC
+#include <api/stats/rtcstats_objects.h>
+#include <api/task_queue/default_task_queue_factory.h>
+#include <api/video/i420_buffer.h>
+#include <modules/audio_device/include/audio_device.h>
+#include <rtc_base/event.h>
+#include <rtc_base/logging.h>
+#include <rtc_base/ref_counted_object.h>
+#include <rtc_base/task_utils/to_queued_task.h>
+#include <rtc_base/thread.h>
+#include <rtc_base/time_utils.h>
+#include <third_party/libyuv/include/libyuv.h>
+
+#include "rtc/rtc_manager.h"
+#include "rtc/scalable_track_source.h"
+#include "unity_renderer.h"
+
+namespace {
+
+struct Resolution {
+  const char* name;
+  int width;
+  int height;
+};
+
+const Resolution kResolutions[] = {
+    {"480p", 640, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+};
+
+const int kFramerate = 30;
+// Unity のレンダリングループの間隔
+const int kRenderIntervalMs = 16;
+// 帯域推定が上がりきるまでは計測しない
+const int kWarmupMs = 3000;
+// 計測終了後、送信済みのフレームが届くのを待つ時間
+const int kDrainMs = 1000;
+const int kConnectTimeoutMs = 10000;
+
+int g_duration_sec = 10;
+
+// 現在のスレッドと、プロセス全体で使った CPU 時間（マイクロ秒）
+int64_t GetThreadCpuTimeUs() {
+#if defined(_WIN32)
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  return (int64_t)((k.QuadPart + u.QuadPart) / 10);
+#elif defined(__APPLE__)
+  mach_port_t thread = mach_thread_self();
+  thread_basic_info_data_t info;
+  mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+  kern_return_t r =
+      thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+  mach_port_deallocate(mach_task_self(), thread);
+  if (r != KERN_SUCCESS) {
+    return 0;
+  }
+  return (int64_t)info.user_time.seconds * 1000000 +
+         info.user_time.microseconds +
+         (int64_t)info.system_time.seconds * 1000000 +
+         info.system_time.microseconds;
+#else
+  return 0;
+#endif
+}
+
+int64_t GetProcessCpuTimeUs() {
+#if defined(_WIN32)
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel,
+                       &user)) {
+    return 0;
+  }
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  return (int64_t)((k.QuadPart + u.QuadPart) / 10);
+#elif defined(__APPLE__)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return (int64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec +
+         (int64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+#else
+  return 0;
+#endif
+}
+
+// フレーム番号を映像の上端にブロックとして書き込み、受信側で読み取って遅延を測る。
+// ブロックのサイズは幅に比例させているので、途中で縮小されても読み取れる。
+// 読み間違いを防ぐために、番号とそのビット反転を並べて書いておく。
+const int kIdBits = 16;
+const int kIdBlocks = kIdBits * 2;
+
+int IdBlockSize(int width) {
+  return width / kIdBlocks;
+}
+
+void WriteFrameId(webrtc::I420Buffer* buffer, uint16_t id) {
+  int bs = IdBlockSize(buffer->width());
+  uint32_t bits = id | ((uint32_t)(uint16_t)~id << kIdBits);
+  for (int i = 0; i < kIdBlocks; i++) {
+    uint8_t y = (bits >> i) & 1 ? 235 : 16;
+    for (int dy = 0; dy < bs; dy++) {
+      memset(buffer->MutableDataY() + dy * buffer->StrideY() + i * bs, y, bs);
+    }
+  }
+  // ブロックの部分は無彩色にする
+  for (int dy = 0; dy < (bs + 1) / 2; dy++) {
+    memset(buffer->MutableDataU() + dy * buffer->StrideU(), 128,
+           kIdBlocks * bs / 2);
+    memset(buffer->MutableDataV() + dy * buffer->StrideV(), 128,
+           kIdBlocks * bs / 2);
+  }
+}
+
+// data の (x, y) の明るさを stride と pixel_bytes から読んでフレーム番号を取り出す
+bool ReadFrameId(const uint8_t* data,
+                 int stride,
+                 int pixel_bytes,
+                 int width,
+                 uint16_t* id) {
+  int bs = IdBlockSize(width);
+  if (bs < 2) {
+    return false;
+  }
+  uint32_t bits = 0;
+  for (int i = 0; i < kIdBlocks; i++) {
+    int x = i * bs + bs / 2;
+    int y = bs / 2;
+    if (data[y * stride + x * pixel_bytes] >= 128) {
+      bits |= 1u << i;
+    }
+  }
+  uint16_t value = (uint16_t)bits;
+  uint16_t inverted = (uint16_t)(bits >> kIdBits);
+  if ((uint16_t)~value != inverted) {
+    return false;
+  }
+  *id = value;
+  return true;
+}
+
+// フレーム番号ごとのキャプチャ時刻と、受信側で観測した遅延の集計
+class FrameTracker {
+ public:
+  void Reset() {
+    for (auto& t : capture_us_) {
+      t.store(0);
+    }
+    std::lock_guard<std::mutex> guard(mutex_);
+    decoded_.clear();
+    rendered_.clear();
+    measure_start_us_ = INT64_MAX;
+    measure_end_us_ = INT64_MAX;
+    captured_ = 0;
+    undecodable_ = 0;
+  }
+
+  void StartMeasure(int64_t now_us) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    measure_start_us_ = now_us;
+  }
+  void StopMeasure(int64_t now_us) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    measure_end_us_ = now_us;
+  }
+
+  void OnCaptured(uint16_t id, int64_t now_us) {
+    capture_us_[id].store(now_us);
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (InMeasure(now_us)) {
+      captured_++;
+    }
+  }
+  void OnDecoded(uint16_t id, int64_t now_us) {
+    Add(id, now_us, &decoded_);
+  }
+  void OnRendered(uint16_t id, int64_t now_us) {
+    Add(id, now_us, &rendered_);
+  }
+  void OnUndecodable() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    undecodable_++;
+  }
+
+  void Print() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    double sec = (measure_end_us_ - measure_start_us_) / 1e6;
+    printf("  captured %lld (%.1f fps), decoded %zu (%.1f fps), rendered %zu "
+           "(%.1f fps), dropped %lld, unreadable %lld\n",
+           (long long)captured_, captured_ / sec, decoded_.size(),
+           decoded_.size() / sec, rendered_.size(), rendered_.size() / sec,
+           (long long)(captured_ - (int64_t)decoded_.size()),
+           (long long)undecodable_);
+    PrintLatency("capture->decode", &decoded_);
+    PrintLatency("capture->render", &rendered_);
+  }
+
+ private:
+  bool InMeasure(int64_t capture_us) const {
+    return capture_us >= measure_start_us_ && capture_us < measure_end_us_;
+  }
+
+  void Add(uint16_t id, int64_t now_us, std::vector<int64_t>* samples) {
+    int64_t capture_us = capture_us_[id].load();
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (capture_us == 0 || !InMeasure(capture_us)) {
+      return;
+    }
+    samples->push_back(now_us - capture_us);
+  }
+
+  static void PrintLatency(const char* name, std::vector<int64_t>* samples) {
+    if (samples->empty()) {
+      printf("  %-16s no samples\n", name);
+      return;
+    }
+    std::sort(samples->begin(), samples->end());
+    auto percentile = [samples](double p) {
+      size_t i = (size_t)(p * (samples->size() - 1));
+      return (*samples)[i] / 1000.0;
+    };
+    printf("  %-16s p50 %7.2f ms  p90 %7.2f ms  p99 %7.2f ms  max %7.2f ms\n",
+           name, percentile(0.5), percentile(0.9), percentile(0.99),
+           samples->back() / 1000.0);
+  }
+
+  std::array<std::atomic<int64_t>, 65536> capture_us_;
+  std::mutex mutex_;
+  std::vector<int64_t> decoded_;
+  std::vector<int64_t> rendered_;
+  int64_t measure_start_us_ = INT64_MAX;
+  int64_t measure_end_us_ = INT64_MAX;
+  int64_t captured_ = 0;
+  int64_t undecodable_ = 0;
+};
+
+FrameTracker g_tracker;
+
+// スレッドを指定した間隔で回す。間隔は前回の予定時刻から数えるので、
+// 処理に時間がかかってもフレームレートがずれない。
+class PeriodicThread {
+ public:
+  PeriodicThread(const char* name, int interval_us, std::function<void()> f)
+      : interval_us_(interval_us), f_(std::move(f)) {
+    thread_ = rtc::Thread::Create();
+    thread_->SetName(name, nullptr);
+    thread_->Start();
+  }
+  ~PeriodicThread() { Stop(); }
+
+  void Start() {
+    running_.store(true);
+    next_us_ = rtc::TimeMicros();
+    thread_->PostTask(webrtc::ToQueuedTask([this]() { Tick(); }));
+  }
+  void Stop() {
+    running_.store(false);
+    thread_->Stop();
+  }
+  rtc::Thread* thread() { return thread_.get(); }
+
+ private:
+  void Tick() {
+    if (!running_.load()) {
+      return;
+    }
+    f_();
+    next_us_ += interval_us_;
+    int64_t delay_ms = (next_us_ - rtc::TimeMicros()) / 1000;
+    thread_->PostDelayedTask(webrtc::ToQueuedTask([this]() { Tick(); }),
+                             (uint32_t)std::max<int64_t>(delay_ms, 0));
+  }
+
+  int interval_us_;
+  std::function<void()> f_;
+  std::unique_ptr<rtc::Thread> thread_;
+  std::atomic<bool> running_{false};
+  int64_t next_us_ = 0;
+};
+
+// 動く模様とフレーム番号を書き込んだ I420 を ScalableVideoTrackSource に渡す
+class SyntheticCapturer {
+ public:
+  SyntheticCapturer(rtc::scoped_refptr<sora::ScalableVideoTrackSource> source,
+                    int width,
+                    int height)
+      : source_(source), width_(width), height_(height) {
+    // 行ごとにずらして切り出すと、斜めに流れる模様になる
+    pattern_.resize(width + 256);
+    for (size_t i = 0; i < pattern_.size(); i++) {
+      pattern_[i] = (uint8_t)(16 + (i * 7 % 220));
+    }
+  }
+
+  void Capture() {
+    rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+        pool_.CreateI420Buffer(width_, height_);
+    if (!buffer) {
+      buffer = webrtc::I420Buffer::Create(width_, height_);
+    }
+    for (int y = 0; y < height_; y++) {
+      int offset = (int)((y + frame_ * 4) & 255);
+      memcpy(buffer->MutableDataY() + y * buffer->StrideY(),
+             pattern_.data() + offset, width_);
+    }
+    libyuv::SetPlane(buffer->MutableDataU(), buffer->StrideU(),
+                     buffer->ChromaWidth(), buffer->ChromaHeight(), 128);
+    libyuv::SetPlane(buffer->MutableDataV(), buffer->StrideV(),
+                     buffer->ChromaWidth(), buffer->ChromaHeight(), 128);
+
+    uint16_t id = (uint16_t)frame_++;
+    WriteFrameId(buffer.get(), id);
+
+    int64_t now_us = rtc::TimeMicros();
+    g_tracker.OnCaptured(id, now_us);
+    source_->OnCapturedFrame(webrtc::VideoFrame::Builder()
+                                 .set_video_frame_buffer(buffer)
+                                 .set_rotation(webrtc::kVideoRotation_0)
+                                 .set_timestamp_us(now_us)
+                                 .build());
+  }
+
+ private:
+  rtc::scoped_refptr<sora::ScalableVideoTrackSource> source_;
+  int width_;
+  int height_;
+  uint64_t frame_ = 0;
+  std::vector<uint8_t> pattern_;
+  webrtc::VideoFrameBufferPool pool_{false, 8};
+};
+
+// デコード直後のフレームから番号を読み取る
+class DecodeSink : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+ public:
+  void OnFrame(const webrtc::VideoFrame& frame) override {
+    int64_t now_us = rtc::TimeMicros();
+    rtc::scoped_refptr<webrtc::I420BufferInterface> i420 =
+        frame.video_frame_buffer()->ToI420();
+    uint16_t id;
+    if (!ReadFrameId(i420->DataY(), i420->StrideY(), 1, i420->width(), &id)) {
+      g_tracker.OnUndecodable();
+      return;
+    }
+    g_tracker.OnDecoded(id, now_us);
+  }
+};
+
+// 受信したトラックを UnityRenderer と DecodeSink の両方に繋ぐ
+class BenchReceiver : public VideoTrackReceiver {
+ public:
+  BenchReceiver()
+      : renderer_([this](ptrid_t id) { track_id_.store(id); },
+                  [this](ptrid_t id) { track_id_.store(0); }) {}
+
+  void AddTrack(webrtc::VideoTrackInterface* track) override {
+    renderer_.AddTrack(track);
+    track->AddOrUpdateSink(&decode_sink_, rtc::VideoSinkWants());
+  }
+  void RemoveTrack(webrtc::VideoTrackInterface* track) override {
+    track->RemoveSink(&decode_sink_);
+    renderer_.RemoveTrack(track);
+  }
+
+  sora::UnityRenderer* renderer() { return &renderer_; }
+  ptrid_t track_id() const { return track_id_.load(); }
+
+  // Unity のレンダリングスレッドの代わりに TextureUpdateCallback を呼び、
+  // テクスチャに転送される ABGR から番号を読み取る
+  void Render() {
+    ptrid_t track_id = track_id_.load();
+    if (track_id == 0) {
+      return;
+    }
+    sora_track_render_stats_t stats;
+    if (!sora::UnityRenderer::Sink::GetRenderStats(track_id, &stats) ||
+        stats.last_frame_width == 0) {
+      return;
+    }
+    UnityRenderingExtTextureUpdateParamsV2 params = {};
+    params.textureID = 1;
+    params.userData = (unsigned int)track_id;
+    params.format = kUnityRenderingExtFormatR8G8B8A8_UNorm;
+    params.width = stats.last_frame_width;
+    params.height = stats.last_frame_height;
+    params.bpp = 4;
+    sora::UnityRenderer::Sink::TextureUpdateCallback(
+        kUnityRenderingExtEventUpdateTextureBeginV2, &params);
+    if (params.texData != nullptr) {
+      int64_t now_us = rtc::TimeMicros();
+      uint16_t id;
+      if (ReadFrameId((const uint8_t*)params.texData, params.width * 4, 4,
+                      params.width, &id)) {
+        g_tracker.OnRendered(id, now_us);
+      }
+    }
+    sora::UnityRenderer::Sink::TextureUpdateCallback(
+        kUnityRenderingExtEventUpdateTextureEndV2, &params);
+  }
+
+ private:
+  DecodeSink decode_sink_;
+  std::atomic<ptrid_t> track_id_{0};
+  sora::UnityRenderer renderer_;
+};
+
+// 相手の RTCConnection に ICE candidate を直接渡す。
+// 相手の RemoteDescription が設定されるまでは溜めておく。
+class LoopbackSender : public sora::RTCMessageSender {
+ public:
+  void SetPeer(sora::RTCConnection* peer) { peer_ = peer; }
+
+  void SetPeerReady() {
+    std::vector<Candidate> candidates;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      ready_ = true;
+      candidates = std::move(pending_);
+    }
+    for (const auto& c : candidates) {
+      peer_->AddIceCandidate(c.sdp_mid, c.sdp_mlineindex, c.sdp);
+    }
+  }
+
+  bool WaitConnected(int timeout_ms) {
+    return connected_.Wait(timeout_ms);
+  }
+
+  void OnIceConnectionStateChange(
+      webrtc::PeerConnectionInterface::IceConnectionState new_state) override {
+    if (new_state == webrtc::PeerConnectionInterface::kIceConnectionConnected ||
+        new_state == webrtc::PeerConnectionInterface::kIceConnectionCompleted) {
+      connected_.Set();
+    }
+  }
+  void OnIceCandidate(const std::string sdp_mid,
+                      const int sdp_mlineindex,
+                      const std::string sdp) override {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (!ready_) {
+        pending_.push_back(Candidate{sdp_mid, sdp_mlineindex, sdp});
+        return;
+      }
+    }
+    peer_->AddIceCandidate(sdp_mid, sdp_mlineindex, sdp);
+  }
+
+ private:
+  struct Candidate {
+    std::string sdp_mid;
+    int sdp_mlineindex;
+    std::string sdp;
+  };
+  sora::RTCConnection* peer_ = nullptr;
+  std::mutex mutex_;
+  bool ready_ = false;
+  std::vector<Candidate> pending_;
+  rtc::Event connected_;
+};
+
+// m=video の中で codec のペイロードタイプを先頭に並べ替える。
+// Answer 側は Offer の順番でコーデックを選ぶので、これで使うコーデックが決まる。
+std::string PreferCodec(const std::string& sdp, const std::string& codec) {
+  std::vector<std::string> lines;
+  {
+    std::istringstream is(sdp);
+    std::string line;
+    while (std::getline(is, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      lines.push_back(line);
+    }
+  }
+
+  int mline = -1;
+  std::vector<std::string> preferred;
+  for (int i = 0; i < (int)lines.size(); i++) {
+    const std::string& line = lines[i];
+    if (line.compare(0, 2, "m=") == 0) {
+      if (mline >= 0) {
+        break;
+      }
+      if (line.compare(0, 8, "m=video ") == 0) {
+        mline = i;
+      }
+      continue;
+    }
+    if (mline < 0 || line.compare(0, 9, "a=rtpmap:") != 0) {
+      continue;
+    }
+    size_t sp = line.find(' ');
+    size_t slash = line.find('/');
+    if (sp == std::string::npos || slash == std::string::npos) {
+      continue;
+    }
+    std::string name = line.substr(sp + 1, slash - sp - 1);
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (name == codec) {
+      preferred.push_back(line.substr(9, sp - 9));
+    }
+  }
+  if (mline < 0 || preferred.empty()) {
+    return sdp;
+  }
+
+  // m=video <port> <proto> <pt>...
+  std::istringstream is(lines[mline]);
+  std::vector<std::string> fields;
+  std::string field;
+  while (is >> field) {
+    fields.push_back(field);
+  }
+  std::string result = fields[0] + " " + fields[1] + " " + fields[2];
+  for (const auto& pt : preferred) {
+    result += " " + pt;
+  }
+  for (size_t i = 3; i < fields.size(); i++) {
+    if (std::find(preferred.begin(), preferred.end(), fields[i]) ==
+        preferred.end()) {
+      result += " " + fields[i];
+    }
+  }
+  lines[mline] = result;
+
+  std::string out;
+  for (const auto& line : lines) {
+    out += line + "\r\n";
+  }
+  return out;
+}
+
+// signaling_thread, worker_thread には CPU 時間を測るためのスレッドを返す。
+// スレッドは RTCManager が所有している。
+std::unique_ptr<sora::RTCManager> CreateManager(
+    rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> source,
+    VideoTrackReceiver* receiver,
+    rtc::Thread** signaling_thread_out,
+    rtc::Thread** worker_thread_out) {
+  std::unique_ptr<rtc::Thread> worker_thread = rtc::Thread::Create();
+  worker_thread->Start();
+  std::unique_ptr<rtc::Thread> signaling_thread = rtc::Thread::Create();
+
+  auto task_queue_factory = webrtc::CreateDefaultTaskQueueFactory();
+  // 音声は計測しないのでダミーのデバイスを使う
+  rtc::scoped_refptr<webrtc::AudioDeviceModule> adm =
+      worker_thread->Invoke<rtc::scoped_refptr<webrtc::AudioDeviceModule> >(
+          RTC_FROM_HERE, [&] {
+            return webrtc::AudioDeviceModule::Create(
+                webrtc::AudioDeviceModule::kDummyAudio,
+                task_queue_factory.get());
+          });
+
+  sora::RTCManagerConfig config;
+  config.no_recording = true;
+  config.no_playout = true;
+  config.no_video = source == nullptr;
+  // 解像度ごとに比較したいので、負荷が高い時は解像度ではなくフレームレートを落とす
+  config.priority = webrtc::DegradationPreference::MAINTAIN_RESOLUTION;
+
+  *signaling_thread_out = signaling_thread.get();
+  *worker_thread_out = worker_thread.get();
+  return sora::RTCManager::Create(
+      config, source, receiver, adm, std::move(task_queue_factory),
+      std::move(signaling_thread), std::move(worker_thread));
+}
+
+struct NamedThread {
+  const char* name;
+  rtc::Thread* thread;
+  int64_t start_cpu_us;
+};
+
+int64_t ThreadCpuTimeUs(rtc::Thread* thread) {
+  return thread->Invoke<int64_t>(RTC_FROM_HERE, &GetThreadCpuTimeUs);
+}
+
+void PrintStats(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& send,
+                const rtc::scoped_refptr<const webrtc::RTCStatsReport>& recv) {
+  for (const auto* s :
+       send->GetStatsOfType<webrtc::RTCOutboundRTPStreamStats>()) {
+    if (!s->kind.is_defined() || *s->kind != "video") {
+      continue;
+    }
+    std::string codec = "?";
+    if (s->codec_id.is_defined()) {
+      const webrtc::RTCStats* c = send->Get(*s->codec_id);
+      if (c != nullptr) {
+        const auto& cs = c->cast_to<webrtc::RTCCodecStats>();
+        if (cs.mime_type.is_defined()) {
+          codec = *cs.mime_type;
+        }
+      }
+    }
+    std::string impl = s->encoder_implementation.is_defined()
+                           ? *s->encoder_implementation
+                           : "?";
+    uint32_t frames = s->frames_encoded.is_defined() ? *s->frames_encoded : 0;
+    double encode_ms = s->total_encode_time.is_defined() && frames > 0
+                           ? *s->total_encode_time * 1000 / frames
+                           : 0;
+    printf("  encoder %s (%s): %u frames, %.2f ms/frame", codec.c_str(),
+           impl.c_str(), frames, encode_ms);
+    if (s->frame_width.is_defined() && s->frame_height.is_defined()) {
+      printf(", %ux%u", *s->frame_width, *s->frame_height);
+    }
+    printf("\n");
+  }
+  for (const auto* s :
+       recv->GetStatsOfType<webrtc::RTCInboundRTPStreamStats>()) {
+    if (!s->kind.is_defined() || *s->kind != "video") {
+      continue;
+    }
+    uint32_t frames = s->frames_decoded.is_defined() ? *s->frames_decoded : 0;
+    double decode_ms = s->total_decode_time.is_defined() && frames > 0
+                           ? *s->total_decode_time * 1000 / frames
+                           : 0;
+    printf("  decoder: %u frames, %.2f ms/frame\n", frames, decode_ms);
+  }
+}
+
+rtc::scoped_refptr<const webrtc::RTCStatsReport> GetStats(
+    sora::RTCConnection* conn) {
+  rtc::scoped_refptr<const webrtc::RTCStatsReport> result;
+  rtc::Event event;
+  conn->GetStats(
+      [&](const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
+        result = report;
+        event.Set();
+      });
+  event.Wait(kConnectTimeoutMs);
+  return result;
+}
+
+bool RunOne(const std::string& codec, const Resolution& r) {
+  printf("%s %s (%dx%d@%d)\n", codec.c_str(), r.name, r.width, r.height,
+         kFramerate);
+  g_tracker.Reset();
+
+  rtc::scoped_refptr<sora::ScalableVideoTrackSource> source =
+      new rtc::RefCountedObject<sora::ScalableVideoTrackSource>();
+  BenchReceiver receiver;
+
+  rtc::Thread* send_signaling;
+  rtc::Thread* send_worker;
+  rtc::Thread* recv_signaling;
+  rtc::Thread* recv_worker;
+  auto send_manager =
+      CreateManager(source, nullptr, &send_signaling, &send_worker);
+  auto recv_manager =
+      CreateManager(nullptr, &receiver, &recv_signaling, &recv_worker);
+  if (!send_manager || !recv_manager) {
+    printf("  failed to create RTCManager\n");
+    return false;
+  }
+
+  LoopbackSender send_sender;
+  LoopbackSender recv_sender;
+  webrtc::PeerConnectionInterface::RTCConfiguration rtc_config;
+  std::shared_ptr<sora::RTCConnection> send_conn =
+      send_manager->createConnection(rtc_config, &send_sender);
+  std::shared_ptr<sora::RTCConnection> recv_conn =
+      recv_manager->createConnection(rtc_config, &recv_sender);
+  if (!send_conn || !recv_conn) {
+    printf("  failed to create RTCConnection\n");
+    return false;
+  }
+  send_sender.SetPeer(recv_conn.get());
+  recv_sender.SetPeer(send_conn.get());
+
+  // Offer/Answer を交換する
+  rtc::Event event;
+  std::string offer;
+  send_conn->CreateOffer([&](webrtc::SessionDescriptionInterface* desc) {
+    desc->ToString(&offer);
+    event.Set();
+  });
+  if (!event.Wait(kConnectTimeoutMs)) {
+    printf("  CreateOffer timed out\n");
+    return false;
+  }
+  recv_conn->SetOffer(PreferCodec(offer, codec), [&]() { event.Set(); });
+  if (!event.Wait(kConnectTimeoutMs)) {
+    printf("  SetOffer timed out\n");
+    return false;
+  }
+  send_sender.SetPeerReady();
+  std::string answer;
+  recv_conn->CreateAnswer([&](webrtc::SessionDescriptionInterface* desc) {
+    desc->ToString(&answer);
+    event.Set();
+  });
+  if (!event.Wait(kConnectTimeoutMs)) {
+    printf("  CreateAnswer timed out\n");
+    return false;
+  }
+  send_conn->SetAnswer(answer, [&]() { event.Set(); });
+  if (!event.Wait(kConnectTimeoutMs)) {
+    printf("  SetAnswer timed out\n");
+    return false;
+  }
+  recv_sender.SetPeerReady();
+  if (!send_sender.WaitConnected(kConnectTimeoutMs)) {
+    printf("  ICE connection timed out\n");
+    return false;
+  }
+
+  SyntheticCapturer capturer(source, r.width, r.height);
+  PeriodicThread capture_thread("Capture", 1000000 / kFramerate,
+                                [&]() { capturer.Capture(); });
+  PeriodicThread render_thread("Render", kRenderIntervalMs * 1000,
+                               [&]() { receiver.Render(); });
+  capture_thread.Start();
+  render_thread.Start();
+
+  // ウォームアップ中もテクスチャサイズを VideoSinkWants に反映しておく
+  int64_t warmup_end_us = rtc::TimeMicros() + kWarmupMs * 1000;
+  while (rtc::TimeMicros() < warmup_end_us) {
+    receiver.renderer()->ApplySinkWants();
+    rtc::Thread::SleepMs(100);
+  }
+
+  std::vector<NamedThread> threads = {
+      {"capture", capture_thread.thread(), 0},
+      {"render", render_thread.thread(), 0},
+      {"send signaling", send_signaling, 0},
+      {"send worker", send_worker, 0},
+      {"recv signaling", recv_signaling, 0},
+      {"recv worker", recv_worker, 0},
+  };
+  for (auto& t : threads) {
+    t.start_cpu_us = ThreadCpuTimeUs(t.thread);
+  }
+  int64_t process_start_cpu_us = GetProcessCpuTimeUs();
+  int64_t start_us = rtc::TimeMicros();
+  g_tracker.StartMeasure(start_us);
+
+  int64_t end_us = start_us + (int64_t)g_duration_sec * 1000000;
+  while (rtc::TimeMicros() < end_us) {
+    receiver.renderer()->ApplySinkWants();
+    rtc::Thread::SleepMs(100);
+  }
+  int64_t stop_us = rtc::TimeMicros();
+  g_tracker.StopMeasure(stop_us);
+  int64_t process_cpu_us = GetProcessCpuTimeUs() - process_start_cpu_us;
+  std::vector<int64_t> thread_cpu_us;
+  for (auto& t : threads) {
+    thread_cpu_us.push_back(ThreadCpuTimeUs(t.thread) - t.start_cpu_us);
+  }
+
+  // 計測中にキャプチャしたフレームが届くのを待ってから止める
+  rtc::Thread::SleepMs(kDrainMs);
+  capture_thread.Stop();
+  render_thread.Stop();
+
+  g_tracker.Print();
+  // エンコーダやデコーダ、ネットワークのスレッドは WebRTC の中で作られるので other に含まれる
+  double wall_us = (double)(stop_us - start_us);
+  int64_t known_cpu_us = 0;
+  printf("  cpu (%% of one core):");
+  for (size_t i = 0; i < threads.size(); i++) {
+    known_cpu_us += thread_cpu_us[i];
+    printf(" %s %.1f,", threads[i].name, thread_cpu_us[i] * 100 / wall_us);
+  }
+  printf(" other %.1f, process %.1f\n",
+         (process_cpu_us - known_cpu_us) * 100 / wall_us,
+         process_cpu_us * 100 / wall_us);
+
+  rtc::scoped_refptr<const webrtc::RTCStatsReport> send_stats =
+      GetStats(send_conn.get());
+  rtc::scoped_refptr<const webrtc::RTCStatsReport> recv_stats =
+      GetStats(recv_conn.get());
+  if (send_stats && recv_stats) {
+    PrintStats(send_stats, recv_stats);
+  }
+
+  // RTCConnection を破棄すると受信トラックが BenchReceiver から外れる
+  send_conn = nullptr;
+  recv_conn = nullptr;
+  send_manager = nullptr;
+  recv_manager = nullptr;
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  rtc::LogMessage::LogToDebug(rtc::LS_WARNING);
+
+  if (argc >= 2) {
+    g_duration_sec = std::max(atoi(argv[1]), 1);
+  }
+  std::vector<std::string> codecs;
+  for (int i = 2; i < argc; i++) {
+    std::string codec = argv[i];
+    std::transform(codec.begin(), codec.end(), codec.begin(), ::toupper);
+    codecs.push_back(codec);
+  }
+  if (codecs.empty()) {
+    codecs = {"VP8", "VP9", "H264"};
+  }
+
+  int failed = 0;
+  for (const auto& codec : codecs) {
+    for (const Resolution& r : kResolutions) {
+      if (!RunOne(codec, r)) {
+        failed++;
+      }
+    }
+  }
+  return failed == 0 ? 0 : 1;
+}
@@ -6,6 +6,7 @@ _PACKAGES=" \
   macos \
   android \
   ios \
+  ubuntu \
 "
 
 set -e
@@ -74,6 +75,11 @@ CMAKE_COMMON_ARGS=" \
     -DANDROID_TOOLCHAIN_FILE="$INSTALL_DIR/android-ndk/build/cmake/android.toolchain.cmake" \
 "
 
+if [ "$PACKAGE" = "ubuntu" ]; then
+  # WebRTC に合わせて clang と WebRTC の libc++ でビルドする
+  CMAKE_ARGS="$CMAKE_ARGS -DCMAKE_C_COMPILER=clang -DCMAKE_CXX_COMPILER=clang++"
+fi
+
 if [ "$PACKAGE" = "ios" ]; then
   mkdir -p _build/sora-unity-sdk/$PACKAGE
   pushd _build/sora-unity-sdk/$PACKAGE
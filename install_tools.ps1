@@ -126,3 +126,77 @@ if ($CUDA_CHANGED -Or !(Test-Path "$INSTALL_DIR\cuda\nvcc")) {
   Pop-Location
 }
 Set-Content "$CUDA_VERSION_FILE" -Value "$CUDA_VERSION"
+
+# oneVPL
+# Intel の QSV を使うためのディスパッチャ。実際のランタイムはドライバに入っている
+
+$ONEVPL_VERSION_FILE = "$INSTALL_DIR\onevpl.version"
+$ONEVPL_CHANGED = $FALSE
+if (!(Test-Path $ONEVPL_VERSION_FILE) -Or ("$ONEVPL_VERSION" -ne (Get-Content $ONEVPL_VERSION_FILE))) {
+  $ONEVPL_CHANGED = $TRUE
+}
+
+if ($ONEVPL_CHANGED -Or !(Test-Path "$INSTALL_DIR\onevpl\lib\vpl.lib")) {
+  $_URL = "https://github.com/oneapi-src/oneVPL/archive/refs/tags/v$ONEVPL_VERSION.zip"
+  $_FILE = "$BUILD_DIR\oneVPL-$ONEVPL_VERSION.zip"
+  Push-Location $BUILD_DIR
+    if (!(Test-Path $_FILE)) {
+      Invoke-WebRequest -Uri $_URL -OutFile $_FILE
+    }
+    if (Test-Path "oneVPL-$ONEVPL_VERSION") {
+      Remove-Item oneVPL-$ONEVPL_VERSION -Force -Recurse
+    }
+    7z x $_FILE
+  Pop-Location
+
+  if (Test-Path "$INSTALL_DIR\onevpl") {
+    Remove-Item $INSTALL_DIR\onevpl -Recurse -Force
+  }
+  # SoraUnitySdk と同じく CRT を静的リンクする
+  mkdir $BUILD_DIR\oneVPL-build -Force
+  Push-Location $BUILD_DIR\oneVPL-build
+    cmake $BUILD_DIR\oneVPL-$ONEVPL_VERSION `
+      -G "Visual Studio 16 2019" `
+      -DCMAKE_INSTALL_PREFIX="$INSTALL_DIR\onevpl" `
+      -DCMAKE_POLICY_DEFAULT_CMP0091=NEW `
+      -DCMAKE_MSVC_RUNTIME_LIBRARY=MultiThreaded `
+      -DBUILD_SHARED_LIBS=OFF `
+      -DBUILD_TOOLS=OFF `
+      -DBUILD_EXAMPLES=OFF `
+      -DBUILD_TESTS=OFF `
+      -DINSTALL_EXAMPLE_CODE=OFF
+    cmake --build . --config Release
+    cmake --install . --config Release
+  Pop-Location
+}
+Set-Content "$ONEVPL_VERSION_FILE" -Value "$ONEVPL_VERSION"
+
+# AMF
+# AMD の GPU でエンコードするためのヘッダ。ランタイムはドライバに入っている
+
+$AMF_VERSION_FILE = "$INSTALL_DIR\amf.version"
+$AMF_CHANGED = $FALSE
+if (!(Test-Path $AMF_VERSION_FILE) -Or ("$AMF_VERSION" -ne (Get-Content $AMF_VERSION_FILE))) {
+  $AMF_CHANGED = $TRUE
+}
+
+if ($AMF_CHANGED -Or !(Test-Path "$INSTALL_DIR\amf\include\AMF\core\Factory.h")) {
+  $_URL = "https://github.com/GPUOpen-LibrariesAndSDKs/AMF/archive/refs/tags/v$AMF_VERSION.zip"
+  $_FILE = "$BUILD_DIR\AMF-$AMF_VERSION.zip"
+  Push-Location $BUILD_DIR
+    if (!(Test-Path $_FILE)) {
+      Invoke-WebRequest -Uri $_URL -OutFile $_FILE
+    }
+    if (Test-Path "AMF-$AMF_VERSION") {
+      Remove-Item AMF-$AMF_VERSION -Force -Recurse
+    }
+    7z x $_FILE
+  Pop-Location
+
+  if (Test-Path "$INSTALL_DIR\amf") {
+    Remove-Item $INSTALL_DIR\amf -Recurse -Force
+  }
+  mkdir $INSTALL_DIR\amf\include -Force
+  Copy-Item $BUILD_DIR\AMF-$AMF_VERSION\amf\public\include -Destination $INSTALL_DIR\amf\include\AMF -Recurse
+}
+Set-Content "$AMF_VERSION_FILE" -Value "$AMF_VERSION"
@@ -7,6 +7,13 @@ INSTALL_DIR="`pwd`/_install"
 
 source `pwd`/VERSIONS
 
+# Android NDK はホストの OS に合わせたものを使う
+if [ "`uname`" = "Linux" ]; then
+  HOST_OS=linux
+else
+  HOST_OS=darwin
+fi
+
 mkdir -p $BUILD_DIR
 mkdir -p $INSTALL_DIR
 
@@ -17,11 +24,13 @@ if [ ! -e $WEBRTC_VERSION_FILE -o "$WEBRTC_BUILD_VERSION" != "`cat $WEBRTC_VERSI
   WEBRTC_CHANGED=1
 fi
 
-for name in macos android ios; do
+for name in macos android ios ubuntu; do
   if [ $WEBRTC_CHANGED -eq 1 -o ! -e $INSTALL_DIR/$name/webrtc ]; then
     pkgname=$name
     if [ "$name" == "macos" ]; then
       pkgname=macos_x86_64
+    elif [ "$name" == "ubuntu" ]; then
+      pkgname=ubuntu-20.04_x86_64
     fi
 
     # shiguredo-webrtc-build から各環境のバイナリをダウンロードして配置するだけ
@@ -81,8 +90,8 @@ if [ ! -e $ANDROID_NDK_VERSION_FILE -o "$ANDROID_NDK_VERSION" != "`cat $ANDROID_
 fi
 
 if [ $ANDROID_NDK_CHANGED -eq 1 -o ! -e $INSTALL_DIR/android-ndk ]; then
-  _URL=https://dl.google.com/android/repository/android-ndk-${ANDROID_NDK_VERSION}-darwin-x86_64.zip
-  _FILE=$BUILD_DIR/android-ndk-${ANDROID_NDK_VERSION}-darwin-x86_64.zip
+  _URL=https://dl.google.com/android/repository/android-ndk-${ANDROID_NDK_VERSION}-${HOST_OS}-x86_64.zip
+  _FILE=$BUILD_DIR/android-ndk-${ANDROID_NDK_VERSION}-${HOST_OS}-x86_64.zip
   mkdir -p $BUILD_DIR
   if [ ! -e $_FILE ]; then
     echo "file(DOWNLOAD $_URL $_FILE)" > $BUILD_DIR/tmp.cmake
@@ -105,7 +114,7 @@ if [ ! -e $INSTALL_DIR/android/webrtc.ldflags ]; then
   # readelf を使って libwebrtc.a の関数一覧を列挙して、その中から Java_org_webrtc_ を含む関数を取り出し、
   # -Wl,--undefined=<関数名> に加工する。
   # （-Wl,--undefined はアプリケーションから参照されていなくても関数を削除しないためのフラグ）
-  _READELF=$INSTALL_DIR/android-ndk/toolchains/llvm/prebuilt/darwin-x86_64/bin/aarch64-linux-android-readelf
+  _READELF=$INSTALL_DIR/android-ndk/toolchains/llvm/prebuilt/${HOST_OS}-x86_64/bin/aarch64-linux-android-readelf
   _LIBWEBRTC_A=$INSTALL_DIR/android/webrtc/lib/arm64-v8a/libwebrtc.a
   $_READELF -Ws $_LIBWEBRTC_A \
     | grep Java_org_webrtc_ \
@@ -0,0 +1,470 @@
+#include "ahardware_buffer_texture.h"
+
+#include <dlfcn.h>
+#include <mutex>
+
+#include <GLES2/gl2ext.h>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/ref_counted_object.h"
+#include "sdk/android/native_api/jni/class_loader.h"
+#include "sdk/android/src/jni/video_frame.h"
+
+#include "android_context.h"
+
+namespace sora {
+
+namespace {
+
+// minSdkVersion が 24 なので、AHardwareBuffer の関数は実行時に探す
+typedef int (*AHardwareBufferAllocateFunc)(const AHardwareBuffer_Desc*,
+                                           AHardwareBuffer**);
+typedef void (*AHardwareBufferReleaseFunc)(AHardwareBuffer*);
+
+// テクスチャを作ったり消したりする時だけ使う EGL コンテキスト。
+// GetSharedEglBaseContext と同じ共有グループに入れる。
+struct SharedEgl {
+  std::mutex mutex;
+  bool initialized = false;
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLContext context = EGL_NO_CONTEXT;
+  EGLSurface surface = EGL_NO_SURFACE;
+  PFNEGLGETNATIVECLIENTBUFFERANDROIDPROC get_native_client_buffer = nullptr;
+  PFNEGLCREATEIMAGEKHRPROC create_image = nullptr;
+  PFNEGLDESTROYIMAGEKHRPROC destroy_image = nullptr;
+  PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture = nullptr;
+  // TextureBufferImpl を I420 に変換する時に使う。最後まで解放しない。
+  webrtc::ScopedJavaGlobalRef<jobject>* handler = nullptr;
+  webrtc::ScopedJavaGlobalRef<jobject>* yuv_converter = nullptr;
+  // OES テクスチャを描画する時に使う。最初に DrawOes を呼んだ時に作る
+  webrtc::ScopedJavaGlobalRef<jobject>* drawer = nullptr;
+};
+
+SharedEgl& GetSharedEgl() {
+  static SharedEgl egl;
+  return egl;
+}
+
+bool InitSharedEgl(JNIEnv* env, SharedEgl& egl) {
+  webrtc::ScopedJavaLocalRef<jobject> egl_base_context =
+      GetSharedEglBaseContext(env);
+  if (egl_base_context.is_null()) {
+    RTC_LOG(LS_ERROR) << "Failed to get EglBase.Context";
+    return false;
+  }
+
+  // long nativeContext = ((EglBase14.Context)context).getNativeEglContext();
+  webrtc::ScopedJavaLocalRef<jclass> ctxcls(
+      env, env->GetObjectClass(egl_base_context.obj()));
+  jmethodID nativeid =
+      env->GetMethodID(ctxcls.obj(), "getNativeEglContext", "()J");
+  EGLContext share_context =
+      (EGLContext)env->CallLongMethod(egl_base_context.obj(), nativeid);
+
+  egl.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (egl.display == EGL_NO_DISPLAY ||
+      !eglInitialize(egl.display, nullptr, nullptr)) {
+    RTC_LOG(LS_ERROR) << "eglInitialize failed";
+    return false;
+  }
+
+  const EGLint config_attrs[] = {EGL_RED_SIZE,
+                                 8,
+                                 EGL_GREEN_SIZE,
+                                 8,
+                                 EGL_BLUE_SIZE,
+                                 8,
+                                 EGL_RENDERABLE_TYPE,
+                                 EGL_OPENGL_ES2_BIT,
+                                 EGL_SURFACE_TYPE,
+                                 EGL_PBUFFER_BIT,
+                                 EGL_NONE};
+  EGLConfig config;
+  EGLint num_configs = 0;
+  if (!eglChooseConfig(egl.display, config_attrs, &config, 1, &num_configs) ||
+      num_configs == 0) {
+    RTC_LOG(LS_ERROR) << "eglChooseConfig failed";
+    return false;
+  }
+  const EGLint context_attrs[] = {EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE};
+  egl.context =
+      eglCreateContext(egl.display, config, share_context, context_attrs);
+  if (egl.context == EGL_NO_CONTEXT) {
+    RTC_LOG(LS_ERROR) << "eglCreateContext failed: error=" << eglGetError();
+    return false;
+  }
+  const EGLint surface_attrs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+  egl.surface = eglCreatePbufferSurface(egl.display, config, surface_attrs);
+  if (egl.surface == EGL_NO_SURFACE) {
+    RTC_LOG(LS_ERROR) << "eglCreatePbufferSurface failed: error="
+                      << eglGetError();
+    return false;
+  }
+
+  egl.get_native_client_buffer =
+      (PFNEGLGETNATIVECLIENTBUFFERANDROIDPROC)eglGetProcAddress(
+          "eglGetNativeClientBufferANDROID");
+  egl.create_image =
+      (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+  egl.destroy_image =
+      (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+  egl.image_target_texture =
+      (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress(
+          "glEGLImageTargetTexture2DOES");
+  if (egl.get_native_client_buffer == nullptr ||
+      egl.create_image == nullptr || egl.destroy_image == nullptr ||
+      egl.image_target_texture == nullptr) {
+    RTC_LOG(LS_ERROR) << "EGLImage extensions are not available";
+    return false;
+  }
+
+  // SurfaceTextureHelper helper = SurfaceTextureHelper.create("SoraUnityCameraTexture", context);
+  // Handler handler = helper.getHandler();
+  webrtc::ScopedJavaLocalRef<jclass> helpcls =
+      webrtc::GetClass(env, "org/webrtc/SurfaceTextureHelper");
+  jmethodID createid =
+      env->GetStaticMethodID(helpcls.obj(), "create",
+                             "(Ljava/lang/String;Lorg/webrtc/EglBase$Context;)"
+                             "Lorg/webrtc/SurfaceTextureHelper;");
+  webrtc::ScopedJavaLocalRef<jstring> name(
+      env, env->NewStringUTF("SoraUnityCameraTexture"));
+  webrtc::ScopedJavaLocalRef<jobject> helper(
+      env, env->CallStaticObjectMethod(helpcls.obj(), createid, name.obj(),
+                                       egl_base_context.obj()));
+  if (helper.is_null()) {
+    RTC_LOG(LS_ERROR) << "SurfaceTextureHelper.create failed";
+    return false;
+  }
+  jmethodID handlerid = env->GetMethodID(helpcls.obj(), "getHandler",
+                                         "()Landroid/os/Handler;");
+  webrtc::ScopedJavaLocalRef<jobject> handler(
+      env, env->CallObjectMethod(helper.obj(), handlerid));
+
+  // YuvConverter yuvConverter = new YuvConverter();
+  webrtc::ScopedJavaLocalRef<jclass> yuvcls =
+      webrtc::GetClass(env, "org/webrtc/YuvConverter");
+  jmethodID yuvctorid = env->GetMethodID(yuvcls.obj(), "<init>", "()V");
+  webrtc::ScopedJavaLocalRef<jobject> yuv_converter(
+      env, env->NewObject(yuvcls.obj(), yuvctorid));
+
+  egl.handler = new webrtc::ScopedJavaGlobalRef<jobject>(env, handler);
+  egl.yuv_converter =
+      new webrtc::ScopedJavaGlobalRef<jobject>(env, yuv_converter);
+  return true;
+}
+
+// SharedEgl のコンテキストを一時的にカレントにする
+class ScopedMakeCurrent {
+ public:
+  explicit ScopedMakeCurrent(SharedEgl& egl)
+      : egl_(egl),
+        prev_display_(eglGetCurrentDisplay()),
+        prev_context_(eglGetCurrentContext()),
+        prev_draw_(eglGetCurrentSurface(EGL_DRAW)),
+        prev_read_(eglGetCurrentSurface(EGL_READ)) {
+    ok_ = eglMakeCurrent(egl.display, egl.surface, egl.surface,
+                         egl.context) == EGL_TRUE;
+  }
+  ~ScopedMakeCurrent() {
+    if (prev_context_ != EGL_NO_CONTEXT) {
+      eglMakeCurrent(prev_display_, prev_draw_, prev_read_, prev_context_);
+    } else {
+      eglMakeCurrent(egl_.display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                     EGL_NO_CONTEXT);
+    }
+  }
+  bool ok() const { return ok_; }
+
+ private:
+  SharedEgl& egl_;
+  EGLDisplay prev_display_;
+  EGLContext prev_context_;
+  EGLSurface prev_draw_;
+  EGLSurface prev_read_;
+  bool ok_;
+};
+
+}  // namespace
+
+AHardwareBuffer* AHardwareBufferTexture::AllocateBuffer(int width,
+                                                        int height) {
+  static auto allocate = (AHardwareBufferAllocateFunc)dlsym(
+      RTLD_DEFAULT, "AHardwareBuffer_allocate");
+  if (allocate == nullptr) {
+    RTC_LOG(LS_INFO) << "AHardwareBuffer is not available";
+    return nullptr;
+  }
+  AHardwareBuffer_Desc desc = {};
+  desc.width = width;
+  desc.height = height;
+  desc.layers = 1;
+  desc.format = AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM;
+  desc.usage = AHARDWAREBUFFER_USAGE_GPU_SAMPLED_IMAGE |
+               AHARDWAREBUFFER_USAGE_GPU_COLOR_OUTPUT;
+  AHardwareBuffer* buffer = nullptr;
+  int r = allocate(&desc, &buffer);
+  if (r != 0) {
+    RTC_LOG(LS_ERROR) << "AHardwareBuffer_allocate failed: r=" << r;
+    return nullptr;
+  }
+  return buffer;
+}
+
+void AHardwareBufferTexture::ReleaseBuffer(AHardwareBuffer* buffer) {
+  static auto release = (AHardwareBufferReleaseFunc)dlsym(
+      RTLD_DEFAULT, "AHardwareBuffer_release");
+  if (buffer != nullptr && release != nullptr) {
+    release(buffer);
+  }
+}
+
+std::unique_ptr<AHardwareBufferTexture> AHardwareBufferTexture::Create(
+    JNIEnv* env,
+    AHardwareBuffer* buffer,
+    int width,
+    int height) {
+  std::unique_ptr<AHardwareBufferTexture> p(new AHardwareBufferTexture());
+  p->width_ = width;
+  p->height_ = height;
+  if (!p->Init(env, buffer, width, height)) {
+    return nullptr;
+  }
+  return p;
+}
+
+bool AHardwareBufferTexture::Init(JNIEnv* env,
+                                  AHardwareBuffer* buffer,
+                                  int width,
+                                  int height) {
+  auto& egl = GetSharedEgl();
+  std::lock_guard<std::mutex> guard(egl.mutex);
+  if (!egl.initialized) {
+    if (!InitSharedEgl(env, egl)) {
+      return false;
+    }
+    egl.initialized = true;
+  }
+
+  {
+    ScopedMakeCurrent current(egl);
+    if (!current.ok()) {
+      RTC_LOG(LS_ERROR) << "eglMakeCurrent failed: error=" << eglGetError();
+      return false;
+    }
+
+    EGLClientBuffer client_buffer = egl.get_native_client_buffer(buffer);
+    const EGLint image_attrs[] = {EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE};
+    image_ = egl.create_image(egl.display, EGL_NO_CONTEXT,
+                              EGL_NATIVE_BUFFER_ANDROID, client_buffer,
+                              image_attrs);
+    if (image_ == EGL_NO_IMAGE_KHR) {
+      RTC_LOG(LS_ERROR) << "eglCreateImageKHR failed: error="
+                        << eglGetError();
+      return false;
+    }
+
+    glGenTextures(1, &texture_);
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    egl.image_target_texture(GL_TEXTURE_2D, image_);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    // 他のコンテキストから使う前にテクスチャの作成を終わらせておく
+    glFinish();
+  }
+
+  // TextureBufferImpl buffer = new TextureBufferImpl(
+  //     width, height, VideoFrame.TextureBuffer.Type.RGB, texture,
+  //     new Matrix(), handler, yuvConverter, null);
+  webrtc::ScopedJavaLocalRef<jclass> matcls =
+      webrtc::GetClass(env, "android/graphics/Matrix");
+  jmethodID matctorid = env->GetMethodID(matcls.obj(), "<init>", "()V");
+  webrtc::ScopedJavaLocalRef<jobject> matrix(
+      env, env->NewObject(matcls.obj(), matctorid));
+
+  webrtc::ScopedJavaLocalRef<jclass> typecls =
+      webrtc::GetClass(env, "org/webrtc/VideoFrame$TextureBuffer$Type");
+  jfieldID rgbid = env->GetStaticFieldID(
+      typecls.obj(), "RGB", "Lorg/webrtc/VideoFrame$TextureBuffer$Type;");
+  webrtc::ScopedJavaLocalRef<jobject> type(
+      env, env->GetStaticObjectField(typecls.obj(), rgbid));
+
+  webrtc::ScopedJavaLocalRef<jclass> bufcls =
+      webrtc::GetClass(env, "org/webrtc/TextureBufferImpl");
+  jmethodID bufctorid =
+      env->GetMethodID(bufcls.obj(), "<init>",
+                       "("
+                       "II"
+                       "Lorg/webrtc/VideoFrame$TextureBuffer$Type;"
+                       "I"
+                       "Landroid/graphics/Matrix;"
+                       "Landroid/os/Handler;"
+                       "Lorg/webrtc/YuvConverter;"
+                       "Ljava/lang/Runnable;"
+                       ")V");
+  webrtc::ScopedJavaLocalRef<jobject> j_buffer(
+      env, env->NewObject(bufcls.obj(), bufctorid, width, height, type.obj(),
+                          (jint)texture_, matrix.obj(), egl.handler->obj(),
+                          egl.yuv_converter->obj(), nullptr));
+  if (j_buffer.is_null()) {
+    RTC_LOG(LS_ERROR) << "Failed to create TextureBufferImpl";
+    return false;
+  }
+  buffer_ = webrtc::jni::AndroidVideoBuffer::Adopt(env, j_buffer);
+  return true;
+}
+
+AHardwareBufferTexture::~AHardwareBufferTexture() {
+  buffer_ = nullptr;
+
+  auto& egl = GetSharedEgl();
+  std::lock_guard<std::mutex> guard(egl.mutex);
+  if (texture_ == 0 && image_ == EGL_NO_IMAGE_KHR) {
+    return;
+  }
+  ScopedMakeCurrent current(egl);
+  if (!current.ok()) {
+    return;
+  }
+  if (framebuffer_ != 0) {
+    glDeleteFramebuffers(1, &framebuffer_);
+  }
+  if (texture_ != 0) {
+    glDeleteTextures(1, &texture_);
+  }
+  if (image_ != EGL_NO_IMAGE_KHR) {
+    egl.destroy_image(egl.display, image_);
+  }
+}
+
+bool AHardwareBufferTexture::InUse() const {
+  // AndroidVideoBuffer::Adopt は RefCountedObject で作っているので、
+  // 自分以外に参照している人がいるかどうかを調べられる
+  auto p = static_cast<const rtc::RefCountedObject<webrtc::jni::AndroidVideoBuffer>*>(
+      static_cast<const webrtc::jni::AndroidVideoBuffer*>(buffer_.get()));
+  return !p->HasOneRef();
+}
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer> AHardwareBufferTexture::buffer()
+    const {
+  return buffer_;
+}
+
+bool AHardwareBufferTexture::DrawOes(JNIEnv* env,
+                                     webrtc::VideoFrameBuffer* frame) {
+  if (frame->type() != webrtc::VideoFrameBuffer::Type::kNative) {
+    return false;
+  }
+  jobject j_buffer =
+      static_cast<webrtc::jni::AndroidVideoBuffer*>(frame)->video_frame_buffer()
+          .obj();
+
+  // if (!(buffer instanceof VideoFrame.TextureBuffer)) return false;
+  // VideoFrame.TextureBuffer textureBuffer = (VideoFrame.TextureBuffer)buffer;
+  // if (textureBuffer.getType() != VideoFrame.TextureBuffer.Type.OES) return false;
+  webrtc::ScopedJavaLocalRef<jclass> texcls =
+      webrtc::GetClass(env, "org/webrtc/VideoFrame$TextureBuffer");
+  if (!env->IsInstanceOf(j_buffer, texcls.obj())) {
+    return false;
+  }
+  jmethodID gettypeid = env->GetMethodID(
+      texcls.obj(), "getType", "()Lorg/webrtc/VideoFrame$TextureBuffer$Type;");
+  webrtc::ScopedJavaLocalRef<jobject> type(
+      env, env->CallObjectMethod(j_buffer, gettypeid));
+  webrtc::ScopedJavaLocalRef<jclass> typecls =
+      webrtc::GetClass(env, "org/webrtc/VideoFrame$TextureBuffer$Type");
+  jfieldID oesid = env->GetStaticFieldID(
+      typecls.obj(), "OES", "Lorg/webrtc/VideoFrame$TextureBuffer$Type;");
+  webrtc::ScopedJavaLocalRef<jobject> oes(
+      env, env->GetStaticObjectField(typecls.obj(), oesid));
+  if (!env->IsSameObject(type.obj(), oes.obj())) {
+    return false;
+  }
+
+  // int textureId = textureBuffer.getTextureId();
+  // float[] matrix = RendererCommon.convertMatrixFromAndroidGraphicsMatrix(
+  //     textureBuffer.getTransformMatrix());
+  // matrix = RendererCommon.multiplyMatrices(matrix, RendererCommon.verticalFlipMatrix());
+  jmethodID texid = env->GetMethodID(texcls.obj(), "getTextureId", "()I");
+  jint texture_id = env->CallIntMethod(j_buffer, texid);
+  jmethodID matid = env->GetMethodID(texcls.obj(), "getTransformMatrix",
+                                     "()Landroid/graphics/Matrix;");
+  webrtc::ScopedJavaLocalRef<jobject> matrix(
+      env, env->CallObjectMethod(j_buffer, matid));
+  webrtc::ScopedJavaLocalRef<jclass> rccls =
+      webrtc::GetClass(env, "org/webrtc/RendererCommon");
+  jmethodID convid =
+      env->GetStaticMethodID(rccls.obj(), "convertMatrixFromAndroidGraphicsMatrix",
+                             "(Landroid/graphics/Matrix;)[F");
+  webrtc::ScopedJavaLocalRef<jobject> tex_matrix(
+      env, env->CallStaticObjectMethod(rccls.obj(), convid, matrix.obj()));
+  jmethodID flipid =
+      env->GetStaticMethodID(rccls.obj(), "verticalFlipMatrix", "()[F");
+  webrtc::ScopedJavaLocalRef<jobject> flip(
+      env, env->CallStaticObjectMethod(rccls.obj(), flipid));
+  jmethodID mulid = env->GetStaticMethodID(rccls.obj(), "multiplyMatrices",
+                                           "([F[F)[F");
+  webrtc::ScopedJavaLocalRef<jobject> draw_matrix(
+      env, env->CallStaticObjectMethod(rccls.obj(), mulid, tex_matrix.obj(),
+                                       flip.obj()));
+
+  auto& egl = GetSharedEgl();
+  std::lock_guard<std::mutex> guard(egl.mutex);
+  if (!egl.initialized) {
+    return false;
+  }
+  if (egl.drawer == nullptr) {
+    // GlRectDrawer drawer = new GlRectDrawer();
+    webrtc::ScopedJavaLocalRef<jclass> drawcls =
+        webrtc::GetClass(env, "org/webrtc/GlRectDrawer");
+    jmethodID drawctorid = env->GetMethodID(drawcls.obj(), "<init>", "()V");
+    webrtc::ScopedJavaLocalRef<jobject> drawer(
+        env, env->NewObject(drawcls.obj(), drawctorid));
+    egl.drawer = new webrtc::ScopedJavaGlobalRef<jobject>(env, drawer);
+  }
+
+  ScopedMakeCurrent current(egl);
+  if (!current.ok()) {
+    RTC_LOG(LS_ERROR) << "eglMakeCurrent failed: error=" << eglGetError();
+    return false;
+  }
+  if (framebuffer_ == 0) {
+    glGenFramebuffers(1, &framebuffer_);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, texture_, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+      RTC_LOG(LS_ERROR) << "glCheckFramebufferStatus failed: status="
+                        << status;
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+      return false;
+    }
+  } else {
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+  }
+
+  // drawer.drawOes(textureId, matrix, frameWidth, frameHeight, 0, 0, width, height);
+  // 他のコンテキストのスレッドから呼ばれても、GL の呼び出しは今カレントのコンテキストに対して行われる
+  webrtc::ScopedJavaLocalRef<jclass> drawcls(
+      env, env->GetObjectClass(egl.drawer->obj()));
+  jmethodID drawid =
+      env->GetMethodID(drawcls.obj(), "drawOes", "(I[FIIIIII)V");
+  env->CallVoidMethod(egl.drawer->obj(), drawid, texture_id, draw_matrix.obj(),
+                      (jint)frame->width(), (jint)frame->height(), 0, 0,
+                      (jint)width_, (jint)height_);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  if (env->ExceptionCheck()) {
+    env->ExceptionDescribe();
+    env->ExceptionClear();
+    RTC_LOG(LS_ERROR) << "GlRectDrawer.drawOes failed";
+    return false;
+  }
+  // Vulkan 側から読む前に描画を終わらせておく
+  glFinish();
+  return true;
+}
+
+}  // namespace sora
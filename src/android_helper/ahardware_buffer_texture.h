@@ -0,0 +1,58 @@
+#ifndef AHARDWARE_BUFFER_TEXTURE_H_
+#define AHARDWARE_BUFFER_TEXTURE_H_
+
+#include <memory>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <android/hardware_buffer.h>
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+#include "sdk/android/native_api/jni/scoped_java_ref.h"
+
+namespace sora {
+
+// AHardwareBuffer を EGLImage 経由で GL_TEXTURE_2D にして、
+// org.webrtc.TextureBufferImpl で包んだもの。
+// テクスチャは GetSharedEglBaseContext と共有されているので、
+// ハードウェアエンコーダは CPU を経由せずにエンコードできる。
+//
+// 同じ TextureBufferImpl を使い回すので、InUse() が false になるまで
+// AHardwareBuffer に書き込んではいけない。
+class AHardwareBufferTexture {
+ public:
+  // API レベル 26 未満の場合は nullptr を返す
+  static AHardwareBuffer* AllocateBuffer(int width, int height);
+  static void ReleaseBuffer(AHardwareBuffer* buffer);
+
+  static std::unique_ptr<AHardwareBufferTexture> Create(JNIEnv* env,
+                                                        AHardwareBuffer* buffer,
+                                                        int width,
+                                                        int height);
+  ~AHardwareBufferTexture();
+
+  bool InUse() const;
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer() const;
+
+  // MediaCodec が SurfaceTexture に出力した OES の TextureBuffer を、
+  // このテクスチャのサイズに合わせて GPU 上で描画する。描画が終わるまで待つ。
+  // RenderTrackToTexture で転送した場合と同じ向きになるように上下を反転する
+  bool DrawOes(JNIEnv* env, webrtc::VideoFrameBuffer* frame);
+
+ private:
+  bool Init(JNIEnv* env, AHardwareBuffer* buffer, int width, int height);
+
+  int width_ = 0;
+  int height_ = 0;
+  EGLImageKHR image_ = EGL_NO_IMAGE_KHR;
+  GLuint texture_ = 0;
+  // DrawOes で描画する時に作る
+  GLuint framebuffer_ = 0;
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer_;
+};
+
+}  // namespace sora
+
+#endif  // AHARDWARE_BUFFER_TEXTURE_H_
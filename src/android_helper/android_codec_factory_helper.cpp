@@ -5,40 +5,17 @@
 #include "sdk/android/native_api/jni/class_loader.h"
 #include "sdk/android/native_api/jni/scoped_java_ref.h"
 
+#include "android_context.h"
+
 namespace sora {
 
 std::unique_ptr<webrtc::VideoEncoderFactory> CreateAndroidEncoderFactory(JNIEnv* env) {
-  // int[] configPlain = EglBase.CONFIG_PLAIN;
-  // EglBase eglBase = new EglBase14Impl(configPlain);
-  // EglBase.Context context = eglBase.getEglBaseContext();
+  // EglBase.Context context = (Unity カメラのテクスチャと共有する EglBase.Context);
   // DefaultVideoEncoderFactory encoderFactory = new DefaultVideoEncoderFactory(context, true /* enableIntelVp8Encoder */, false /* enableH264HighProfile */);
 
-  //jobject config_plain;
-  //{
-  //  webrtc::ScopedJavaLocalRef<jclass> eglcls =
-  //      webrtc::GetClass(env, "org/webrtc/EglBase");
-  //  jfieldID fieldid =
-  //      env->GetStaticFieldID(eglcls.obj(), "CONFIG_PLAIN", "[I");
-  //  config_plain = env->GetStaticObjectField(eglcls.obj(), fieldid);
-  //}
-
-  //jobject egl_base;
-  //{
-  //  webrtc::ScopedJavaLocalRef<jclass> eglcls =
-  //      webrtc::GetClass(env, "org/webrtc/EglBase14Impl");
-  //  jmethodID ctorid = env->GetMethodID(eglcls.obj(), "<init>",
-  //                                      "(Landroid/opengl/EGLContext;[I)V");
-  //  egl_base = env->NewObject(eglcls.obj(), ctorid, nullptr, config_plain);
-  //}
-
-  //jobject context;
-  //{
-  //  webrtc::ScopedJavaLocalRef<jclass> eglcls =
-  //      webrtc::GetClass(env, "org/webrtc/EglBase");
-  //  jmethodID ctxid = env->GetMethodID(eglcls.obj(), "getEglBaseContext",
-  //                                     "()Lorg/webrtc/EglBase$Context;");
-  //  context = env->CallObjectMethod(egl_base, ctxid);
-  //}
+  // EglBase.Context を渡しておくと、テクスチャのフレームを
+  // ハードウェアエンコーダが CPU を経由せずにエンコードしてくれる
+  webrtc::ScopedJavaLocalRef<jobject> context = GetSharedEglBaseContext(env);
 
   jobject encoder_factory;
   {
@@ -47,22 +24,30 @@ std::unique_ptr<webrtc::VideoEncoderFactory> CreateAndroidEncoderFactory(JNIEnv*
     jmethodID ctorid = env->GetMethodID(faccls.obj(), "<init>",
                                         "(Lorg/webrtc/EglBase$Context;ZZ)V");
     encoder_factory =
-        env->NewObject(faccls.obj(), ctorid, nullptr, true, false);
+        env->NewObject(faccls.obj(), ctorid, context.obj(), true, false);
   }
 
   return webrtc::JavaToNativeVideoEncoderFactory(env, encoder_factory);
 }
 std::unique_ptr<webrtc::VideoDecoderFactory> CreateAndroidDecoderFactory(
-    JNIEnv* env) {
-  // EglBase eglBase = EglBase.create();
-  // EglBase.Context context = context.getEglBaseContext();
+    JNIEnv* env,
+    bool texture_output) {
+  // EglBase.Context context = texture_output ? (共有の EglBase.Context) : null;
   // DefaultVideoDecoderFactory decoderFactory = new DefaultVideoDecoderFactory(context);
 
+  // EglBase.Context が null の場合、MediaCodec はバイトバッファに出力するので
+  // デコード結果は CPU のメモリに置かれる
+  webrtc::ScopedJavaLocalRef<jobject> context;
+  if (texture_output) {
+    context = GetSharedEglBaseContext(env);
+  }
+
   webrtc::ScopedJavaLocalRef<jclass> faccls =
       webrtc::GetClass(env, "org/webrtc/DefaultVideoDecoderFactory");
   jmethodID ctorid = env->GetMethodID(faccls.obj(), "<init>",
                                       "(Lorg/webrtc/EglBase$Context;)V");
-  jobject decoder_factory = env->NewObject(faccls.obj(), ctorid, nullptr);
+  jobject decoder_factory =
+      env->NewObject(faccls.obj(), ctorid, context.obj());
   return webrtc::JavaToNativeVideoDecoderFactory(env, decoder_factory);
 }
 
@@ -11,8 +11,11 @@ namespace sora {
 
 std::unique_ptr<webrtc::VideoEncoderFactory> CreateAndroidEncoderFactory(
     JNIEnv* env);
+// texture_output の場合は、MediaCodec のデコード結果を GetSharedEglBaseContext と
+// 共有した SurfaceTexture に出力させ、OES テクスチャのフレームを渡す
 std::unique_ptr<webrtc::VideoDecoderFactory> CreateAndroidDecoderFactory(
-    JNIEnv* env);
+    JNIEnv* env,
+    bool texture_output);
 
 }  // namespace sora
 
@@ -1,5 +1,7 @@
 #include "android_context.h"
 
+#include <mutex>
+
 #include "sdk/android/native_api/jni/class_loader.h"
 #include "sdk/android/native_api/jni/jvm.h"
 #include "sdk/android/native_api/jni/scoped_java_ref.h"
@@ -26,4 +28,33 @@ webrtc::ScopedJavaLocalRef<jobject> GetAndroidApplicationContext(JNIEnv* env) {
   return context;
 }
 
+webrtc::ScopedJavaLocalRef<jobject> GetSharedEglBaseContext(JNIEnv* env) {
+  static std::mutex mutex;
+  // 最後まで解放しない
+  static webrtc::ScopedJavaGlobalRef<jobject>* egl_base_context = nullptr;
+
+  std::lock_guard<std::mutex> guard(mutex);
+  if (egl_base_context == nullptr) {
+    // EglBase eglBase = EglBase.createEgl14(EglBase.CONFIG_PLAIN);
+    // EglBase.Context context = eglBase.getEglBaseContext();
+    webrtc::ScopedJavaLocalRef<jclass> eglcls =
+        webrtc::GetClass(env, "org/webrtc/EglBase");
+    jfieldID configid =
+        env->GetStaticFieldID(eglcls.obj(), "CONFIG_PLAIN", "[I");
+    webrtc::ScopedJavaLocalRef<jobject> config_plain(
+        env, env->GetStaticObjectField(eglcls.obj(), configid));
+    jmethodID createid = env->GetStaticMethodID(
+        eglcls.obj(), "createEgl14", "([I)Lorg/webrtc/EglBase14;");
+    webrtc::ScopedJavaLocalRef<jobject> egl_base(
+        env, env->CallStaticObjectMethod(eglcls.obj(), createid,
+                                         config_plain.obj()));
+    jmethodID ctxid = env->GetMethodID(eglcls.obj(), "getEglBaseContext",
+                                       "()Lorg/webrtc/EglBase$Context;");
+    webrtc::ScopedJavaLocalRef<jobject> context(
+        env, env->CallObjectMethod(egl_base.obj(), ctxid));
+    egl_base_context = new webrtc::ScopedJavaGlobalRef<jobject>(env, context);
+  }
+  return webrtc::ScopedJavaLocalRef<jobject>(env, egl_base_context->obj());
+}
+
 }  // namespace sora
@@ -7,6 +7,10 @@ namespace sora {
 
 webrtc::ScopedJavaLocalRef<jobject> GetAndroidApplicationContext(JNIEnv* env);
 
+// エンコーダと Unity カメラのテクスチャで共有する org.webrtc.EglBase.Context。
+// 最初に呼ばれた時に EglBase を作って、以降はずっと同じものを返す。
+webrtc::ScopedJavaLocalRef<jobject> GetSharedEglBaseContext(JNIEnv* env);
+
 }
 
 #endif  // ANDROID_CONTEXT_H_
@@ -0,0 +1,269 @@
+#include "android_native_texture_renderer.h"
+
+#include "rtc_base/logging.h"
+#include "sdk/android/native_api/jni/jvm.h"
+
+// unity
+#include "unity/IUnityGraphics.h"
+#include "unity/IUnityGraphicsVulkan.h"
+
+#include "unity_context.h"
+
+namespace sora {
+
+AndroidNativeTextureRenderer::~AndroidNativeTextureRenderer() {
+  auto ifs = UnityContext::Instance().GetInterfaces();
+  if (ifs == nullptr) {
+    return;
+  }
+  VkDevice device = ifs->Get<IUnityGraphicsVulkan>()->Instance().device;
+
+  // GPU がまだ画像を使っている可能性があるので、破棄する時だけは待つ
+  bool pending = false;
+  for (auto& slot : slots_) {
+    pending = pending || slot.pending;
+  }
+  if (pending) {
+    vkDeviceWaitIdle(device);
+  }
+  Destroy(device);
+}
+
+bool AndroidNativeTextureRenderer::IsSupported() {
+  auto ifs = UnityContext::Instance().GetInterfaces();
+  if (ifs == nullptr) {
+    return false;
+  }
+  return ifs->Get<IUnityGraphics>()->GetRenderer() == kUnityGfxRendererVulkan &&
+         IsVulkanAHardwareBufferEnabled();
+}
+
+bool AndroidNativeTextureRenderer::IsWritable(const Slot& slot) const {
+  return slot.texture && !slot.drawing && !slot.texture->InUse() &&
+         (!slot.pending || slot.frame_number <= safe_frame_number_);
+}
+
+rtc::scoped_refptr<webrtc::VideoFrameBuffer> AndroidNativeTextureRenderer::Draw(
+    webrtc::VideoFrameBuffer* frame) {
+  Slot* slot = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (failed_) {
+      return nullptr;
+    }
+    // サイズが変わったら、レンダリングスレッドで作り直すまでは CPU を経由させる
+    requested_width_ = frame->width();
+    requested_height_ = frame->height();
+    if (width_ != requested_width_ || height_ != requested_height_) {
+      return nullptr;
+    }
+    for (int i = 0; i < kSlotCount; i++) {
+      Slot& s = slots_[(next_slot_ + i) % kSlotCount];
+      if (IsWritable(s)) {
+        slot = &s;
+        next_slot_ = (next_slot_ + i + 1) % kSlotCount;
+        break;
+      }
+    }
+    if (slot == nullptr) {
+      RTC_LOG(LS_VERBOSE) << "No writable native texture";
+      return nullptr;
+    }
+    slot->drawing = true;
+    slot->pending = false;
+  }
+
+  JNIEnv* env = webrtc::AttachCurrentThreadIfNeeded();
+  bool result = slot->texture->DrawOes(env, frame);
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  slot->drawing = false;
+  if (!result) {
+    return nullptr;
+  }
+  return slot->texture->buffer();
+}
+
+void AndroidNativeTextureRenderer::Update() {
+  IUnityGraphicsVulkan* graphics =
+      UnityContext::Instance().GetInterfaces()->Get<IUnityGraphicsVulkan>();
+  VkDevice device = graphics->Instance().device;
+
+  UnityVulkanRecordingState state;
+  if (!graphics->CommandRecordingState(
+          &state, kUnityVulkanGraphicsQueueAccess_DontCare)) {
+    RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::CommandRecordingState Failed";
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  safe_frame_number_ = state.safeFrameNumber;
+  if (failed_ || requested_width_ == 0 ||
+      (width_ == requested_width_ && height_ == requested_height_)) {
+    return;
+  }
+
+  // どのバッファも使われていなければ作り直す
+  for (auto& slot : slots_) {
+    if (slot.drawing || (slot.texture && slot.texture->InUse()) ||
+        (slot.pending && slot.frame_number > safe_frame_number_)) {
+      return;
+    }
+  }
+  Destroy(device);
+  if (!Allocate(device, requested_width_, requested_height_)) {
+    RTC_LOG(LS_WARNING) << "Failed to allocate native textures, "
+                           "fallback to CPU";
+    Destroy(device);
+    failed_ = true;
+  }
+}
+
+bool AndroidNativeTextureRenderer::Render(webrtc::VideoFrameBuffer* frame,
+                                          void* unity_texture) {
+  IUnityGraphicsVulkan* graphics =
+      UnityContext::Instance().GetInterfaces()->Get<IUnityGraphicsVulkan>();
+  UnityVulkanInstance instance = graphics->Instance();
+
+  UnityVulkanImage image;
+  if (!graphics->AccessTexture(
+          unity_texture, UnityVulkanWholeImage,
+          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+          VK_ACCESS_TRANSFER_WRITE_BIT,
+          kUnityVulkanResourceAccess_PipelineBarrier, &image)) {
+    RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::AccessTexture Failed";
+    return false;
+  }
+  graphics->EnsureOutsideRenderPass();
+
+  UnityVulkanRecordingState state;
+  if (!graphics->CommandRecordingState(
+          &state, kUnityVulkanGraphicsQueueAccess_DontCare)) {
+    RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::CommandRecordingState Failed";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  Slot* slot = nullptr;
+  for (auto& s : slots_) {
+    if (s.texture && s.texture->buffer().get() == frame) {
+      slot = &s;
+      break;
+    }
+  }
+  if (slot == nullptr) {
+    return false;
+  }
+
+  uint32_t queue_family_index = instance.queueFamilyIndex;
+
+  // GL 側から所有権を受け取る。GL で描画した内容を残しておく
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+  barrier.dstQueueFamilyIndex = queue_family_index;
+  barrier.image = slot->image;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  vkCmdPipelineBarrier(state.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+
+  // サイズが同じならコピーする。sRGB のテクスチャでも RenderTrackToTexture と
+  // 同じくバイト列をそのまま書き込みたいので、blit は縮小が必要な場合だけ使う
+  if ((int)image.extent.width == width_ &&
+      (int)image.extent.height == height_) {
+    VkImageCopy region = {};
+    region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.srcOffset = {0, 0, 0};
+    region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.dstOffset = {0, 0, 0};
+    region.extent = {(uint32_t)width_, (uint32_t)height_, 1};
+    vkCmdCopyImage(state.commandBuffer, slot->image,
+                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+  } else {
+    VkImageBlit region = {};
+    region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.srcOffsets[0] = {0, 0, 0};
+    region.srcOffsets[1] = {width_, height_, 1};
+    region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.dstOffsets[0] = {0, 0, 0};
+    region.dstOffsets[1] = {(int32_t)image.extent.width,
+                            (int32_t)image.extent.height, 1};
+    vkCmdBlitImage(state.commandBuffer, slot->image,
+                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                   VK_FILTER_LINEAR);
+  }
+
+  // GL 側に所有権を返す
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  barrier.dstAccessMask = 0;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = queue_family_index;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+  vkCmdPipelineBarrier(state.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+
+  slot->pending = true;
+  slot->frame_number = state.currentFrameNumber;
+  return true;
+}
+
+bool AndroidNativeTextureRenderer::Allocate(VkDevice device,
+                                            int width,
+                                            int height) {
+  JNIEnv* env = webrtc::AttachCurrentThreadIfNeeded();
+  for (auto& slot : slots_) {
+    slot.hardware_buffer = AHardwareBufferTexture::AllocateBuffer(width, height);
+    if (slot.hardware_buffer == nullptr) {
+      return false;
+    }
+    if (!ImportAHardwareBufferImage(device, slot.hardware_buffer, width, height,
+                                    VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                                    &slot.image, &slot.memory)) {
+      return false;
+    }
+    slot.texture = AHardwareBufferTexture::Create(env, slot.hardware_buffer,
+                                                  width, height);
+    if (!slot.texture) {
+      return false;
+    }
+  }
+  width_ = width;
+  height_ = height;
+  memory_.Set((int64_t)width * height * 4 * kSlotCount, kSlotCount);
+  RTC_LOG(LS_INFO) << "Native textures for decoded frames: " << width << "x"
+                   << height;
+  return true;
+}
+
+void AndroidNativeTextureRenderer::Destroy(VkDevice device) {
+  for (auto& slot : slots_) {
+    slot.texture.reset();
+    if (slot.image != VK_NULL_HANDLE) {
+      vkDestroyImage(device, slot.image, nullptr);
+      slot.image = VK_NULL_HANDLE;
+    }
+    if (slot.memory != VK_NULL_HANDLE) {
+      vkFreeMemory(device, slot.memory, nullptr);
+      slot.memory = VK_NULL_HANDLE;
+    }
+    if (slot.hardware_buffer != nullptr) {
+      AHardwareBufferTexture::ReleaseBuffer(slot.hardware_buffer);
+      slot.hardware_buffer = nullptr;
+    }
+    slot.pending = false;
+  }
+  width_ = 0;
+  height_ = 0;
+  memory_.Set(0, 0);
+}
+
+}  // namespace sora
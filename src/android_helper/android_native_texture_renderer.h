@@ -0,0 +1,73 @@
+#ifndef ANDROID_NATIVE_TEXTURE_RENDERER_H_
+#define ANDROID_NATIVE_TEXTURE_RENDERER_H_
+
+#include <memory>
+#include <mutex>
+
+#include "api/scoped_refptr.h"
+#include "api/video/video_frame_buffer.h"
+
+#include "ahardware_buffer_texture.h"
+#include "android_vulkan_hook.h"
+#include "memory_stats.h"
+
+namespace sora {
+
+// MediaCodec が SurfaceTexture に出力した OES テクスチャを、CPU を経由せずに
+// Unity の Vulkan のテクスチャに転送する。
+//
+// デコーダのスレッドで OES テクスチャを AHardwareBuffer に GL で描画し、
+// レンダリングスレッドで AHardwareBuffer を取り込んだ VkImage から Unity のテクスチャにコピーする。
+// AHardwareBuffer は描画中、Unity に渡すフレームとして保持中、GPU でコピー中の
+// ３つを入れ替えて使う。
+class AndroidNativeTextureRenderer {
+ public:
+  ~AndroidNativeTextureRenderer();
+
+  // Unity が Vulkan で、AHardwareBuffer を Vulkan から使える場合だけ true
+  static bool IsSupported();
+
+  // デコーダのスレッドから呼ぶ。frame が OES テクスチャなら AHardwareBuffer に描画し、
+  // それを包んだ kNative のフレームを返す。描画できない場合は nullptr を返す
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> Draw(
+      webrtc::VideoFrameBuffer* frame);
+  // レンダリングスレッドから毎フレーム呼ぶ。受信した映像のサイズが変わっていたら作り直す
+  void Update();
+  // レンダリングスレッドから呼ぶ。Draw が返したフレームを Unity のテクスチャにコピーする
+  bool Render(webrtc::VideoFrameBuffer* frame, void* unity_texture);
+
+ private:
+  struct Slot {
+    AHardwareBuffer* hardware_buffer = nullptr;
+    std::unique_ptr<AHardwareBufferTexture> texture;
+    VkImage image = VK_NULL_HANDLE;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    // Draw で描画している最中
+    bool drawing = false;
+    // Vulkan でコピーしたフレームの番号。GPU の処理が終わるまで描画しない
+    bool pending = false;
+    uint64_t frame_number = 0;
+  };
+  static const int kSlotCount = 3;
+
+  bool IsWritable(const Slot& slot) const;
+  // レンダリングスレッドから呼ぶ
+  bool Allocate(VkDevice device, int width, int height);
+  void Destroy(VkDevice device);
+
+  std::mutex mutex_;
+  Slot slots_[kSlotCount];
+  int next_slot_ = 0;
+  int width_ = 0;
+  int height_ = 0;
+  // Draw で受け取ったフレームのサイズ。Render で作り直す
+  int requested_width_ = 0;
+  int requested_height_ = 0;
+  bool failed_ = false;
+  uint64_t safe_frame_number_ = 0;
+  TrackedMemory memory_{MemoryCategory::kRendererBuffers};
+};
+
+}  // namespace sora
+
+#endif  // ANDROID_NATIVE_TEXTURE_RENDERER_H_
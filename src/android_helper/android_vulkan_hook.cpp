@@ -0,0 +1,262 @@
+#include "android_vulkan_hook.h"
+
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#include "rtc_base/logging.h"
+#include "unity/IUnityGraphicsVulkan.h"
+
+namespace sora {
+
+static PFN_vkGetInstanceProcAddr g_get_instance_proc_addr = nullptr;
+static PFN_vkCreateInstance g_create_instance = nullptr;
+static PFN_vkCreateDevice g_create_device = nullptr;
+static std::atomic<bool> g_ahb_enabled{false};
+
+static const char* const kInstanceExtensions[] = {
+    VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
+    VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME,
+};
+
+// VK_ANDROID_external_memory_android_hardware_buffer と、それが依存している拡張
+static const char* const kDeviceExtensions[] = {
+    VK_KHR_MAINTENANCE1_EXTENSION_NAME,
+    VK_KHR_BIND_MEMORY_2_EXTENSION_NAME,
+    VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME,
+    VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME,
+    VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME,
+    VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME,
+    VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME,
+    VK_ANDROID_EXTERNAL_MEMORY_ANDROID_HARDWARE_BUFFER_EXTENSION_NAME,
+};
+
+static bool Contains(const std::vector<const char*>& names, const char* name) {
+  for (auto n : names) {
+    if (std::strcmp(n, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+HookCreateInstance(const VkInstanceCreateInfo* create_info,
+                   const VkAllocationCallbacks* allocator,
+                   VkInstance* instance) {
+  uint32_t count = 0;
+  vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+  std::vector<VkExtensionProperties> props(count);
+  vkEnumerateInstanceExtensionProperties(nullptr, &count, props.data());
+
+  std::vector<const char*> names(
+      create_info->ppEnabledExtensionNames,
+      create_info->ppEnabledExtensionNames +
+          create_info->enabledExtensionCount);
+  for (auto ext : kInstanceExtensions) {
+    if (Contains(names, ext)) {
+      continue;
+    }
+    for (const auto& prop : props) {
+      if (std::strcmp(prop.extensionName, ext) == 0) {
+        names.push_back(ext);
+        break;
+      }
+    }
+  }
+
+  VkInstanceCreateInfo info = *create_info;
+  info.enabledExtensionCount = (uint32_t)names.size();
+  info.ppEnabledExtensionNames = names.data();
+  return g_create_instance(&info, allocator, instance);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+HookCreateDevice(VkPhysicalDevice physical_device,
+                 const VkDeviceCreateInfo* create_info,
+                 const VkAllocationCallbacks* allocator,
+                 VkDevice* device) {
+  uint32_t count = 0;
+  vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count,
+                                       nullptr);
+  std::vector<VkExtensionProperties> props(count);
+  vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count,
+                                       props.data());
+
+  // 必要な拡張が全て使える場合だけ追加する
+  std::vector<const char*> names(
+      create_info->ppEnabledExtensionNames,
+      create_info->ppEnabledExtensionNames + create_info->enabledExtensionCount);
+  bool supported = true;
+  for (auto ext : kDeviceExtensions) {
+    bool found = false;
+    for (const auto& prop : props) {
+      if (std::strcmp(prop.extensionName, ext) == 0) {
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      RTC_LOG(LS_INFO) << "Vulkan device extension is not supported: " << ext;
+      supported = false;
+      break;
+    }
+  }
+  if (supported) {
+    for (auto ext : kDeviceExtensions) {
+      if (!Contains(names, ext)) {
+        names.push_back(ext);
+      }
+    }
+  }
+
+  VkDeviceCreateInfo info = *create_info;
+  info.enabledExtensionCount = (uint32_t)names.size();
+  info.ppEnabledExtensionNames = names.data();
+  VkResult result = g_create_device(physical_device, &info, allocator, device);
+  if (result != VK_SUCCESS && supported) {
+    // 拡張を追加したせいで失敗したかもしれないので、元の設定で作り直す
+    RTC_LOG(LS_WARNING) << "vkCreateDevice failed with AHardwareBuffer "
+                           "extensions: result="
+                        << result;
+    supported = false;
+    result = g_create_device(physical_device, create_info, allocator, device);
+  }
+  g_ahb_enabled.store(result == VK_SUCCESS && supported);
+  return result;
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
+HookGetInstanceProcAddr(VkInstance instance, const char* name) {
+  if (std::strcmp(name, "vkCreateInstance") == 0) {
+    g_create_instance =
+        (PFN_vkCreateInstance)g_get_instance_proc_addr(instance, name);
+    return (PFN_vkVoidFunction)&HookCreateInstance;
+  }
+  if (std::strcmp(name, "vkCreateDevice") == 0) {
+    g_create_device =
+        (PFN_vkCreateDevice)g_get_instance_proc_addr(instance, name);
+    return (PFN_vkVoidFunction)&HookCreateDevice;
+  }
+  return g_get_instance_proc_addr(instance, name);
+}
+
+static PFN_vkGetInstanceProcAddr UNITY_INTERFACE_API
+OnVulkanInitialization(PFN_vkGetInstanceProcAddr get_instance_proc_addr,
+                       void* userdata) {
+  g_get_instance_proc_addr = get_instance_proc_addr;
+  return &HookGetInstanceProcAddr;
+}
+
+void InterceptVulkanInitialization(IUnityInterfaces* ifs) {
+  auto vulkan = ifs->Get<IUnityGraphicsVulkan>();
+  if (vulkan == nullptr) {
+    return;
+  }
+  if (!vulkan->InterceptInitialization(&OnVulkanInitialization, nullptr)) {
+    RTC_LOG(LS_INFO) << "IUnityGraphicsVulkan::InterceptInitialization failed";
+  }
+}
+
+bool IsVulkanAHardwareBufferEnabled() {
+  return g_ahb_enabled.load();
+}
+
+bool ImportAHardwareBufferImage(VkDevice device,
+                                AHardwareBuffer* buffer,
+                                int width,
+                                int height,
+                                VkImageUsageFlags usage,
+                                VkImage* image,
+                                VkDeviceMemory* memory) {
+  auto get_properties =
+      (PFN_vkGetAndroidHardwareBufferPropertiesANDROID)vkGetDeviceProcAddr(
+          device, "vkGetAndroidHardwareBufferPropertiesANDROID");
+  if (get_properties == nullptr) {
+    RTC_LOG(LS_WARNING)
+        << "vkGetAndroidHardwareBufferPropertiesANDROID not found";
+    return false;
+  }
+
+  VkAndroidHardwareBufferFormatPropertiesANDROID format_props = {};
+  format_props.sType =
+      VK_STRUCTURE_TYPE_ANDROID_HARDWARE_BUFFER_FORMAT_PROPERTIES_ANDROID;
+  VkAndroidHardwareBufferPropertiesANDROID props = {};
+  props.sType = VK_STRUCTURE_TYPE_ANDROID_HARDWARE_BUFFER_PROPERTIES_ANDROID;
+  props.pNext = &format_props;
+  if (get_properties(device, buffer, &props) != VK_SUCCESS) {
+    RTC_LOG(LS_ERROR) << "vkGetAndroidHardwareBufferPropertiesANDROID failed";
+    return false;
+  }
+
+  VkExternalMemoryImageCreateInfo external_info = {};
+  external_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+  external_info.handleTypes =
+      VK_EXTERNAL_MEMORY_HANDLE_TYPE_ANDROID_HARDWARE_BUFFER_BIT_ANDROID;
+
+  VkImageCreateInfo imageInfo = {};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.pNext = &external_info;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+  imageInfo.extent = {(uint32_t)width, (uint32_t)height, 1};
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.usage = usage;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  if (vkCreateImage(device, &imageInfo, nullptr, image) != VK_SUCCESS) {
+    RTC_LOG(LS_ERROR) << "vkCreateImage failed";
+    return false;
+  }
+
+  int found = -1;
+  for (uint32_t i = 0; i < 32; ++i) {
+    if (props.memoryTypeBits & (1u << i)) {
+      found = i;
+      break;
+    }
+  }
+  if (found < 0) {
+    RTC_LOG(LS_ERROR) << "Memory type for AHardwareBuffer not found";
+    vkDestroyImage(device, *image, nullptr);
+    *image = VK_NULL_HANDLE;
+    return false;
+  }
+
+  VkImportAndroidHardwareBufferInfoANDROID importInfo = {};
+  importInfo.sType =
+      VK_STRUCTURE_TYPE_IMPORT_ANDROID_HARDWARE_BUFFER_INFO_ANDROID;
+  importInfo.buffer = buffer;
+
+  VkMemoryDedicatedAllocateInfo dedicatedInfo = {};
+  dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+  dedicatedInfo.pNext = &importInfo;
+  dedicatedInfo.image = *image;
+
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.pNext = &dedicatedInfo;
+  allocInfo.allocationSize = props.allocationSize;
+  allocInfo.memoryTypeIndex = found;
+  if (vkAllocateMemory(device, &allocInfo, nullptr, memory) != VK_SUCCESS) {
+    RTC_LOG(LS_ERROR) << "vkAllocateMemory failed";
+    vkDestroyImage(device, *image, nullptr);
+    *image = VK_NULL_HANDLE;
+    return false;
+  }
+
+  if (vkBindImageMemory(device, *image, *memory, 0) != VK_SUCCESS) {
+    RTC_LOG(LS_ERROR) << "vkBindImageMemory failed";
+    vkFreeMemory(device, *memory, nullptr);
+    vkDestroyImage(device, *image, nullptr);
+    *memory = VK_NULL_HANDLE;
+    *image = VK_NULL_HANDLE;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace sora
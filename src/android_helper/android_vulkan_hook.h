@@ -0,0 +1,34 @@
+#ifndef ANDROID_VULKAN_HOOK_H_
+#define ANDROID_VULKAN_HOOK_H_
+
+#include <android/hardware_buffer.h>
+
+#ifndef VK_USE_PLATFORM_ANDROID_KHR
+#define VK_USE_PLATFORM_ANDROID_KHR
+#endif
+#include <vulkan/vulkan.h>
+
+#include "unity/IUnityInterface.h"
+
+namespace sora {
+
+// Unity が Vulkan のデバイスを作る時に、AHardwareBuffer を Vulkan から使うための拡張を追加する。
+// プラグインがプリロードされていないと間に合わないので、その場合は何もしない。
+void InterceptVulkanInitialization(IUnityInterfaces* ifs);
+
+// VK_ANDROID_external_memory_android_hardware_buffer が有効になっているかどうか
+bool IsVulkanAHardwareBufferEnabled();
+
+// AHardwareBuffer のメモリを使った RGBA の VkImage を作る。
+// 失敗した場合は途中まで作ったものを解放して false を返す
+bool ImportAHardwareBufferImage(VkDevice device,
+                                AHardwareBuffer* buffer,
+                                int width,
+                                int height,
+                                VkImageUsageFlags usage,
+                                VkImage* image,
+                                VkDeviceMemory* memory);
+
+}  // namespace sora
+
+#endif  // ANDROID_VULKAN_HOOK_H_
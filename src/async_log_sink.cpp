@@ -0,0 +1,94 @@
+#include "async_log_sink.h"
+
+#include <chrono>
+
+namespace sora {
+
+AsyncLogSink::AsyncLogSink(std::unique_ptr<rtc::LogSink> sink,
+                           size_t capacity)
+    : sink_(std::move(sink)) {
+  size_t n = 1;
+  while (n < capacity) {
+    n <<= 1;
+  }
+  mask_ = n - 1;
+  cells_.reset(new Cell[n]);
+  for (size_t i = 0; i < n; i++) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  thread_ = std::thread([this]() { Run(); });
+}
+
+AsyncLogSink::~AsyncLogSink() {
+  stopped_.store(true);
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    cond_.notify_one();
+  }
+  thread_.join();
+}
+
+void AsyncLogSink::OnLogMessage(const std::string& message) {
+  size_t index = write_index_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[index & mask_];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)index;
+    if (diff == 0) {
+      if (write_index_.compare_exchange_weak(index, index + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // 書き込むスレッドが追いついていない
+      dropped_count_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      index = write_index_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->message = message;
+  cell->sequence.store(index + 1, std::memory_order_release);
+  // 待っているとは限らないので、起こし損ねても Run のタイムアウトで拾う
+  cond_.notify_one();
+}
+
+bool AsyncLogSink::Pop(std::string* message) {
+  Cell& cell = cells_[read_index_ & mask_];
+  if (cell.sequence.load(std::memory_order_acquire) != read_index_ + 1) {
+    return false;
+  }
+  message->swap(cell.message);
+  cell.message.clear();
+  cell.sequence.store(read_index_ + mask_ + 1, std::memory_order_release);
+  read_index_++;
+  return true;
+}
+
+void AsyncLogSink::Run() {
+  std::string message;
+  uint64_t reported_dropped_count = 0;
+  while (true) {
+    bool stopped = stopped_.load();
+    while (Pop(&message)) {
+      sink_->OnLogMessage(message);
+    }
+    uint64_t dropped_count = dropped_count_.load(std::memory_order_relaxed);
+    if (dropped_count != reported_dropped_count) {
+      sink_->OnLogMessage("(AsyncLogSink) dropped " +
+                          std::to_string(dropped_count -
+                                         reported_dropped_count) +
+                          " log messages\n");
+      reported_dropped_count = dropped_count;
+    }
+    // 止める前に積まれていた分は書き出してから終わる
+    if (stopped) {
+      break;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait_for(lock, std::chrono::milliseconds(100));
+  }
+}
+
+}  // namespace sora
@@ -0,0 +1,65 @@
+#ifndef SORA_ASYNC_LOG_SINK_H_INCLUDED
+#define SORA_ASYNC_LOG_SINK_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// WebRTC
+#include "rtc_base/logging.h"
+
+namespace sora {
+
+// ログを書き込むスレッドを分けるための LogSink。
+// OnLogMessage はロックを使わない固定長のリングバッファに積むだけで、
+// ファイルへの書き込みは専用のスレッドから sink_ に渡して行う。
+// エンコーダやレンダリング、オーディオのスレッドがディスクの I/O で止まらないようにするためのもの。
+// 書き込みが追いつかずにリングバッファが一杯になった場合は、そのログを捨てて数えておく。
+class AsyncLogSink : public rtc::LogSink {
+ public:
+  // capacity は 2 のべき乗に切り上げる
+  AsyncLogSink(std::unique_ptr<rtc::LogSink> sink, size_t capacity);
+  ~AsyncLogSink() override;
+
+  // どのスレッドから呼んでもいい
+  void OnLogMessage(const std::string& message) override;
+
+  // リングバッファが一杯で捨てたログの数の累計
+  uint64_t dropped_count() const {
+    return dropped_count_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // 書き込むスレッドが 1 つなので、取り出す側は Run からしか呼ばない
+  bool Pop(std::string* message);
+  void Run();
+
+  // 書き込み側が複数の、シーケンス番号を使ったリングバッファ。
+  // sequence が index と同じなら空いていて、index + 1 なら書き込み済み
+  struct Cell {
+    std::atomic<size_t> sequence;
+    std::string message;
+  };
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  std::atomic<size_t> write_index_{0};
+  size_t read_index_ = 0;
+  std::atomic<uint64_t> dropped_count_{0};
+
+  std::unique_ptr<rtc::LogSink> sink_;
+  // 書き込むスレッドを起こすためだけに使い、OnLogMessage では取らない
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::atomic<bool> stopped_{false};
+  std::thread thread_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_ASYNC_LOG_SINK_H_INCLUDED
@@ -0,0 +1,101 @@
+#ifndef SORA_AUDIO_PLAYOUT_BUFFER_H_INCLUDED
+#define SORA_AUDIO_PLAYOUT_BUFFER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include "audio_sample_conversion.h"
+#include "spsc_ring_buffer.h"
+
+namespace sora {
+
+// 受信した int16 の音声を溜めておき、Unity のオーディオスレッドから float で取り出すためのバッファ。
+// 書き込むのは WebRTC から音声を取得するスレッド、読み込むのは Unity のオーディオスレッドで、
+// どちらも確保やロックをしない。
+class AudioPlayoutBuffer {
+ public:
+  explicit AudioPlayoutBuffer(size_t capacity) : data_(capacity) {}
+
+  // 書き込み側から呼ぶ。チャンネル数を変える時に呼ぶこと。
+  // 残っているデータは次の Read で捨てる。
+  void Reset(int channels) {
+    channels_ = channels;
+    reset_ = true;
+  }
+  int channels() const { return channels_; }
+
+  // 書き込み側から呼ぶ。入り切らない場合は何も書き込まずに false を返す
+  bool Write(const int16_t* data, size_t frames) {
+    return data_.Write(frames * channels_,
+                       [data](int16_t* dst, size_t offset, size_t count) {
+                         std::copy(data + offset, data + offset + count, dst);
+                       });
+  }
+  size_t AvailableFrames() const { return data_.Available() / channels_; }
+  size_t CapacityFrames() const { return data_.capacity() / channels_; }
+
+  // 読み込み側から呼ぶ。frames フレーム分を channels チャンネルの float で dst に書き込む。
+  // 足りない分は無音にする。
+  void Read(float* dst, int frames, int channels) {
+    if (reset_.exchange(false)) {
+      data_.Clear();
+    }
+    last_read_frames_ = frames;
+    last_read_at_ = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    const int src_channels = channels_;
+    const int kChunkFrames = 480;
+    int16_t s16[kChunkFrames * 2];
+    float f32[kChunkFrames * 2];
+    int done = 0;
+    while (done < frames) {
+      int n = std::min(frames - done, kChunkFrames);
+      int got = (int)(data_.Read(s16, n * src_channels) / src_channels);
+      float* out = dst + done * channels;
+      if (src_channels == channels) {
+        Int16ToFloat(s16, out, got * channels);
+      } else {
+        Int16ToFloat(s16, f32, got * src_channels);
+        for (int i = 0; i < got; i++) {
+          for (int c = 0; c < channels; c++) {
+            // モノラルの場合は全てのチャンネルに同じ音を入れる
+            out[i * channels + c] =
+                src_channels == 1 ? f32[i]
+                : c < src_channels ? f32[i * src_channels + c] : 0.0f;
+          }
+        }
+      }
+      if (got < n) {
+        std::fill(out + got * channels, out + n * channels, 0.0f);
+        underrun_frames_ += n - got;
+      }
+      done += n;
+    }
+  }
+
+  // Unity が最後に 1 回で取り出したフレーム数。書き込み側が溜めておく量の目安にする
+  int last_read_frames() const { return last_read_frames_; }
+  // 最後に Read が呼ばれた時刻。一度も呼ばれていなければ steady_clock の起点になる
+  std::chrono::steady_clock::time_point last_read_at() const {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(last_read_at_));
+  }
+  // 足りずに無音にしたフレーム数の累計
+  uint64_t underrun_frames() const { return underrun_frames_; }
+
+ private:
+  SpscRingBuffer<int16_t> data_;
+  std::atomic_int channels_ = {1};
+  std::atomic_bool reset_ = {false};
+  std::atomic_int last_read_frames_ = {0};
+  std::atomic<std::chrono::steady_clock::rep> last_read_at_ = {0};
+  std::atomic<uint64_t> underrun_frames_ = {0};
+};
+
+}  // namespace sora
+
+#endif  // SORA_AUDIO_PLAYOUT_BUFFER_H_INCLUDED
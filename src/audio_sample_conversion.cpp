@@ -0,0 +1,157 @@
+#include "audio_sample_conversion.h"
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#include <emmintrin.h>
+#define SORA_AUDIO_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SORA_AUDIO_NEON
+#endif
+
+namespace sora {
+
+namespace {
+
+// 1.0 は 32768 になるが、int16 に詰める時に 32767 に飽和させる
+const float kInt16Scale = 32768.0f;
+
+// SSE2、NEON、スカラーのどれで変換しても結果が同じになるように、
+// NaN は -1.0 として扱い、0.5 は 0 から遠い方に丸める。
+// SIMD で変換するのは 8 サンプル単位なので、残りはここで変換する。
+int16_t FloatToInt16Scalar(float v) {
+  v = (v > 1.0f ? 1.0f : v > -1.0f ? v : -1.0f) * kInt16Scale;
+  int n = (int)(v >= 0 ? v + 0.5f : v - 0.5f);
+  return (int16_t)std::min(std::max(n, -32768), 32767);
+}
+
+}  // namespace
+
+void FloatToInt16(const float* src, int16_t* dst, size_t size) {
+  size_t i = 0;
+#if defined(SORA_AUDIO_SSE2)
+  const __m128 min = _mm_set1_ps(-1.0f);
+  const __m128 max = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(kInt16Scale);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  for (; i + 8 <= size; i += 8) {
+    __m128 a = _mm_loadu_ps(src + i);
+    __m128 b = _mm_loadu_ps(src + i + 4);
+    // _mm_max_ps はどちらかが NaN なら 2 番目を返すので、NaN は -1.0 になる
+    a = _mm_mul_ps(_mm_min_ps(_mm_max_ps(a, min), max), scale);
+    b = _mm_mul_ps(_mm_min_ps(_mm_max_ps(b, min), max), scale);
+    // _mm_cvtps_epi32 は 0.5 を偶数に丸めるので、符号を付けた 0.5 を足して
+    // 0 方向に丸める _mm_cvttps_epi32 で変換する
+    a = _mm_add_ps(a, _mm_or_ps(half, _mm_and_ps(a, sign)));
+    b = _mm_add_ps(b, _mm_or_ps(half, _mm_and_ps(b, sign)));
+    __m128i s = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+    _mm_storeu_si128((__m128i*)(dst + i), s);
+  }
+#elif defined(SORA_AUDIO_NEON)
+  const float32x4_t min = vdupq_n_f32(-1.0f);
+  const float32x4_t max = vdupq_n_f32(1.0f);
+  const float32x4_t scale = vdupq_n_f32(kInt16Scale);
+  const float32x4_t half = vdupq_n_f32(0.5f);
+  for (; i + 8 <= size; i += 8) {
+    float32x4_t a = vld1q_f32(src + i);
+    float32x4_t b = vld1q_f32(src + i + 4);
+    // vmaxq_f32 は NaN をそのまま返すので、先に NaN を -1.0 に置き換える
+    a = vbslq_f32(vceqq_f32(a, a), a, min);
+    b = vbslq_f32(vceqq_f32(b, b), b, min);
+    a = vmulq_f32(vminq_f32(vmaxq_f32(a, min), max), scale);
+    b = vmulq_f32(vminq_f32(vmaxq_f32(b, min), max), scale);
+    // vcvtq_s32_f32 は 0 方向に丸めるので、符号に合わせて 0.5 を足してから変換する
+    a = vaddq_f32(a, vbslq_f32(vcltq_f32(a, vdupq_n_f32(0.0f)),
+                               vnegq_f32(half), half));
+    b = vaddq_f32(b, vbslq_f32(vcltq_f32(b, vdupq_n_f32(0.0f)),
+                               vnegq_f32(half), half));
+    int16x8_t s = vcombine_s16(vqmovn_s32(vcvtq_s32_f32(a)),
+                               vqmovn_s32(vcvtq_s32_f32(b)));
+    vst1q_s16(dst + i, s);
+  }
+#endif
+  for (; i < size; i++) {
+    dst[i] = FloatToInt16Scalar(src[i]);
+  }
+}
+
+void Int16ToFloat(const int16_t* src, float* dst, size_t size) {
+  const float kScale = 1.0f / kInt16Scale;
+  size_t i = 0;
+#if defined(SORA_AUDIO_SSE2)
+  const __m128 scale = _mm_set1_ps(kScale);
+  for (; i + 8 <= size; i += 8) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    // 符号拡張して 32bit にする
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#elif defined(SORA_AUDIO_NEON)
+  const float32x4_t scale = vdupq_n_f32(kScale);
+  for (; i + 8 <= size; i += 8) {
+    int16x8_t s = vld1q_s16(src + i);
+    int32x4_t lo = vmovl_s16(vget_low_s16(s));
+    int32x4_t hi = vmovl_s16(vget_high_s16(s));
+    vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(lo), scale));
+    vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(hi), scale));
+  }
+#endif
+  for (; i < size; i++) {
+    dst[i] = src[i] * kScale;
+  }
+}
+
+void DownmixToStereo(const float* src,
+                     int channels,
+                     float* dst,
+                     size_t frames) {
+  // チャンネルごとの左右への係数。
+  // Unity のチャンネルの並びは FL, FR, C, LFE, RL, RR, SL, SR の順番で、
+  // Quad は FL, FR, RL, RR、Surround は FL, FR, C, RL, RR になる。
+  const float kSide = 0.7071f;
+  static const float kQuad[][2] = {{1, 0}, {0, 1}, {kSide, 0}, {0, kSide}};
+  static const float kSurround[][2] = {
+      {1, 0}, {0, 1}, {kSide, kSide}, {kSide, 0}, {0, kSide}};
+  static const float k5Point1[][2] = {{1, 0},     {0, 1},    {kSide, kSide},
+                                      {0, 0},     {kSide, 0}, {0, kSide}};
+  static const float k7Point1[][2] = {
+      {1, 0},     {0, 1},    {kSide, kSide}, {0, 0},
+      {kSide, 0}, {0, kSide}, {kSide, 0},    {0, kSide}};
+  const float(*matrix)[2] = channels == 4   ? kQuad
+                            : channels == 5 ? kSurround
+                            : channels == 6 ? k5Point1
+                            : channels == 8 ? k7Point1
+                                            : nullptr;
+  if (matrix == nullptr) {
+    for (size_t i = 0; i < frames; i++) {
+      dst[i * 2 + 0] = src[i * channels + 0];
+      dst[i * 2 + 1] = channels >= 2 ? src[i * channels + 1] : src[i];
+    }
+    return;
+  }
+
+  // クリップしないように、片側の係数の合計で割っておく
+  float scale = 0;
+  for (int c = 0; c < channels; c++) {
+    scale += matrix[c][0];
+  }
+  scale = 1.0f / scale;
+  for (size_t i = 0; i < frames; i++) {
+    const float* s = src + i * channels;
+    float l = 0;
+    float r = 0;
+    for (int c = 0; c < channels; c++) {
+      l += s[c] * matrix[c][0];
+      r += s[c] * matrix[c][1];
+    }
+    dst[i * 2 + 0] = l * scale;
+    dst[i * 2 + 1] = r * scale;
+  }
+}
+
+}  // namespace sora
@@ -0,0 +1,24 @@
+#ifndef SORA_AUDIO_SAMPLE_CONVERSION_H_INCLUDED
+#define SORA_AUDIO_SAMPLE_CONVERSION_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sora {
+
+// Unity の float のサンプル (-1.0〜1.0) と WebRTC の int16 のサンプルを変換する。
+// x86 では SSE2、ARM では NEON を使ってまとめて変換する。
+
+// 範囲外の値は -1.0〜1.0 に、NaN は -1.0 にしてから変換する。
+// 0.5 は 0 から遠い方に丸める
+void FloatToInt16(const float* src, int16_t* dst, size_t size);
+void Int16ToFloat(const int16_t* src, float* dst, size_t size);
+
+// Unity のスピーカー構成 (4/5/6/8 チャンネル) の float のサンプルを
+// ステレオに混ぜる。LFE は使わない。
+// 知らないチャンネル数の場合は最初の 2 チャンネルをそのまま使う。
+void DownmixToStereo(const float* src, int channels, float* dst, size_t frames);
+
+}  // namespace sora
+
+#endif  // SORA_AUDIO_SAMPLE_CONVERSION_H_INCLUDED
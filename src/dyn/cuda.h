@@ -3,6 +3,11 @@
 
 #include <cuda.h>
 
+#if defined(WIN32)
+#include <d3d11.h>
+#include <cudaD3D11.h>
+#endif
+
 #include "dyn.h"
 
 namespace dyn {
@@ -18,6 +23,8 @@ DYN_REGISTER(CUDA_SO, cuDeviceGetCount);
 DYN_REGISTER(CUDA_SO, cuDeviceGetName);
 DYN_REGISTER(CUDA_SO, cuCtxCreate);
 DYN_REGISTER(CUDA_SO, cuCtxDestroy);
+DYN_REGISTER(CUDA_SO, cuDevicePrimaryCtxRetain);
+DYN_REGISTER(CUDA_SO, cuDevicePrimaryCtxRelease);
 DYN_REGISTER(CUDA_SO, cuCtxPushCurrent);
 DYN_REGISTER(CUDA_SO, cuCtxPopCurrent);
 DYN_REGISTER(CUDA_SO, cuGetErrorName);
@@ -28,6 +35,14 @@ DYN_REGISTER(CUDA_SO, cuMemcpy2D);
 DYN_REGISTER(CUDA_SO, cuMemcpy2DAsync);
 DYN_REGISTER(CUDA_SO, cuMemcpy2DUnaligned);
 DYN_REGISTER(CUDA_SO, cuStreamSynchronize);
+DYN_REGISTER(CUDA_SO, cuGraphicsUnregisterResource);
+DYN_REGISTER(CUDA_SO, cuGraphicsMapResources);
+DYN_REGISTER(CUDA_SO, cuGraphicsUnmapResources);
+DYN_REGISTER(CUDA_SO, cuGraphicsSubResourceGetMappedArray);
+#if defined(WIN32)
+DYN_REGISTER(CUDA_SO, cuD3D11GetDevice);
+DYN_REGISTER(CUDA_SO, cuGraphicsD3D11RegisterResource);
+#endif
 
 }  // namespace dyn
 
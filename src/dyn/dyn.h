@@ -3,6 +3,7 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #if defined(_WIN32)
@@ -27,27 +28,12 @@ class DynModule {
   typedef void* module_ptr_t;
 #endif
 
-  bool IsLoadable(const char* name) {
-#if defined(_WIN32)
-    module_ptr_t module = LoadLibraryA(name);
-    if (module == nullptr) {
-        return false;
-    }
-    FreeLibrary(module);
-    return true;
-#elif defined(__linux__)
-    module_ptr_t module = dlopen(name, RTLD_LAZY);
-    if (module == nullptr) {
-      return false;
-    }
-    dlclose(module);
-    return true;
-#else
-    return false;
-#endif
-  }
+  // ロードできた場合はそのまま保持しておき、後で Get した時に再度ロードしないようにする
+  bool IsLoadable(const char* name) { return Get(name) != nullptr; }
 
+  // 複数のスレッドから呼ばれるのでロックする
   module_ptr_t Get(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex_);
     auto it = modules_.find(name);
     if (it != modules_.end()) {
       return it->second.get();
@@ -95,6 +81,7 @@ class DynModule {
     }
   };
 
+  std::mutex mutex_;
   std::map<std::string, std::unique_ptr<module_t, dlcloser>> modules_;
 };
 }  // namespace dyn
@@ -111,11 +98,12 @@ class DynModule {
 
 #define DYN_STRINGIZE_I(text) #text
 
+// 関数のアドレスは最初に呼んだ時に 1 回だけ取得する
 #define DYN_REGISTER(soname, func)                              \
   template <class... Args>                                      \
   inline auto func(Args... args) {                              \
     typedef std::add_pointer<decltype(::func)>::type func_type; \
-    auto f = (func_type)DynModule::Instance().GetFunc(soname, DYN_STRINGIZE(func)); \
+    static auto f = (func_type)DynModule::Instance().GetFunc(soname, DYN_STRINGIZE(func)); \
     if (f == nullptr) {                                         \
       exit(1);                                                  \
     }                                                           \
@@ -0,0 +1,54 @@
+#include "encoder_stats.h"
+
+namespace sora {
+
+const size_t EncoderStats::kSizeBucketLimits[kSizeBucketCount - 1] = {
+    1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024,
+};
+
+EncoderStats& EncoderStats::Instance() {
+  static EncoderStats instance;
+  return instance;
+}
+
+void EncoderStats::Add(size_t size,
+                       bool key_frame,
+                       int qp,
+                       int64_t latency_us) {
+  frames_.fetch_add(1, std::memory_order_relaxed);
+  if (key_frame) {
+    key_frames_.fetch_add(1, std::memory_order_relaxed);
+  }
+  total_bytes_.fetch_add(size, std::memory_order_relaxed);
+  if (qp > 0) {
+    total_qp_.fetch_add(qp, std::memory_order_relaxed);
+  }
+  total_latency_us_.fetch_add(latency_us, std::memory_order_relaxed);
+  int64_t current = max_latency_us_.load(std::memory_order_relaxed);
+  while (latency_us > current &&
+         !max_latency_us_.compare_exchange_weak(current, latency_us,
+                                                std::memory_order_relaxed)) {
+  }
+
+  int bucket = 0;
+  while (bucket < kSizeBucketCount - 1 && size >= kSizeBucketLimits[bucket]) {
+    bucket++;
+  }
+  size_buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+EncoderStats::Snapshot EncoderStats::Get() const {
+  Snapshot s;
+  s.frames = frames_.load(std::memory_order_relaxed);
+  s.key_frames = key_frames_.load(std::memory_order_relaxed);
+  s.total_bytes = total_bytes_.load(std::memory_order_relaxed);
+  s.total_qp = total_qp_.load(std::memory_order_relaxed);
+  s.total_latency_us = total_latency_us_.load(std::memory_order_relaxed);
+  s.max_latency_us = max_latency_us_.load(std::memory_order_relaxed);
+  for (int i = 0; i < kSizeBucketCount; i++) {
+    s.size_buckets[i] = size_buckets_[i].load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+}  // namespace sora
@@ -0,0 +1,47 @@
+#ifndef SORA_ENCODER_STATS_H_INCLUDED
+#define SORA_ENCODER_STATS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace sora {
+
+// ハードウェアエンコーダが報告するフレームごとの情報を、プロセス全体で数える。
+// ビットストリームを解析せずに取れる値だけを使う
+class EncoderStats {
+ public:
+  // フレームサイズの分布の区切り (バイト)。最後の区間はそれ以上全部
+  static const int kSizeBucketCount = 6;
+  static const size_t kSizeBucketLimits[kSizeBucketCount - 1];
+
+  struct Snapshot {
+    uint64_t frames;
+    uint64_t key_frames;
+    uint64_t total_bytes;
+    uint64_t total_qp;
+    int64_t total_latency_us;
+    int64_t max_latency_us;
+    uint64_t size_buckets[kSizeBucketCount];
+  };
+
+  static EncoderStats& Instance();
+
+  // latency_us はエンコーダにフレームを投入してから出力を受け取るまでの時間
+  void Add(size_t size, bool key_frame, int qp, int64_t latency_us);
+  Snapshot Get() const;
+
+ private:
+  std::atomic<uint64_t> frames_ = {0};
+  std::atomic<uint64_t> key_frames_ = {0};
+  std::atomic<uint64_t> total_bytes_ = {0};
+  std::atomic<uint64_t> total_qp_ = {0};
+  std::atomic<int64_t> total_latency_us_ = {0};
+  std::atomic<int64_t> max_latency_us_ = {0};
+  std::atomic<uint64_t> size_buckets_[kSizeBucketCount] = {};
+};
+
+}  // namespace sora
+
+#endif  // SORA_ENCODER_STATS_H_INCLUDED
@@ -0,0 +1,609 @@
+#include "amf_h264_encoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "common_video/h264/h264_common.h"
+#include "libyuv.h"
+#include "modules/video_coding/codecs/h264/include/h264.h"
+#include "modules/video_coding/include/video_error_codes.h"
+#include "rtc_base/logging.h"
+
+// AMF
+#include <AMF/components/VideoConverter.h>
+#include <AMF/components/VideoEncoderVCE.h>
+#include <AMF/core/Factory.h>
+
+#include "dyn/dyn.h"
+#include "log_rate_limiter.h"
+#include "perf_counters.h"
+#include "rtc/d3d11_texture_buffer.h"
+#include "rtc/dxgi_adapter.h"
+
+const int kLowH264QpThreshold = 34;
+const int kHighH264QpThreshold = 40;
+
+// DXGI_ADAPTER_DESC::VendorId
+const UINT kAmdVendorId = 0x1002;
+
+using Microsoft::WRL::ComPtr;
+
+// AMF のランタイムはドライバに入っているので、リンクせずに実行時に読み込む。
+// 読み込めなかった場合は nullptr を返す
+static amf::AMFFactory* GetAmfFactory() {
+  static amf::AMFFactory* factory = []() -> amf::AMFFactory* {
+    AMFInit_Fn init = (AMFInit_Fn)dyn::DynModule::Instance().GetFunc(
+        AMF_DLL_NAMEA, AMF_INIT_FUNCTION_NAME);
+    if (init == nullptr) {
+      RTC_LOG(LS_INFO) << AMF_DLL_NAMEA << " is not found";
+      return nullptr;
+    }
+    amf::AMFFactory* f = nullptr;
+    AMF_RESULT res = init(AMF_FULL_VERSION, &f);
+    if (res != AMF_OK) {
+      RTC_LOG(LS_WARNING) << "AMFInit is failed: res=" << res;
+      return nullptr;
+    }
+    return f;
+  }();
+  return factory;
+}
+
+// adapter_luid のアダプタに D3D11 のデバイスを作って AMF のコンテキストを初期化する
+static bool CreateAmfContext(const LUID& adapter_luid,
+                             ComPtr<ID3D11Device>* device,
+                             ComPtr<ID3D11DeviceContext>* device_context,
+                             amf::AMFContextPtr* context) {
+  amf::AMFFactory* factory = GetAmfFactory();
+  if (factory == nullptr) {
+    return false;
+  }
+  ComPtr<IDXGIAdapter> adapter = sora::FindAdapter(adapter_luid);
+  if (adapter == nullptr) {
+    RTC_LOG(LS_WARNING) << "Adapter not found";
+    return false;
+  }
+  HRESULT hr = D3D11CreateDevice(
+      adapter.Get(), D3D_DRIVER_TYPE_UNKNOWN, NULL, 0, NULL, 0,
+      D3D11_SDK_VERSION, device->GetAddressOf(), NULL,
+      device_context->GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING) << "D3D11CreateDevice is failed: hr=" << hr;
+    return false;
+  }
+  AMF_RESULT res = factory->CreateContext(&(*context));
+  if (res != AMF_OK) {
+    RTC_LOG(LS_WARNING) << "AMFFactory::CreateContext is failed: res=" << res;
+    return false;
+  }
+  res = (*context)->InitDX11(device->Get());
+  if (res != AMF_OK) {
+    RTC_LOG(LS_WARNING) << "AMFContext::InitDX11 is failed: res=" << res;
+    (*context)->Terminate();
+    *context = nullptr;
+    return false;
+  }
+  RTC_LOG(LS_INFO) << "AMF context: adapter="
+                   << sora::GetAdapterName(adapter.Get());
+  return true;
+}
+
+static amf_int64 ToAmfProfile(webrtc::H264::Profile profile) {
+  switch (profile) {
+    case webrtc::H264::kProfileConstrainedBaseline:
+      return AMF_VIDEO_ENCODER_PROFILE_CONSTRAINED_BASELINE;
+    case webrtc::H264::kProfileBaseline:
+      return AMF_VIDEO_ENCODER_PROFILE_BASELINE;
+    case webrtc::H264::kProfileMain:
+      return AMF_VIDEO_ENCODER_PROFILE_MAIN;
+    case webrtc::H264::kProfileConstrainedHigh:
+      return AMF_VIDEO_ENCODER_PROFILE_CONSTRAINED_HIGH;
+    case webrtc::H264::kProfileHigh:
+      return AMF_VIDEO_ENCODER_PROFILE_HIGH;
+  }
+  return AMF_VIDEO_ENCODER_PROFILE_CONSTRAINED_BASELINE;
+}
+
+static amf_int64 ToAmfLevel(webrtc::H264::Level level) {
+  // webrtc::H264::Level は 1b 以外 level_idc と同じ値になっている。
+  // AMF には 1b が無いので、それより低い 1 にする
+  if (level == webrtc::H264::kLevel1_b) {
+    return webrtc::H264::kLevel1;
+  }
+  return static_cast<amf_int64>(level);
+}
+
+AmfH264Encoder::AmfH264Encoder(const cricket::VideoCodec& codec,
+                               LUID adapter_luid)
+    : adapter_luid_(adapter_luid) {
+  absl::optional<webrtc::H264::ProfileLevelId> profile_level_id =
+      webrtc::H264::ParseSdpProfileLevelId(codec.params);
+  if (profile_level_id) {
+    profile_ = profile_level_id->profile;
+    level_ = profile_level_id->level;
+  } else {
+    RTC_LOG(LS_WARNING) << "Invalid profile-level-id";
+  }
+  RTC_LOG(INFO) << __FUNCTION__ << " profile:" << profile_
+                << " level:" << level_;
+}
+
+AmfH264Encoder::~AmfH264Encoder() {
+  Release();
+}
+
+bool AmfH264Encoder::IsSupported() {
+  // 調べている最中に呼ばれた場合は、結果が出るまで待つ
+  static const bool supported = []() {
+    LUID adapter_luid;
+    if (!sora::FindAdapterLuidByVendor(kAmdVendorId, {}, &adapter_luid)) {
+      return false;
+    }
+    ComPtr<ID3D11Device> device;
+    ComPtr<ID3D11DeviceContext> device_context;
+    amf::AMFContextPtr context;
+    if (!CreateAmfContext(adapter_luid, &device, &device_context, &context)) {
+      return false;
+    }
+    amf::AMFComponentPtr encoder;
+    AMF_RESULT res = GetAmfFactory()->CreateComponent(
+        context, AMFVideoEncoderVCE_AVC, &encoder);
+    if (res != AMF_OK) {
+      RTC_LOG(LS_INFO) << "AMFFactory::CreateComponent is failed: res="
+                       << res;
+      context->Terminate();
+      return false;
+    }
+    encoder->Terminate();
+    context->Terminate();
+    return true;
+  }();
+  return supported;
+}
+
+int32_t AmfH264Encoder::InitEncode(const webrtc::VideoCodec* codec_settings,
+                                   int32_t number_of_cores,
+                                   size_t max_payload_size) {
+  RTC_DCHECK(codec_settings);
+  RTC_DCHECK_EQ(codec_settings->codecType, webrtc::kVideoCodecH264);
+
+  // simulcast の場合は SimulcastEncoderAdapter にレイヤーごとに作ってもらう
+  if (codec_settings->numberOfSimulcastStreams > 1) {
+    return WEBRTC_VIDEO_CODEC_ERR_SIMULCAST_PARAMETERS_NOT_SUPPORTED;
+  }
+
+  int32_t release_ret = Release();
+  if (release_ret != WEBRTC_VIDEO_CODEC_OK) {
+    return release_ret;
+  }
+
+  width_ = codec_settings->width;
+  height_ = codec_settings->height;
+  target_bitrate_bps_ = codec_settings->startBitrate * 1000;
+  max_bitrate_bps_ = codec_settings->maxBitrate * 1000;
+  bitrate_adjuster_.SetTargetBitrateBps(target_bitrate_bps_);
+  framerate_ = std::max<uint32_t>(codec_settings->maxFramerate, 1);
+  mode_ = codec_settings->mode;
+
+  RTC_LOG(LS_INFO) << "InitEncode " << width_ << "x" << height_ << " "
+                   << target_bitrate_bps_ << "bit/sec " << framerate_ << "fps";
+
+  encoded_image_._completeFrame = true;
+  encoded_image_._encodedWidth = 0;
+  encoded_image_._encodedHeight = 0;
+  encoded_image_.timing_.flags =
+      webrtc::VideoSendTiming::TimingFrameFlags::kInvalid;
+  encoded_image_.content_type_ =
+      (codec_settings->mode == webrtc::VideoCodecMode::kScreensharing)
+          ? webrtc::VideoContentType::SCREENSHARE
+          : webrtc::VideoContentType::UNSPECIFIED;
+
+  return InitAmf();
+}
+
+int32_t AmfH264Encoder::InitAmf() {
+  LUID adapter_luid;
+  if (!sora::FindAdapterLuidByVendor(kAmdVendorId, adapter_luid_,
+                                     &adapter_luid)) {
+    RTC_LOG(LS_ERROR) << "AMD adapter not found";
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  adapter_luid_ = adapter_luid;
+  if (!CreateAmfContext(adapter_luid_, &d3d11_device_, &d3d11_context_,
+                        &context_)) {
+    ReleaseAmf();
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  AMF_RESULT res = GetAmfFactory()->CreateComponent(
+      context_, AMFVideoEncoderVCE_AVC, &encoder_);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_ERROR) << "AMFFactory::CreateComponent is failed: res=" << res;
+    ReleaseAmf();
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  // NVENC の NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ に合わせて、
+  // 1 フレーム入れたら 1 フレーム出てくる低遅延の CBR にする
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_USAGE,
+                        AMF_VIDEO_ENCODER_USAGE_ULTRA_LOW_LATENCY);
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_PROFILE, ToAmfProfile(profile_));
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_PROFILE_LEVEL, ToAmfLevel(level_));
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_QUALITY_PRESET,
+                        AMF_VIDEO_ENCODER_QUALITY_PRESET_SPEED);
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_FRAMESIZE,
+                        ::AMFConstructSize(width_, height_));
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_B_PIC_PATTERN, (amf_int64)0);
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_MAX_NUM_REFRAMES, (amf_int64)1);
+  // 周期的な IDR は入れず、キーフレーム要求があった時だけ入れる
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_IDR_PERIOD, (amf_int64)0);
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_RATE_CONTROL_METHOD,
+                        AMF_VIDEO_ENCODER_RATE_CONTROL_METHOD_CBR);
+  // 帯域が余った時にフィラーで埋めない
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_FILLER_DATA_ENABLE, false);
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_ENFORCE_HRD, false);
+  SetRateProperties();
+
+  res = encoder_->Init(amf::AMF_SURFACE_NV12, width_, height_);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_ERROR) << "AMFComponent::Init is failed: res=" << res;
+    ReleaseAmf();
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  RTC_LOG(LS_INFO) << "AMF encoder initialized: " << width_ << "x" << height_;
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void AmfH264Encoder::SetRateProperties() {
+  amf_int64 bitrate = bitrate_adjuster_.GetAdjustedBitrateBps();
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_TARGET_BITRATE, bitrate);
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_PEAK_BITRATE,
+                        std::max<amf_int64>(bitrate, max_bitrate_bps_));
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_FRAMERATE,
+                        ::AMFConstructRate(framerate_, 1));
+  // NVENC と同じく VBV は 1 フレーム分にする
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_VBV_BUFFER_SIZE,
+                        bitrate / framerate_);
+  encoder_->SetProperty(AMF_VIDEO_ENCODER_INITIAL_VBV_BUFFER_FULLNESS,
+                        (amf_int64)64);
+}
+
+void AmfH264Encoder::ReleaseAmf() {
+  if (converter_ != nullptr) {
+    converter_->Terminate();
+    converter_ = nullptr;
+  }
+  if (encoder_ != nullptr) {
+    encoder_->Terminate();
+    encoder_ = nullptr;
+  }
+  if (context_ != nullptr) {
+    context_->Terminate();
+    context_ = nullptr;
+  }
+  converter_failed_ = false;
+  shared_textures_.clear();
+  copy_texture_.Reset();
+  d3d11_context_.Reset();
+  d3d11_device_.Reset();
+}
+
+int32_t AmfH264Encoder::RegisterEncodeCompleteCallback(
+    webrtc::EncodedImageCallback* callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  callback_ = callback;
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t AmfH264Encoder::Release() {
+  ReleaseAmf();
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+amf::AMFSurfacePtr AmfH264Encoder::CreateHostSurface(
+    webrtc::VideoFrameBuffer* frame_buffer) {
+  amf::AMFSurfacePtr surface;
+  AMF_RESULT res = context_->AllocSurface(
+      amf::AMF_MEMORY_HOST, amf::AMF_SURFACE_NV12, width_, height_, &surface);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_ERROR) << "AMFContext::AllocSurface is failed: res=" << res;
+    return nullptr;
+  }
+  amf::AMFPlane* plane_y = surface->GetPlane(amf::AMF_PLANE_Y);
+  amf::AMFPlane* plane_uv = surface->GetPlane(amf::AMF_PLANE_UV);
+  uint8_t* dst_y = (uint8_t*)plane_y->GetNative();
+  uint8_t* dst_uv = (uint8_t*)plane_uv->GetNative();
+  int pitch_y = plane_y->GetHPitch();
+  int pitch_uv = plane_uv->GetHPitch();
+  if (frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNV12) {
+    const webrtc::NV12BufferInterface* nv12 = frame_buffer->GetNV12();
+    libyuv::CopyPlane(nv12->DataY(), nv12->StrideY(), dst_y, pitch_y, width_,
+                      height_);
+    libyuv::CopyPlane(nv12->DataUV(), nv12->StrideUV(), dst_uv, pitch_uv,
+                      (width_ + 1) / 2 * 2, (height_ + 1) / 2);
+    return surface;
+  }
+  rtc::scoped_refptr<webrtc::I420BufferInterface> i420 =
+      frame_buffer->ToI420();
+  if (!i420) {
+    return nullptr;
+  }
+  libyuv::I420ToNV12(i420->DataY(), i420->StrideY(), i420->DataU(),
+                     i420->StrideU(), i420->DataV(), i420->StrideV(), dst_y,
+                     pitch_y, dst_uv, pitch_uv, width_, height_);
+  return surface;
+}
+
+bool AmfH264Encoder::InitConverter() {
+  // 変換元のテクスチャ。Unity のテクスチャは縮小時に左上だけ使うので、その部分だけコピーする
+  D3D11_TEXTURE2D_DESC desc = {};
+  desc.Width = width_;
+  desc.Height = height_;
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D11_USAGE_DEFAULT;
+  desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+  HRESULT hr = d3d11_device_->CreateTexture2D(&desc, NULL,
+                                              copy_texture_.GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING) << "CreateTexture2D is failed: hr=" << hr;
+    return false;
+  }
+
+  AMF_RESULT res = GetAmfFactory()->CreateComponent(
+      context_, AMFVideoConverter, &converter_);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_WARNING) << "AMFFactory::CreateComponent is failed: res="
+                        << res;
+    return false;
+  }
+  converter_->SetProperty(AMF_VIDEO_CONVERTER_MEMORY_TYPE,
+                          amf::AMF_MEMORY_DX11);
+  converter_->SetProperty(AMF_VIDEO_CONVERTER_OUTPUT_FORMAT,
+                          amf::AMF_SURFACE_NV12);
+  converter_->SetProperty(AMF_VIDEO_CONVERTER_OUTPUT_SIZE,
+                          ::AMFConstructSize(width_, height_));
+  res = converter_->Init(amf::AMF_SURFACE_BGRA, width_, height_);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_WARNING) << "AMFComponent::Init is failed: res=" << res;
+    return false;
+  }
+  return true;
+}
+
+amf::AMFSurfacePtr AmfH264Encoder::CreateTextureSurface(
+    sora::D3D11TextureBuffer* buffer) {
+  // 別のアダプタのテクスチャは開けないので、ToI420 で読み出す
+  if (converter_failed_ ||
+      !sora::IsSameAdapterLuid(buffer->adapter_luid(), adapter_luid_)) {
+    return nullptr;
+  }
+  if (converter_ == nullptr && !InitConverter()) {
+    converter_failed_ = true;
+    if (converter_ != nullptr) {
+      converter_->Terminate();
+      converter_ = nullptr;
+    }
+    copy_texture_.Reset();
+    return nullptr;
+  }
+
+  ComPtr<ID3D11Texture2D>& texture = shared_textures_[buffer->shared_handle()];
+  if (texture == nullptr) {
+    HRESULT hr = d3d11_device_->OpenSharedResource(
+        buffer->shared_handle(), __uuidof(ID3D11Texture2D),
+        (void**)texture.GetAddressOf());
+    if (FAILED(hr)) {
+      RTC_LOG(LS_WARNING) << "ID3D11Device::OpenSharedResource is failed: hr="
+                          << hr;
+      return nullptr;
+    }
+  }
+
+  ComPtr<IDXGIKeyedMutex> keyed_mutex;
+  texture.As(&keyed_mutex);
+  if (keyed_mutex == nullptr || keyed_mutex->AcquireSync(0, 1000) != S_OK) {
+    RTC_LOG(LS_ERROR) << "IDXGIKeyedMutex::AcquireSync is failed";
+    return nullptr;
+  }
+  D3D11_BOX box = {0, 0, 0, width_, height_, 1};
+  d3d11_context_->CopySubresourceRegion(copy_texture_.Get(), 0, 0, 0, 0,
+                                        texture.Get(), 0, &box);
+  keyed_mutex->ReleaseSync(0);
+
+  amf::AMFSurfacePtr bgra;
+  AMF_RESULT res = context_->CreateSurfaceFromDX11Native(copy_texture_.Get(),
+                                                         &bgra, nullptr);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_ERROR)
+        << "AMFContext::CreateSurfaceFromDX11Native is failed: res=" << res;
+    return nullptr;
+  }
+  res = converter_->SubmitInput(bgra);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_ERROR) << "AMFComponent::SubmitInput is failed: res=" << res;
+    return nullptr;
+  }
+  amf::AMFDataPtr data;
+  res = converter_->QueryOutput(&data);
+  if (res != AMF_OK || data == nullptr) {
+    RTC_LOG(LS_ERROR) << "AMFComponent::QueryOutput is failed: res=" << res;
+    return nullptr;
+  }
+  return amf::AMFSurfacePtr(data);
+}
+
+int32_t AmfH264Encoder::Encode(
+    const webrtc::VideoFrame& frame,
+    const std::vector<webrtc::VideoFrameType>* frame_types) {
+  ScopedPerfTimer timer(PerfStage::kEncode);
+  if (encoder_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  if (!callback_) {
+    RTC_LOG(LS_WARNING)
+        << "InitEncode() has been called, but a callback function "
+        << "has not been set with RegisterEncodeCompleteCallback()";
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame_buffer =
+      frame.video_frame_buffer();
+  if ((uint32_t)frame_buffer->width() != width_ ||
+      (uint32_t)frame_buffer->height() != height_) {
+    RTC_LOG(LS_WARNING) << "Unexpected frame size: " << frame_buffer->width()
+                        << "x" << frame_buffer->height();
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  if (reconfigure_needed_) {
+    // ビットレートとフレームレートはエンコード中に変えられる
+    SetRateProperties();
+    reconfigure_needed_ = false;
+  }
+
+  amf::AMFSurfacePtr surface;
+  // Unity のカメラのテクスチャは GPU で NV12 に変換する
+  if (auto texture_buffer =
+          dynamic_cast<sora::D3D11TextureBuffer*>(frame_buffer.get())) {
+    surface = CreateTextureSurface(texture_buffer);
+  }
+  if (surface == nullptr) {
+    surface = CreateHostSurface(frame_buffer.get());
+  }
+  if (surface == nullptr) {
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  // AMF の pts は 100 ナノ秒単位
+  surface->SetPts((amf_pts)frame.timestamp() * AMF_SECOND / 90000);
+
+  if (frame_types != nullptr && !frame_types->empty() &&
+      (*frame_types)[0] == webrtc::VideoFrameType::kVideoFrameKey) {
+    surface->SetProperty(AMF_VIDEO_ENCODER_FORCE_PICTURE_TYPE,
+                         AMF_VIDEO_ENCODER_PICTURE_TYPE_IDR);
+    surface->SetProperty(AMF_VIDEO_ENCODER_INSERT_SPS, true);
+    surface->SetProperty(AMF_VIDEO_ENCODER_INSERT_PPS, true);
+  }
+
+  AMF_RESULT res = encoder_->SubmitInput(surface);
+  if (res != AMF_OK) {
+    RTC_LOG(LS_ERROR) << "AMFComponent::SubmitInput is failed: res=" << res;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  // ULTRA_LOW_LATENCY なので、入れたフレームはすぐに出てくる
+  amf::AMFDataPtr data;
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(1000);
+  while (true) {
+    res = encoder_->QueryOutput(&data);
+    if (res != AMF_REPEAT || std::chrono::steady_clock::now() > deadline) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (res != AMF_OK || data == nullptr) {
+    RTC_LOG(LS_ERROR) << "AMFComponent::QueryOutput is failed: res=" << res;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  amf::AMFBufferPtr output(data);
+  const uint8_t* p = (const uint8_t*)output->GetNative();
+  size_t size = output->GetSize();
+  amf_int64 output_type = AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_P;
+  output->GetProperty(AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE, &output_type);
+  bool key_frame = output_type == AMF_VIDEO_ENCODER_OUTPUT_DATA_TYPE_IDR;
+
+  rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> encoded_data;
+  if (auto buffer = encoded_buffer_pool_.Create(size)) {
+    memcpy(buffer->data(), p, size);
+    encoded_data = buffer;
+  } else {
+    encoded_data = webrtc::EncodedImageBuffer::Create(p, size);
+  }
+  // 出力バッファはすぐに AMF に返す
+  output = nullptr;
+  data = nullptr;
+
+  const uint8_t* encoded = encoded_data->data();
+  encoded_image_.SetEncodedData(encoded_data);
+  encoded_image_._encodedWidth = width_;
+  encoded_image_._encodedHeight = height_;
+  encoded_image_.SetTimestamp(frame.timestamp());
+  encoded_image_.ntp_time_ms_ = frame.ntp_time_ms();
+  encoded_image_.capture_time_ms_ = frame.render_time_ms();
+  encoded_image_.rotation_ = frame.rotation();
+  encoded_image_.SetColorSpace(frame.color_space());
+  encoded_image_._frameType = key_frame
+                                  ? webrtc::VideoFrameType::kVideoFrameKey
+                                  : webrtc::VideoFrameType::kVideoFrameDelta;
+
+  webrtc::CodecSpecificInfo codec_specific;
+  codec_specific.codecType = webrtc::kVideoCodecH264;
+  codec_specific.codecSpecific.H264.packetization_mode =
+      webrtc::H264PacketizationMode::NonInterleaved;
+
+  h264_bitstream_parser_.ParseBitstream(encoded, size);
+  h264_bitstream_parser_.GetLastSliceQp(&encoded_image_.qp_);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (callback_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+  webrtc::EncodedImageCallback::Result result =
+      callback_->OnEncodedImage(encoded_image_, &codec_specific);
+  if (result.error != webrtc::EncodedImageCallback::Result::OK) {
+    RTC_LOG(LS_ERROR) << __FUNCTION__
+                      << " OnEncodedImage failed error:" << result.error;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  bitrate_adjuster_.Update(size);
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void AmfH264Encoder::SetRates(
+    const webrtc::VideoEncoder::RateControlParameters& parameters) {
+  if (encoder_ == nullptr) {
+    RTC_LOG(LS_WARNING) << "SetRates() while uninitialized.";
+    return;
+  }
+
+  if (parameters.framerate_fps < 1.0) {
+    RTC_LOG(LS_WARNING) << "Invalid frame rate: " << parameters.framerate_fps;
+    return;
+  }
+
+  uint32_t new_framerate = (uint32_t)parameters.framerate_fps;
+  uint32_t new_bitrate = parameters.bitrate.get_sum_bps();
+  // 帯域の推定が変わる度に呼ばれるので間引く
+  SORA_LOG_RATE_LIMITED(LS_INFO, 1000)
+      << __FUNCTION__ << " framerate_:" << framerate_
+      << " new_framerate: " << new_framerate
+      << " target_bitrate_bps:" << target_bitrate_bps_
+      << " new_bitrate:" << new_bitrate
+      << " max_bitrate_bps:" << max_bitrate_bps_;
+  if (new_bitrate == 0) {
+    return;
+  }
+  if (new_bitrate == target_bitrate_bps_ && new_framerate == framerate_) {
+    return;
+  }
+  target_bitrate_bps_ = new_bitrate;
+  bitrate_adjuster_.SetTargetBitrateBps(target_bitrate_bps_);
+  framerate_ = new_framerate;
+  reconfigure_needed_ = true;
+}
+
+webrtc::VideoEncoder::EncoderInfo AmfH264Encoder::GetEncoderInfo() const {
+  webrtc::VideoEncoder::EncoderInfo info;
+  info.supports_native_handle = true;
+  info.implementation_name = "AMD AMF H264";
+  info.scaling_settings = webrtc::VideoEncoder::ScalingSettings(
+      kLowH264QpThreshold, kHighH264QpThreshold);
+  info.is_hardware_accelerated = true;
+  info.has_internal_source = false;
+  return info;
+}
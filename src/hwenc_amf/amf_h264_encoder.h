@@ -0,0 +1,94 @@
+#ifndef AMF_H264_ENCODER_H_
+#define AMF_H264_ENCODER_H_
+
+#include <d3d11.h>
+#include <wrl.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "api/video_codecs/video_encoder.h"
+#include "common_video/h264/h264_bitstream_parser.h"
+#include "common_video/include/bitrate_adjuster.h"
+#include "media/base/codec.h"
+#include "media/base/h264_profile_level_id.h"
+
+// AMF
+#include <AMF/components/Component.h>
+#include <AMF/core/Context.h>
+
+#include "rtc/encoded_image_buffer_pool.h"
+
+namespace sora {
+class D3D11TextureBuffer;
+}
+
+// AMD の AMF (VCE/VCN) の H.264 エンコーダ。
+// Unity のテクスチャと同じアダプタで動かせる場合は、テクスチャをコピーして
+// AMF の VideoConverter で NV12 に変換してから渡す。それ以外は I420 を経由する。
+// simulcast には対応しないので、SimulcastEncoderAdapter で包んで使う
+class AmfH264Encoder : public webrtc::VideoEncoder {
+ public:
+  // adapter_luid が AMD のアダプタならそれを使い、そうでなければ最初に見つかった AMD のアダプタを使う
+  AmfH264Encoder(const cricket::VideoCodec& codec, LUID adapter_luid);
+  ~AmfH264Encoder() override;
+
+  // AMF のランタイムを読み込んでエンコーダを作れるか確認するので重い。結果はプロセスで覚えておく
+  static bool IsSupported();
+
+  int32_t InitEncode(const webrtc::VideoCodec* codec_settings,
+                     int32_t number_of_cores,
+                     size_t max_payload_size) override;
+  int32_t RegisterEncodeCompleteCallback(
+      webrtc::EncodedImageCallback* callback) override;
+  int32_t Release() override;
+  int32_t Encode(
+      const webrtc::VideoFrame& frame,
+      const std::vector<webrtc::VideoFrameType>* frame_types) override;
+  void SetRates(
+      const webrtc::VideoEncoder::RateControlParameters& parameters) override;
+  webrtc::VideoEncoder::EncoderInfo GetEncoderInfo() const override;
+
+ private:
+  int32_t InitAmf();
+  void ReleaseAmf();
+  void SetRateProperties();
+  amf::AMFSurfacePtr CreateHostSurface(webrtc::VideoFrameBuffer* frame_buffer);
+  amf::AMFSurfacePtr CreateTextureSurface(sora::D3D11TextureBuffer* buffer);
+  bool InitConverter();
+
+  std::mutex mutex_;
+  webrtc::EncodedImageCallback* callback_ = nullptr;
+
+  LUID adapter_luid_;
+  Microsoft::WRL::ComPtr<ID3D11Device> d3d11_device_;
+  Microsoft::WRL::ComPtr<ID3D11DeviceContext> d3d11_context_;
+  amf::AMFContextPtr context_;
+  amf::AMFComponentPtr encoder_;
+  // BGRA のテクスチャを NV12 に変換する。最初にテクスチャを受け取った時に作る
+  amf::AMFComponentPtr converter_;
+  bool converter_failed_ = false;
+  // Unity のテクスチャはキー付きミューテックスを早く返すために、ここにコピーしてから使う
+  Microsoft::WRL::ComPtr<ID3D11Texture2D> copy_texture_;
+  // 共有ハンドルから開いたテクスチャ
+  std::map<HANDLE, Microsoft::WRL::ComPtr<ID3D11Texture2D>> shared_textures_;
+
+  webrtc::BitrateAdjuster bitrate_adjuster_{0.5, 0.95};
+  uint32_t target_bitrate_bps_ = 0;
+  uint32_t max_bitrate_bps_ = 0;
+  bool reconfigure_needed_ = false;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  uint32_t framerate_ = 30;
+  webrtc::VideoCodecMode mode_ = webrtc::VideoCodecMode::kRealtimeVideo;
+  webrtc::H264::Profile profile_ = webrtc::H264::kProfileConstrainedBaseline;
+  webrtc::H264::Level level_ = webrtc::H264::kLevel3_1;
+
+  webrtc::EncodedImage encoded_image_;
+  webrtc::H264BitstreamParser h264_bitstream_parser_;
+  sora::EncodedImageBufferPool encoded_buffer_pool_{16};
+};
+
+#endif  // AMF_H264_ENCODER_H_
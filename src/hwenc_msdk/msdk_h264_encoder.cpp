@@ -0,0 +1,652 @@
+#include "msdk_h264_encoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "common_video/h264/h264_common.h"
+#include "libyuv.h"
+#include "modules/video_coding/codecs/h264/include/h264.h"
+#include "modules/video_coding/include/video_error_codes.h"
+#include "rtc_base/logging.h"
+
+#include "log_rate_limiter.h"
+#include "perf_counters.h"
+#ifdef _WIN32
+#include "rtc/d3d11_texture_buffer.h"
+#include "rtc/dxgi_adapter.h"
+#endif
+
+const int kLowH264QpThreshold = 34;
+const int kHighH264QpThreshold = 40;
+
+#ifdef _WIN32
+using Microsoft::WRL::ComPtr;
+#endif
+
+static mfxU16 Align16(uint32_t value) {
+  return (mfxU16)((value + 15) & ~15);
+}
+
+static mfxU16 ToMfxProfile(webrtc::H264::Profile profile) {
+  switch (profile) {
+    case webrtc::H264::kProfileConstrainedBaseline:
+      return MFX_PROFILE_AVC_CONSTRAINED_BASELINE;
+    case webrtc::H264::kProfileBaseline:
+      return MFX_PROFILE_AVC_BASELINE;
+    case webrtc::H264::kProfileMain:
+      return MFX_PROFILE_AVC_MAIN;
+    case webrtc::H264::kProfileConstrainedHigh:
+      return MFX_PROFILE_AVC_CONSTRAINED_HIGH;
+    case webrtc::H264::kProfileHigh:
+      return MFX_PROFILE_AVC_HIGH;
+  }
+  return MFX_PROFILE_AVC_CONSTRAINED_BASELINE;
+}
+
+static mfxU16 ToMfxLevel(webrtc::H264::Level level) {
+  // webrtc::H264::Level は 1b 以外 MFX_LEVEL_AVC_* と同じ値になっている
+  if (level == webrtc::H264::kLevel1_b) {
+    return MFX_LEVEL_AVC_1b;
+  }
+  return static_cast<mfxU16>(level);
+}
+
+MsdkH264Encoder::MsdkH264Encoder(const cricket::VideoCodec& codec) {
+  absl::optional<webrtc::H264::ProfileLevelId> profile_level_id =
+      webrtc::H264::ParseSdpProfileLevelId(codec.params);
+  if (profile_level_id) {
+    profile_ = profile_level_id->profile;
+    level_ = profile_level_id->level;
+  } else {
+    RTC_LOG(LS_WARNING) << "Invalid profile-level-id";
+  }
+  RTC_LOG(INFO) << __FUNCTION__ << " profile:" << profile_
+                << " level:" << level_;
+}
+
+MsdkH264Encoder::~MsdkH264Encoder() {
+  Release();
+}
+
+bool MsdkH264Encoder::IsSupported() {
+  // 調べている最中に呼ばれた場合は、結果が出るまで待つ
+  static const bool supported = []() {
+    std::unique_ptr<MsdkSession> session = MsdkSession::Create();
+    if (session == nullptr) {
+      return false;
+    }
+    mfxVideoParam param;
+    mfxExtCodingOption coding_option;
+    mfxExtBuffer* ext_buffers[1];
+    MakeParams(&param, &coding_option, ext_buffers,
+               MFX_PROFILE_AVC_CONSTRAINED_BASELINE, MFX_LEVEL_AVC_31, 640,
+               480, 30, 1000000);
+    mfxVideoParam out = param;
+    out.ExtParam = nullptr;
+    out.NumExtParam = 0;
+    mfxStatus sts = MFXVideoENCODE_Query(session->session(), &param, &out);
+    if (sts < MFX_ERR_NONE) {
+      RTC_LOG(LS_INFO) << "MFXVideoENCODE_Query is failed: sts=" << sts;
+      return false;
+    }
+    return true;
+  }();
+  return supported;
+}
+
+void MsdkH264Encoder::MakeParams(mfxVideoParam* param,
+                                 mfxExtCodingOption* coding_option,
+                                 mfxExtBuffer** ext_buffers,
+                                 mfxU16 profile,
+                                 mfxU16 level,
+                                 uint32_t width,
+                                 uint32_t height,
+                                 uint32_t framerate,
+                                 uint32_t bitrate_bps) {
+  memset(param, 0, sizeof(*param));
+  param->mfx.CodecId = MFX_CODEC_AVC;
+  param->mfx.CodecProfile = profile;
+  param->mfx.CodecLevel = level;
+  param->mfx.TargetUsage = MFX_TARGETUSAGE_BALANCED;
+  // 遅延を増やさないように B フレームは使わず、参照も 1 枚だけにする
+  param->mfx.GopRefDist = 1;
+  param->mfx.NumRefFrame = 1;
+  param->mfx.IdrInterval = 0;
+  param->mfx.RateControlMethod = MFX_RATECONTROL_CBR;
+  // TargetKbps は 16 ビットなので、大きい場合は BRCParamMultiplier で割っておく
+  uint32_t kbps = std::max<uint32_t>(bitrate_bps / 1000, 1);
+  mfxU16 multiplier = (mfxU16)(kbps / 0x10000 + 1);
+  param->mfx.BRCParamMultiplier = multiplier;
+  param->mfx.TargetKbps = (mfxU16)(kbps / multiplier);
+  param->mfx.MaxKbps = param->mfx.TargetKbps;
+  param->mfx.FrameInfo.FourCC = MFX_FOURCC_NV12;
+  param->mfx.FrameInfo.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
+  param->mfx.FrameInfo.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
+  param->mfx.FrameInfo.FrameRateExtN = std::max<uint32_t>(framerate, 1);
+  param->mfx.FrameInfo.FrameRateExtD = 1;
+  param->mfx.FrameInfo.CropW = (mfxU16)width;
+  param->mfx.FrameInfo.CropH = (mfxU16)height;
+  param->mfx.FrameInfo.Width = Align16(width);
+  param->mfx.FrameInfo.Height = Align16(height);
+  param->IOPattern = MFX_IOPATTERN_IN_SYSTEM_MEMORY;
+  // 入力したフレームはすぐに出力させる
+  param->AsyncDepth = 1;
+
+  // HRD に従うとビットレートの変更でシーケンスを作り直すことになるので無効にする
+  memset(coding_option, 0, sizeof(*coding_option));
+  coding_option->Header.BufferId = MFX_EXTBUFF_CODING_OPTION;
+  coding_option->Header.BufferSz = sizeof(*coding_option);
+  coding_option->NalHrdConformance = MFX_CODINGOPTION_OFF;
+  coding_option->VuiNalHrdParameters = MFX_CODINGOPTION_OFF;
+  ext_buffers[0] = &coding_option->Header;
+  param->ExtParam = ext_buffers;
+  param->NumExtParam = 1;
+}
+
+int32_t MsdkH264Encoder::InitEncode(const webrtc::VideoCodec* codec_settings,
+                                    int32_t number_of_cores,
+                                    size_t max_payload_size) {
+  RTC_DCHECK(codec_settings);
+  RTC_DCHECK_EQ(codec_settings->codecType, webrtc::kVideoCodecH264);
+
+  // simulcast の場合は SimulcastEncoderAdapter にレイヤーごとに作ってもらう
+  if (codec_settings->numberOfSimulcastStreams > 1) {
+    return WEBRTC_VIDEO_CODEC_ERR_SIMULCAST_PARAMETERS_NOT_SUPPORTED;
+  }
+
+  int32_t release_ret = Release();
+  if (release_ret != WEBRTC_VIDEO_CODEC_OK) {
+    return release_ret;
+  }
+
+  width_ = codec_settings->width;
+  height_ = codec_settings->height;
+  target_bitrate_bps_ = codec_settings->startBitrate * 1000;
+  max_bitrate_bps_ = codec_settings->maxBitrate * 1000;
+  bitrate_adjuster_.SetTargetBitrateBps(target_bitrate_bps_);
+  framerate_ = codec_settings->maxFramerate;
+  mode_ = codec_settings->mode;
+
+  RTC_LOG(LS_INFO) << "InitEncode " << width_ << "x" << height_ << " "
+                   << target_bitrate_bps_ << "bit/sec " << framerate_ << "fps";
+
+  encoded_image_._completeFrame = true;
+  encoded_image_._encodedWidth = 0;
+  encoded_image_._encodedHeight = 0;
+  encoded_image_.timing_.flags =
+      webrtc::VideoSendTiming::TimingFrameFlags::kInvalid;
+  encoded_image_.content_type_ =
+      (codec_settings->mode == webrtc::VideoCodecMode::kScreensharing)
+          ? webrtc::VideoContentType::SCREENSHARE
+          : webrtc::VideoContentType::UNSPECIFIED;
+
+  return InitMsdk();
+}
+
+int32_t MsdkH264Encoder::InitMsdk() {
+  session_ = MsdkSession::Create();
+  if (session_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  MakeParams(&param_, &coding_option_, ext_buffers_, ToMfxProfile(profile_),
+             ToMfxLevel(level_), width_, height_, framerate_,
+             bitrate_adjuster_.GetAdjustedBitrateBps());
+
+  mfxFrameAllocRequest request = {};
+  mfxStatus sts = MFXVideoENCODE_QueryIOSurf(session_->session(), &param_, &request);
+  if (sts < MFX_ERR_NONE) {
+    RTC_LOG(LS_ERROR) << "MFXVideoENCODE_QueryIOSurf is failed: sts=" << sts;
+    ReleaseMsdk();
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  sts = MFXVideoENCODE_Init(session_->session(), &param_);
+  if (sts < MFX_ERR_NONE) {
+    RTC_LOG(LS_ERROR) << "MFXVideoENCODE_Init is failed: sts=" << sts;
+    ReleaseMsdk();
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  if (sts > MFX_ERR_NONE) {
+    // 対応していない設定は Init が近いものに変えてくれる
+    RTC_LOG(LS_WARNING) << "MFXVideoENCODE_Init adjusted params: sts=" << sts;
+  }
+  encoder_initialized_ = true;
+
+  // NV12 のサーフェスをシステムメモリに確保する
+  const mfxFrameInfo& info = param_.mfx.FrameInfo;
+  const size_t frame_size = (size_t)info.Width * info.Height * 3 / 2;
+  const int num_surfaces = std::max<int>(request.NumFrameSuggested, 1);
+  surface_buffer_.assign(frame_size * num_surfaces, 0);
+  surfaces_.assign(num_surfaces, mfxFrameSurface1());
+  for (int i = 0; i < num_surfaces; i++) {
+    mfxFrameSurface1& s = surfaces_[i];
+    memset(&s, 0, sizeof(s));
+    s.Info = info;
+    s.Data.Y = surface_buffer_.data() + frame_size * i;
+    s.Data.UV = s.Data.Y + (size_t)info.Width * info.Height;
+    s.Data.Pitch = info.Width;
+  }
+
+  mfxVideoParam actual = {};
+  MFXVideoENCODE_GetVideoParam(session_->session(), &actual);
+  size_t bitstream_size =
+      std::max<size_t>((size_t)actual.mfx.BufferSizeInKB *
+                           std::max<mfxU16>(actual.mfx.BRCParamMultiplier, 1) *
+                           1000,
+                       frame_size);
+  bitstream_buffer_.resize(bitstream_size);
+  memset(&bitstream_, 0, sizeof(bitstream_));
+  bitstream_.Data = bitstream_buffer_.data();
+  bitstream_.MaxLength = (mfxU32)bitstream_buffer_.size();
+
+  RTC_LOG(LS_INFO) << "MSDK encoder initialized: surfaces=" << num_surfaces
+                   << " bitstream=" << bitstream_size;
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void MsdkH264Encoder::ReleaseMsdk() {
+  if (encoder_initialized_) {
+    MFXVideoENCODE_Close(session_->session());
+    encoder_initialized_ = false;
+  }
+  session_.reset();
+  surfaces_.clear();
+  surface_buffer_.clear();
+  bitstream_buffer_.clear();
+}
+
+int32_t MsdkH264Encoder::RegisterEncodeCompleteCallback(
+    webrtc::EncodedImageCallback* callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  callback_ = callback;
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t MsdkH264Encoder::Release() {
+  ReleaseMsdk();
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+mfxFrameSurface1* MsdkH264Encoder::GetFreeSurface() {
+  for (auto& s : surfaces_) {
+    if (s.Data.Locked == 0) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+bool MsdkH264Encoder::CopyToSurface(webrtc::VideoFrameBuffer* frame_buffer,
+                                    mfxFrameSurface1* surface) {
+  uint8_t* dst_y = surface->Data.Y;
+  uint8_t* dst_uv = surface->Data.UV;
+  int pitch = surface->Data.Pitch;
+  if (frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNV12) {
+    const webrtc::NV12BufferInterface* nv12 = frame_buffer->GetNV12();
+    libyuv::CopyPlane(nv12->DataY(), nv12->StrideY(), dst_y, pitch, width_,
+                      height_);
+    libyuv::CopyPlane(nv12->DataUV(), nv12->StrideUV(), dst_uv, pitch,
+                      (width_ + 1) / 2 * 2, (height_ + 1) / 2);
+    return true;
+  }
+  rtc::scoped_refptr<webrtc::I420BufferInterface> i420 =
+      frame_buffer->ToI420();
+  if (!i420) {
+    return false;
+  }
+  libyuv::I420ToNV12(i420->DataY(), i420->StrideY(), i420->DataU(),
+                     i420->StrideU(), i420->DataV(), i420->StrideV(), dst_y,
+                     pitch, dst_uv, pitch, width_, height_);
+  return true;
+}
+
+int32_t MsdkH264Encoder::Encode(
+    const webrtc::VideoFrame& frame,
+    const std::vector<webrtc::VideoFrameType>* frame_types) {
+  ScopedPerfTimer timer(PerfStage::kEncode);
+  if (!encoder_initialized_) {
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  if (!callback_) {
+    RTC_LOG(LS_WARNING)
+        << "InitEncode() has been called, but a callback function "
+        << "has not been set with RegisterEncodeCompleteCallback()";
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame_buffer =
+      frame.video_frame_buffer();
+  if ((uint32_t)frame_buffer->width() != width_ ||
+      (uint32_t)frame_buffer->height() != height_) {
+    RTC_LOG(LS_WARNING) << "Unexpected frame size: " << frame_buffer->width()
+                        << "x" << frame_buffer->height();
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  if (reconfigure_needed_) {
+    // ビットレートとフレームレートはセッションを作り直さずに Reset で変えられる
+    MakeParams(&param_, &coding_option_, ext_buffers_, ToMfxProfile(profile_),
+               ToMfxLevel(level_), width_, height_, framerate_,
+               bitrate_adjuster_.GetAdjustedBitrateBps());
+    mfxStatus sts = MFXVideoENCODE_Reset(session_->session(), &param_);
+    if (sts < MFX_ERR_NONE) {
+      RTC_LOG(LS_WARNING) << "MFXVideoENCODE_Reset is failed: sts=" << sts;
+    }
+    reconfigure_needed_ = false;
+  }
+
+  mfxFrameSurface1* surface = GetFreeSurface();
+  if (surface == nullptr) {
+    RTC_LOG(LS_ERROR) << "No free surface";
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  bool copied = false;
+#ifdef _WIN32
+  // Unity のカメラのテクスチャは GPU で NV12 に変換してから読み出す
+  if (auto texture_buffer =
+          dynamic_cast<sora::D3D11TextureBuffer*>(frame_buffer.get())) {
+    copied = CopyTextureToSurface(texture_buffer, surface);
+  }
+#endif
+  if (!copied && !CopyToSurface(frame_buffer.get(), surface)) {
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  surface->Data.TimeStamp = frame.timestamp();
+
+  mfxEncodeCtrl ctrl = {};
+  mfxEncodeCtrl* pctrl = nullptr;
+  if (frame_types != nullptr && !frame_types->empty() &&
+      (*frame_types)[0] == webrtc::VideoFrameType::kVideoFrameKey) {
+    ctrl.FrameType = MFX_FRAMETYPE_I | MFX_FRAMETYPE_IDR | MFX_FRAMETYPE_REF;
+    pctrl = &ctrl;
+  }
+
+  mfxSyncPoint syncp = nullptr;
+  mfxStatus sts;
+  while (true) {
+    sts = MFXVideoENCODE_EncodeFrameAsync(session_->session(), pctrl, surface,
+                                          &bitstream_, &syncp);
+    if (sts != MFX_WRN_DEVICE_BUSY) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (sts == MFX_ERR_MORE_DATA) {
+    // まだ出力するフレームが無い
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+  if (sts < MFX_ERR_NONE || syncp == nullptr) {
+    RTC_LOG(LS_ERROR) << "MFXVideoENCODE_EncodeFrameAsync is failed: sts="
+                      << sts;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  sts = MFXVideoCORE_SyncOperation(session_->session(), syncp, 1000);
+  if (sts != MFX_ERR_NONE) {
+    RTC_LOG(LS_ERROR) << "MFXVideoCORE_SyncOperation is failed: sts=" << sts;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  const uint8_t* data = bitstream_.Data + bitstream_.DataOffset;
+  size_t size = bitstream_.DataLength;
+  bool key_frame = (bitstream_.FrameType & MFX_FRAMETYPE_IDR) != 0;
+  rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> encoded_data;
+  if (auto buffer = encoded_buffer_pool_.Create(size)) {
+    memcpy(buffer->data(), data, size);
+    encoded_data = buffer;
+  } else {
+    encoded_data = webrtc::EncodedImageBuffer::Create(data, size);
+  }
+  bitstream_.DataOffset = 0;
+  bitstream_.DataLength = 0;
+
+  data = encoded_data->data();
+  encoded_image_.SetEncodedData(encoded_data);
+  encoded_image_._encodedWidth = width_;
+  encoded_image_._encodedHeight = height_;
+  encoded_image_.SetTimestamp(frame.timestamp());
+  encoded_image_.ntp_time_ms_ = frame.ntp_time_ms();
+  encoded_image_.capture_time_ms_ = frame.render_time_ms();
+  encoded_image_.rotation_ = frame.rotation();
+  encoded_image_.SetColorSpace(frame.color_space());
+  encoded_image_._frameType = key_frame
+                                  ? webrtc::VideoFrameType::kVideoFrameKey
+                                  : webrtc::VideoFrameType::kVideoFrameDelta;
+
+  webrtc::CodecSpecificInfo codec_specific;
+  codec_specific.codecType = webrtc::kVideoCodecH264;
+  codec_specific.codecSpecific.H264.packetization_mode =
+      webrtc::H264PacketizationMode::NonInterleaved;
+
+  h264_bitstream_parser_.ParseBitstream(data, size);
+  h264_bitstream_parser_.GetLastSliceQp(&encoded_image_.qp_);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (callback_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+  webrtc::EncodedImageCallback::Result result =
+      callback_->OnEncodedImage(encoded_image_, &codec_specific);
+  if (result.error != webrtc::EncodedImageCallback::Result::OK) {
+    RTC_LOG(LS_ERROR) << __FUNCTION__
+                      << " OnEncodedImage failed error:" << result.error;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  bitrate_adjuster_.Update(size);
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void MsdkH264Encoder::SetRates(
+    const webrtc::VideoEncoder::RateControlParameters& parameters) {
+  if (!encoder_initialized_) {
+    RTC_LOG(LS_WARNING) << "SetRates() while uninitialized.";
+    return;
+  }
+
+  if (parameters.framerate_fps < 1.0) {
+    RTC_LOG(LS_WARNING) << "Invalid frame rate: " << parameters.framerate_fps;
+    return;
+  }
+
+  uint32_t new_framerate = (uint32_t)parameters.framerate_fps;
+  uint32_t new_bitrate = parameters.bitrate.get_sum_bps();
+  // 帯域の推定が変わる度に呼ばれるので間引く
+  SORA_LOG_RATE_LIMITED(LS_INFO, 1000)
+      << __FUNCTION__ << " framerate_:" << framerate_
+      << " new_framerate: " << new_framerate
+      << " target_bitrate_bps:" << target_bitrate_bps_
+      << " new_bitrate:" << new_bitrate
+      << " max_bitrate_bps:" << max_bitrate_bps_;
+  if (new_bitrate == 0) {
+    return;
+  }
+  if (new_bitrate == target_bitrate_bps_ && new_framerate == framerate_) {
+    return;
+  }
+  target_bitrate_bps_ = new_bitrate;
+  bitrate_adjuster_.SetTargetBitrateBps(target_bitrate_bps_);
+  framerate_ = new_framerate;
+  reconfigure_needed_ = true;
+}
+
+webrtc::VideoEncoder::EncoderInfo MsdkH264Encoder::GetEncoderInfo() const {
+  webrtc::VideoEncoder::EncoderInfo info;
+  info.supports_native_handle = true;
+  info.implementation_name = "Intel QSV H264";
+  info.scaling_settings = webrtc::VideoEncoder::ScalingSettings(
+      kLowH264QpThreshold, kHighH264QpThreshold);
+  info.is_hardware_accelerated = true;
+  info.has_internal_source = false;
+  return info;
+}
+
+#ifdef _WIN32
+bool MsdkH264Encoder::InitTextureConverter(const LUID& adapter_luid) {
+  // Unity のテクスチャを共有ハンドルで開けるように、テクスチャと同じアダプタを使う
+  ComPtr<IDXGIAdapter> adapter = sora::FindAdapter(adapter_luid);
+  if (adapter == nullptr) {
+    RTC_LOG(LS_WARNING) << "Adapter not found";
+    return false;
+  }
+  HRESULT hr = D3D11CreateDevice(
+      adapter.Get(), D3D_DRIVER_TYPE_UNKNOWN, NULL, 0, NULL, 0,
+      D3D11_SDK_VERSION, d3d11_device_.GetAddressOf(), NULL,
+      d3d11_context_.GetAddressOf());
+  if (FAILED(hr) || FAILED(d3d11_device_.As(&video_device_)) ||
+      FAILED(d3d11_context_.As(&video_context_))) {
+    RTC_LOG(LS_WARNING) << "ID3D11VideoDevice is not available: hr=" << hr;
+    return false;
+  }
+
+  D3D11_VIDEO_PROCESSOR_CONTENT_DESC content_desc = {};
+  content_desc.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+  content_desc.InputFrameRate = {framerate_, 1};
+  content_desc.InputWidth = width_;
+  content_desc.InputHeight = height_;
+  content_desc.OutputFrameRate = {framerate_, 1};
+  content_desc.OutputWidth = width_;
+  content_desc.OutputHeight = height_;
+  content_desc.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+  hr = video_device_->CreateVideoProcessorEnumerator(
+      &content_desc, vp_enumerator_.GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING)
+        << "ID3D11VideoDevice::CreateVideoProcessorEnumerator is failed: hr="
+        << hr;
+    return false;
+  }
+  hr = video_device_->CreateVideoProcessor(vp_enumerator_.Get(), 0,
+                                           vp_.GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING)
+        << "ID3D11VideoDevice::CreateVideoProcessor is failed: hr=" << hr;
+    return false;
+  }
+  video_context_->VideoProcessorSetStreamFrameFormat(
+      vp_.Get(), 0, D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE);
+  video_context_->VideoProcessorSetStreamAutoProcessingMode(vp_.Get(), 0,
+                                                            FALSE);
+
+  // 変換先と、CPU から読み出すためのステージングテクスチャ
+  D3D11_TEXTURE2D_DESC desc = {};
+  desc.Width = width_;
+  desc.Height = height_;
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = DXGI_FORMAT_NV12;
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D11_USAGE_DEFAULT;
+  desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+  hr = d3d11_device_->CreateTexture2D(&desc, NULL,
+                                      nv12_texture_.GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING) << "CreateTexture2D is failed: hr=" << hr;
+    return false;
+  }
+  desc.Usage = D3D11_USAGE_STAGING;
+  desc.BindFlags = 0;
+  desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+  hr = d3d11_device_->CreateTexture2D(&desc, NULL,
+                                      staging_texture_.GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING) << "CreateTexture2D is failed: hr=" << hr;
+    return false;
+  }
+
+  D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC output_desc = {};
+  output_desc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+  hr = video_device_->CreateVideoProcessorOutputView(
+      nv12_texture_.Get(), vp_enumerator_.Get(), &output_desc,
+      vp_output_view_.GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING)
+        << "ID3D11VideoDevice::CreateVideoProcessorOutputView is failed: hr="
+        << hr;
+    return false;
+  }
+  return true;
+}
+
+bool MsdkH264Encoder::CopyTextureToSurface(sora::D3D11TextureBuffer* buffer,
+                                           mfxFrameSurface1* surface) {
+  if (texture_failed_) {
+    return false;
+  }
+  if (d3d11_device_ == nullptr &&
+      !InitTextureConverter(buffer->adapter_luid())) {
+    texture_failed_ = true;
+    d3d11_device_.Reset();
+    return false;
+  }
+
+  ComPtr<ID3D11Texture2D>& texture = shared_textures_[buffer->shared_handle()];
+  if (texture == nullptr) {
+    HRESULT hr = d3d11_device_->OpenSharedResource(
+        buffer->shared_handle(), __uuidof(ID3D11Texture2D),
+        (void**)texture.GetAddressOf());
+    if (FAILED(hr)) {
+      RTC_LOG(LS_WARNING) << "ID3D11Device::OpenSharedResource is failed: hr="
+                          << hr;
+      return false;
+    }
+  }
+  ComPtr<ID3D11VideoProcessorInputView>& input_view =
+      vp_input_views_[texture.Get()];
+  if (input_view == nullptr) {
+    D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC desc = {};
+    desc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+    HRESULT hr = video_device_->CreateVideoProcessorInputView(
+        texture.Get(), vp_enumerator_.Get(), &desc, input_view.GetAddressOf());
+    if (FAILED(hr)) {
+      RTC_LOG(LS_WARNING)
+          << "ID3D11VideoDevice::CreateVideoProcessorInputView is failed: hr="
+          << hr;
+      vp_input_views_.erase(texture.Get());
+      return false;
+    }
+  }
+
+  // テクスチャが縮小されている場合は左上だけを使う
+  RECT rect = {0, 0, (LONG)width_, (LONG)height_};
+  video_context_->VideoProcessorSetStreamSourceRect(vp_.Get(), 0, TRUE, &rect);
+  ComPtr<IDXGIKeyedMutex> keyed_mutex;
+  texture.As(&keyed_mutex);
+  if (keyed_mutex == nullptr || keyed_mutex->AcquireSync(0, 1000) != S_OK) {
+    RTC_LOG(LS_ERROR) << "IDXGIKeyedMutex::AcquireSync is failed";
+    return false;
+  }
+  D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+  stream.Enable = TRUE;
+  stream.pInputSurface = input_view.Get();
+  HRESULT hr = video_context_->VideoProcessorBlt(
+      vp_.Get(), vp_output_view_.Get(), 0, 1, &stream);
+  keyed_mutex->ReleaseSync(0);
+  if (FAILED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11VideoContext::VideoProcessorBlt is failed: hr="
+                      << hr;
+    return false;
+  }
+
+  // BGRA の 4 バイトではなく、NV12 の 1.5 バイトだけ読み出す
+  d3d11_context_->CopyResource(staging_texture_.Get(), nv12_texture_.Get());
+  D3D11_MAPPED_SUBRESOURCE map;
+  hr = d3d11_context_->Map(staging_texture_.Get(), 0, D3D11_MAP_READ, 0, &map);
+  if (FAILED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11DeviceContext::Map is failed: hr=" << hr;
+    return false;
+  }
+  const uint8_t* src_y = (const uint8_t*)map.pData;
+  const uint8_t* src_uv = src_y + (size_t)map.RowPitch * height_;
+  libyuv::CopyPlane(src_y, map.RowPitch, surface->Data.Y, surface->Data.Pitch,
+                    width_, height_);
+  libyuv::CopyPlane(src_uv, map.RowPitch, surface->Data.UV,
+                    surface->Data.Pitch, (width_ + 1) / 2 * 2,
+                    (height_ + 1) / 2);
+  d3d11_context_->Unmap(staging_texture_.Get(), 0);
+  return true;
+}
+#endif
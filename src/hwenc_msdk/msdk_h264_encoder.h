@@ -0,0 +1,126 @@
+#ifndef MSDK_H264_ENCODER_H_
+#define MSDK_H264_ENCODER_H_
+
+#ifdef _WIN32
+#include <d3d11.h>
+#include <wrl.h>
+#endif
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "api/video_codecs/video_encoder.h"
+#include "common_video/h264/h264_bitstream_parser.h"
+#include "common_video/include/bitrate_adjuster.h"
+#include "media/base/codec.h"
+#include "media/base/h264_profile_level_id.h"
+
+#include "msdk_session.h"
+#include "rtc/encoded_image_buffer_pool.h"
+
+#ifdef _WIN32
+namespace sora {
+class D3D11TextureBuffer;
+}
+#endif
+
+// Intel Quick Sync Video の H.264 エンコーダ。
+// NvCodecH264Encoder と同じく Unity のカメラのテクスチャを受け取れるが、
+// サーフェスはシステムメモリに置くので、GPU 上で NV12 に変換してから読み出して渡す。
+// simulcast には対応しないので、SimulcastEncoderAdapter で包んで使う
+class MsdkH264Encoder : public webrtc::VideoEncoder {
+ public:
+  explicit MsdkH264Encoder(const cricket::VideoCodec& codec);
+  ~MsdkH264Encoder() override;
+
+  // 実際にセッションを作ってエンコーダの設定を確認するので重い。結果はプロセスで覚えておく
+  static bool IsSupported();
+
+  int32_t InitEncode(const webrtc::VideoCodec* codec_settings,
+                     int32_t number_of_cores,
+                     size_t max_payload_size) override;
+  int32_t RegisterEncodeCompleteCallback(
+      webrtc::EncodedImageCallback* callback) override;
+  int32_t Release() override;
+  int32_t Encode(
+      const webrtc::VideoFrame& frame,
+      const std::vector<webrtc::VideoFrameType>* frame_types) override;
+  void SetRates(
+      const webrtc::VideoEncoder::RateControlParameters& parameters) override;
+  webrtc::VideoEncoder::EncoderInfo GetEncoderInfo() const override;
+
+ private:
+  static void MakeParams(mfxVideoParam* param,
+                         mfxExtCodingOption* coding_option,
+                         mfxExtBuffer** ext_buffers,
+                         mfxU16 profile,
+                         mfxU16 level,
+                         uint32_t width,
+                         uint32_t height,
+                         uint32_t framerate,
+                         uint32_t bitrate_bps);
+  int32_t InitMsdk();
+  void ReleaseMsdk();
+  mfxFrameSurface1* GetFreeSurface();
+  bool CopyToSurface(webrtc::VideoFrameBuffer* frame_buffer,
+                     mfxFrameSurface1* surface);
+#ifdef _WIN32
+  bool InitTextureConverter(const LUID& adapter_luid);
+  bool CopyTextureToSurface(sora::D3D11TextureBuffer* buffer,
+                            mfxFrameSurface1* surface);
+#endif
+
+  std::mutex mutex_;
+  webrtc::EncodedImageCallback* callback_ = nullptr;
+
+  std::unique_ptr<MsdkSession> session_;
+  bool encoder_initialized_ = false;
+  mfxVideoParam param_ = {};
+  mfxExtCodingOption coding_option_ = {};
+  mfxExtBuffer* ext_buffers_[1] = {};
+  // エンコーダが参照している間は上書きできないので、QueryIOSurf で求めた数だけ用意する
+  std::vector<mfxFrameSurface1> surfaces_;
+  std::vector<uint8_t> surface_buffer_;
+  mfxBitstream bitstream_ = {};
+  std::vector<uint8_t> bitstream_buffer_;
+
+  webrtc::BitrateAdjuster bitrate_adjuster_{0.5, 0.95};
+  uint32_t target_bitrate_bps_ = 0;
+  uint32_t max_bitrate_bps_ = 0;
+  bool reconfigure_needed_ = false;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  uint32_t framerate_ = 30;
+  webrtc::VideoCodecMode mode_ = webrtc::VideoCodecMode::kRealtimeVideo;
+  webrtc::H264::Profile profile_ = webrtc::H264::kProfileConstrainedBaseline;
+  webrtc::H264::Level level_ = webrtc::H264::kLevel3_1;
+
+  webrtc::EncodedImage encoded_image_;
+  webrtc::H264BitstreamParser h264_bitstream_parser_;
+  sora::EncodedImageBufferPool encoded_buffer_pool_{16};
+
+#ifdef _WIN32
+  // Unity のテクスチャを開いて NV12 に変換するためのデバイス。
+  // テクスチャのアダプタに作るので、QSV とは別の GPU の場合もある
+  Microsoft::WRL::ComPtr<ID3D11Device> d3d11_device_;
+  Microsoft::WRL::ComPtr<ID3D11DeviceContext> d3d11_context_;
+  Microsoft::WRL::ComPtr<ID3D11VideoDevice> video_device_;
+  Microsoft::WRL::ComPtr<ID3D11VideoContext> video_context_;
+  Microsoft::WRL::ComPtr<ID3D11VideoProcessorEnumerator> vp_enumerator_;
+  Microsoft::WRL::ComPtr<ID3D11VideoProcessor> vp_;
+  Microsoft::WRL::ComPtr<ID3D11Texture2D> nv12_texture_;
+  Microsoft::WRL::ComPtr<ID3D11Texture2D> staging_texture_;
+  Microsoft::WRL::ComPtr<ID3D11VideoProcessorOutputView> vp_output_view_;
+  // 共有ハンドルから開いたテクスチャとその入力ビュー。開けなかったハンドルは nullptr を入れておく
+  std::map<HANDLE, Microsoft::WRL::ComPtr<ID3D11Texture2D>> shared_textures_;
+  std::map<ID3D11Texture2D*,
+           Microsoft::WRL::ComPtr<ID3D11VideoProcessorInputView>>
+      vp_input_views_;
+  // 変換の準備に失敗したら、以降は I420 を経由する
+  bool texture_failed_ = false;
+#endif
+};
+
+#endif  // MSDK_H264_ENCODER_H_
@@ -0,0 +1,61 @@
+#include "msdk_session.h"
+
+// WebRTC
+#include <rtc_base/logging.h>
+
+static bool SetFilterU32(mfxLoader loader, const char* name, mfxU32 value) {
+  mfxConfig config = MFXCreateConfig(loader);
+  if (config == nullptr) {
+    return false;
+  }
+  mfxVariant v = {};
+  v.Type = MFX_VARIANT_TYPE_U32;
+  v.Data.U32 = value;
+  return MFXSetConfigFilterProperty(config, (const mfxU8*)name, v) ==
+         MFX_ERR_NONE;
+}
+
+std::unique_ptr<MsdkSession> MsdkSession::Create() {
+  std::unique_ptr<MsdkSession> p(new MsdkSession());
+  p->loader_ = MFXLoad();
+  if (p->loader_ == nullptr) {
+    RTC_LOG(LS_WARNING) << "MFXLoad is failed";
+    return nullptr;
+  }
+  // ソフトウェア実装は使わない
+  if (!SetFilterU32(p->loader_, "mfxImplDescription.Impl",
+                    MFX_IMPL_TYPE_HARDWARE)) {
+    RTC_LOG(LS_WARNING) << "MFXSetConfigFilterProperty is failed";
+    return nullptr;
+  }
+#if defined(_WIN32)
+  SetFilterU32(p->loader_, "mfxImplDescription.AccelerationMode",
+               MFX_ACCEL_MODE_VIA_D3D11);
+#endif
+
+  mfxStatus sts = MFXCreateSession(p->loader_, 0, &p->session_);
+  if (sts != MFX_ERR_NONE) {
+    // Intel の GPU が無い場合はここで失敗する
+    RTC_LOG(LS_INFO) << "MFXCreateSession is failed: sts=" << sts;
+    p->session_ = nullptr;
+    return nullptr;
+  }
+
+  mfxIMPL impl = 0;
+  mfxVersion version = {};
+  MFXQueryIMPL(p->session_, &impl);
+  MFXQueryVersion(p->session_, &version);
+  RTC_LOG(LS_INFO) << "oneVPL session: impl=0x" << std::hex << impl
+                   << std::dec << " version=" << version.Major << "."
+                   << version.Minor;
+  return p;
+}
+
+MsdkSession::~MsdkSession() {
+  if (session_ != nullptr) {
+    MFXClose(session_);
+  }
+  if (loader_ != nullptr) {
+    MFXUnload(loader_);
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef MSDK_SESSION_H_
+#define MSDK_SESSION_H_
+
+#include <memory>
+
+// oneVPL
+#include <vpl/mfx.h>
+
+// Intel Quick Sync Video を使うための oneVPL のセッション。
+// 古い GPU の場合も oneVPL のディスパッチャが Media SDK のランタイムを探してくれる。
+// サーフェスはシステムメモリに置くので、D3D11 のデバイスは渡さない
+class MsdkSession {
+ public:
+  // QSV が使えない場合は nullptr を返す
+  static std::unique_ptr<MsdkSession> Create();
+  ~MsdkSession();
+
+  mfxSession session() const { return session_; }
+
+ private:
+  MsdkSession() = default;
+
+  mfxLoader loader_ = nullptr;
+  mfxSession session_ = nullptr;
+};
+
+#endif  // MSDK_SESSION_H_
@@ -0,0 +1,283 @@
+#include "msdk_video_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// WebRTC
+#include <modules/video_coding/include/video_error_codes.h>
+#include <rtc_base/logging.h>
+#include <third_party/libyuv/include/libyuv/planar_functions.h>
+
+#include "perf_counters.h"
+
+static void MakeDecodeParams(mfxVideoParam* param, mfxU32 codec) {
+  memset(param, 0, sizeof(*param));
+  param->mfx.CodecId = codec;
+  param->IOPattern = MFX_IOPATTERN_OUT_SYSTEM_MEMORY;
+  // デコードしたフレームはすぐに出力させる
+  param->AsyncDepth = 1;
+}
+
+MsdkVideoDecoder::MsdkVideoDecoder(mfxU32 codec)
+    : codec_(codec), buffer_pool_(false, 300 /* max_number_of_buffers*/) {}
+
+MsdkVideoDecoder::~MsdkVideoDecoder() {
+  Release();
+}
+
+bool MsdkVideoDecoder::IsSupported(mfxU32 codec) {
+  // 調べている最中に呼ばれた場合は、結果が出るまで待つ
+  static std::mutex mutex;
+  static std::map<mfxU32, bool> supported;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = supported.find(codec);
+  if (it != supported.end()) {
+    return it->second;
+  }
+  bool result = ProbeSupported(codec);
+  supported[codec] = result;
+  return result;
+}
+
+bool MsdkVideoDecoder::ProbeSupported(mfxU32 codec) {
+  std::unique_ptr<MsdkSession> session = MsdkSession::Create();
+  if (session == nullptr) {
+    return false;
+  }
+  mfxVideoParam param;
+  MakeDecodeParams(&param, codec);
+  param.mfx.FrameInfo.FourCC = MFX_FOURCC_NV12;
+  param.mfx.FrameInfo.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
+  param.mfx.FrameInfo.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
+  param.mfx.FrameInfo.Width = 640;
+  param.mfx.FrameInfo.Height = 480;
+  param.mfx.FrameInfo.CropW = 640;
+  param.mfx.FrameInfo.CropH = 480;
+  mfxVideoParam out = param;
+  mfxStatus sts = MFXVideoDECODE_Query(session->session(), &param, &out);
+  if (sts < MFX_ERR_NONE) {
+    RTC_LOG(LS_INFO) << "MFXVideoDECODE_Query is failed: codec=" << codec
+                     << " sts=" << sts;
+    return false;
+  }
+  return true;
+}
+
+int32_t MsdkVideoDecoder::InitDecode(const webrtc::VideoCodec* codec_settings,
+                                     int32_t number_of_cores) {
+  Release();
+  session_ = MsdkSession::Create();
+  if (session_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  // デコーダはビットストリームのヘッダを受け取ってから作る
+  bitstream_buffer_.resize(1024 * 1024);
+  memset(&bitstream_, 0, sizeof(bitstream_));
+  bitstream_.Data = bitstream_buffer_.data();
+  bitstream_.MaxLength = (mfxU32)bitstream_buffer_.size();
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+bool MsdkVideoDecoder::InitMsdk() {
+  MakeDecodeParams(&param_, codec_);
+  mfxStatus sts =
+      MFXVideoDECODE_DecodeHeader(session_->session(), &bitstream_, &param_);
+  if (sts == MFX_ERR_MORE_DATA) {
+    return false;
+  }
+  if (sts < MFX_ERR_NONE) {
+    RTC_LOG(LS_ERROR) << "MFXVideoDECODE_DecodeHeader is failed: sts=" << sts;
+    return false;
+  }
+
+  mfxFrameAllocRequest request = {};
+  sts = MFXVideoDECODE_QueryIOSurf(session_->session(), &param_, &request);
+  if (sts < MFX_ERR_NONE) {
+    RTC_LOG(LS_ERROR) << "MFXVideoDECODE_QueryIOSurf is failed: sts=" << sts;
+    return false;
+  }
+
+  sts = MFXVideoDECODE_Init(session_->session(), &param_);
+  if (sts < MFX_ERR_NONE) {
+    RTC_LOG(LS_ERROR) << "MFXVideoDECODE_Init is failed: sts=" << sts;
+    return false;
+  }
+  decoder_initialized_ = true;
+
+  const mfxFrameInfo& info = param_.mfx.FrameInfo;
+  const size_t frame_size = (size_t)info.Width * info.Height * 3 / 2;
+  const int num_surfaces = std::max<int>(request.NumFrameSuggested, 1);
+  surface_buffer_.assign(frame_size * num_surfaces, 0);
+  surfaces_.assign(num_surfaces, mfxFrameSurface1());
+  for (int i = 0; i < num_surfaces; i++) {
+    mfxFrameSurface1& s = surfaces_[i];
+    memset(&s, 0, sizeof(s));
+    s.Info = info;
+    s.Data.Y = surface_buffer_.data() + frame_size * i;
+    s.Data.UV = s.Data.Y + (size_t)info.Width * info.Height;
+    s.Data.Pitch = info.Width;
+  }
+  RTC_LOG(LS_INFO) << "MSDK decoder initialized: " << info.CropW << "x"
+                   << info.CropH << " surfaces=" << num_surfaces;
+  return true;
+}
+
+void MsdkVideoDecoder::ReleaseMsdk() {
+  if (decoder_initialized_) {
+    MFXVideoDECODE_Close(session_->session());
+    decoder_initialized_ = false;
+  }
+  surfaces_.clear();
+  surface_buffer_.clear();
+}
+
+mfxFrameSurface1* MsdkVideoDecoder::GetFreeSurface() {
+  for (auto& s : surfaces_) {
+    if (s.Data.Locked == 0) {
+      return &s;
+    }
+  }
+  return nullptr;
+}
+
+int32_t MsdkVideoDecoder::Decode(const webrtc::EncodedImage& input_image,
+                                 bool missing_frames,
+                                 int64_t render_time_ms) {
+  ScopedPerfTimer timer(PerfStage::kDecode);
+  if (session_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  if (decode_complete_callback_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  if (input_image.data() == nullptr && input_image.size() > 0) {
+    return WEBRTC_VIDEO_CODEC_ERR_PARAMETER;
+  }
+
+  // 読み残した分を先頭に詰めてから追加する
+  if (bitstream_.DataOffset > 0) {
+    memmove(bitstream_.Data, bitstream_.Data + bitstream_.DataOffset,
+            bitstream_.DataLength);
+    bitstream_.DataOffset = 0;
+  }
+  if (bitstream_.DataLength + input_image.size() > bitstream_.MaxLength) {
+    bitstream_buffer_.resize(bitstream_.DataLength + input_image.size());
+    bitstream_.Data = bitstream_buffer_.data();
+    bitstream_.MaxLength = (mfxU32)bitstream_buffer_.size();
+  }
+  memcpy(bitstream_.Data + bitstream_.DataLength, input_image.data(),
+         input_image.size());
+  bitstream_.DataLength += (mfxU32)input_image.size();
+  bitstream_.TimeStamp = input_image.Timestamp();
+  bitstream_.DataFlag = MFX_BITSTREAM_COMPLETE_FRAME;
+
+  if (!decoder_initialized_ && !InitMsdk()) {
+    // キーフレームが来るまで待つ
+    bitstream_.DataOffset = 0;
+    bitstream_.DataLength = 0;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+
+  while (true) {
+    mfxFrameSurface1* surface = GetFreeSurface();
+    if (surface == nullptr) {
+      RTC_LOG(LS_ERROR) << "No free surface";
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    mfxFrameSurface1* out = nullptr;
+    mfxSyncPoint syncp = nullptr;
+    mfxStatus sts = MFXVideoDECODE_DecodeFrameAsync(
+        session_->session(), &bitstream_, surface, &out, &syncp);
+    if (sts == MFX_WRN_DEVICE_BUSY) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    if (sts == MFX_ERR_MORE_SURFACE || sts == MFX_WRN_VIDEO_PARAM_CHANGED) {
+      continue;
+    }
+    if (sts == MFX_ERR_MORE_DATA) {
+      // このフレームは全部デコーダに渡した
+      break;
+    }
+    if (sts == MFX_ERR_INCOMPATIBLE_VIDEO_PARAM) {
+      // 解像度が変わったので、新しいヘッダからデコーダを作り直す
+      RTC_LOG(LS_INFO) << "Video params changed, reinitialize decoder";
+      ReleaseMsdk();
+      if (!InitMsdk()) {
+        bitstream_.DataLength = 0;
+        return WEBRTC_VIDEO_CODEC_ERROR;
+      }
+      continue;
+    }
+    if (sts < MFX_ERR_NONE) {
+      RTC_LOG(LS_ERROR) << "MFXVideoDECODE_DecodeFrameAsync is failed: sts="
+                        << sts;
+      bitstream_.DataLength = 0;
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    if (syncp == nullptr || out == nullptr) {
+      continue;
+    }
+    sts = MFXVideoCORE_SyncOperation(session_->session(), syncp, 1000);
+    if (sts != MFX_ERR_NONE) {
+      RTC_LOG(LS_ERROR) << "MFXVideoCORE_SyncOperation is failed: sts=" << sts;
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    DeliverFrame(out);
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void MsdkVideoDecoder::DeliverFrame(mfxFrameSurface1* surface) {
+  // I420 には変換せずに NV12 のまま渡す
+  int width = surface->Info.CropW;
+  int height = surface->Info.CropH;
+  rtc::scoped_refptr<webrtc::NV12Buffer> nv12_buffer =
+      buffer_pool_.CreateNV12Buffer(width, height);
+  if (nv12_buffer == nullptr) {
+    RTC_LOG(LS_WARNING) << "Failed to allocate NV12 buffer, drop frame";
+    return;
+  }
+  const int pitch = surface->Data.Pitch;
+  libyuv::CopyPlane(surface->Data.Y + surface->Info.CropY * pitch +
+                        surface->Info.CropX,
+                    pitch, nv12_buffer->MutableDataY(), nv12_buffer->StrideY(),
+                    width, height);
+  libyuv::CopyPlane(surface->Data.UV + surface->Info.CropY / 2 * pitch +
+                        surface->Info.CropX,
+                    pitch, nv12_buffer->MutableDataUV(),
+                    nv12_buffer->StrideUV(), (width + 1) / 2 * 2,
+                    (height + 1) / 2);
+
+  webrtc::VideoFrame decoded_image =
+      webrtc::VideoFrame::Builder()
+          .set_video_frame_buffer(nv12_buffer)
+          .set_timestamp_rtp((uint32_t)surface->Data.TimeStamp)
+          .build();
+  decode_complete_callback_->Decoded(decoded_image, absl::nullopt,
+                                     absl::nullopt);
+}
+
+int32_t MsdkVideoDecoder::RegisterDecodeCompleteCallback(
+    webrtc::DecodedImageCallback* callback) {
+  decode_complete_callback_ = callback;
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t MsdkVideoDecoder::Release() {
+  ReleaseMsdk();
+  session_.reset();
+  buffer_pool_.Release();
+  bitstream_buffer_.clear();
+  memset(&bitstream_, 0, sizeof(bitstream_));
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+const char* MsdkVideoDecoder::ImplementationName() const {
+  return "Intel QSV";
+}
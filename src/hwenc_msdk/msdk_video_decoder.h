@@ -0,0 +1,63 @@
+#ifndef MSDK_VIDEO_DECODER_H_
+#define MSDK_VIDEO_DECODER_H_
+
+#include <memory>
+#include <vector>
+
+// WebRTC
+#include <api/video_codecs/video_decoder.h>
+#include <common_video/include/video_frame_buffer_pool.h>
+
+#include "msdk_session.h"
+
+// Intel Quick Sync Video のデコーダ。
+// サーフェスはシステムメモリに置き、デコード結果は NV12 のまま渡す
+class MsdkVideoDecoder : public webrtc::VideoDecoder {
+ public:
+  // MFX_CODEC_AVC
+  // MFX_CODEC_VP8
+  // MFX_CODEC_VP9
+  explicit MsdkVideoDecoder(mfxU32 codec);
+  ~MsdkVideoDecoder() override;
+
+  // 実際にセッションを作って確認するので重い。結果はコーデックごとにプロセスで覚えておく
+  static bool IsSupported(mfxU32 codec);
+
+  int32_t InitDecode(const webrtc::VideoCodec* codec_settings,
+                     int32_t number_of_cores) override;
+
+  int32_t Decode(const webrtc::EncodedImage& input_image,
+                 bool missing_frames,
+                 int64_t render_time_ms) override;
+
+  int32_t RegisterDecodeCompleteCallback(
+      webrtc::DecodedImageCallback* callback) override;
+
+  int32_t Release() override;
+
+  const char* ImplementationName() const override;
+
+ private:
+  static bool ProbeSupported(mfxU32 codec);
+
+  // ビットストリームのヘッダからデコーダを作る。ヘッダが足りなければ false を返す
+  bool InitMsdk();
+  void ReleaseMsdk();
+  mfxFrameSurface1* GetFreeSurface();
+  void DeliverFrame(mfxFrameSurface1* surface);
+
+  mfxU32 codec_;
+  webrtc::DecodedImageCallback* decode_complete_callback_ = nullptr;
+  webrtc::VideoFrameBufferPool buffer_pool_;
+
+  std::unique_ptr<MsdkSession> session_;
+  bool decoder_initialized_ = false;
+  mfxVideoParam param_ = {};
+  std::vector<mfxFrameSurface1> surfaces_;
+  std::vector<uint8_t> surface_buffer_;
+  // デコーダが読み残した分は次の Decode で先頭に詰めて続きを追加する
+  mfxBitstream bitstream_ = {};
+  std::vector<uint8_t> bitstream_buffer_;
+};
+
+#endif  // MSDK_VIDEO_DECODER_H_
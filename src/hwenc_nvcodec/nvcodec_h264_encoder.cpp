@@ -1,10 +1,22 @@
 #include "nvcodec_h264_encoder.h"
 
+#include <algorithm>
+
 #include "libyuv.h"
 #include "modules/video_coding/codecs/h264/include/h264.h"
 #include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
 
+#include "encoder_stats.h"
+#include "log_rate_limiter.h"
+#include "perf_counters.h"
 #include "rtc/native_buffer.h"
+#ifdef _WIN32
+#include <d3d10.h>
+
+#include "rtc/d3d11_texture_buffer.h"
+#include "rtc/dxgi_adapter.h"
+#endif
 
 const int kLowH264QpThreshold = 34;
 const int kHighH264QpThreshold = 40;
@@ -18,43 +30,99 @@ struct nal_entry {
 using Microsoft::WRL::ComPtr;
 #endif
 
-NvCodecH264Encoder::NvCodecH264Encoder(const cricket::VideoCodec& codec)
-    : bitrate_adjuster_(0.05, 0.95) {
+#ifdef __linux__
+// Y の直後に UV が続いている NV12 なら、変換せずにそのまま NVENC に渡せる
+static bool IsContiguousNV12(const webrtc::VideoFrameBuffer* buffer) {
+  if (buffer->type() != webrtc::VideoFrameBuffer::Type::kNV12) {
+    return false;
+  }
+  const webrtc::NV12BufferInterface* nv12 = buffer->GetNV12();
+  return nv12->StrideY() == nv12->StrideUV() &&
+         nv12->DataUV() == nv12->DataY() + nv12->StrideY() * nv12->height();
+}
+#endif
+
+#ifdef _WIN32
+NvCodecH264Encoder::NvCodecH264Encoder(const cricket::VideoCodec& codec,
+                                       int output_delay,
+                                       bool intra_refresh,
+                                       LUID adapter_luid)
+#else
+NvCodecH264Encoder::NvCodecH264Encoder(const cricket::VideoCodec& codec,
+                                       int output_delay,
+                                       bool intra_refresh)
+#endif
+    : output_delay_(std::max(output_delay, 0)), intra_refresh_(intra_refresh) {
+  absl::optional<webrtc::H264::ProfileLevelId> profile_level_id =
+      webrtc::H264::ParseSdpProfileLevelId(codec.params);
+  if (profile_level_id) {
+    profile_ = profile_level_id->profile;
+    level_ = profile_level_id->level;
+  } else {
+    RTC_LOG(LS_WARNING) << "Invalid profile-level-id";
+  }
+  RTC_LOG(INFO) << __FUNCTION__ << " profile:" << profile_
+                << " level:" << level_;
+
 #ifdef _WIN32
-  ComPtr<IDXGIFactory1> idxgi_factory;
-  RTC_CHECK(!FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1),
-                                       (void**)idxgi_factory.GetAddressOf())));
+  // Unity のテクスチャを共有ハンドルで開けるように、Unity と同じアダプタを使う
   ComPtr<IDXGIAdapter> idxgi_adapter;
-  RTC_CHECK(
-      !FAILED(idxgi_factory->EnumAdapters(0, idxgi_adapter.GetAddressOf())));
+  if (adapter_luid.LowPart != 0 || adapter_luid.HighPart != 0) {
+    idxgi_adapter = sora::FindAdapter(adapter_luid);
+    if (idxgi_adapter == nullptr) {
+      RTC_LOG(LS_WARNING) << "Adapter not found, fallback to the first adapter";
+    }
+  }
+  if (idxgi_adapter == nullptr) {
+    ComPtr<IDXGIFactory1> idxgi_factory;
+    RTC_CHECK(!FAILED(CreateDXGIFactory1(
+        __uuidof(IDXGIFactory1), (void**)idxgi_factory.GetAddressOf())));
+    RTC_CHECK(
+        !FAILED(idxgi_factory->EnumAdapters(0, idxgi_adapter.GetAddressOf())));
+  }
   RTC_CHECK(!FAILED(D3D11CreateDevice(
       idxgi_adapter.Get(), D3D_DRIVER_TYPE_UNKNOWN, NULL, 0, NULL, 0,
       D3D11_SDK_VERSION, id3d11_device_.GetAddressOf(), NULL,
       id3d11_context_.GetAddressOf())));
 
-  // 以下デバイス名を取得するだけの処理
-  DXGI_ADAPTER_DESC adapter_desc;
-  idxgi_adapter->GetDesc(&adapter_desc);
-  char szDesc[80];
-  size_t result = 0;
-  wcstombs_s(&result, szDesc, adapter_desc.Description, sizeof(szDesc));
-  RTC_LOG(INFO) << __FUNCTION__ << "GPU in use: " << szDesc;
+  // 出力スレッドからも NVENC 経由でデバイスを触るのでスレッドセーフにしておく
+  ComPtr<ID3D10Multithread> multithread;
+  if (SUCCEEDED(id3d11_context_.As(&multithread))) {
+    multithread->SetMultithreadProtected(TRUE);
+  }
+
+  // simulcast の縮小に使う。取れなければ simulcast には対応しない
+  if (FAILED(id3d11_device_.As(&video_device_)) ||
+      FAILED(id3d11_context_.As(&video_context_))) {
+    RTC_LOG(LS_WARNING) << "ID3D11VideoDevice is not available";
+    video_device_.Reset();
+    video_context_.Reset();
+  }
+
+  RTC_LOG(INFO) << __FUNCTION__
+                << "GPU in use: " << sora::GetAdapterName(idxgi_adapter.Get());
 #endif
 #ifdef __linux__
   cuda_.reset(new NvCodecH264EncoderCuda());
 #endif
 }
 
-NvCodecH264Encoder::~NvCodecH264Encoder() {}
+NvCodecH264Encoder::~NvCodecH264Encoder() {
+  Release();
+}
 
 bool NvCodecH264Encoder::IsSupported() {
-  try {
-    NvEncoder::TryLoadNvEncApi();
-    return true;
-  } catch (const NVENCException& e) {
-    RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
-    return false;
-  }
+  // 調べている最中に呼ばれた場合は、結果が出るまで待つ
+  static const bool supported = []() {
+    try {
+      NvEncoder::TryLoadNvEncApi();
+      return true;
+    } catch (const NVENCException& e) {
+      RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
+      return false;
+    }
+  }();
+  return supported;
 }
 
 int32_t NvCodecH264Encoder::InitEncode(const webrtc::VideoCodec* codec_settings,
@@ -63,6 +131,11 @@ int32_t NvCodecH264Encoder::InitEncode(const webrtc::VideoCodec* codec_settings,
   RTC_DCHECK(codec_settings);
   RTC_DCHECK_EQ(codec_settings->codecType, webrtc::kVideoCodecH264);
 
+  // 解像度が変わっただけなら、セッションを作り直さずに Reconfigure で変更する
+  if (ResizeInPlace(codec_settings)) {
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+
   int32_t release_ret = Release();
   if (release_ret != WEBRTC_VIDEO_CODEC_OK) {
     return release_ret;
@@ -70,28 +143,143 @@ int32_t NvCodecH264Encoder::InitEncode(const webrtc::VideoCodec* codec_settings,
 
   width_ = codec_settings->width;
   height_ = codec_settings->height;
-  target_bitrate_bps_ = codec_settings->startBitrate * 1000;
-  max_bitrate_bps_ = codec_settings->maxBitrate * 1000;
-  bitrate_adjuster_.SetTargetBitrateBps(target_bitrate_bps_);
   framerate_ = codec_settings->maxFramerate;
   mode_ = codec_settings->mode;
 
-  RTC_LOG(LS_INFO) << "InitEncode " << target_bitrate_bps_ << "bit/sec";
+  int number_of_streams =
+      std::max<int>(codec_settings->numberOfSimulcastStreams, 1);
+  if (number_of_streams > 1) {
+#ifdef _WIN32
+    if (video_device_ == nullptr) {
+      return WEBRTC_VIDEO_CODEC_ERR_SIMULCAST_PARAMETERS_NOT_SUPPORTED;
+    }
+    // 一番解像度の高いレイヤーから縮小するので、それより大きいレイヤーは作れない
+    const webrtc::SimulcastStream& top =
+        codec_settings->simulcastStream[number_of_streams - 1];
+    if (top.width != width_ || top.height != height_) {
+      return WEBRTC_VIDEO_CODEC_ERR_SIMULCAST_PARAMETERS_NOT_SUPPORTED;
+    }
+    for (int i = 0; i < number_of_streams; i++) {
+      const webrtc::SimulcastStream& stream =
+          codec_settings->simulcastStream[i];
+      if (stream.width == 0 || stream.height == 0 || stream.width > width_ ||
+          stream.height > height_) {
+        return WEBRTC_VIDEO_CODEC_ERR_SIMULCAST_PARAMETERS_NOT_SUPPORTED;
+      }
+    }
+#else
+    return WEBRTC_VIDEO_CODEC_ERR_SIMULCAST_PARAMETERS_NOT_SUPPORTED;
+#endif
+  }
+
+  for (int i = 0; i < number_of_streams; i++) {
+    std::unique_ptr<Layer> layer(new Layer());
+    layer->simulcast_index = i;
+    UpdateLayer(layer.get(), codec_settings, number_of_streams);
+    layer->max_width = layer->width;
+    layer->max_height = layer->height;
 
-  // Initialize encoded image. Default buffer size: size of unencoded data.
-  encoded_image_._encodedWidth = 0;
-  encoded_image_._encodedHeight = 0;
-  encoded_image_.set_size(0);
-  encoded_image_.timing_.flags =
-      webrtc::VideoSendTiming::TimingFrameFlags::kInvalid;
-  encoded_image_.content_type_ =
-      (codec_settings->mode == webrtc::VideoCodecMode::kScreensharing)
-          ? webrtc::VideoContentType::SCREENSHARE
-          : webrtc::VideoContentType::UNSPECIFIED;
+    RTC_LOG(LS_INFO) << "InitEncode simulcast_index=" << i << " "
+                     << layer->width << "x" << layer->height << " "
+                     << layer->target_bitrate_bps << "bit/sec";
+
+    // Initialize encoded image. Default buffer size: size of unencoded data.
+    webrtc::EncodedImage& encoded_image = layer->encoded_image;
+    encoded_image._encodedWidth = 0;
+    encoded_image._encodedHeight = 0;
+    encoded_image.set_size(0);
+    encoded_image.timing_.flags =
+        webrtc::VideoSendTiming::TimingFrameFlags::kInvalid;
+    encoded_image.content_type_ =
+        (codec_settings->mode == webrtc::VideoCodecMode::kScreensharing)
+            ? webrtc::VideoContentType::SCREENSHARE
+            : webrtc::VideoContentType::UNSPECIFIED;
+    layers_.push_back(std::move(layer));
+  }
 
   return InitNvEnc();
 }
 
+void NvCodecH264Encoder::UpdateLayer(Layer* layer,
+                                     const webrtc::VideoCodec* codec_settings,
+                                     int number_of_streams) {
+  if (number_of_streams == 1) {
+    layer->width = codec_settings->width;
+    layer->height = codec_settings->height;
+    layer->target_bitrate_bps = codec_settings->startBitrate * 1000;
+    layer->max_bitrate_bps = codec_settings->maxBitrate * 1000;
+  } else {
+    const webrtc::SimulcastStream& stream =
+        codec_settings->simulcastStream[layer->simulcast_index];
+    layer->width = stream.width;
+    layer->height = stream.height;
+    layer->active = stream.active;
+    layer->target_bitrate_bps = stream.targetBitrate * 1000;
+    layer->max_bitrate_bps = stream.maxBitrate * 1000;
+  }
+  layer->bitrate_adjuster.SetTargetBitrateBps(layer->target_bitrate_bps);
+}
+
+bool NvCodecH264Encoder::ResizeInPlace(
+    const webrtc::VideoCodec* codec_settings) {
+  int number_of_streams =
+      std::max<int>(codec_settings->numberOfSimulcastStreams, 1);
+  if (layers_.empty() || layers_.size() != (size_t)number_of_streams ||
+      codec_settings->mode != mode_) {
+    return false;
+  }
+  if (number_of_streams > 1) {
+    const webrtc::SimulcastStream& top =
+        codec_settings->simulcastStream[number_of_streams - 1];
+    if (top.width != codec_settings->width ||
+        top.height != codec_settings->height) {
+      return false;
+    }
+  }
+  // 入力バッファはセッションを作った時の解像度で確保しているので、それを超える場合は作り直す
+  for (int i = 0; i < number_of_streams; i++) {
+    const Layer* layer = layers_[i].get();
+    uint32_t width = number_of_streams == 1
+                         ? codec_settings->width
+                         : codec_settings->simulcastStream[i].width;
+    uint32_t height = number_of_streams == 1
+                          ? codec_settings->height
+                          : codec_settings->simulcastStream[i].height;
+    if (!layer->nv_encoder || width == 0 || height == 0 ||
+        width > layer->max_width || height > layer->max_height) {
+      return false;
+    }
+  }
+
+  width_ = codec_settings->width;
+  height_ = codec_settings->height;
+  framerate_ = codec_settings->maxFramerate;
+  for (auto& layer : layers_) {
+    uint32_t width = layer->width;
+    uint32_t height = layer->height;
+    UpdateLayer(layer.get(), codec_settings, number_of_streams);
+    if (layer->width != width || layer->height != height) {
+      layer->resize_needed = true;
+    }
+    layer->reconfigure_needed = true;
+#ifdef _WIN32
+    // 縮小元の解像度が変わるので VideoProcessor は作り直す
+    if (layer->vp) {
+      layer->vp_input_views.clear();
+      layer->vp_output_views.clear();
+      if (!InitScaler(layer.get(), layer->vp_input_format)) {
+        return false;
+      }
+    }
+#endif
+    RTC_LOG(LS_INFO) << "ResizeInPlace simulcast_index="
+                     << layer->simulcast_index << " " << layer->width << "x"
+                     << layer->height << " " << layer->target_bitrate_bps
+                     << "bit/sec";
+  }
+  return true;
+}
+
 int32_t NvCodecH264Encoder::RegisterEncodeCompleteCallback(
     webrtc::EncodedImageCallback* callback) {
   std::lock_guard<std::mutex> lock(mutex_);
@@ -100,14 +288,17 @@ int32_t NvCodecH264Encoder::RegisterEncodeCompleteCallback(
 }
 
 int32_t NvCodecH264Encoder::Release() {
-  return ReleaseNvEnc();
+  int32_t ret = ReleaseNvEnc();
+  layers_.clear();
+  return ret;
 }
 
 int32_t NvCodecH264Encoder::Encode(
     const webrtc::VideoFrame& frame,
     const std::vector<webrtc::VideoFrameType>* frame_types) {
   //RTC_LOG(LS_ERROR) << __FUNCTION__ << " Start";
-  if (!nv_encoder_) {
+  ScopedPerfTimer timer(PerfStage::kEncode);
+  if (layers_.empty() || !layers_.back()->nv_encoder) {
     return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
   }
   if (!callback_) {
@@ -117,168 +308,438 @@ int32_t NvCodecH264Encoder::Encode(
     return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
   }
 
-  if (frame.video_frame_buffer()->type() ==
-      webrtc::VideoFrameBuffer::Type::kNative) {
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame_buffer =
+      frame.video_frame_buffer();
+#ifdef _WIN32
+  // Unity のカメラのテクスチャは、このデバイスで開けたら GPU 上で NV12 に変換してエンコードする。
+  // 開けなかった場合やその他のネイティブバッファは I420 に変換してからエンコードする。
+  // どちらの場合も NVENC の入力は NV12 なので、切り替わってもセッションは作り直さない。
+  ComPtr<ID3D11Texture2D> shared_texture;
+  if (auto texture_buffer =
+          dynamic_cast<sora::D3D11TextureBuffer*>(frame_buffer.get())) {
+    shared_texture = OpenSharedTexture(texture_buffer);
+  }
+  if (shared_texture == nullptr &&
+      frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative) {
+    frame_buffer = frame_buffer->ToI420();
+    if (!frame_buffer) {
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+  }
+
+  // NVENC の入力バッファに直接書き込んでいる場合は、テクスチャからコピーできないので
+  // 最初に Unity のテクスチャを受け取った時だけ作り直す
+  if (shared_texture && !texture_input_) {
+    ReleaseNvEnc();
+    RTC_LOG(LS_INFO) << "Use texture input";
+    texture_input_ = true;
+    if (InitNvEnc() != WEBRTC_VIDEO_CODEC_OK) {
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+  }
+#endif
+
+#ifdef __linux__
+  // NativeBuffer 以外のネイティブバッファは I420 に変換してからエンコードする
+  if (frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative &&
+      dynamic_cast<NativeBuffer*>(frame_buffer.get()) == nullptr) {
+    frame_buffer = frame_buffer->ToI420();
+    if (!frame_buffer) {
+      RTC_LOG(LS_ERROR) << "Failed to convert the native buffer to I420";
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+  }
+
+  // MJPEG の NativeBuffer と NV12 の場合は NVENC の入力を NV12 にする
+  if (frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative ||
+      IsContiguousNV12(frame_buffer.get())) {
     if (!use_native_) {
       ReleaseNvEnc();
       RTC_LOG(LS_INFO) << "Use Native";
       use_native_ = true;
-      InitNvEnc();
+      if (InitNvEnc() != WEBRTC_VIDEO_CODEC_OK) {
+        return WEBRTC_VIDEO_CODEC_ERROR;
+      }
     }
   } else {
     if (use_native_) {
       ReleaseNvEnc();
       RTC_LOG(LS_INFO) << "Unuse Native";
       use_native_ = false;
-      InitNvEnc();
+      if (InitNvEnc() != WEBRTC_VIDEO_CODEC_OK) {
+        return WEBRTC_VIDEO_CODEC_ERROR;
+      }
     }
   }
+#endif
 
-  bool send_key_frame = false;
-
-  if (reconfigure_needed_) {
-    NV_ENC_RECONFIGURE_PARAMS reconfigure_params = {
-        NV_ENC_RECONFIGURE_PARAMS_VER};
-    NV_ENC_CONFIG encode_config = {NV_ENC_CONFIG_VER};
-    reconfigure_params.reInitEncodeParams.encodeConfig = &encode_config;
-    nv_encoder_->GetInitializeParams(&reconfigure_params.reInitEncodeParams);
-
-    reconfigure_params.reInitEncodeParams.frameRateNum = framerate_;
-
-    encode_config.rcParams.averageBitRate =
-        bitrate_adjuster_.GetAdjustedBitrateBps();
-    encode_config.rcParams.maxBitRate = max_bitrate_bps_;
-    encode_config.rcParams.vbvBufferSize =
-        encode_config.rcParams.averageBitRate * 1 / framerate_;
-    encode_config.rcParams.vbvInitialDelay =
-        encode_config.rcParams.vbvBufferSize;
-    try {
-      //RTC_LOG(LS_ERROR) << __FUNCTION__ << " Reconfigure";
-      nv_encoder_->Reconfigure(&reconfigure_params);
-    } catch (const NVENCException& e) {
-      RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
-      return WEBRTC_VIDEO_CODEC_ERROR;
+  // 各レイヤーでこのフレームをエンコードするか、キーフレームにするかを決める
+  std::vector<bool> send_frame(layers_.size(), false);
+  std::vector<bool> send_key_frame(layers_.size(), false);
+  bool send_any = false;
+  for (size_t i = 0; i < layers_.size(); i++) {
+    Layer* layer = layers_[i].get();
+    if (!layer->active) {
+      continue;
     }
-
-    reconfigure_needed_ = false;
+    if (frame_types != nullptr) {
+      RTC_DCHECK_EQ(frame_types->size(), layers_.size());
+      webrtc::VideoFrameType frame_type =
+          i < frame_types->size() ? (*frame_types)[i] : (*frame_types)[0];
+      // Skip frame?
+      if (frame_type == webrtc::VideoFrameType::kEmptyFrame) {
+        continue;
+      }
+      // Force key frame?
+      send_key_frame[i] =
+          frame_type == webrtc::VideoFrameType::kVideoFrameKey;
+    }
+    send_frame[i] = true;
+    send_any = true;
+  }
+  if (!send_any) {
+    return WEBRTC_VIDEO_CODEC_OK;
   }
 
-  if (frame_types != nullptr) {
-    // We only support a single stream.
-    RTC_DCHECK_EQ(frame_types->size(), static_cast<size_t>(1));
-    // Skip frame?
-    if ((*frame_types)[0] == webrtc::VideoFrameType::kEmptyFrame) {
-      return WEBRTC_VIDEO_CODEC_OK;
+  for (size_t i = 0; i < layers_.size(); i++) {
+    if (send_frame[i] && layers_[i]->reconfigure_needed) {
+      if (!ReconfigureLayer(layers_[i].get())) {
+        return WEBRTC_VIDEO_CODEC_ERROR;
+      }
     }
-    // Force key frame?
-    send_key_frame =
-        (*frame_types)[0] == webrtc::VideoFrameType::kVideoFrameKey;
   }
 
-  NV_ENC_PIC_PARAMS pic_params = {NV_ENC_PIC_PARAMS_VER};
-  pic_params.encodePicFlags = 0;
-  if (send_key_frame) {
-    pic_params.encodePicFlags =
-        NV_ENC_PIC_FLAG_FORCEINTRA | NV_ENC_PIC_FLAG_FORCEIDR;
+  // フレームは一番解像度の高いレイヤーの入力バッファにアップロードして、
+  // 他のレイヤーにはそこから縮小する。
+  // 一番上のレイヤーを送らない場合も縮小元として入力バッファは使う。
+  Layer* top = layers_.back().get();
+  for (size_t i = 0; i < layers_.size(); i++) {
+    Layer* layer = layers_[i].get();
+    // 次の入力バッファが出力スレッドで使い終わるのを待つ
+    if ((send_frame[i] || layer == top) && !WaitForInputBuffer(layer, false)) {
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
   }
-  pic_params.inputWidth = width_;
-  pic_params.inputHeight = height_;
-
-  v_packet_.clear();
 
 #ifdef _WIN32
-  const NvEncInputFrame* input_frame = nv_encoder_->GetNextInputFrame();
-  D3D11_MAPPED_SUBRESOURCE map;
-  id3d11_context_->Map(id3d11_texture_.Get(), D3D11CalcSubresource(0, 0, 1),
-                       D3D11_MAP_WRITE, 0, &map);
-  if (use_native_) {
-    const sora::NativeBuffer* frame_buffer =
-        dynamic_cast<sora::NativeBuffer*>(frame.video_frame_buffer().get());
-    for (int y = 0; y < frame_buffer->height(); y++) {
-      memcpy((uint8_t*)map.pData + y * map.RowPitch,
-             frame_buffer->Data() + frame_buffer->raw_width() * y,
-             frame_buffer->raw_width());
+  const NvEncInputFrame* input_frame = top->nv_encoder->GetNextInputFrame();
+  ID3D11Texture2D* nv12_texture =
+      reinterpret_cast<ID3D11Texture2D*>(input_frame->inputPtr);
+  if (shared_texture) {
+    // CPU を経由せずに GPU 上でエンコーダの入力テクスチャに NV12 に変換して書き込む
+    if (!top->vp && !InitScaler(top, DXGI_FORMAT_B8G8R8A8_UNORM)) {
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    ComPtr<IDXGIKeyedMutex> keyed_mutex;
+    shared_texture.As(&keyed_mutex);
+    if (keyed_mutex == nullptr || keyed_mutex->AcquireSync(0, 1000) != S_OK) {
+      RTC_LOG(LS_ERROR) << "IDXGIKeyedMutex::AcquireSync is failed";
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    // 縮小されている場合はテクスチャの左上だけを使う。範囲は InitScaler で指定している
+    bool scaled = ScaleToLayer(top, shared_texture.Get(), nv12_texture);
+    keyed_mutex->ReleaseSync(0);
+    if (!scaled) {
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+  } else if (top->host_memory_encoder != nullptr) {
+    // NVENC の入力バッファに直接 NV12 を書き込む
+    rtc::scoped_refptr<const webrtc::I420BufferInterface> i420_buffer =
+        frame_buffer->ToI420();
+    uint32_t pitch = 0;
+    uint8_t* data = nullptr;
+    try {
+      data = top->host_memory_encoder->LockInputBuffer(input_frame, &pitch);
+    } catch (const NVENCException& e) {
+      RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    libyuv::I420ToNV12(i420_buffer->DataY(), i420_buffer->StrideY(),
+                       i420_buffer->DataU(), i420_buffer->StrideU(),
+                       i420_buffer->DataV(), i420_buffer->StrideV(), data,
+                       pitch, data + top->max_height * pitch, pitch, width_,
+                       height_);
+    try {
+      top->host_memory_encoder->UnlockInputBuffer(input_frame);
+    } catch (const NVENCException& e) {
+      RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
+      return WEBRTC_VIDEO_CODEC_ERROR;
     }
   } else {
-    rtc::scoped_refptr<const webrtc::I420BufferInterface> frame_buffer =
-        frame.video_frame_buffer()->ToI420();
-    libyuv::I420ToNV12(frame_buffer->DataY(), frame_buffer->StrideY(),
-                       frame_buffer->DataU(), frame_buffer->StrideU(),
-                       frame_buffer->DataV(), frame_buffer->StrideV(),
+    D3D11_MAPPED_SUBRESOURCE map;
+    id3d11_context_->Map(id3d11_texture_.Get(), D3D11CalcSubresource(0, 0, 1),
+                         D3D11_MAP_WRITE, 0, &map);
+    // ステージングテクスチャはセッションの最大の解像度で作っているので、
+    // UV 面の位置は最大の高さから決まる
+    rtc::scoped_refptr<const webrtc::I420BufferInterface> i420_buffer =
+        frame_buffer->ToI420();
+    libyuv::I420ToNV12(i420_buffer->DataY(), i420_buffer->StrideY(),
+                       i420_buffer->DataU(), i420_buffer->StrideU(),
+                       i420_buffer->DataV(), i420_buffer->StrideV(),
                        (uint8_t*)map.pData, map.RowPitch,
-                       ((uint8_t*)map.pData + height_ * map.RowPitch),
+                       ((uint8_t*)map.pData + top->max_height * map.RowPitch),
                        map.RowPitch, width_, height_);
+    id3d11_context_->Unmap(id3d11_texture_.Get(),
+                           D3D11CalcSubresource(0, 0, 1));
+    id3d11_context_->CopyResource(nv12_texture, id3d11_texture_.Get());
+  }
+
+  // 他のレイヤーには GPU 上で縮小してから渡す
+  for (size_t i = 0; i + 1 < layers_.size(); i++) {
+    if (!send_frame[i]) {
+      continue;
+    }
+    Layer* layer = layers_[i].get();
+    const NvEncInputFrame* layer_input_frame =
+        layer->nv_encoder->GetNextInputFrame();
+    if (!ScaleToLayer(
+            layer, nv12_texture,
+            reinterpret_cast<ID3D11Texture2D*>(layer_input_frame->inputPtr))) {
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
   }
-  id3d11_context_->Unmap(id3d11_texture_.Get(), D3D11CalcSubresource(0, 0, 1));
-  ID3D11Texture2D* nv12_texture =
-      reinterpret_cast<ID3D11Texture2D*>(input_frame->inputPtr);
-  id3d11_context_->CopyResource(nv12_texture, id3d11_texture_.Get());
 #endif
 #ifdef __linux__
-  if (frame.video_frame_buffer()->type() ==
-      webrtc::VideoFrameBuffer::Type::kNative) {
+  if (frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative) {
     NativeBuffer* native_buffer =
-        dynamic_cast<NativeBuffer*>(frame.video_frame_buffer().get());
-    cuda_->CopyNative(nv_encoder_.get(), native_buffer->Data(),
+        static_cast<NativeBuffer*>(frame_buffer.get());
+    cuda_->CopyNative(top->nv_encoder.get(), native_buffer->Data(),
                       native_buffer->length(), native_buffer->width(),
                       native_buffer->height());
+  } else if (IsContiguousNV12(frame_buffer.get())) {
+    const webrtc::NV12BufferInterface* nv12 = frame_buffer->GetNV12();
+    cuda_->CopyNV12(top->nv_encoder.get(), nv12->DataY(), nv12->StrideY(),
+                    nv12->width(), nv12->height());
   } else {
-    rtc::scoped_refptr<const webrtc::I420BufferInterface> frame_buffer =
-        frame.video_frame_buffer()->ToI420();
-    cuda_->Copy(nv_encoder_.get(), frame_buffer->DataY(), frame_buffer->width(),
-                frame_buffer->height());
+    rtc::scoped_refptr<const webrtc::I420BufferInterface> i420_buffer =
+        frame_buffer->ToI420();
+    cuda_->Copy(top->nv_encoder.get(), i420_buffer->DataY(),
+                i420_buffer->width(), i420_buffer->height());
   }
 #endif
 
+  for (size_t i = 0; i < layers_.size(); i++) {
+    if (!send_frame[i]) {
+      continue;
+    }
+    Layer* layer = layers_[i].get();
+
+    NV_ENC_PIC_PARAMS pic_params = {NV_ENC_PIC_PARAMS_VER};
+    pic_params.encodePicFlags = 0;
+    if (send_key_frame[i]) {
+      SetKeyFrameParams(layer, &pic_params);
+    }
+    layer->frame_count++;
+    pic_params.inputWidth = layer->width;
+    pic_params.inputHeight = layer->height;
+
+    // エンコード結果は出力スレッドで受け取るので、ここではエンコーダに投入するだけ
+    try {
+      layer->nv_encoder->SubmitFrame(&pic_params);
+    } catch (const NVENCException& e) {
+      RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+
+    PendingFrame pending;
+    pending.width = layer->width;
+    pending.height = layer->height;
+    pending.timestamp = frame.timestamp();
+    pending.ntp_time_ms = frame.ntp_time_ms();
+    pending.capture_time_ms = frame.render_time_ms();
+    pending.rotation = frame.rotation();
+    pending.color_space = frame.color_space();
+    pending.submit_time_us = rtc::TimeMicros();
+    {
+      std::lock_guard<std::mutex> lock(layer->output_mutex);
+      layer->pending_frames.push_back(std::move(pending));
+    }
+    layer->output_cond.notify_all();
+  }
+
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+bool NvCodecH264Encoder::ReconfigureLayer(Layer* layer) {
+  uint32_t bitrate_bps = layer->bitrate_adjuster.GetAdjustedBitrateBps();
+  if (!layer->resize_needed && bitrate_bps == layer->applied_bitrate_bps &&
+      layer->max_bitrate_bps == layer->applied_max_bitrate_bps &&
+      framerate_ == layer->applied_framerate) {
+    layer->reconfigure_needed = false;
+    return true;
+  }
+
+  // 解像度を変える場合はエンコーダをリセットするので、投入済みのフレームを全部出力させておく。
+  // レート制御だけの変更は投入済みのフレームを待たずに反映する
+  if (layer->resize_needed && !WaitForInputBuffer(layer, true)) {
+    return false;
+  }
+
+  NV_ENC_RECONFIGURE_PARAMS reconfigure_params = {
+      NV_ENC_RECONFIGURE_PARAMS_VER};
+  NV_ENC_CONFIG encode_config = {NV_ENC_CONFIG_VER};
+  reconfigure_params.reInitEncodeParams.encodeConfig = &encode_config;
+  layer->nv_encoder->GetInitializeParams(
+      &reconfigure_params.reInitEncodeParams);
+
+  reconfigure_params.reInitEncodeParams.frameRateNum = framerate_;
+  if (layer->resize_needed) {
+    // 入力バッファは最大の解像度で確保しているので、解像度だけ変えて IDR から始める
+    reconfigure_params.reInitEncodeParams.encodeWidth = layer->width;
+    reconfigure_params.reInitEncodeParams.encodeHeight = layer->height;
+    reconfigure_params.reInitEncodeParams.darWidth = layer->width;
+    reconfigure_params.reInitEncodeParams.darHeight = layer->height;
+    reconfigure_params.resetEncoder = 1;
+    reconfigure_params.forceIDR = 1;
+  }
+
+  encode_config.rcParams.averageBitRate = bitrate_bps;
+  encode_config.rcParams.maxBitRate = layer->max_bitrate_bps;
+  encode_config.rcParams.vbvBufferSize =
+      encode_config.rcParams.averageBitRate * 1 / framerate_;
+  encode_config.rcParams.vbvInitialDelay =
+      encode_config.rcParams.vbvBufferSize;
   try {
-    nv_encoder_->EncodeFrame(v_packet_, &pic_params);
+    //RTC_LOG(LS_ERROR) << __FUNCTION__ << " Reconfigure";
+    layer->nv_encoder->Reconfigure(&reconfigure_params);
   } catch (const NVENCException& e) {
     RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
-    return WEBRTC_VIDEO_CODEC_ERROR;
+    return false;
   }
 
-  for (std::vector<uint8_t>& packet : v_packet_) {
-    encoded_image_.SetEncodedData(
-        webrtc::EncodedImageBuffer::Create(packet.data(), packet.size()));
-    encoded_image_._encodedWidth = width_;
-    encoded_image_._encodedHeight = height_;
-    encoded_image_.content_type_ =
-        (mode_ == webrtc::VideoCodecMode::kScreensharing)
-            ? webrtc::VideoContentType::SCREENSHARE
-            : webrtc::VideoContentType::UNSPECIFIED;
-    encoded_image_.timing_.flags = webrtc::VideoSendTiming::kInvalid;
-    encoded_image_.SetTimestamp(frame.timestamp());
-    encoded_image_.ntp_time_ms_ = frame.ntp_time_ms();
-    encoded_image_.capture_time_ms_ = frame.render_time_ms();
-    encoded_image_.rotation_ = frame.rotation();
-    encoded_image_.SetColorSpace(frame.color_space());
-    encoded_image_._frameType = webrtc::VideoFrameType::kVideoFrameDelta;
-    //RTC_LOG(LS_ERROR) << __FUNCTION__ << " packet.size():" << packet.size();
-
-    webrtc::CodecSpecificInfo codec_specific;
-    codec_specific.codecType = webrtc::kVideoCodecH264;
-    codec_specific.codecSpecific.H264.packetization_mode =
-        webrtc::H264PacketizationMode::NonInterleaved;
-
-    h264_bitstream_parser_.ParseBitstream(packet.data(), packet.size());
-    h264_bitstream_parser_.GetLastSliceQp(&encoded_image_.qp_);
-
-    webrtc::EncodedImageCallback::Result result = callback_->OnEncodedImage(
-        encoded_image_, &codec_specific);
-    if (result.error != webrtc::EncodedImageCallback::Result::OK) {
-      RTC_LOG(LS_ERROR) << __FUNCTION__
-                        << " OnEncodedImage failed error:" << result.error;
-      return WEBRTC_VIDEO_CODEC_ERROR;
+  layer->applied_bitrate_bps = bitrate_bps;
+  layer->applied_max_bitrate_bps = layer->max_bitrate_bps;
+  layer->applied_framerate = framerate_;
+  layer->reconfigure_needed = false;
+  if (layer->resize_needed) {
+    layer->resize_needed = false;
+    layer->frame_count = 0;
+    layer->intra_refresh_start = -1;
+  }
+  return true;
+}
+
+bool NvCodecH264Encoder::WaitForInputBuffer(Layer* layer, bool drain) {
+  // drain の場合は投入済みのフレームが全部出力されるまで待つ
+  size_t max_pending =
+      drain ? 0 : (size_t)layer->nv_encoder->GetEncoderBufferCount() - 1;
+  std::unique_lock<std::mutex> lock(layer->output_mutex);
+  layer->output_cond.wait(lock, [layer, max_pending]() {
+    return layer->output_failed || layer->pending_frames.size() <= max_pending;
+  });
+  return !layer->output_failed;
+}
+
+void NvCodecH264Encoder::OutputThread(Layer* layer) {
+  while (true) {
+    PendingFrame frame;
+    {
+      std::unique_lock<std::mutex> lock(layer->output_mutex);
+      layer->output_cond.wait(lock, [layer]() {
+        return layer->output_stop || !layer->pending_frames.empty();
+      });
+      // 止める場合も、投入済みのフレームは入力バッファを解放するために全部受け取る
+      if (layer->pending_frames.empty()) {
+        return;
+      }
+      frame = layer->pending_frames.front();
+    }
+
+    bool failed = false;
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> encoded_data;
+    NvEncoder::PacketInfo info;
+    try {
+      layer->nv_encoder->GetSubmittedPacket(
+          [this, &encoded_data](size_t size) {
+            // プールのバッファが全部送信側で使われている場合は新しく確保する
+            auto buffer = encoded_buffer_pool_.Create(size);
+            if (buffer) {
+              encoded_data = buffer;
+            } else {
+              encoded_data = webrtc::EncodedImageBuffer::Create(size);
+            }
+            return encoded_data->data();
+          },
+          &info);
+    } catch (const NVENCException& e) {
+      RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
+      failed = true;
+    }
+    if (!failed && encoded_data) {
+      SendEncodedImage(layer, frame, info, std::move(encoded_data));
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(layer->output_mutex);
+      layer->pending_frames.pop_front();
+      if (failed) {
+        // 失敗したら以降のフレームは受け取れないので、Encode がエラーを返すようにする
+        layer->output_failed = true;
+        layer->pending_frames.clear();
+      }
+    }
+    layer->output_cond.notify_all();
+    if (failed) {
+      return;
     }
-    bitrate_adjuster_.Update(packet.size());
   }
+}
 
-  return WEBRTC_VIDEO_CODEC_OK;
+void NvCodecH264Encoder::SendEncodedImage(
+    Layer* layer,
+    const PendingFrame& frame,
+    const NvEncoder::PacketInfo& info,
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> encoded_data) {
+  webrtc::EncodedImage& encoded_image = layer->encoded_image;
+  size_t size = encoded_data->size();
+  encoded_image.SetEncodedData(std::move(encoded_data));
+  encoded_image._encodedWidth = frame.width;
+  encoded_image._encodedHeight = frame.height;
+  encoded_image.content_type_ =
+      (mode_ == webrtc::VideoCodecMode::kScreensharing)
+          ? webrtc::VideoContentType::SCREENSHARE
+          : webrtc::VideoContentType::UNSPECIFIED;
+  encoded_image.timing_.flags = webrtc::VideoSendTiming::kInvalid;
+  encoded_image.SetTimestamp(frame.timestamp);
+  encoded_image.ntp_time_ms_ = frame.ntp_time_ms;
+  encoded_image.capture_time_ms_ = frame.capture_time_ms;
+  encoded_image.rotation_ = frame.rotation;
+  encoded_image.SetColorSpace(frame.color_space);
+  // フレームの種類と QP は NVENC が報告したものを使い、ビットストリームは解析しない
+  encoded_image._frameType = info.pictureType == NV_ENC_PIC_TYPE_IDR
+                                 ? webrtc::VideoFrameType::kVideoFrameKey
+                                 : webrtc::VideoFrameType::kVideoFrameDelta;
+  encoded_image.qp_ = (int)info.frameAvgQP;
+  sora::EncoderStats::Instance().Add(
+      size, info.pictureType == NV_ENC_PIC_TYPE_IDR, encoded_image.qp_,
+      rtc::TimeMicros() - frame.submit_time_us);
+  if (layers_.size() > 1) {
+    encoded_image.SetSpatialIndex(layer->simulcast_index);
+  }
+
+  webrtc::CodecSpecificInfo codec_specific;
+  codec_specific.codecType = webrtc::kVideoCodecH264;
+  codec_specific.codecSpecific.H264.packetization_mode =
+      webrtc::H264PacketizationMode::NonInterleaved;
+
+  // 複数のレイヤーの出力スレッドから呼ばれるので、コールバックは順番に呼ぶ
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (callback_ == nullptr) {
+    return;
+  }
+  webrtc::EncodedImageCallback::Result result =
+      callback_->OnEncodedImage(encoded_image, &codec_specific);
+  if (result.error != webrtc::EncodedImageCallback::Result::OK) {
+    RTC_LOG(LS_ERROR) << __FUNCTION__
+                      << " OnEncodedImage failed error:" << result.error;
+    return;
+  }
+  layer->bitrate_adjuster.Update(size);
 }
 
 void NvCodecH264Encoder::SetRates(
     const webrtc::VideoEncoder::RateControlParameters& parameters) {
-  if (!nv_encoder_) {
+  if (layers_.empty()) {
     RTC_LOG(LS_WARNING) << "SetRates() while uninitialized.";
     return;
   }
@@ -289,16 +750,33 @@ void NvCodecH264Encoder::SetRates(
   }
 
   uint32_t new_framerate = (uint32_t)parameters.framerate_fps;
-  uint32_t new_bitrate = parameters.bitrate.get_sum_bps();
-  RTC_LOG(INFO) << __FUNCTION__ << " framerate_:" << framerate_
-                << " new_framerate: " << new_framerate
-                << " target_bitrate_bps_:" << target_bitrate_bps_
-                << " new_bitrate:" << new_bitrate
-                << " max_bitrate_bps_:" << max_bitrate_bps_;
+  for (auto& layer : layers_) {
+    uint32_t new_bitrate =
+        layers_.size() == 1
+            ? parameters.bitrate.get_sum_bps()
+            : parameters.bitrate.GetSpatialLayerSum(layer->simulcast_index);
+    // 帯域の推定が変わる度に呼ばれるので間引く
+    SORA_LOG_RATE_LIMITED(LS_INFO, 1000)
+        << __FUNCTION__ << " simulcast_index:" << layer->simulcast_index
+        << " framerate_:" << framerate_ << " new_framerate: " << new_framerate
+        << " target_bitrate_bps:" << layer->target_bitrate_bps
+        << " new_bitrate:" << new_bitrate
+        << " max_bitrate_bps:" << layer->max_bitrate_bps;
+    // ビットレートが 0 のレイヤーは送らない
+    layer->active = new_bitrate > 0;
+    if (!layer->active) {
+      continue;
+    }
+    // 帯域の推定が変わっていなければ NVENC の設定もそのまま
+    if (new_bitrate == layer->target_bitrate_bps &&
+        new_framerate == framerate_) {
+      continue;
+    }
+    layer->target_bitrate_bps = new_bitrate;
+    layer->bitrate_adjuster.SetTargetBitrateBps(layer->target_bitrate_bps);
+    layer->reconfigure_needed = true;
+  }
   framerate_ = new_framerate;
-  target_bitrate_bps_ = new_bitrate;
-  bitrate_adjuster_.SetTargetBitrateBps(target_bitrate_bps_);
-  reconfigure_needed_ = true;
 }
 
 webrtc::VideoEncoder::EncoderInfo NvCodecH264Encoder::GetEncoderInfo() const {
@@ -314,29 +792,62 @@ webrtc::VideoEncoder::EncoderInfo NvCodecH264Encoder::GetEncoderInfo() const {
 
 int32_t NvCodecH264Encoder::InitNvEnc() {
 #ifdef _WIN32
+  // ステージングテクスチャは一番解像度の高いレイヤーへのアップロードに使う
+  id3d11_texture_.Reset();
+#endif
+  for (auto& layer : layers_) {
+    int32_t ret = InitLayer(layer.get());
+    if (ret != WEBRTC_VIDEO_CODEC_OK) {
+      ReleaseNvEnc();
+      return ret;
+    }
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t NvCodecH264Encoder::InitLayer(Layer* layer) {
+#ifdef _WIN32
+  bool is_top = layer == layers_.back().get();
+  // Unity のテクスチャも VideoProcessor で NV12 に変換するので、入力は常に NV12
   DXGI_FORMAT dxgi_format = DXGI_FORMAT_NV12;
   NV_ENC_BUFFER_FORMAT nvenc_format = NV_ENC_BUFFER_FORMAT_NV12;
-  if (use_native_) {
-    dxgi_format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    nvenc_format = NV_ENC_BUFFER_FORMAT_ARGB;
-  }
-  D3D11_TEXTURE2D_DESC desc;
-  ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
-  desc.Width = width_;
-  desc.Height = height_;
-  desc.MipLevels = 1;
-  desc.ArraySize = 1;
-  desc.Format = dxgi_format;
-  desc.SampleDesc.Count = 1;
-  desc.Usage = D3D11_USAGE_STAGING;
-  desc.BindFlags = 0;
-  desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-  id3d11_device_->CreateTexture2D(&desc, NULL, id3d11_texture_.GetAddressOf());
+
+  // 入力バッファは、エンコード中のものと次のフレームをコピーする分に
+  // output_delay_ を足した数だけ用意する
+  uint32_t extra_output_delay = output_delay_ + 1;
 
   // Driver が古いとかに気づくのはココ
   try {
-    nv_encoder_.reset(new NvEncoderD3D11(id3d11_device_.Get(), width_, height_,
-                                         nvenc_format));
+    if (!texture_input_ && !host_memory_failed_ && layers_.size() == 1) {
+      // テクスチャを使わない場合は NVENC の入力バッファに直接書き込む
+      layer->host_memory_encoder = new NvEncoderHostMemory(
+          NV_ENC_DEVICE_TYPE_DIRECTX, id3d11_device_.Get(), layer->width,
+          layer->height, nvenc_format, extra_output_delay);
+      layer->nv_encoder.reset(layer->host_memory_encoder);
+    } else {
+      if (is_top) {
+        D3D11_TEXTURE2D_DESC desc;
+        ZeroMemory(&desc, sizeof(D3D11_TEXTURE2D_DESC));
+        desc.Width = layer->max_width;
+        desc.Height = layer->max_height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = dxgi_format;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.BindFlags = 0;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        id3d11_device_->CreateTexture2D(&desc, NULL,
+                                        id3d11_texture_.GetAddressOf());
+      } else if (!InitScaler(layer, DXGI_FORMAT_NV12)) {
+        return WEBRTC_VIDEO_CODEC_ERROR;
+      }
+
+      layer->nv_encoder.reset(new NvEncoderD3D11(id3d11_device_.Get(),
+                                                 layer->width, layer->height,
+                                                 nvenc_format,
+                                                 extra_output_delay));
+    }
   } catch (const NVENCException& e) {
     RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
     return WEBRTC_VIDEO_CODEC_ERROR;
@@ -345,36 +856,37 @@ int32_t NvCodecH264Encoder::InitNvEnc() {
 
 #ifdef __linux__
   try {
-    nv_encoder_.reset(cuda_->CreateNvEncoder(width_, height_, use_native_));
+    layer->nv_encoder.reset(
+        cuda_->CreateNvEncoder(layer->width, layer->height, use_native_));
   } catch (const NVENCException& e) {
     RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
     return WEBRTC_VIDEO_CODEC_ERROR;
   }
 #endif
 
-  initialize_params_ = {NV_ENC_INITIALIZE_PARAMS_VER};
+  NV_ENC_INITIALIZE_PARAMS initialize_params = {NV_ENC_INITIALIZE_PARAMS_VER};
   NV_ENC_CONFIG encode_config = {NV_ENC_CONFIG_VER};
-  initialize_params_.encodeConfig = &encode_config;
+  initialize_params.encodeConfig = &encode_config;
   try {
-    nv_encoder_->CreateDefaultEncoderParams(
-        &initialize_params_, NV_ENC_CODEC_H264_GUID,
+    layer->nv_encoder->CreateDefaultEncoderParams(
+        &initialize_params, NV_ENC_CODEC_H264_GUID,
         NV_ENC_PRESET_LOW_LATENCY_DEFAULT_GUID);
 
-    //initialize_params_.enablePTD = 1;
-    initialize_params_.frameRateDen = 1;
-    initialize_params_.frameRateNum = framerate_;
-    initialize_params_.maxEncodeWidth = width_;
-    initialize_params_.maxEncodeHeight = height_;
+    //initialize_params.enablePTD = 1;
+    initialize_params.frameRateDen = 1;
+    initialize_params.frameRateNum = framerate_;
+    // 入力バッファは最大の解像度で確保して、縮小は Reconfigure で行う
+    initialize_params.maxEncodeWidth = layer->max_width;
+    initialize_params.maxEncodeHeight = layer->max_height;
 
-    //encode_config.profileGUID = NV_ENC_H264_PROFILE_BASELINE_GUID;
     encode_config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
-    encode_config.rcParams.averageBitRate = target_bitrate_bps_;
-    encode_config.rcParams.maxBitRate = max_bitrate_bps_;
+    encode_config.rcParams.averageBitRate = layer->target_bitrate_bps;
+    encode_config.rcParams.maxBitRate = layer->max_bitrate_bps;
 
     encode_config.rcParams.disableBadapt = 1;
     encode_config.rcParams.vbvBufferSize =
         encode_config.rcParams.averageBitRate *
-        initialize_params_.frameRateDen / initialize_params_.frameRateNum;
+        initialize_params.frameRateDen / initialize_params.frameRateNum;
     encode_config.rcParams.vbvInitialDelay =
         encode_config.rcParams.vbvBufferSize;
     encode_config.gopLength = NVENC_INFINITE_GOPLENGTH;
@@ -382,42 +894,295 @@ int32_t NvCodecH264Encoder::InitNvEnc() {
     encode_config.rcParams.enableAQ = 1;
 
     //encode_config.encodeCodecConfig.h264Config.outputAUD = 1;
-    //encode_config.encodeCodecConfig.h264Config.level = NV_ENC_LEVEL_H264_31;
-    //encode_config.encodeCodecConfig.h264Config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CAVLC;
+    SetProfileLevel(&encode_config);
     encode_config.encodeCodecConfig.h264Config.idrPeriod =
         NVENC_INFINITE_GOPLENGTH;
     encode_config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
     encode_config.encodeCodecConfig.h264Config.sliceMode = 0;
     encode_config.encodeCodecConfig.h264Config.sliceModeData = 0;
 
-    nv_encoder_->CreateEncoder(&initialize_params_);
+    // 周期的なリフレッシュはせず、キーフレーム要求があった時だけ行う
+    layer->intra_refresh_cnt = std::max<uint32_t>(framerate_ / 2, 2);
+    if (intra_refresh_) {
+      encode_config.encodeCodecConfig.h264Config.enableIntraRefresh = 1;
+      encode_config.encodeCodecConfig.h264Config.intraRefreshPeriod =
+          NVENC_INFINITE_GOPLENGTH;
+      encode_config.encodeCodecConfig.h264Config.intraRefreshCnt =
+          layer->intra_refresh_cnt;
+      encode_config.encodeCodecConfig.h264Config.outputRecoveryPointSEI = 1;
+    }
+
+    layer->nv_encoder->CreateEncoder(&initialize_params);
 
-    RTC_LOG(INFO) << __FUNCTION__ << " framerate_:" << framerate_
-                  << " bitrate_bps_:" << target_bitrate_bps_
-                  << " maxBitRate:" << encode_config.rcParams.maxBitRate;
+    RTC_LOG(INFO) << __FUNCTION__ << " simulcast_index:"
+                  << layer->simulcast_index << " framerate_:" << framerate_
+                  << " bitrate_bps:" << layer->target_bitrate_bps
+                  << " maxBitRate:" << encode_config.rcParams.maxBitRate
+                  << " encoder_buffers:"
+                  << layer->nv_encoder->GetEncoderBufferCount();
   } catch (const NVENCException& e) {
     RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
+#ifdef _WIN32
+    // 入力バッファを NVENC に確保させられなかった場合はステージングテクスチャを使う
+    if (layer->host_memory_encoder != nullptr) {
+      RTC_LOG(LS_WARNING) << "Fallback to the staging texture";
+      host_memory_failed_ = true;
+      layer->host_memory_encoder = nullptr;
+      layer->nv_encoder = nullptr;
+      return InitLayer(layer);
+    }
+#endif
     return WEBRTC_VIDEO_CODEC_ERROR;
   }
 
-  reconfigure_needed_ = false;
+  layer->applied_bitrate_bps = layer->target_bitrate_bps;
+  layer->applied_max_bitrate_bps = layer->max_bitrate_bps;
+  layer->applied_framerate = framerate_;
+  layer->reconfigure_needed = false;
+  layer->resize_needed = false;
+  // 新しいセッションの最初のフレームは IDR になる
+  layer->frame_count = 0;
+  layer->intra_refresh_start = -1;
+
+  layer->output_stop = false;
+  layer->output_failed = false;
+  layer->output_thread = std::thread([this, layer]() { OutputThread(layer); });
 
   return WEBRTC_VIDEO_CODEC_OK;
 }
 
+void NvCodecH264Encoder::SetKeyFrameParams(Layer* layer,
+                                           NV_ENC_PIC_PARAMS* pic_params) {
+  if (!intra_refresh_ || layer->frame_count == 0) {
+    pic_params->encodePicFlags =
+        NV_ENC_PIC_FLAG_FORCEINTRA | NV_ENC_PIC_FLAG_FORCEIDR;
+    return;
+  }
+
+  int64_t cnt = layer->intra_refresh_cnt;
+  int64_t elapsed = layer->frame_count - layer->intra_refresh_start;
+  if (layer->intra_refresh_start >= 0 && elapsed < cnt) {
+    // リフレッシュ中なので、終わるまでは何もしない
+    return;
+  }
+  if (layer->intra_refresh_start >= 0 && elapsed < 2 * cnt) {
+    // リフレッシュが終わってもまだ要求されている場合は、受信側が途中から
+    // デコードできない状態（新しく参加した等）なので IDR を送る。
+    // WebRTC の H264 の受信側はロス後は IDR でしか復帰できない。
+    layer->intra_refresh_start = -1;
+    pic_params->encodePicFlags =
+        NV_ENC_PIC_FLAG_FORCEINTRA | NV_ENC_PIC_FLAG_FORCEIDR;
+    return;
+  }
+  layer->intra_refresh_start = layer->frame_count;
+  pic_params->codecPicParams.h264PicParams.forceIntraRefreshWithFrameCnt =
+      layer->intra_refresh_cnt;
+}
+
+void NvCodecH264Encoder::SetProfileLevel(NV_ENC_CONFIG* encode_config) {
+  NV_ENC_CONFIG_H264& h264_config = encode_config->encodeCodecConfig.h264Config;
+  switch (profile_) {
+    case webrtc::H264::kProfileConstrainedBaseline:
+    case webrtc::H264::kProfileBaseline:
+      encode_config->profileGUID = NV_ENC_H264_PROFILE_BASELINE_GUID;
+      h264_config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CAVLC;
+      h264_config.adaptiveTransformMode =
+          NV_ENC_H264_ADAPTIVE_TRANSFORM_DISABLE;
+      break;
+    case webrtc::H264::kProfileMain:
+      encode_config->profileGUID = NV_ENC_H264_PROFILE_MAIN_GUID;
+      h264_config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
+      h264_config.adaptiveTransformMode =
+          NV_ENC_H264_ADAPTIVE_TRANSFORM_DISABLE;
+      break;
+    case webrtc::H264::kProfileConstrainedHigh:
+    case webrtc::H264::kProfileHigh:
+      // B フレームは使っていないので Constrained High も High で出せる
+      encode_config->profileGUID = NV_ENC_H264_PROFILE_HIGH_GUID;
+      h264_config.entropyCodingMode = NV_ENC_H264_ENTROPY_CODING_MODE_CABAC;
+      h264_config.adaptiveTransformMode =
+          NV_ENC_H264_ADAPTIVE_TRANSFORM_ENABLE;
+      break;
+  }
+
+  // webrtc::H264::Level は 1b 以外 NV_ENC_LEVEL と同じ値になっている
+  if (level_ == webrtc::H264::kLevel1_b) {
+    h264_config.level = NV_ENC_LEVEL_H264_1b;
+  } else {
+    h264_config.level = static_cast<uint32_t>(level_);
+  }
+}
+
+#ifdef _WIN32
+ComPtr<ID3D11Texture2D> NvCodecH264Encoder::OpenSharedTexture(
+    sora::D3D11TextureBuffer* buffer) {
+  // NV12 への変換に VideoProcessor を使うので、無い場合は I420 を経由する
+  if (video_device_ == nullptr || buffer->width() != width_ ||
+      buffer->height() != height_) {
+    return nullptr;
+  }
+  auto it = shared_textures_.find(buffer->shared_handle());
+  if (it != shared_textures_.end()) {
+    return it->second;
+  }
+  // Unity と別のアダプタを使っている場合はここで失敗する
+  ComPtr<ID3D11Texture2D> texture;
+  HRESULT hr = id3d11_device_->OpenSharedResource(
+      buffer->shared_handle(), __uuidof(ID3D11Texture2D),
+      (void**)texture.GetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_WARNING) << "ID3D11Device::OpenSharedResource is failed: hr="
+                        << hr;
+    texture = nullptr;
+  }
+  shared_textures_[buffer->shared_handle()] = texture;
+  return texture;
+}
+
+bool NvCodecH264Encoder::InitScaler(Layer* layer, DXGI_FORMAT input_format) {
+  D3D11_VIDEO_PROCESSOR_CONTENT_DESC content_desc = {};
+  content_desc.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+  content_desc.InputFrameRate = {framerate_, 1};
+  content_desc.InputWidth = width_;
+  content_desc.InputHeight = height_;
+  content_desc.OutputFrameRate = {framerate_, 1};
+  content_desc.OutputWidth = layer->width;
+  content_desc.OutputHeight = layer->height;
+  content_desc.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+  HRESULT hr = video_device_->CreateVideoProcessorEnumerator(
+      &content_desc, layer->vp_enumerator.ReleaseAndGetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_ERROR)
+        << "ID3D11VideoDevice::CreateVideoProcessorEnumerator is failed: hr="
+        << hr;
+    return false;
+  }
+
+  UINT input_flags = 0;
+  UINT output_flags = 0;
+  if (FAILED(layer->vp_enumerator->CheckVideoProcessorFormat(input_format,
+                                                             &input_flags)) ||
+      FAILED(layer->vp_enumerator->CheckVideoProcessorFormat(DXGI_FORMAT_NV12,
+                                                             &output_flags)) ||
+      (input_flags & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_INPUT) == 0 ||
+      (output_flags & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_OUTPUT) == 0) {
+    RTC_LOG(LS_ERROR) << "Video processor does not support format "
+                      << input_format;
+    return false;
+  }
+  layer->vp_input_format = input_format;
+
+  hr = video_device_->CreateVideoProcessor(
+      layer->vp_enumerator.Get(), 0, layer->vp.ReleaseAndGetAddressOf());
+  if (FAILED(hr)) {
+    RTC_LOG(LS_ERROR)
+        << "ID3D11VideoDevice::CreateVideoProcessor is failed: hr=" << hr;
+    return false;
+  }
+  video_context_->VideoProcessorSetStreamFrameFormat(
+      layer->vp.Get(), 0, D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE);
+  video_context_->VideoProcessorSetStreamAutoProcessingMode(layer->vp.Get(), 0,
+                                                            FALSE);
+  RECT src_rect = {0, 0, (LONG)width_, (LONG)height_};
+  RECT dst_rect = {0, 0, (LONG)layer->width, (LONG)layer->height};
+  video_context_->VideoProcessorSetStreamSourceRect(layer->vp.Get(), 0, TRUE,
+                                                    &src_rect);
+  video_context_->VideoProcessorSetStreamDestRect(layer->vp.Get(), 0, TRUE,
+                                                  &dst_rect);
+  video_context_->VideoProcessorSetOutputTargetRect(layer->vp.Get(), TRUE,
+                                                    &dst_rect);
+  return true;
+}
+
+bool NvCodecH264Encoder::ScaleToLayer(Layer* layer,
+                                      ID3D11Texture2D* src,
+                                      ID3D11Texture2D* dst) {
+  // 入力バッファは使い回されるので、ビューもテクスチャごとに作って使い回す
+  ComPtr<ID3D11VideoProcessorInputView>& input_view =
+      layer->vp_input_views[src];
+  if (input_view == nullptr) {
+    D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC desc = {};
+    desc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+    HRESULT hr = video_device_->CreateVideoProcessorInputView(
+        src, layer->vp_enumerator.Get(), &desc, input_view.GetAddressOf());
+    if (FAILED(hr)) {
+      RTC_LOG(LS_ERROR)
+          << "ID3D11VideoDevice::CreateVideoProcessorInputView is failed: hr="
+          << hr;
+      layer->vp_input_views.erase(src);
+      return false;
+    }
+  }
+  ComPtr<ID3D11VideoProcessorOutputView>& output_view =
+      layer->vp_output_views[dst];
+  if (output_view == nullptr) {
+    D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC desc = {};
+    desc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+    HRESULT hr = video_device_->CreateVideoProcessorOutputView(
+        dst, layer->vp_enumerator.Get(), &desc, output_view.GetAddressOf());
+    if (FAILED(hr)) {
+      RTC_LOG(LS_ERROR)
+          << "ID3D11VideoDevice::CreateVideoProcessorOutputView is failed: hr="
+          << hr;
+      layer->vp_output_views.erase(dst);
+      return false;
+    }
+  }
+
+  D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+  stream.Enable = TRUE;
+  stream.pInputSurface = input_view.Get();
+  HRESULT hr = video_context_->VideoProcessorBlt(
+      layer->vp.Get(), output_view.Get(), 0, 1, &stream);
+  if (FAILED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11VideoContext::VideoProcessorBlt is failed: hr="
+                      << hr;
+    return false;
+  }
+  return true;
+}
+#endif
+
 int32_t NvCodecH264Encoder::ReleaseNvEnc() {
   RTC_LOG(LS_INFO) << __FUNCTION__;
-  if (nv_encoder_) {
+  for (auto& layer : layers_) {
+    ReleaseLayer(layer.get());
+  }
+#ifdef _WIN32
+  id3d11_texture_.Reset();
+  shared_textures_.clear();
+#endif
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void NvCodecH264Encoder::ReleaseLayer(Layer* layer) {
+  if (layer->output_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(layer->output_mutex);
+      layer->output_stop = true;
+    }
+    layer->output_cond.notify_all();
+    layer->output_thread.join();
+  }
+  if (layer->nv_encoder) {
     try {
-      nv_encoder_->EndEncode(v_packet_);
-      nv_encoder_->DestroyEncoder();
+      std::vector<std::vector<uint8_t>> packets;
+      layer->nv_encoder->EndEncode(packets);
+      layer->nv_encoder->DestroyEncoder();
     } catch (const NVENCException& e) {
       RTC_LOG(LS_ERROR) << __FUNCTION__ << e.what();
     }
-    nv_encoder_ = nullptr;
+    layer->nv_encoder = nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(layer->output_mutex);
+    layer->pending_frames.clear();
+  }
 #ifdef _WIN32
-    id3d11_texture_.Reset();
+  layer->host_memory_encoder = nullptr;
+  layer->vp_input_views.clear();
+  layer->vp_output_views.clear();
+  layer->vp.Reset();
+  layer->vp_enumerator.Reset();
 #endif
-  }
-  return WEBRTC_VIDEO_CODEC_OK;
 }
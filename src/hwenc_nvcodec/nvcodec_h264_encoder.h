@@ -7,28 +7,60 @@
 #endif
 
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <thread>
+#include <vector>
 
 #include "api/video_codecs/video_encoder.h"
-#include "common_video/h264/h264_bitstream_parser.h"
 #include "common_video/include/bitrate_adjuster.h"
+#include "media/base/codec.h"
+#include "media/base/h264_profile_level_id.h"
 #include "modules/video_coding/codecs/h264/include/h264.h"
 
+#include "rtc/encoded_image_buffer_pool.h"
+
 // NvCodec
 #ifdef _WIN32
 #include <NvEncoder/NvEncoderD3D11.h>
+
+#include "nvcodec_host_memory_encoder.h"
 #endif
 #ifdef __linux__
 #include "nvcodec_h264_encoder_cuda.h"
 #endif
 
+#ifdef _WIN32
+namespace sora {
+class D3D11TextureBuffer;
+}
+#endif
+
 class NvCodecH264Encoder : public webrtc::VideoEncoder {
  public:
-  NvCodecH264Encoder(const cricket::VideoCodec& codec);
+  // output_delay は、エンコード中のフレームとは別に何フレームまで入力を受け付けるか。
+  // 0 の場合が最も遅延が少なく、増やすと高解像度でのスループットが上がる。
+  // intra_refresh が true の場合、キーフレーム要求には IDR ではなく
+  // 数フレームかけてのイントラリフレッシュで応える。
+#ifdef _WIN32
+  // adapter_luid のアダプタにデバイスを作る。
+  // 指定しないか見つからなかった場合は最初のアダプタを使う。
+  NvCodecH264Encoder(const cricket::VideoCodec& codec,
+                     int output_delay = 0,
+                     bool intra_refresh = false,
+                     LUID adapter_luid = {});
+#else
+  NvCodecH264Encoder(const cricket::VideoCodec& codec,
+                     int output_delay = 0,
+                     bool intra_refresh = false);
+#endif
   ~NvCodecH264Encoder() override;
 
+  // NvEnc API のロードは重いので、結果はプロセスで覚えておく
   static bool IsSupported();
 
   int32_t InitEncode(const webrtc::VideoCodec* codec_settings,
@@ -47,33 +79,125 @@ class NvCodecH264Encoder : public webrtc::VideoEncoder {
  private:
   std::mutex mutex_;
   webrtc::EncodedImageCallback* callback_ = nullptr;
-  webrtc::BitrateAdjuster bitrate_adjuster_;
-  uint32_t target_bitrate_bps_ = 0;
-  uint32_t max_bitrate_bps_ = 0;
+
+  // エンコーダに投入済みで、まだ出力を受け取っていないフレームの情報
+  struct PendingFrame {
+    uint32_t width;
+    uint32_t height;
+    uint32_t timestamp;
+    int64_t ntp_time_ms;
+    int64_t capture_time_ms;
+    webrtc::VideoRotation rotation;
+    absl::optional<webrtc::ColorSpace> color_space;
+    // エンコーダに投入した時刻
+    int64_t submit_time_us;
+  };
+
+  // NVENC のセッションひとつ分。
+  // simulcast の場合はレイヤーごとに作って、一番解像度の高いレイヤーに
+  // アップロードしたフレームを GPU で縮小して他のレイヤーに渡す。
+  struct Layer {
+    int simulcast_index = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // セッションを作った時の最大の解像度。これ以下なら Reconfigure で変更できる
+    uint32_t max_width = 0;
+    uint32_t max_height = 0;
+    bool active = true;
+    webrtc::BitrateAdjuster bitrate_adjuster{0.05, 0.95};
+    uint32_t target_bitrate_bps = 0;
+    uint32_t max_bitrate_bps = 0;
+    bool reconfigure_needed = false;
+    bool resize_needed = false;
+    // NVENC に最後に設定したレート制御の値。変わっていなければ Reconfigure しない
+    uint32_t applied_bitrate_bps = 0;
+    uint32_t applied_max_bitrate_bps = 0;
+    uint32_t applied_framerate = 0;
+    // イントラリフレッシュの状態。フレーム数はこのセッションで投入した数
+    uint32_t intra_refresh_cnt = 0;
+    int64_t frame_count = 0;
+    int64_t intra_refresh_start = -1;
+    std::unique_ptr<NvEncoder> nv_encoder;
+#ifdef _WIN32
+    // CPU 上のフレームは NVENC が確保した入力バッファに直接書き込む。
+    // simulcast の場合や、入力バッファを確保できなかった場合はステージングテクスチャからコピーする。
+    NvEncoderHostMemory* host_memory_encoder = nullptr;
+    // 一番解像度の高いレイヤーの入力テクスチャから縮小するための VideoProcessor。
+    // 一番解像度の高いレイヤーでは Unity のテクスチャを NV12 に変換するのに使う。
+    DXGI_FORMAT vp_input_format = DXGI_FORMAT_UNKNOWN;
+    Microsoft::WRL::ComPtr<ID3D11VideoProcessorEnumerator> vp_enumerator;
+    Microsoft::WRL::ComPtr<ID3D11VideoProcessor> vp;
+    std::map<ID3D11Texture2D*,
+             Microsoft::WRL::ComPtr<ID3D11VideoProcessorInputView>>
+        vp_input_views;
+    std::map<ID3D11Texture2D*,
+             Microsoft::WRL::ComPtr<ID3D11VideoProcessorOutputView>>
+        vp_output_views;
+#endif
+
+    // 出力スレッドでエンコード結果を待って OnEncodedImage を呼ぶ
+    std::thread output_thread;
+    std::mutex output_mutex;
+    std::condition_variable output_cond;
+    std::deque<PendingFrame> pending_frames;
+    bool output_stop = false;
+    bool output_failed = false;
+    webrtc::EncodedImage encoded_image;
+  };
+  // simulcastStream と同じく解像度の低い順に並べる
+  std::vector<std::unique_ptr<Layer>> layers_;
 
   int32_t InitNvEnc();
   int32_t ReleaseNvEnc();
-  webrtc::H264BitstreamParser h264_bitstream_parser_;
+  int32_t InitLayer(Layer* layer);
+  void UpdateLayer(Layer* layer,
+                   const webrtc::VideoCodec* codec_settings,
+                   int number_of_streams);
+  bool ResizeInPlace(const webrtc::VideoCodec* codec_settings);
+  void SetProfileLevel(NV_ENC_CONFIG* encode_config);
+  void SetKeyFrameParams(Layer* layer, NV_ENC_PIC_PARAMS* pic_params);
+  void ReleaseLayer(Layer* layer);
+  bool ReconfigureLayer(Layer* layer);
+  void OutputThread(Layer* layer);
+  bool WaitForInputBuffer(Layer* layer, bool drain);
+  void SendEncodedImage(
+      Layer* layer,
+      const PendingFrame& frame,
+      const NvEncoder::PacketInfo& info,
+      rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> encoded_data);
+  int output_delay_;
+  bool intra_refresh_;
+  // エンコード結果はプールしたバッファに直接コピーする
+  sora::EncodedImageBufferPool encoded_buffer_pool_{16};
 
 #ifdef _WIN32
   Microsoft::WRL::ComPtr<ID3D11Device> id3d11_device_;
   Microsoft::WRL::ComPtr<ID3D11DeviceContext> id3d11_context_;
   Microsoft::WRL::ComPtr<ID3D11Texture2D> id3d11_texture_;
-  std::unique_ptr<NvEncoderD3D11> nv_encoder_;
+  Microsoft::WRL::ComPtr<ID3D11VideoDevice> video_device_;
+  Microsoft::WRL::ComPtr<ID3D11VideoContext> video_context_;
+  bool host_memory_failed_ = false;
+  // Unity のテクスチャを受け取ったら、入力バッファをテクスチャにする
+  bool texture_input_ = false;
+  // 共有ハンドルから開いたテクスチャ。開けなかったハンドルは nullptr を入れておく
+  std::map<HANDLE, Microsoft::WRL::ComPtr<ID3D11Texture2D>> shared_textures_;
+  Microsoft::WRL::ComPtr<ID3D11Texture2D> OpenSharedTexture(
+      sora::D3D11TextureBuffer* buffer);
+  bool InitScaler(Layer* layer, DXGI_FORMAT input_format);
+  bool ScaleToLayer(Layer* layer, ID3D11Texture2D* src, ID3D11Texture2D* dst);
 #endif
 #ifdef __linux__
   std::unique_ptr<NvCodecH264EncoderCuda> cuda_;
-  std::unique_ptr<NvEncoder> nv_encoder_;
-#endif
-  bool reconfigure_needed_ = false;
   bool use_native_ = false;
+#endif
+  // 一番解像度の高いレイヤーのサイズ
   uint32_t width_ = 0;
   uint32_t height_ = 0;
   uint32_t framerate_ = 0;
   webrtc::VideoCodecMode mode_ = webrtc::VideoCodecMode::kRealtimeVideo;
-  NV_ENC_INITIALIZE_PARAMS initialize_params_;
-  std::vector<std::vector<uint8_t>> v_packet_;
-  webrtc::EncodedImage encoded_image_;
+  // SDP でネゴシエーションされた profile-level-id
+  webrtc::H264::Profile profile_ = webrtc::H264::kProfileConstrainedBaseline;
+  webrtc::H264::Level level_ = webrtc::H264::kLevel3_1;
 };
 
 #endif  // NVCODEC_H264_ENCODER_H_
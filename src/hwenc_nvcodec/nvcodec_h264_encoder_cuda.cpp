@@ -5,11 +5,13 @@
 #include <NvDecoder/NvDecoder.h>
 #include <NvEncoder/NvEncoderCuda.h>
 
+#include "dyn/cuda.h"
+
 #ifdef __cuda_cuda_h__
 inline bool check(CUresult e, int iLine, const char* szFile) {
   if (e != CUDA_SUCCESS) {
     const char* szErrName = NULL;
-    cuGetErrorName(e, &szErrName);
+    dyn::cuGetErrorName(e, &szErrName);
     std::cerr << "CUDA driver API error " << szErrName << " at line " << iLine
               << " in file " << szFile << std::endl;
     return false;
@@ -115,6 +117,11 @@ class NvCodecH264EncoderCudaImpl {
                   int size,
                   int width,
                   int height);
+  void CopyNV12(NvEncoder* nv_encoder,
+                const void* ptr,
+                int pitch,
+                int width,
+                int height);
   NvEncoder* CreateNvEncoder(int width, int height, bool use_native);
 
  private:
@@ -142,135 +149,32 @@ void NvCodecH264EncoderCuda::CopyNative(NvEncoder* nv_encoder,
                                         int height) {
   impl_->CopyNative(nv_encoder, ptr, size, width, height);
 }
+void NvCodecH264EncoderCuda::CopyNV12(NvEncoder* nv_encoder,
+                                      const void* ptr,
+                                      int pitch,
+                                      int width,
+                                      int height) {
+  impl_->CopyNV12(nv_encoder, ptr, pitch, width, height);
+}
 NvEncoder* NvCodecH264EncoderCuda::CreateNvEncoder(int width,
                                                    int height,
                                                    bool use_native) {
   return impl_->CreateNvEncoder(width, height, use_native);
 }
 
-void ShowEncoderCapability() {
-  ck(cuInit(0));
-  int nGpu = 0;
-  ck(cuDeviceGetCount(&nGpu));
-  if (nGpu == 0) {
-    std::cerr << "CUDA Device not found" << std::endl;
-    exit(1);
-  }
-  std::cout << "Encoder Capability" << std::endl;
-  for (int iGpu = 0; iGpu < nGpu; iGpu++) {
-    CUdevice cuDevice = 0;
-    ck(cuDeviceGet(&cuDevice, iGpu));
-    char szDeviceName[80];
-    ck(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
-    CUcontext cuContext = NULL;
-    ck(cuCtxCreate(&cuContext, 0, cuDevice));
-    NvEncoderCuda enc(cuContext, 1280, 720, NV_ENC_BUFFER_FORMAT_NV12);
-
-    std::cout << "GPU " << iGpu << " - " << szDeviceName << std::endl
-              << std::endl;
-    std::cout
-        << "\tH264:\t\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_H264_GUID,
-                                   NV_ENC_CAPS_SUPPORTED_RATECONTROL_MODES)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tH264_444:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_H264_GUID,
-                                   NV_ENC_CAPS_SUPPORT_YUV444_ENCODE)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tH264_ME:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_H264_GUID,
-                                   NV_ENC_CAPS_SUPPORT_MEONLY_MODE)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tH264_WxH:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_H264_GUID,
-                                   NV_ENC_CAPS_WIDTH_MAX))
-        << "*"
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_H264_GUID,
-                                   NV_ENC_CAPS_HEIGHT_MAX))
-        << std::endl
-        << "\tHEVC:\t\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_SUPPORTED_RATECONTROL_MODES)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tHEVC_Main10:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_SUPPORT_10BIT_ENCODE)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tHEVC_Lossless:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_SUPPORT_LOSSLESS_ENCODE)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tHEVC_SAO:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_SUPPORT_SAO)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tHEVC_444:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_SUPPORT_YUV444_ENCODE)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tHEVC_ME:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_SUPPORT_MEONLY_MODE)
-                ? "yes"
-                : "no")
-        << std::endl
-        << "\tHEVC_WxH:\t"
-        << "  "
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_WIDTH_MAX))
-        << "*"
-        << (enc.GetCapabilityValue(NV_ENC_CODEC_HEVC_GUID,
-                                   NV_ENC_CAPS_HEIGHT_MAX))
-        << std::endl;
-
-    std::cout << std::endl;
-
-    enc.DestroyEncoder();
-    ck(cuCtxDestroy(cuContext));
-  }
-}
-
 NvCodecH264EncoderCudaImpl::NvCodecH264EncoderCudaImpl() {
-  ShowEncoderCapability();
-
-  ck(cuInit(0));
-  ck(cuDeviceGet(&cu_device_, 0));
+  ck(dyn::cuInit(0));
+  ck(dyn::cuDeviceGet(&cu_device_, 0));
   char device_name[80];
-  ck(cuDeviceGetName(device_name, sizeof(device_name), cu_device_));
+  ck(dyn::cuDeviceGetName(device_name, sizeof(device_name), cu_device_));
   std::cout << "GPU in use: " << device_name << std::endl;
-  ck(cuCtxCreate(&cu_context_, 0, cu_device_));
+  ck(dyn::cuCtxCreate(&cu_context_, 0, cu_device_));
 }
 NvCodecH264EncoderCudaImpl::~NvCodecH264EncoderCudaImpl() {
   if (nv_decoder_ != nullptr) {
     delete nv_decoder_;
   }
-  cuCtxDestroy(cu_context_);
+  dyn::cuCtxDestroy(cu_context_);
 }
 void NvCodecH264EncoderCudaImpl::Copy(NvEncoder* nv_encoder,
                                       const void* ptr,
@@ -306,6 +210,19 @@ void NvCodecH264EncoderCudaImpl::CopyNative(NvEncoder* nv_encoder,
         input_frame->chromaOffsets, input_frame->numChromaPlanes);
   }
 }
+void NvCodecH264EncoderCudaImpl::CopyNV12(NvEncoder* nv_encoder,
+                                          const void* ptr,
+                                          int pitch,
+                                          int width,
+                                          int height) {
+  // NVENC の入力は NV12 で作っているので、そのままピッチだけ合わせてコピーする
+  const NvEncInputFrame* input_frame = nv_encoder->GetNextInputFrame();
+  NvEncoderCuda::CopyToDeviceFrame(
+      cu_context_, (void*)ptr, pitch, (CUdeviceptr)input_frame->inputPtr,
+      (int)input_frame->pitch, width, height, CU_MEMORYTYPE_HOST,
+      input_frame->bufferFormat, input_frame->chromaOffsets,
+      input_frame->numChromaPlanes);
+}
 NvEncoder* NvCodecH264EncoderCudaImpl::CreateNvEncoder(int width,
                                                        int height,
                                                        bool use_native) {
@@ -25,6 +25,12 @@ class NvCodecH264EncoderCuda {
                   int size,
                   int width,
                   int height);
+  // Y の直後に UV が同じピッチで続いている NV12 をコピーする
+  void CopyNV12(NvEncoder* nv_encoder,
+                const void* ptr,
+                int pitch,
+                int width,
+                int height);
   // 念のため <memory> も include せずポインタを利用する
   NvEncoder* CreateNvEncoder(int width, int height, bool use_native);
 
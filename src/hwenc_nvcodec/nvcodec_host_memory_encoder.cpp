@@ -0,0 +1,75 @@
+#include "nvcodec_host_memory_encoder.h"
+
+NvEncoderHostMemory::NvEncoderHostMemory(NV_ENC_DEVICE_TYPE device_type,
+                                         void* device,
+                                         uint32_t width,
+                                         uint32_t height,
+                                         NV_ENC_BUFFER_FORMAT format,
+                                         uint32_t extra_output_delay)
+    : NvEncoder(device_type,
+                device,
+                width,
+                height,
+                format,
+                extra_output_delay,
+                false) {
+  if (!m_hEncoder) {
+    NVENC_THROW_ERROR("Encoder Initialization failed",
+                      NV_ENC_ERR_INVALID_DEVICE);
+  }
+}
+
+NvEncoderHostMemory::~NvEncoderHostMemory() {
+  ReleaseInputBuffers();
+}
+
+uint8_t* NvEncoderHostMemory::LockInputBuffer(const NvEncInputFrame* frame,
+                                              uint32_t* pitch) {
+  NV_ENC_LOCK_INPUT_BUFFER lock_params = {NV_ENC_LOCK_INPUT_BUFFER_VER};
+  lock_params.inputBuffer = frame->inputPtr;
+  NVENC_API_CALL(m_nvenc.nvEncLockInputBuffer(m_hEncoder, &lock_params));
+  *pitch = lock_params.pitch;
+  return (uint8_t*)lock_params.bufferDataPtr;
+}
+
+void NvEncoderHostMemory::UnlockInputBuffer(const NvEncInputFrame* frame) {
+  NVENC_API_CALL(m_nvenc.nvEncUnlockInputBuffer(m_hEncoder, frame->inputPtr));
+}
+
+void NvEncoderHostMemory::AllocateInputBuffers(int32_t num_input_buffers) {
+  if (!IsHWEncoderInitialized()) {
+    NVENC_THROW_ERROR("Encoder intialization failed",
+                      NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+  }
+
+  for (int i = 0; i < num_input_buffers; i++) {
+    NV_ENC_CREATE_INPUT_BUFFER create_params = {
+        NV_ENC_CREATE_INPUT_BUFFER_VER};
+    create_params.width = GetMaxEncodeWidth();
+    create_params.height = GetMaxEncodeHeight();
+    create_params.bufferFmt = GetPixelFormat();
+    NVENC_API_CALL(m_nvenc.nvEncCreateInputBuffer(m_hEncoder, &create_params));
+
+    // 登録したリソースではないので、エンコード時にマップせずそのまま渡される
+    NvEncInputFrame frame = {};
+    frame.inputPtr = create_params.inputBuffer;
+    frame.bufferFormat = GetPixelFormat();
+    m_vInputFrames.push_back(frame);
+  }
+}
+
+void NvEncoderHostMemory::ReleaseInputBuffers() {
+  if (!m_hEncoder) {
+    return;
+  }
+
+  // 投入済みのフレームを全部出力させてから破棄する
+  UnregisterInputResources();
+
+  for (auto& frame : m_vInputFrames) {
+    if (frame.inputPtr) {
+      m_nvenc.nvEncDestroyInputBuffer(m_hEncoder, frame.inputPtr);
+    }
+  }
+  m_vInputFrames.clear();
+}
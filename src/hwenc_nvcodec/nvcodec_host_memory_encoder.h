@@ -0,0 +1,31 @@
+#ifndef NVCODEC_HOST_MEMORY_ENCODER_H_
+#define NVCODEC_HOST_MEMORY_ENCODER_H_
+
+#include <NvEncoder/NvEncoder.h>
+
+// nvEncCreateInputBuffer で NVENC に確保させた入力バッファを使う NvEncoder。
+// CPU から入力バッファに直接書き込めるので、ステージングテクスチャを経由しなくて良い。
+// デバイスは入力バッファの確保には使わず、エンコードセッションを開くためだけに使う。
+class NvEncoderHostMemory : public NvEncoder {
+ public:
+  NvEncoderHostMemory(NV_ENC_DEVICE_TYPE device_type,
+                      void* device,
+                      uint32_t width,
+                      uint32_t height,
+                      NV_ENC_BUFFER_FORMAT format,
+                      uint32_t extra_output_delay);
+  ~NvEncoderHostMemory() override;
+
+  // GetNextInputFrame() で取得した入力バッファを CPU から書き込めるようにする。
+  // ピッチは確保時には分からないので、ここで返す値を使うこと。
+  uint8_t* LockInputBuffer(const NvEncInputFrame* frame, uint32_t* pitch);
+  void UnlockInputBuffer(const NvEncInputFrame* frame);
+
+ protected:
+  void ReleaseInputBuffers() override;
+
+ private:
+  void AllocateInputBuffers(int32_t num_input_buffers) override;
+};
+
+#endif  // NVCODEC_HOST_MEMORY_ENCODER_H_
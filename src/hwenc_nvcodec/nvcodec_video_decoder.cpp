@@ -1,20 +1,111 @@
 #include "nvcodec_video_decoder.h"
 
+#include <map>
+#include <mutex>
+#include <vector>
+
 // WebRTC
 #include <modules/video_coding/include/video_error_codes.h>
 #include <rtc_base/checks.h>
 #include <rtc_base/logging.h>
 #include <rtc_base/time_utils.h>
-#include <third_party/libyuv/include/libyuv/convert.h>
+#include <third_party/libyuv/include/libyuv/planar_functions.h>
 
 #include "dyn/cuda.h"
 #include "dyn/nvcuvid.h"
+#include "perf_counters.h"
+
+namespace {
+
+// 使い終わった NVDEC のセッションを取っておき、次に作るデコーダで使い回す。
+// マルチストリームでトラックが増減するたびにセッションを作り直さずに済む。
+// セッションは GPU のメモリを使うので、取っておく数には上限を設ける。
+// adapter_id はホストのメモリに出力するセッションがどの GPU で作られたか
+struct PooledSession {
+  cudaVideoCodec codec_id;
+  void* texture_device;
+  uint64_t adapter_id;
+  std::unique_ptr<NvCodecVideoDecoderCuda> decoder;
+};
+const size_t kMaxPooledSessions = 4;
+
+std::mutex& GetSessionPoolMutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+// 終了時に CUDA のライブラリより後に破棄されないよう、意図的に解放しない
+std::vector<PooledSession>& GetSessionPool() {
+  static auto pool = new std::vector<PooledSession>();
+  return *pool;
+}
+
+std::unique_ptr<NvCodecVideoDecoderCuda> AcquireSession(
+    cudaVideoCodec codec_id,
+    void* texture_device,
+    uint64_t adapter_id) {
+  std::lock_guard<std::mutex> lock(GetSessionPoolMutex());
+  auto& pool = GetSessionPool();
+  for (auto it = pool.begin(); it != pool.end(); ++it) {
+    if (it->codec_id == codec_id && it->texture_device == texture_device &&
+        it->adapter_id == adapter_id) {
+      std::unique_ptr<NvCodecVideoDecoderCuda> decoder = std::move(it->decoder);
+      pool.erase(it);
+      return decoder;
+    }
+  }
+  return nullptr;
+}
+
+void RecycleSession(cudaVideoCodec codec_id,
+                    void* texture_device,
+                    uint64_t adapter_id,
+                    std::unique_ptr<NvCodecVideoDecoderCuda> decoder) {
+  // 前のストリームのフレームが次のストリームで出てこないようにしておく
+  if (!decoder->Flush()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(GetSessionPoolMutex());
+  auto& pool = GetSessionPool();
+  if (pool.size() >= kMaxPooledSessions) {
+    return;
+  }
+  PooledSession session;
+  session.codec_id = codec_id;
+  session.texture_device = texture_device;
+  session.adapter_id = adapter_id;
+  session.decoder = std::move(decoder);
+  pool.push_back(std::move(session));
+}
+
+#if defined(_WIN32)
+uint64_t GetAdapterId(const LUID& luid) {
+  return ((uint64_t)(uint32_t)luid.HighPart << 32) | luid.LowPart;
+}
+#endif
+
+}  // namespace
 
-NvCodecVideoDecoder::NvCodecVideoDecoder(cudaVideoCodec codec_id)
+#if defined(_WIN32)
+NvCodecVideoDecoder::NvCodecVideoDecoder(cudaVideoCodec codec_id,
+                                         ID3D11Device* texture_device,
+                                         bool async_output,
+                                         LUID adapter_luid)
     : codec_id_(codec_id),
       decode_complete_callback_(nullptr),
-      buffer_pool_(false, 300 /* max_number_of_buffers*/) {
+      buffer_pool_(false, 300 /* max_number_of_buffers*/),
+      async_output_(async_output),
+      texture_device_(texture_device),
+      adapter_luid_(adapter_luid) {
 }
+#else
+NvCodecVideoDecoder::NvCodecVideoDecoder(cudaVideoCodec codec_id,
+                                         bool async_output)
+    : codec_id_(codec_id),
+      decode_complete_callback_(nullptr),
+      buffer_pool_(false, 300 /* max_number_of_buffers*/),
+      async_output_(async_output) {
+}
+#endif
 
 NvCodecVideoDecoder::~NvCodecVideoDecoder() {
   Release();
@@ -31,6 +122,20 @@ void NvCodecVideoDecoder::Log(NvCodecVideoDecoderCuda::LogType type, const std::
 }
 
 bool NvCodecVideoDecoder::IsSupported(cudaVideoCodec codec_id) {
+  // 調べている最中に呼ばれた場合は、結果が出るまで待つ
+  static std::mutex mutex;
+  static std::map<cudaVideoCodec, bool> supported;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = supported.find(codec_id);
+  if (it != supported.end()) {
+    return it->second;
+  }
+  bool result = ProbeSupported(codec_id);
+  supported[codec_id] = result;
+  return result;
+}
+
+bool NvCodecVideoDecoder::ProbeSupported(cudaVideoCodec codec_id) {
   // CUDA 周りのライブラリがロードできるか確認する
   if (!dyn::DynModule::Instance().IsLoadable(dyn::CUDA_SO)) {
     RTC_LOG(LS_WARNING) << "load library failed: " << dyn::CUDA_SO;
@@ -42,7 +147,16 @@ bool NvCodecVideoDecoder::IsSupported(cudaVideoCodec codec_id) {
   }
 
   auto decoder = NvCodecVideoDecoderCuda::Create(codec_id, &NvCodecVideoDecoder::Log);
-  return decoder != nullptr;
+  if (decoder == nullptr) {
+    return false;
+  }
+  if (!decoder->IsCodecSupported(codec_id)) {
+    RTC_LOG(LS_INFO) << "NVDEC does not support codec: " << codec_id;
+    return false;
+  }
+  // 確認に使ったセッションは最初のデコーダで使う
+  RecycleSession(codec_id, nullptr, 0, std::move(decoder));
+  return true;
 }
 
 int32_t NvCodecVideoDecoder::InitDecode(const webrtc::VideoCodec* codec_settings,
@@ -56,6 +170,7 @@ int32_t NvCodecVideoDecoder::InitDecode(const webrtc::VideoCodec* codec_settings
 int32_t NvCodecVideoDecoder::Decode(const webrtc::EncodedImage& input_image,
                                  bool missing_frames,
                                  int64_t render_time_ms) {
+  ScopedPerfTimer timer(PerfStage::kDecode);
   if (decoder_ == nullptr) {
     return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
   }
@@ -68,7 +183,9 @@ int32_t NvCodecVideoDecoder::Decode(const webrtc::EncodedImage& input_image,
 
   uint8_t** frames = nullptr;
   int frame_count = 0;
-  decoder_->Decode(input_image.data(), (int)input_image.size(), frames, frame_count);
+  // 非同期モードではデコードが終わったフレームは OnDisplay で通知される
+  decoder_->Decode(input_image.data(), (int)input_image.size(), frames,
+                   frame_count, input_image.Timestamp());
   if (frames == nullptr || frame_count == 0) {
     return WEBRTC_VIDEO_CODEC_OK;
   }
@@ -83,18 +200,47 @@ int32_t NvCodecVideoDecoder::Decode(const webrtc::EncodedImage& input_image,
 
   uint32_t pts = input_image.Timestamp();
 
-  // NV12 から I420 に変換
-  rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
-      buffer_pool_.CreateI420Buffer(width_, height_);
-  libyuv::NV12ToI420(frames[0], nvdec->GetDeviceFramePitch(),
-                     frames[0] + nvdec->GetHeight() * nvdec->GetDeviceFramePitch(), nvdec->GetDeviceFramePitch(),
-                     i420_buffer->MutableDataY(), i420_buffer->StrideY(),
-                     i420_buffer->MutableDataU(), i420_buffer->StrideU(),
-                     i420_buffer->MutableDataV(), i420_buffer->StrideV(),
-                     width_, height_);
+#if defined(_WIN32)
+  if (texture_device_ != nullptr) {
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> texture_buffer;
+    if (!CopyToTexture(frames[0], nullptr, &texture_buffer)) {
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    // 全部のテクスチャが使用中だったのでこのフレームは捨てる
+    if (texture_buffer == nullptr) {
+      return WEBRTC_VIDEO_CODEC_OK;
+    }
+    webrtc::VideoFrame decoded_image =
+        webrtc::VideoFrame::Builder()
+            .set_video_frame_buffer(texture_buffer)
+            .set_timestamp_rtp(pts)
+            .build();
+    decode_complete_callback_->Decoded(decoded_image, absl::nullopt,
+                                       absl::nullopt);
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+#endif
+
+  // I420 には変換せずに NV12 のまま渡す。
+  // レンダラは NV12 から直接 ABGR に変換したり、プレーンをそのまま転送できる。
+  int width = nvdec->GetWidth();
+  int height = nvdec->GetHeight();
+  int pitch = nvdec->GetDeviceFramePitch();
+  rtc::scoped_refptr<webrtc::NV12Buffer> nv12_buffer =
+      CreatePooledNV12Buffer(width, height);
+  if (nv12_buffer == nullptr) {
+    RTC_LOG(LS_WARNING) << "Failed to allocate NV12 buffer, drop frame";
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+  libyuv::CopyPlane(frames[0], pitch, nv12_buffer->MutableDataY(),
+                    nv12_buffer->StrideY(), width, height);
+  libyuv::CopyPlane(frames[0] + height * pitch, pitch,
+                    nv12_buffer->MutableDataUV(), nv12_buffer->StrideUV(),
+                    nv12_buffer->ChromaWidth() * 2,
+                    nv12_buffer->ChromaHeight());
 
   webrtc::VideoFrame decoded_image = webrtc::VideoFrame::Builder()
-                                         .set_video_frame_buffer(i420_buffer)
+                                         .set_video_frame_buffer(nv12_buffer)
                                          .set_timestamp_rtp(pts)
                                          .build();
   decode_complete_callback_->Decoded(decoded_image, absl::nullopt,
@@ -112,9 +258,31 @@ int32_t NvCodecVideoDecoder::RegisterDecodeCompleteCallback(
 int32_t NvCodecVideoDecoder::Release() {
   ReleaseNvCodec();
   buffer_pool_.Release();
+  pooled_buffers_.clear();
+  pool_memory_.Set(0, 0);
   return WEBRTC_VIDEO_CODEC_OK;
 }
 
+rtc::scoped_refptr<webrtc::NV12Buffer>
+NvCodecVideoDecoder::CreatePooledNV12Buffer(int width, int height) {
+  rtc::scoped_refptr<webrtc::NV12Buffer> buffer =
+      buffer_pool_.CreateNV12Buffer(width, height);
+  if (buffer == nullptr) {
+    return nullptr;
+  }
+  if (width != pooled_width_ || height != pooled_height_) {
+    pooled_buffers_.clear();
+    pooled_width_ = width;
+    pooled_height_ = height;
+  }
+  if (pooled_buffers_.insert(buffer.get()).second) {
+    int64_t bytes = (int64_t)buffer->StrideY() * buffer->height() +
+                    (int64_t)buffer->StrideUV() * buffer->ChromaHeight();
+    pool_memory_.Set(bytes * pooled_buffers_.size(), pooled_buffers_.size());
+  }
+  return buffer;
+}
+
 bool NvCodecVideoDecoder::PrefersLateDecoding() const {
   return true;
 }
@@ -124,11 +292,258 @@ const char* NvCodecVideoDecoder::ImplementationName() const {
 }
 
 int32_t NvCodecVideoDecoder::InitNvCodec() {
-  decoder_ = NvCodecVideoDecoderCuda::Create(codec_id_, &NvCodecVideoDecoder::Log);
+  ReleaseNvCodec();
+#if defined(_WIN32)
+  if (texture_device_ != nullptr) {
+    // 非同期モードはデコードサーフェスの数が違うので使い回したセッションは使えない
+    if (!async_output_) {
+      decoder_ = AcquireSession(codec_id_, texture_device_, 0);
+    }
+    if (decoder_ == nullptr) {
+      decoder_ = NvCodecVideoDecoderCuda::Create(
+          codec_id_, &NvCodecVideoDecoder::Log, texture_device_);
+    }
+    if (decoder_ == nullptr) {
+      // D3D11 と連携できない環境では従来通り CPU に読み出す
+      RTC_LOG(LS_WARNING)
+          << "Failed to create NVDEC with D3D11 interop, fallback to I420";
+      texture_device_ = nullptr;
+    }
+  }
+  // アダプタが指定されていなければ最初の GPU を使う
+  uint64_t adapter_id = GetAdapterId(adapter_luid_);
+  if (decoder_ == nullptr && !async_output_) {
+    decoder_ = AcquireSession(codec_id_, nullptr, adapter_id);
+  }
+  if (decoder_ == nullptr && adapter_id != 0) {
+    decoder_ = NvCodecVideoDecoderCuda::Create(
+        codec_id_, &NvCodecVideoDecoder::Log, adapter_luid_);
+  }
+  if (decoder_ == nullptr) {
+    decoder_ = NvCodecVideoDecoderCuda::Create(codec_id_,
+                                               &NvCodecVideoDecoder::Log);
+    adapter_luid_ = {};
+  }
+#else
+  if (!async_output_) {
+    decoder_ = AcquireSession(codec_id_, nullptr, 0);
+  }
+  if (decoder_ == nullptr) {
+    decoder_ = NvCodecVideoDecoderCuda::Create(codec_id_, &NvCodecVideoDecoder::Log);
+  }
+#endif
   output_info_ = false;
+  // 失敗した場合はソフトウェアデコーダにフォールバックさせる
+  if (decoder_ == nullptr) {
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  if (async_output_) {
+    decoder_->GetNvDecoder()->SetAsyncDisplay(
+        kAsyncQueueDepth,
+        [this](const CUVIDPARSERDISPINFO& info) { OnDisplay(info); },
+        [this]() { WaitDeliveryDrained(); });
+    StartDelivery();
+  }
   return WEBRTC_VIDEO_CODEC_OK;
 }
 
 void NvCodecVideoDecoder::ReleaseNvCodec() {
+  // コピー中のフレームが無くなってからデコーダを破棄する
+  StopDelivery();
+#if defined(_WIN32)
+  // CUDA のコンテキストを破棄する前に登録を解除する
+  if (decoder_ != nullptr) {
+    for (auto& frame : texture_frames_) {
+      decoder_->UnregisterTexture(frame.y);
+      decoder_->UnregisterTexture(frame.uv);
+    }
+  }
+  texture_frames_.clear();
+  void* texture_device = texture_device_;
+  uint64_t adapter_id =
+      texture_device_ != nullptr ? 0 : GetAdapterId(adapter_luid_);
+#else
+  void* texture_device = nullptr;
+  uint64_t adapter_id = 0;
+#endif
+  if (decoder_ != nullptr && !async_output_) {
+    RecycleSession(codec_id_, texture_device, adapter_id, std::move(decoder_));
+  }
   decoder_.reset();
 }
+
+void NvCodecVideoDecoder::StartDelivery() {
+  delivery_stop_ = false;
+  delivery_in_flight_ = 0;
+  delivery_thread_ = std::thread([this]() { DeliveryThread(); });
+}
+
+void NvCodecVideoDecoder::StopDelivery() {
+  if (!delivery_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(delivery_mutex_);
+    delivery_stop_ = true;
+  }
+  delivery_cond_.notify_all();
+  delivery_thread_.join();
+  // まだコピーしていないフレームは捨てる
+  delivery_queue_.clear();
+  delivery_in_flight_ = 0;
+}
+
+void NvCodecVideoDecoder::DeliveryThread() {
+  while (true) {
+    CUVIDPARSERDISPINFO info;
+    {
+      std::unique_lock<std::mutex> lock(delivery_mutex_);
+      delivery_cond_.wait(lock, [this]() {
+        return delivery_stop_ || !delivery_queue_.empty();
+      });
+      if (delivery_stop_) {
+        return;
+      }
+      info = delivery_queue_.front();
+      delivery_queue_.pop_front();
+    }
+    DeliverFrame(info);
+    {
+      std::lock_guard<std::mutex> lock(delivery_mutex_);
+      delivery_in_flight_--;
+    }
+    delivery_cond_.notify_all();
+  }
+}
+
+void NvCodecVideoDecoder::OnDisplay(const CUVIDPARSERDISPINFO& info) {
+  // ここはデコードスレッドの Decode の中から呼ばれる
+  if (!output_info_) {
+    RTC_LOG(LS_INFO) << decoder_->GetNvDecoder()->GetVideoInfo();
+    output_info_ = true;
+  }
+  {
+    // 出力が追いついていない場合は、サーフェスが上書きされないように待つ
+    std::unique_lock<std::mutex> lock(delivery_mutex_);
+    delivery_cond_.wait(lock, [this]() {
+      return delivery_stop_ || delivery_in_flight_ < kAsyncQueueDepth;
+    });
+    if (delivery_stop_) {
+      return;
+    }
+    delivery_queue_.push_back(info);
+    delivery_in_flight_++;
+  }
+  delivery_cond_.notify_all();
+}
+
+void NvCodecVideoDecoder::WaitDeliveryDrained() {
+  // デコーダの再設定の前に、キューに入っているフレームを全部出力しておく
+  std::unique_lock<std::mutex> lock(delivery_mutex_);
+  delivery_cond_.wait(lock, [this]() {
+    return delivery_stop_ || delivery_in_flight_ == 0;
+  });
+}
+
+void NvCodecVideoDecoder::DeliverFrame(const CUVIDPARSERDISPINFO& info) {
+  // ここは出力用のスレッドから呼ばれる
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+#if defined(_WIN32)
+  if (texture_device_ != nullptr) {
+    if (!CopyToTexture(nullptr, &info, &buffer)) {
+      RTC_LOG(LS_ERROR) << "Failed to copy decoded frame to texture";
+      return;
+    }
+    // 全部のテクスチャが使用中だったのでこのフレームは捨てる
+    if (buffer == nullptr) {
+      return;
+    }
+  }
+#endif
+  if (buffer == nullptr) {
+    auto nvdec = decoder_->GetNvDecoder();
+    rtc::scoped_refptr<webrtc::NV12Buffer> nv12_buffer =
+        CreatePooledNV12Buffer(nvdec->GetWidth(), nvdec->GetHeight());
+    if (nv12_buffer == nullptr) {
+      RTC_LOG(LS_WARNING) << "Failed to allocate NV12 buffer, drop frame";
+      return;
+    }
+    if (!decoder_->CopyFrame(info, nv12_buffer->MutableDataY(),
+                             nv12_buffer->StrideY(),
+                             nv12_buffer->MutableDataUV(),
+                             nv12_buffer->StrideUV())) {
+      return;
+    }
+    buffer = nv12_buffer;
+  }
+
+  webrtc::VideoFrame decoded_image =
+      webrtc::VideoFrame::Builder()
+          .set_video_frame_buffer(buffer)
+          .set_timestamp_rtp((uint32_t)info.timestamp)
+          .build();
+  decode_complete_callback_->Decoded(decoded_image, absl::nullopt,
+                                     absl::nullopt);
+}
+
+#if defined(_WIN32)
+// 空いているテクスチャにデコード結果をコピーして buffer に入れる。
+// 全部使用中の場合は true を返して buffer を nullptr のままにする。
+bool NvCodecVideoDecoder::CopyToTexture(
+    const uint8_t* frame,
+    const CUVIDPARSERDISPINFO* info,
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer>* buffer) {
+  auto nvdec = decoder_->GetNvDecoder();
+  int width = nvdec->GetWidth();
+  int height = nvdec->GetHeight();
+
+  // 解像度が変わったテクスチャは捨てる
+  for (auto it = texture_frames_.begin(); it != texture_frames_.end();) {
+    if (it->buffer->width() != width || it->buffer->height() != height) {
+      decoder_->UnregisterTexture(it->y);
+      decoder_->UnregisterTexture(it->uv);
+      it = texture_frames_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  TextureFrame* target = nullptr;
+  for (auto& f : texture_frames_) {
+    if (f.buffer->HasOneRef()) {
+      target = &f;
+      break;
+    }
+  }
+  if (target == nullptr) {
+    if (texture_frames_.size() >= kMaxTextureFrames) {
+      RTC_LOG(LS_WARNING) << "All decoder textures are in use, drop frame";
+      return true;
+    }
+    TextureFrame f;
+    f.buffer = sora::D3D11NV12TextureBuffer::Create(texture_device_, width,
+                                                    height);
+    if (f.buffer == nullptr) {
+      return false;
+    }
+    f.y = decoder_->RegisterTexture(f.buffer->y_texture());
+    f.uv = decoder_->RegisterTexture(f.buffer->uv_texture());
+    if (f.y == nullptr || f.uv == nullptr) {
+      decoder_->UnregisterTexture(f.y);
+      decoder_->UnregisterTexture(f.uv);
+      return false;
+    }
+    texture_frames_.push_back(f);
+    target = &texture_frames_.back();
+  }
+
+  bool ok = info != nullptr
+                ? decoder_->CopyFrameToTexture(*info, target->y, target->uv)
+                : decoder_->CopyToTexture(frame, target->y, target->uv);
+  if (!ok) {
+    return false;
+  }
+  *buffer = target->buffer;
+  return true;
+}
+#endif
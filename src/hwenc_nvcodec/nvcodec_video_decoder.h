@@ -6,6 +6,21 @@
 #include <common_video/include/video_frame_buffer_pool.h>
 #include <rtc_base/platform_thread.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#if defined(_WIN32)
+#include <vector>
+
+#include <d3d11.h>
+
+#include "rtc/d3d11_nv12_texture_buffer.h"
+#endif
+
+#include "memory_stats.h"
 #include "nvcodec_video_decoder_cuda.h"
 
 class NvCodecVideoDecoder : public webrtc::VideoDecoder {
@@ -13,9 +28,22 @@ class NvCodecVideoDecoder : public webrtc::VideoDecoder {
   // cudaVideoCodec_H264
   // cudaVideoCodec_VP8
   // cudaVideoCodec_VP9
-  NvCodecVideoDecoder(cudaVideoCodec codec_id);
+  // async_output を true にすると、NVDEC のサーフェスからのコピーと
+  // Decoded の呼び出しを別スレッドで行い、Decode はビットストリームを渡したらすぐに戻る
+#if defined(_WIN32)
+  // texture_device を指定すると、デコード結果を GPU に置いたまま
+  // sora::D3D11NV12TextureBuffer として出力する。
+  // adapter_luid を指定すると、texture_device を使わない場合もそのアダプタの GPU でデコードする
+  NvCodecVideoDecoder(cudaVideoCodec codec_id,
+                      ID3D11Device* texture_device = nullptr,
+                      bool async_output = false,
+                      LUID adapter_luid = {});
+#else
+  NvCodecVideoDecoder(cudaVideoCodec codec_id, bool async_output = false);
+#endif
   ~NvCodecVideoDecoder() override;
 
+  // 実際にデコーダを作って確認するので重い。結果はコーデックごとにプロセスで覚えておく
   static bool IsSupported(cudaVideoCodec codec_id);
 
   int32_t InitDecode(const webrtc::VideoCodec* codec_settings,
@@ -38,19 +66,71 @@ class NvCodecVideoDecoder : public webrtc::VideoDecoder {
   const char* ImplementationName() const override;
 
  private:
-  static void NvCodecVideoDecoder::Log(NvCodecVideoDecoderCuda::LogType type, const std::string& log);
+  static bool ProbeSupported(cudaVideoCodec codec_id);
+  static void Log(NvCodecVideoDecoderCuda::LogType type,
+                  const std::string& log);
 
   int32_t InitNvCodec();
   void ReleaseNvCodec();
 
+  // 非同期モード
+  void StartDelivery();
+  void StopDelivery();
+  void DeliveryThread();
+  void OnDisplay(const CUVIDPARSERDISPINFO& info);
+  void WaitDeliveryDrained();
+  void DeliverFrame(const CUVIDPARSERDISPINFO& info);
+  // buffer_pool_ から取り出して、プールが確保しているメモリを数える
+  rtc::scoped_refptr<webrtc::NV12Buffer> CreatePooledNV12Buffer(int width,
+                                                                int height);
+#if defined(_WIN32)
+  // info を指定した場合は frame ではなく非同期モードで通知されたフレームをコピーする
+  bool CopyToTexture(const uint8_t* frame,
+                     const CUVIDPARSERDISPINFO* info,
+                     rtc::scoped_refptr<webrtc::VideoFrameBuffer>* buffer);
+#endif
+
   int width_ = 0;
   int height_ = 0;
   webrtc::DecodedImageCallback* decode_complete_callback_ = nullptr;
   webrtc::VideoFrameBufferPool buffer_pool_;
+  // buffer_pool_ が確保したバッファ。
+  // プールは解像度が変わると古いバッファを捨てるので、その時に数え直す
+  std::set<const webrtc::NV12Buffer*> pooled_buffers_;
+  int pooled_width_ = 0;
+  int pooled_height_ = 0;
+  sora::TrackedMemory pool_memory_{sora::MemoryCategory::kDecoderFramePool};
 
   cudaVideoCodec codec_id_;
   std::unique_ptr<NvCodecVideoDecoderCuda> decoder_;
   bool output_info_ = false;
+
+  // 出力待ちのフレームの数の上限。
+  // この数だけ NVDEC のデコードサーフェスを増やしておき、上書きされないようにする。
+  static const int kAsyncQueueDepth = 3;
+  bool async_output_;
+  std::thread delivery_thread_;
+  std::mutex delivery_mutex_;
+  std::condition_variable delivery_cond_;
+  std::deque<CUVIDPARSERDISPINFO> delivery_queue_;
+  // キューに入っているものと、コピー中のものを合わせた数
+  int delivery_in_flight_ = 0;
+  bool delivery_stop_ = false;
+
+#if defined(_WIN32)
+  // テクスチャは CUDA への登録が重いので使い回す。
+  // レンダラ側がまだ参照しているものは使わない。
+  struct TextureFrame {
+    rtc::scoped_refptr<rtc::RefCountedObject<sora::D3D11NV12TextureBuffer>>
+        buffer;
+    CUgraphicsResource y;
+    CUgraphicsResource uv;
+  };
+  static const size_t kMaxTextureFrames = 8;
+  ID3D11Device* texture_device_;
+  LUID adapter_luid_;
+  std::vector<TextureFrame> texture_frames_;
+#endif
 };
 
 #endif  // NVCODEC_VIDEO_DECODER_H_
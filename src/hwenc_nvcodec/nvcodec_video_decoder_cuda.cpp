@@ -5,6 +5,14 @@
 
 #include "dyn/cuda.h"
 
+#if defined(_WIN32)
+#include <d3d11.h>
+#include <dxgi.h>
+#include <wrl.h>
+
+#include "rtc/dxgi_adapter.h"
+#endif
+
 typedef std::function<void (NvCodecVideoDecoderCuda::LogType, const std::string&)> LogFunc;
 
 #ifdef __cuda_cuda_h__
@@ -117,17 +125,124 @@ inline bool check(const LogFunc& f, int e, int iLine, const char* szFile) {
 
 std::unique_ptr<NvCodecVideoDecoderCuda> NvCodecVideoDecoderCuda::Create(cudaVideoCodec codec_id, std::function<void (LogType, const std::string&)> f) {
   auto p = std::unique_ptr<NvCodecVideoDecoderCuda>(new NvCodecVideoDecoderCuda());
-  if (p->Init(codec_id, f) != 0) {
+  if (p->Init(codec_id, f, nullptr, false) != 0) {
+    return nullptr;
+  }
+  return p;
+}
+
+#if defined(_WIN32)
+std::unique_ptr<NvCodecVideoDecoderCuda> NvCodecVideoDecoderCuda::Create(cudaVideoCodec codec_id, std::function<void (LogType, const std::string&)> f, ID3D11Device* d3d11_device) {
+  auto p = std::unique_ptr<NvCodecVideoDecoderCuda>(new NvCodecVideoDecoderCuda());
+  // テクスチャに直接書き込めるように、D3D11 のデバイスと同じ GPU を使う
+  Microsoft::WRL::ComPtr<IDXGIDevice> dxgi_device;
+  Microsoft::WRL::ComPtr<IDXGIAdapter> dxgi_adapter;
+  if (!SUCCEEDED(d3d11_device->QueryInterface(__uuidof(IDXGIDevice), (void**)dxgi_device.GetAddressOf())) ||
+      !SUCCEEDED(dxgi_device->GetAdapter(dxgi_adapter.GetAddressOf()))) {
+    f(NvCodecVideoDecoderCuda::LogType::LOG_ERROR, "Failed to get IDXGIAdapter");
+    return nullptr;
+  }
+  if (p->Init(codec_id, f, dxgi_adapter.Get(), true) != 0) {
+    return nullptr;
+  }
+  return p;
+}
+
+std::unique_ptr<NvCodecVideoDecoderCuda> NvCodecVideoDecoderCuda::Create(cudaVideoCodec codec_id, std::function<void (LogType, const std::string&)> f, const LUID& adapter_luid) {
+  auto p = std::unique_ptr<NvCodecVideoDecoderCuda>(new NvCodecVideoDecoderCuda());
+  Microsoft::WRL::ComPtr<IDXGIAdapter> dxgi_adapter = sora::FindAdapter(adapter_luid);
+  if (dxgi_adapter == nullptr) {
+    f(NvCodecVideoDecoderCuda::LogType::LOG_WARNING, "Adapter not found, fallback to the first GPU");
+  }
+  if (p->Init(codec_id, f, dxgi_adapter.Get(), false) != 0) {
     return nullptr;
   }
   return p;
 }
 
+CUgraphicsResource NvCodecVideoDecoderCuda::RegisterTexture(ID3D11Texture2D* texture) {
+  CUgraphicsResource resource = nullptr;
+  if (!ck(log_, dyn::cuCtxPushCurrent(cu_context_))) {
+    return nullptr;
+  }
+  // CUDA からは書き込むだけ
+  bool ok = ck(log_, dyn::cuGraphicsD3D11RegisterResource(&resource, texture, CU_GRAPHICS_REGISTER_FLAGS_NONE));
+  dyn::cuCtxPopCurrent(nullptr);
+  return ok ? resource : nullptr;
+}
+
+void NvCodecVideoDecoderCuda::UnregisterTexture(CUgraphicsResource resource) {
+  if (resource == nullptr) {
+    return;
+  }
+  dyn::cuCtxPushCurrent(cu_context_);
+  dyn::cuGraphicsUnregisterResource(resource);
+  dyn::cuCtxPopCurrent(nullptr);
+}
+
+bool NvCodecVideoDecoderCuda::CopyToTexture(const uint8_t* frame, CUgraphicsResource y, CUgraphicsResource uv) {
+  return CopyPlanesToTexture((CUdeviceptr)frame, decoder_->GetDeviceFramePitch(), decoder_->GetHeight(), y, uv);
+}
+
+bool NvCodecVideoDecoderCuda::CopyFrameToTexture(const CUVIDPARSERDISPINFO& info, CUgraphicsResource y, CUgraphicsResource uv) {
+  CUdeviceptr src = 0;
+  unsigned int pitch = 0;
+  if (!decoder_->MapFrame(info, &src, &pitch)) {
+    log_(LogType::LOG_ERROR, "cuvidMapVideoFrame failed");
+    return false;
+  }
+  bool ok = CopyPlanesToTexture(src, pitch, decoder_->GetSurfaceHeight(), y, uv);
+  decoder_->UnmapFrame(src);
+  return ok;
+}
+
+bool NvCodecVideoDecoderCuda::CopyPlanesToTexture(CUdeviceptr src, int pitch, int uv_offset_rows, CUgraphicsResource y, CUgraphicsResource uv) {
+  if (!ck(log_, dyn::cuCtxPushCurrent(cu_context_))) {
+    return false;
+  }
+  // Map/Unmap で D3D11 側の処理との同期が取られるので、
+  // Unmap した後は Unity のデバイスからそのまま読める
+  CUgraphicsResource resources[2] = {y, uv};
+  bool ok = ck(log_, dyn::cuGraphicsMapResources(2, resources, 0));
+  if (ok) {
+    CUarray y_array = nullptr;
+    CUarray uv_array = nullptr;
+    ok = ck(log_, dyn::cuGraphicsSubResourceGetMappedArray(&y_array, y, 0, 0)) &&
+         ck(log_, dyn::cuGraphicsSubResourceGetMappedArray(&uv_array, uv, 0, 0));
+    if (ok) {
+      int width = decoder_->GetWidth();
+      int height = decoder_->GetHeight();
+
+      CUDA_MEMCPY2D m = {};
+      m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+      m.srcDevice = src;
+      m.srcPitch = pitch;
+      m.dstMemoryType = CU_MEMORYTYPE_ARRAY;
+      m.dstArray = y_array;
+      m.WidthInBytes = width;
+      m.Height = height;
+      ok = ck(log_, dyn::cuMemcpy2D(&m));
+
+      // UV は uv_offset_rows 行目から、幅は同じバイト数で高さが半分で並んでいる
+      m.srcDevice = src + (size_t)pitch * uv_offset_rows;
+      m.dstArray = uv_array;
+      m.WidthInBytes = (width + 1) / 2 * 2;
+      m.Height = (height + 1) / 2;
+      ok = ok && ck(log_, dyn::cuMemcpy2D(&m));
+    }
+    dyn::cuGraphicsUnmapResources(2, resources, 0);
+  }
+  dyn::cuCtxPopCurrent(nullptr);
+  return ok;
+}
+#endif
+
 NvCodecVideoDecoderCuda::~NvCodecVideoDecoderCuda() {
   Release();
 }
 
-int32_t NvCodecVideoDecoderCuda::Init(cudaVideoCodec codec_id, const std::function<void (LogType, const std::string&)>& f) {
+int32_t NvCodecVideoDecoderCuda::Init(cudaVideoCodec codec_id, const std::function<void (LogType, const std::string&)>& f, void* dxgi_adapter, bool use_device_frame) {
+  log_ = f;
   if (!ck(f, dyn::cuInit(0))) {
     return -1;
   }
@@ -138,15 +253,24 @@ int32_t NvCodecVideoDecoderCuda::Init(cudaVideoCodec codec_id, const std::functi
   if (gpu_num == 0) {
     return -3;
   }
+#if defined(_WIN32)
+  if (dxgi_adapter != nullptr) {
+    if (!ck(f, dyn::cuD3D11GetDevice(&cu_device_, (IDXGIAdapter*)dxgi_adapter))) {
+      return -4;
+    }
+  } else
+#endif
   if (!ck(f, dyn::cuDeviceGet(&cu_device_, 0))) {
     return -4;
   }
-  if (!ck(f, dyn::cuCtxCreate(&cu_context_, 0, cu_device_))) {
+  // デコーダ毎にコンテキストを作るとメモリもコンテキストの切り替えも増えるので、
+  // 同じ GPU のデコーダ同士でプライマリコンテキストを共有する
+  if (!ck(f, dyn::cuDevicePrimaryCtxRetain(&cu_context_, cu_device_))) {
     return -5;
   }
 
   try {
-    decoder_.reset(new NvDecoder(cu_context_, false, codec_id, nullptr, false, false, nullptr, nullptr, 3840, 2160));
+    decoder_.reset(new NvDecoder(cu_context_, use_device_frame, codec_id, nullptr, false, false, nullptr, nullptr, 3840, 2160));
   } catch (NVDECException& e) {
     f(NvCodecVideoDecoderCuda::LogType::LOG_ERROR, e.what());
     return -4;
@@ -155,11 +279,77 @@ int32_t NvCodecVideoDecoderCuda::Init(cudaVideoCodec codec_id, const std::functi
   return 0;
 }
 
-void NvCodecVideoDecoderCuda::Decode(const uint8_t* ptr, int size, uint8_t**& frames, int& frame_count) {
-  decoder_->Decode((const uint8_t*)ptr, size, &frames, &frame_count);
+void NvCodecVideoDecoderCuda::Decode(const uint8_t* ptr, int size, uint8_t**& frames, int& frame_count, int64_t timestamp) {
+  decoder_->Decode((const uint8_t*)ptr, size, &frames, &frame_count, 0, nullptr, timestamp);
+}
+
+bool NvCodecVideoDecoderCuda::CopyFrame(const CUVIDPARSERDISPINFO& info, uint8_t* dst_y, int stride_y, uint8_t* dst_uv, int stride_uv) {
+  CUdeviceptr src = 0;
+  unsigned int pitch = 0;
+  if (!decoder_->MapFrame(info, &src, &pitch)) {
+    log_(LogType::LOG_ERROR, "cuvidMapVideoFrame failed");
+    return false;
+  }
+  bool ok = ck(log_, dyn::cuCtxPushCurrent(cu_context_));
+  if (ok) {
+    int width = decoder_->GetWidth();
+    int height = decoder_->GetHeight();
+
+    CUDA_MEMCPY2D m = {};
+    m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    m.srcDevice = src;
+    m.srcPitch = pitch;
+    m.dstMemoryType = CU_MEMORYTYPE_HOST;
+    m.dstHost = dst_y;
+    m.dstPitch = stride_y;
+    m.WidthInBytes = width;
+    m.Height = height;
+    ok = ck(log_, dyn::cuMemcpy2D(&m));
+
+    m.srcDevice = src + (size_t)pitch * decoder_->GetSurfaceHeight();
+    m.dstHost = dst_uv;
+    m.dstPitch = stride_uv;
+    m.WidthInBytes = (width + 1) / 2 * 2;
+    m.Height = (height + 1) / 2;
+    ok = ok && ck(log_, dyn::cuMemcpy2D(&m));
+    dyn::cuCtxPopCurrent(nullptr);
+  }
+  decoder_->UnmapFrame(src);
+  return ok;
+}
+
+bool NvCodecVideoDecoderCuda::IsCodecSupported(cudaVideoCodec codec_id) {
+  // NvDecoder はシーケンスヘッダを受け取るまでデコーダを作らないので、
+  // パーサが作れただけではデコードできるか分からない
+  CUVIDDECODECAPS caps = {};
+  caps.eCodecType = codec_id;
+  caps.eChromaFormat = cudaVideoChromaFormat_420;
+  caps.nBitDepthMinus8 = 0;
+  if (!ck(log_, dyn::cuCtxPushCurrent(cu_context_))) {
+    return false;
+  }
+  bool ok = ck(log_, dyn::cuvidGetDecoderCaps(&caps));
+  dyn::cuCtxPopCurrent(nullptr);
+  return ok && caps.bIsSupported;
+}
+
+bool NvCodecVideoDecoderCuda::Flush() {
+  uint8_t** frames = nullptr;
+  int frame_count = 0;
+  // サイズ 0 で呼ぶと CUVID_PKT_ENDOFSTREAM になって、残っているフレームが出てくる
+  try {
+    decoder_->Decode(nullptr, 0, &frames, &frame_count);
+  } catch (NVDECException& e) {
+    log_(NvCodecVideoDecoderCuda::LogType::LOG_WARNING, e.what());
+    return false;
+  }
+  return true;
 }
 
 void NvCodecVideoDecoderCuda::Release() {
   decoder_.reset();
-  dyn::cuCtxDestroy(cu_context_);
+  if (cu_context_ != nullptr) {
+    dyn::cuDevicePrimaryCtxRelease(cu_device_);
+    cu_context_ = nullptr;
+  }
 }
\ No newline at end of file
@@ -11,6 +11,13 @@
 // cuda
 #include <cuda.h>
 
+#if defined(_WIN32)
+#include <windows.h>
+
+struct ID3D11Device;
+struct ID3D11Texture2D;
+#endif
+
 class NvCodecVideoDecoderCuda {
  public:
   enum class LogType {
@@ -22,19 +29,49 @@ class NvCodecVideoDecoderCuda {
   // cudaVideoCodec_VP8
   // cudaVideoCodec_VP9
   static std::unique_ptr<NvCodecVideoDecoderCuda> Create(cudaVideoCodec codec_id, std::function<void (LogType, const std::string&)> f);
+#if defined(_WIN32)
+  // d3d11_device と同じ GPU で CUDA のコンテキストを作り、デコード結果を GPU のメモリに置く。
+  // Decode で返るフレームはデバイスのポインタなので、CopyToTexture でテクスチャに書き込むこと。
+  static std::unique_ptr<NvCodecVideoDecoderCuda> Create(cudaVideoCodec codec_id, std::function<void (LogType, const std::string&)> f, ID3D11Device* d3d11_device);
+  // adapter_luid のアダプタと同じ GPU で CUDA のコンテキストを作る。デコード結果はホストのメモリに置く。
+  static std::unique_ptr<NvCodecVideoDecoderCuda> Create(cudaVideoCodec codec_id, std::function<void (LogType, const std::string&)> f, const LUID& adapter_luid);
+
+  // Y は DXGI_FORMAT_R8_UNORM、UV は DXGI_FORMAT_R8G8_UNORM のテクスチャを登録する
+  CUgraphicsResource RegisterTexture(ID3D11Texture2D* texture);
+  void UnregisterTexture(CUgraphicsResource resource);
+  // Decode で返ったフレームを、登録したテクスチャに GPU 上でコピーする
+  bool CopyToTexture(const uint8_t* frame, CUgraphicsResource y, CUgraphicsResource uv);
+  // 非同期モードで通知されたフレームを、登録したテクスチャに GPU 上でコピーする
+  bool CopyFrameToTexture(const CUVIDPARSERDISPINFO& info, CUgraphicsResource y, CUgraphicsResource uv);
+#endif
+
+  // この GPU が 8bit 4:2:0 の codec_id をデコードできるか
+  bool IsCodecSupported(cudaVideoCodec codec_id);
 
   NvDecoder* GetNvDecoder() { return decoder_.get(); }
-  void Decode(const uint8_t* ptr, int size, uint8_t**& frames, int& frame_count);
+  // timestamp は非同期モードで CUVIDPARSERDISPINFO::timestamp として返ってくる
+  void Decode(const uint8_t* ptr, int size, uint8_t**& frames, int& frame_count, int64_t timestamp = 0);
+  // 非同期モード (NvDecoder::SetAsyncDisplay) で通知されたフレームを
+  // NVDEC のサーフェスから NV12 のメモリにコピーする。別のスレッドから呼んでもいい。
+  bool CopyFrame(const CUVIDPARSERDISPINFO& info, uint8_t* dst_y, int stride_y, uint8_t* dst_uv, int stride_uv);
+  // パーサに残っているフレームを捨てて、別のストリームのデコードに使えるようにする
+  bool Flush();
   ~NvCodecVideoDecoderCuda();
 
 private:
-  int32_t Init(cudaVideoCodec codec_id, const std::function<void (LogType, const std::string&)>& f);
+#if defined(_WIN32)
+  bool CopyPlanesToTexture(CUdeviceptr src, int pitch, int uv_offset_rows, CUgraphicsResource y, CUgraphicsResource uv);
+#endif
+  // dxgi_adapter が nullptr の場合は最初の GPU を使う
+  int32_t Init(cudaVideoCodec codec_id, const std::function<void (LogType, const std::string&)>& f, void* dxgi_adapter, bool use_device_frame);
   void Release();
 
 private:
   std::unique_ptr<NvDecoder> decoder_;
-  CUdevice cu_device_;
-  CUcontext cu_context_;
+  CUdevice cu_device_ = 0;
+  // GPU ごとのプライマリコンテキストを共有する
+  CUcontext cu_context_ = nullptr;
+  std::function<void (LogType, const std::string&)> log_;
 };
 
 #endif  // NVCODEC_VIDEO_DECODER_CUDA_H_
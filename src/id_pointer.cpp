@@ -1,27 +1,77 @@
 #include "id_pointer.h"
 
+#include <thread>
+
+#include <rtc_base/logging.h>
+
 namespace sora {
 
 IdPointer& IdPointer::Instance() {
   static IdPointer ip;
   return ip;
 }
-ptrid_t IdPointer::Register(void* p) {
+IdPointer::IdPointer() {
+  // ID が 0 にならないように、0 番目のスロットは使わない。
+  // 解放したスロットはすぐに使わず、なるべく間を空けて再利用する
+  for (uint32_t i = kMaxSlots - 1; i >= 1; i--) {
+    free_indices_.push_back(i);
+  }
+}
+ptrid_t IdPointer::Register(void* p, Type type) {
   std::lock_guard<std::mutex> guard(mutex_);
-  map_[counter_] = p;
-  return counter_++;
+  if (free_indices_.empty()) {
+    RTC_LOG(LS_ERROR) << "IdPointer: too many registered pointers";
+    return 0;
+  }
+  uint32_t index = free_indices_.back();
+  free_indices_.pop_back();
+  Slot& slot = slots_[index];
+  uint32_t generation = slot.generation.load() + 1;
+  slot.pointer.store(p);
+  slot.type.store(type);
+  slot.generation.store(generation);
+  return (((generation >> 1) & kGenerationMask) << kIndexBits) | index;
 }
 void IdPointer::Unregister(ptrid_t id) {
+  uint32_t index = id & kIndexMask;
+  if (index == 0) {
+    return;
+  }
+  Slot& slot = slots_[index];
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    uint32_t generation = slot.generation.load();
+    if ((generation & 1) == 0 ||
+        ((generation >> 1) & kGenerationMask) != (id >> kIndexBits)) {
+      return;
+    }
+    // 先に世代を進めて新しく Lookup できないようにする。
+    // Lookup は readers を増やしてから世代を確認するので、どちらかが必ず相手に気付く
+    slot.generation.store(generation + 1);
+  }
+  // スロットはまだ空きに戻していないので、ロックを外して待っても再利用されない
+  while (slot.readers.load() != 0) {
+    std::this_thread::yield();
+  }
   std::lock_guard<std::mutex> guard(mutex_);
-  map_.erase(id);
+  slot.pointer.store(nullptr);
+  free_indices_.push_front(index);
 }
-void* IdPointer::Lookup(ptrid_t id) {
-  std::lock_guard<std::mutex> guard(mutex_);
-  auto it = map_.find(id);
-  if (it == map_.end()) {
-    return nullptr;
+IdPointer::Ref IdPointer::Lookup(ptrid_t id, Type type) {
+  uint32_t index = id & kIndexMask;
+  if (index == 0) {
+    return Ref();
+  }
+  Slot& slot = slots_[index];
+  slot.readers.fetch_add(1);
+  uint32_t generation = slot.generation.load();
+  if ((generation & 1) == 0 ||
+      ((generation >> 1) & kGenerationMask) != (id >> kIndexBits) ||
+      slot.type.load() != type) {
+    slot.readers.fetch_sub(1);
+    return Ref();
   }
-  return it->second;
+  return Ref(&slot, slot.pointer.load());
 }
 
 }  // namespace sora
@@ -1,7 +1,8 @@
 #ifndef SORA_ID_POINTER_H_INCLUDED
 #define SORA_ID_POINTER_H_INCLUDED
 
-#include <map>
+#include <atomic>
+#include <deque>
 #include <mutex>
 
 #include "unity.h"
@@ -9,17 +10,99 @@
 namespace sora {
 
 // TextureUpdateCallback のユーザデータが 32bit 整数しか扱えないので、
-// ID からポインタに変換する仕組みを用意する
+// ID からポインタに変換する仕組みを用意する。
+//
+// Lookup は Unity のレンダリングスレッドやオーディオスレッドから毎フレーム呼ばれるので、
+// ロックを使わずに ID の下位ビットをスロットの番号として直接引く。
+// 上位ビットには世代を入れて、解放済みのスロットを再利用しても古い ID では引けないようにする。
+// 違う種類のオブジェクトの ID を渡されても間違った型にキャストしないように、
+// スロットには登録した時の型も持っておき、Lookup で型が一致しなければ引けないようにする。
 class IdPointer {
-  std::mutex mutex_;
-  ptrid_t counter_ = 1;
-  std::map<ptrid_t, void*> map_;
+ public:
+  // 登録するオブジェクトの型
+  enum class Type {
+    kSora = 1,
+    kVideoSink,
+    kAudioSink,
+    kTextureAtlas,
+  };
+
+ private:
+  struct Slot {
+    // 奇数の場合は使用中
+    std::atomic<uint32_t> generation{0};
+    std::atomic<void*> pointer{nullptr};
+    std::atomic<Type> type{Type::kSora};
+    // Lookup で返したポインタを使っている数
+    std::atomic<int> readers{0};
+  };
 
  public:
+  // Lookup の結果。これを破棄するまで、Unregister は戻らない
+  class Ref {
+   public:
+    Ref() = default;
+    Ref(Ref&& r) : slot_(r.slot_), p_(r.p_) {
+      r.slot_ = nullptr;
+      r.p_ = nullptr;
+    }
+    Ref(const Ref&) = delete;
+    Ref& operator=(const Ref&) = delete;
+    Ref& operator=(Ref&& r) {
+      if (this != &r) {
+        Release();
+        slot_ = r.slot_;
+        p_ = r.p_;
+        r.slot_ = nullptr;
+        r.p_ = nullptr;
+      }
+      return *this;
+    }
+    ~Ref() { Release(); }
+    void* get() const { return p_; }
+
+   private:
+    friend class IdPointer;
+    Ref(Slot* slot, void* p) : slot_(slot), p_(p) {}
+    void Release() {
+      if (slot_ != nullptr) {
+        slot_->readers.fetch_sub(1);
+        slot_ = nullptr;
+        p_ = nullptr;
+      }
+    }
+    Slot* slot_ = nullptr;
+    void* p_ = nullptr;
+  };
+
   static IdPointer& Instance();
-  ptrid_t Register(void* p);
+  // 登録できるのは Sora、トラック、アトラスを合わせて同時に kMaxSlots - 1 (4095) 個まで。
+  // 足りない場合は 0 を返すので、呼び出し側は 0 を登録の失敗として扱うこと
+  ptrid_t Register(void* p, Type type);
+  // 他のスレッドで Lookup の結果を使っている場合は、使い終わるまで待つ。
+  // 待っている間はロックを取らないので、他の Register や Unregister は止めない。
+  // 戻った後は、ポインタの指すオブジェクトを破棄してもいい
   void Unregister(ptrid_t id);
-  void* Lookup(ptrid_t id);
+  // ロックを取らずに O(1) で引く。見つからない場合や型が違う場合は get() が nullptr になる
+  Ref Lookup(ptrid_t id, Type type);
+
+  // ID の下位 kIndexBits ビットがスロットの番号で、その上が世代。
+  // UnityRenderer は ID の上位 3 ビットを使うので、29 ビットに収める
+  static const int kIndexBits = 12;
+  static const uint32_t kMaxSlots = 1u << kIndexBits;
+  static const uint32_t kIndexMask = kMaxSlots - 1;
+  // スロットの番号。登録中の ID 同士では被らないので、ID ごとの表の添字に使える
+  static uint32_t SlotIndex(ptrid_t id) { return id & kIndexMask; }
+
+ private:
+  IdPointer();
+
+  static const uint32_t kGenerationMask = (1u << (29 - kIndexBits)) - 1;
+
+  Slot slots_[kMaxSlots];
+  // Register と Unregister はロックを取る
+  std::mutex mutex_;
+  std::deque<uint32_t> free_indices_;
 };
 
 }  // namespace sora
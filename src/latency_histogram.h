@@ -0,0 +1,78 @@
+#ifndef SORA_LATENCY_HISTOGRAM_H_INCLUDED
+#define SORA_LATENCY_HISTOGRAM_H_INCLUDED
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace sora {
+
+// 遅延（ミリ秒）の分布を固定のバケットで数えて、パーセンタイルを求めるクラス。
+// 確保やロックをしないので、フレームごとに別スレッドから Add してもいい。
+// 256 ミリ秒までは 1 ミリ秒ごと、それ以降は約 4 秒まで 16 ミリ秒ごとに数える。
+class LatencyHistogram {
+ public:
+  LatencyHistogram() {
+    for (auto& b : buckets_) {
+      b.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void Add(int64_t ms) {
+    buckets_[ToBucket(ms)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+  // percentile は 0～100。サンプルが無い場合は -1 を返す
+  int Percentile(double percentile) const {
+    uint64_t total = count();
+    if (total == 0) {
+      return -1;
+    }
+    uint64_t target = (uint64_t)(total * std::min(percentile, 100.0) / 100.0);
+    target = std::max<uint64_t>(target, 1);
+    uint64_t sum = 0;
+    for (int i = 0; i < kBucketCount; i++) {
+      sum += buckets_[i].load(std::memory_order_relaxed);
+      if (sum >= target) {
+        return FromBucket(i);
+      }
+    }
+    return FromBucket(kBucketCount - 1);
+  }
+
+ private:
+  static const int kFineBuckets = 256;
+  static const int kCoarseWidth = 16;
+  static const int kCoarseBuckets = 240;
+  static const int kBucketCount = kFineBuckets + kCoarseBuckets;
+
+  static int ToBucket(int64_t ms) {
+    if (ms < 0) {
+      // 時計のずれで負になった場合
+      return 0;
+    }
+    if (ms < kFineBuckets) {
+      return (int)ms;
+    }
+    int64_t b = kFineBuckets + (ms - kFineBuckets) / kCoarseWidth;
+    return (int)std::min<int64_t>(b, kBucketCount - 1);
+  }
+  // バケットに入る値の上限
+  static int FromBucket(int b) {
+    if (b < kFineBuckets) {
+      return b;
+    }
+    return kFineBuckets + (b - kFineBuckets + 1) * kCoarseWidth - 1;
+  }
+
+  std::atomic<uint32_t> buckets_[kBucketCount];
+  std::atomic<uint64_t> count_{0};
+};
+
+}  // namespace sora
+
+#endif  // SORA_LATENCY_HISTOGRAM_H_INCLUDED
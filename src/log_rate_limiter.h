@@ -0,0 +1,45 @@
+#ifndef SORA_LOG_RATE_LIMITER_H_INCLUDED
+#define SORA_LOG_RATE_LIMITER_H_INCLUDED
+
+#include <stdint.h>
+
+#include <atomic>
+
+// WebRTC
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+
+namespace sora {
+
+// 同じ箇所のログを interval_ms に 1 回までに間引く。
+// 複数のスレッドから同時に呼ばれた場合は、どれか 1 つだけが出力される
+class LogRateLimiter {
+ public:
+  bool Allow(int64_t interval_ms) {
+    int64_t now = rtc::TimeMillis();
+    int64_t last = last_ms_.load(std::memory_order_relaxed);
+    if (last != 0 && now - last < interval_ms) {
+      return false;
+    }
+    return last_ms_.compare_exchange_strong(last, now,
+                                            std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<int64_t> last_ms_{0};
+};
+
+}  // namespace sora
+
+// RTC_LOG と同じように文として使う。呼び出し箇所ごとに interval_ms に 1 回だけ出力する。
+// 出力しない場合はメッセージを組み立てない。
+// RTC_LOG の式の型がバージョンによって違うので、三項演算子ではなく if で分ける
+#define SORA_LOG_RATE_LIMITED(sev, interval_ms) \
+  if (!([]() {                                  \
+        static ::sora::LogRateLimiter limiter;  \
+        return limiter.Allow(interval_ms);      \
+      }())) {                                   \
+  } else                                        \
+    RTC_LOG(sev)
+
+#endif  // SORA_LOG_RATE_LIMITER_H_INCLUDED
@@ -10,6 +10,9 @@
 
 #include "mac_capturer.h"
 
+#include <algorithm>
+#include <tuple>
+
 #include "rtc_base/logging.h"
 
 #import "sdk/objc/base/RTCVideoCapturer.h"
@@ -40,21 +43,37 @@
 
 namespace {
 
+Float64 MaxFrameRate(AVCaptureDeviceFormat* format) {
+  Float64 max_fps = 0;
+  for (AVFrameRateRange* range in format.videoSupportedFrameRateRanges) {
+    max_fps = std::max(max_fps, range.maxFrameRate);
+  }
+  return max_fps;
+}
+
+// 解像度が一番近いものの中から、要求したフレームレートを出せて、
+// キャプチャラの出力形式と同じ（変換が要らない）形式を選ぶ
 AVCaptureDeviceFormat* SelectClosestFormat(AVCaptureDevice* device,
                                            size_t width,
-                                           size_t height) {
+                                           size_t height,
+                                           size_t target_fps,
+                                           FourCharCode preferred_format) {
   NSArray<AVCaptureDeviceFormat*>* formats =
       [RTCCameraVideoCapturer supportedFormatsForDevice:device];
   AVCaptureDeviceFormat* selectedFormat = nil;
-  int currentDiff = INT_MAX;
+  std::tuple<int64_t, bool, bool> currentScore;
   for (AVCaptureDeviceFormat* format in formats) {
     CMVideoDimensions dimension =
         CMVideoFormatDescriptionGetDimensions(format.formatDescription);
-    int diff = std::abs((int64_t)width - dimension.width) +
-               std::abs((int64_t)height - dimension.height);
-    if (diff < currentDiff) {
+    int64_t diff = std::abs((int64_t)width - dimension.width) +
+                   std::abs((int64_t)height - dimension.height);
+    FourCharCode sub_type =
+        CMFormatDescriptionGetMediaSubType(format.formatDescription);
+    auto score = std::make_tuple(diff, MaxFrameRate(format) < target_fps,
+                                 sub_type != preferred_format);
+    if (selectedFormat == nil || score < currentScore) {
       selectedFormat = format;
-      currentDiff = diff;
+      currentScore = score;
     }
   }
   return selectedFormat;
@@ -70,8 +89,17 @@ MacCapturer::MacCapturer(size_t width,
   adapter_.capturer = this;
 
   capturer_ = [[RTCCameraVideoCapturer alloc] initWithDelegate:adapter_];
-  AVCaptureDeviceFormat* format = SelectClosestFormat(device, width, height);
-  [capturer_ startCaptureWithDevice:device format:format fps:target_fps];
+  AVCaptureDeviceFormat* format =
+      SelectClosestFormat(device, width, height, target_fps,
+                          [capturer_ preferredOutputPixelFormat]);
+  // 形式が対応していないフレームレートを指定すると設定に失敗するので、上限に合わせる
+  size_t fps = target_fps;
+  if (format != nil) {
+    fps = std::min(fps, (size_t)MaxFrameRate(format));
+  }
+  RTC_LOG(LS_INFO) << "Selected capture format: "
+                   << [[format description] UTF8String] << " fps=" << fps;
+  [capturer_ startCaptureWithDevice:device format:format fps:fps];
 }
 
 rtc::scoped_refptr<MacCapturer> MacCapturer::Create(
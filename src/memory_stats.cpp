@@ -0,0 +1,57 @@
+#include "memory_stats.h"
+
+namespace sora {
+
+const char* GetMemoryCategoryName(MemoryCategory category) {
+  switch (category) {
+    case MemoryCategory::kDecoderFramePool:
+      return "decoderFramePool";
+    case MemoryCategory::kRendererBuffers:
+      return "rendererBuffers";
+    case MemoryCategory::kCapturerStaging:
+      return "capturerStaging";
+    case MemoryCategory::kAudioBuffers:
+      return "audioBuffers";
+    case MemoryCategory::kWebSocketWriteQueue:
+      return "websocketWriteQueue";
+    case MemoryCategory::kEventQueue:
+      return "eventQueue";
+    case MemoryCategory::kRecordingQueue:
+      return "recordingQueue";
+    default:
+      return "unknown";
+  }
+}
+
+static void UpdatePeak(std::atomic<int64_t>& peak, int64_t value) {
+  int64_t current = peak.load(std::memory_order_relaxed);
+  while (value > current &&
+         !peak.compare_exchange_weak(current, value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+MemoryStats& MemoryStats::Instance() {
+  static MemoryStats instance;
+  return instance;
+}
+
+void MemoryStats::Add(MemoryCategory category, int64_t bytes, int64_t count) {
+  AtomicUsage& u = usages_[(int)category];
+  UpdatePeak(u.peak_bytes,
+             u.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  UpdatePeak(u.peak_count,
+             u.count.fetch_add(count, std::memory_order_relaxed) + count);
+}
+
+MemoryStats::Usage MemoryStats::Get(MemoryCategory category) const {
+  const AtomicUsage& u = usages_[(int)category];
+  Usage r;
+  r.bytes = u.bytes.load(std::memory_order_relaxed);
+  r.peak_bytes = u.peak_bytes.load(std::memory_order_relaxed);
+  r.count = u.count.load(std::memory_order_relaxed);
+  r.peak_count = u.peak_count.load(std::memory_order_relaxed);
+  return r;
+}
+
+}  // namespace sora
@@ -0,0 +1,76 @@
+#ifndef SORA_MEMORY_STATS_H_INCLUDED
+#define SORA_MEMORY_STATS_H_INCLUDED
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace sora {
+
+// メモリの使用量を数える対象
+enum class MemoryCategory : int {
+  kDecoderFramePool = 0,  // NvCodecVideoDecoder::buffer_pool_
+  kRendererBuffers,       // UnityRenderer::Sink の変換用のバッファ
+  kCapturerStaging,       // UnityCameraCapturer の読み出し用のリソース
+  kAudioBuffers,          // Unity との音声の受け渡し用のバッファ
+  kWebSocketWriteQueue,   // Websocket::write_data_
+  kEventQueue,            // Sora::event_queue_
+  kRecordingQueue,        // EncodedFrameRecorder の書き込み待ちのフレーム
+  kCount,
+};
+
+const char* GetMemoryCategoryName(MemoryCategory category);
+
+// 対象ごとに、プロセス全体で現在使っているバイト数と要素数、およびその最大値を数える。
+// 長時間動かした時にどこでメモリが増えているかを調べるためのもの
+class MemoryStats {
+ public:
+  struct Usage {
+    int64_t bytes;
+    int64_t peak_bytes;
+    int64_t count;
+    int64_t peak_count;
+  };
+
+  static MemoryStats& Instance();
+
+  void Add(MemoryCategory category, int64_t bytes, int64_t count);
+  Usage Get(MemoryCategory category) const;
+
+ private:
+  struct AtomicUsage {
+    std::atomic<int64_t> bytes = {0};
+    std::atomic<int64_t> peak_bytes = {0};
+    std::atomic<int64_t> count = {0};
+    std::atomic<int64_t> peak_count = {0};
+  };
+  AtomicUsage usages_[(int)MemoryCategory::kCount];
+};
+
+// 持ち主ごとの使用量を覚えておき、変わった分だけ MemoryStats に反映する。
+// 持ち主が破棄されると使用量は 0 に戻る
+class TrackedMemory {
+ public:
+  explicit TrackedMemory(MemoryCategory category) : category_(category) {}
+  ~TrackedMemory() { Set(0, 0); }
+  TrackedMemory(const TrackedMemory&) = delete;
+  TrackedMemory& operator=(const TrackedMemory&) = delete;
+
+  void Set(int64_t bytes, int64_t count = 0) {
+    int64_t diff_bytes = bytes - bytes_.exchange(bytes);
+    int64_t diff_count = count - count_.exchange(count);
+    if (diff_bytes != 0 || diff_count != 0) {
+      MemoryStats::Instance().Add(category_, diff_bytes, diff_count);
+    }
+  }
+  int64_t bytes() const { return bytes_.load(); }
+
+ private:
+  MemoryCategory category_;
+  std::atomic<int64_t> bytes_ = {0};
+  std::atomic<int64_t> count_ = {0};
+};
+
+}  // namespace sora
+
+#endif  // SORA_MEMORY_STATS_H_INCLUDED
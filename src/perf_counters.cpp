@@ -0,0 +1,125 @@
+#include "perf_counters.h"
+
+#include <stdio.h>
+
+// WebRTC
+#include <rtc_base/logging.h>
+#include <rtc_base/platform_thread_types.h>
+
+namespace sora {
+
+std::atomic<bool> PerfCounters::enabled_ = {false};
+std::atomic<bool> PerfCounters::tracing_ = {false};
+
+const char* GetPerfStageName(PerfStage stage) {
+  switch (stage) {
+    case PerfStage::kCameraRender:
+      return "UnityCameraCapturer::OnRender";
+    case PerfStage::kCameraCapture:
+      return "UnityCameraCapturer::Capture";
+    case PerfStage::kSourceCapturedFrame:
+      return "ScalableVideoTrackSource::OnCapturedFrame";
+    case PerfStage::kEncode:
+      return "NvCodecH264Encoder::Encode";
+    case PerfStage::kDecode:
+      return "NvCodecVideoDecoder::Decode";
+    case PerfStage::kTextureUpdate:
+      return "UnityRenderer::Sink::TextureUpdateCallback";
+    case PerfStage::kAudioProcess:
+      return "UnityAudioDevice::ProcessAudioData";
+    case PerfStage::kAudioHandle:
+      return "UnityAudioDevice::HandleAudioData";
+    default:
+      return "Unknown";
+  }
+}
+
+PerfCounters& PerfCounters::Instance() {
+  static PerfCounters instance;
+  return instance;
+}
+
+void PerfCounters::SetEnabled(bool enabled) {
+  enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void PerfCounters::Add(PerfStage stage, int64_t start_us, int64_t end_us) {
+  int64_t duration_us = end_us - start_us;
+  AtomicCounter& c = counters_[(int)stage];
+  c.count.fetch_add(1, std::memory_order_relaxed);
+  c.total_us.fetch_add(duration_us, std::memory_order_relaxed);
+  c.last_us.store(duration_us, std::memory_order_relaxed);
+  int64_t max_us = c.max_us.load(std::memory_order_relaxed);
+  while (duration_us > max_us &&
+         !c.max_us.compare_exchange_weak(max_us, duration_us,
+                                         std::memory_order_relaxed)) {
+  }
+
+  if (IsTracing()) {
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    if (trace_events_.size() < kMaxTraceEvents) {
+      trace_events_.push_back(TraceEvent{
+          stage, (uint32_t)rtc::CurrentThreadId(), start_us, duration_us});
+    }
+  }
+}
+
+PerfCounters::Counter PerfCounters::Get(PerfStage stage) const {
+  const AtomicCounter& c = counters_[(int)stage];
+  Counter r;
+  r.count = c.count.load(std::memory_order_relaxed);
+  r.total_us = c.total_us.load(std::memory_order_relaxed);
+  r.max_us = c.max_us.load(std::memory_order_relaxed);
+  r.last_us = c.last_us.load(std::memory_order_relaxed);
+  return r;
+}
+
+void PerfCounters::Reset() {
+  for (AtomicCounter& c : counters_) {
+    c.count.store(0, std::memory_order_relaxed);
+    c.total_us.store(0, std::memory_order_relaxed);
+    c.max_us.store(0, std::memory_order_relaxed);
+    c.last_us.store(0, std::memory_order_relaxed);
+  }
+}
+
+void PerfCounters::StartTrace() {
+  {
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    trace_events_.clear();
+  }
+  tracing_.store(true, std::memory_order_relaxed);
+}
+
+bool PerfCounters::StopTrace(const std::string& path) {
+  tracing_.store(false, std::memory_order_relaxed);
+
+  std::vector<TraceEvent> events;
+  {
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    events.swap(trace_events_);
+  }
+
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) {
+    RTC_LOG(LS_ERROR) << "Failed to open trace file: " << path;
+    return false;
+  }
+  // chrome://tracing や Perfetto で開ける形式で書き出す
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < events.size(); i++) {
+    const TraceEvent& e = events[i];
+    fprintf(fp,
+            "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+            "\"ts\":%lld,\"dur\":%lld}%s\n",
+            GetPerfStageName(e.stage), e.thread_id, (long long)e.start_us,
+            (long long)e.duration_us, i + 1 < events.size() ? "," : "");
+  }
+  fprintf(fp, "]}\n");
+  fclose(fp);
+  RTC_LOG(LS_INFO) << "Wrote " << events.size() << " trace events to "
+                   << path;
+  return true;
+}
+
+}  // namespace sora
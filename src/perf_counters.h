@@ -0,0 +1,103 @@
+#ifndef SORA_PERF_COUNTERS_H_INCLUDED
+#define SORA_PERF_COUNTERS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// WebRTC
+#include <rtc_base/time_utils.h>
+
+namespace sora {
+
+// 計測する処理。番号は Unity 側の Sora.PerfStage と合わせること
+enum class PerfStage : int {
+  kCameraRender = 0,       // UnityCameraCapturer::OnRender
+  kCameraCapture,          // UnityCameraCapturer の GPU からの読み出し
+  kSourceCapturedFrame,    // ScalableVideoTrackSource::OnCapturedFrame
+  kEncode,                 // NvCodecH264Encoder::Encode
+  kDecode,                 // NvCodecVideoDecoder::Decode
+  kTextureUpdate,          // UnityRenderer::Sink::TextureUpdateCallback
+  kAudioProcess,           // UnityAudioDevice::ProcessAudioData
+  kAudioHandle,            // UnityAudioDevice::HandleAudioData
+  kCount,
+};
+
+const char* GetPerfStageName(PerfStage stage);
+
+// 処理ごとの回数と時間を数えておき、有効な場合は Chrome の trace 形式のイベントも溜めておく。
+// 無効な場合は ScopedPerfTimer が atomic な bool を 1 回読むだけになる
+class PerfCounters {
+ public:
+  struct Counter {
+    uint64_t count;
+    int64_t total_us;
+    int64_t max_us;
+    int64_t last_us;
+  };
+
+  static PerfCounters& Instance();
+
+  static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+  static bool IsTracing() { return tracing_.load(std::memory_order_relaxed); }
+  void SetEnabled(bool enabled);
+
+  void Add(PerfStage stage, int64_t start_us, int64_t end_us);
+  Counter Get(PerfStage stage) const;
+  void Reset();
+
+  // 溜めている trace のイベントを捨てて、新しく溜め始める
+  void StartTrace();
+  // 溜めるのを止めて、溜めたイベントを path に書き出す
+  bool StopTrace(const std::string& path);
+
+ private:
+  struct AtomicCounter {
+    std::atomic<uint64_t> count = {0};
+    std::atomic<int64_t> total_us = {0};
+    std::atomic<int64_t> max_us = {0};
+    std::atomic<int64_t> last_us = {0};
+  };
+  struct TraceEvent {
+    PerfStage stage;
+    uint32_t thread_id;
+    int64_t start_us;
+    int64_t duration_us;
+  };
+  // 止め忘れた場合にメモリを使い切らないようにする
+  static const size_t kMaxTraceEvents = 1 << 18;
+
+  static std::atomic<bool> enabled_;
+  static std::atomic<bool> tracing_;
+
+  AtomicCounter counters_[(int)PerfStage::kCount];
+  std::mutex trace_mutex_;
+  std::vector<TraceEvent> trace_events_;
+};
+
+// スコープを抜けるまでの時間を stage の時間として数える
+class ScopedPerfTimer {
+ public:
+  explicit ScopedPerfTimer(PerfStage stage)
+      : stage_(stage),
+        start_us_(PerfCounters::IsEnabled() ? rtc::TimeMicros() : 0) {}
+  ~ScopedPerfTimer() {
+    if (start_us_ != 0) {
+      PerfCounters::Instance().Add(stage_, start_us_, rtc::TimeMicros());
+    }
+  }
+  ScopedPerfTimer(const ScopedPerfTimer&) = delete;
+  ScopedPerfTimer& operator=(const ScopedPerfTimer&) = delete;
+
+ private:
+  PerfStage stage_;
+  int64_t start_us_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_PERF_COUNTERS_H_INCLUDED
@@ -0,0 +1,240 @@
+#include "quality_controller.h"
+
+#include <algorithm>
+
+// webrtc
+#include "api/stats/rtcstats_objects.h"
+#include "rtc_base/logging.h"
+
+namespace sora {
+
+namespace {
+
+// 目標のフレーム時間をこれだけ超えたら落とす
+const double kOverloadRatio = 1.1;
+// 目標のフレーム時間をこれだけ下回っていれば余裕があるとみなす
+const double kHealthyRatio = 0.85;
+// 余裕がある状態がこの回数続いたら 1 段階戻す
+const int kRecoverCount = 5;
+// 1 フレームのエンコードにフレーム間隔のこの割合以上かかっていたら落とす
+const double kEncodeBusyRatio = 0.7;
+// 1 フレームのエンコードがフレーム間隔のこの割合未満なら余裕があるとみなす
+const double kEncodeHealthyRatio = 0.5;
+// 落とす状態がこの回数続いたら 1 段階落とす
+const int kOverloadCount = 2;
+// 段階を変えた後、この回数は落とさずに結果が統計情報に出るのを待つ
+const int kSettleCount = 2;
+
+}  // namespace
+
+const QualityController::Level QualityController::kLevels[] = {
+    {1.0, 0},  {1.0, 24}, {1.5, 24}, {2.0, 20},
+    {2.0, 15}, {3.0, 15}, {4.0, 10},
+};
+const int QualityController::kLevelCount =
+    sizeof(QualityController::kLevels) / sizeof(QualityController::kLevels[0]);
+
+QualityController::QualityController(double target_frame_ms)
+    : target_frame_ms_(target_frame_ms) {}
+
+void QualityController::SetConnection(
+    std::shared_ptr<RTCConnection> connection) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  connection_ = connection;
+  // 新しい接続では最初からやり直す。
+  // 他の値はシグナリングスレッドで触っているので、次の OnReport で戻す
+  level_ = 0;
+  reset_pending_ = true;
+}
+
+void QualityController::ReportFrameTime(double frame_ms) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!has_frame_ms_) {
+    frame_ms_ = frame_ms;
+    has_frame_ms_ = true;
+  } else {
+    // 1 回だけのスパイクで落とさないように均す
+    frame_ms_ += (frame_ms - frame_ms_) * 0.1;
+  }
+}
+
+int QualityController::level() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return level_;
+}
+
+void QualityController::OnReport(
+    const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
+  // 送信している映像の中で一番エンコードが重いものを見る
+  std::string limitation;
+  double total_encode_time = 0;
+  uint64_t frames_encoded = 0;
+  double frames_per_second = 0;
+  bool found = false;
+  for (const webrtc::RTCOutboundRTPStreamStats* outbound :
+       report->GetStatsOfType<webrtc::RTCOutboundRTPStreamStats>()) {
+    if (!outbound->kind.is_defined() || *outbound->kind != "video") {
+      continue;
+    }
+    found = true;
+    if (outbound->quality_limitation_reason.is_defined() &&
+        (limitation.empty() || limitation == "none")) {
+      limitation = *outbound->quality_limitation_reason;
+    }
+    if (outbound->total_encode_time.is_defined()) {
+      total_encode_time += *outbound->total_encode_time;
+    }
+    if (outbound->frames_encoded.is_defined()) {
+      frames_encoded += *outbound->frames_encoded;
+    }
+    if (outbound->frames_per_second.is_defined()) {
+      frames_per_second =
+          std::max(frames_per_second, (double)*outbound->frames_per_second);
+    }
+  }
+  if (!found) {
+    return;
+  }
+
+  double frame_ms;
+  bool has_frame_ms;
+  bool reset;
+  int current_level;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    frame_ms = frame_ms_;
+    has_frame_ms = has_frame_ms_;
+    reset = reset_pending_;
+    reset_pending_ = false;
+    current_level = level_;
+  }
+  if (reset) {
+    applied_level_ = 0;
+    healthy_count_ = 0;
+    overload_count_ = 0;
+    settle_count_ = 0;
+    prev_total_encode_time_ = 0;
+    prev_frames_encoded_ = 0;
+    has_base_parameters_ = false;
+  }
+
+  double encode_ms = 0;
+  if (frames_encoded > prev_frames_encoded_ &&
+      total_encode_time >= prev_total_encode_time_) {
+    encode_ms = (total_encode_time - prev_total_encode_time_) * 1000.0 /
+                (frames_encoded - prev_frames_encoded_);
+  }
+  prev_total_encode_time_ = total_encode_time;
+  prev_frames_encoded_ = frames_encoded;
+
+  bool game_overloaded = target_frame_ms_ > 0 && has_frame_ms &&
+                         frame_ms > target_frame_ms_ * kOverloadRatio;
+  bool game_healthy = target_frame_ms_ <= 0 || !has_frame_ms ||
+                      frame_ms < target_frame_ms_ * kHealthyRatio;
+  // quality_limitation_reason の "cpu" は WebRTC 自身が解像度を落としている間はずっと出続けるので、
+  // それを見て落とすと WebRTC の調整と取り合って一番下まで落ちてしまう。
+  // エンコードにかかった時間とフレーム間隔の比で判断する
+  double encode_ratio =
+      frames_per_second > 0 ? encode_ms * frames_per_second / 1000.0 : 0;
+  bool encoder_busy = encode_ratio > kEncodeBusyRatio;
+  bool encoder_healthy = encode_ratio < kEncodeHealthyRatio;
+
+  if (settle_count_ > 0) {
+    settle_count_--;
+  }
+  int level = current_level;
+  if (game_overloaded || encoder_busy) {
+    healthy_count_ = 0;
+    if (++overload_count_ >= kOverloadCount && settle_count_ == 0) {
+      overload_count_ = 0;
+      level = std::min(current_level + 1, kLevelCount - 1);
+    }
+  } else if (game_healthy && encoder_healthy && current_level > 0) {
+    overload_count_ = 0;
+    if (++healthy_count_ >= kRecoverCount) {
+      healthy_count_ = 0;
+      level = current_level - 1;
+    }
+  } else {
+    overload_count_ = 0;
+    healthy_count_ = 0;
+  }
+
+  if (level != current_level) {
+    RTC_LOG(LS_INFO) << "QualityController: level " << current_level << " -> "
+                     << level << " frame_ms=" << frame_ms
+                     << " encode_ms=" << encode_ms
+                     << " encode_ratio=" << encode_ratio
+                     << " quality_limitation_reason=" << limitation;
+    settle_count_ = kSettleCount;
+    std::lock_guard<std::mutex> guard(mutex_);
+    level_ = level;
+  }
+  if (level != applied_level_) {
+    Apply(level);
+  }
+}
+
+void QualityController::Apply(int level) {
+  std::shared_ptr<RTCConnection> connection;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    connection = connection_.lock();
+  }
+  if (connection == nullptr) {
+    return;
+  }
+  rtc::scoped_refptr<webrtc::RtpSenderInterface> sender;
+  for (auto s : connection->GetConnection()->GetSenders()) {
+    if (s->media_type() == cricket::MEDIA_TYPE_VIDEO) {
+      sender = s;
+      break;
+    }
+  }
+  if (sender == nullptr) {
+    return;
+  }
+
+  webrtc::RtpParameters parameters = sender->GetParameters();
+  if (!has_base_parameters_) {
+    has_base_parameters_ = true;
+    base_degradation_preference_ = parameters.degradation_preference;
+    base_encodings_ = parameters.encodings;
+  }
+  if (parameters.encodings.size() != base_encodings_.size()) {
+    // simulcast のレイヤーが変わった場合は、今の値を元にする
+    base_encodings_ = parameters.encodings;
+  }
+
+  const Level& l = kLevels[level];
+  // 落としている間は WebRTC 自身の解像度の調整と重ならないように、
+  // フレームレートだけを落とさせる
+  parameters.degradation_preference =
+      level == 0 ? base_degradation_preference_
+                 : webrtc::DegradationPreference::MAINTAIN_RESOLUTION;
+  for (size_t i = 0; i < parameters.encodings.size(); i++) {
+    webrtc::RtpEncodingParameters& encoding = parameters.encodings[i];
+    const webrtc::RtpEncodingParameters& base = base_encodings_[i];
+    if (level == 0) {
+      encoding.scale_resolution_down_by = base.scale_resolution_down_by;
+      encoding.max_framerate = base.max_framerate;
+      continue;
+    }
+    encoding.scale_resolution_down_by =
+        base.scale_resolution_down_by.value_or(1.0) *
+        l.scale_resolution_down_by;
+    if (l.max_framerate > 0) {
+      encoding.max_framerate =
+          std::min<double>(base.max_framerate.value_or(l.max_framerate),
+                           l.max_framerate);
+    }
+  }
+  webrtc::RTCError error = sender->SetParameters(parameters);
+  if (!error.ok()) {
+    RTC_LOG(LS_WARNING) << "Failed to set parameters: " << error.message();
+    return;
+  }
+  applied_level_ = level;
+}
+
+}  // namespace sora
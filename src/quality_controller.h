@@ -0,0 +1,78 @@
+#ifndef SORA_QUALITY_CONTROLLER_H_INCLUDED
+#define SORA_QUALITY_CONTROLLER_H_INCLUDED
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// webrtc
+#include "api/rtp_parameters.h"
+#include "api/stats/rtc_stats_report.h"
+
+#include "rtc/rtc_connection.h"
+
+namespace sora {
+
+// 送信する映像の解像度とフレームレートを、統計情報と Unity のフレーム時間から調整するクラス。
+// ゲームのフレーム時間が目標を超えたり、エンコードがフレーム間隔に間に合わなくなったりしたら段階的に落とし、
+// 余裕がしばらく続いたら元に戻す。
+// 解像度を落とすと VideoSinkWants でキャプチャラにも伝わるので、
+// Unity のカメラからの読み出しや縮小も減る。
+class QualityController {
+ public:
+  // target_frame_ms は Unity の 1 フレームにかけていい時間。
+  // 0 の場合はフレーム時間を見ずに、エンコードの状態だけで調整する
+  explicit QualityController(double target_frame_ms);
+
+  void SetConnection(std::shared_ptr<RTCConnection> connection);
+
+  // Unity のスレッドから毎フレーム呼ぶ
+  void ReportFrameTime(double frame_ms);
+
+  // StatsSampler が統計情報を取得するたびに、シグナリングスレッドから呼ばれる
+  void OnReport(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report);
+
+  // 0 が最高品質で、大きいほど落としている
+  int level() const;
+
+ private:
+  struct Level {
+    double scale_resolution_down_by;
+    // 0 の場合は制限しない
+    int max_framerate;
+  };
+  static const Level kLevels[];
+  static const int kLevelCount;
+
+  void Apply(int level);
+
+  const double target_frame_ms_;
+
+  mutable std::mutex mutex_;
+  std::weak_ptr<RTCConnection> connection_;
+  // ReportFrameTime で受け取ったフレーム時間の指数移動平均
+  double frame_ms_ = 0;
+  bool has_frame_ms_ = false;
+  int level_ = 0;
+  bool reset_pending_ = false;
+
+  // 以下はシグナリングスレッドからしか触らない
+  int applied_level_ = 0;
+  // 余裕がある状態と、落とす状態が何回続いたか
+  int healthy_count_ = 0;
+  int overload_count_ = 0;
+  // 段階を変えてから、あと何回は落とさずに待つか
+  int settle_count_ = 0;
+  double prev_total_encode_time_ = 0;
+  uint64_t prev_frames_encoded_ = 0;
+  // 調整を始める前の送信パラメータ。戻す時に使う
+  bool has_base_parameters_ = false;
+  webrtc::DegradationPreference base_degradation_preference_ =
+      webrtc::DegradationPreference::BALANCED;
+  std::vector<webrtc::RtpEncodingParameters> base_encodings_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_QUALITY_CONTROLLER_H_INCLUDED
@@ -0,0 +1,145 @@
+#include "render_scheduler.h"
+
+#include <algorithm>
+
+// WebRTC
+#include <rtc_base/logging.h>
+
+namespace sora {
+
+// RenderScheduler::Entry
+
+RenderScheduler::Entry::Entry(std::function<bool()> has_new_frame)
+    : has_new_frame_(std::move(has_new_frame)) {
+  RenderScheduler::Instance().Register(this);
+}
+RenderScheduler::Entry::~Entry() {
+  RenderScheduler::Instance().Unregister(this);
+}
+
+bool RenderScheduler::Entry::Acquire(int pixel_count) {
+  auto& scheduler = RenderScheduler::Instance();
+  uint64_t frame = scheduler.frame_.load();
+  requested_frame_ = frame;
+  if (pixel_count > 0) {
+    pixel_count_ = pixel_count;
+  }
+  if (!scheduler.active_.load()) {
+    return true;
+  }
+  return allowed_frame_ == frame;
+}
+
+void RenderScheduler::Entry::AddCost(int64_t time_us, int64_t bytes) {
+  frame_us_ += time_us;
+  frame_bytes_ += bytes;
+  stale_frames_ = 0;
+}
+
+// RenderScheduler
+
+RenderScheduler& RenderScheduler::Instance() {
+  static RenderScheduler instance;
+  return instance;
+}
+
+void RenderScheduler::Register(Entry* entry) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  entries_.push_back(entry);
+}
+void RenderScheduler::Unregister(Entry* entry) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  entries_.erase(std::remove(entries_.begin(), entries_.end(), entry),
+                 entries_.end());
+}
+
+void RenderScheduler::SetBudget(int64_t time_us,
+                                int64_t bytes,
+                                int max_stale_frames) {
+  RTC_LOG(LS_INFO) << "Set render budget: time_us=" << time_us
+                   << " bytes=" << bytes
+                   << " max_stale_frames=" << max_stale_frames;
+  budget_us_.store(std::max<int64_t>(time_us, 0));
+  budget_bytes_.store(std::max<int64_t>(bytes, 0));
+  max_stale_frames_.store(std::max(max_stale_frames, 0));
+  if (time_us <= 0 && bytes <= 0) {
+    active_.store(false);
+  }
+}
+
+void RenderScheduler::BeginFrame() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  uint64_t prev_frame = frame_.load();
+  uint64_t frame = prev_frame + 1;
+  int64_t budget_us = budget_us_.load();
+  int64_t budget_bytes = budget_bytes_.load();
+  int max_stale_frames = max_stale_frames_.load();
+
+  candidates_.clear();
+  for (Entry* e : entries_) {
+    // 前のフレームで転送した分を移動平均に入れる
+    if (e->frame_us_ != 0 || e->frame_bytes_ != 0) {
+      e->cost_us_ = (e->cost_us_ * 3 + e->frame_us_) / 4;
+      e->cost_bytes_ = (e->cost_bytes_ * 3 + e->frame_bytes_) / 4;
+      e->frame_us_ = 0;
+      e->frame_bytes_ = 0;
+    }
+    // 前のフレームで転送を要求されていないトラックは、テクスチャに紐付いていないので数えない
+    if (e->requested_frame_ != prev_frame || !e->has_new_frame_()) {
+      e->stale_frames_ = 0;
+      continue;
+    }
+    e->stale_frames_++;
+    candidates_.push_back(e);
+  }
+
+  if (budget_us <= 0 && budget_bytes <= 0) {
+    frame_.store(frame);
+    return;
+  }
+
+  auto forced = [max_stale_frames](const Entry* e) {
+    return e->stale_frames_ > max_stale_frames;
+  };
+  std::stable_sort(candidates_.begin(), candidates_.end(),
+                   [&forced](const Entry* a, const Entry* b) {
+                     if (forced(a) != forced(b)) {
+                       return forced(a);
+                     }
+                     int pa = a->priority_.load();
+                     int pb = b->priority_.load();
+                     if (pa != pb) {
+                       return pa > pb;
+                     }
+                     if (a->stale_frames_ != b->stale_frames_) {
+                       return a->stale_frames_ > b->stale_frames_;
+                     }
+                     return a->pixel_count_ > b->pixel_count_;
+                   });
+
+  int64_t used_us = 0;
+  int64_t used_bytes = 0;
+  int allowed = 0;
+  for (Entry* e : candidates_) {
+    bool fits =
+        (budget_us <= 0 || used_us + e->cost_us_ <= budget_us) &&
+        (budget_bytes <= 0 || used_bytes + e->cost_bytes_ <= budget_bytes);
+    // 1 つも転送できないと進まないので、最初の 1 つは必ず転送する
+    if (!fits && !forced(e) && allowed != 0) {
+      e->frames_deferred_++;
+      continue;
+    }
+    e->allowed_frame_ = frame;
+    used_us += e->cost_us_;
+    used_bytes += e->cost_bytes_;
+    allowed++;
+  }
+  frame_.store(frame);
+  active_.store(true);
+}
+
+void RenderScheduler::BeginFrameCallback(int eventID) {
+  RenderScheduler::Instance().BeginFrame();
+}
+
+}  // namespace sora
@@ -0,0 +1,94 @@
+#ifndef SORA_RENDER_SCHEDULER_H_INCLUDED
+#define SORA_RENDER_SCHEDULER_H_INCLUDED
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "unity/IUnityInterface.h"
+
+namespace sora {
+
+// 受信した映像のテクスチャ転送に、Unity の 1 フレームあたりの時間とバイト数の上限を設ける。
+// 大量のトラックを受信している時に、全てのトラックを同じフレームで転送して
+// レンダリングスレッドが詰まるのを避けるためのもの。
+//
+// BeginFrame の時点で前のフレームに転送を要求されたトラックのうち、新しいフレームが
+// 来ているものを優先度、待たされたフレーム数、テクスチャのサイズの順に並べ、
+// 前回までの転送にかかった時間とバイト数から上限に収まる分だけ転送を許可する。
+// 許可されなかったトラックは待たされたフレーム数が増えるので、次のフレームで先に転送される。
+// max_stale_frames フレームより長く待たされたトラックは上限を超えても転送する。
+//
+// BeginFrame と転送はどちらも Unity のレンダリングスレッドから呼ばれる前提。
+class RenderScheduler {
+ public:
+  // Sink ごとのスケジューリングの状態。作ると RenderScheduler に登録される
+  class Entry {
+   public:
+    explicit Entry(std::function<bool()> has_new_frame);
+    ~Entry();
+    Entry(const Entry&) = delete;
+    Entry& operator=(const Entry&) = delete;
+
+    // 大きいほど先に転送する。デフォルトは 0
+    void SetPriority(int priority) { priority_.store(priority); }
+    // 予算の範囲外で転送を見送ったフレーム数
+    uint64_t frames_deferred() const { return frames_deferred_.load(); }
+
+    // テクスチャの転送を要求された時に呼ぶ。このフレームで転送してよければ true を返す。
+    // pixel_count はテクスチャのピクセル数で、0 の場合は前の値のままにする
+    bool Acquire(int pixel_count);
+    // 転送した時に、かかった時間とバイト数を積算する
+    void AddCost(int64_t time_us, int64_t bytes);
+
+   private:
+    friend class RenderScheduler;
+
+    std::function<bool()> has_new_frame_;
+    std::atomic<int> priority_{0};
+    std::atomic<uint64_t> frames_deferred_{0};
+
+    // 以下はレンダリングスレッドからしか触らない
+    int pixel_count_ = 0;
+    int stale_frames_ = 0;
+    uint64_t requested_frame_ = 0;
+    uint64_t allowed_frame_ = 0;
+    // 1 フレームで転送にかかった時間とバイト数の移動平均と、今のフレームの積算値
+    int64_t cost_us_ = 0;
+    int64_t cost_bytes_ = 0;
+    int64_t frame_us_ = 0;
+    int64_t frame_bytes_ = 0;
+  };
+
+  static RenderScheduler& Instance();
+
+  // time_us と bytes の両方が 0 の場合は制限しない
+  void SetBudget(int64_t time_us, int64_t bytes, int max_stale_frames);
+  // Unity のフレームの最初に、テクスチャの転送より前に呼ぶ
+  void BeginFrame();
+  // IssuePluginEvent で呼ぶ。eventID は使わない
+  static void UNITY_INTERFACE_API BeginFrameCallback(int eventID);
+
+ private:
+  void Register(Entry* entry);
+  void Unregister(Entry* entry);
+
+  std::atomic<int64_t> budget_us_{0};
+  std::atomic<int64_t> budget_bytes_{0};
+  std::atomic<int> max_stale_frames_{3};
+  // 予算が設定されていて、BeginFrame が呼ばれたことがある場合だけ有効にする
+  std::atomic<bool> active_{false};
+  std::atomic<uint64_t> frame_{0};
+
+  std::mutex mutex_;
+  std::vector<Entry*> entries_;
+  // BeginFrame で毎回確保しないように使い回す
+  std::vector<Entry*> candidates_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_RENDER_SCHEDULER_H_INCLUDED
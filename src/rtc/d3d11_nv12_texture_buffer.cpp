@@ -0,0 +1,177 @@
+#include "d3d11_nv12_texture_buffer.h"
+
+#include <dxgi.h>
+
+#include "api/video/i420_buffer.h"
+#include "libyuv.h"
+#include "rtc_base/logging.h"
+
+#include "d3d11_texture_buffer.h"
+#include "dxgi_adapter.h"
+
+using Microsoft::WRL::ComPtr;
+
+namespace {
+
+ComPtr<ID3D11Texture2D> CreatePlaneTexture(ID3D11Device* device,
+                                           DXGI_FORMAT format,
+                                           int width,
+                                           int height) {
+  D3D11_TEXTURE2D_DESC desc = {};
+  desc.Width = width;
+  desc.Height = height;
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = format;
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D11_USAGE_DEFAULT;
+  desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+  // ToI420 で別のデバイスから開けるようにしておく
+  desc.MiscFlags = D3D11_RESOURCE_MISC_SHARED;
+  ComPtr<ID3D11Texture2D> texture;
+  HRESULT hr = device->CreateTexture2D(&desc, NULL, texture.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11Device::CreateTexture2D is failed: hr=" << hr;
+    return nullptr;
+  }
+  return texture;
+}
+
+// 共有テクスチャを device で開いて、読み出し用のテクスチャにコピーして Map する
+bool MapSharedTexture(ID3D11Device* device,
+                      ID3D11DeviceContext* context,
+                      ID3D11Texture2D* texture,
+                      ComPtr<ID3D11Texture2D>* staging,
+                      D3D11_MAPPED_SUBRESOURCE* resource) {
+  ComPtr<IDXGIResource> dxgi_resource;
+  HANDLE shared_handle = nullptr;
+  if (!SUCCEEDED(texture->QueryInterface(
+          __uuidof(IDXGIResource), (void**)dxgi_resource.GetAddressOf())) ||
+      !SUCCEEDED(dxgi_resource->GetSharedHandle(&shared_handle))) {
+    RTC_LOG(LS_ERROR) << "Failed to get shared handle";
+    return false;
+  }
+  ComPtr<ID3D11Texture2D> shared;
+  HRESULT hr = device->OpenSharedResource(
+      shared_handle, __uuidof(ID3D11Texture2D), (void**)shared.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11Device::OpenSharedResource is failed: hr="
+                      << hr;
+    return false;
+  }
+
+  D3D11_TEXTURE2D_DESC desc;
+  shared->GetDesc(&desc);
+  desc.Usage = D3D11_USAGE_STAGING;
+  desc.BindFlags = 0;
+  desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+  desc.MiscFlags = 0;
+  hr = device->CreateTexture2D(&desc, NULL, staging->GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11Device::CreateTexture2D is failed: hr=" << hr;
+    return false;
+  }
+  context->CopyResource(staging->Get(), shared.Get());
+  hr = context->Map(staging->Get(), 0, D3D11_MAP_READ, 0, resource);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11DeviceContext::Map is failed: hr=" << hr;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+namespace sora {
+
+rtc::scoped_refptr<rtc::RefCountedObject<D3D11NV12TextureBuffer>>
+D3D11NV12TextureBuffer::Create(ID3D11Device* device, int width, int height) {
+  ComPtr<ID3D11Texture2D> y_texture =
+      CreatePlaneTexture(device, DXGI_FORMAT_R8_UNORM, width, height);
+  ComPtr<ID3D11Texture2D> uv_texture =
+      CreatePlaneTexture(device, DXGI_FORMAT_R8G8_UNORM, (width + 1) / 2,
+                         (height + 1) / 2);
+  if (y_texture == nullptr || uv_texture == nullptr) {
+    return nullptr;
+  }
+
+  // ToI420 で同じアダプタを探すために LUID を覚えておく
+  LUID adapter_luid = {};
+  GetAdapterLuid(device, &adapter_luid);
+
+  return new rtc::RefCountedObject<D3D11NV12TextureBuffer>(
+      y_texture, uv_texture, adapter_luid, width, height);
+}
+
+D3D11NV12TextureBuffer::D3D11NV12TextureBuffer(
+    ComPtr<ID3D11Texture2D> y_texture,
+    ComPtr<ID3D11Texture2D> uv_texture,
+    LUID adapter_luid,
+    int width,
+    int height)
+    : y_texture_(y_texture),
+      uv_texture_(uv_texture),
+      adapter_luid_(adapter_luid),
+      width_(width),
+      height_(height) {}
+
+D3D11NV12TextureBuffer::~D3D11NV12TextureBuffer() {}
+
+webrtc::VideoFrameBuffer::Type D3D11NV12TextureBuffer::type() const {
+  return Type::kNative;
+}
+
+int D3D11NV12TextureBuffer::width() const {
+  return width_;
+}
+
+int D3D11NV12TextureBuffer::height() const {
+  return height_;
+}
+
+rtc::scoped_refptr<webrtc::I420BufferInterface>
+D3D11NV12TextureBuffer::ToI420() {
+  ID3D11Device* device;
+  ID3D11DeviceContext* context;
+  std::unique_lock<std::mutex> lock =
+      GetReadbackDevice(adapter_luid_, &device, &context);
+  if (device == nullptr) {
+    return nullptr;
+  }
+
+  ComPtr<ID3D11Texture2D> y_staging;
+  ComPtr<ID3D11Texture2D> uv_staging;
+  D3D11_MAPPED_SUBRESOURCE y_resource;
+  D3D11_MAPPED_SUBRESOURCE uv_resource;
+  if (!MapSharedTexture(device, context, y_texture_.Get(), &y_staging,
+                        &y_resource)) {
+    return nullptr;
+  }
+  if (!MapSharedTexture(device, context, uv_texture_.Get(), &uv_staging,
+                        &uv_resource)) {
+    context->Unmap(y_staging.Get(), 0);
+    return nullptr;
+  }
+
+  rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
+      webrtc::I420Buffer::Create(width_, height_);
+  libyuv::NV12ToI420((const uint8_t*)y_resource.pData, y_resource.RowPitch,
+                     (const uint8_t*)uv_resource.pData, uv_resource.RowPitch,
+                     i420_buffer->MutableDataY(), i420_buffer->StrideY(),
+                     i420_buffer->MutableDataU(), i420_buffer->StrideU(),
+                     i420_buffer->MutableDataV(), i420_buffer->StrideV(),
+                     width_, height_);
+  context->Unmap(y_staging.Get(), 0);
+  context->Unmap(uv_staging.Get(), 0);
+  return i420_buffer;
+}
+
+ID3D11Texture2D* D3D11NV12TextureBuffer::y_texture() const {
+  return y_texture_.Get();
+}
+
+ID3D11Texture2D* D3D11NV12TextureBuffer::uv_texture() const {
+  return uv_texture_.Get();
+}
+
+}  // namespace sora
@@ -0,0 +1,50 @@
+#ifndef SORA_D3D11_NV12_TEXTURE_BUFFER_H_
+#define SORA_D3D11_NV12_TEXTURE_BUFFER_H_
+
+#include <d3d11.h>
+#include <wrl.h>
+
+#include "api/video/video_frame_buffer.h"
+#include "rtc_base/ref_counted_object.h"
+
+namespace sora {
+
+// NVDEC のデコード結果を GPU に置いたまま持つ VideoFrameBuffer。
+// Unity のデバイス上に Y (R8) と UV (R8G8) の 2 枚のテクスチャを持っていて、
+// UnityRenderer は CPU を経由せずに Unity のテクスチャへコピーする。
+class D3D11NV12TextureBuffer : public webrtc::VideoFrameBuffer {
+ public:
+  // デコーダがテクスチャを使い回せるか HasOneRef() で調べられるように
+  // RefCountedObject のまま返す
+  static rtc::scoped_refptr<rtc::RefCountedObject<D3D11NV12TextureBuffer>>
+  Create(ID3D11Device* device, int width, int height);
+
+  Type type() const override;
+  int width() const override;
+  int height() const override;
+  // テクスチャに対応していない描画方法向け。
+  // 同じアダプタに自前のデバイスを作って読み出すので遅い。
+  rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+
+  ID3D11Texture2D* y_texture() const;
+  ID3D11Texture2D* uv_texture() const;
+
+ protected:
+  D3D11NV12TextureBuffer(Microsoft::WRL::ComPtr<ID3D11Texture2D> y_texture,
+                         Microsoft::WRL::ComPtr<ID3D11Texture2D> uv_texture,
+                         LUID adapter_luid,
+                         int width,
+                         int height);
+  ~D3D11NV12TextureBuffer() override;
+
+ private:
+  const Microsoft::WRL::ComPtr<ID3D11Texture2D> y_texture_;
+  const Microsoft::WRL::ComPtr<ID3D11Texture2D> uv_texture_;
+  const LUID adapter_luid_;
+  const int width_;
+  const int height_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_D3D11_NV12_TEXTURE_BUFFER_H_
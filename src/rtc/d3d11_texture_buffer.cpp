@@ -0,0 +1,176 @@
+#include "d3d11_texture_buffer.h"
+
+#include <dxgi.h>
+
+#include "api/video/i420_buffer.h"
+#include "libyuv.h"
+#include "rtc_base/logging.h"
+
+#include "dxgi_adapter.h"
+
+using Microsoft::WRL::ComPtr;
+
+namespace sora {
+
+std::unique_lock<std::mutex> GetReadbackDevice(const LUID& adapter_luid,
+                                               ID3D11Device** device_out,
+                                               ID3D11DeviceContext** context_out) {
+  static std::mutex mutex;
+  static ComPtr<ID3D11Device> device;
+  static ComPtr<ID3D11DeviceContext> context;
+  static LUID luid = {};
+
+  std::unique_lock<std::mutex> lock(mutex);
+  *device_out = nullptr;
+  *context_out = nullptr;
+  if (device == nullptr || !IsSameAdapterLuid(luid, adapter_luid)) {
+    device.Reset();
+    context.Reset();
+    ComPtr<IDXGIAdapter> adapter = FindAdapter(adapter_luid);
+    HRESULT hr = D3D11CreateDevice(
+        adapter.Get(),
+        adapter ? D3D_DRIVER_TYPE_UNKNOWN : D3D_DRIVER_TYPE_HARDWARE, NULL, 0,
+        NULL, 0, D3D11_SDK_VERSION, device.GetAddressOf(), NULL,
+        context.GetAddressOf());
+    if (!SUCCEEDED(hr)) {
+      RTC_LOG(LS_ERROR) << "D3D11CreateDevice is failed: hr=" << hr;
+      device.Reset();
+      context.Reset();
+      return lock;
+    }
+    luid = adapter_luid;
+  }
+  *device_out = device.Get();
+  *context_out = context.Get();
+  return lock;
+}
+
+rtc::scoped_refptr<rtc::RefCountedObject<D3D11TextureBuffer>>
+D3D11TextureBuffer::Create(ComPtr<ID3D11Texture2D> texture) {
+  ComPtr<IDXGIResource> dxgi_resource;
+  HRESULT hr = texture.As(&dxgi_resource);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "QueryInterface(IDXGIResource) is failed: hr=" << hr;
+    return nullptr;
+  }
+  HANDLE shared_handle = nullptr;
+  hr = dxgi_resource->GetSharedHandle(&shared_handle);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "IDXGIResource::GetSharedHandle is failed: hr=" << hr;
+    return nullptr;
+  }
+
+  // ToI420 で同じアダプタを探すために LUID を覚えておく
+  ComPtr<ID3D11Device> device;
+  texture->GetDevice(device.GetAddressOf());
+  LUID adapter_luid = {};
+  GetAdapterLuid(device.Get(), &adapter_luid);
+
+  D3D11_TEXTURE2D_DESC desc;
+  texture->GetDesc(&desc);
+  return new rtc::RefCountedObject<D3D11TextureBuffer>(
+      texture, shared_handle, adapter_luid, desc.Width,
+      desc.Height);
+}
+
+D3D11TextureBuffer::D3D11TextureBuffer(ComPtr<ID3D11Texture2D> texture,
+                                       HANDLE shared_handle,
+                                       LUID adapter_luid,
+                                       int width,
+                                       int height)
+    : texture_(texture),
+      shared_handle_(shared_handle),
+      adapter_luid_(adapter_luid),
+      width_(width),
+      height_(height) {}
+
+D3D11TextureBuffer::~D3D11TextureBuffer() {}
+
+webrtc::VideoFrameBuffer::Type D3D11TextureBuffer::type() const {
+  return Type::kNative;
+}
+
+int D3D11TextureBuffer::width() const {
+  return width_;
+}
+
+int D3D11TextureBuffer::height() const {
+  return height_;
+}
+
+rtc::scoped_refptr<webrtc::I420BufferInterface> D3D11TextureBuffer::ToI420() {
+  ID3D11Device* device;
+  ID3D11DeviceContext* context;
+  std::unique_lock<std::mutex> lock =
+      GetReadbackDevice(adapter_luid_, &device, &context);
+  if (device == nullptr) {
+    return nullptr;
+  }
+
+  ComPtr<ID3D11Texture2D> texture;
+  HRESULT hr = device->OpenSharedResource(shared_handle_,
+                                          __uuidof(ID3D11Texture2D),
+                                          (void**)texture.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11Device::OpenSharedResource is failed: hr="
+                      << hr;
+    return nullptr;
+  }
+
+  D3D11_TEXTURE2D_DESC desc;
+  texture->GetDesc(&desc);
+  desc.Usage = D3D11_USAGE_STAGING;
+  desc.BindFlags = 0;
+  desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+  desc.MiscFlags = 0;
+  ComPtr<ID3D11Texture2D> staging;
+  hr = device->CreateTexture2D(&desc, NULL, staging.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11Device::CreateTexture2D is failed: hr=" << hr;
+    return nullptr;
+  }
+
+  ComPtr<IDXGIKeyedMutex> keyed_mutex;
+  texture.As(&keyed_mutex);
+  if (keyed_mutex == nullptr || keyed_mutex->AcquireSync(0, 1000) != S_OK) {
+    RTC_LOG(LS_ERROR) << "IDXGIKeyedMutex::AcquireSync is failed";
+    return nullptr;
+  }
+  context->CopyResource(staging.Get(), texture.Get());
+  keyed_mutex->ReleaseSync(0);
+
+  D3D11_MAPPED_SUBRESOURCE resource;
+  hr = context->Map(staging.Get(), 0, D3D11_MAP_READ, 0, &resource);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11DeviceContext::Map is failed: hr=" << hr;
+    return nullptr;
+  }
+  rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
+      webrtc::I420Buffer::Create(width_, height_);
+  libyuv::ARGBToI420((const uint8_t*)resource.pData, resource.RowPitch,
+                     i420_buffer->MutableDataY(), i420_buffer->StrideY(),
+                     i420_buffer->MutableDataU(), i420_buffer->StrideU(),
+                     i420_buffer->MutableDataV(), i420_buffer->StrideV(),
+                     width_, height_);
+  context->Unmap(staging.Get(), 0);
+  return i420_buffer;
+}
+
+ID3D11Texture2D* D3D11TextureBuffer::texture() const {
+  return texture_.Get();
+}
+
+HANDLE D3D11TextureBuffer::shared_handle() const {
+  return shared_handle_;
+}
+
+const LUID& D3D11TextureBuffer::adapter_luid() const {
+  return adapter_luid_;
+}
+
+void D3D11TextureBuffer::SetSize(int width, int height) {
+  width_ = width;
+  height_ = height;
+}
+
+}  // namespace sora
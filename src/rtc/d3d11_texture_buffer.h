@@ -0,0 +1,66 @@
+#ifndef SORA_D3D11_TEXTURE_BUFFER_H_
+#define SORA_D3D11_TEXTURE_BUFFER_H_
+
+#include <d3d11.h>
+#include <wrl.h>
+
+#include <mutex>
+
+#include "api/video/video_frame_buffer.h"
+#include "rtc_base/ref_counted_object.h"
+
+namespace sora {
+
+// ToI420 でテクスチャを読み出すためのデバイス。
+// Unity のデバイスコンテキストは Unity のレンダースレッド以外から触れないので、
+// adapter_luid のアダプタに読み出し用のデバイスを別に作って使い回す。
+// 返した lock を持っている間だけ device と context を使うこと。
+std::unique_lock<std::mutex> GetReadbackDevice(const LUID& adapter_luid,
+                                               ID3D11Device** device,
+                                               ID3D11DeviceContext** context);
+
+// Unity のデバイス上にある BGRA テクスチャを持つ VideoFrameBuffer。
+// テクスチャは D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX で作られていて、
+// エンコーダは共有ハンドルから別のデバイスで開いて直接読み込む。
+// 書き込み側も読み込み側もキー 0 で AcquireSync/ReleaseSync する。
+class D3D11TextureBuffer : public webrtc::VideoFrameBuffer {
+ public:
+  // 書き込み側がテクスチャを使い回せるか HasOneRef() で調べられるように
+  // RefCountedObject のまま返す
+  static rtc::scoped_refptr<rtc::RefCountedObject<D3D11TextureBuffer>> Create(
+      Microsoft::WRL::ComPtr<ID3D11Texture2D> texture);
+
+  Type type() const override;
+  int width() const override;
+  int height() const override;
+  // テクスチャに対応していないエンコーダ向け。
+  // 同じアダプタに自前のデバイスを作って読み出すので遅い。
+  rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+
+  ID3D11Texture2D* texture() const;
+  HANDLE shared_handle() const;
+  const LUID& adapter_luid() const;
+
+  // テクスチャの左上 width x height だけを使う。
+  // 書き込み側が HasOneRef() を確認してから、テクスチャに書き込む時に呼ぶこと。
+  void SetSize(int width, int height);
+
+ protected:
+  D3D11TextureBuffer(Microsoft::WRL::ComPtr<ID3D11Texture2D> texture,
+                     HANDLE shared_handle,
+                     LUID adapter_luid,
+                     int width,
+                     int height);
+  ~D3D11TextureBuffer() override;
+
+ private:
+  const Microsoft::WRL::ComPtr<ID3D11Texture2D> texture_;
+  const HANDLE shared_handle_;
+  const LUID adapter_luid_;
+  int width_;
+  int height_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_D3D11_TEXTURE_BUFFER_H_
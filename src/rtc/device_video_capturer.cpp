@@ -11,12 +11,70 @@
 #include "device_video_capturer.h"
 
 #include <stdint.h>
+#include <algorithm>
+#include <cstdlib>
 #include <memory>
+#include <tuple>
 
 #include "modules/video_capture/video_capture_factory.h"
 #include "rtc_base/checks.h"
 #include "rtc_base/logging.h"
 
+namespace {
+
+// VideoCaptureModule は受け取ったフレームを必ず I420 に変換するので、
+// その変換が軽い形式ほど小さい値にする
+int FormatCost(webrtc::VideoType type) {
+  switch (type) {
+    case webrtc::VideoType::kI420:
+    case webrtc::VideoType::kIYUV:
+    case webrtc::VideoType::kYV12:
+    case webrtc::VideoType::kNV12:
+    case webrtc::VideoType::kNV21:
+      return 0;
+    case webrtc::VideoType::kYUY2:
+    case webrtc::VideoType::kUYVY:
+      return 1;
+    case webrtc::VideoType::kMJPEG:
+      return 2;
+    case webrtc::VideoType::kUnknown:
+      return 4;
+    default:
+      return 3;
+  }
+}
+
+// 解像度が一番近いものの中から、要求したフレームレートを出せて、
+// 変換が軽い形式を選ぶ
+bool SelectCapability(webrtc::VideoCaptureModule::DeviceInfo* device_info,
+                      const char* unique_name,
+                      int width,
+                      int height,
+                      int target_fps,
+                      webrtc::VideoCaptureCapability* result) {
+  int count = device_info->NumberOfCapabilities(unique_name);
+  bool found = false;
+  std::tuple<int, bool, int, int> best;
+  for (int i = 0; i < count; i++) {
+    webrtc::VideoCaptureCapability cap;
+    if (device_info->GetCapability(unique_name, i, cap) != 0) {
+      continue;
+    }
+    auto score = std::make_tuple(
+        std::abs(cap.width - width) + std::abs(cap.height - height),
+        cap.maxFPS < target_fps, FormatCost(cap.videoType),
+        std::abs(cap.maxFPS - target_fps));
+    if (!found || score < best) {
+      *result = cap;
+      best = score;
+      found = true;
+    }
+  }
+  return found;
+}
+
+}  // namespace
+
 namespace sora {
 
 DeviceVideoCapturer::DeviceVideoCapturer() : vcm_(nullptr) {}
@@ -47,12 +105,24 @@ bool DeviceVideoCapturer::Init(size_t width,
   }
   vcm_->RegisterCaptureDataCallback(this);
 
-  device_info->GetCapability(vcm_->CurrentDeviceName(), 0, capability_);
-
-  capability_.width = static_cast<int32_t>(width);
-  capability_.height = static_cast<int32_t>(height);
-  capability_.maxFPS = static_cast<int32_t>(target_fps);
-  capability_.videoType = webrtc::VideoType::kI420;
+  if (SelectCapability(device_info.get(), vcm_->CurrentDeviceName(),
+                       (int)width, (int)height, (int)target_fps,
+                       &capability_)) {
+    RTC_LOG(LS_INFO) << "Selected capability: width=" << capability_.width
+                     << " height=" << capability_.height
+                     << " max_fps=" << capability_.maxFPS
+                     << " video_type=" << (int)capability_.videoType;
+    // 要求より速いフレームレートを出せる場合は、要求したフレームレートで取り出す
+    capability_.maxFPS =
+        std::min(capability_.maxFPS, static_cast<int32_t>(target_fps));
+  } else {
+    // 形式を列挙できない場合は今まで通り要求した値をそのまま使う
+    device_info->GetCapability(vcm_->CurrentDeviceName(), 0, capability_);
+    capability_.width = static_cast<int32_t>(width);
+    capability_.height = static_cast<int32_t>(height);
+    capability_.maxFPS = static_cast<int32_t>(target_fps);
+    capability_.videoType = webrtc::VideoType::kI420;
+  }
 
   if (vcm_->StartCapture(capability_) != 0) {
     Destroy();
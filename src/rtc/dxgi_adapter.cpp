@@ -0,0 +1,124 @@
+#include "dxgi_adapter.h"
+
+#include <stdlib.h>
+
+#include "rtc_base/logging.h"
+
+using Microsoft::WRL::ComPtr;
+
+namespace sora {
+
+bool IsSameAdapterLuid(const LUID& a, const LUID& b) {
+  return a.LowPart == b.LowPart && a.HighPart == b.HighPart;
+}
+
+ComPtr<IDXGIAdapter> FindAdapter(const LUID& adapter_luid) {
+  ComPtr<IDXGIFactory1> factory;
+  HRESULT hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1),
+                                  (void**)factory.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "CreateDXGIFactory1 is failed: hr=" << hr;
+    return nullptr;
+  }
+  ComPtr<IDXGIAdapter> adapter;
+  for (UINT i = 0; factory->EnumAdapters(i, adapter.ReleaseAndGetAddressOf()) !=
+                   DXGI_ERROR_NOT_FOUND;
+       i++) {
+    DXGI_ADAPTER_DESC desc;
+    if (SUCCEEDED(adapter->GetDesc(&desc)) &&
+        IsSameAdapterLuid(desc.AdapterLuid, adapter_luid)) {
+      return adapter;
+    }
+  }
+  return nullptr;
+}
+
+bool GetAdapterLuid(int index, LUID* adapter_luid) {
+  ComPtr<IDXGIFactory1> factory;
+  HRESULT hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1),
+                                  (void**)factory.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "CreateDXGIFactory1 is failed: hr=" << hr;
+    return false;
+  }
+  ComPtr<IDXGIAdapter> adapter;
+  hr = factory->EnumAdapters(index, adapter.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "IDXGIFactory1::EnumAdapters is failed: index="
+                      << index << " hr=" << hr;
+    return false;
+  }
+  DXGI_ADAPTER_DESC desc;
+  if (!SUCCEEDED(adapter->GetDesc(&desc))) {
+    return false;
+  }
+  *adapter_luid = desc.AdapterLuid;
+  return true;
+}
+
+bool GetAdapterLuid(ID3D11Device* device, LUID* adapter_luid) {
+  ComPtr<IDXGIDevice> dxgi_device;
+  ComPtr<IDXGIAdapter> dxgi_adapter;
+  DXGI_ADAPTER_DESC desc;
+  if (device == nullptr ||
+      !SUCCEEDED(device->QueryInterface(__uuidof(IDXGIDevice),
+                                        (void**)dxgi_device.GetAddressOf())) ||
+      !SUCCEEDED(dxgi_device->GetAdapter(dxgi_adapter.GetAddressOf())) ||
+      !SUCCEEDED(dxgi_adapter->GetDesc(&desc))) {
+    return false;
+  }
+  *adapter_luid = desc.AdapterLuid;
+  return true;
+}
+
+bool GetAdapterVendorId(const LUID& adapter_luid, UINT* vendor_id) {
+  ComPtr<IDXGIAdapter> adapter = FindAdapter(adapter_luid);
+  DXGI_ADAPTER_DESC desc;
+  if (adapter == nullptr || !SUCCEEDED(adapter->GetDesc(&desc))) {
+    return false;
+  }
+  *vendor_id = desc.VendorId;
+  return true;
+}
+
+bool FindAdapterLuidByVendor(UINT vendor_id,
+                             const LUID& preferred_luid,
+                             LUID* adapter_luid) {
+  UINT preferred_vendor_id = 0;
+  if (GetAdapterVendorId(preferred_luid, &preferred_vendor_id) &&
+      preferred_vendor_id == vendor_id) {
+    *adapter_luid = preferred_luid;
+    return true;
+  }
+  ComPtr<IDXGIFactory1> factory;
+  HRESULT hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1),
+                                  (void**)factory.GetAddressOf());
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "CreateDXGIFactory1 is failed: hr=" << hr;
+    return false;
+  }
+  ComPtr<IDXGIAdapter> adapter;
+  for (UINT i = 0; factory->EnumAdapters(i, adapter.ReleaseAndGetAddressOf()) !=
+                   DXGI_ERROR_NOT_FOUND;
+       i++) {
+    DXGI_ADAPTER_DESC desc;
+    if (SUCCEEDED(adapter->GetDesc(&desc)) && desc.VendorId == vendor_id) {
+      *adapter_luid = desc.AdapterLuid;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string GetAdapterName(IDXGIAdapter* adapter) {
+  DXGI_ADAPTER_DESC desc;
+  if (!SUCCEEDED(adapter->GetDesc(&desc))) {
+    return "";
+  }
+  char name[128];
+  size_t result = 0;
+  wcstombs_s(&result, name, desc.Description, sizeof(name));
+  return name;
+}
+
+}  // namespace sora
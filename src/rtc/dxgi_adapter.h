@@ -0,0 +1,39 @@
+#ifndef SORA_DXGI_ADAPTER_H_
+#define SORA_DXGI_ADAPTER_H_
+
+#include <d3d11.h>
+#include <dxgi.h>
+#include <wrl.h>
+
+#include <string>
+
+namespace sora {
+
+// Unity と同じ GPU でエンコードやデコードをするために、
+// アダプタを LUID で受け渡すためのユーティリティ
+
+bool IsSameAdapterLuid(const LUID& a, const LUID& b);
+
+// adapter_luid のアダプタを探す。見つからなければ nullptr
+Microsoft::WRL::ComPtr<IDXGIAdapter> FindAdapter(const LUID& adapter_luid);
+
+// IDXGIFactory1::EnumAdapters で index 番目のアダプタの LUID を返す
+bool GetAdapterLuid(int index, LUID* adapter_luid);
+
+// device が作られたアダプタの LUID を返す
+bool GetAdapterLuid(ID3D11Device* device, LUID* adapter_luid);
+
+// adapter_luid のアダプタのベンダー ID を返す
+bool GetAdapterVendorId(const LUID& adapter_luid, UINT* vendor_id);
+
+// vendor_id のアダプタを探す。preferred_luid がそのベンダーならそれを優先する
+bool FindAdapterLuidByVendor(UINT vendor_id,
+                             const LUID& preferred_luid,
+                             LUID* adapter_luid);
+
+// ログ用のアダプタ名
+std::string GetAdapterName(IDXGIAdapter* adapter);
+
+}  // namespace sora
+
+#endif  // SORA_DXGI_ADAPTER_H_
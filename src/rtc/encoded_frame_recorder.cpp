@@ -0,0 +1,282 @@
+#include "encoded_frame_recorder.h"
+
+#include <string.h>
+
+// WebRTC
+#include <rtc_base/logging.h>
+#include <rtc_base/ref_counted_object.h>
+
+namespace sora {
+
+namespace {
+
+// 受け取ったフレームを recorder に書き出してから、そのまま次の処理に渡す
+class RecordingFrameTransformer : public webrtc::FrameTransformerInterface {
+ public:
+  RecordingFrameTransformer(std::shared_ptr<EncodedFrameRecorder> recorder,
+                            std::string direction)
+      : recorder_(std::move(recorder)), direction_(std::move(direction)) {}
+
+  void Transform(
+      std::unique_ptr<webrtc::TransformableFrameInterface> frame) override {
+    auto video_frame =
+        static_cast<webrtc::TransformableVideoFrameInterface*>(frame.get());
+    recorder_->Write(direction_, frame->GetSsrc(), frame->GetTimestamp(),
+                     video_frame->IsKeyFrame(), frame->GetData());
+
+    rtc::scoped_refptr<webrtc::TransformedFrameCallback> callback;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = sink_callbacks_.find(frame->GetSsrc());
+      callback = it != sink_callbacks_.end() ? it->second : callback_;
+    }
+    if (callback) {
+      callback->OnTransformedFrame(std::move(frame));
+    }
+  }
+
+  void RegisterTransformedFrameCallback(
+      rtc::scoped_refptr<webrtc::TransformedFrameCallback> callback) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    callback_ = callback;
+  }
+  // simulcast の場合はレイヤーごとに別の ssrc で登録される
+  void RegisterTransformedFrameSinkCallback(
+      rtc::scoped_refptr<webrtc::TransformedFrameCallback> callback,
+      uint32_t ssrc) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    sink_callbacks_[ssrc] = callback;
+  }
+  void UnregisterTransformedFrameCallback() override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    callback_ = nullptr;
+  }
+  void UnregisterTransformedFrameSinkCallback(uint32_t ssrc) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    sink_callbacks_.erase(ssrc);
+  }
+
+ private:
+  std::shared_ptr<EncodedFrameRecorder> recorder_;
+  std::string direction_;
+  std::mutex mutex_;
+  rtc::scoped_refptr<webrtc::TransformedFrameCallback> callback_;
+  std::map<uint32_t, rtc::scoped_refptr<webrtc::TransformedFrameCallback>>
+      sink_callbacks_;
+};
+
+void WriteLE16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+void WriteLE32(uint8_t* p, uint32_t v) {
+  WriteLE16(p, v & 0xffff);
+  WriteLE16(p + 2, (v >> 16) & 0xffff);
+}
+void WriteLE64(uint8_t* p, uint64_t v) {
+  WriteLE32(p, v & 0xffffffff);
+  WriteLE32(p + 4, (v >> 32) & 0xffffffff);
+}
+
+const char* GetIvfFourcc(const std::string& codec) {
+  if (codec == "VP8") {
+    return "VP80";
+  } else if (codec == "VP9") {
+    return "VP90";
+  } else if (codec == "AV1") {
+    return "AV01";
+  } else if (codec == "H264") {
+    return "H264";
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+std::shared_ptr<EncodedFrameRecorder> EncodedFrameRecorder::Create(
+    std::string directory,
+    std::string codec,
+    size_t max_buffer_bytes) {
+  if (GetIvfFourcc(codec) == nullptr) {
+    RTC_LOG(LS_ERROR) << "Recording is not supported: codec=" << codec;
+    return nullptr;
+  }
+  std::shared_ptr<EncodedFrameRecorder> p(new EncodedFrameRecorder(
+      std::move(directory), std::move(codec), max_buffer_bytes));
+  p->thread_ = std::thread([p = p.get()]() { p->Run(); });
+  return p;
+}
+
+EncodedFrameRecorder::EncodedFrameRecorder(std::string directory,
+                                           std::string codec,
+                                           size_t max_buffer_bytes)
+    : directory_(std::move(directory)),
+      codec_(std::move(codec)),
+      max_buffer_bytes_(max_buffer_bytes) {}
+
+EncodedFrameRecorder::~EncodedFrameRecorder() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopped_ = true;
+  }
+  cond_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  RTC_LOG(LS_INFO) << "Recording finished: dropped_frames=" << dropped_frames_;
+}
+
+rtc::scoped_refptr<webrtc::FrameTransformerInterface>
+EncodedFrameRecorder::CreateTransformer(std::string direction) {
+  return new rtc::RefCountedObject<RecordingFrameTransformer>(
+      shared_from_this(), std::move(direction));
+}
+
+void EncodedFrameRecorder::Write(const std::string& direction,
+                                 uint32_t ssrc,
+                                 uint32_t rtp_timestamp,
+                                 bool key_frame,
+                                 rtc::ArrayView<const uint8_t> data) {
+  if (data.empty()) {
+    return;
+  }
+  std::string name = direction + "_" + std::to_string(ssrc);
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (stopped_) {
+      return;
+    }
+    auto it = streams_.find(name);
+    bool first = it == streams_.end();
+    StreamState& stream = streams_[name];
+    // キーフレームが無いと後ろのフレームをデコードできないので、最初と捨てた後は待つ
+    if (stream.waiting_key_frame && !key_frame) {
+      dropped_frames_++;
+      return;
+    }
+    if (queued_bytes_ + data.size() > max_buffer_bytes_) {
+      if (!stream.waiting_key_frame) {
+        RTC_LOG(LS_WARNING) << "Recording buffer is full, dropping frames: "
+                            << name;
+      }
+      stream.waiting_key_frame = true;
+      dropped_frames_++;
+      return;
+    }
+    stream.waiting_key_frame = false;
+    // RTP のタイムスタンプは 32 ビットで一周するので、最初のフレームを 0 として伸ばす
+    if (!first) {
+      stream.unwrapped_timestamp +=
+          (int32_t)(rtp_timestamp - stream.last_rtp_timestamp);
+    }
+    stream.last_rtp_timestamp = rtp_timestamp;
+
+    Frame frame;
+    frame.name = std::move(name);
+    frame.timestamp = stream.unwrapped_timestamp;
+    frame.data.SetData(data.data(), data.size());
+    queued_bytes_ += data.size();
+    queue_.push_back(std::move(frame));
+    queue_memory_.Set(queued_bytes_, queue_.size());
+  }
+  cond_.notify_one();
+}
+
+uint64_t EncodedFrameRecorder::dropped_frames() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return dropped_frames_;
+}
+
+void EncodedFrameRecorder::Run() {
+  RTC_LOG(LS_INFO) << "Recording started: directory=" << directory_
+                   << " codec=" << codec_;
+  std::deque<Frame> frames;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this]() { return stopped_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      break;
+    }
+    // キューごと取り出して、ロックの外で書き込む
+    frames.swap(queue_);
+    lock.unlock();
+
+    size_t written_bytes = 0;
+    for (Frame& frame : frames) {
+      written_bytes += frame.data.size();
+      auto it = files_.find(frame.name);
+      if (it == files_.end()) {
+        File file;
+        file.fp = OpenFile(frame.name);
+        it = files_.insert(std::make_pair(frame.name, file)).first;
+      }
+      File& file = it->second;
+      if (file.fp == nullptr) {
+        continue;
+      }
+      uint8_t header[12];
+      WriteLE32(header, (uint32_t)frame.data.size());
+      WriteLE64(header + 4, (uint64_t)frame.timestamp);
+      if (fwrite(header, sizeof(header), 1, file.fp) != 1 ||
+          fwrite(frame.data.data(), frame.data.size(), 1, file.fp) != 1) {
+        RTC_LOG(LS_ERROR) << "Failed to write recording: " << frame.name;
+        CloseFile(file);
+        continue;
+      }
+      file.frame_count++;
+    }
+    frames.clear();
+
+    lock.lock();
+    queued_bytes_ -= written_bytes;
+    queue_memory_.Set(queued_bytes_, queue_.size());
+  }
+  lock.unlock();
+
+  for (auto& kv : files_) {
+    CloseFile(kv.second);
+  }
+  files_.clear();
+}
+
+FILE* EncodedFrameRecorder::OpenFile(const std::string& name) {
+  std::string path = directory_ + "/" + name + ".ivf";
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) {
+    RTC_LOG(LS_ERROR) << "Failed to open recording file: " << path;
+    return nullptr;
+  }
+  // 解像度はビットストリームから分かるので 0 にしておく。
+  // タイムスタンプは RTP と同じ 90kHz にする
+  uint8_t header[32] = {};
+  memcpy(header, "DKIF", 4);
+  WriteLE16(header + 4, 0);
+  WriteLE16(header + 6, sizeof(header));
+  memcpy(header + 8, GetIvfFourcc(codec_), 4);
+  WriteLE32(header + 16, 90000);
+  WriteLE32(header + 20, 1);
+  if (fwrite(header, sizeof(header), 1, fp) != 1) {
+    RTC_LOG(LS_ERROR) << "Failed to write recording file: " << path;
+    fclose(fp);
+    return nullptr;
+  }
+  RTC_LOG(LS_INFO) << "Recording to " << path;
+  return fp;
+}
+
+void EncodedFrameRecorder::CloseFile(File& file) {
+  if (file.fp == nullptr) {
+    return;
+  }
+  // ヘッダのフレーム数を書き換える
+  uint8_t count[4];
+  WriteLE32(count, file.frame_count);
+  if (fseek(file.fp, 24, SEEK_SET) == 0) {
+    fwrite(count, sizeof(count), 1, file.fp);
+  }
+  fclose(file.fp);
+  file.fp = nullptr;
+}
+
+}  // namespace sora
@@ -0,0 +1,95 @@
+#ifndef SORA_RTC_ENCODED_FRAME_RECORDER_H_
+#define SORA_RTC_ENCODED_FRAME_RECORDER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// WebRTC
+#include <api/array_view.h>
+#include <api/frame_transformer_interface.h>
+#include <rtc_base/buffer.h>
+
+#include "../memory_stats.h"
+
+namespace sora {
+
+// エンコード済みの映像フレームを、再エンコードせずにストリームごとの IVF ファイルに書き出す。
+// ファイルへの書き込みは専用のスレッドで行い、書き込み待ちが max_buffer_bytes を超えた場合は
+// そのストリームのフレームを次のキーフレームまで捨てる
+class EncodedFrameRecorder
+    : public std::enable_shared_from_this<EncodedFrameRecorder> {
+ public:
+  // codec は "VP8", "VP9", "AV1", "H264" のどれか
+  static std::shared_ptr<EncodedFrameRecorder> Create(std::string directory,
+                                                      std::string codec,
+                                                      size_t max_buffer_bytes);
+  ~EncodedFrameRecorder();
+
+  // 送信側はエンコーダの後、受信側はデコーダの前にフレームを書き出す FrameTransformer を作る。
+  // direction はファイル名に使う
+  rtc::scoped_refptr<webrtc::FrameTransformerInterface> CreateTransformer(
+      std::string direction);
+
+  // どのスレッドから呼んでもいい
+  void Write(const std::string& direction,
+             uint32_t ssrc,
+             uint32_t rtp_timestamp,
+             bool key_frame,
+             rtc::ArrayView<const uint8_t> data);
+
+  // 書き込みが間に合わずに捨てたフレーム数
+  uint64_t dropped_frames() const;
+
+ private:
+  EncodedFrameRecorder(std::string directory,
+                       std::string codec,
+                       size_t max_buffer_bytes);
+  void Run();
+
+  // Write を呼ぶスレッドで持つストリームの状態
+  struct StreamState {
+    bool waiting_key_frame = true;
+    uint32_t last_rtp_timestamp = 0;
+    int64_t unwrapped_timestamp = 0;
+  };
+  struct Frame {
+    std::string name;
+    int64_t timestamp;
+    rtc::Buffer data;
+  };
+  // 書き込みスレッドで持つファイル
+  struct File {
+    FILE* fp = nullptr;
+    uint32_t frame_count = 0;
+  };
+  FILE* OpenFile(const std::string& name);
+  void CloseFile(File& file);
+
+  const std::string directory_;
+  const std::string codec_;
+  const size_t max_buffer_bytes_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stopped_ = false;
+  std::map<std::string, StreamState> streams_;
+  std::deque<Frame> queue_;
+  size_t queued_bytes_ = 0;
+  uint64_t dropped_frames_ = 0;
+  TrackedMemory queue_memory_{MemoryCategory::kRecordingQueue};
+
+  std::map<std::string, File> files_;
+  std::thread thread_;
+};
+
+}  // namespace sora
+
+#endif
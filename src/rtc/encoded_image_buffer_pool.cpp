@@ -0,0 +1,56 @@
+#include "encoded_image_buffer_pool.h"
+
+#include "rtc_base/logging.h"
+
+namespace sora {
+
+const uint8_t* PooledEncodedImageBuffer::data() const {
+  return data_.get();
+}
+uint8_t* PooledEncodedImageBuffer::data() {
+  return data_.get();
+}
+size_t PooledEncodedImageBuffer::size() const {
+  return size_;
+}
+
+void PooledEncodedImageBuffer::Resize(size_t size) {
+  if (size > capacity_) {
+    // ビットレートが少し上がっただけで確保し直さないように余裕を持たせておく
+    capacity_ = size + size / 2;
+    data_.reset(new uint8_t[capacity_]);
+  }
+  size_ = size;
+}
+
+EncodedImageBufferPool::EncodedImageBufferPool(size_t max_number_of_buffers)
+    : max_number_of_buffers_(max_number_of_buffers) {}
+
+rtc::scoped_refptr<PooledEncodedImageBuffer> EncodedImageBufferPool::Create(
+    size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  rtc::scoped_refptr<Buffer> buffer;
+  for (auto& b : buffers_) {
+    if (b->HasOneRef()) {
+      buffer = b;
+      break;
+    }
+  }
+  if (buffer == nullptr) {
+    if (buffers_.size() >= max_number_of_buffers_) {
+      RTC_LOG(LS_WARNING) << "EncodedImageBufferPool: too many buffers";
+      return nullptr;
+    }
+    buffer = new Buffer();
+    buffers_.push_back(buffer);
+  }
+  buffer->Resize(size);
+  return buffer;
+}
+
+void EncodedImageBufferPool::Release() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffers_.clear();
+}
+
+}  // namespace sora
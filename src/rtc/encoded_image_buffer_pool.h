@@ -0,0 +1,54 @@
+#ifndef SORA_ENCODED_IMAGE_BUFFER_POOL_H_
+#define SORA_ENCODED_IMAGE_BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "api/video/encoded_image.h"
+#include "rtc_base/ref_counted_object.h"
+
+namespace sora {
+
+// エンコード結果を入れるバッファ。
+// 確保済みの領域より小さいサイズであればメモリを確保し直さない。
+class PooledEncodedImageBuffer : public webrtc::EncodedImageBufferInterface {
+ public:
+  const uint8_t* data() const override;
+  uint8_t* data() override;
+  size_t size() const override;
+
+  // 中身は保持しない
+  void Resize(size_t size);
+
+ private:
+  std::unique_ptr<uint8_t[]> data_;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+};
+
+// エンコーダから誰も参照しなくなったバッファを使い回すためのプール。
+// エンコード済みのフレームは送信側で保持されることがあるので、
+// プールからしか参照されていないバッファだけを再利用する。
+class EncodedImageBufferPool {
+ public:
+  explicit EncodedImageBufferPool(size_t max_number_of_buffers);
+
+  // 使えるバッファが無くて、これ以上作れない場合は nullptr を返す
+  rtc::scoped_refptr<PooledEncodedImageBuffer> Create(size_t size);
+  void Release();
+
+ private:
+  const size_t max_number_of_buffers_;
+  std::mutex mutex_;
+  typedef rtc::RefCountedObject<PooledEncodedImageBuffer> Buffer;
+  std::vector<rtc::scoped_refptr<Buffer>> buffers_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_ENCODED_IMAGE_BUFFER_POOL_H_
@@ -0,0 +1,169 @@
+#include "encoded_video_track_source.h"
+
+#include <string.h>
+
+#include "api/video/video_frame.h"
+#include "rtc_base/logging.h"
+#include "rtc_base/ref_counted_object.h"
+#include "rtc_base/time_utils.h"
+
+#include "log_rate_limiter.h"
+
+namespace sora {
+
+rtc::scoped_refptr<EncodedFrameBuffer> EncodedFrameBuffer::Create(
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+    int width,
+    int height,
+    bool is_key_frame,
+    uint64_t sequence,
+    rtc::scoped_refptr<EncodedVideoTrackSource> source) {
+  return new rtc::RefCountedObject<EncodedFrameBuffer>(
+      std::move(data), width, height, is_key_frame, sequence,
+      std::move(source));
+}
+
+EncodedFrameBuffer::EncodedFrameBuffer(
+    rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+    int width,
+    int height,
+    bool is_key_frame,
+    uint64_t sequence,
+    rtc::scoped_refptr<EncodedVideoTrackSource> source)
+    : data_(std::move(data)),
+      width_(width),
+      height_(height),
+      is_key_frame_(is_key_frame),
+      sequence_(sequence),
+      source_(std::move(source)) {}
+
+webrtc::VideoFrameBuffer::Type EncodedFrameBuffer::type() const {
+  return Type::kNative;
+}
+
+int EncodedFrameBuffer::width() const {
+  return width_;
+}
+
+int EncodedFrameBuffer::height() const {
+  return height_;
+}
+
+rtc::scoped_refptr<webrtc::I420BufferInterface> EncodedFrameBuffer::ToI420() {
+  SORA_LOG_RATE_LIMITED(LS_ERROR, 10000)
+      << "EncodedFrameBuffer cannot be converted to I420";
+  return nullptr;
+}
+
+rtc::scoped_refptr<webrtc::EncodedImageBufferInterface>
+EncodedFrameBuffer::data() const {
+  return data_;
+}
+
+bool EncodedFrameBuffer::is_key_frame() const {
+  return is_key_frame_;
+}
+
+uint64_t EncodedFrameBuffer::sequence() const {
+  return sequence_;
+}
+
+void EncodedFrameBuffer::RequestKeyFrame() {
+  source_->RequestKeyFrame();
+}
+
+rtc::scoped_refptr<EncodedVideoTrackSource> EncodedVideoTrackSource::Create(
+    int width,
+    int height) {
+  return new rtc::RefCountedObject<EncodedVideoTrackSource>(width, height);
+}
+
+EncodedVideoTrackSource::EncodedVideoTrackSource(int width, int height)
+    : AdaptedVideoTrackSource(1), width_(width), height_(height) {}
+
+bool EncodedVideoTrackSource::is_screencast() const {
+  return false;
+}
+
+absl::optional<bool> EncodedVideoTrackSource::needs_denoising() const {
+  return false;
+}
+
+webrtc::MediaSourceInterface::SourceState EncodedVideoTrackSource::state()
+    const {
+  return SourceState::kLive;
+}
+
+bool EncodedVideoTrackSource::remote() const {
+  return false;
+}
+
+bool EncodedVideoTrackSource::PushEncodedFrame(const uint8_t* data,
+                                               size_t size,
+                                               int64_t timestamp_us,
+                                               bool is_key_frame) {
+  if (data == nullptr || size == 0) {
+    return false;
+  }
+  // キーフレームが来るまでは差分のフレームを送ってもデコードできないので、受け取る前に要求しておく
+  if (!is_key_frame && !received_key_frame_) {
+    RequestKeyFrame();
+    return false;
+  }
+
+  auto buffer = buffer_pool_.Create(size);
+  if (!buffer) {
+    // 送信が詰まっている。このフレームを捨てると以降の差分のフレームがデコードできなくなる
+    SORA_LOG_RATE_LIMITED(LS_WARNING, 1000)
+        << "No encoded frame buffer available, request key frame";
+    received_key_frame_ = false;
+    RequestKeyFrame();
+    return false;
+  }
+  memcpy(buffer->data(), data, size);
+
+  if (is_key_frame) {
+    received_key_frame_ = true;
+    key_frame_requested_at_ms_.store(-1);
+  }
+
+  const int64_t translated_timestamp_us =
+      timestamp_aligner_.TranslateTimestamp(timestamp_us, rtc::TimeMicros());
+  // AdaptFrame は使わずに、全てのフレームをそのまま流す
+  OnFrame(webrtc::VideoFrame::Builder()
+              .set_video_frame_buffer(EncodedFrameBuffer::Create(
+                  buffer, width_, height_, is_key_frame, next_sequence_++,
+                  this))
+              .set_rotation(webrtc::kVideoRotation_0)
+              .set_timestamp_us(translated_timestamp_us)
+              .build());
+  return true;
+}
+
+void EncodedVideoTrackSource::SetOnKeyFrameRequest(
+    std::function<void()> on_key_frame_request) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  on_key_frame_request_ = std::move(on_key_frame_request);
+}
+
+void EncodedVideoTrackSource::RequestKeyFrame() {
+  // 要求してからしばらく経ってもキーフレームが来なければ、もう一度要求する
+  int64_t now_ms = rtc::TimeMillis();
+  int64_t requested_at_ms = key_frame_requested_at_ms_.load();
+  if (requested_at_ms >= 0 &&
+      now_ms - requested_at_ms < kKeyFrameRequestIntervalMs) {
+    return;
+  }
+  if (!key_frame_requested_at_ms_.compare_exchange_strong(requested_at_ms,
+                                                          now_ms)) {
+    return;
+  }
+  RTC_LOG(LS_INFO) << "Key frame requested"
+                   << (requested_at_ms >= 0 ? " again" : "");
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (on_key_frame_request_) {
+    on_key_frame_request_();
+  }
+}
+
+}  // namespace sora
@@ -0,0 +1,116 @@
+#ifndef SORA_ENCODED_VIDEO_TRACK_SOURCE_H_
+#define SORA_ENCODED_VIDEO_TRACK_SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+#include "api/scoped_refptr.h"
+#include "api/video/encoded_image.h"
+#include "api/video/video_frame_buffer.h"
+#include "media/base/adapted_video_track_source.h"
+#include "rtc_base/timestamp_aligner.h"
+
+#include "encoded_image_buffer_pool.h"
+
+namespace sora {
+
+class EncodedVideoTrackSource;
+
+// アプリがエンコードした H.264 のフレームを、VideoFrame に載せてエンコーダまで運ぶためのバッファ。
+// PassThroughVideoEncoder がこれを受け取ると、エンコードせずにそのまま送信する。
+// 中身はエンコード済みのデータなので ToI420 はできない
+class EncodedFrameBuffer : public webrtc::VideoFrameBuffer {
+ public:
+  static rtc::scoped_refptr<EncodedFrameBuffer> Create(
+      rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+      int width,
+      int height,
+      bool is_key_frame,
+      uint64_t sequence,
+      rtc::scoped_refptr<EncodedVideoTrackSource> source);
+
+  Type type() const override;
+  int width() const override;
+  int height() const override;
+  rtc::scoped_refptr<webrtc::I420BufferInterface> ToI420() override;
+
+  rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data() const;
+  bool is_key_frame() const;
+  // EncodedVideoTrackSource が流したフレームの通し番号。1 から始まる。
+  // エンコーダに届くまでに間引かれたフレームがあるかどうかはこれで調べる
+  uint64_t sequence() const;
+  // エンコーダがキーフレームを要求された時に呼ぶ
+  void RequestKeyFrame();
+
+ protected:
+  EncodedFrameBuffer(
+      rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data,
+      int width,
+      int height,
+      bool is_key_frame,
+      uint64_t sequence,
+      rtc::scoped_refptr<EncodedVideoTrackSource> source);
+
+ private:
+  const rtc::scoped_refptr<webrtc::EncodedImageBufferInterface> data_;
+  const int width_;
+  const int height_;
+  const bool is_key_frame_;
+  const uint64_t sequence_;
+  const rtc::scoped_refptr<EncodedVideoTrackSource> source_;
+};
+
+// アプリからエンコード済みのフレームを受け取って送信するための VideoTrackSource。
+// 解像度やフレームレートの調整はできないので、受け取ったフレームは全てそのまま流す。
+class EncodedVideoTrackSource : public rtc::AdaptedVideoTrackSource {
+ public:
+  // width, height は SDP や送信時の解像度として使う。実際のストリームと合わせること
+  static rtc::scoped_refptr<EncodedVideoTrackSource> Create(int width,
+                                                           int height);
+
+  bool is_screencast() const override;
+  absl::optional<bool> needs_denoising() const override;
+  webrtc::MediaSourceInterface::SourceState state() const override;
+  bool remote() const override;
+
+  // data は Annex B 形式の H.264 のアクセスユニット。
+  // キーフレームには SPS と PPS を含めること
+  bool PushEncodedFrame(const uint8_t* data,
+                        size_t size,
+                        int64_t timestamp_us,
+                        bool is_key_frame);
+
+  // キーフレームが要求された時に呼ばれる。
+  // 次のキーフレームを受け取るまでは、何度要求されても kKeyFrameRequestIntervalMs に 1 回しか呼ばない。
+  // アプリが要求を取りこぼしても、キーフレームが来なければまた呼ぶ。
+  // エンコーダのスレッドから呼ばれる
+  void SetOnKeyFrameRequest(std::function<void()> on_key_frame_request);
+  void RequestKeyFrame();
+
+ protected:
+  EncodedVideoTrackSource(int width, int height);
+
+ private:
+  static const int64_t kKeyFrameRequestIntervalMs = 1000;
+
+  const int width_;
+  const int height_;
+  rtc::TimestampAligner timestamp_aligner_;
+  EncodedImageBufferPool buffer_pool_{16};
+  // PushEncodedFrame からしか触らない
+  bool received_key_frame_ = false;
+  uint64_t next_sequence_ = 1;
+
+  std::mutex mutex_;
+  std::function<void()> on_key_frame_request_;
+  // 最後にキーフレームを要求した時刻。要求していない場合は -1
+  std::atomic<int64_t> key_frame_requested_at_ms_{-1};
+};
+
+}  // namespace sora
+
+#endif  // SORA_ENCODED_VIDEO_TRACK_SOURCE_H_
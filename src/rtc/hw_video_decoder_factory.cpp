@@ -12,6 +12,7 @@
 
 #include "absl/strings/match.h"
 #include "api/video_codecs/sdp_video_format.h"
+#include "api/video_codecs/video_decoder_software_fallback_wrapper.h"
 #include "media/base/codec.h"
 #include "media/base/media_constants.h"
 #include "modules/video_coding/codecs/h264/include/h264.h"
@@ -21,6 +22,10 @@
 #include "rtc_base/logging.h"
 
 #if defined(SORA_UNITY_SDK_WINDOWS)
+#include "hwenc_msdk/msdk_video_decoder.h"
+#include "hwenc_nvcodec/nvcodec_video_decoder.h"
+#include "h264_format.h"
+#elif defined(SORA_UNITY_SDK_UBUNTU)
 #include "hwenc_nvcodec/nvcodec_video_decoder.h"
 #include "h264_format.h"
 #endif
@@ -52,22 +57,40 @@ std::vector<webrtc::SdpVideoFormat> HWVideoDecoderFactory::GetSupportedFormats()
     formats.push_back(format);
 
 #if defined(SORA_UNITY_SDK_WINDOWS)
+  // NVDEC が使えなければ QSV を使う
+  if (!NvCodecVideoDecoder::IsSupported(cudaVideoCodec_H264) &&
+      !MsdkVideoDecoder::IsSupported(MFX_CODEC_AVC)) {
+    return formats;
+  }
+
+  // NVDEC も QSV も High プロファイルの Level 5.1 までデコードできる
+  const webrtc::H264::Profile h264_profiles[] = {
+      webrtc::H264::kProfileBaseline,
+      webrtc::H264::kProfileConstrainedBaseline,
+      webrtc::H264::kProfileMain,
+      webrtc::H264::kProfileConstrainedHigh,
+      webrtc::H264::kProfileHigh,
+  };
+  for (webrtc::H264::Profile profile : h264_profiles) {
+    formats.push_back(CreateH264Format(profile, webrtc::H264::kLevel5_1, "1"));
+    formats.push_back(CreateH264Format(profile, webrtc::H264::kLevel5_1, "0"));
+  }
+#elif defined(SORA_UNITY_SDK_UBUNTU)
   if (!NvCodecVideoDecoder::IsSupported(cudaVideoCodec_H264)) {
     return formats;
   }
 
-  std::vector<webrtc::SdpVideoFormat> h264_codecs = {
-      CreateH264Format(webrtc::H264::kProfileBaseline, webrtc::H264::kLevel3_1,
-                       "1"),
-      CreateH264Format(webrtc::H264::kProfileBaseline, webrtc::H264::kLevel3_1,
-                       "0"),
-      CreateH264Format(webrtc::H264::kProfileConstrainedBaseline,
-                       webrtc::H264::kLevel3_1, "1"),
-      CreateH264Format(webrtc::H264::kProfileConstrainedBaseline,
-                       webrtc::H264::kLevel3_1, "0")};
-
-  for (const webrtc::SdpVideoFormat& h264_format : h264_codecs)
-    formats.push_back(h264_format);
+  const webrtc::H264::Profile h264_profiles[] = {
+      webrtc::H264::kProfileBaseline,
+      webrtc::H264::kProfileConstrainedBaseline,
+      webrtc::H264::kProfileMain,
+      webrtc::H264::kProfileConstrainedHigh,
+      webrtc::H264::kProfileHigh,
+  };
+  for (webrtc::H264::Profile profile : h264_profiles) {
+    formats.push_back(CreateH264Format(profile, webrtc::H264::kLevel5_1, "1"));
+    formats.push_back(CreateH264Format(profile, webrtc::H264::kLevel5_1, "0"));
+  }
 #endif
 
   return formats;
@@ -80,14 +103,61 @@ std::unique_ptr<webrtc::VideoDecoder> HWVideoDecoderFactory::CreateVideoDecoder(
     return nullptr;
   }
 
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  // VP8/VP9 は NVDEC が使えれば使い、初期化やデコードに失敗したら libvpx に切り替える
+  if (absl::EqualsIgnoreCase(format.name, cricket::kVp8CodecName) &&
+      NvCodecVideoDecoder::IsSupported(cudaVideoCodec_VP8)) {
+    return webrtc::CreateVideoDecoderSoftwareFallbackWrapper(
+        webrtc::VP8Decoder::Create(),
+        absl::make_unique<NvCodecVideoDecoder>(
+            cudaVideoCodec_VP8, texture_device_, async_output_,
+            adapter_luid_));
+  }
+  if (absl::EqualsIgnoreCase(format.name, cricket::kVp9CodecName) &&
+      NvCodecVideoDecoder::IsSupported(cudaVideoCodec_VP9)) {
+    return webrtc::CreateVideoDecoderSoftwareFallbackWrapper(
+        webrtc::VP9Decoder::Create(),
+        absl::make_unique<NvCodecVideoDecoder>(
+            cudaVideoCodec_VP9, texture_device_, async_output_,
+            adapter_luid_));
+  }
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+  if (absl::EqualsIgnoreCase(format.name, cricket::kVp8CodecName) &&
+      NvCodecVideoDecoder::IsSupported(cudaVideoCodec_VP8)) {
+    return webrtc::CreateVideoDecoderSoftwareFallbackWrapper(
+        webrtc::VP8Decoder::Create(),
+        absl::make_unique<NvCodecVideoDecoder>(cudaVideoCodec_VP8,
+                                               async_output_));
+  }
+  if (absl::EqualsIgnoreCase(format.name, cricket::kVp9CodecName) &&
+      NvCodecVideoDecoder::IsSupported(cudaVideoCodec_VP9)) {
+    return webrtc::CreateVideoDecoderSoftwareFallbackWrapper(
+        webrtc::VP9Decoder::Create(),
+        absl::make_unique<NvCodecVideoDecoder>(cudaVideoCodec_VP9,
+                                               async_output_));
+  }
+#endif
   if (absl::EqualsIgnoreCase(format.name, cricket::kVp8CodecName))
     return webrtc::VP8Decoder::Create();
   if (absl::EqualsIgnoreCase(format.name, cricket::kVp9CodecName))
     return webrtc::VP9Decoder::Create();
 #if defined(SORA_UNITY_SDK_WINDOWS)
-  if (absl::EqualsIgnoreCase(format.name, cricket::kH264CodecName))
+  if (absl::EqualsIgnoreCase(format.name, cricket::kH264CodecName)) {
+    if (NvCodecVideoDecoder::IsSupported(cudaVideoCodec_H264)) {
+      return std::unique_ptr<webrtc::VideoDecoder>(
+          absl::make_unique<NvCodecVideoDecoder>(
+              cudaVideoCodec_H264, texture_device_, async_output_,
+              adapter_luid_));
+    }
+    return std::unique_ptr<webrtc::VideoDecoder>(
+        absl::make_unique<MsdkVideoDecoder>(MFX_CODEC_AVC));
+  }
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+  if (absl::EqualsIgnoreCase(format.name, cricket::kH264CodecName)) {
     return std::unique_ptr<webrtc::VideoDecoder>(
-        absl::make_unique<NvCodecVideoDecoder>(cudaVideoCodec_H264));
+        absl::make_unique<NvCodecVideoDecoder>(cudaVideoCodec_H264,
+                                               async_output_));
+  }
 #endif
 
   RTC_NOTREACHED();
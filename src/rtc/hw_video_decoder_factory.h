@@ -16,17 +16,48 @@
 
 #include "api/video_codecs/video_decoder_factory.h"
 
+#if defined(SORA_UNITY_SDK_WINDOWS)
+#include <d3d11.h>
+#endif
+
 namespace sora {
 
 class HWVideoDecoderFactory : public webrtc::VideoDecoderFactory {
  public:
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  // texture_device を指定すると、NVDEC のデコード結果をそのデバイスの
+  // テクスチャに置いたまま出力する。
+  // async_output を true にすると、NVDEC の出力を別スレッドで行う。
+  // adapter_luid を指定すると、NVDEC をそのアダプタの GPU で動かす。
+  explicit HWVideoDecoderFactory(ID3D11Device* texture_device = nullptr,
+                                 bool async_output = false,
+                                 LUID adapter_luid = {})
+      : texture_device_(texture_device),
+        async_output_(async_output),
+        adapter_luid_(adapter_luid) {}
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+  // async_output を true にすると、NVDEC の出力を別スレッドで行う。
+  explicit HWVideoDecoderFactory(bool async_output = false)
+      : async_output_(async_output) {}
+#else
   HWVideoDecoderFactory() {}
+#endif
   virtual ~HWVideoDecoderFactory() {}
 
   std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
 
   std::unique_ptr<webrtc::VideoDecoder> CreateVideoDecoder(
       const webrtc::SdpVideoFormat& format) override;
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+ private:
+  ID3D11Device* texture_device_;
+  bool async_output_;
+  LUID adapter_luid_;
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+ private:
+  bool async_output_;
+#endif
 };
 
 }
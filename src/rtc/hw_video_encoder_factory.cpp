@@ -11,10 +11,78 @@
 #include "rtc_base/logging.h"
 
 #include "h264_format.h"
+#include "pass_through_video_encoder.h"
 #if defined(SORA_UNITY_SDK_WINDOWS)
+#include "hwenc_amf/amf_h264_encoder.h"
+#include "hwenc_msdk/msdk_h264_encoder.h"
+#include "hwenc_nvcodec/nvcodec_h264_encoder.h"
+#elif defined(SORA_UNITY_SDK_UBUNTU)
 #include "hwenc_nvcodec/nvcodec_h264_encoder.h"
 #endif
 
+namespace {
+
+// InitEncode に渡す CPU のコア数を置き換えるエンコーダ。
+// libvpx はコア数と解像度からスレッド数を決めるので、これでスレッド数を調整する
+class CoreLimitedVideoEncoder : public webrtc::VideoEncoder {
+ public:
+  CoreLimitedVideoEncoder(std::unique_ptr<webrtc::VideoEncoder> encoder,
+                          int number_of_cores)
+      : encoder_(std::move(encoder)), number_of_cores_(number_of_cores) {}
+
+  void SetFecControllerOverride(
+      webrtc::FecControllerOverride* fec_controller_override) override {
+    encoder_->SetFecControllerOverride(fec_controller_override);
+  }
+  int InitEncode(const webrtc::VideoCodec* codec_settings,
+                 const webrtc::VideoEncoder::Settings& settings) override {
+    webrtc::VideoEncoder::Settings s = settings;
+    s.number_of_cores = number_of_cores_;
+    RTC_LOG(LS_INFO) << "Encoder cores: " << settings.number_of_cores << " -> "
+                     << number_of_cores_;
+    return encoder_->InitEncode(codec_settings, s);
+  }
+  int32_t RegisterEncodeCompleteCallback(
+      webrtc::EncodedImageCallback* callback) override {
+    return encoder_->RegisterEncodeCompleteCallback(callback);
+  }
+  int32_t Release() override { return encoder_->Release(); }
+  int32_t Encode(
+      const webrtc::VideoFrame& frame,
+      const std::vector<webrtc::VideoFrameType>* frame_types) override {
+    return encoder_->Encode(frame, frame_types);
+  }
+  void SetRates(const RateControlParameters& parameters) override {
+    encoder_->SetRates(parameters);
+  }
+  void OnPacketLossRateUpdate(float packet_loss_rate) override {
+    encoder_->OnPacketLossRateUpdate(packet_loss_rate);
+  }
+  void OnRttUpdate(int64_t rtt_ms) override { encoder_->OnRttUpdate(rtt_ms); }
+  void OnLossNotification(const LossNotification& loss_notification) override {
+    encoder_->OnLossNotification(loss_notification);
+  }
+  EncoderInfo GetEncoderInfo() const override {
+    return encoder_->GetEncoderInfo();
+  }
+
+ private:
+  std::unique_ptr<webrtc::VideoEncoder> encoder_;
+  int number_of_cores_;
+};
+
+std::unique_ptr<webrtc::VideoEncoder> LimitCores(
+    std::unique_ptr<webrtc::VideoEncoder> encoder,
+    int number_of_cores) {
+  if (number_of_cores <= 0) {
+    return encoder;
+  }
+  return absl::make_unique<CoreLimitedVideoEncoder>(std::move(encoder),
+                                                    number_of_cores);
+}
+
+}  // namespace
+
 namespace sora {
 
 std::vector<webrtc::SdpVideoFormat> HWVideoEncoderFactory::GetSupportedFormats()
@@ -25,19 +93,30 @@ std::vector<webrtc::SdpVideoFormat> HWVideoEncoderFactory::GetSupportedFormats()
     supported_codecs.push_back(format);
 
 #if defined(SORA_UNITY_SDK_WINDOWS)
-  if (NvCodecH264Encoder::IsSupported()) {
-    std::vector<webrtc::SdpVideoFormat> h264_codecs = {
-        CreateH264Format(webrtc::H264::kProfileBaseline,
-                         webrtc::H264::kLevel3_1, "1"),
-        CreateH264Format(webrtc::H264::kProfileBaseline,
-                         webrtc::H264::kLevel3_1, "0"),
-        CreateH264Format(webrtc::H264::kProfileConstrainedBaseline,
-                         webrtc::H264::kLevel3_1, "1"),
-        CreateH264Format(webrtc::H264::kProfileConstrainedBaseline,
-                         webrtc::H264::kLevel3_1, "0")};
-
-    for (const webrtc::SdpVideoFormat& format : h264_codecs)
-      supported_codecs.push_back(format);
+  // NVENC が使えなければ AMF、それも使えなければ QSV を使う
+  const bool h264_supported = NvCodecH264Encoder::IsSupported() ||
+                              AmfH264Encoder::IsSupported() ||
+                              MsdkH264Encoder::IsSupported();
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+  const bool h264_supported = NvCodecH264Encoder::IsSupported();
+#endif
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_UBUNTU)
+  if (h264_supported || encoded_input_) {
+    // 1080p60 を出せるように Level 5.1 まで対応する。
+    // 実際のレベルは相手との間で低い方にネゴシエーションされる。
+    const webrtc::H264::Profile h264_profiles[] = {
+        webrtc::H264::kProfileBaseline,
+        webrtc::H264::kProfileConstrainedBaseline,
+        webrtc::H264::kProfileMain,
+        webrtc::H264::kProfileConstrainedHigh,
+        webrtc::H264::kProfileHigh,
+    };
+    for (webrtc::H264::Profile profile : h264_profiles) {
+      supported_codecs.push_back(
+          CreateH264Format(profile, webrtc::H264::kLevel5_1, "1"));
+      supported_codecs.push_back(
+          CreateH264Format(profile, webrtc::H264::kLevel5_1, "0"));
+    }
   }
 #endif
 
@@ -47,15 +126,22 @@ std::vector<webrtc::SdpVideoFormat> HWVideoEncoderFactory::GetSupportedFormats()
 std::unique_ptr<webrtc::VideoEncoder> HWVideoEncoderFactory::CreateVideoEncoder(
     const webrtc::SdpVideoFormat& format) {
   if (absl::EqualsIgnoreCase(format.name, cricket::kVp8CodecName))
-    return webrtc::VP8Encoder::Create();
+    return LimitCores(webrtc::VP8Encoder::Create(), encoder_threads_);
 
   if (absl::EqualsIgnoreCase(format.name, cricket::kVp9CodecName))
-    return webrtc::VP9Encoder::Create(cricket::VideoCodec(format));
+    return LimitCores(webrtc::VP9Encoder::Create(cricket::VideoCodec(format)),
+                      encoder_threads_);
 
-#if defined(SORA_UNITY_SDK_WINDOWS)
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_UBUNTU)
   if (absl::EqualsIgnoreCase(format.name, cricket::kH264CodecName)) {
-    return std::unique_ptr<webrtc::VideoEncoder>(
-        absl::make_unique<NvCodecH264Encoder>(cricket::VideoCodec(format)));
+    std::unique_ptr<webrtc::VideoEncoder> encoder = CreateH264Encoder(format);
+    if (encoded_input_) {
+      // エンコード済みのフレーム以外が来た場合は HW エンコーダでエンコードする
+      return absl::make_unique<PassThroughVideoEncoder>(std::move(encoder));
+    }
+    if (encoder) {
+      return encoder;
+    }
   }
 #endif
 
@@ -64,4 +150,32 @@ std::unique_ptr<webrtc::VideoEncoder> HWVideoEncoderFactory::CreateVideoEncoder(
   return nullptr;
 }
 
+std::unique_ptr<webrtc::VideoEncoder> HWVideoEncoderFactory::CreateH264Encoder(
+    const webrtc::SdpVideoFormat& format) {
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  if (NvCodecH264Encoder::IsSupported()) {
+    return std::unique_ptr<webrtc::VideoEncoder>(
+        absl::make_unique<NvCodecH264Encoder>(
+            cricket::VideoCodec(format), output_delay_, intra_refresh_,
+            adapter_luid_));
+  }
+  if (AmfH264Encoder::IsSupported()) {
+    return std::unique_ptr<webrtc::VideoEncoder>(
+        absl::make_unique<AmfH264Encoder>(cricket::VideoCodec(format),
+                                          adapter_luid_));
+  }
+  if (MsdkH264Encoder::IsSupported()) {
+    return std::unique_ptr<webrtc::VideoEncoder>(
+        absl::make_unique<MsdkH264Encoder>(cricket::VideoCodec(format)));
+  }
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+  if (NvCodecH264Encoder::IsSupported()) {
+    return std::unique_ptr<webrtc::VideoEncoder>(
+        absl::make_unique<NvCodecH264Encoder>(
+            cricket::VideoCodec(format), output_delay_, intra_refresh_));
+  }
+#endif
+  return nullptr;
+}
+
 }  // namespace sora
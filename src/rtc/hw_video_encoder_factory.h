@@ -16,12 +16,52 @@ namespace sora {
 
 class HWVideoEncoderFactory : public webrtc::VideoEncoderFactory {
  public:
+  // encoder_threads を指定すると、libvpx (VP8, VP9) のエンコーダに
+  // その数の CPU コアがあるものとして初期化させる。0 の場合は実際のコア数を使う。
+  // encoded_input が true の場合は、H.264 のエンコーダを PassThroughVideoEncoder にして
+  // アプリがエンコードしたフレームをそのまま送る。HW エンコーダが無くても H.264 を使える
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  // adapter_luid を指定すると、NVENC をそのアダプタで動かす。
+  // AMF もそのアダプタが AMD の GPU ならそのアダプタで動かす
+  HWVideoEncoderFactory(int output_delay = 0,
+                        bool intra_refresh = false,
+                        int encoder_threads = 0,
+                        LUID adapter_luid = {},
+                        bool encoded_input = false)
+      : output_delay_(output_delay),
+        intra_refresh_(intra_refresh),
+        encoder_threads_(encoder_threads),
+        encoded_input_(encoded_input),
+        adapter_luid_(adapter_luid) {}
+#else
+  HWVideoEncoderFactory(int output_delay = 0,
+                        bool intra_refresh = false,
+                        int encoder_threads = 0,
+                        bool encoded_input = false)
+      : output_delay_(output_delay),
+        intra_refresh_(intra_refresh),
+        encoder_threads_(encoder_threads),
+        encoded_input_(encoded_input) {}
+#endif
   virtual ~HWVideoEncoderFactory() {}
 
   std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
 
   std::unique_ptr<webrtc::VideoEncoder> CreateVideoEncoder(
       const webrtc::SdpVideoFormat& format) override;
+
+ private:
+  // HW エンコーダが無い場合は nullptr を返す
+  std::unique_ptr<webrtc::VideoEncoder> CreateH264Encoder(
+      const webrtc::SdpVideoFormat& format);
+
+  int output_delay_;
+  bool intra_refresh_;
+  int encoder_threads_;
+  bool encoded_input_;
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  LUID adapter_luid_;
+#endif
 };
 
 }  // namespace sora
@@ -0,0 +1,196 @@
+#include "pass_through_video_encoder.h"
+
+#include "api/video/encoded_image.h"
+#include "modules/video_coding/include/video_codec_interface.h"
+#include "modules/video_coding/include/video_error_codes.h"
+#include "rtc_base/logging.h"
+
+#include "encoded_video_track_source.h"
+#include "log_rate_limiter.h"
+
+namespace sora {
+
+PassThroughVideoEncoder::PassThroughVideoEncoder(
+    std::unique_ptr<webrtc::VideoEncoder> fallback)
+    : fallback_(std::move(fallback)) {}
+
+PassThroughVideoEncoder::~PassThroughVideoEncoder() {
+  Release();
+}
+
+void PassThroughVideoEncoder::SetFecControllerOverride(
+    webrtc::FecControllerOverride* fec_controller_override) {
+  if (fallback_) {
+    fallback_->SetFecControllerOverride(fec_controller_override);
+  }
+}
+
+int32_t PassThroughVideoEncoder::InitEncode(
+    const webrtc::VideoCodec* codec_settings,
+    const webrtc::VideoEncoder::Settings& settings) {
+  if (codec_settings == nullptr) {
+    return WEBRTC_VIDEO_CODEC_ERR_PARAMETER;
+  }
+  mode_ = codec_settings->mode;
+  // fallback が使えなくても、エンコード済みのフレームは送れるので失敗にはしない
+  fallback_initialized_ =
+      fallback_ && fallback_->InitEncode(codec_settings, settings) ==
+                       WEBRTC_VIDEO_CODEC_OK;
+  RTC_LOG(LS_INFO) << "PassThroughVideoEncoder::InitEncode fallback="
+                   << (fallback_initialized_ ? "enabled" : "disabled");
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t PassThroughVideoEncoder::RegisterEncodeCompleteCallback(
+    webrtc::EncodedImageCallback* callback) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    callback_ = callback;
+  }
+  if (fallback_) {
+    fallback_->RegisterEncodeCompleteCallback(callback);
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t PassThroughVideoEncoder::Release() {
+  if (fallback_initialized_) {
+    fallback_->Release();
+    fallback_initialized_ = false;
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t PassThroughVideoEncoder::Encode(
+    const webrtc::VideoFrame& frame,
+    const std::vector<webrtc::VideoFrameType>* frame_types) {
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame_buffer =
+      frame.video_frame_buffer();
+  EncodedFrameBuffer* buffer = nullptr;
+  if (frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative) {
+    buffer = dynamic_cast<EncodedFrameBuffer*>(frame_buffer.get());
+  }
+  if (buffer == nullptr) {
+    if (!fallback_initialized_) {
+      SORA_LOG_RATE_LIMITED(LS_ERROR, 10000)
+          << "PassThroughVideoEncoder received a raw frame without fallback";
+      return WEBRTC_VIDEO_CODEC_ERROR;
+    }
+    return fallback_->Encode(frame, frame_types);
+  }
+
+  // キーフレームを作れないので、アプリに作ってもらう
+  bool key_frame_requested = false;
+  if (frame_types != nullptr) {
+    for (webrtc::VideoFrameType type : *frame_types) {
+      if (type == webrtc::VideoFrameType::kVideoFrameKey) {
+        key_frame_requested = true;
+      }
+    }
+  }
+  if (key_frame_requested && !buffer->is_key_frame()) {
+    buffer->RequestKeyFrame();
+  }
+
+  // エンコーダが詰まっている場合などは Encode が呼ばれる前にフレームが捨てられるので、
+  // 通し番号が飛んでいたら以降の差分のフレームはデコードできない
+  uint64_t sequence = buffer->sequence();
+  if (!buffer->is_key_frame() && last_sequence_ != 0 &&
+      sequence != last_sequence_ + 1 && !waiting_key_frame_) {
+    SORA_LOG_RATE_LIMITED(LS_WARNING, 1000)
+        << "Encoded frames dropped: last_sequence=" << last_sequence_
+        << " sequence=" << sequence;
+    waiting_key_frame_ = true;
+  }
+  last_sequence_ = sequence;
+  if (buffer->is_key_frame()) {
+    waiting_key_frame_ = false;
+  } else if (waiting_key_frame_) {
+    buffer->RequestKeyFrame();
+    return WEBRTC_VIDEO_CODEC_OK;
+  }
+
+  webrtc::EncodedImage encoded_image;
+  encoded_image.SetEncodedData(buffer->data());
+  encoded_image._encodedWidth = buffer->width();
+  encoded_image._encodedHeight = buffer->height();
+  encoded_image.content_type_ =
+      (mode_ == webrtc::VideoCodecMode::kScreensharing)
+          ? webrtc::VideoContentType::SCREENSHARE
+          : webrtc::VideoContentType::UNSPECIFIED;
+  encoded_image.timing_.flags = webrtc::VideoSendTiming::kInvalid;
+  encoded_image.SetTimestamp(frame.timestamp());
+  encoded_image.ntp_time_ms_ = frame.ntp_time_ms();
+  encoded_image.capture_time_ms_ = frame.render_time_ms();
+  encoded_image.rotation_ = frame.rotation();
+  encoded_image._frameType = buffer->is_key_frame()
+                                 ? webrtc::VideoFrameType::kVideoFrameKey
+                                 : webrtc::VideoFrameType::kVideoFrameDelta;
+
+  webrtc::CodecSpecificInfo codec_specific;
+  codec_specific.codecType = webrtc::kVideoCodecH264;
+  codec_specific.codecSpecific.H264.packetization_mode =
+      webrtc::H264PacketizationMode::NonInterleaved;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (callback_ == nullptr) {
+    waiting_key_frame_ = true;
+    return WEBRTC_VIDEO_CODEC_UNINITIALIZED;
+  }
+  webrtc::EncodedImageCallback::Result result =
+      callback_->OnEncodedImage(encoded_image, &codec_specific);
+  if (result.error != webrtc::EncodedImageCallback::Result::OK) {
+    // 送れなかったフレームを参照する差分のフレームも送れない
+    waiting_key_frame_ = true;
+    buffer->RequestKeyFrame();
+    RTC_LOG(LS_ERROR) << __FUNCTION__
+                      << " OnEncodedImage failed error:" << result.error;
+    return WEBRTC_VIDEO_CODEC_ERROR;
+  }
+  return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void PassThroughVideoEncoder::SetRates(
+    const RateControlParameters& parameters) {
+  if (fallback_initialized_) {
+    fallback_->SetRates(parameters);
+  }
+}
+
+void PassThroughVideoEncoder::OnPacketLossRateUpdate(float packet_loss_rate) {
+  if (fallback_initialized_) {
+    fallback_->OnPacketLossRateUpdate(packet_loss_rate);
+  }
+}
+
+void PassThroughVideoEncoder::OnRttUpdate(int64_t rtt_ms) {
+  if (fallback_initialized_) {
+    fallback_->OnRttUpdate(rtt_ms);
+  }
+}
+
+void PassThroughVideoEncoder::OnLossNotification(
+    const LossNotification& loss_notification) {
+  if (fallback_initialized_) {
+    fallback_->OnLossNotification(loss_notification);
+  }
+}
+
+webrtc::VideoEncoder::EncoderInfo PassThroughVideoEncoder::GetEncoderInfo()
+    const {
+  EncoderInfo info;
+  if (fallback_initialized_) {
+    info = fallback_->GetEncoderInfo();
+  }
+  info.implementation_name = "PassThrough";
+  info.is_hardware_accelerated = true;
+  // EncodedFrameBuffer を I420 に変換させない
+  info.supports_native_handle = true;
+  // WebRTC 側でフレームを間引かれると、以降の差分のフレームがデコードできなくなる
+  info.has_trusted_rate_controller = true;
+  // QP が分からないので解像度を落とす判断はさせない
+  info.scaling_settings = webrtc::VideoEncoder::ScalingSettings::kOff;
+  return info;
+}
+
+}  // namespace sora
@@ -0,0 +1,56 @@
+#ifndef SORA_PASS_THROUGH_VIDEO_ENCODER_H_
+#define SORA_PASS_THROUGH_VIDEO_ENCODER_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "api/video/video_frame.h"
+#include "api/video_codecs/video_encoder.h"
+
+namespace sora {
+
+// EncodedFrameBuffer に入っているエンコード済みの H.264 のフレームを、
+// エンコードせずにそのまま EncodedImage として出力するエンコーダ。
+// それ以外のフレームが来た場合は fallback に渡してエンコードする。
+// ビットレートはアプリ側のエンコーダで制御するので、SetRates の値は fallback にしか効かない
+class PassThroughVideoEncoder : public webrtc::VideoEncoder {
+ public:
+  // fallback は nullptr でもいい
+  explicit PassThroughVideoEncoder(
+      std::unique_ptr<webrtc::VideoEncoder> fallback);
+  ~PassThroughVideoEncoder() override;
+
+  void SetFecControllerOverride(
+      webrtc::FecControllerOverride* fec_controller_override) override;
+  int32_t InitEncode(const webrtc::VideoCodec* codec_settings,
+                     const webrtc::VideoEncoder::Settings& settings) override;
+  int32_t RegisterEncodeCompleteCallback(
+      webrtc::EncodedImageCallback* callback) override;
+  int32_t Release() override;
+  int32_t Encode(
+      const webrtc::VideoFrame& frame,
+      const std::vector<webrtc::VideoFrameType>* frame_types) override;
+  void SetRates(const RateControlParameters& parameters) override;
+  void OnPacketLossRateUpdate(float packet_loss_rate) override;
+  void OnRttUpdate(int64_t rtt_ms) override;
+  void OnLossNotification(const LossNotification& loss_notification) override;
+  EncoderInfo GetEncoderInfo() const override;
+
+ private:
+  std::unique_ptr<webrtc::VideoEncoder> fallback_;
+  // fallback の InitEncode が成功したかどうか
+  bool fallback_initialized_ = false;
+  webrtc::VideoCodecMode mode_ = webrtc::VideoCodecMode::kRealtimeVideo;
+  // 最後に送った EncodedFrameBuffer の通し番号。
+  // 番号が飛んだら、次のキーフレームまで差分のフレームは送らない
+  uint64_t last_sequence_ = 0;
+  bool waiting_key_frame_ = false;
+
+  std::mutex mutex_;
+  webrtc::EncodedImageCallback* callback_ = nullptr;
+};
+
+}  // namespace sora
+
+#endif  // SORA_PASS_THROUGH_VIDEO_ENCODER_H_
@@ -13,7 +13,12 @@ PeerConnectionObserver::~PeerConnectionObserver() {
 }
 
 void PeerConnectionObserver::OnDataChannel(
-    rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel) {}
+    rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel) {
+  RTC_LOG(LS_INFO) << __FUNCTION__ << " label=" << data_channel->label();
+  if (sender_ != nullptr) {
+    sender_->OnDataChannel(data_channel);
+  }
+}
 
 void PeerConnectionObserver::OnStandardizedIceConnectionChange(
     webrtc::PeerConnectionInterface::IceConnectionState new_state) {
@@ -42,25 +47,40 @@ void PeerConnectionObserver::OnIceCandidate(
 
 void PeerConnectionObserver::OnTrack(
     rtc::scoped_refptr<webrtc::RtpTransceiverInterface> transceiver) {
-  if (receiver_ == nullptr)
-    return;
   rtc::scoped_refptr<webrtc::MediaStreamTrackInterface> track =
       transceiver->receiver()->track();
-  if (track->kind() == webrtc::MediaStreamTrackInterface::kVideoKind) {
+  if (track->kind() == webrtc::MediaStreamTrackInterface::kVideoKind &&
+      video_receive_transformer_) {
+    transceiver->receiver()->SetDepacketizerToDecoderFrameTransformer(
+        video_receive_transformer_);
+  }
+  if (track->kind() == webrtc::MediaStreamTrackInterface::kVideoKind &&
+      video_min_delay_ms_ >= 0) {
+    transceiver->receiver()->SetJitterBufferMinimumDelay(
+        video_min_delay_ms_ / 1000.0);
+  }
+  if (track->kind() == webrtc::MediaStreamTrackInterface::kVideoKind &&
+      receiver_ != nullptr) {
     webrtc::VideoTrackInterface* video_track =
         static_cast<webrtc::VideoTrackInterface*>(track.get());
     video_tracks_.push_back(video_track);
     receiver_->AddTrack(video_track);
   }
+  if (track->kind() == webrtc::MediaStreamTrackInterface::kAudioKind &&
+      audio_receiver_ != nullptr) {
+    webrtc::AudioTrackInterface* audio_track =
+        static_cast<webrtc::AudioTrackInterface*>(track.get());
+    audio_tracks_.push_back(audio_track);
+    audio_receiver_->AddTrack(audio_track);
+  }
 }
 
 void PeerConnectionObserver::OnRemoveTrack(
     rtc::scoped_refptr<webrtc::RtpReceiverInterface> receiver) {
-  if (receiver_ == nullptr)
-    return;
   rtc::scoped_refptr<webrtc::MediaStreamTrackInterface> track =
       receiver->track();
-  if (track->kind() == webrtc::MediaStreamTrackInterface::kVideoKind) {
+  if (track->kind() == webrtc::MediaStreamTrackInterface::kVideoKind &&
+      receiver_ != nullptr) {
     webrtc::VideoTrackInterface* video_track =
         static_cast<webrtc::VideoTrackInterface*>(track.get());
     video_tracks_.erase(
@@ -71,6 +91,18 @@ void PeerConnectionObserver::OnRemoveTrack(
         video_tracks_.end());
     receiver_->RemoveTrack(video_track);
   }
+  if (track->kind() == webrtc::MediaStreamTrackInterface::kAudioKind &&
+      audio_receiver_ != nullptr) {
+    webrtc::AudioTrackInterface* audio_track =
+        static_cast<webrtc::AudioTrackInterface*>(track.get());
+    audio_tracks_.erase(
+        std::remove_if(audio_tracks_.begin(), audio_tracks_.end(),
+                       [audio_track](const webrtc::AudioTrackInterface* track) {
+                         return track == audio_track;
+                       }),
+        audio_tracks_.end());
+    audio_receiver_->RemoveTrack(audio_track);
+  }
 }
 
 void PeerConnectionObserver::ClearAllRegisteredTracks() {
@@ -80,6 +112,12 @@ void PeerConnectionObserver::ClearAllRegisteredTracks() {
     }
   }
   video_tracks_.clear();
+  if (audio_receiver_ != nullptr) {
+    for (webrtc::AudioTrackInterface* audio_track : audio_tracks_) {
+      audio_receiver_->RemoveTrack(audio_track);
+    }
+  }
+  audio_tracks_.clear();
 }
 
 }  // namespace sora
\ No newline at end of file
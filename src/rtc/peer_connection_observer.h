@@ -4,6 +4,7 @@
 // WebRTC
 #include <api/peer_connection_interface.h>
 
+#include "audio_track_receiver.h"
 #include "rtc_message_sender.h"
 #include "video_track_receiver.h"
 
@@ -11,10 +12,20 @@ namespace sora {
 
 class PeerConnectionObserver : public webrtc::PeerConnectionObserver {
  public:
-  PeerConnectionObserver(RTCMessageSender* sender, VideoTrackReceiver* receiver)
-      : sender_(sender), receiver_(receiver) {}
+  PeerConnectionObserver(RTCMessageSender* sender,
+                         VideoTrackReceiver* receiver,
+                         AudioTrackReceiver* audio_receiver = nullptr,
+                         rtc::scoped_refptr<webrtc::FrameTransformerInterface>
+                             video_receive_transformer = nullptr)
+      : sender_(sender),
+        receiver_(receiver),
+        audio_receiver_(audio_receiver),
+        video_receive_transformer_(video_receive_transformer) {}
   ~PeerConnectionObserver();
 
+  // 受信する映像ごとに表示までの遅延の下限を設定する。-1 の場合は WebRTC に任せる
+  void SetVideoMinimumDelay(int delay_ms) { video_min_delay_ms_ = delay_ms; }
+
  private:
   void OnSignalingChange(
       webrtc::PeerConnectionInterface::SignalingState new_state) override {}
@@ -36,7 +47,13 @@ class PeerConnectionObserver : public webrtc::PeerConnectionObserver {
 
   RTCMessageSender* sender_;
   VideoTrackReceiver* receiver_;
+  AudioTrackReceiver* audio_receiver_;
+  // 指定されていれば、受信した映像のデコード前のフレームをこれに通す
+  rtc::scoped_refptr<webrtc::FrameTransformerInterface>
+      video_receive_transformer_;
+  int video_min_delay_ms_ = -1;
   std::vector<webrtc::VideoTrackInterface*> video_tracks_;
+  std::vector<webrtc::AudioTrackInterface*> audio_tracks_;
 };
 
 }  // namespace sora
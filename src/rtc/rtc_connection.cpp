@@ -156,8 +156,15 @@ void RTCConnection::SetOffer(const std::string sdp,
                       << "\nline: " << error.line.c_str();
     return;
   }
+  // offer で増えたトランシーバーにも反映させるため、answer を作る前に毎回設定する
+  auto with_codec_preferences = [this, on_success = std::move(on_success)]() {
+    ApplyCodecPreferences();
+    if (on_success) {
+      on_success();
+    }
+  };
   connection_->SetRemoteDescription(
-      SetSessionDescriptionThunk::Create(std::move(on_success),
+      SetSessionDescriptionThunk::Create(std::move(with_codec_preferences),
                                          std::move(on_failure)),
       session_description.release());
 }
@@ -361,6 +368,41 @@ void RTCConnection::SetEncodingParameters(
   sender->SetParameters(parameters);
 }
 
+void RTCConnection::SetCodecPreferences(
+    cricket::MediaType media_type,
+    std::vector<webrtc::RtpCodecCapability> codecs) {
+  if (media_type == cricket::MediaType::MEDIA_TYPE_AUDIO) {
+    audio_codecs_ = std::move(codecs);
+  } else if (media_type == cricket::MediaType::MEDIA_TYPE_VIDEO) {
+    video_codecs_ = std::move(codecs);
+  }
+}
+
+void RTCConnection::ApplyCodecPreferences() {
+  if (audio_codecs_.empty() && video_codecs_.empty()) {
+    return;
+  }
+  for (auto transceiver : connection_->GetTransceivers()) {
+    if (transceiver->stopped()) {
+      continue;
+    }
+    const auto& codecs =
+        transceiver->media_type() == cricket::MediaType::MEDIA_TYPE_AUDIO
+            ? audio_codecs_
+            : video_codecs_;
+    if (codecs.empty()) {
+      continue;
+    }
+    webrtc::RTCError error = transceiver->SetCodecPreferences(codecs);
+    if (!error.ok()) {
+      RTC_LOG(LS_WARNING) << __FUNCTION__
+                          << ": SetCodecPreferences failed: mid="
+                          << transceiver->mid().value_or("nullopt")
+                          << " message=" << error.message();
+    }
+  }
+}
+
 rtc::scoped_refptr<webrtc::PeerConnectionInterface>
 RTCConnection::GetConnection() const {
   return connection_;
@@ -50,6 +50,11 @@ class RTCConnection {
   void SetEncodingParameters(
       std::vector<webrtc::RtpEncodingParameters> encodings);
 
+  // SetOffer で作られたトランシーバーに設定するコーデックの優先順位。
+  // 空の場合は設定しない
+  void SetCodecPreferences(cricket::MediaType media_type,
+                           std::vector<webrtc::RtpCodecCapability> codecs);
+
   rtc::scoped_refptr<webrtc::PeerConnectionInterface> GetConnection() const;
 
  private:
@@ -61,10 +66,13 @@ class RTCConnection {
       bool enabled);
   bool IsMediaEnabled(
       rtc::scoped_refptr<webrtc::MediaStreamTrackInterface> track);
+  void ApplyCodecPreferences();
 
   RTCMessageSender* sender_;
   std::unique_ptr<PeerConnectionObserver> observer_;
   rtc::scoped_refptr<webrtc::PeerConnectionInterface> connection_;
+  std::vector<webrtc::RtpCodecCapability> audio_codecs_;
+  std::vector<webrtc::RtpCodecCapability> video_codecs_;
 };
 
 }
@@ -0,0 +1,63 @@
+#include "rtc_data_channel.h"
+
+// WebRTC
+#include <rtc_base/logging.h>
+
+namespace sora {
+
+RTCDataChannel::RTCDataChannel(
+    rtc::scoped_refptr<webrtc::DataChannelInterface> channel,
+    OnStateChangeFunc on_state_change,
+    OnMessageFunc on_message)
+    : channel_(channel),
+      on_state_change_(std::move(on_state_change)),
+      on_message_(std::move(on_message)) {
+  channel_->RegisterObserver(this);
+}
+
+RTCDataChannel::~RTCDataChannel() {
+  // シグナリングスレッドで解除されるので、解除した後にコールバックが呼ばれることはない
+  channel_->UnregisterObserver();
+}
+
+std::string RTCDataChannel::label() const {
+  return channel_->label();
+}
+
+bool RTCDataChannel::IsOpen() const {
+  return channel_->state() == webrtc::DataChannelInterface::kOpen;
+}
+
+bool RTCDataChannel::Send(const std::string& data) {
+  return Send((const uint8_t*)data.data(), data.size());
+}
+
+bool RTCDataChannel::Send(const uint8_t* data, size_t size) {
+  if (!IsOpen()) {
+    RTC_LOG(LS_WARNING) << "DataChannel is not open: label="
+                        << channel_->label();
+    return false;
+  }
+  // Send はシグナリングスレッドで同期的に処理されるので、呼び出し元のバッファから直接
+  // SCTP の送信キューにコピーされる
+  return channel_->Send(
+      webrtc::DataBuffer(rtc::CopyOnWriteBuffer(data, size), true));
+}
+
+void RTCDataChannel::OnStateChange() {
+  webrtc::DataChannelInterface::DataState state = channel_->state();
+  RTC_LOG(LS_INFO) << "DataChannel state changed: label=" << channel_->label()
+                   << " state="
+                   << webrtc::DataChannelInterface::DataStateString(state);
+  if (on_state_change_) {
+    on_state_change_(state);
+  }
+}
+
+void RTCDataChannel::OnMessage(const webrtc::DataBuffer& buffer) {
+  if (on_message_) {
+    on_message_(buffer.data);
+  }
+}
+
+}  // namespace sora
@@ -0,0 +1,46 @@
+#ifndef SORA_RTC_DATA_CHANNEL_H_
+#define SORA_RTC_DATA_CHANNEL_H_
+
+#include <functional>
+#include <string>
+
+// WebRTC
+#include <api/data_channel_interface.h>
+#include <rtc_base/copy_on_write_buffer.h>
+
+namespace sora {
+
+// DataChannel の受信を std::function で受け取るためのクラス。
+// コールバックは WebRTC のシグナリングスレッドから呼ばれる。
+class RTCDataChannel : public webrtc::DataChannelObserver {
+ public:
+  typedef std::function<void(webrtc::DataChannelInterface::DataState state)>
+      OnStateChangeFunc;
+  // data は受信したバッファをそのまま参照しているので、コピーせずに持ち回せる
+  typedef std::function<void(const rtc::CopyOnWriteBuffer& data)>
+      OnMessageFunc;
+
+  RTCDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> channel,
+                 OnStateChangeFunc on_state_change,
+                 OnMessageFunc on_message);
+  ~RTCDataChannel() override;
+
+  std::string label() const;
+  bool IsOpen() const;
+  // Sora に合わせてバイナリで送る。開いていない場合は false を返す
+  bool Send(const std::string& data);
+  bool Send(const uint8_t* data, size_t size);
+
+ private:
+  void OnStateChange() override;
+  void OnMessage(const webrtc::DataBuffer& buffer) override;
+  void OnBufferedAmountChange(uint64_t sent_data_size) override {}
+
+  rtc::scoped_refptr<webrtc::DataChannelInterface> channel_;
+  OnStateChangeFunc on_state_change_;
+  OnMessageFunc on_message_;
+};
+
+}  // namespace sora
+
+#endif
@@ -1,15 +1,19 @@
+#include <algorithm>
 #include <iostream>
+#include <string>
 
 // WebRTC
 #include <absl/memory/memory.h>
 #include <api/audio_codecs/builtin_audio_decoder_factory.h>
 #include <api/audio_codecs/builtin_audio_encoder_factory.h>
+#include <api/audio_codecs/opus/audio_encoder_opus.h>
 #include <api/create_peerconnection_factory.h>
 #include <api/rtc_event_log/rtc_event_log_factory.h>
 #include <api/task_queue/default_task_queue_factory.h>
 #include <api/video_codecs/builtin_video_decoder_factory.h>
 #include <api/video_codecs/builtin_video_encoder_factory.h>
 #include <api/video_track_source_proxy.h>
+#include <media/base/media_constants.h>
 #include <media/engine/webrtc_media_engine.h>
 #include <modules/audio_device/include/audio_device.h>
 #include <modules/audio_device/include/audio_device_factory.h>
@@ -17,12 +21,15 @@
 #include <modules/video_capture/video_capture.h>
 #include <modules/video_capture/video_capture_factory.h>
 #include <rtc_base/logging.h>
+#include <rtc_base/ref_counted_object.h>
 #include <rtc_base/ssl_adapter.h>
+#include <system_wrappers/include/field_trial.h>
 
 #include "peer_connection_observer.h"
 #include "rtc_manager.h"
 #include "rtc_ssl_verifier.h"
 #include "scalable_track_source.h"
+#include "simulcast_encoder_factory.h"
 
 #if defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
 #include "mac_helper/objc_codec_factory_helper.h"
@@ -45,47 +52,118 @@ std::string GenerateRandomChars() {
   return GenerateRandomChars(32);
 }
 
+// Opus のエンコーダだけ complexity を上書きして作り、それ以外は builtin に任せる。
+// complexity は SDP の fmtp で指定できないので、エンコーダを作る時に設定する
+class OpusComplexityAudioEncoderFactory : public webrtc::AudioEncoderFactory {
+ public:
+  OpusComplexityAudioEncoderFactory(
+      rtc::scoped_refptr<webrtc::AudioEncoderFactory> factory,
+      int complexity)
+      : factory_(factory), complexity_(complexity) {}
+
+  std::vector<webrtc::AudioCodecSpec> GetSupportedEncoders() override {
+    return factory_->GetSupportedEncoders();
+  }
+  absl::optional<webrtc::AudioCodecInfo> QueryAudioEncoder(
+      const webrtc::SdpAudioFormat& format) override {
+    return factory_->QueryAudioEncoder(format);
+  }
+  std::unique_ptr<webrtc::AudioEncoder> MakeAudioEncoder(
+      int payload_type,
+      const webrtc::SdpAudioFormat& format,
+      absl::optional<webrtc::AudioCodecPairId> codec_pair_id) override {
+    auto config = webrtc::AudioEncoderOpus::SdpToConfig(format);
+    if (!config) {
+      return factory_->MakeAudioEncoder(payload_type, format, codec_pair_id);
+    }
+    config->complexity = complexity_;
+    config->low_rate_complexity = complexity_;
+    return webrtc::AudioEncoderOpus::MakeAudioEncoder(*config, payload_type,
+                                                      codec_pair_id);
+  }
+
+ private:
+  rtc::scoped_refptr<webrtc::AudioEncoderFactory> factory_;
+  int complexity_;
+};
+
 }  // namespace
 
 namespace sora {
 
-std::unique_ptr<RTCManager> RTCManager::Create(
-    RTCManagerConfig config,
-    rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
-    VideoTrackReceiver* receiver,
+std::shared_ptr<RTCEngine> RTCEngine::Create(
+    const RTCManagerConfig& config,
     rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
     std::unique_ptr<webrtc::TaskQueueFactory> task_queue_factory,
     std::unique_ptr<rtc::Thread> signaling_thread,
     std::unique_ptr<rtc::Thread> worker_thread) {
-  std::unique_ptr<RTCManager> p(new RTCManager());
-  if (!p->Init(config, video_track_source, receiver, adm,
-               std::move(task_queue_factory), std::move(signaling_thread),
-               std::move(worker_thread))) {
+  std::shared_ptr<RTCEngine> p(new RTCEngine());
+  if (!p->Init(config, adm, std::move(task_queue_factory),
+               std::move(signaling_thread), std::move(worker_thread))) {
     return nullptr;
   }
   return p;
 }
 
-RTCManager::RTCManager() {}
+RTCEngine::RTCEngine() {}
 
-bool RTCManager::Init(
-    RTCManagerConfig config,
-    rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
-    VideoTrackReceiver* receiver,
+bool RTCEngine::Init(
+    const RTCManagerConfig& config,
     rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
     std::unique_ptr<webrtc::TaskQueueFactory> task_queue_factory,
     std::unique_ptr<rtc::Thread> signaling_thread,
     std::unique_ptr<rtc::Thread> worker_thread) {
-  config_ = config;
-  receiver_ = receiver;
-
   rtc::InitializeSSL();
 
+  // field trial は PeerConnectionFactory を作る前に設定する必要がある。
+  // 渡した文字列はプロセスが終わるまで参照されるので、static に持っておく
+  std::string config_field_trials = config.field_trials;
+  // 映像の遅延の上限は受信側の API が無いので、playout-delay 拡張を受け取った時と
+  // 同じように field trial で上書きする
+  // VP9 の SVC は m88 ではレイヤー数を指定する API が無く、field trial でだけ有効にできる
+  if (config.vp9_spatial_layers > 0) {
+    config_field_trials += "WebRTC-SupportVP9SVC/EnabledByFlag_" +
+                           std::to_string(config.vp9_spatial_layers) + "SL" +
+                           std::to_string(config.vp9_temporal_layers) + "TL/";
+  }
+  if (config.video_playout_delay_max_ms >= 0) {
+    config_field_trials +=
+        "WebRTC-ForcePlayoutDelay/min_ms:" +
+        std::to_string(std::max(config.video_playout_delay_min_ms, 0)) +
+        ",max_ms:" + std::to_string(config.video_playout_delay_max_ms) + "/";
+  }
+  // FlexFEC と音声の RED は m88 では field trial を有効にしないと SDP に含まれない。
+  // 実際に使うかどうかは接続ごとのコーデックの優先順位で決める
+  if (config.video_fec == RTCManagerConfig::VideoFec::kFlexfec) {
+    config_field_trials +=
+        "WebRTC-FlexFEC-03/Enabled/WebRTC-FlexFEC-03-Advertised/Enabled/";
+  }
+  if (config.audio_red) {
+    config_field_trials += "WebRTC-Audio-Red-For-Opus/Enabled/";
+  }
+  if (!config_field_trials.empty()) {
+    static std::string field_trials;
+    if (field_trials.empty()) {
+      field_trials = config_field_trials;
+      webrtc::field_trial::InitFieldTrialsFromString(field_trials.c_str());
+      RTC_LOG(LS_INFO) << "Field trials: " << field_trials;
+    } else if (field_trials != config_field_trials) {
+      RTC_LOG(LS_WARNING) << "Field trials are already initialized, ignored: "
+                          << config_field_trials;
+    }
+  }
+
   network_thread_ = rtc::Thread::CreateWithSocketServer();
   network_thread_->Start();
   worker_thread_ = std::move(worker_thread);
   signaling_thread_ = std::move(signaling_thread);
   signaling_thread_->Start();
+  ApplyThreadConfig(network_thread_.get(), "Sora Network Thread",
+                    config.network_thread_config);
+  ApplyThreadConfig(worker_thread_.get(), "Sora Worker Thread",
+                    config.worker_thread_config);
+  ApplyThreadConfig(signaling_thread_.get(), "Sora Signaling Thread",
+                    config.signaling_thread_config);
 
   webrtc::PeerConnectionFactoryDependencies dependencies;
   dependencies.network_thread = network_thread_.get();
@@ -105,24 +183,67 @@ bool RTCManager::Init(
 
   media_dependencies.audio_encoder_factory =
       webrtc::CreateBuiltinAudioEncoderFactory();
+  if (config.audio_opus_complexity >= 0) {
+    RTC_LOG(LS_INFO) << "Opus complexity: " << config.audio_opus_complexity;
+    media_dependencies.audio_encoder_factory =
+        new rtc::RefCountedObject<OpusComplexityAudioEncoderFactory>(
+            media_dependencies.audio_encoder_factory,
+            std::min(config.audio_opus_complexity, 10));
+  }
   media_dependencies.audio_decoder_factory =
       webrtc::CreateBuiltinAudioDecoderFactory();
+  if (config.audio_only) {
+    // 映像のファクトリが無い場合、映像のコーデックは 1 つも無いことになる
+    RTC_LOG(LS_INFO) << __FUNCTION__ << ": audio only";
+  } else {
 #if defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
-  media_dependencies.video_encoder_factory = CreateObjCEncoderFactory();
-  media_dependencies.video_decoder_factory = CreateObjCDecoderFactory();
+    media_dependencies.video_encoder_factory = CreateObjCEncoderFactory();
+    media_dependencies.video_decoder_factory = CreateObjCDecoderFactory();
 #elif defined(SORA_UNITY_SDK_ANDROID)
-  JNIEnv* jni = webrtc::AttachCurrentThreadIfNeeded();
-  media_dependencies.video_encoder_factory = CreateAndroidEncoderFactory(jni);
-  media_dependencies.video_decoder_factory = CreateAndroidDecoderFactory(jni);
+    JNIEnv* jni = webrtc::AttachCurrentThreadIfNeeded();
+    media_dependencies.video_encoder_factory =
+        CreateAndroidEncoderFactory(jni);
+    media_dependencies.video_decoder_factory =
+        CreateAndroidDecoderFactory(jni, config.video_decoder_texture_output);
+#elif defined(SORA_UNITY_SDK_WINDOWS)
+    media_dependencies.video_encoder_factory =
+        absl::make_unique<HWVideoEncoderFactory>(
+            config.video_encoder_output_delay,
+            config.video_encoder_intra_refresh, config.video_encoder_threads,
+            config.gpu_adapter_luid, config.video_encoded_input);
+    media_dependencies.video_decoder_factory =
+        absl::make_unique<HWVideoDecoderFactory>(
+            config.video_decoder_texture_device,
+            config.video_decoder_async_output, config.gpu_adapter_luid);
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+    media_dependencies.video_encoder_factory =
+        absl::make_unique<HWVideoEncoderFactory>(
+            config.video_encoder_output_delay,
+            config.video_encoder_intra_refresh, config.video_encoder_threads,
+            config.video_encoded_input);
+    media_dependencies.video_decoder_factory =
+        absl::make_unique<HWVideoDecoderFactory>(
+            config.video_decoder_async_output);
 #else
-  media_dependencies.video_encoder_factory =
-      absl::make_unique<HWVideoEncoderFactory>();
-  media_dependencies.video_decoder_factory =
-      absl::make_unique<HWVideoDecoderFactory>();
+    media_dependencies.video_encoder_factory =
+        absl::make_unique<HWVideoEncoderFactory>(
+            config.video_encoder_output_delay,
+            config.video_encoder_intra_refresh, config.video_encoder_threads);
+    media_dependencies.video_decoder_factory =
+        absl::make_unique<HWVideoDecoderFactory>();
 #endif
+    if (config.simulcast) {
+      media_dependencies.video_encoder_factory =
+          absl::make_unique<SimulcastEncoderFactory>(
+              std::move(media_dependencies.video_encoder_factory));
+    }
+  }
   media_dependencies.audio_mixer = nullptr;
+  // 音声処理が不要な場合は AudioProcessing を作らず、10 ミリ秒ごとの処理を丸ごと飛ばす
   media_dependencies.audio_processing =
-      webrtc::AudioProcessingBuilder().Create();
+      config.disable_audio_processing
+          ? nullptr
+          : webrtc::AudioProcessingBuilder().Create();
 
   dependencies.media_engine =
       cricket::CreateMediaEngine(std::move(media_dependencies));
@@ -146,6 +267,72 @@ bool RTCManager::Init(
   factory_options.ssl_max_version = rtc::SSL_PROTOCOL_DTLS_12;
   factory_->SetOptions(factory_options);
 
+  return true;
+}
+
+RTCEngine::~RTCEngine() {
+  factory_ = nullptr;
+  network_thread_->Stop();
+  worker_thread_->Stop();
+  signaling_thread_->Stop();
+
+  rtc::CleanupSSL();
+}
+
+webrtc::PeerConnectionFactoryInterface* RTCEngine::factory() const {
+  return factory_.get();
+}
+
+rtc::Thread* RTCEngine::signaling_thread() const {
+  return signaling_thread_.get();
+}
+
+rtc::Thread* RTCEngine::worker_thread() const {
+  return worker_thread_.get();
+}
+
+std::unique_ptr<RTCManager> RTCManager::Create(
+    RTCManagerConfig config,
+    rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
+    VideoTrackReceiver* receiver,
+    rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
+    std::unique_ptr<webrtc::TaskQueueFactory> task_queue_factory,
+    std::unique_ptr<rtc::Thread> signaling_thread,
+    std::unique_ptr<rtc::Thread> worker_thread) {
+  std::shared_ptr<RTCEngine> engine =
+      RTCEngine::Create(config, adm, std::move(task_queue_factory),
+                        std::move(signaling_thread), std::move(worker_thread));
+  if (engine == nullptr) {
+    return nullptr;
+  }
+  return Create(config, std::move(video_track_source), receiver,
+                std::move(engine));
+}
+
+std::unique_ptr<RTCManager> RTCManager::Create(
+    RTCManagerConfig config,
+    rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
+    VideoTrackReceiver* receiver,
+    std::shared_ptr<RTCEngine> engine) {
+  std::unique_ptr<RTCManager> p(new RTCManager());
+  if (!p->Init(config, video_track_source, receiver, std::move(engine))) {
+    return nullptr;
+  }
+  return p;
+}
+
+RTCManager::RTCManager() {}
+
+bool RTCManager::Init(
+    RTCManagerConfig config,
+    rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
+    VideoTrackReceiver* receiver,
+    std::shared_ptr<RTCEngine> engine) {
+  config_ = config;
+  receiver_ = receiver;
+  engine_ = std::move(engine);
+  factory_ = engine_->factory();
+
   if (!config_.no_recording) {
     cricket::AudioOptions ao;
     if (config_.disable_echo_cancellation)
@@ -169,8 +356,9 @@ bool RTCManager::Init(
 
   if (video_track_source && !config_.no_video) {
     rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> video_source =
-        webrtc::VideoTrackSourceProxy::Create(
-            signaling_thread_.get(), worker_thread_.get(), video_track_source);
+        webrtc::VideoTrackSourceProxy::Create(engine_->signaling_thread(),
+                                              engine_->worker_thread(),
+                                              video_track_source);
     video_track_ =
         factory_->CreateVideoTrack(GenerateRandomChars(), video_source);
     if (video_track_) {
@@ -178,7 +366,7 @@ bool RTCManager::Init(
         video_track_->set_content_hint(
             webrtc::VideoTrackInterface::ContentHint::kText);
       }
-      if (receiver != nullptr) {
+      if (receiver != nullptr && config_.local_preview) {
         receiver->AddTrack(video_track_.get());
       }
     } else {
@@ -186,10 +374,19 @@ bool RTCManager::Init(
       return false;
     }
   }
+
+  if (!config_.recording_directory.empty()) {
+    recorder_ = EncodedFrameRecorder::Create(config_.recording_directory,
+                                             config_.recording_codec,
+                                             config_.recording_max_buffer_bytes);
+    if (recorder_ == nullptr) {
+      return false;
+    }
+  }
   return true;
 }
 
-bool RTCManager::InitADM(rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
+bool RTCEngine::InitADM(rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
                          std::string audio_recording_device,
                          std::string audio_playout_device) {
   // 録音デバイスと再生デバイスを指定する
@@ -273,12 +470,28 @@ bool RTCManager::InitADM(rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
 RTCManager::~RTCManager() {
   audio_track_ = nullptr;
   video_track_ = nullptr;
+  recorder_ = nullptr;
   factory_ = nullptr;
-  network_thread_->Stop();
-  worker_thread_->Stop();
-  signaling_thread_->Stop();
+  // 最後の RTCManager の場合は、ここでスレッドと PeerConnectionFactory が破棄される
+  engine_ = nullptr;
+}
 
-  rtc::CleanupSSL();
+void RTCManager::SetAudioTrackReceiver(AudioTrackReceiver* audio_receiver) {
+  audio_receiver_ = audio_receiver;
+}
+
+void RTCManager::WarmUpCodecs() {
+  if (config_.audio_only) {
+    return;
+  }
+  webrtc::RtpCapabilities sender_capabilities =
+      factory_->GetRtpSenderCapabilities(cricket::MEDIA_TYPE_VIDEO);
+  webrtc::RtpCapabilities receiver_capabilities =
+      factory_->GetRtpReceiverCapabilities(cricket::MEDIA_TYPE_VIDEO);
+  RTC_LOG(LS_INFO) << __FUNCTION__
+                   << ": sender_codecs=" << sender_capabilities.codecs.size()
+                   << " receiver_codecs="
+                   << receiver_capabilities.codecs.size();
 }
 
 std::shared_ptr<RTCConnection> RTCManager::createConnection(
@@ -286,8 +499,20 @@ std::shared_ptr<RTCConnection> RTCManager::createConnection(
     RTCMessageSender* sender) {
   rtc_config.enable_dtls_srtp = true;
   rtc_config.sdp_semantics = webrtc::SdpSemantics::kUnifiedPlan;
-  std::unique_ptr<PeerConnectionObserver> observer(
-      new PeerConnectionObserver(sender, receiver_));
+  if (config_.audio_jitter_buffer_min_delay_ms >= 0) {
+    rtc_config.audio_jitter_buffer_min_delay_ms =
+        config_.audio_jitter_buffer_min_delay_ms;
+  }
+  if (config_.audio_jitter_buffer_max_packets > 0) {
+    rtc_config.audio_jitter_buffer_max_packets =
+        config_.audio_jitter_buffer_max_packets;
+  }
+  rtc_config.audio_jitter_buffer_fast_accelerate =
+      config_.audio_jitter_buffer_fast_accelerate;
+  std::unique_ptr<PeerConnectionObserver> observer(new PeerConnectionObserver(
+      sender, receiver_, audio_receiver_,
+      recorder_ ? recorder_->CreateTransformer("recv") : nullptr));
+  observer->SetVideoMinimumDelay(config_.video_playout_delay_min_ms);
   webrtc::PeerConnectionDependencies dependencies(observer.get());
 
   // WebRTC の SSL 接続の検証は自前のルート証明書(rtc_base/ssl_roots.h)でやっていて、
@@ -304,6 +529,25 @@ std::shared_ptr<RTCConnection> RTCManager::createConnection(
     return nullptr;
   }
 
+  if (config_.start_bitrate_kbps > 0 || config_.min_bitrate_kbps > 0 ||
+      config_.max_bitrate_kbps > 0) {
+    webrtc::BitrateSettings bitrate;
+    if (config_.min_bitrate_kbps > 0) {
+      bitrate.min_bitrate_bps = config_.min_bitrate_kbps * 1000;
+    }
+    if (config_.start_bitrate_kbps > 0) {
+      bitrate.start_bitrate_bps = config_.start_bitrate_kbps * 1000;
+    }
+    if (config_.max_bitrate_kbps > 0) {
+      bitrate.max_bitrate_bps = config_.max_bitrate_kbps * 1000;
+    }
+    webrtc::RTCError error = connection->SetBitrate(bitrate);
+    if (!error.ok()) {
+      RTC_LOG(LS_WARNING) << __FUNCTION__
+                          << ": SetBitrate failed: " << error.message();
+    }
+  }
+
   std::string stream_id = GenerateRandomChars();
 
   if (audio_track_) {
@@ -323,13 +567,77 @@ std::shared_ptr<RTCConnection> RTCManager::createConnection(
       webrtc::RtpParameters parameters = video_sender->GetParameters();
       parameters.degradation_preference = config_.priority;
       video_sender->SetParameters(parameters);
+      if (recorder_) {
+        video_sender->SetEncoderToPacketizerFrameTransformer(
+            recorder_->CreateTransformer("send"));
+      }
     } else {
       RTC_LOG(LS_WARNING) << __FUNCTION__ << ": Cannot add video_track_";
     }
   }
 
-  return std::make_shared<RTCConnection>(sender, std::move(observer),
-                                         connection);
+  auto rtc_connection = std::make_shared<RTCConnection>(
+      sender, std::move(observer), connection);
+  if (config_.video_fec != RTCManagerConfig::VideoFec::kDefault) {
+    rtc_connection->SetCodecPreferences(cricket::MEDIA_TYPE_VIDEO,
+                                        GetVideoCodecPreferences());
+  }
+  if (config_.audio_red) {
+    rtc_connection->SetCodecPreferences(cricket::MEDIA_TYPE_AUDIO,
+                                        GetAudioCodecPreferences());
+  }
+  return rtc_connection;
+}
+
+std::vector<webrtc::RtpCodecCapability>
+RTCManager::GetVideoCodecPreferences() {
+  // 使わない FEC を取り除く。ULPFEC は RED に包んで送るので RED も一緒に扱う
+  bool ulpfec = config_.video_fec == RTCManagerConfig::VideoFec::kUlpfec;
+  bool flexfec = config_.video_fec == RTCManagerConfig::VideoFec::kFlexfec;
+  bool found = false;
+  std::vector<webrtc::RtpCodecCapability> codecs;
+  for (const auto& codec :
+       factory_->GetRtpReceiverCapabilities(cricket::MEDIA_TYPE_VIDEO).codecs) {
+    if (codec.name == cricket::kRedCodecName ||
+        codec.name == cricket::kUlpfecCodecName) {
+      if (!ulpfec) {
+        continue;
+      }
+      found = true;
+    } else if (codec.name == cricket::kFlexfecCodecName) {
+      if (!flexfec) {
+        continue;
+      }
+      found = true;
+    }
+    codecs.push_back(codec);
+  }
+  if ((ulpfec || flexfec) && !found) {
+    RTC_LOG(LS_WARNING) << __FUNCTION__
+                        << ": FEC codec is not supported, field trials may be "
+                           "initialized by another RTCEngine";
+  }
+  return codecs;
+}
+
+std::vector<webrtc::RtpCodecCapability>
+RTCManager::GetAudioCodecPreferences() {
+  // RED は先頭にある場合だけ送信に使われるので、先頭に移す
+  std::vector<webrtc::RtpCodecCapability> codecs;
+  for (const auto& codec :
+       factory_->GetRtpReceiverCapabilities(cricket::MEDIA_TYPE_AUDIO).codecs) {
+    if (codec.name == cricket::kRedCodecName) {
+      codecs.insert(codecs.begin(), codec);
+    } else {
+      codecs.push_back(codec);
+    }
+  }
+  if (codecs.empty() || codecs[0].name != cricket::kRedCodecName) {
+    RTC_LOG(LS_WARNING) << __FUNCTION__
+                        << ": RED is not supported, field trials may be "
+                           "initialized by another RTCEngine";
+  }
+  return codecs;
 }
 
 }  // namespace sora
@@ -6,14 +6,24 @@
 #include <api/video/video_frame.h>
 #include <pc/video_track_source.h>
 
+#if defined(SORA_UNITY_SDK_WINDOWS)
+#include <d3d11.h>
+#endif
+
+#include "encoded_frame_recorder.h"
 #include "rtc_connection.h"
+#include "thread_config.h"
 #include "scalable_track_source.h"
+#include "audio_track_receiver.h"
 #include "video_track_receiver.h"
 
 namespace sora {
 
 struct RTCManagerConfig {
   bool no_video = false;
+  // 映像を一切扱わない。映像のコーデックのファクトリを作らないので、
+  // NVENC などのライブラリの読み込みや対応コーデックの確認も行われない
+  bool audio_only = false;
   bool fixed_resolution = false;
 
   bool no_recording = false;
@@ -23,20 +33,138 @@ struct RTCManagerConfig {
   bool disable_noise_suppression = false;
   bool disable_highpass_filter = false;
   bool disable_typing_detection = false;
+  // AudioProcessing を作らず、送受信どちらの音声処理も行わない
+  bool disable_audio_processing = false;
 
   std::string audio_recording_device;
   std::string audio_playout_device;
 
+  // NVENC でエンコード中のフレームとは別に何フレームまで入力を受け付けるか
+  int video_encoder_output_delay = 0;
+  // NVENC でキーフレーム要求にイントラリフレッシュで応えるか
+  bool video_encoder_intra_refresh = false;
+  // libvpx のエンコーダに使わせる CPU のコア数。0 の場合は実際のコア数を使う。
+  // libvpx は解像度に応じて最大でこの数までのスレッドでエンコードする
+  int video_encoder_threads = 0;
+  // H.264 のエンコーダを、アプリがエンコードしたフレームをそのまま送るものにする。
+  // Windows と Ubuntu だけ対応していて、HW エンコーダが無くても H.264 を使える。
+  // エンコーダのファクトリに設定するので、RTCEngine を共有している場合は最初のものが使われる
+  bool video_encoded_input = false;
+  // VP9 を SVC で送る場合の空間レイヤーと時間レイヤーの数。0 の場合は SVC にしない。
+  // field trial で設定するので、プロセス全体で共通になる
+  int vp9_spatial_layers = 0;
+  int vp9_temporal_layers = 0;
+  // simulcast で送る。自前で simulcast に対応していないエンコーダも使えるようにする
+  bool simulcast = false;
+  // 送信する帯域の推定の開始値と範囲 (kbps)。0 の場合は WebRTC の既定値を使う。
+  // start を高めにすると、接続直後に映像が粗い時間が短くなる
+  int start_bitrate_kbps = 0;
+  int min_bitrate_kbps = 0;
+  int max_bitrate_kbps = 0;
+  // WebRTC の field trial の文字列。"WebRTC-Foo/Enabled/WebRTC-Bar/Disabled/" の形式。
+  // プロセス全体の設定なので、最初に作った RTCEngine のものだけが使われる
+  std::string field_trials;
+  // 送信する映像を receiver にも渡して、受信した映像と同じ方法で描画できるようにする。
+  // false の場合は自分の映像を描画しないので、そのための変換が行われない
+  bool local_preview = true;
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  // 指定すると NVDEC のデコード結果をこのデバイスのテクスチャに置いたまま渡す
+  ID3D11Device* video_decoder_texture_device = nullptr;
+#endif
+#if defined(SORA_UNITY_SDK_ANDROID)
+  // MediaCodec のデコード結果を SurfaceTexture に出力し、OES テクスチャのまま渡す
+  bool video_decoder_texture_output = false;
+#endif
+  // NVDEC の出力を別スレッドで行うか
+  bool video_decoder_async_output = false;
+  // 受信した映像を表示するまでの遅延の下限と上限 (ミリ秒)。-1 の場合は WebRTC に任せる。
+  // 下限は受信する映像ごとに設定し、上限は field trial で設定するのでプロセス全体で共通になる。
+  // 両方 0 にすると、ジッタバッファで待たずにデコードできたフレームからすぐに表示する
+  int video_playout_delay_min_ms = -1;
+  int video_playout_delay_max_ms = -1;
+  // 受信した音声のジッタバッファに溜める遅延の下限 (ミリ秒)。-1 の場合は WebRTC に任せる
+  int audio_jitter_buffer_min_delay_ms = -1;
+  // 音声のジッタバッファに溜まりすぎた場合に早送りして遅延を減らす
+  bool audio_jitter_buffer_fast_accelerate = false;
+  // 音声のジッタバッファに溜められるパケット数。0 の場合は WebRTC に任せる
+  int audio_jitter_buffer_max_packets = 0;
+  // 送信する Opus の符号化の複雑さ (0-10)。-1 の場合は WebRTC に任せる。
+  // 下げると音質と引き換えにエンコードの CPU 負荷が下がる。
+  // エンコーダのファクトリに設定するので、RTCEngine を共有している場合は最初のものが使われる
+  int audio_opus_complexity = -1;
+  // 受信と送信に使う映像の FEC。kDefault の場合は offer と WebRTC の既定のまま変更しない。
+  // FlexFEC は field trial で有効にするので、RTCEngine を共有している場合は最初のものが使われる
+  enum class VideoFec { kDefault, kNone, kUlpfec, kFlexfec };
+  VideoFec video_fec = VideoFec::kDefault;
+  // Opus を RED で冗長化して送る。前のパケットの音声を次のパケットにも入れるので、
+  // 1 パケットのロスなら再送を待たずに復元できる。
+  // field trial で有効にするので、RTCEngine を共有している場合は最初のものが使われる
+  bool audio_red = false;
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  // NVENC と NVDEC を動かすアダプタ。0 の場合は最初のアダプタを使う
+  LUID gpu_adapter_luid = {};
+#endif
+
+  // 指定するとエンコード済みの映像をストリームごとにこのディレクトリの IVF ファイルに書き出す。
+  // 送信はエンコーダの後、受信はデコーダの前のフレームを書くので、再エンコードしない
+  std::string recording_directory;
+  // recording_directory の場合の映像のコーデックと、書き込み待ちにしておける最大のバイト数
+  std::string recording_codec;
+  size_t recording_max_buffer_bytes = 32 * 1024 * 1024;
+
   // webrtc::DegradationPreference::MAINTAIN_RESOLUTION;
   // webrtc::DegradationPreference::MAINTAIN_FRAMERATE;
   webrtc::DegradationPreference priority =
       webrtc::DegradationPreference::BALANCED;
 
   bool insecure = false;
+
+  // SDK が作るスレッドの優先度と CPU
+  ThreadConfig network_thread_config;
+  ThreadConfig worker_thread_config;
+  ThreadConfig signaling_thread_config;
+  ThreadConfig audio_playout_thread_config =
+      ThreadConfig(ThreadConfig::Priority::Realtime);
+  ThreadConfig audio_recording_thread_config =
+      ThreadConfig(ThreadConfig::Priority::High);
+};
+
+// PeerConnectionFactory と、それが使うスレッドや ADM、コーデックのファクトリ。
+// 複数の RTCManager で共有できる。コーデックや ADM の設定は作った時の config のものになる
+class RTCEngine {
+ public:
+  static std::shared_ptr<RTCEngine> Create(
+      const RTCManagerConfig& config,
+      rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
+      std::unique_ptr<webrtc::TaskQueueFactory> task_queue_factory,
+      std::unique_ptr<rtc::Thread> signaling_thread,
+      std::unique_ptr<rtc::Thread> worker_thread);
+  ~RTCEngine();
+
+  webrtc::PeerConnectionFactoryInterface* factory() const;
+  rtc::Thread* signaling_thread() const;
+  rtc::Thread* worker_thread() const;
+
+ private:
+  RTCEngine();
+  bool Init(const RTCManagerConfig& config,
+            rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
+            std::unique_ptr<webrtc::TaskQueueFactory> task_queue_factory,
+            std::unique_ptr<rtc::Thread> signaling_thread,
+            std::unique_ptr<rtc::Thread> worker_thread);
+  static bool InitADM(rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
+                      std::string audio_recording_device,
+                      std::string audio_playout_device);
+
+  rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> factory_;
+  std::unique_ptr<rtc::Thread> network_thread_;
+  std::unique_ptr<rtc::Thread> worker_thread_;
+  std::unique_ptr<rtc::Thread> signaling_thread_;
 };
 
 class RTCManager {
  public:
+  // RTCEngine を作って、この RTCManager だけで使う
   static std::unique_ptr<RTCManager> Create(
       RTCManagerConfig config,
       rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
@@ -45,16 +173,19 @@ class RTCManager {
       std::unique_ptr<webrtc::TaskQueueFactory> task_queue_factory,
       std::unique_ptr<rtc::Thread> signaling_thread,
       std::unique_ptr<rtc::Thread> worker_thread);
+  // 既にある RTCEngine を使う
+  static std::unique_ptr<RTCManager> Create(
+      RTCManagerConfig config,
+      rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
+      VideoTrackReceiver* receiver,
+      std::shared_ptr<RTCEngine> engine);
 
  private:
   RTCManager();
   bool Init(RTCManagerConfig config,
             rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> video_track_source,
             VideoTrackReceiver* receiver,
-            rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
-            std::unique_ptr<webrtc::TaskQueueFactory> task_queue_factory,
-            std::unique_ptr<rtc::Thread> signaling_thread,
-            std::unique_ptr<rtc::Thread> worker_thread);
+            std::shared_ptr<RTCEngine> engine);
 
  public:
   ~RTCManager();
@@ -62,19 +193,27 @@ class RTCManager {
       webrtc::PeerConnectionInterface::RTCConfiguration rtc_config,
       RTCMessageSender* sender);
 
- private:
-  static bool InitADM(rtc::scoped_refptr<webrtc::AudioDeviceModule> adm,
-                      std::string audio_recording_device,
-                      std::string audio_playout_device);
+  // 受信した音声をトラックごとに受け取る場合に設定する。
+  // createConnection より前に呼ぶこと
+  void SetAudioTrackReceiver(AudioTrackReceiver* audio_receiver);
+
+  // 対応しているコーデックを先に調べておく。
+  // NVENC などはここで初めてライブラリを読み込むので、最初の offer に答えるまでの時間が減る
+  void WarmUpCodecs();
 
  private:
+  // video_fec と audio_red に合わせて受信できるコーデックを並べ替えたもの
+  std::vector<webrtc::RtpCodecCapability> GetVideoCodecPreferences();
+  std::vector<webrtc::RtpCodecCapability> GetAudioCodecPreferences();
+
+  std::shared_ptr<RTCEngine> engine_;
   rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> factory_;
   rtc::scoped_refptr<webrtc::AudioTrackInterface> audio_track_;
   rtc::scoped_refptr<webrtc::VideoTrackInterface> video_track_;
   VideoTrackReceiver* receiver_;
-  std::unique_ptr<rtc::Thread> network_thread_;
-  std::unique_ptr<rtc::Thread> worker_thread_;
-  std::unique_ptr<rtc::Thread> signaling_thread_;
+  AudioTrackReceiver* audio_receiver_ = nullptr;
+  // recording_directory の場合だけ作る。FrameTransformer が持っているので接続より長く生きる
+  std::shared_ptr<EncodedFrameRecorder> recorder_;
   RTCManagerConfig config_;
 };
 
@@ -15,6 +15,9 @@ class RTCMessageSender {
   virtual void OnIceCandidate(const std::string sdp_mid,
                               const int sdp_mlineindex,
                               const std::string sdp) = 0;
+  // Sora が作った DataChannel を受け取る
+  virtual void OnDataChannel(
+      rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel) {}
 };
 
 }  // namespace sora
@@ -18,6 +18,7 @@
 #include "api/video/video_rotation.h"
 #include "libyuv.h"
 #include "native_buffer.h"
+#include "../perf_counters.h"
 #include "rtc_base/logging.h"
 
 namespace sora {
@@ -44,62 +45,104 @@ bool ScalableVideoTrackSource::remote() const {
 }
 
 void ScalableVideoTrackSource::OnCapturedFrame(
-    const webrtc::VideoFrame& video_frame) {
-  webrtc::VideoFrame frame = video_frame;
-
+    const webrtc::VideoFrame& frame) {
+  ScopedPerfTimer timer(PerfStage::kSourceCapturedFrame);
   const int64_t timestamp_us = frame.timestamp_us();
-  const int64_t translated_timestamp_us =
-      timestamp_aligner_.TranslateTimestamp(timestamp_us, rtc::TimeMicros());
-
-  // 回転が必要
-  if (frame.rotation() != webrtc::kVideoRotation_0) {
-    int width;
-    int height;
-    libyuv::RotationMode mode;
-    switch (frame.rotation()) {
-      case webrtc::kVideoRotation_180:
-        width = frame.width();
-        height = frame.height();
-        mode = libyuv::kRotate180;
-        break;
-      case webrtc::kVideoRotation_90:
-        width = frame.height();
-        height = frame.width();
-        mode = libyuv::kRotate90;
-        break;
-      case webrtc::kVideoRotation_270:
-      default:
-        width = frame.height();
-        height = frame.width();
-        mode = libyuv::kRotate270;
-        break;
-    }
-
-    rtc::scoped_refptr<webrtc::I420Buffer> rotated =
-        webrtc::I420Buffer::Create(width, height);
-    rtc::scoped_refptr<webrtc::I420BufferInterface> src =
-        frame.video_frame_buffer()->ToI420();
-    libyuv::I420Rotate(src->DataY(), src->StrideY(), src->DataU(),
-                       src->StrideU(), src->DataV(), src->StrideV(),
-                       rotated->MutableDataY(), rotated->StrideY(),
-                       rotated->MutableDataU(), rotated->StrideU(),
-                       rotated->MutableDataV(), rotated->StrideV(),
-                       frame.width(), frame.height(), mode);
-    frame.set_video_frame_buffer(rotated);
-    frame.set_rotation(webrtc::kVideoRotation_0);
+
+  // 回転後の解像度で AdaptFrame する
+  int width;
+  int height;
+  libyuv::RotationMode mode;
+  switch (frame.rotation()) {
+    case webrtc::kVideoRotation_0:
+      width = frame.width();
+      height = frame.height();
+      mode = libyuv::kRotate0;
+      break;
+    case webrtc::kVideoRotation_180:
+      width = frame.width();
+      height = frame.height();
+      mode = libyuv::kRotate180;
+      break;
+    case webrtc::kVideoRotation_90:
+      width = frame.height();
+      height = frame.width();
+      mode = libyuv::kRotate90;
+      break;
+    case webrtc::kVideoRotation_270:
+    default:
+      width = frame.height();
+      height = frame.width();
+      mode = libyuv::kRotate270;
+      break;
   }
 
   int adapted_width;
   int adapted_height;
+  if (!AdaptCapturedFrame(width, height, timestamp_us, &adapted_width,
+                          &adapted_height)) {
+    return;
+  }
+
+  if (mode == libyuv::kRotate0) {
+    OnAdaptedFrame(frame, adapted_width, adapted_height);
+    return;
+  }
+
+  // 回転が必要な場合は、先に小さい解像度に縮小してから回転する
+  int scaled_width = adapted_width;
+  int scaled_height = adapted_height;
+  if (mode != libyuv::kRotate180) {
+    std::swap(scaled_width, scaled_height);
+  }
+
+  rtc::scoped_refptr<webrtc::I420BufferInterface> src =
+      frame.video_frame_buffer()->ToI420();
+  if (!src) {
+    return;
+  }
+  if (scaled_width != src->width() || scaled_height != src->height()) {
+    rtc::scoped_refptr<webrtc::I420Buffer> scaled =
+        CreatePooledBuffer(scale_buffer_pool_, scaled_width, scaled_height);
+    scaled->ScaleFrom(*src);
+    src = scaled;
+  }
+
+  rtc::scoped_refptr<webrtc::I420Buffer> rotated =
+      CreatePooledBuffer(buffer_pool_, adapted_width, adapted_height);
+  libyuv::I420Rotate(src->DataY(), src->StrideY(), src->DataU(),
+                     src->StrideU(), src->DataV(), src->StrideV(),
+                     rotated->MutableDataY(), rotated->StrideY(),
+                     rotated->MutableDataU(), rotated->StrideU(),
+                     rotated->MutableDataV(), rotated->StrideV(),
+                     src->width(), src->height(), mode);
+
+  OnAdaptedFrame(webrtc::VideoFrame::Builder()
+                     .set_video_frame_buffer(rotated)
+                     .set_rotation(webrtc::kVideoRotation_0)
+                     .set_timestamp_us(timestamp_us)
+                     .build(),
+                 adapted_width, adapted_height);
+}
+
+bool ScalableVideoTrackSource::AdaptCapturedFrame(int width,
+                                                  int height,
+                                                  int64_t timestamp_us,
+                                                  int* adapted_width,
+                                                  int* adapted_height) {
   int crop_width;
   int crop_height;
   int crop_x;
   int crop_y;
-  if (!AdaptFrame(frame.width(), frame.height(), timestamp_us, &adapted_width,
-                  &adapted_height, &crop_width, &crop_height, &crop_x,
-                  &crop_y)) {
-    return;
-  }
+  return AdaptFrame(width, height, timestamp_us, adapted_width, adapted_height,
+                    &crop_width, &crop_height, &crop_x, &crop_y);
+}
+
+void ScalableVideoTrackSource::OnAdaptedFrame(const webrtc::VideoFrame& frame,
+                                              int adapted_width,
+                                              int adapted_height) {
+  const int64_t translated_timestamp_us = timestamp_aligner_.TranslateTimestamp(
+      frame.timestamp_us(), rtc::TimeMicros());
 
   if (useNativeBuffer() && frame.video_frame_buffer()->type() ==
                                webrtc::VideoFrameBuffer::Type::kNative) {
@@ -117,7 +160,7 @@ void ScalableVideoTrackSource::OnCapturedFrame(
     // Video adapter has requested a down-scale. Allocate a new buffer and
     // return scaled version.
     rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
-        webrtc::I420Buffer::Create(adapted_width, adapted_height);
+        CreatePooledBuffer(buffer_pool_, adapted_width, adapted_height);
     i420_buffer->ScaleFrom(*buffer->ToI420());
     buffer = i420_buffer;
   }
@@ -129,4 +172,20 @@ void ScalableVideoTrackSource::OnCapturedFrame(
               .build());
 }
 
+rtc::scoped_refptr<webrtc::I420Buffer>
+ScalableVideoTrackSource::CreatePooledBuffer(webrtc::VideoFrameBufferPool& pool,
+                                             int width,
+                                             int height) {
+  std::lock_guard<std::mutex> guard(pool_mutex_);
+  rtc::scoped_refptr<webrtc::I420Buffer> buffer =
+      pool.CreateI420Buffer(width, height);
+  if (!buffer) {
+    // エンコーダ側で詰まっていてプールが全て使用中なので、新しく確保する
+    RTC_LOG(LS_VERBOSE) << "Buffer pool is exhausted: width=" << width
+                        << " height=" << height;
+    buffer = webrtc::I420Buffer::Create(width, height);
+  }
+  return buffer;
+}
+
 }  // namespace sora
@@ -13,7 +13,10 @@
 #include <stddef.h>
 
 #include <memory>
+#include <mutex>
 
+#include "api/video/i420_buffer.h"
+#include "common_video/include/video_frame_buffer_pool.h"
 #include "media/base/adapted_video_track_source.h"
 #include "media/base/video_adapter.h"
 #include "rtc_base/timestamp_aligner.h"
@@ -32,9 +35,36 @@ class ScalableVideoTrackSource : public rtc::AdaptedVideoTrackSource {
   void OnCapturedFrame(const webrtc::VideoFrame& frame);
   virtual bool useNativeBuffer() { return false; }
 
+  // フレームを作る前に、そのフレームを使うかどうかと使う場合の解像度を調べる。
+  // true を返した場合だけフレームを作って OnAdaptedFrame に渡すこと。
+  // フレームレートを落としている場合などに、GPU からの読み出しを省略できる。
+  bool AdaptCapturedFrame(int width,
+                          int height,
+                          int64_t timestamp_us,
+                          int* adapted_width,
+                          int* adapted_height);
+  // AdaptCapturedFrame で使うと決めたフレームを渡す。
+  // adapted_width, adapted_height とサイズが違う場合はここで縮小する。
+  void OnAdaptedFrame(const webrtc::VideoFrame& frame,
+                      int adapted_width,
+                      int adapted_height);
+
  private:
+  // 回転や縮小で使うバッファは毎フレーム確保しないようにプールから取り出す。
+  // 空いていない場合は新しく確保する。
+  rtc::scoped_refptr<webrtc::I420Buffer> CreatePooledBuffer(
+      webrtc::VideoFrameBufferPool& pool,
+      int width,
+      int height);
+
   rtc::TimestampAligner timestamp_aligner_;
 
+  std::mutex pool_mutex_;
+  // 送信するフレーム用
+  webrtc::VideoFrameBufferPool buffer_pool_{false, 8};
+  // 回転前の縮小用。すぐに解放されるので少なくて良い
+  webrtc::VideoFrameBufferPool scale_buffer_pool_{false, 2};
+
   cricket::VideoAdapter video_adapter_;
 };
 
@@ -0,0 +1,26 @@
+#include "simulcast_encoder_factory.h"
+
+#include "absl/memory/memory.h"
+#include "media/engine/encoder_simulcast_proxy.h"
+
+namespace sora {
+
+SimulcastEncoderFactory::SimulcastEncoderFactory(
+    std::unique_ptr<webrtc::VideoEncoderFactory> internal_factory)
+    : internal_factory_(std::move(internal_factory)) {}
+
+std::vector<webrtc::SdpVideoFormat>
+SimulcastEncoderFactory::GetSupportedFormats() const {
+  return internal_factory_->GetSupportedFormats();
+}
+
+std::unique_ptr<webrtc::VideoEncoder>
+SimulcastEncoderFactory::CreateVideoEncoder(
+    const webrtc::SdpVideoFormat& format) {
+  // InitEncode で simulcast に対応していないと言われた場合だけ
+  // SimulcastEncoderAdapter に切り替わる
+  return absl::make_unique<webrtc::EncoderSimulcastProxy>(
+      internal_factory_.get(), format);
+}
+
+}  // namespace sora
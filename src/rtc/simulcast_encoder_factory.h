@@ -0,0 +1,34 @@
+#ifndef SORA_SIMULCAST_ENCODER_FACTORY_H_
+#define SORA_SIMULCAST_ENCODER_FACTORY_H_
+
+#include <memory>
+#include <vector>
+
+#include "api/video_codecs/sdp_video_format.h"
+#include "api/video_codecs/video_encoder.h"
+#include "api/video_codecs/video_encoder_factory.h"
+
+namespace sora {
+
+// simulcast で送る場合に使うエンコーダファクトリ。
+// エンコーダが自前で simulcast に対応していればそのまま使い
+// (libvpx の VP8 や NVENC)、対応していなければ
+// レイヤーごとにエンコーダを作る SimulcastEncoderAdapter で包む
+// (VideoToolbox や MediaCodec、VP9)。
+class SimulcastEncoderFactory : public webrtc::VideoEncoderFactory {
+ public:
+  explicit SimulcastEncoderFactory(
+      std::unique_ptr<webrtc::VideoEncoderFactory> internal_factory);
+
+  std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override;
+
+  std::unique_ptr<webrtc::VideoEncoder> CreateVideoEncoder(
+      const webrtc::SdpVideoFormat& format) override;
+
+ private:
+  const std::unique_ptr<webrtc::VideoEncoderFactory> internal_factory_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_SIMULCAST_ENCODER_FACTORY_H_
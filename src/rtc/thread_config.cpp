@@ -0,0 +1,171 @@
+#include "thread_config.h"
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+#include <windows.h>
+#elif defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#include <pthread.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "rtc_base/logging.h"
+#include "rtc_base/platform_thread_types.h"
+
+namespace sora {
+
+namespace {
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+
+bool SetPriority(ThreadConfig::Priority priority) {
+  int value = THREAD_PRIORITY_NORMAL;
+  switch (priority) {
+    case ThreadConfig::Priority::Low:
+      value = THREAD_PRIORITY_BELOW_NORMAL;
+      break;
+    case ThreadConfig::Priority::Normal:
+      value = THREAD_PRIORITY_NORMAL;
+      break;
+    case ThreadConfig::Priority::High:
+      value = THREAD_PRIORITY_HIGHEST;
+      break;
+    case ThreadConfig::Priority::Realtime:
+      value = THREAD_PRIORITY_TIME_CRITICAL;
+      break;
+    default:
+      return true;
+  }
+  return ::SetThreadPriority(::GetCurrentThread(), value) != FALSE;
+}
+
+bool SetAffinity(uint64_t mask) {
+  return ::SetThreadAffinityMask(::GetCurrentThread(), (DWORD_PTR)mask) != 0;
+}
+
+#elif defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
+
+// 10 ミリ秒ごとに 2 ミリ秒まで動けるようにする。CoreAudio の IO スレッドと同じ考え方
+bool SetRealtimePolicy() {
+  mach_timebase_info_data_t timebase;
+  mach_timebase_info(&timebase);
+  auto ms_to_abs = [&timebase](double ms) {
+    return (uint32_t)(ms * 1000000.0 * timebase.denom / timebase.numer);
+  };
+  thread_time_constraint_policy_data_t policy;
+  policy.period = ms_to_abs(10);
+  policy.computation = ms_to_abs(2);
+  policy.constraint = ms_to_abs(10);
+  policy.preemptible = 1;
+  return thread_policy_set(pthread_mach_thread_np(pthread_self()),
+                           THREAD_TIME_CONSTRAINT_POLICY,
+                           (thread_policy_t)&policy,
+                           THREAD_TIME_CONSTRAINT_POLICY_COUNT) ==
+         KERN_SUCCESS;
+}
+
+bool SetPriority(ThreadConfig::Priority priority) {
+  qos_class_t qos = QOS_CLASS_DEFAULT;
+  switch (priority) {
+    case ThreadConfig::Priority::Low:
+      qos = QOS_CLASS_UTILITY;
+      break;
+    case ThreadConfig::Priority::Normal:
+      qos = QOS_CLASS_DEFAULT;
+      break;
+    case ThreadConfig::Priority::High:
+      qos = QOS_CLASS_USER_INTERACTIVE;
+      break;
+    case ThreadConfig::Priority::Realtime:
+      if (SetRealtimePolicy()) {
+        return true;
+      }
+      RTC_LOG(LS_WARNING) << "Failed to set realtime policy, use high priority";
+      qos = QOS_CLASS_USER_INTERACTIVE;
+      break;
+    default:
+      return true;
+  }
+  return pthread_set_qos_class_self_np(qos, 0) == 0;
+}
+
+bool SetAffinity(uint64_t mask) {
+  RTC_LOG(LS_INFO) << "Thread affinity is not supported on this platform";
+  return true;
+}
+
+#else
+
+// nice 値。Android の ANDROID_PRIORITY_AUDIO は -16
+int GetNice(ThreadConfig::Priority priority) {
+  switch (priority) {
+    case ThreadConfig::Priority::Low:
+      return 10;
+    case ThreadConfig::Priority::High:
+      return -8;
+    case ThreadConfig::Priority::Realtime:
+      return -16;
+    default:
+      return 0;
+  }
+}
+
+bool SetPriority(ThreadConfig::Priority priority) {
+  if (priority == ThreadConfig::Priority::Default) {
+    return true;
+  }
+  if (priority == ThreadConfig::Priority::Realtime) {
+    sched_param param = {};
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0) {
+      return true;
+    }
+    // 通常は権限が無いので nice 値で上げる
+    RTC_LOG(LS_INFO) << "SCHED_FIFO is not permitted, use nice value";
+  }
+  // Linux では nice 値はスレッドごとに設定できる
+  return setpriority(PRIO_PROCESS, (id_t)rtc::CurrentThreadId(),
+                     GetNice(priority)) == 0;
+}
+
+bool SetAffinity(uint64_t mask) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i = 0; i < 64 && i < CPU_SETSIZE; i++) {
+    if (mask & ((uint64_t)1 << i)) {
+      CPU_SET(i, &set);
+    }
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+#endif
+
+}  // namespace
+
+void ApplyCurrentThreadConfig(const char* name, const ThreadConfig& config) {
+  rtc::SetCurrentThreadName(name);
+  if (!SetPriority(config.priority)) {
+    RTC_LOG(LS_WARNING) << "Failed to set thread priority: name=" << name
+                        << " priority=" << (int)config.priority;
+  }
+  if (config.affinity_mask != 0 && !SetAffinity(config.affinity_mask)) {
+    RTC_LOG(LS_WARNING) << "Failed to set thread affinity: name=" << name
+                        << " mask=" << config.affinity_mask;
+  }
+}
+
+void ApplyThreadConfig(rtc::Thread* thread,
+                       std::string name,
+                       const ThreadConfig& config) {
+  thread->PostTask(RTC_FROM_HERE, [name, config]() {
+    ApplyCurrentThreadConfig(name.c_str(), config);
+  });
+}
+
+}  // namespace sora
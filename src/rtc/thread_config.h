@@ -0,0 +1,46 @@
+#ifndef SORA_THREAD_CONFIG_H_
+#define SORA_THREAD_CONFIG_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "rtc_base/thread.h"
+
+namespace sora {
+
+// SDK が作るスレッドの優先度と、動かす CPU の設定
+struct ThreadConfig {
+  enum class Priority {
+    // OS の既定のまま変更しない
+    Default,
+    Low,
+    Normal,
+    High,
+    // 音声のように一定間隔で確実に動かしたいスレッド向け。
+    // 権限が無くて設定できない場合は High にする
+    Realtime,
+  };
+  Priority priority = Priority::Default;
+  // 動かしてもいい CPU のビットマスク。0 の場合は変更しない。
+  // big.LITTLE の端末で効率コアや性能コアに固定する場合に使う。
+  // macOS と iOS は対応していないので無視する
+  uint64_t affinity_mask = 0;
+
+  ThreadConfig() = default;
+  ThreadConfig(Priority priority, uint64_t affinity_mask = 0)
+      : priority(priority), affinity_mask(affinity_mask) {}
+};
+
+// 呼び出したスレッドに名前を付けて、config を適用する。
+// 失敗してもログを出すだけで続ける
+void ApplyCurrentThreadConfig(const char* name, const ThreadConfig& config);
+
+// thread で ApplyCurrentThreadConfig を呼ぶ。thread は開始済みであること
+void ApplyThreadConfig(rtc::Thread* thread,
+                       std::string name,
+                       const ThreadConfig& config);
+
+}  // namespace sora
+
+#endif  // SORA_THREAD_CONFIG_H_
@@ -0,0 +1,344 @@
+#include "v4l2_video_capturer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "api/video/i420_buffer.h"
+#include "api/video/nv12_buffer.h"
+#include "libyuv.h"
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+
+#include "native_buffer.h"
+
+namespace {
+
+const int kBufferCount = 4;
+const int kMaxDeviceCount = 64;
+
+int xioctl(int fd, unsigned long request, void* arg) {
+  int r;
+  do {
+    r = ioctl(fd, request, arg);
+  } while (r == -1 && errno == EINTR);
+  return r;
+}
+
+// 映像をキャプチャできるデバイスなら開いて返す
+int OpenCaptureDevice(const std::string& path, std::string* card) {
+  int fd = open(path.c_str(), O_RDWR | O_NONBLOCK, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  v4l2_capability cap = {};
+  if (xioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
+    close(fd);
+    return -1;
+  }
+  uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps
+                                                            : cap.capabilities;
+  if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+    close(fd);
+    return -1;
+  }
+  *card = (const char*)cap.card;
+  return fd;
+}
+
+}  // namespace
+
+namespace sora {
+
+V4L2VideoCapturer::V4L2VideoCapturer() {}
+
+V4L2VideoCapturer::~V4L2VideoCapturer() {
+  Destroy();
+}
+
+rtc::scoped_refptr<V4L2VideoCapturer> V4L2VideoCapturer::Create(
+    size_t width,
+    size_t height,
+    size_t target_fps,
+    std::string device_name,
+    bool native_frame) {
+  // デバイス名の指定が無い場合は最初に開けたものを使い、
+  // 指定がある場合はパスかカード名が一致したものを使う
+  for (int i = 0; i < kMaxDeviceCount; i++) {
+    std::string path = "/dev/video" + std::to_string(i);
+    std::string card;
+    int fd = OpenCaptureDevice(path, &card);
+    if (fd < 0) {
+      continue;
+    }
+    close(fd);
+    if (!device_name.empty() && device_name != path && device_name != card) {
+      continue;
+    }
+
+    rtc::scoped_refptr<V4L2VideoCapturer> capturer(
+        new rtc::RefCountedObject<V4L2VideoCapturer>());
+    if (capturer->Init(path, width, height, target_fps, native_frame)) {
+      return capturer;
+    }
+    RTC_LOG(LS_WARNING) << "Failed to create V4L2VideoCapturer: path=" << path
+                        << " card=" << card << " width=" << width
+                        << " height=" << height << " target_fps=" << target_fps;
+    if (!device_name.empty()) {
+      return nullptr;
+    }
+  }
+  RTC_LOG(LS_WARNING) << "No video capturer found: specified_device_name="
+                      << device_name;
+  return nullptr;
+}
+
+bool V4L2VideoCapturer::useNativeBuffer() {
+  return pixel_format_ == V4L2_PIX_FMT_MJPEG;
+}
+
+bool V4L2VideoCapturer::Init(const std::string& device_path,
+                             size_t width,
+                             size_t height,
+                             size_t target_fps,
+                             bool native_frame) {
+  std::string card;
+  fd_ = OpenCaptureDevice(device_path, &card);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  // NV12 はそのまま NV12Buffer で渡せる。
+  // MJPEG はエンコーダがデコードできる時だけ最初に選ぶ。
+  std::vector<uint32_t> candidates;
+  if (native_frame) {
+    candidates = {V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV,
+                  V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_UYVY};
+  } else {
+    candidates = {V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUYV,
+                  V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_MJPEG};
+  }
+  if (!SetFormat(candidates, width, height)) {
+    Destroy();
+    return false;
+  }
+
+  v4l2_streamparm parm = {};
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd_, VIDIOC_G_PARM, &parm) == 0 &&
+      (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = (uint32_t)target_fps;
+    if (xioctl(fd_, VIDIOC_S_PARM, &parm) < 0) {
+      RTC_LOG(LS_WARNING) << "VIDIOC_S_PARM failed: errno=" << errno;
+    }
+  }
+
+  if (!StartStreaming()) {
+    Destroy();
+    return false;
+  }
+
+  RTC_LOG(LS_INFO) << "V4L2VideoCapturer started: path=" << device_path
+                   << " card=" << card << " width=" << width_
+                   << " height=" << height_ << " format="
+                   << std::string((const char*)&pixel_format_, 4);
+  thread_.reset(new std::thread([this]() { CaptureThread(); }));
+  return true;
+}
+
+bool V4L2VideoCapturer::SetFormat(const std::vector<uint32_t>& candidates,
+                                  size_t width,
+                                  size_t height) {
+  std::vector<uint32_t> supported;
+  v4l2_fmtdesc desc = {};
+  desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  while (xioctl(fd_, VIDIOC_ENUM_FMT, &desc) == 0) {
+    supported.push_back(desc.pixelformat);
+    desc.index++;
+  }
+
+  for (uint32_t format : candidates) {
+    if (std::find(supported.begin(), supported.end(), format) ==
+        supported.end()) {
+      continue;
+    }
+    v4l2_format fmt = {};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = (uint32_t)width;
+    fmt.fmt.pix.height = (uint32_t)height;
+    fmt.fmt.pix.pixelformat = format;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0 ||
+        fmt.fmt.pix.pixelformat != format) {
+      continue;
+    }
+    // ドライバが近いサイズに変えることがある
+    pixel_format_ = format;
+    width_ = (int)fmt.fmt.pix.width;
+    height_ = (int)fmt.fmt.pix.height;
+    return true;
+  }
+  RTC_LOG(LS_ERROR) << "No supported pixel format";
+  return false;
+}
+
+bool V4L2VideoCapturer::StartStreaming() {
+  v4l2_requestbuffers req = {};
+  req.count = kBufferCount;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(fd_, VIDIOC_REQBUFS, &req) < 0 || req.count == 0) {
+    RTC_LOG(LS_ERROR) << "VIDIOC_REQBUFS failed: errno=" << errno;
+    return false;
+  }
+
+  for (uint32_t i = 0; i < req.count; i++) {
+    v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if (xioctl(fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+      RTC_LOG(LS_ERROR) << "VIDIOC_QUERYBUF failed: errno=" << errno;
+      return false;
+    }
+    Buffer buffer;
+    buffer.start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd_, buf.m.offset);
+    if (buffer.start == MAP_FAILED) {
+      RTC_LOG(LS_ERROR) << "mmap failed: errno=" << errno;
+      return false;
+    }
+    buffer.length = buf.length;
+    buffers_.push_back(buffer);
+    if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+      RTC_LOG(LS_ERROR) << "VIDIOC_QBUF failed: errno=" << errno;
+      return false;
+    }
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+    RTC_LOG(LS_ERROR) << "VIDIOC_STREAMON failed: errno=" << errno;
+    return false;
+  }
+  streaming_ = true;
+  return true;
+}
+
+void V4L2VideoCapturer::Destroy() {
+  quit_.store(true);
+  if (thread_) {
+    thread_->join();
+    thread_.reset();
+  }
+  if (streaming_) {
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(fd_, VIDIOC_STREAMOFF, &type);
+    streaming_ = false;
+  }
+  for (const Buffer& buffer : buffers_) {
+    munmap(buffer.start, buffer.length);
+  }
+  buffers_.clear();
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+void V4L2VideoCapturer::CaptureThread() {
+  while (!quit_.load()) {
+    pollfd fds = {};
+    fds.fd = fd_;
+    fds.events = POLLIN;
+    // 終了を確認できるように、タイムアウトを短めにしておく
+    int r = poll(&fds, 1, 100);
+    if (r < 0 && errno != EINTR) {
+      RTC_LOG(LS_ERROR) << "poll failed: errno=" << errno;
+      return;
+    }
+    if (r <= 0) {
+      continue;
+    }
+
+    v4l2_buffer buf = {};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd_, VIDIOC_DQBUF, &buf) < 0) {
+      if (errno != EAGAIN) {
+        RTC_LOG(LS_ERROR) << "VIDIOC_DQBUF failed: errno=" << errno;
+      }
+      continue;
+    }
+    if (!(buf.flags & V4L2_BUF_FLAG_ERROR)) {
+      OnCaptured((const uint8_t*)buffers_[buf.index].start, buf.bytesused);
+    }
+    if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+      RTC_LOG(LS_ERROR) << "VIDIOC_QBUF failed: errno=" << errno;
+    }
+  }
+}
+
+void V4L2VideoCapturer::OnCaptured(const uint8_t* data, size_t size) {
+  int64_t timestamp_us = rtc::TimeMicros();
+  int adapted_width;
+  int adapted_height;
+  if (!AdaptCapturedFrame(width_, height_, timestamp_us, &adapted_width,
+                          &adapted_height)) {
+    return;
+  }
+
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+  if (pixel_format_ == V4L2_PIX_FMT_MJPEG) {
+    // デコードはエンコーダで行うので、ここでは JPEG のままコピーするだけ。
+    // NativeBuffer は幅×高さ×4 バイト確保されている
+    if (size > (size_t)width_ * height_ * 4) {
+      RTC_LOG(LS_WARNING) << "Too large MJPEG frame: size=" << size;
+      return;
+    }
+    rtc::scoped_refptr<NativeBuffer> native_buffer =
+        NativeBuffer::Create(webrtc::VideoType::kMJPEG, width_, height_);
+    memcpy(native_buffer->MutableData(), data, size);
+    native_buffer->SetLength(size);
+    buffer = native_buffer;
+  } else if (pixel_format_ == V4L2_PIX_FMT_NV12) {
+    rtc::scoped_refptr<webrtc::NV12Buffer> nv12_buffer =
+        webrtc::NV12Buffer::Create(width_, height_);
+    int chroma_width = (width_ + 1) / 2 * 2;
+    libyuv::CopyPlane(data, width_, nv12_buffer->MutableDataY(),
+                      nv12_buffer->StrideY(), width_, height_);
+    libyuv::CopyPlane(data + width_ * height_, width_,
+                      nv12_buffer->MutableDataUV(), nv12_buffer->StrideUV(),
+                      chroma_width, (height_ + 1) / 2);
+    buffer = nv12_buffer;
+  } else {
+    rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
+        webrtc::I420Buffer::Create(width_, height_);
+    if (libyuv::ConvertToI420(
+            data, size, i420_buffer->MutableDataY(), i420_buffer->StrideY(),
+            i420_buffer->MutableDataU(), i420_buffer->StrideU(),
+            i420_buffer->MutableDataV(), i420_buffer->StrideV(), 0, 0, width_,
+            height_, width_, height_, libyuv::kRotate0, pixel_format_) != 0) {
+      RTC_LOG(LS_WARNING) << "Failed to convert frame: size=" << size;
+      return;
+    }
+    buffer = i420_buffer;
+  }
+
+  OnAdaptedFrame(webrtc::VideoFrame::Builder()
+                     .set_video_frame_buffer(buffer)
+                     .set_rotation(webrtc::kVideoRotation_0)
+                     .set_timestamp_us(timestamp_us)
+                     .build(),
+                 adapted_width, adapted_height);
+}
+
+}  // namespace sora
@@ -0,0 +1,71 @@
+#ifndef SORA_V4L2_VIDEO_CAPTURER_H_
+#define SORA_V4L2_VIDEO_CAPTURER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api/scoped_refptr.h"
+#include "rtc_base/ref_counted_object.h"
+
+#include "scalable_track_source.h"
+
+namespace sora {
+
+// V4L2 から直接フレームを取り出すキャプチャラ。
+// VideoCaptureModule は必ず I420 に変換してから渡してくるので、
+// MJPEG や NV12 をそのままエンコーダに渡したい場合はこちらを使う。
+//
+// native_frame が true でカメラが MJPEG を出せる場合は、MJPEG のまま NativeBuffer で渡す。
+// NVENC はそれを NVDEC でデコードしてからエンコードする。
+// それ以外は NV12 を出せるなら NV12Buffer、出せなければ I420 に変換して渡す。
+class V4L2VideoCapturer : public ScalableVideoTrackSource {
+ public:
+  // device_name はデバイスのパス (/dev/video0 など) かカード名。
+  // 空の場合は最初に開けたデバイスを使う。
+  static rtc::scoped_refptr<V4L2VideoCapturer> Create(size_t width,
+                                                      size_t height,
+                                                      size_t target_fps,
+                                                      std::string device_name,
+                                                      bool native_frame);
+  V4L2VideoCapturer();
+  ~V4L2VideoCapturer() override;
+
+  bool useNativeBuffer() override;
+
+ private:
+  bool Init(const std::string& device_path,
+            size_t width,
+            size_t height,
+            size_t target_fps,
+            bool native_frame);
+  bool SetFormat(const std::vector<uint32_t>& candidates,
+                 size_t width,
+                 size_t height);
+  bool StartStreaming();
+  void Destroy();
+  void CaptureThread();
+  void OnCaptured(const uint8_t* data, size_t size);
+
+  int fd_ = -1;
+  uint32_t pixel_format_ = 0;
+  int width_ = 0;
+  int height_ = 0;
+  struct Buffer {
+    void* start = nullptr;
+    size_t length = 0;
+  };
+  std::vector<Buffer> buffers_;
+  bool streaming_ = false;
+  std::atomic<bool> quit_{false};
+  std::unique_ptr<std::thread> thread_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_V4L2_VIDEO_CAPTURER_H_
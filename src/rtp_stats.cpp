@@ -0,0 +1,125 @@
+#include "rtp_stats.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+// webrtc
+#include "api/stats/rtcstats_objects.h"
+
+namespace sora {
+
+namespace {
+
+std::mutex g_implementation_mutex;
+std::vector<std::string> g_implementation_names;
+
+template <class T, class U>
+T ValueOr(const webrtc::RTCStatsMember<T>& member, U default_value) {
+  return member.is_defined() ? *member : (T)default_value;
+}
+
+}  // namespace
+
+void CollectRtpStats(
+    const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report,
+    std::vector<sora_rtp_stats_t>& stats) {
+  stats.clear();
+
+  // 受信側の RTT は、使っている候補ペアの値を使う
+  double current_round_trip_time = 0;
+  for (const webrtc::RTCTransportStats* transport :
+       report->GetStatsOfType<webrtc::RTCTransportStats>()) {
+    if (!transport->selected_candidate_pair_id.is_defined()) {
+      continue;
+    }
+    const webrtc::RTCStats* pair =
+        report->Get(*transport->selected_candidate_pair_id);
+    if (pair != nullptr) {
+      current_round_trip_time = ValueOr(
+          pair->cast_to<webrtc::RTCIceCandidatePairStats>()
+              .current_round_trip_time,
+          0);
+      break;
+    }
+  }
+
+  // 送信側のパケットロスやジッタ、RTT は相手から届いた remote-inbound-rtp にある
+  std::map<std::string, const webrtc::RTCRemoteInboundRtpStreamStats*>
+      remote_inbounds;
+  for (const webrtc::RTCRemoteInboundRtpStreamStats* remote :
+       report->GetStatsOfType<webrtc::RTCRemoteInboundRtpStreamStats>()) {
+    if (remote->local_id.is_defined()) {
+      remote_inbounds[*remote->local_id] = remote;
+    }
+  }
+
+  for (const webrtc::RTCInboundRTPStreamStats* inbound :
+       report->GetStatsOfType<webrtc::RTCInboundRTPStreamStats>()) {
+    sora_rtp_stats_t s = {};
+    s.kind = ValueOr(inbound->kind, "") == "video" ? 1 : 0;
+    s.direction = 0;
+    s.ssrc = ValueOr(inbound->ssrc, 0);
+    s.bytes = ValueOr(inbound->bytes_received, 0);
+    s.packets = ValueOr(inbound->packets_received, 0);
+    s.packets_lost = ValueOr(inbound->packets_lost, 0);
+    s.jitter = ValueOr(inbound->jitter, 0);
+    s.round_trip_time = current_round_trip_time;
+    s.frames_per_second = ValueOr(inbound->frames_per_second, 0);
+    s.frame_width = (int32_t)ValueOr(inbound->frame_width, 0);
+    s.frame_height = (int32_t)ValueOr(inbound->frame_height, 0);
+    s.frames = ValueOr(inbound->frames_decoded, 0);
+    s.qp_sum = ValueOr(inbound->qp_sum, 0);
+    s.implementation = GetImplementationId(
+        ValueOr(inbound->decoder_implementation, ""));
+    stats.push_back(s);
+  }
+
+  for (const webrtc::RTCOutboundRTPStreamStats* outbound :
+       report->GetStatsOfType<webrtc::RTCOutboundRTPStreamStats>()) {
+    sora_rtp_stats_t s = {};
+    s.kind = ValueOr(outbound->kind, "") == "video" ? 1 : 0;
+    s.direction = 1;
+    s.ssrc = ValueOr(outbound->ssrc, 0);
+    s.bytes = ValueOr(outbound->bytes_sent, 0);
+    s.packets = ValueOr(outbound->packets_sent, 0);
+    auto it = remote_inbounds.find(outbound->id());
+    if (it != remote_inbounds.end()) {
+      s.packets_lost = ValueOr(it->second->packets_lost, 0);
+      s.jitter = ValueOr(it->second->jitter, 0);
+      s.round_trip_time = ValueOr(it->second->round_trip_time, 0);
+    }
+    s.frames_per_second = ValueOr(outbound->frames_per_second, 0);
+    s.frame_width = (int32_t)ValueOr(outbound->frame_width, 0);
+    s.frame_height = (int32_t)ValueOr(outbound->frame_height, 0);
+    s.frames = ValueOr(outbound->frames_encoded, 0);
+    s.qp_sum = ValueOr(outbound->qp_sum, 0);
+    s.implementation = GetImplementationId(
+        ValueOr(outbound->encoder_implementation, ""));
+    stats.push_back(s);
+  }
+}
+
+int GetImplementationId(const std::string& name) {
+  if (name.empty()) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> guard(g_implementation_mutex);
+  auto it = std::find(g_implementation_names.begin(),
+                      g_implementation_names.end(), name);
+  if (it != g_implementation_names.end()) {
+    return (int)(it - g_implementation_names.begin()) + 1;
+  }
+  g_implementation_names.push_back(name);
+  return (int)g_implementation_names.size();
+}
+
+std::string GetImplementationName(int id) {
+  std::lock_guard<std::mutex> guard(g_implementation_mutex);
+  if (id <= 0 || id > (int)g_implementation_names.size()) {
+    return "";
+  }
+  return g_implementation_names[id - 1];
+}
+
+}  // namespace sora
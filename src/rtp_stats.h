@@ -0,0 +1,27 @@
+#ifndef SORA_RTP_STATS_H_INCLUDED
+#define SORA_RTP_STATS_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+// webrtc
+#include "api/stats/rtc_stats_report.h"
+
+#include "unity.h"
+
+namespace sora {
+
+// RTCStatsReport から送受信している RTP ストリームごとの値だけを取り出す。
+// JSON にせずに Unity に渡すためのもの
+void CollectRtpStats(
+    const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report,
+    std::vector<sora_rtp_stats_t>& stats);
+
+// encoder_implementation と decoder_implementation は毎回文字列で渡さずに番号にする。
+// 同じ名前には常に同じ番号を返す。0 は名前が無いことを表す
+int GetImplementationId(const std::string& name);
+std::string GetImplementationName(int id);
+
+}  // namespace sora
+
+#endif  // SORA_RTP_STATS_H_INCLUDED
@@ -0,0 +1,70 @@
+#include "shared_engine.h"
+
+#include <mutex>
+
+#include "rtc_base/logging.h"
+
+namespace sora {
+
+namespace {
+
+std::mutex g_mutex;
+std::weak_ptr<SharedEngine> g_engine;
+
+}  // namespace
+
+std::shared_ptr<SharedEngine> SharedEngine::GetOrCreate(
+    std::function<std::shared_ptr<SharedEngine>()> create) {
+  std::lock_guard<std::mutex> lock(g_mutex);
+  std::shared_ptr<SharedEngine> engine = g_engine.lock();
+  if (engine != nullptr) {
+    RTC_LOG(LS_INFO) << "Use existing SharedEngine";
+    return engine;
+  }
+  engine = create();
+  if (engine != nullptr) {
+    g_engine = engine;
+  }
+  return engine;
+}
+
+SharedEngine::SharedEngine(std::shared_ptr<RTCEngine> rtc_engine,
+                           rtc::scoped_refptr<UnityAudioDevice> adm)
+    : rtc_engine_(std::move(rtc_engine)),
+      adm_(std::move(adm)),
+      ioc_(1),
+      work_guard_(boost::asio::make_work_guard(ioc_)) {}
+
+SharedEngine::~SharedEngine() {
+  RTC_LOG(LS_INFO) << "SharedEngine destroy started";
+  work_guard_.reset();
+  ioc_.stop();
+  if (thread_) {
+    thread_->Stop();
+    thread_.reset();
+  }
+  adm_ = nullptr;
+  rtc_engine_ = nullptr;
+  RTC_LOG(LS_INFO) << "SharedEngine destroy finished";
+}
+
+bool SharedEngine::Start(const ThreadConfig& io_thread_config) {
+  thread_ = rtc::Thread::Create();
+  if (!thread_->SetName("Sora Shared IO Thread", nullptr)) {
+    RTC_LOG(LS_INFO) << "Failed to set thread name";
+    return false;
+  }
+  if (!thread_->Start()) {
+    RTC_LOG(LS_INFO) << "Failed to start thread";
+    return false;
+  }
+  thread_->PostTask(RTC_FROM_HERE, [this, io_thread_config]() {
+    ApplyCurrentThreadConfig("Sora Shared IO Thread", io_thread_config);
+    RTC_LOG(LS_INFO) << "shared io_context started";
+    ioc_.run();
+    RTC_LOG(LS_INFO) << "shared io_context finished";
+  });
+  return true;
+}
+
+}  // namespace sora
@@ -0,0 +1,53 @@
+#ifndef SORA_SHARED_ENGINE_H_INCLUDED
+#define SORA_SHARED_ENGINE_H_INCLUDED
+
+#include <functional>
+#include <memory>
+
+// boost
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+// webrtc
+#include "rtc_base/thread.h"
+
+// sora
+#include "rtc/rtc_manager.h"
+#include "unity_audio_device.h"
+
+namespace sora {
+
+// 複数の Sora で共有する PeerConnectionFactory とスレッド、ADM、シグナリング用の io_context。
+// 複数のチャンネルに同時に接続しても、スレッドやコーデックのファクトリが増えないようにする。
+// 最後に使っていた Sora が破棄された時に一緒に破棄される。
+class SharedEngine {
+ public:
+  // 既にあればそれを返し、無ければ create で作って返す。
+  // create は作っている間ロックを取ったまま呼ばれる
+  static std::shared_ptr<SharedEngine> GetOrCreate(
+      std::function<std::shared_ptr<SharedEngine>()> create);
+
+  SharedEngine(std::shared_ptr<RTCEngine> rtc_engine,
+               rtc::scoped_refptr<UnityAudioDevice> adm);
+  ~SharedEngine();
+
+  // io_context を動かすスレッドを開始する
+  bool Start(const ThreadConfig& io_thread_config);
+
+  const std::shared_ptr<RTCEngine>& rtc_engine() const { return rtc_engine_; }
+  const rtc::scoped_refptr<UnityAudioDevice>& adm() const { return adm_; }
+  boost::asio::io_context& ioc() { return ioc_; }
+
+ private:
+  std::shared_ptr<RTCEngine> rtc_engine_;
+  rtc::scoped_refptr<UnityAudioDevice> adm_;
+  boost::asio::io_context ioc_;
+  // 接続が 1 つも無い間も run() が終わらないようにする
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+      work_guard_;
+  std::unique_ptr<rtc::Thread> thread_;
+};
+
+}  // namespace sora
+
+#endif  // SORA_SHARED_ENGINE_H_INCLUDED
@@ -1,8 +1,16 @@
 #include "sora.h"
 
+#include <stdio.h>
+
+#include <future>
+
+#include <boost/asio/post.hpp>
+
 #include "api/task_queue/default_task_queue_factory.h"
 #include "modules/audio_device/include/audio_device_factory.h"
 
+#include "encoder_stats.h"
+
 #ifdef SORA_UNITY_SDK_ANDROID
 #include "sdk/android/native_api/audio_device_module/audio_device_android.h"
 #include "sdk/android/native_api/jni/jvm.h"
@@ -17,10 +25,21 @@
 #include "mac_helper/ios_audio_init.h"
 #endif
 
+#ifdef SORA_UNITY_SDK_WINDOWS
+#include "hwenc_amf/amf_h264_encoder.h"
+#include "hwenc_msdk/msdk_h264_encoder.h"
+#include "hwenc_nvcodec/nvcodec_h264_encoder.h"
+#include "rtc/dxgi_adapter.h"
+#endif
+
+#ifdef SORA_UNITY_SDK_UBUNTU
+#include "hwenc_nvcodec/nvcodec_h264_encoder.h"
+#endif
+
 namespace sora {
 
 Sora::Sora(UnityContext* context) : context_(context) {
-  ptrid_ = IdPointer::Instance().Register(this);
+  ptrid_ = IdPointer::Instance().Register(this, IdPointer::Type::kSora);
 }
 
 Sora::~Sora() {
@@ -33,6 +52,11 @@ Sora::~Sora() {
     static_cast<AndroidCapturer*>(capturer_.get())->Stop();
   }
 #endif
+  // エンコーダが capturer_ を参照している間に、破棄した this を呼ばないようにする
+  if (capturer_ != nullptr && capturer_type_ == 2) {
+    static_cast<EncodedVideoTrackSource*>(capturer_.get())
+        ->SetOnKeyFrameRequest(nullptr);
+  }
   capturer_ = nullptr;
   unity_adm_ = nullptr;
 
@@ -44,13 +68,25 @@ Sora::~Sora() {
     thread_->Stop();
     thread_.reset();
   }
-  if (signaling_) {
+  if (signaling_ && shared_engine_) {
+    // 共有している io_context は止められないので、そのスレッドで Release して、
+    // それ以降に残っているハンドラが何もしないようにする
+    std::promise<void> released;
+    auto signaling = signaling_;
+    boost::asio::post(shared_engine_->ioc(), [signaling, &released]() {
+      signaling->Release();
+      released.set_value();
+    });
+    released.get_future().wait();
+  } else if (signaling_) {
     signaling_->Release();
   }
   signaling_.reset();
   ioc_.reset();
   rtc_manager_.reset();
   renderer_.reset();
+  shared_engine_.reset();
+  audio_track_receiver_.reset();
   RTC_LOG(LS_INFO) << "Sora object destroy finished";
 }
 void Sora::SetOnAddTrack(std::function<void(ptrid_t)> on_add_track) {
@@ -59,137 +95,533 @@ void Sora::SetOnAddTrack(std::function<void(ptrid_t)> on_add_track) {
 void Sora::SetOnRemoveTrack(std::function<void(ptrid_t)> on_remove_track) {
   on_remove_track_ = on_remove_track;
 }
+void Sora::SetOnAddAudioTrack(
+    std::function<void(ptrid_t)> on_add_audio_track) {
+  on_add_audio_track_ = on_add_audio_track;
+}
+void Sora::SetOnRemoveAudioTrack(
+    std::function<void(ptrid_t)> on_remove_audio_track) {
+  on_remove_audio_track_ = on_remove_audio_track;
+}
 void Sora::SetOnNotify(std::function<void(std::string)> on_notify) {
   on_notify_ = std::move(on_notify);
 }
+void Sora::SetOnDataChannelMessage(
+    std::function<void(const std::string&, const uint8_t*, size_t)>
+        on_data_channel_message) {
+  on_data_channel_message_ = std::move(on_data_channel_message);
+}
+void Sora::SetOnKeyFrameRequest(std::function<void()> on_key_frame_request) {
+  on_key_frame_request_ = std::move(on_key_frame_request);
+}
 
 void Sora::DispatchEvents() {
-  while (!event_queue_.empty()) {
-    std::function<void()> f;
-    {
-      std::lock_guard<std::mutex> guard(event_mutex_);
-      f = std::move(event_queue_.front());
-      event_queue_.pop_front();
-    }
-    f();
+  if (renderer_ != nullptr) {
+    renderer_->ApplySinkWants();
   }
+
+  // 溜まっているイベントをまとめて取り出して、ロックは 1 回だけ取る
+  {
+    std::lock_guard<std::mutex> guard(event_mutex_);
+    event_queue_.swap(dispatching_events_);
+    event_json_bytes_ = 0;
+    event_memory_.Set(event_queue_.capacity() * sizeof(Event), 0);
+  }
+  for (Event& ev : dispatching_events_) {
+    DispatchEvent(ev);
+  }
+  // 領域は次の入れ替えで使い回す
+  dispatching_events_.clear();
 }
 
-bool Sora::Connect(const Sora::ConnectConfig& cc) {
-#if defined(SORA_UNITY_SDK_IOS)
-  // iOS でマイクを使用する場合、マイクの初期化の設定をしてから DoConnect する。
+void Sora::PushEvent(Event ev) {
+  std::lock_guard<std::mutex> guard(event_mutex_);
+  event_json_bytes_ += ev.json.size() + ev.data.size();
+  event_queue_.push_back(std::move(ev));
+  event_memory_.Set(
+      event_queue_.capacity() * sizeof(Event) + event_json_bytes_,
+      event_queue_.size());
+}
 
-  if (cc.role == "recvonly" || cc.unity_audio_input) {
-    // この場合マイクを利用しないのですぐに DoConnect
-    return DoConnect(cc);
+void Sora::DispatchEvent(Event& ev) {
+  switch (ev.type) {
+    case Event::Type::AddTrack:
+      if (on_add_track_) {
+        on_add_track_(ev.track_id);
+      }
+      break;
+    case Event::Type::RemoveTrack:
+      if (on_remove_track_) {
+        on_remove_track_(ev.track_id);
+      }
+      break;
+    case Event::Type::AddAudioTrack:
+      if (on_add_audio_track_) {
+        on_add_audio_track_(ev.track_id);
+      }
+      break;
+    case Event::Type::RemoveAudioTrack:
+      if (on_remove_audio_track_) {
+        on_remove_audio_track_(ev.track_id);
+      }
+      break;
+    case Event::Type::Notify:
+      if (on_notify_) {
+        on_notify_(std::move(ev.json));
+      }
+      break;
+    case Event::Type::GetStats:
+      ev.on_get_stats(std::move(ev.json));
+      break;
+    case Event::Type::DataChannelMessage:
+      if (on_data_channel_message_) {
+        on_data_channel_message_(ev.label, ev.data.cdata(), ev.data.size());
+      }
+      break;
+    case Event::Type::KeyFrameRequest:
+      if (on_key_frame_request_) {
+        on_key_frame_request_();
+      }
+      break;
   }
+}
 
-  IosAudioInit([this](std::string error) {
-    if (!error.empty()) {
-      RTC_LOG(LS_ERROR) << "Failed to IosAudioInit: error=" << error;
-    }
-  });
-  return DoConnect(cc);
-#else
-  return DoConnect(cc);
+bool Sora::Prepare(const Sora::ConnectConfig& cc) {
+  if (prepared_) {
+    RTC_LOG(LS_ERROR) << "Already prepared";
+    return false;
+  }
+
+#if defined(SORA_UNITY_SDK_IOS)
+  // iOS でマイクを使用する場合、マイクの初期化の設定をしてから DoPrepare する。
+  // recvonly や Unity の音声を使う場合はマイクを利用しないので、すぐに DoPrepare
+  if (cc.role != "recvonly" && !cc.unity_audio_input) {
+    IosAudioInit([this](std::string error) {
+      if (!error.empty()) {
+        RTC_LOG(LS_ERROR) << "Failed to IosAudioInit: error=" << error;
+      }
+    });
+  }
 #endif
+
+  if (!DoPrepare(cc)) {
+    return false;
+  }
+  prepared_ = true;
+  return true;
+}
+
+bool Sora::Connect() {
+  if (!prepared_) {
+    RTC_LOG(LS_ERROR) << "Not prepared";
+    return false;
+  }
+  signaling_->SendConnect();
+  return true;
+}
+
+bool Sora::SetThreadConfig(int thread_type, const ThreadConfig& config) {
+  if (thread_type < kNetworkThread || thread_type > kAudioRecordingThread) {
+    RTC_LOG(LS_ERROR) << "Invalid thread_type: " << thread_type;
+    return false;
+  }
+  if (prepared_) {
+    RTC_LOG(LS_WARNING) << "SetThreadConfig must be called before Prepare";
+    return false;
+  }
+  thread_configs_[thread_type] = config;
+  return true;
+}
+
+bool Sora::AddDataChannel(
+    const SoraSignalingConfig::DataChannel& data_channel) {
+  if (prepared_) {
+    RTC_LOG(LS_WARNING) << "AddDataChannel must be called before Prepare";
+    return false;
+  }
+  // Sora はメッセージング用のラベルを # で始まるものに限っている
+  if (data_channel.label.size() < 2 || data_channel.label[0] != '#') {
+    RTC_LOG(LS_ERROR) << "Invalid DataChannel label: " << data_channel.label;
+    return false;
+  }
+  if (data_channel.direction != "sendrecv" &&
+      data_channel.direction != "sendonly" &&
+      data_channel.direction != "recvonly") {
+    RTC_LOG(LS_ERROR) << "Invalid DataChannel direction: "
+                      << data_channel.direction;
+    return false;
+  }
+  if (data_channel.max_packet_life_time >= 0 &&
+      data_channel.max_retransmits >= 0) {
+    RTC_LOG(LS_ERROR) << "max_packet_life_time and max_retransmits cannot be "
+                         "specified at the same time";
+    return false;
+  }
+  data_channels_.push_back(data_channel);
+  return true;
 }
 
-bool Sora::DoConnect(const Sora::ConnectConfig& cc) {
+bool Sora::SendDataChannelMessage(const std::string& label,
+                                  const uint8_t* data,
+                                  size_t size) {
+  if (signaling_ == nullptr) {
+    return false;
+  }
+  return signaling_->SendDataChannelMessage(label, data, size);
+}
+
+bool Sora::DoPrepare(const Sora::ConnectConfig& cc) {
   signaling_url_ = std::move(cc.signaling_url);
   channel_id_ = std::move(cc.channel_id);
 
-  RTC_LOG(LS_INFO) << "Sora::Connect unity_version=" << cc.unity_version
+  RTC_LOG(LS_INFO) << "Sora::Prepare unity_version=" << cc.unity_version
                    << " signaling_url =" << signaling_url_
                    << " channel_id=" << channel_id_
                    << " metadata=" << cc.metadata << " role=" << cc.role
                    << " multistream=" << cc.multistream
+                   << " video=" << cc.video
                    << " capturer_type=" << cc.capturer_type
                    << " unity_camera_texture=0x" << cc.unity_camera_texture
+                   << " unity_camera_readback_latency="
+                   << cc.unity_camera_readback_latency
+                   << " unity_camera_static_content="
+                   << cc.unity_camera_static_content
+                   << " unity_camera_static_refresh_ms="
+                   << cc.unity_camera_static_refresh_ms
+                   << " unity_camera_capture_fps="
+                   << cc.unity_camera_capture_fps
                    << " video_capturer_device=" << cc.video_capturer_device
                    << " video_width=" << cc.video_width
                    << " video_height=" << cc.video_height
+                   << " video_fps=" << cc.video_fps
                    << " unity_audio_input=" << cc.unity_audio_input
                    << " unity_audio_output=" << cc.unity_audio_output
+                   << " unity_audio_sample_rate=" << cc.unity_audio_sample_rate
+                   << " unity_audio_channels=" << cc.unity_audio_channels
+                   << " unity_audio_output_per_track="
+                   << cc.unity_audio_output_per_track
                    << " audio_recording_device=" << cc.audio_recording_device
-                   << " audio_playout_device=" << cc.audio_playout_device;
+                   << " audio_playout_device=" << cc.audio_playout_device
+                   << " audio_profile=" << cc.audio_profile
+                   << " audio_opus_dtx=" << cc.audio_opus_dtx
+                   << " audio_opus_fec=" << cc.audio_opus_fec
+                   << " audio_opus_ptime=" << cc.audio_opus_ptime
+                   << " audio_opus_stereo=" << cc.audio_opus_stereo
+                   << " audio_opus_complexity=" << cc.audio_opus_complexity
+                   << " video_fec=" << cc.video_fec
+                   << " audio_red=" << cc.audio_red
+                   << " stats_interval_ms=" << cc.stats_interval_ms
+                   << " reconnect_max_attempts=" << cc.reconnect_max_attempts
+                   << " data_channel_signaling=" << cc.data_channel_signaling
+                   << " ignore_disconnect_websocket="
+                   << cc.ignore_disconnect_websocket
+                   << " simulcast=" << cc.simulcast
+                   << " simulcast_rid=" << cc.simulcast_rid
+                   << " spotlight=" << cc.spotlight
+                   << " spotlight_number=" << cc.spotlight_number
+                   << " adaptive_quality=" << cc.adaptive_quality
+                   << " adaptive_quality_target_frame_ms="
+                   << cc.adaptive_quality_target_frame_ms
+                   << " video_start_bitrate=" << cc.video_start_bitrate
+                   << " video_min_bitrate=" << cc.video_min_bitrate
+                   << " video_max_bitrate=" << cc.video_max_bitrate
+                   << " field_trials=" << cc.field_trials
+                   << " local_preview=" << cc.local_preview
+                   << " renderer_convert_threads="
+                   << cc.renderer_convert_threads
+                   << " video_encoder_output_delay="
+                   << cc.video_encoder_output_delay
+                   << " video_encoder_intra_refresh="
+                   << cc.video_encoder_intra_refresh
+                   << " video_encoder_threads=" << cc.video_encoder_threads
+                   << " video_scalability_mode=" << cc.video_scalability_mode
+                   << " video_decoder_texture_output="
+                   << cc.video_decoder_texture_output
+                   << " video_decoder_async_output="
+                   << cc.video_decoder_async_output
+                   << " video_playout_delay_min_ms="
+                   << cc.video_playout_delay_min_ms
+                   << " video_playout_delay_max_ms="
+                   << cc.video_playout_delay_max_ms
+                   << " audio_jitter_buffer_min_delay_ms="
+                   << cc.audio_jitter_buffer_min_delay_ms
+                   << " low_latency=" << cc.low_latency
+                   << " gpu_adapter_index=" << cc.gpu_adapter_index
+                   << " shared_engine=" << cc.shared_engine
+                   << " recording_directory=" << cc.recording_directory
+                   << " ice_candidate_pool_size=" << cc.ice_candidate_pool_size
+                   << " ice_transport_policy=" << cc.ice_transport_policy
+                   << " ice_continual_gathering="
+                   << cc.ice_continual_gathering;
 
   if (cc.role != "sendonly" && cc.role != "recvonly" && cc.role != "sendrecv") {
     RTC_LOG(LS_ERROR) << "Invalid role: " << cc.role;
     return false;
   }
+  if (cc.ice_transport_policy != "All" && cc.ice_transport_policy != "Relay" &&
+      cc.ice_transport_policy != "RelayTls") {
+    RTC_LOG(LS_ERROR) << "Invalid ice_transport_policy: "
+                      << cc.ice_transport_policy;
+    return false;
+  }
+  if (cc.video && cc.capturer_type == 2) {
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_UBUNTU)
+    // エンコード済みのフレームは解像度を変えられないので、simulcast では送れない
+    if (cc.video_codec != "H264" || cc.simulcast || cc.spotlight) {
+      RTC_LOG(LS_ERROR) << "Encoded input requires H264 without simulcast: "
+                        << "codec=" << cc.video_codec
+                        << " simulcast=" << cc.simulcast
+                        << " spotlight=" << cc.spotlight;
+      return false;
+    }
+#else
+    // VideoToolbox と MediaCodec のエンコーダのファクトリは差し替えられない
+    RTC_LOG(LS_ERROR) << "Encoded input is not supported on this platform";
+    return false;
+#endif
+  }
 
-  renderer_.reset(new UnityRenderer(
-      [this](ptrid_t track_id) {
-        std::lock_guard<std::mutex> guard(event_mutex_);
-        event_queue_.push_back([this, track_id]() {
-          // ここは Unity スレッドから呼ばれる
-          if (on_add_track_) {
-            on_add_track_(track_id);
-          }
-        });
-      },
-      [this](ptrid_t track_id) {
-        std::lock_guard<std::mutex> guard(event_mutex_);
-        event_queue_.push_back([this, track_id]() {
-          // ここは Unity スレッドから呼ばれる
-          if (on_remove_track_) {
-            on_remove_track_(track_id);
-          }
-        });
-      }));
+  if (cc.video) {
+    renderer_.reset(new UnityRenderer(
+        [this](ptrid_t track_id) {
+          PushEvent(Event(Event::Type::AddTrack, track_id));
+        },
+        [this](ptrid_t track_id) {
+          PushEvent(Event(Event::Type::RemoveTrack, track_id));
+        },
+        cc.renderer_convert_threads));
+  }
 
-  std::unique_ptr<rtc::Thread> worker_thread = rtc::Thread::Create();
-  worker_thread->Start();
+  if (cc.unity_audio_output_per_track) {
+    audio_track_receiver_.reset(new UnityAudioTrackReceiver(
+        cc.unity_audio_sample_rate > 0 ? cc.unity_audio_sample_rate : 48000,
+        [this](ptrid_t track_id) {
+          PushEvent(Event(Event::Type::AddAudioTrack, track_id));
+        },
+        [this](ptrid_t track_id) {
+          PushEvent(Event(Event::Type::RemoveAudioTrack, track_id));
+        }));
+  }
 
-  auto task_queue_factory = webrtc::CreateDefaultTaskQueueFactory();
-  unity_adm_ = CreateADM(task_queue_factory.get(), false, cc.unity_audio_input,
-                         cc.unity_audio_output, on_handle_audio_,
-                         cc.audio_recording_device, cc.audio_playout_device,
-                         worker_thread.get());
-  if (!unity_adm_) {
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  // NVENC と NVDEC は、指定が無ければ Unity と同じアダプタで動かす。
+  // Unity のデバイスコンテキストはレンダースレッド以外から触れないので、
+  // デバイスそのものは共有せず、同じアダプタに自前のデバイスを作る。
+  LUID unity_adapter_luid = {};
+  GetAdapterLuid(context_->GetDevice(), &unity_adapter_luid);
+  LUID gpu_adapter_luid = unity_adapter_luid;
+  if (cc.gpu_adapter_index >= 0 &&
+      !GetAdapterLuid(cc.gpu_adapter_index, &gpu_adapter_luid)) {
     return false;
   }
+#endif
 
-  std::unique_ptr<rtc::Thread> signaling_thread = rtc::Thread::Create();
+  const bool send = cc.role == "sendonly" || cc.role == "sendrecv";
 
   RTCManagerConfig config;
+  config.audio_only = !cc.video;
+  config.no_video = !cc.video;
   config.audio_recording_device = cc.audio_recording_device;
   config.audio_playout_device = cc.audio_playout_device;
+  if (!ApplyAudioProfile(cc.audio_profile, config)) {
+    return false;
+  }
+  if (cc.audio_codec == "OPUS") {
+    config.audio_opus_complexity = cc.audio_opus_complexity;
+    config.audio_red = cc.audio_red;
+  }
+  if (cc.video && !ApplyVideoFec(cc.video_fec, config)) {
+    return false;
+  }
+  if (send) {
+    // 送信のみの場合は playout の設定はしない
+    config.no_playout = cc.role == "sendonly";
+    config.video_encoder_output_delay = cc.video_encoder_output_delay;
+    config.video_encoder_intra_refresh = cc.video_encoder_intra_refresh;
+    config.video_encoder_threads = cc.video_encoder_threads;
+    config.video_encoded_input = cc.video && cc.capturer_type == 2;
+    if (!cc.video_scalability_mode.empty()) {
+      if (cc.video_codec != "VP9" || cc.simulcast || cc.spotlight) {
+        // SVC は VP9 で、simulcast と同時には使えない
+        RTC_LOG(LS_WARNING) << "video_scalability_mode is ignored: codec="
+                            << cc.video_codec << " simulcast=" << cc.simulcast
+                            << " spotlight=" << cc.spotlight;
+      } else if (!ApplyScalabilityMode(cc.video_scalability_mode, config)) {
+        return false;
+      }
+    }
+    // スポットライトは simulcast で送る
+    config.simulcast = cc.simulcast || cc.spotlight;
+    // Unity のカメラの映像はテクスチャのまま表示できるので、
+    // GPU から読み出した映像をもう一度テクスチャに転送しない。
+    // エンコード済みのフレームはデコードしないと表示できないので表示しない
+    config.local_preview =
+        cc.capturer_type != 2 &&
+        (cc.local_preview == 0 ||
+         (cc.local_preview == 1 && cc.capturer_type == 0));
+    // 静止した画面が多い場合は、解像度を落とさずにフレームレートで帯域を調整する
+    config.fixed_resolution =
+        cc.capturer_type == 1 && cc.unity_camera_static_content;
+  } else {
+    // 受信側は capturer を作らず、video, recording の設定もしない
+    config.no_recording = true;
+    config.no_video = true;
+  }
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  if (cc.video_decoder_texture_output) {
+    config.video_decoder_texture_device = context_->GetDevice();
+  }
+  config.gpu_adapter_luid = gpu_adapter_luid;
+#endif
+#if defined(SORA_UNITY_SDK_ANDROID)
+  config.video_decoder_texture_output = cc.video_decoder_texture_output;
+#endif
+  config.video_decoder_async_output = cc.video_decoder_async_output;
+  config.video_playout_delay_min_ms = cc.video_playout_delay_min_ms;
+  config.video_playout_delay_max_ms = cc.video_playout_delay_max_ms;
+  config.audio_jitter_buffer_min_delay_ms = cc.audio_jitter_buffer_min_delay_ms;
+  if (cc.low_latency) {
+    // 映像はジッタバッファで待たずに表示し、音声は溜まった分を早送りして 1 秒までしか溜めない
+    if (config.video_playout_delay_min_ms < 0) {
+      config.video_playout_delay_min_ms = 0;
+    }
+    if (config.video_playout_delay_max_ms < 0) {
+      config.video_playout_delay_max_ms = 0;
+    }
+    if (config.audio_jitter_buffer_min_delay_ms < 0) {
+      config.audio_jitter_buffer_min_delay_ms = 0;
+    }
+    config.audio_jitter_buffer_fast_accelerate = true;
+    config.audio_jitter_buffer_max_packets = 50;
+  }
+  config.start_bitrate_kbps = cc.video_start_bitrate;
+  config.min_bitrate_kbps = cc.video_min_bitrate;
+  config.max_bitrate_kbps = cc.video_max_bitrate;
+  config.field_trials = cc.field_trials;
+  if (cc.video) {
+    config.recording_directory = cc.recording_directory;
+    config.recording_codec = cc.video_codec;
+  }
+  ThreadConfig io_thread_config;
+  for (const auto& kv : thread_configs_) {
+    switch (kv.first) {
+      case kNetworkThread:
+        config.network_thread_config = kv.second;
+        break;
+      case kWorkerThread:
+        config.worker_thread_config = kv.second;
+        break;
+      case kSignalingThread:
+        config.signaling_thread_config = kv.second;
+        break;
+      case kIOThread:
+        io_thread_config = kv.second;
+        break;
+      case kAudioPlayoutThread:
+        config.audio_playout_thread_config = kv.second;
+        break;
+      case kAudioRecordingThread:
+        config.audio_recording_thread_config = kv.second;
+        break;
+    }
+  }
 
-  if (cc.role == "sendonly" || cc.role == "sendrecv") {
-    // 送信側は capturer を設定する。送信のみの場合は playout の設定はしない
-    rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> capturer =
-        CreateVideoCapturer(cc.capturer_type, cc.unity_camera_texture,
-                            cc.video_capturer_device, cc.video_width,
-                            cc.video_height, signaling_thread.get());
+  std::shared_ptr<RTCEngine> rtc_engine;
+  if (cc.shared_engine) {
+    // 既に他の Sora が作っていればそれを使う。
+    // コーデックや ADM の設定は最初に作った Sora のものになる
+    if (on_handle_audio_) {
+      RTC_LOG(LS_WARNING)
+          << "OnHandleAudio is not supported with shared_engine, ignored";
+    }
+    shared_engine_ = SharedEngine::GetOrCreate(
+        [&cc, &config, &io_thread_config]() -> std::shared_ptr<SharedEngine> {
+          rtc::scoped_refptr<UnityAudioDevice> adm;
+          std::shared_ptr<RTCEngine> rtc_engine =
+              CreateRTCEngine(cc, config, nullptr, &adm);
+          if (rtc_engine == nullptr) {
+            return nullptr;
+          }
+          auto engine = std::make_shared<SharedEngine>(rtc_engine, adm);
+          if (!engine->Start(io_thread_config)) {
+            return nullptr;
+          }
+          return engine;
+        });
+    if (shared_engine_ == nullptr) {
+      return false;
+    }
+    rtc_engine = shared_engine_->rtc_engine();
+    unity_adm_ = shared_engine_->adm();
+  } else {
+    rtc_engine = CreateRTCEngine(cc, config, on_handle_audio_, &unity_adm_);
+    if (rtc_engine == nullptr) {
+      return false;
+    }
+  }
+
+  rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> capturer;
+  if (send && cc.video) {
+    // NVENC や VideoToolbox, MediaCodec で H264 を送る場合は、
+    // Unity のカメラ映像をテクスチャのままエンコーダに渡す
+    bool unity_camera_native_texture = false;
+#if defined(SORA_UNITY_SDK_WINDOWS)
+    // NVENC が Unity と別のアダプタでエンコードする場合はテクスチャを共有できない。
+    // QSV の場合はテクスチャと同じアダプタで NV12 に変換してから渡すので、アダプタは問わない。
+    // AMF の場合も別のアダプタのテクスチャはエンコーダ側で読み出すので、アダプタは問わない
+    unity_camera_native_texture =
+        cc.video_codec == "H264" &&
+        (NvCodecH264Encoder::IsSupported()
+             ? IsSameAdapterLuid(gpu_adapter_luid, unity_adapter_luid)
+             : AmfH264Encoder::IsSupported() ||
+                   MsdkH264Encoder::IsSupported());
+#elif defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS) || \
+    defined(SORA_UNITY_SDK_ANDROID)
+    unity_camera_native_texture = cc.video_codec == "H264";
+#endif
+    // 実カメラの MJPEG を NVDEC でデコードできる場合は、CPU でデコードせずに渡す
+    bool device_native_frame = false;
+#if defined(SORA_UNITY_SDK_UBUNTU)
+    device_native_frame =
+        cc.video_codec == "H264" && NvCodecH264Encoder::IsSupported();
+#endif
+
+    // 送信側は capturer を設定する
+    capturer = CreateVideoCapturer(
+        cc.capturer_type, cc.unity_camera_texture,
+        cc.unity_camera_readback_latency, unity_camera_native_texture,
+        device_native_frame, cc.video_capturer_device, cc.video_width,
+        cc.video_height, cc.video_fps, rtc_engine->signaling_thread());
     if (!capturer) {
       return false;
     }
 
     capturer_ = capturer;
     capturer_type_ = cc.capturer_type;
+    if (capturer_type_ == 1 && cc.unity_camera_static_content) {
+      static_cast<UnityCameraCapturer*>(capturer_.get())
+          ->SetStaticContent(true, cc.unity_camera_static_refresh_ms);
+    }
+    if (capturer_type_ == 1 && cc.unity_camera_capture_fps > 0) {
+      static_cast<UnityCameraCapturer*>(capturer_.get())
+          ->SetCaptureFps(cc.unity_camera_capture_fps);
+    }
+    if (capturer_type_ == 2) {
+      // エンコーダのスレッドから呼ばれるので、Unity スレッドに渡す
+      static_cast<EncodedVideoTrackSource*>(capturer_.get())
+          ->SetOnKeyFrameRequest([this]() {
+            PushEvent(Event(Event::Type::KeyFrameRequest));
+          });
+    }
+  }
 
-    config.no_playout = cc.role == "sendonly";
-
-    config.audio_recording_device = cc.audio_recording_device;
-    config.audio_playout_device = cc.audio_playout_device;
-    rtc_manager_ = RTCManager::Create(
-        config, std::move(capturer), renderer_.get(), unity_adm_,
-        std::move(task_queue_factory), std::move(signaling_thread),
-        std::move(worker_thread));
-  } else {
-    // 受信側は capturer を作らず、video, recording の設定もしない
-    RTCManagerConfig config;
-    config.no_recording = true;
-    config.no_video = true;
-
-    config.audio_recording_device = cc.audio_recording_device;
-    config.audio_playout_device = cc.audio_playout_device;
-    rtc_manager_ = RTCManager::Create(config, nullptr, renderer_.get(),
-                                      unity_adm_, std::move(task_queue_factory),
-                                      std::move(signaling_thread),
-                                      std::move(worker_thread));
+  rtc_manager_ = RTCManager::Create(config, std::move(capturer),
+                                    renderer_.get(), std::move(rtc_engine));
+  if (rtc_manager_ && audio_track_receiver_) {
+    rtc_manager_->SetAudioTrackReceiver(audio_track_receiver_.get());
+  }
+  if (rtc_manager_) {
+    rtc_manager_->WarmUpCodecs();
   }
 
   {
@@ -203,12 +635,41 @@ bool Sora::DoConnect(const Sora::ConnectConfig& cc) {
                             ? SoraSignalingConfig::Role::Recvonly
                             : SoraSignalingConfig::Role::Sendrecv;
     config.multistream = cc.multistream;
+    config.video = cc.video;
     config.signaling_url = signaling_url_;
     config.channel_id = channel_id_;
     config.video_codec = cc.video_codec;
     config.video_bitrate = cc.video_bitrate;
     config.audio_codec = cc.audio_codec;
     config.audio_bitrate = cc.audio_bitrate;
+    config.audio_opus_dtx = cc.audio_opus_dtx;
+    config.audio_opus_fec = cc.audio_opus_fec;
+    config.audio_opus_ptime = cc.audio_opus_ptime;
+    config.audio_opus_stereo = cc.audio_opus_stereo;
+    config.stats_interval_ms = cc.stats_interval_ms;
+    config.reconnect_max_attempts = cc.reconnect_max_attempts;
+    config.data_channel_signaling = cc.data_channel_signaling;
+    config.ignore_disconnect_websocket = cc.ignore_disconnect_websocket;
+    config.data_channels = data_channels_;
+    config.simulcast = cc.simulcast;
+    config.simulcast_rid = cc.simulcast_rid;
+    config.spotlight = cc.spotlight;
+    config.spotlight_number = cc.spotlight_number;
+    config.adaptive_quality = cc.adaptive_quality;
+    config.adaptive_quality_target_frame_ms =
+        cc.adaptive_quality_target_frame_ms;
+    config.ice_candidate_pool_size = cc.ice_candidate_pool_size;
+    config.ice_transport_policy =
+        cc.ice_transport_policy == "Relay"
+            ? SoraSignalingConfig::IceTransportPolicy::Relay
+            : cc.ice_transport_policy == "RelayTls"
+                  ? SoraSignalingConfig::IceTransportPolicy::RelayTls
+                  : SoraSignalingConfig::IceTransportPolicy::All;
+    config.ice_continual_gathering = cc.ice_continual_gathering;
+    // 音声以外の用途では、指定が無ければ音質を優先して高めのビットレートにする
+    if (config.audio_bitrate == 0 && cc.audio_profile != "Voice") {
+      config.audio_bitrate = 128;
+    }
     if (!cc.metadata.empty()) {
       boost::json::error_code ec;
       auto md = boost::json::parse(cc.metadata, ec);
@@ -219,25 +680,36 @@ bool Sora::DoConnect(const Sora::ConnectConfig& cc) {
       }
     }
 
-    ioc_.reset(new boost::asio::io_context(1));
+    // SharedEngine を使う場合はシグナリングの io_context とスレッドも共有する
+    boost::asio::io_context* ioc;
+    if (shared_engine_) {
+      ioc = &shared_engine_->ioc();
+    } else {
+      ioc_.reset(new boost::asio::io_context(1));
+      ioc = ioc_.get();
+    }
     signaling_ = SoraSignaling::Create(
-        *ioc_, rtc_manager_.get(), config, [this](std::string json) {
-          std::lock_guard<std::mutex> guard(event_mutex_);
-          event_queue_.push_back([this, json = std::move(json)]() {
-            // ここは Unity スレッドから呼ばれる
-            if (on_notify_) {
-              on_notify_(std::move(json));
-            }
-          });
+        *ioc, rtc_manager_.get(), config, [this](std::string json) {
+          PushEvent(Event(Event::Type::Notify, std::move(json)));
         });
     if (signaling_ == nullptr) {
       return false;
     }
-    if (!signaling_->Connect()) {
+    // 受信したバッファはコピーせずに Unity スレッドまで持っていく
+    signaling_->SetOnMessage(
+        [this](const std::string& label, const rtc::CopyOnWriteBuffer& data) {
+          PushEvent(Event(Event::Type::DataChannelMessage, label, data));
+        });
+    // connect メッセージは Connect() で送る
+    if (!signaling_->Preconnect()) {
       return false;
     }
   }
 
+  if (shared_engine_) {
+    return true;
+  }
+
   thread_ = rtc::Thread::Create();
   if (!thread_->SetName("Sora IO Thread", nullptr)) {
     RTC_LOG(LS_INFO) << "Failed to set thread name";
@@ -247,7 +719,8 @@ bool Sora::DoConnect(const Sora::ConnectConfig& cc) {
     RTC_LOG(LS_INFO) << "Failed to start thread";
     return false;
   }
-  thread_->PostTask(RTC_FROM_HERE, [this]() {
+  thread_->PostTask(RTC_FROM_HERE, [this, io_thread_config]() {
+    ApplyCurrentThreadConfig("Sora IO Thread", io_thread_config);
     RTC_LOG(LS_INFO) << "io_context started";
     ioc_->run();
     RTC_LOG(LS_INFO) << "io_context finished";
@@ -257,19 +730,43 @@ bool Sora::DoConnect(const Sora::ConnectConfig& cc) {
 }
 
 void Sora::RenderCallbackStatic(int event_id) {
-  auto sora = (sora::Sora*)IdPointer::Instance().Lookup(event_id);
+  // RenderCallback の途中で Sora が破棄されないように、ref を持ったまま呼ぶ
+  auto ref = IdPointer::Instance().Lookup(event_id, IdPointer::Type::kSora);
+  auto sora = (sora::Sora*)ref.get();
   if (sora == nullptr) {
     return;
   }
 
   sora->RenderCallback();
 }
+void Sora::MarkUnityCameraDirty() {
+  if (capturer_ != nullptr && capturer_type_ == 1) {
+    static_cast<UnityCameraCapturer*>(capturer_.get())->MarkContentDirty();
+  }
+}
+
+bool Sora::PushEncodedFrame(const void* data,
+                            int size,
+                            int64_t timestamp_us,
+                            bool is_key_frame) {
+  if (capturer_ == nullptr || capturer_type_ != 2) {
+    RTC_LOG(LS_ERROR) << "PushEncodedFrame requires capturer_type=2";
+    return false;
+  }
+  if (size <= 0) {
+    return false;
+  }
+  return static_cast<EncodedVideoTrackSource*>(capturer_.get())
+      ->PushEncodedFrame((const uint8_t*)data, (size_t)size, timestamp_us,
+                         is_key_frame);
+}
+
 int Sora::GetRenderCallbackEventID() const {
   return ptrid_;
 }
 
 void Sora::RenderCallback() {
-  if (capturer_ != nullptr && capturer_type_ != 0) {
+  if (capturer_ != nullptr && capturer_type_ == 1) {
     static_cast<UnityCameraCapturer*>(capturer_.get())->OnRender();
   }
 }
@@ -277,21 +774,128 @@ void Sora::ProcessAudio(const void* p, int offset, int samples) {
   if (!unity_adm_) {
     return;
   }
-  // 今のところステレオデータを渡すようにしてるので2倍する
-  unity_adm_->ProcessAudioData((const float*)p + offset, samples * 2);
+  // samples はフレーム数で、チャンネル数は接続時に指定したものを使う
+  unity_adm_->ProcessAudioData((const float*)p + offset, samples);
+}
+void Sora::PullAudio(float* dst, int frames, int channels) {
+  if (!unity_adm_) {
+    std::fill(dst, dst + frames * channels, 0.0f);
+    return;
+  }
+  unity_adm_->PullAudioData(dst, frames, channels);
+}
+void Sora::PullTrackAudio(ptrid_t track_id,
+                          float* dst,
+                          int frames,
+                          int channels) {
+  if (!audio_track_receiver_) {
+    std::fill(dst, dst + frames * channels, 0.0f);
+    return;
+  }
+  audio_track_receiver_->Pull(track_id, dst, frames, channels);
 }
 void Sora::SetOnHandleAudio(std::function<void(const int16_t*, int, int)> f) {
   on_handle_audio_ = f;
 }
 
+bool Sora::ApplyScalabilityMode(const std::string& scalability_mode,
+                                RTCManagerConfig& config) {
+  int spatial_layers = 0;
+  int temporal_layers = 0;
+  char rest = 0;
+  // WebRTC の VP9 のエンコーダは空間レイヤーも時間レイヤーも 3 つまで
+  if (sscanf(scalability_mode.c_str(), "L%dT%d%c", &spatial_layers,
+             &temporal_layers, &rest) != 2 ||
+      spatial_layers < 1 || spatial_layers > 3 || temporal_layers < 1 ||
+      temporal_layers > 3) {
+    RTC_LOG(LS_ERROR) << "Invalid video_scalability_mode: " << scalability_mode;
+    return false;
+  }
+  config.vp9_spatial_layers = spatial_layers;
+  config.vp9_temporal_layers = temporal_layers;
+  return true;
+}
+
+bool Sora::ApplyAudioProfile(const std::string& audio_profile,
+                             RTCManagerConfig& config) {
+  if (audio_profile == "Voice") {
+    // 通話向け。マイクの音声に全ての処理をかける
+  } else if (audio_profile == "Music") {
+    // 楽器や BGM 向け。スピーカーからの回り込みは防ぎつつ、音を加工する処理は無効にする
+    config.disable_auto_gain_control = true;
+    config.disable_noise_suppression = true;
+    config.disable_highpass_filter = true;
+    config.disable_typing_detection = true;
+  } else if (audio_profile == "RawGameAudio") {
+    // unity_audio_input で送るゲームの合成音向け。マイクを通らないので処理は一切しない
+    config.disable_echo_cancellation = true;
+    config.disable_auto_gain_control = true;
+    config.disable_noise_suppression = true;
+    config.disable_highpass_filter = true;
+    config.disable_typing_detection = true;
+    config.disable_audio_processing = true;
+  } else {
+    RTC_LOG(LS_ERROR) << "Invalid audio_profile: " << audio_profile;
+    return false;
+  }
+  return true;
+}
+
+bool Sora::ApplyVideoFec(const std::string& video_fec,
+                         RTCManagerConfig& config) {
+  if (video_fec == "Default") {
+    config.video_fec = RTCManagerConfig::VideoFec::kDefault;
+  } else if (video_fec == "None") {
+    config.video_fec = RTCManagerConfig::VideoFec::kNone;
+  } else if (video_fec == "Ulpfec") {
+    config.video_fec = RTCManagerConfig::VideoFec::kUlpfec;
+  } else if (video_fec == "Flexfec") {
+    config.video_fec = RTCManagerConfig::VideoFec::kFlexfec;
+  } else {
+    RTC_LOG(LS_ERROR) << "Invalid video_fec: " << video_fec;
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<RTCEngine> Sora::CreateRTCEngine(
+    const ConnectConfig& cc,
+    const RTCManagerConfig& config,
+    std::function<void(const int16_t*, int, int)> on_handle_audio,
+    rtc::scoped_refptr<UnityAudioDevice>* adm) {
+  std::unique_ptr<rtc::Thread> worker_thread = rtc::Thread::Create();
+  worker_thread->Start();
+
+  auto task_queue_factory = webrtc::CreateDefaultTaskQueueFactory();
+  *adm = CreateADM(task_queue_factory.get(), false, cc.unity_audio_input,
+                   cc.unity_audio_output, std::move(on_handle_audio),
+                   cc.unity_audio_sample_rate, cc.unity_audio_channels,
+                   cc.unity_audio_output_per_track, cc.audio_recording_device,
+                   cc.audio_playout_device, config.audio_playout_thread_config,
+                   config.audio_recording_thread_config, worker_thread.get());
+  if (!*adm) {
+    return nullptr;
+  }
+
+  std::unique_ptr<rtc::Thread> signaling_thread = rtc::Thread::Create();
+  return RTCEngine::Create(config, *adm, std::move(task_queue_factory),
+                           std::move(signaling_thread),
+                           std::move(worker_thread));
+}
+
 rtc::scoped_refptr<UnityAudioDevice> Sora::CreateADM(
     webrtc::TaskQueueFactory* task_queue_factory,
     bool dummy_audio,
     bool unity_audio_input,
     bool unity_audio_output,
     std::function<void(const int16_t*, int, int)> on_handle_audio,
+    int unity_audio_sample_rate,
+    int unity_audio_channels,
+    bool unity_audio_output_per_track,
     std::string audio_recording_device,
     std::string audio_playout_device,
+    const ThreadConfig& playout_thread_config,
+    const ThreadConfig& recording_thread_config,
     rtc::Thread* worker_thread) {
   rtc::scoped_refptr<webrtc::AudioDeviceModule> adm;
 
@@ -329,61 +933,176 @@ rtc::scoped_refptr<UnityAudioDevice> Sora::CreateADM(
       RTC_FROM_HERE, [&] {
         return UnityAudioDevice::Create(adm, !unity_audio_input,
                                         !unity_audio_output, on_handle_audio,
-                                        task_queue_factory);
+                                        unity_audio_sample_rate,
+                                        unity_audio_channels,
+                                        unity_audio_output_per_track,
+                                        task_queue_factory,
+                                        playout_thread_config,
+                                        recording_thread_config);
       });
 }
 
 rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> Sora::CreateVideoCapturer(
     int capturer_type,
     void* unity_camera_texture,
+    int unity_camera_readback_latency,
+    bool unity_camera_native_texture,
+    bool device_native_frame,
     std::string video_capturer_device,
     int video_width,
     int video_height,
+    int video_fps,
     rtc::Thread* signaling_thread) {
   if (capturer_type == 0) {
     // 実カメラ（デバイス）を使う
-    // TODO(melpon): framerate をちゃんと設定する
 #if defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
-    return MacCapturer::Create(video_width, video_height, 30,
+    return MacCapturer::Create(video_width, video_height, video_fps,
                                video_capturer_device);
 #elif defined(SORA_UNITY_SDK_ANDROID)
     JNIEnv* jni = webrtc::AttachCurrentThreadIfNeeded();
     return AndroidCapturer::Create(jni, signaling_thread, video_width,
-                                   video_height, 30, video_capturer_device);
+                                   video_height, video_fps,
+                                   video_capturer_device);
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+    // VideoCaptureModule は I420 に変換してしまうので、V4L2 から直接取り出す
+    return V4L2VideoCapturer::Create(video_width, video_height, video_fps,
+                                     video_capturer_device,
+                                     device_native_frame);
 #else
-    return DeviceVideoCapturer::Create(video_width, video_height, 30,
+    return DeviceVideoCapturer::Create(video_width, video_height, video_fps,
                                        video_capturer_device);
 #endif
+  } else if (capturer_type == 2) {
+    // アプリがエンコードした映像を使う
+    return EncodedVideoTrackSource::Create(video_width, video_height);
   } else {
     // Unity のカメラからの映像を使う
-    return UnityCameraCapturer::Create(&UnityContext::Instance(),
-                                       unity_camera_texture, video_width,
-                                       video_height);
+    return UnityCameraCapturer::Create(
+        &UnityContext::Instance(), unity_camera_texture, video_width,
+        video_height, unity_camera_readback_latency,
+        unity_camera_native_texture);
   }
 }
 
 void Sora::GetStats(std::function<void(std::string)> on_get_stats) {
   auto conn = signaling_ == nullptr ? nullptr : signaling_->getRTCConnection();
   if (signaling_ == nullptr || conn == nullptr) {
-    std::lock_guard<std::mutex> guard(event_mutex_);
-    event_queue_.push_back([on_get_stats = std::move(on_get_stats)]() {
-      // ここは Unity スレッドから呼ばれる
-      on_get_stats("[]");
-    });
+    PushEvent(Event(Event::Type::GetStats, AppendSoraStats("[]"),
+                    std::move(on_get_stats)));
+    return;
+  }
+
+  // 新しい統計情報を取得済みならそれを使う
+  auto sampler = signaling_->GetStatsSampler();
+  auto report = sampler->GetLatestReport(sampler->interval_ms());
+  if (report != nullptr) {
+    PushEvent(Event(Event::Type::GetStats, AppendSoraStats(report->ToJson()),
+                    std::move(on_get_stats)));
     return;
   }
 
   conn->GetStats(
       [this, on_get_stats = std::move(on_get_stats)](
           const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
-        std::string json = report->ToJson();
-        std::lock_guard<std::mutex> guard(event_mutex_);
-        event_queue_.push_back(
-            [on_get_stats = std::move(on_get_stats), json = std::move(json)]() {
-              // ここは Unity スレッドから呼ばれる
-              on_get_stats(std::move(json));
-            });
+        std::string json = AppendSoraStats(report->ToJson());
+        PushEvent(Event(Event::Type::GetStats, std::move(json),
+                        std::move(on_get_stats)));
       });
 }
 
+int Sora::GetRtpStats(int age, sora_rtp_stats_t* stats, int max_count) {
+  if (signaling_ == nullptr) {
+    return -1;
+  }
+  return signaling_->GetStatsSampler()->GetRtpStats(age, stats, max_count);
+}
+
+void Sora::ReportFrameTime(double frame_ms) {
+  if (signaling_ == nullptr) {
+    return;
+  }
+  auto controller = signaling_->GetQualityController();
+  if (controller != nullptr) {
+    controller->ReportFrameTime(frame_ms);
+  }
+}
+
+int Sora::GetQualityLevel() {
+  if (signaling_ == nullptr) {
+    return 0;
+  }
+  auto controller = signaling_->GetQualityController();
+  return controller == nullptr ? 0 : controller->level();
+}
+
+std::string Sora::AppendSoraStats(std::string json) {
+  if (json.empty() || json.back() != ']') {
+    return json;
+  }
+
+  std::string stats;
+  if (renderer_ != nullptr) {
+    boost::json::object obj;
+    obj["type"] = "sora-unity-renderer";
+    obj["id"] = "sora-unity-renderer";
+    obj["bufferBytes"] = renderer_->GetBufferBytes();
+    stats += boost::json::serialize(obj);
+  }
+
+  // プロセス全体の対象ごとのメモリの使用量
+  {
+    boost::json::object obj;
+    obj["type"] = "sora-unity-memory";
+    obj["id"] = "sora-unity-memory";
+    for (int i = 0; i < (int)MemoryCategory::kCount; i++) {
+      auto usage = MemoryStats::Instance().Get((MemoryCategory)i);
+      boost::json::object u;
+      u["bytes"] = usage.bytes;
+      u["peakBytes"] = usage.peak_bytes;
+      u["count"] = usage.count;
+      u["peakCount"] = usage.peak_count;
+      obj[GetMemoryCategoryName((MemoryCategory)i)] = std::move(u);
+    }
+    if (!stats.empty()) {
+      stats += ",";
+    }
+    stats += boost::json::serialize(obj);
+  }
+
+  // ハードウェアエンコーダが報告したフレームの情報。今は NVENC だけ
+  {
+    auto s = EncoderStats::Instance().Get();
+    boost::json::object obj;
+    obj["type"] = "sora-unity-encoder";
+    obj["id"] = "sora-unity-encoder";
+    obj["frames"] = s.frames;
+    obj["keyFrames"] = s.key_frames;
+    obj["totalBytes"] = s.total_bytes;
+    obj["totalQp"] = s.total_qp;
+    obj["totalLatencyUs"] = s.total_latency_us;
+    obj["maxLatencyUs"] = s.max_latency_us;
+    boost::json::array buckets;
+    for (int i = 0; i < EncoderStats::kSizeBucketCount; i++) {
+      boost::json::object b;
+      // lessThanBytes 未満のフレームの数。最後の区間は上限なし
+      if (i < EncoderStats::kSizeBucketCount - 1) {
+        b["lessThanBytes"] = EncoderStats::kSizeBucketLimits[i];
+      }
+      b["count"] = s.size_buckets[i];
+      buckets.push_back(std::move(b));
+    }
+    obj["frameSizes"] = std::move(buckets);
+    stats += ",";
+    stats += boost::json::serialize(obj);
+  }
+
+  json.pop_back();
+  if (json.size() > 1) {
+    json += ",";
+  }
+  json += stats;
+  json += "]";
+  return json;
+}
+
 }  // namespace sora
@@ -1,15 +1,21 @@
 #ifndef SORA_SORA_H_INCLUDED
 #define SORA_SORA_H_INCLUDED
 
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 // boost
 #include <boost/asio/io_context.hpp>
 
 #if defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
 #include "mac_helper/mac_capturer.h"
+#elif defined(SORA_UNITY_SDK_UBUNTU)
+#include "rtc/v4l2_video_capturer.h"
 #else
 #include "rtc/device_video_capturer.h"
 #endif
@@ -21,10 +27,14 @@
 
 // sora
 #include "id_pointer.h"
+#include "memory_stats.h"
+#include "rtc/encoded_video_track_source.h"
 #include "rtc/rtc_manager.h"
+#include "shared_engine.h"
 #include "sora_signaling.h"
 #include "unity.h"
 #include "unity_audio_device.h"
+#include "unity_audio_track_receiver.h"
 #include "unity_camera_capturer.h"
 #include "unity_context.h"
 #include "unity_renderer.h"
@@ -36,22 +46,74 @@ class Sora {
   UnityContext* context_;
   std::string signaling_url_;
   std::string channel_id_;
+  // RTCManager より後に破棄する必要があるので、rtc_manager_ より前に置く
+  std::unique_ptr<UnityAudioTrackReceiver> audio_track_receiver_;
   std::unique_ptr<RTCManager> rtc_manager_;
   std::shared_ptr<SoraSignaling> signaling_;
   std::unique_ptr<rtc::Thread> thread_;
   std::unique_ptr<UnityRenderer> renderer_;
+  // shared_engine の場合に使う。他の Sora と共有しているので、最後に破棄する
+  std::shared_ptr<SharedEngine> shared_engine_;
   std::function<void(ptrid_t)> on_add_track_;
   std::function<void(ptrid_t)> on_remove_track_;
+  std::function<void(ptrid_t)> on_add_audio_track_;
+  std::function<void(ptrid_t)> on_remove_audio_track_;
   std::function<void(std::string)> on_notify_;
   std::function<void(const int16_t*, int, int)> on_handle_audio_;
+  std::function<void(const std::string&, const uint8_t*, size_t)>
+      on_data_channel_message_;
+  std::function<void()> on_key_frame_request_;
 
+  // Unity スレッドに渡すイベント。
+  // 毎回 std::function を確保しないように、種類と値だけを持つ
+  struct Event {
+    enum class Type {
+      AddTrack,
+      RemoveTrack,
+      AddAudioTrack,
+      RemoveAudioTrack,
+      Notify,
+      GetStats,
+      DataChannelMessage,
+      KeyFrameRequest,
+    };
+    Type type;
+    ptrid_t track_id = 0;
+    std::string json;
+    std::function<void(std::string)> on_get_stats;
+    // DataChannelMessage の場合のラベルと、受信したバッファそのもの
+    std::string label;
+    rtc::CopyOnWriteBuffer data;
+
+    explicit Event(Type type) : type(type) {}
+    Event(Type type, ptrid_t track_id) : type(type), track_id(track_id) {}
+    Event(Type type,
+          std::string json,
+          std::function<void(std::string)> on_get_stats = nullptr)
+        : type(type),
+          json(std::move(json)),
+          on_get_stats(std::move(on_get_stats)) {}
+    Event(Type type, std::string label, rtc::CopyOnWriteBuffer data)
+        : type(type), label(std::move(label)), data(std::move(data)) {}
+  };
   std::mutex event_mutex_;
-  std::deque<std::function<void()>> event_queue_;
+  std::vector<Event> event_queue_;
+  // DispatchEvents で event_queue_ と丸ごと入れ替えて、ロックの外で処理する。
+  // 2 つの vector を交互に使うので、一度確保した領域は使い回される
+  std::vector<Event> dispatching_events_;
+  // event_queue_ に溜まっている JSON とメッセージのバイト数
+  size_t event_json_bytes_ = 0;
+  TrackedMemory event_memory_{MemoryCategory::kEventQueue};
 
   ptrid_t ptrid_;
 
   rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> capturer_;
   int capturer_type_ = 0;
+  bool prepared_ = false;
+  // SetThreadConfig で指定されたスレッドの設定。指定が無いスレッドは既定のまま
+  std::map<int, ThreadConfig> thread_configs_;
+  // AddDataChannel で指定されたメッセージング用の DataChannel
+  std::vector<SoraSignalingConfig::DataChannel> data_channels_;
 
   rtc::scoped_refptr<UnityAudioDevice> unity_adm_;
 
@@ -60,9 +122,39 @@ class Sora {
   ~Sora();
   void SetOnAddTrack(std::function<void(ptrid_t)> on_add_track);
   void SetOnRemoveTrack(std::function<void(ptrid_t)> on_remove_track);
+  void SetOnAddAudioTrack(std::function<void(ptrid_t)> on_add_audio_track);
+  void SetOnRemoveAudioTrack(
+      std::function<void(ptrid_t)> on_remove_audio_track);
   void SetOnNotify(std::function<void(std::string)> on_notify);
+  // メッセージング用の DataChannel で受信したメッセージを DispatchEvents で渡す。
+  // data は DispatchEvents の中でだけ有効
+  void SetOnDataChannelMessage(
+      std::function<void(const std::string&, const uint8_t*, size_t)>
+          on_data_channel_message);
+  // capturer_type が 2 の場合に、受信側からキーフレームを要求された時に DispatchEvents で呼ばれる。
+  // 呼ばれたらなるべく早くキーフレームを PushEncodedFrame で渡すこと
+  void SetOnKeyFrameRequest(std::function<void()> on_key_frame_request);
   void DispatchEvents();
 
+  // SDK が作るスレッドの種類
+  enum ThreadType {
+    kNetworkThread = 0,
+    kWorkerThread = 1,
+    kSignalingThread = 2,
+    kIOThread = 3,
+    kAudioPlayoutThread = 4,
+    kAudioRecordingThread = 5,
+  };
+  // Prepare() より前に呼ぶ。shared_engine の場合、IO スレッド以外の
+  // スレッドは最初に作った Sora の設定になる
+  bool SetThreadConfig(int thread_type, const ThreadConfig& config);
+  // Sora に作ってもらうメッセージング用の DataChannel を追加する。Prepare() より前に呼ぶ
+  bool AddDataChannel(const SoraSignalingConfig::DataChannel& data_channel);
+  // メッセージング用の DataChannel でバイナリを送る。どのスレッドから呼んでもいい
+  bool SendDataChannelMessage(const std::string& label,
+                              const uint8_t* data,
+                              size_t size);
+
   struct ConnectConfig {
     std::string unity_version;
     std::string signaling_url;
@@ -70,22 +162,116 @@ class Sora {
     std::string metadata;
     std::string role;
     bool multistream;
+    // false の場合は音声だけで接続し、キャプチャラや映像のコーデック、レンダラを作らない
+    bool video;
+    // 0: 実カメラ, 1: Unity のカメラ, 2: アプリがエンコードした H.264 を PushEncodedFrame で渡す。
+    // 2 の場合は video_width, video_height に実際の解像度を指定すること
     int capturer_type;
     void* unity_camera_texture;
+    int unity_camera_readback_latency;
+    // Unity のカメラの映像が変わった時だけ送る。変わったことは MarkUnityCameraDirty で知らせ、
+    // 変わらなくても unity_camera_static_refresh_ms ごとに 1 回は送る
+    bool unity_camera_static_content;
+    int unity_camera_static_refresh_ms;
+    // Unity のカメラの映像を GPU からコピーするフレームレート。0 の場合は毎フレームコピーする
+    int unity_camera_capture_fps;
     std::string video_capturer_device;
     int video_width;
     int video_height;
+    // 実カメラのフレームレート。Unity のカメラの場合は Unity の描画に合わせるので使わない
+    int video_fps;
     std::string video_codec;
     int video_bitrate;
     bool unity_audio_input;
     bool unity_audio_output;
+    // Unity の AudioSettings のサンプリングレートとチャンネル数
+    int unity_audio_sample_rate;
+    int unity_audio_channels;
+    // 受信した音声をミックスせずに、トラックごとに PullTrackAudio で取り出す
+    bool unity_audio_output_per_track;
     std::string audio_recording_device;
     std::string audio_playout_device;
     std::string audio_codec;
     int audio_bitrate;
+    // 音声処理のプロファイル。"Voice", "Music", "RawGameAudio" のどれか
+    std::string audio_profile;
+    // Opus の DTX, in-band FEC, 1 パケットの長さ (ミリ秒、0 なら既定値)、ステレオ、
+    // 符号化の複雑さ (0-10、-1 なら既定値)。audio_codec が OPUS の場合だけ使う
+    bool audio_opus_dtx;
+    bool audio_opus_fec;
+    int audio_opus_ptime;
+    bool audio_opus_stereo;
+    int audio_opus_complexity;
+    // 映像の FEC。"Default", "None", "Ulpfec", "Flexfec" のどれか
+    std::string video_fec;
+    // Opus を RED で冗長化して送る。audio_codec が OPUS の場合だけ使う
+    bool audio_red;
+    // 統計情報を取得する間隔（ミリ秒）
+    int stats_interval_ms;
+    // シグナリングが切れた時に再接続を試みる最大回数。0 の場合は再接続しない
+    int reconnect_max_attempts;
+    // 接続後のシグナリングを DataChannel で行い、必要なら WebSocket を切断する
+    bool data_channel_signaling;
+    bool ignore_disconnect_websocket;
+    // simulcast で送受信する。simulcast_rid は受信するレイヤーで、空なら Sora に任せる
+    bool simulcast;
+    std::string simulcast_rid;
+    // スポットライトで、音声の大きい spotlight_number 人だけを高画質で受信する。
+    // spotlight_number が 0 の場合は Sora の設定に任せる
+    bool spotlight;
+    int spotlight_number;
+    // 送信する映像の解像度とフレームレートを、統計情報と ReportFrameTime で
+    // 受け取ったフレーム時間から調整する
+    bool adaptive_quality;
+    double adaptive_quality_target_frame_ms;
+    // 送信する帯域の推定の開始値と範囲 (kbps)。0 の場合は WebRTC の既定値を使う
+    int video_start_bitrate;
+    int video_min_bitrate;
+    int video_max_bitrate;
+    std::string field_trials;
+    // 自分の映像の表示方法。
+    // 0: 受信した映像と同じく OnAddTrack で通知して UnityRenderer で描画する
+    // 1: Unity のカメラの場合は UnityRenderer を使わない（Unity 側でカメラのテクスチャを表示する）。
+    //    実カメラの場合は 0 と同じ
+    // 2: 表示しない
+    int local_preview;
+    int renderer_convert_threads;
+    int video_encoder_output_delay;
+    bool video_encoder_intra_refresh;
+    // libvpx のエンコーダに使わせるスレッド数の上限。0 の場合は CPU のコア数から決める
+    int video_encoder_threads;
+    // VP9 を SVC で送る場合の空間レイヤーと時間レイヤーの数を "L3T3" の形式で指定する。
+    // 空の場合は SVC にしない
+    std::string video_scalability_mode;
+    bool video_decoder_texture_output;
+    bool video_decoder_async_output;
+    // 受信した映像を表示するまでの遅延の下限と上限、音声のジッタバッファの遅延の下限 (ミリ秒)。
+    // -1 の場合は WebRTC に任せる
+    int video_playout_delay_min_ms;
+    int video_playout_delay_max_ms;
+    int audio_jitter_buffer_min_delay_ms;
+    // 滑らかさより遅延を優先する。上の値で指定しなかったものは遅延が最小になる設定にする
+    bool low_latency;
+    // NVENC と NVDEC を動かすアダプタの番号 (IDXGIFactory1::EnumAdapters の順番)。
+    // -1 の場合は Unity が描画に使っているアダプタを使う
+    int gpu_adapter_index;
+    // 同じプロセスの他の Sora と PeerConnectionFactory やスレッドを共有する
+    bool shared_engine;
+    // 指定すると、送受信する映像を再エンコードせずにこのディレクトリへ IVF で書き出す
+    std::string recording_directory;
+    // 先に集めておく ICE の候補の数と、使う候補の種類 ("All", "Relay", "RelayTls")、
+    // 接続後も候補を集め続けるか
+    int ice_candidate_pool_size;
+    std::string ice_transport_policy;
+    bool ice_continual_gathering;
   };
 
-  bool Connect(const ConnectConfig& config);
+  // 接続に必要なスレッドや PeerConnectionFactory、キャプチャラを作り、
+  // シグナリングの WebSocket の接続までを済ませておく。
+  // ロード画面の間などに呼んでおくと、Connect() から映像が届くまでの時間が減る
+  bool Prepare(const ConnectConfig& config);
+  // Prepare() の後に呼ぶ。connect メッセージを送って接続を開始する
+  bool Connect();
 
   static void UNITY_INTERFACE_API RenderCallbackStatic(int event_id);
   int GetRenderCallbackEventID() const;
@@ -93,12 +279,62 @@ class Sora {
   void RenderCallback();
 
   void ProcessAudio(const void* p, int offset, int samples);
+  // OnHandleAudio を設定していない場合に、受信した音声を Unity のオーディオスレッドから取り出す
+  void PullAudio(float* dst, int frames, int channels);
+  // unity_audio_output_per_track の場合に、track_id のトラックの音声を取り出す
+  void PullTrackAudio(ptrid_t track_id, float* dst, int frames, int channels);
   void SetOnHandleAudio(std::function<void(const int16_t*, int, int)> f);
 
   void GetStats(std::function<void (std::string)> on_get_stats);
+  // age 回前に取得した統計情報を最大 max_count 個 stats に書き込み、ストリームの数を返す。
+  // age が 0 の場合は最新のもの。その回の統計情報が無い場合は -1 を返す
+  int GetRtpStats(int age, sora_rtp_stats_t* stats, int max_count);
+
+  // adaptive_quality の場合に、Unity の 1 フレームにかかった時間を渡す
+  void ReportFrameTime(double frame_ms);
+  // adaptive_quality で落としている段階。0 が最高品質
+  int GetQualityLevel();
+
+  // unity_camera_static_content の場合に、Unity のカメラの映像が変わったことを知らせる
+  void MarkUnityCameraDirty();
+
+  // capturer_type が 2 の場合に、Annex B 形式の H.264 のアクセスユニットを 1 つ送る。
+  // data はこの中でコピーするので、呼び出し後すぐに再利用していい
+  bool PushEncodedFrame(const void* data,
+                        int size,
+                        int64_t timestamp_us,
+                        bool is_key_frame);
 
  private:
-  bool DoConnect(const ConnectConfig& config);
+  bool DoPrepare(const ConnectConfig& config);
+
+  // どのスレッドから呼んでもいい
+  void PushEvent(Event ev);
+  // Unity スレッドから呼ばれる
+  void DispatchEvent(Event& ev);
+
+  // WebRTC の統計情報に Sora Unity SDK 独自の統計情報を追加する
+  std::string AppendSoraStats(std::string json);
+
+  // audio_profile に合わせて音声処理の設定をする。
+  // 不明なプロファイルの場合は false を返す
+  static bool ApplyAudioProfile(const std::string& audio_profile,
+                                RTCManagerConfig& config);
+  // "Ulpfec" のような video_fec を RTCManagerConfig::VideoFec にする。
+  // 不明な値の場合は false を返す
+  static bool ApplyVideoFec(const std::string& video_fec,
+                            RTCManagerConfig& config);
+  // "L3T3" のような scalability mode を VP9 の SVC のレイヤー数にする。
+  // 形式が正しくない場合は false を返す
+  static bool ApplyScalabilityMode(const std::string& scalability_mode,
+                                   RTCManagerConfig& config);
+
+  // ADM とスレッドを作って RTCEngine を作る。作った ADM は adm に入れる
+  static std::shared_ptr<RTCEngine> CreateRTCEngine(
+      const ConnectConfig& cc,
+      const RTCManagerConfig& config,
+      std::function<void(const int16_t*, int, int)> on_handle_audio,
+      rtc::scoped_refptr<UnityAudioDevice>* adm);
 
   static rtc::scoped_refptr<UnityAudioDevice> CreateADM(
       webrtc::TaskQueueFactory* task_queue_factory,
@@ -106,16 +342,25 @@ class Sora {
       bool unity_audio_input,
       bool unity_audio_output,
       std::function<void(const int16_t*, int, int)> on_handle_audio,
+      int unity_audio_sample_rate,
+      int unity_audio_channels,
+      bool unity_audio_output_per_track,
       std::string audio_recording_device,
       std::string audio_playout_device,
+      const ThreadConfig& playout_thread_config,
+      const ThreadConfig& recording_thread_config,
       rtc::Thread* worker_thread);
 
   static rtc::scoped_refptr<rtc::AdaptedVideoTrackSource> CreateVideoCapturer(
       int capturer_type,
       void* unity_camera_texture,
+      int unity_camera_readback_latency,
+      bool unity_camera_native_texture,
+      bool device_native_frame,
       std::string video_capturer_device,
       int video_width,
       int video_height,
+      int video_fps,
       rtc::Thread* signaling_thread);
 };
 
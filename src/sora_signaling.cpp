@@ -1,14 +1,28 @@
 #include "sora_signaling.h"
 #include "sora_version.h"
 
+#include <algorithm>
+#include <chrono>
+
 #include <boost/asio/connect.hpp>
-#include <boost/beast/core/buffers_to_string.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/beast/websocket/stream.hpp>
 #include <boost/json.hpp>
 #include <boost/preprocessor/stringize.hpp>
 
+// WebRTC
+#include <absl/strings/string_view.h>
+#include <rtc_base/logging.h>
+
 namespace {
 
+// 受信したメッセージを INFO でログに出力する時の最大の長さ
+const size_t kMaxLogTextLength = 256;
+
+absl::string_view ToAbslStringView(boost::beast::string_view s) {
+  return absl::string_view(s.data(), s.size());
+}
+
 std::string iceConnectionStateToString(
     webrtc::PeerConnectionInterface::IceConnectionState state) {
   switch (state) {
@@ -50,6 +64,15 @@ std::shared_ptr<RTCConnection> SoraSignaling::getRTCConnection() const {
   }
 }
 
+std::shared_ptr<StatsSampler> SoraSignaling::GetStatsSampler() const {
+  return stats_sampler_;
+}
+
+std::shared_ptr<QualityController> SoraSignaling::GetQualityController()
+    const {
+  return quality_controller_;
+}
+
 std::shared_ptr<SoraSignaling> SoraSignaling::Create(
     boost::asio::io_context& ioc,
     RTCManager* manager,
@@ -70,33 +93,118 @@ SoraSignaling::SoraSignaling(boost::asio::io_context& ioc,
     : ioc_(ioc),
       manager_(manager),
       config_(config),
-      on_notify_(std::move(on_notify)) {}
+      on_notify_(std::move(on_notify)),
+      stats_sampler_(StatsSampler::Create(config.stats_interval_ms,
+                                          config.stats_history_size)),
+      reconnect_timer_(ioc),
+      random_(std::random_device()()) {}
 
 bool SoraSignaling::Init() {
+  // Sora はメッセージング用の DataChannel を DataChannel シグナリングの場合だけ作る
+  if (!config_.data_channels.empty() && !config_.data_channel_signaling) {
+    RTC_LOG(LS_INFO) << "data_channels requires data_channel_signaling";
+    config_.data_channel_signaling = true;
+  }
+  if (config_.adaptive_quality) {
+    auto controller = std::make_shared<QualityController>(
+        config_.adaptive_quality_target_frame_ms);
+    stats_sampler_->SetOnReport(
+        [controller](
+            const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
+          controller->OnReport(report);
+        });
+    quality_controller_ = controller;
+  }
   return true;
 }
 
 void SoraSignaling::Release() {
   // connection_ を nullptr にした上で解放する
   // デストラクタ中にコールバックが呼ばれて解放中の connection_ にアクセスしてしまうことがあるため
+  // 統計情報の取得も接続を解放する前に止めておく
+  closing_ = true;
+  reconnect_timer_.cancel();
+  stats_sampler_->Stop();
+  data_channels_.clear();
+  ClearMessagingChannels(true);
+  // io_context を共有している場合は Release の後もハンドラが呼ばれるので、
+  // Sora に通知しないようにして、WebSocket も閉じておく
+  on_notify_ = nullptr;
+  if (ws_ != nullptr && connected_) {
+    connected_ = false;
+    Close();
+  }
   auto connection = std::move(connection_);
   connection = nullptr;
 }
 
 bool SoraSignaling::Connect() {
-  RTC_LOG(LS_INFO) << __FUNCTION__;
+  return StartConnect(true);
+}
+
+bool SoraSignaling::Preconnect() {
+  return StartConnect(false);
+}
+
+bool SoraSignaling::StartConnect(bool send_connect) {
+  RTC_LOG(LS_INFO) << __FUNCTION__ << " send_connect=" << send_connect;
 
-  if (connected_) {
+  // URL が間違っている場合だけは、呼び出し元に失敗を返せるようにここで調べる
+  URLParts parts;
+  if (!URLParts::Parse(config_.signaling_url, parts) ||
+      (parts.scheme != "ws" && parts.scheme != "wss")) {
+    RTC_LOG(LS_ERROR) << "Invalid Signaling URL: " << config_.signaling_url;
     return false;
   }
+  RTC_LOG(LS_INFO) << "Connect to " << parts.host;
 
-  std::string port = "443";
-  if (!parts_.port.empty()) {
-    port = parts_.port;
-  }
+  // ws_ や connected_ は io_context のスレッドで触っているので、接続はそちらで始める
+  boost::asio::post(ioc_, [self = shared_from_this(), send_connect]() {
+    if (self->closing_) {
+      return;
+    }
+    bool connect_requested = self->connect_requested_;
+    if (send_connect) {
+      self->connect_requested_ = true;
+    }
+    if (self->connected_) {
+      if (send_connect && !connect_requested) {
+        self->DoSendConnect();
+      }
+      return;
+    }
+    // 接続中なら OnConnect で connect メッセージを送る
+    if (self->ws_ != nullptr) {
+      return;
+    }
+    if (!self->ConnectWebsocket()) {
+      RTC_LOG(LS_ERROR) << "Failed to connect signaling";
+    }
+  });
+  return true;
+}
 
-  RTC_LOG(LS_INFO) << "Connect to " << parts_.host;
+void SoraSignaling::SendConnect() {
+  boost::asio::post(ioc_, [self = shared_from_this()]() {
+    if (self->closing_ || self->connect_requested_) {
+      return;
+    }
+    self->connect_requested_ = true;
+    if (self->connected_) {
+      self->DoSendConnect();
+    } else if (self->ws_ == nullptr && !self->reconnect_pending_) {
+      // 先に確立していた接続が切れていて再接続もしていない場合は、ここで接続し直す
+      self->reconnect_attempts_ = 0;
+      self->closed_ws_.reset();
+      if (!self->ConnectWebsocket()) {
+        RTC_LOG(LS_ERROR) << "Failed to connect signaling";
+      }
+    }
+    // それ以外は接続中なので、OnConnect で connect メッセージを送る
+  });
+}
 
+bool SoraSignaling::ConnectWebsocket() {
   URLParts parts;
   if (!URLParts::Parse(config_.signaling_url, parts)) {
     RTC_LOG(LS_ERROR) << "Invalid Signaling URL: " << config_.signaling_url;
@@ -122,6 +230,16 @@ void SoraSignaling::OnConnect(boost::system::error_code ec) {
 
   if (ec) {
     RTC_LOG(LS_ERROR) << "Failed Websocket handshake: " << ec;
+    // 最初の接続に失敗した場合は再接続しない
+    if (reconnect_attempts_ > 0) {
+      OnDisconnect();
+    } else {
+      closed_ws_ = std::move(ws_);
+    }
+    return;
+  }
+
+  if (closing_) {
     return;
   }
 
@@ -129,7 +247,67 @@ void SoraSignaling::OnConnect(boost::system::error_code ec) {
   RTC_LOG(LS_INFO) << "Signaling Websocket is connected";
 
   DoRead();
-  DoSendConnect();
+  if (connect_requested_) {
+    DoSendConnect();
+  }
+}
+
+void SoraSignaling::OnDisconnect() {
+  connected_ = false;
+  // DataChannel に切り替えて自分で切断した場合は再接続しない
+  if (closing_ || websocket_disabled_) {
+    return;
+  }
+  if (reconnect_attempts_ >= config_.reconnect_max_attempts) {
+    RTC_LOG(LS_ERROR) << "Signaling is disconnected: reconnect_attempts="
+                      << reconnect_attempts_;
+    closed_ws_ = std::move(ws_);
+    return;
+  }
+
+  int delay_ms = config_.reconnect_initial_delay_ms;
+  for (int i = 0;
+       i < reconnect_attempts_ && delay_ms < config_.reconnect_max_delay_ms;
+       i++) {
+    delay_ms *= 2;
+  }
+  delay_ms = std::min(delay_ms, config_.reconnect_max_delay_ms);
+  delay_ms -= std::uniform_int_distribution<int>(0, delay_ms / 2)(random_);
+  reconnect_attempts_ += 1;
+
+  RTC_LOG(LS_WARNING) << "Reconnect signaling after " << delay_ms
+                      << " ms: attempt=" << reconnect_attempts_;
+
+  // PeerConnection はそのまま残しておき、再接続して offer が来たら置き換える
+  closed_ws_ = std::move(ws_);
+  reconnect_pending_ = true;
+  reconnect_timer_.expires_after(std::chrono::milliseconds(delay_ms));
+  reconnect_timer_.async_wait(std::bind(&SoraSignaling::OnReconnectTimer,
+                                        shared_from_this(),
+                                        std::placeholders::_1));
+}
+
+void SoraSignaling::OnReconnectTimer(boost::system::error_code ec) {
+  reconnect_pending_ = false;
+  if (ec || closing_) {
+    return;
+  }
+  closed_ws_.reset();
+  if (!ConnectWebsocket()) {
+    OnDisconnect();
+  }
+}
+
+void SoraSignaling::SendText(std::string text) {
+  boost::asio::post(ioc_, [self = shared_from_this(),
+                           text = std::move(text)]() mutable {
+    // 再接続中のメッセージは捨てる。再接続したら offer からやり直しになる
+    if (self->closing_ || self->ws_ == nullptr || !self->connected_) {
+      RTC_LOG(LS_WARNING) << "Signaling is not connected, message dropped";
+      return;
+    }
+    self->ws_->WriteText(std::move(text));
+  });
 }
 
 #define SORA_CLIENT \
@@ -160,10 +338,14 @@ void SoraSignaling::DoSendConnect() {
     json_message["metadata"] = config_.metadata;
   }
 
-  json_message["video"] = boost::json::object();
-  json_message["video"].as_object()["codec_type"] = config_.video_codec;
-  if (config_.video_bitrate != 0) {
-    json_message["video"].as_object()["bit_rate"] = config_.video_bitrate;
+  if (config_.video) {
+    json_message["video"] = boost::json::object();
+    json_message["video"].as_object()["codec_type"] = config_.video_codec;
+    if (config_.video_bitrate != 0) {
+      json_message["video"].as_object()["bit_rate"] = config_.video_bitrate;
+    }
+  } else {
+    json_message["video"] = false;
   }
 
   json_message["audio"] = boost::json::object();
@@ -171,32 +353,253 @@ void SoraSignaling::DoSendConnect() {
   if (config_.audio_bitrate != 0) {
     json_message["audio"].as_object()["bit_rate"] = config_.audio_bitrate;
   }
+  if (HasOpusParams()) {
+    boost::json::object opus_params = {
+        {"useinbandfec", config_.audio_opus_fec},
+        {"usedtx", config_.audio_opus_dtx},
+    };
+    if (config_.audio_opus_ptime > 0) {
+      opus_params["ptime"] = config_.audio_opus_ptime;
+    }
+    if (config_.audio_opus_stereo) {
+      opus_params["stereo"] = true;
+      opus_params["sprop_stereo"] = true;
+    }
+    json_message["audio"].as_object()["opus_params"] = std::move(opus_params);
+  }
+
+  if (config_.simulcast) {
+    json_message["simulcast"] = true;
+    if (!config_.simulcast_rid.empty()) {
+      json_message["simulcast_rid"] = config_.simulcast_rid;
+    }
+  }
+
+  if (config_.spotlight) {
+    json_message["spotlight"] = true;
+    if (config_.spotlight_number > 0) {
+      json_message["spotlight_number"] = config_.spotlight_number;
+    }
+  }
+
+  if (config_.data_channel_signaling) {
+    json_message["data_channel_signaling"] = true;
+    json_message["ignore_disconnect_websocket"] =
+        config_.ignore_disconnect_websocket;
+  }
+
+  if (!config_.data_channels.empty()) {
+    boost::json::array jchannels;
+    for (const auto& dc : config_.data_channels) {
+      boost::json::object jchannel = {{"label", dc.label},
+                                      {"direction", dc.direction},
+                                      {"ordered", dc.ordered}};
+      if (dc.max_packet_life_time >= 0) {
+        jchannel["max_packet_life_time"] = dc.max_packet_life_time;
+      }
+      if (dc.max_retransmits >= 0) {
+        jchannel["max_retransmits"] = dc.max_retransmits;
+      }
+      jchannels.push_back(std::move(jchannel));
+    }
+    json_message["data_channels"] = std::move(jchannels);
+  }
 
-  ws_->WriteText(boost::json::serialize(json_message));
+  SendText(boost::json::serialize(json_message));
 }
 void SoraSignaling::DoSendPong() {
   boost::json::value json_message = {{"type", "pong"}};
-  ws_->WriteText(boost::json::serialize(json_message));
+  SendText(boost::json::serialize(json_message));
 }
 void SoraSignaling::DoSendPong(
     const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
   std::string stats = report->ToJson();
   std::string str = R"({"type":"pong","stats":)" + stats + "}";
-  ws_->WriteText(std::move(str));
+  SendText(std::move(str));
+}
+
+void SoraSignaling::GetStatsReport(
+    std::function<void(
+        const rtc::scoped_refptr<const webrtc::RTCStatsReport>&)> callback) {
+  auto report =
+      stats_sampler_->GetLatestReport(stats_sampler_->interval_ms() * 2);
+  if (report != nullptr) {
+    callback(report);
+  } else {
+    connection_->GetStats(std::move(callback));
+  }
+}
+
+std::vector<webrtc::RtpEncodingParameters> SoraSignaling::ParseEncodings(
+    const boost::json::array& jencodings) {
+  // 数値は整数と小数のどちらで来てもいいようにする
+  auto get_number = [](const boost::json::object& obj, const char* key,
+                       double* value) {
+    auto it = obj.find(key);
+    if (it == obj.end()) {
+      return false;
+    }
+    const boost::json::value& v = it->value();
+    if (v.is_int64()) {
+      *value = (double)v.as_int64();
+    } else if (v.is_uint64()) {
+      *value = (double)v.as_uint64();
+    } else if (v.is_double()) {
+      *value = v.as_double();
+    } else {
+      return false;
+    }
+    return true;
+  };
+
+  std::vector<webrtc::RtpEncodingParameters> encodings;
+  for (const auto& jvalue : jencodings) {
+    if (!jvalue.is_object()) {
+      continue;
+    }
+    const boost::json::object& jencoding = jvalue.as_object();
+    webrtc::RtpEncodingParameters params;
+    auto it = jencoding.find("rid");
+    if (it != jencoding.end() && it->value().is_string()) {
+      params.rid = it->value().as_string().c_str();
+    }
+    it = jencoding.find("active");
+    if (it != jencoding.end() && it->value().is_bool()) {
+      params.active = it->value().as_bool();
+    }
+    double value;
+    if (get_number(jencoding, "maxBitrate", &value)) {
+      params.max_bitrate_bps = (int)value;
+    }
+    if (get_number(jencoding, "maxFramerate", &value)) {
+      params.max_framerate = value;
+    }
+    if (get_number(jencoding, "scaleResolutionDownBy", &value)) {
+      params.scale_resolution_down_by = value;
+    }
+    RTC_LOG(LS_INFO) << "Simulcast encoding: rid=" << params.rid
+                     << " active=" << params.active << " max_bitrate_bps="
+                     << params.max_bitrate_bps.value_or(-1)
+                     << " max_framerate=" << params.max_framerate.value_or(-1)
+                     << " scale_resolution_down_by="
+                     << params.scale_resolution_down_by.value_or(-1);
+    encodings.push_back(std::move(params));
+  }
+  return encodings;
+}
+
+bool SoraSignaling::HasOpusParams() const {
+  return config_.audio_codec == "OPUS" &&
+         (config_.audio_opus_dtx || !config_.audio_opus_fec ||
+          config_.audio_opus_ptime > 0 || config_.audio_opus_stereo);
+}
+
+std::string SoraSignaling::ApplyOpusParams(const std::string& sdp) const {
+  if (!HasOpusParams()) {
+    return sdp;
+  }
+
+  std::vector<std::pair<std::string, std::string>> params = {
+      {"useinbandfec", config_.audio_opus_fec ? "1" : "0"},
+      {"usedtx", config_.audio_opus_dtx ? "1" : "0"},
+  };
+  if (config_.audio_opus_ptime > 0) {
+    params.push_back({"ptime", std::to_string(config_.audio_opus_ptime)});
+  }
+  if (config_.audio_opus_stereo) {
+    params.push_back({"stereo", "1"});
+    params.push_back({"sprop-stereo", "1"});
+  }
+
+  std::vector<std::string> lines;
+  for (size_t pos = 0; pos < sdp.size();) {
+    size_t end = sdp.find("\r\n", pos);
+    if (end == std::string::npos) {
+      lines.push_back(sdp.substr(pos));
+      break;
+    }
+    lines.push_back(sdp.substr(pos, end - pos));
+    pos = end + 2;
+  }
+
+  // a=rtpmap:<pt> opus/48000/2 から Opus のペイロードタイプを探す
+  std::vector<std::string> opus_pts;
+  for (const auto& line : lines) {
+    const std::string prefix = "a=rtpmap:";
+    if (line.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    size_t sp = line.find(' ');
+    if (sp == std::string::npos) {
+      continue;
+    }
+    std::string name = line.substr(sp + 1, 5);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "opus/") {
+      opus_pts.push_back(line.substr(prefix.size(), sp - prefix.size()));
+    }
+  }
+
+  std::string result;
+  for (const auto& line : lines) {
+    std::string out = line;
+    for (const auto& pt : opus_pts) {
+      const std::string prefix = "a=fmtp:" + pt + " ";
+      if (line.compare(0, prefix.size(), prefix) != 0) {
+        continue;
+      }
+      // 既存のパラメータを残したまま、指定したものだけ置き換える
+      std::vector<std::pair<std::string, std::string>> kvs;
+      std::string rest = line.substr(prefix.size());
+      for (size_t pos = 0; pos <= rest.size();) {
+        size_t end = rest.find(';', pos);
+        if (end == std::string::npos) {
+          end = rest.size();
+        }
+        std::string kv = rest.substr(pos, end - pos);
+        size_t eq = kv.find('=');
+        if (eq != std::string::npos) {
+          kvs.push_back({kv.substr(0, eq), kv.substr(eq + 1)});
+        }
+        pos = end + 1;
+      }
+      for (const auto& p : params) {
+        auto it = std::find_if(kvs.begin(), kvs.end(),
+                               [&p](const std::pair<std::string, std::string>&
+                                        kv) { return kv.first == p.first; });
+        if (it != kvs.end()) {
+          it->second = p.second;
+        } else {
+          kvs.push_back(p);
+        }
+      }
+      out = prefix;
+      for (size_t i = 0; i < kvs.size(); i++) {
+        out += (i == 0 ? "" : ";") + kvs[i].first + "=" + kvs[i].second;
+      }
+    }
+    result += out + "\r\n";
+  }
+  return result;
 }
 
-void SoraSignaling::CreatePeerFromConfig(boost::json::value jconfig) {
+void SoraSignaling::CreatePeerFromConfig(const boost::json::value& jconfig) {
   webrtc::PeerConnectionInterface::RTCConfiguration rtc_config;
   webrtc::PeerConnectionInterface::IceServers ice_servers;
 
-  auto jservers = jconfig.at("iceServers");
-  for (auto jserver : jservers.as_array()) {
+  const auto& jservers = jconfig.at("iceServers");
+  for (const auto& jserver : jservers.as_array()) {
     const std::string username = jserver.at("username").as_string().c_str();
     const std::string credential = jserver.at("credential").as_string().c_str();
-    auto jurls = jserver.at("urls");
-    for (const auto url : jurls.as_array()) {
+    const auto& jurls = jserver.at("urls");
+    for (const auto& url : jurls.as_array()) {
       webrtc::PeerConnectionInterface::IceServer ice_server;
       ice_server.uri = url.as_string().c_str();
+      if (config_.ice_transport_policy ==
+              SoraSignalingConfig::IceTransportPolicy::RelayTls &&
+          ice_server.uri.compare(0, 6, "turns:") != 0) {
+        continue;
+      }
       ice_server.username = username;
       ice_server.password = credential;
       ice_servers.push_back(ice_server);
@@ -204,8 +607,26 @@ void SoraSignaling::CreatePeerFromConfig(boost::json::value jconfig) {
   }
 
   rtc_config.servers = ice_servers;
+  if (config_.ice_transport_policy !=
+      SoraSignalingConfig::IceTransportPolicy::All) {
+    if (ice_servers.empty()) {
+      RTC_LOG(LS_WARNING) << "No TURN server for ice_transport_policy";
+    }
+    rtc_config.type = webrtc::PeerConnectionInterface::kRelay;
+  }
+  // iceServers は offer で届くので、PeerConnection を作った時点から
+  // answer を作っている間に TURN の割り当てを済ませておく
+  rtc_config.ice_candidate_pool_size = config_.ice_candidate_pool_size;
+  if (config_.ice_continual_gathering) {
+    rtc_config.continual_gathering_policy =
+        webrtc::PeerConnectionInterface::GATHER_CONTINUALLY;
+  }
 
   connection_ = manager_->createConnection(rtc_config, this);
+  stats_sampler_->SetConnection(connection_);
+  if (quality_controller_) {
+    quality_controller_->SetConnection(connection_);
+  }
 }
 
 void SoraSignaling::Close() {
@@ -228,7 +649,7 @@ void SoraSignaling::DoRead() {
 
 void SoraSignaling::OnRead(boost::system::error_code ec,
                            std::size_t bytes_transferred,
-                           std::string text) {
+                           boost::beast::string_view text) {
   boost::ignore_unused(bytes_transferred);
 
   if (ec == boost::asio::error::operation_aborted) {
@@ -237,28 +658,82 @@ void SoraSignaling::OnRead(boost::system::error_code ec,
 
   if (ec) {
     RTC_LOG(LS_ERROR) << "Failed to read: ec=" << ec;
+    OnDisconnect();
     return;
   }
 
-  RTC_LOG(LS_INFO) << __FUNCTION__ << ": text=" << text;
+  if (closing_) {
+    return;
+  }
+
+  // offer や update の SDP は数 KB あるので、INFO では先頭だけ出力する
+  if (text.size() > kMaxLogTextLength) {
+    RTC_LOG(LS_INFO) << __FUNCTION__ << ": text="
+                     << ToAbslStringView(text.substr(0, kMaxLogTextLength))
+                     << "... (" << text.size() << " bytes)";
+    RTC_LOG(LS_VERBOSE) << __FUNCTION__ << ": text=" << ToAbslStringView(text);
+  } else {
+    RTC_LOG(LS_INFO) << __FUNCTION__ << ": text=" << ToAbslStringView(text);
+  }
+
+  {
+    // パースした値はここで確保した領域に置かれるので、このスコープの外に持ち出さないこと
+    boost::json::monotonic_resource mr(parse_buffer_, sizeof(parse_buffer_));
+    parser_.reset(&mr);
+    boost::system::error_code parse_ec;
+    parser_.write(text.data(), text.size(), parse_ec);
+    if (!parse_ec) {
+      parser_.finish(parse_ec);
+    }
+    if (parse_ec) {
+      RTC_LOG(LS_ERROR) << "Failed to parse message: ec=" << parse_ec;
+    } else {
+      boost::json::value json_message = parser_.release();
+      OnMessage(text, json_message);
+    }
+    // mr を破棄する前にパーサから外しておく
+    parser_.reset();
+  }
+
+  if (websocket_disabled_) {
+    return;
+  }
+  DoRead();
+}
 
-  auto json_message = boost::json::parse(text);
+void SoraSignaling::OnMessage(boost::beast::string_view text,
+                              const boost::json::value& json_message) {
   const std::string type = json_message.at("type").as_string().c_str();
   if (type == "offer") {
+    // 再接続した場合は、ここで以前の PeerConnection を置き換える
+    reconnect_attempts_ = 0;
+    data_channels_.clear();
+    ClearMessagingChannels(false);
     CreatePeerFromConfig(json_message.at("config"));
-    const std::string sdp = json_message.at("sdp").as_string().c_str();
-    connection_->SetOffer(sdp, [this, json_message]() {
+    const std::string sdp =
+        ApplyOpusParams(json_message.at("sdp").as_string().c_str());
+    // simulcast の場合はレイヤーごとの設定が encodings に入っている
+    std::vector<webrtc::RtpEncodingParameters> encodings;
+    auto it = json_message.as_object().find("encodings");
+    if (it != json_message.as_object().end() && it->value().is_array()) {
+      encodings = ParseEncodings(it->value().as_array());
+    }
+    connection_->SetOffer(sdp, [this, encodings = std::move(encodings)]() {
+      if (!encodings.empty()) {
+        connection_->SetEncodingParameters(encodings);
+      }
       connection_->CreateAnswer(
           [this](webrtc::SessionDescriptionInterface* desc) {
             std::string sdp;
             desc->ToString(&sdp);
             boost::json::value json_message = {{"type", "answer"},
                                                {"sdp", sdp}};
-            ws_->WriteText(boost::json::serialize(json_message));
+            SendText(boost::json::serialize(json_message));
           });
     });
   } else if (type == "update") {
-    const std::string sdp = json_message.at("sdp").as_string().c_str();
+    const std::string sdp =
+        ApplyOpusParams(json_message.at("sdp").as_string().c_str());
     connection_->SetOffer(sdp, [this]() {
       connection_->CreateAnswer(
           [this](webrtc::SessionDescriptionInterface* desc) {
@@ -266,32 +741,136 @@ void SoraSignaling::OnRead(boost::system::error_code ec,
             desc->ToString(&sdp);
             boost::json::value json_message = {{"type", "update"},
                                                {"sdp", sdp}};
-            ws_->WriteText(boost::json::serialize(json_message));
+            SendText(boost::json::serialize(json_message));
           });
     });
   } else if (type == "notify") {
     if (on_notify_) {
-      on_notify_(text);
+      on_notify_(std::string(text.data(), text.size()));
     }
   } else if (type == "ping") {
     if (rtc_state_ != webrtc::PeerConnectionInterface::IceConnectionState::
                           kIceConnectionConnected) {
-      DoRead();
       return;
     }
     auto it = json_message.as_object().find("stats");
     if (it != json_message.as_object().end() && it->value().as_bool()) {
-      connection_->GetStats(
-          [this](
-              const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
-            DoSendPong(report);
-          });
+      GetStatsReport(
+          [this](const rtc::scoped_refptr<const webrtc::RTCStatsReport>&
+                     report) { DoSendPong(report); });
     } else {
       DoSendPong();
     }
+  } else if (type == "switched") {
+    // ここから先の update や notify は DataChannel で届く
+    RTC_LOG(LS_INFO) << "Signaling switched to DataChannel";
+    auto it = json_message.as_object().find("ignore_disconnect_websocket");
+    if (it != json_message.as_object().end() && it->value().is_bool() &&
+        it->value().as_bool()) {
+      websocket_disabled_ = true;
+      connected_ = false;
+      Close();
+    }
   }
+}
 
-  DoRead();
+void SoraSignaling::SendDataChannel(std::string label, std::string text) {
+  boost::asio::post(ioc_, [self = shared_from_this(), label = std::move(label),
+                           text = std::move(text)]() {
+    auto it = self->data_channels_.find(label);
+    if (it == self->data_channels_.end()) {
+      RTC_LOG(LS_WARNING) << "DataChannel not found: label=" << label;
+      return;
+    }
+    it->second->Send(text);
+  });
+}
+
+void SoraSignaling::SetOnMessage(OnMessageFunc on_message) {
+  std::lock_guard<std::mutex> guard(messaging_mutex_);
+  on_message_ = std::move(on_message);
+}
+
+bool SoraSignaling::SendDataChannelMessage(const std::string& label,
+                                          const uint8_t* data,
+                                          size_t size) {
+  std::shared_ptr<RTCDataChannel> channel;
+  {
+    std::lock_guard<std::mutex> guard(messaging_mutex_);
+    auto it = messaging_channels_.find(label);
+    if (it == messaging_channels_.end()) {
+      RTC_LOG(LS_WARNING) << "DataChannel not found: label=" << label;
+      return false;
+    }
+    channel = it->second;
+  }
+  // Send はシグナリングスレッドを待つので、ロックの外で呼ぶ
+  return channel->Send(data, size);
+}
+
+void SoraSignaling::ClearMessagingChannels(bool clear_callback) {
+  std::map<std::string, std::shared_ptr<RTCDataChannel>> channels;
+  {
+    std::lock_guard<std::mutex> guard(messaging_mutex_);
+    channels.swap(messaging_channels_);
+    if (clear_callback) {
+      on_message_ = nullptr;
+    }
+  }
+  // 破棄する時にシグナリングスレッドを待つので、ロックの外で破棄する
+  channels.clear();
+}
+
+void SoraSignaling::OnDataChannelMessage(const std::string& label,
+                                         const std::string& data) {
+  if (closing_) {
+    return;
+  }
+  RTC_LOG(LS_INFO) << __FUNCTION__ << ": label=" << label
+                   << " size=" << data.size();
+
+  if (label == "notify") {
+    if (on_notify_) {
+      on_notify_(data);
+    }
+    return;
+  }
+
+  boost::system::error_code ec;
+  auto json_message = boost::json::parse(data, ec);
+  if (ec || !json_message.is_object()) {
+    RTC_LOG(LS_ERROR) << "Failed to parse DataChannel message: label=" << label
+                      << " ec=" << ec;
+    return;
+  }
+  auto type_it = json_message.as_object().find("type");
+  if (type_it == json_message.as_object().end() ||
+      !type_it->value().is_string()) {
+    return;
+  }
+  const std::string type = type_it->value().as_string().c_str();
+
+  if (label == "signaling" && type == "re-offer") {
+    const std::string sdp =
+        ApplyOpusParams(json_message.at("sdp").as_string().c_str());
+    connection_->SetOffer(sdp, [this]() {
+      connection_->CreateAnswer(
+          [this](webrtc::SessionDescriptionInterface* desc) {
+            std::string sdp;
+            desc->ToString(&sdp);
+            boost::json::value json_message = {{"type", "re-answer"},
+                                               {"sdp", sdp}};
+            SendDataChannel("signaling", boost::json::serialize(json_message));
+          });
+    });
+  } else if (label == "stats" && type == "req-stats") {
+    GetStatsReport(
+        [this](const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
+          std::string str =
+              R"({"type":"stats","reports":)" + report->ToJson() + "}";
+          SendDataChannel("stats", std::move(str));
+        });
+  }
 }
 
 // WebRTC からのコールバック
@@ -299,15 +878,60 @@ void SoraSignaling::OnRead(boost::system::error_code ec,
 void SoraSignaling::OnIceConnectionStateChange(
     webrtc::PeerConnectionInterface::IceConnectionState new_state) {
   RTC_LOG(LS_INFO) << __FUNCTION__ << " state:" << new_state;
-  boost::asio::post(boost::beast::bind_front_handler(
-      &SoraSignaling::DoIceConnectionStateChange, shared_from_this(),
-      new_state));
+  boost::asio::post(ioc_, boost::beast::bind_front_handler(
+                              &SoraSignaling::DoIceConnectionStateChange,
+                              shared_from_this(), new_state));
 }
 void SoraSignaling::OnIceCandidate(const std::string sdp_mid,
                                    const int sdp_mlineindex,
                                    const std::string sdp) {
   boost::json::value json_message = {{"type", "candidate"}, {"candidate", sdp}};
-  ws_->WriteText(boost::json::serialize(json_message));
+  SendText(boost::json::serialize(json_message));
+}
+void SoraSignaling::OnDataChannel(
+    rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel) {
+  if (!config_.data_channel_signaling) {
+    return;
+  }
+  // DataChannel が SoraSignaling を持つと循環参照になるので weak_ptr で持つ
+  std::weak_ptr<SoraSignaling> weak_self = shared_from_this();
+  std::string label = data_channel->label();
+
+  // # で始まるラベルはメッセージング用。遅延を減らすために、受信したバッファを
+  // io_context に回さずにシグナリングスレッドからそのまま渡す
+  if (!label.empty() && label[0] == '#') {
+    auto channel = std::make_shared<RTCDataChannel>(
+        data_channel, nullptr,
+        [weak_self, label](const rtc::CopyOnWriteBuffer& data) {
+          auto self = weak_self.lock();
+          if (self == nullptr) {
+            return;
+          }
+          std::lock_guard<std::mutex> guard(self->messaging_mutex_);
+          if (self->on_message_) {
+            self->on_message_(label, data);
+          }
+        });
+    std::lock_guard<std::mutex> guard(messaging_mutex_);
+    messaging_channels_[label] = channel;
+    return;
+  }
+
+  auto channel = std::make_shared<RTCDataChannel>(
+      data_channel, nullptr,
+      [weak_self, label](const rtc::CopyOnWriteBuffer& buffer) {
+        auto self = weak_self.lock();
+        if (self == nullptr) {
+          return;
+        }
+        std::string data(buffer.data<char>(), buffer.size());
+        boost::asio::post(self->ioc_, [self, label, data = std::move(data)]() {
+          self->OnDataChannelMessage(label, data);
+        });
+      });
+  boost::asio::post(ioc_, [self = shared_from_this(), label, channel]() {
+    self->data_channels_[label] = channel;
+  });
 }
 void SoraSignaling::DoIceConnectionStateChange(
     webrtc::PeerConnectionInterface::IceConnectionState new_state) {
@@ -4,22 +4,29 @@
 #include <algorithm>
 #include <cstdlib>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <vector>
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ssl/context.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
-#include <boost/beast/core/multi_buffer.hpp>
 #include <boost/beast/websocket/ssl.hpp>
 #include <boost/beast/websocket/stream.hpp>
 #include <boost/json.hpp>
 
 #include "rtc/rtc_manager.h"
+#include "rtc/rtc_data_channel.h"
 #include "rtc/rtc_message_sender.h"
+#include "quality_controller.h"
+#include "stats_sampler.h"
 #include "url_parts.h"
 #include "websocket.h"
 
@@ -36,12 +43,75 @@ struct SoraSignalingConfig {
 
   std::string audio_codec = "OPUS";
   int audio_bitrate = 0;
+  // Opus のエンコーダの設定。connect メッセージの opus_params で Sora に伝え、
+  // 受け取った offer の fmtp にも反映してから自分のエンコーダに使わせる。
+  // DTX は無音の間のパケットを止め、in-band FEC は前のフレームの冗長データを載せる
+  bool audio_opus_dtx = false;
+  bool audio_opus_fec = true;
+  // 1 パケットに入れる音声の長さ (ミリ秒)。0 の場合は既定値の 20 ミリ秒
+  int audio_opus_ptime = 0;
+  bool audio_opus_stereo = false;
 
   enum class Role { Sendonly, Recvonly, Sendrecv };
   Role role = Role::Sendonly;
   bool multistream = false;
+  // false の場合は connect メッセージで video: false を送り、音声だけで接続する
+  bool video = true;
 
   bool insecure = false;
+
+  // 統計情報を取得する間隔と、履歴に残す回数
+  int stats_interval_ms = 1000;
+  size_t stats_history_size = 30;
+
+  // WebSocket が切れた時に再接続を試みる最大回数。0 なら再接続しない。
+  // 待ち時間は reconnect_initial_delay_ms から倍々にして reconnect_max_delay_ms で止め、
+  // 同時に切れたクライアントが一斉に再接続しないように半分までの範囲でずらす。
+  int reconnect_max_attempts = 5;
+  int reconnect_initial_delay_ms = 500;
+  int reconnect_max_delay_ms = 8000;
+
+  // 接続後の update や notify、統計情報のやりとりを DataChannel で行う
+  bool data_channel_signaling = false;
+  // DataChannel に切り替えた後は WebSocket を切断する
+  bool ignore_disconnect_websocket = false;
+
+  // Sora に作ってもらうメッセージング用の DataChannel。label は # で始める。
+  // 指定した場合は data_channel_signaling も有効になる
+  struct DataChannel {
+    std::string label;
+    // "sendrecv", "sendonly", "recvonly" のどれか
+    std::string direction = "sendrecv";
+    bool ordered = true;
+    // どちらも -1 の場合は届くまで再送する
+    int max_packet_life_time = -1;
+    int max_retransmits = -1;
+  };
+  std::vector<DataChannel> data_channels;
+
+  // 送信側は offer の encodings に従って複数の解像度で送る
+  bool simulcast = false;
+  // 受信側で受け取るレイヤー。"r0", "r1", "r2" のどれかで、空なら Sora に任せる
+  std::string simulcast_rid;
+
+  // multistream でスポットライトを使う。0 の場合は Sora の設定に任せる
+  bool spotlight = false;
+  int spotlight_number = 0;
+
+  // 統計情報と Unity のフレーム時間を見て、送信する映像の解像度とフレームレートを調整する。
+  // adaptive_quality_target_frame_ms が 0 の場合はフレーム時間を見ない
+  bool adaptive_quality = false;
+  double adaptive_quality_target_frame_ms = 0;
+
+  // ICE の候補を PeerConnection を作った時点から集めておく数。
+  // 0 の場合は answer を SetLocalDescription するまで集め始めない
+  int ice_candidate_pool_size = 0;
+  // Relay は TURN の候補だけ、RelayTls は TURN over TLS (turns:) の候補だけを使う。
+  // TURN が必要なネットワークでは、つながらない候補の確認を待たずに済む
+  enum class IceTransportPolicy { All, Relay, RelayTls };
+  IceTransportPolicy ice_transport_policy = IceTransportPolicy::All;
+  // 接続後もネットワークの変化に合わせて候補を集め続ける
+  bool ice_continual_gathering = false;
 };
 
 class SoraSignaling : public std::enable_shared_from_this<SoraSignaling>,
@@ -55,15 +125,49 @@ class SoraSignaling : public std::enable_shared_from_this<SoraSignaling>,
   std::shared_ptr<RTCConnection> connection_;
   SoraSignalingConfig config_;
   std::function<void(std::string)> on_notify_;
+  const std::shared_ptr<StatsSampler> stats_sampler_;
+  // adaptive_quality の場合だけ作る
+  std::shared_ptr<QualityController> quality_controller_;
+
+  // 受信したメッセージのパース用。
+  // パーサの作業領域はメッセージ間で使い回し、パースした値は parse_buffer_ から
+  // 確保して、メッセージを処理し終わったらまとめて捨てる。
+  boost::json::stream_parser parser_;
+  unsigned char parse_buffer_[16 * 1024];
 
   webrtc::PeerConnectionInterface::IceConnectionState rtc_state_;
 
   bool connected_ = false;
 
+  // 再接続用
+  boost::asio::steady_timer reconnect_timer_;
+  int reconnect_attempts_ = 0;
+  bool reconnect_pending_ = false;
+  bool closing_ = false;
+  // connect メッセージを送るかどうか。Preconnect() の場合は SendConnect() で true にする
+  bool connect_requested_ = false;
+
+  // DataChannel シグナリング用。ラベルごとに Sora が作った DataChannel を持つ
+  std::map<std::string, std::shared_ptr<RTCDataChannel>> data_channels_;
+  // メッセージング用の DataChannel。Unity スレッドから送信するのでロックを取って触る
+  std::mutex messaging_mutex_;
+  std::map<std::string, std::shared_ptr<RTCDataChannel>> messaging_channels_;
+  std::function<void(const std::string&, const rtc::CopyOnWriteBuffer&)>
+      on_message_;
+  // DataChannel に切り替えて WebSocket を切断した
+  bool websocket_disabled_ = false;
+  // 切断した WebSocket。まだハンドラが残っているかもしれないので、次の再接続まで破棄しない
+  std::unique_ptr<Websocket> closed_ws_;
+  std::mt19937 random_;
+
  public:
   webrtc::PeerConnectionInterface::IceConnectionState getRTCConnectionState()
       const;
   std::shared_ptr<RTCConnection> getRTCConnection() const;
+  // 定期的に取得している統計情報。どのスレッドから呼んでもいい
+  std::shared_ptr<StatsSampler> GetStatsSampler() const;
+  // adaptive_quality でない場合は nullptr を返す
+  std::shared_ptr<QualityController> GetQualityController() const;
 
   static std::shared_ptr<SoraSignaling> Create(
       boost::asio::io_context& ioc,
@@ -79,22 +183,60 @@ class SoraSignaling : public std::enable_shared_from_this<SoraSignaling>,
   bool Init();
 
  public:
+  // WebSocket の接続を確立して connect メッセージを送る。
+  // 接続は io_context のスレッドで行うので、どのスレッドから呼んでもいい
   bool Connect();
+  // WebSocket の接続の確立までを済ませておき、SendConnect() を呼ぶまで connect メッセージを送らない。
+  // 名前解決や TLS のハンドシェイクを先に済ませておくことで、接続にかかる時間を減らす
+  bool Preconnect();
+  // Preconnect() の後に connect メッセージを送る。どのスレッドから呼んでもいい
+  void SendConnect();
   void Close();
 
+  typedef std::function<void(const std::string& label,
+                             const rtc::CopyOnWriteBuffer& data)>
+      OnMessageFunc;
+  // メッセージング用の DataChannel でメッセージを受信した時に呼ばれる。
+  // WebRTC のシグナリングスレッドから呼ばれる。Connect() より前に設定すること
+  void SetOnMessage(OnMessageFunc on_message);
+  // メッセージング用の DataChannel で data を送る。どのスレッドから呼んでもいい。
+  // まだ開いていない場合は false を返す
+  bool SendDataChannelMessage(const std::string& label,
+                              const uint8_t* data,
+                              size_t size);
+
   // connection_ = nullptr すると直ちに onIceConnectionStateChange コールバックが呼ばれるが、
   // この中で使っている shared_from_this() がデストラクタ内で使えないため、デストラクタで connection_ = nullptr すると実行時エラーになる。
   // なのでこのクラスを解放する前に明示的に Release() 関数を呼んでもらうことにする。.
   void Release();
 
  private:
+  // Connect() と Preconnect() の処理を io_context のスレッドで行う
+  bool StartConnect(bool send_connect);
+  bool ConnectWebsocket();
   void OnConnect(boost::system::error_code ec);
+  // WebSocket が切れた時や再接続に失敗した時に呼ぶ
+  void OnDisconnect();
+  void OnReconnectTimer(boost::system::error_code ec);
+  // コールバックはどのスレッドから来るか分からないので、ioc_ のスレッドで書き込む
+  void SendText(std::string text);
 
   void DoSendConnect();
   void DoSendPong();
   void DoSendPong(
       const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report);
-  void CreatePeerFromConfig(boost::json::value jconfig);
+  // 定期的に取得している統計情報が新しければそれを、古ければ取得し直して返す
+  void GetStatsReport(
+      std::function<void(
+          const rtc::scoped_refptr<const webrtc::RTCStatsReport>&)> callback);
+  void CreatePeerFromConfig(const boost::json::value& jconfig);
+  // offer の encodings を simulcast のレイヤーごとの設定にする
+  static std::vector<webrtc::RtpEncodingParameters> ParseEncodings(
+      const boost::json::array& jencodings);
+  // Opus の設定を既定値から変えているか
+  bool HasOpusParams() const;
+  // offer の Opus の fmtp を audio_opus_* の設定で上書きする
+  std::string ApplyOpusParams(const std::string& sdp) const;
 
  private:
   void OnClose(boost::system::error_code ec);
@@ -102,7 +244,15 @@ class SoraSignaling : public std::enable_shared_from_this<SoraSignaling>,
   void DoRead();
   void OnRead(boost::system::error_code ec,
               std::size_t bytes_transferred,
-              std::string text);
+              boost::beast::string_view text);
+  void OnMessage(boost::beast::string_view text,
+                 const boost::json::value& json_message);
+
+  // どのスレッドから呼んでもいい
+  void SendDataChannel(std::string label, std::string text);
+  void OnDataChannelMessage(const std::string& label, const std::string& data);
+  // メッセージング用の DataChannel を破棄する。clear_callback なら on_message_ も外す
+  void ClearMessagingChannels(bool clear_callback);
 
  private:
   // WebRTC からのコールバック
@@ -112,6 +262,8 @@ class SoraSignaling : public std::enable_shared_from_this<SoraSignaling>,
   void OnIceCandidate(const std::string sdp_mid,
                       const int sdp_mlineindex,
                       const std::string sdp) override;
+  void OnDataChannel(
+      rtc::scoped_refptr<webrtc::DataChannelInterface> data_channel) override;
 
  private:
   void DoIceConnectionStateChange(
@@ -0,0 +1,99 @@
+#ifndef SORA_SPSC_RING_BUFFER_H_INCLUDED
+#define SORA_SPSC_RING_BUFFER_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace sora {
+
+// 書き込むスレッドと読み込むスレッドが 1 つずつの場合に使える、
+// ロックを使わない固定長のリングバッファ。
+// Unity のオーディオスレッドのように待たせたくないスレッドから書き込むために使う。
+// 容量を超える書き込みは捨てて、捨てた数を数えておく。
+template <class T>
+class SpscRingBuffer {
+ public:
+  // capacity は 2 のべき乗に切り上げる
+  explicit SpscRingBuffer(size_t capacity) {
+    capacity_ = 1;
+    while (capacity_ < capacity) {
+      capacity_ <<= 1;
+    }
+    mask_ = capacity_ - 1;
+    data_.reset(new T[capacity_]);
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // 書き込み側から呼ぶ。
+  // size 個をまとめて書き込めない場合は何も書き込まずに false を返す。
+  // ステレオのサンプルがずれないように、部分的には書き込まない。
+  //
+  // f(T* dst, size_t offset, size_t count) は、書き込む領域が
+  // バッファの終端で分かれる場合に 2 回呼ばれる。
+  // offset は書き込むデータの先頭からの位置。
+  template <class F>
+  bool Write(size_t size, F&& f) {
+    size_t write = write_index_.load(std::memory_order_relaxed);
+    size_t read = read_index_.load(std::memory_order_acquire);
+    if (capacity_ - (write - read) < size) {
+      overflow_count_.fetch_add(size, std::memory_order_relaxed);
+      return false;
+    }
+    size_t pos = write & mask_;
+    size_t first = std::min(size, capacity_ - pos);
+    f(data_.get() + pos, 0, first);
+    if (first < size) {
+      f(data_.get(), first, size - first);
+    }
+    write_index_.store(write + size, std::memory_order_release);
+    return true;
+  }
+
+  // 読み込み側から呼ぶ。読めるだけ読んで、読んだ数を返す
+  size_t Read(T* dst, size_t size) {
+    size_t read = read_index_.load(std::memory_order_relaxed);
+    size_t write = write_index_.load(std::memory_order_acquire);
+    size = std::min(size, write - read);
+    size_t pos = read & mask_;
+    size_t first = std::min(size, capacity_ - pos);
+    std::copy(data_.get() + pos, data_.get() + pos + first, dst);
+    std::copy(data_.get(), data_.get() + (size - first), dst + first);
+    read_index_.store(read + size, std::memory_order_release);
+    return size;
+  }
+
+  // 読み込み側から呼ぶ。溜まっているデータを全て捨てる
+  void Clear() {
+    read_index_.store(write_index_.load(std::memory_order_acquire),
+                      std::memory_order_release);
+  }
+
+  // 読み込み側から呼ぶ。読み込める数
+  size_t Available() const {
+    return write_index_.load(std::memory_order_acquire) -
+           read_index_.load(std::memory_order_relaxed);
+  }
+
+  // 容量を超えて捨てた数の累計
+  uint64_t overflow_count() const {
+    return overflow_count_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  size_t capacity_;
+  size_t mask_;
+  std::unique_ptr<T[]> data_;
+  // 書き込みと読み込みの累計。バッファ上の位置は mask_ との AND で求める
+  std::atomic<size_t> write_index_ = {0};
+  std::atomic<size_t> read_index_ = {0};
+  std::atomic<uint64_t> overflow_count_ = {0};
+};
+
+}  // namespace sora
+
+#endif  // SORA_SPSC_RING_BUFFER_H_INCLUDED
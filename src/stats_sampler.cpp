@@ -0,0 +1,213 @@
+#include "stats_sampler.h"
+
+#include <algorithm>
+#include <chrono>
+
+// webrtc
+#include "rtc_base/logging.h"
+#include "rtc_base/time_utils.h"
+
+#include "rtp_stats.h"
+
+namespace sora {
+
+namespace {
+
+// GetStats のコールバックをこれ以上待たない時間
+int64_t RequestTimeoutMs(int interval_ms) {
+  return std::max<int64_t>((int64_t)interval_ms * 5, 5000);
+}
+
+}  // namespace
+
+std::shared_ptr<StatsSampler> StatsSampler::Create(int interval_ms,
+                                                   size_t history_size) {
+  // GetStats は重いので、あまり短い間隔では取得しない
+  std::shared_ptr<StatsSampler> p(new StatsSampler(
+      std::max(interval_ms, 100), std::max<size_t>(history_size, 1)));
+  p->weak_this_ = p;
+  // スレッドが参照を持っておき、Stop されるまでは破棄されないようにする。
+  // GetStats のコールバックの weak_ptr が最後の参照になって、
+  // シグナリングスレッドでスレッドを join することがないようにするため
+  p->thread_ = std::thread([p]() { p->Run(); });
+  return p;
+}
+
+StatsSampler::StatsSampler(int interval_ms, size_t history_size)
+    : interval_ms_(interval_ms), history_(history_size) {}
+
+StatsSampler::~StatsSampler() {
+  // スレッドが参照を持っているので、ここに来るのは Stop でスレッドを止めた後か、
+  // スレッドが最後の参照を手放した時だけ。後者の場合は自分自身を join できないので切り離す
+  if (thread_.joinable()) {
+    if (thread_.get_id() == std::this_thread::get_id()) {
+      thread_.detach();
+    } else {
+      thread_.join();
+    }
+  }
+}
+
+void StatsSampler::SetConnection(std::shared_ptr<RTCConnection> connection) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  connection_ = connection;
+  // 前の接続の取得結果は待たない
+  requesting_ = false;
+  request_id_++;
+}
+
+void StatsSampler::SetOnReport(
+    std::function<void(const rtc::scoped_refptr<const webrtc::RTCStatsReport>&)>
+        on_report) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  on_report_ = std::move(on_report);
+}
+
+void StatsSampler::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopped_ = true;
+    connection_.reset();
+  }
+  cond_.notify_all();
+  if (thread_.joinable() && thread_.get_id() != std::this_thread::get_id()) {
+    thread_.join();
+  }
+}
+
+void StatsSampler::Run() {
+  RTC_LOG(LS_INFO) << "Stats sampler started: interval_ms=" << interval_ms_;
+  auto next = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    next += std::chrono::milliseconds(interval_ms_);
+    cond_.wait_until(lock, next, [this]() { return stopped_; });
+    if (stopped_) {
+      break;
+    }
+    // 前回の取得が終わっていなければ 1 回飛ばす
+    if (requesting_) {
+      if (rtc::TimeMillis() - requested_at_ < RequestTimeoutMs(interval_ms_)) {
+        continue;
+      }
+      RTC_LOG(LS_WARNING) << "GetStats timed out: request_id=" << request_id_;
+      requesting_ = false;
+    }
+    std::shared_ptr<RTCConnection> connection = connection_.lock();
+    if (connection == nullptr) {
+      continue;
+    }
+    requesting_ = true;
+    uint64_t request_id = ++request_id_;
+    requested_at_ = rtc::TimeMillis();
+    lock.unlock();
+
+    // コールバックはシグナリングスレッドから呼ばれるので、破棄された後に来ても大丈夫なようにする
+    std::weak_ptr<StatsSampler> weak = weak_this_;
+    connection->GetStats(
+        [weak, request_id](
+            const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
+          auto self = weak.lock();
+          if (self) {
+            self->OnReport(request_id, report);
+          }
+        });
+    connection = nullptr;
+
+    lock.lock();
+  }
+  RTC_LOG(LS_INFO) << "Stats sampler stopped";
+}
+
+void StatsSampler::OnReport(
+    uint64_t request_id,
+    const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (request_id != request_id_) {
+      RTC_LOG(LS_INFO) << "Discard stale stats report: request_id="
+                       << request_id;
+      return;
+    }
+  }
+
+  std::vector<sora_rtp_stats_t> streams;
+  CollectRtpStats(report, streams);
+  int64_t timestamp_us = report->timestamp_us();
+
+  std::function<void(const rtc::scoped_refptr<const webrtc::RTCStatsReport>&)>
+      on_report;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    on_report = on_report_;
+  }
+  if (on_report) {
+    on_report(report);
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (request_id != request_id_) {
+    return;
+  }
+  requesting_ = false;
+  latest_report_ = report;
+  latest_report_at_ = rtc::TimeMillis();
+
+  // 前回からの差分でビットレートとフレームレートを求める
+  if (history_count_ > 0) {
+    const Sample& prev =
+        history_[(history_next_ + history_.size() - 1) % history_.size()];
+    double elapsed_sec = (timestamp_us - prev.timestamp_us) / 1000000.0;
+    if (elapsed_sec > 0) {
+      for (sora_rtp_stats_t& s : streams) {
+        auto it = std::find_if(
+            prev.streams.begin(), prev.streams.end(),
+            [&s](const sora_rtp_stats_t& p) {
+              return p.kind == s.kind && p.direction == s.direction &&
+                     p.ssrc == s.ssrc;
+            });
+        if (it == prev.streams.end() || s.bytes < it->bytes ||
+            s.frames < it->frames) {
+          continue;
+        }
+        s.bitrate = (s.bytes - it->bytes) * 8 / elapsed_sec;
+        s.frame_rate = (s.frames - it->frames) / elapsed_sec;
+      }
+    }
+  }
+  for (sora_rtp_stats_t& s : streams) {
+    s.timestamp_us = timestamp_us;
+  }
+
+  Sample& sample = history_[history_next_];
+  sample.timestamp_us = timestamp_us;
+  sample.streams = std::move(streams);
+  history_next_ = (history_next_ + 1) % history_.size();
+  history_count_ = std::min(history_count_ + 1, history_.size());
+}
+
+rtc::scoped_refptr<const webrtc::RTCStatsReport> StatsSampler::GetLatestReport(
+    int64_t max_age_ms) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (latest_report_ == nullptr ||
+      rtc::TimeMillis() - latest_report_at_ > max_age_ms) {
+    return nullptr;
+  }
+  return latest_report_;
+}
+
+int StatsSampler::GetRtpStats(int age, sora_rtp_stats_t* stats, int max_count) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (age < 0 || (size_t)age >= history_count_) {
+    return -1;
+  }
+  const Sample& sample =
+      history_[(history_next_ + history_.size() - 1 - age) % history_.size()];
+  int count = (int)sample.streams.size();
+  std::copy(sample.streams.begin(),
+            sample.streams.begin() + std::min(count, std::max(max_count, 0)),
+            stats);
+  return count;
+}
+
+}  // namespace sora
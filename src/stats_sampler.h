@@ -0,0 +1,86 @@
+#ifndef SORA_STATS_SAMPLER_H_INCLUDED
+#define SORA_STATS_SAMPLER_H_INCLUDED
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// webrtc
+#include "api/stats/rtc_stats_report.h"
+
+#include "rtc/rtc_connection.h"
+#include "unity.h"
+
+namespace sora {
+
+// 一定間隔で GetStats を呼んで、最新の統計情報と直近の履歴を持っておくクラス。
+// pong の統計情報や Unity からの取得はここに溜めたものを使い、
+// 同じ統計情報を何度も取得しないようにする。
+class StatsSampler {
+ public:
+  // interval_ms ごとに取得し、history_size 回分の履歴を持つ
+  static std::shared_ptr<StatsSampler> Create(int interval_ms,
+                                              size_t history_size);
+  ~StatsSampler();
+
+  // 統計情報を取得する接続を設定する。nullptr を渡すと取得しなくなる
+  void SetConnection(std::shared_ptr<RTCConnection> connection);
+  // スレッドを止める。接続を解放する前に呼ぶこと。
+  // スレッドがこのオブジェクトの参照を持っているので、呼ばないと破棄されない
+  void Stop();
+
+  // 最後に取得した統計情報。max_age_ms より古い場合は nullptr を返す
+  rtc::scoped_refptr<const webrtc::RTCStatsReport> GetLatestReport(
+      int64_t max_age_ms);
+  // age 回前に取得した統計情報を最大 max_count 個 stats に書き込み、ストリームの数を返す。
+  // age が 0 の場合は最新のもの。その回の統計情報が無い場合は -1 を返す
+  int GetRtpStats(int age, sora_rtp_stats_t* stats, int max_count);
+
+  int interval_ms() const { return interval_ms_; }
+
+  // 統計情報を取得するたびにシグナリングスレッドから呼ばれる
+  void SetOnReport(
+      std::function<void(
+          const rtc::scoped_refptr<const webrtc::RTCStatsReport>&)> on_report);
+
+ private:
+  StatsSampler(int interval_ms, size_t history_size);
+  void Run();
+  void OnReport(uint64_t request_id,
+                const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report);
+
+  struct Sample {
+    int64_t timestamp_us = 0;
+    std::vector<sora_rtp_stats_t> streams;
+  };
+
+  const int interval_ms_;
+  std::weak_ptr<StatsSampler> weak_this_;
+  std::thread thread_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stopped_ = false;
+  // 取得中かどうか。接続が閉じられるとコールバックが来ないことがあるので、
+  // 取得を始めた時刻を持っておいて、時間が経ったら取り直す。
+  // request_id_ と一致しないコールバックは古い取得の結果なので捨てる
+  bool requesting_ = false;
+  uint64_t request_id_ = 0;
+  int64_t requested_at_ = 0;
+  std::weak_ptr<RTCConnection> connection_;
+  std::function<void(const rtc::scoped_refptr<const webrtc::RTCStatsReport>&)>
+      on_report_;
+  rtc::scoped_refptr<const webrtc::RTCStatsReport> latest_report_;
+  int64_t latest_report_at_ = 0;
+  // history_[history_next_] に次の回の統計情報を書き込む
+  std::vector<Sample> history_;
+  size_t history_next_ = 0;
+  size_t history_count_ = 0;
+};
+
+}  // namespace sora
+
+#endif  // SORA_STATS_SAMPLER_H_INCLUDED
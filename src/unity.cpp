@@ -1,10 +1,28 @@
 #include "unity.h"
+
+#include <algorithm>
+
+#include "audio_sample_conversion.h"
+#include "perf_counters.h"
+#include "render_scheduler.h"
 #include "rtc/device_list.h"
+#include "rtp_stats.h"
 #include "sora.h"
+#include "unity_context.h"
+
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_UBUNTU)
+#include <thread>
 
-#if defined(SORA_UNITY_SDK_WINDOWS)
 #include "hwenc_nvcodec/nvcodec_h264_encoder.h"
 #include "hwenc_nvcodec/nvcodec_video_decoder.h"
+#if defined(SORA_UNITY_SDK_WINDOWS)
+#include "hwenc_amf/amf_h264_encoder.h"
+#include "hwenc_msdk/msdk_h264_encoder.h"
+#include "hwenc_msdk/msdk_video_decoder.h"
+#endif
+
+// NVENC/NVDEC や QSV が使えるかどうかを調べるのは重いので、プラグインのロード時に裏で調べておく
+static std::thread g_codec_probe_thread;
 #endif
 
 extern "C" {
@@ -37,6 +55,11 @@ void* sora_create() {
   }
 
   auto sora = std::unique_ptr<sora::Sora>(new sora::Sora(context));
+  // IdPointer に登録できなかった場合は RenderCallback を呼べないので失敗にする
+  if (sora->GetRenderCallbackEventID() == 0) {
+    RTC_LOG(LS_ERROR) << "Failed to register Sora";
+    return nullptr;
+  }
   return sora.release();
 }
 
@@ -56,6 +79,25 @@ void sora_set_on_remove_track(void* p,
   });
 }
 
+void sora_set_on_add_audio_track(void* p,
+                                 track_cb_t on_add_audio_track,
+                                 void* userdata) {
+  auto sora = (sora::Sora*)p;
+  sora->SetOnAddAudioTrack([on_add_audio_track, userdata](ptrid_t track_id) {
+    on_add_audio_track(track_id, userdata);
+  });
+}
+
+void sora_set_on_remove_audio_track(void* p,
+                                    track_cb_t on_remove_audio_track,
+                                    void* userdata) {
+  auto sora = (sora::Sora*)p;
+  sora->SetOnRemoveAudioTrack(
+      [on_remove_audio_track, userdata](ptrid_t track_id) {
+        on_remove_audio_track(track_id, userdata);
+      });
+}
+
 void sora_set_on_notify(void* p, notify_cb_t on_notify, void* userdata) {
   auto sora = (sora::Sora*)p;
   sora->SetOnNotify([on_notify, userdata](std::string json) {
@@ -63,31 +105,150 @@ void sora_set_on_notify(void* p, notify_cb_t on_notify, void* userdata) {
   });
 }
 
+void sora_set_on_data_channel_message(void* p,
+                                      data_channel_message_cb_t on_message,
+                                      void* userdata) {
+  auto sora = (sora::Sora*)p;
+  sora->SetOnDataChannelMessage(
+      [on_message, userdata](const std::string& label, const uint8_t* data,
+                             size_t size) {
+        on_message(label.c_str(), data, (int)size, userdata);
+      });
+}
+
+void sora_set_on_key_frame_request(void* p,
+                                   key_frame_request_cb_t on_key_frame_request,
+                                   void* userdata) {
+  auto sora = (sora::Sora*)p;
+  sora->SetOnKeyFrameRequest([on_key_frame_request, userdata]() {
+    on_key_frame_request(userdata);
+  });
+}
+
 void sora_dispatch_events(void* p) {
   auto sora = (sora::Sora*)p;
   sora->DispatchEvents();
 }
 
-int sora_connect(void* p,
+int sora_set_thread_config(void* p,
+                           int thread_type,
+                           int priority,
+                           uint64_t affinity_mask) {
+  if (priority < (int)sora::ThreadConfig::Priority::Default ||
+      priority > (int)sora::ThreadConfig::Priority::Realtime) {
+    RTC_LOG(LS_ERROR) << "Invalid thread priority: " << priority;
+    return -1;
+  }
+  auto sora = (sora::Sora*)p;
+  sora::ThreadConfig config((sora::ThreadConfig::Priority)priority,
+                            affinity_mask);
+  if (!sora->SetThreadConfig(thread_type, config)) {
+    return -1;
+  }
+  return 0;
+}
+
+int sora_add_data_channel(void* p,
+                          const char* label,
+                          const char* direction,
+                          unity_bool_t ordered,
+                          int max_packet_life_time,
+                          int max_retransmits) {
+  auto sora = (sora::Sora*)p;
+  sora::SoraSignalingConfig::DataChannel data_channel;
+  data_channel.label = label;
+  data_channel.direction = direction;
+  data_channel.ordered = ordered;
+  data_channel.max_packet_life_time = max_packet_life_time;
+  data_channel.max_retransmits = max_retransmits;
+  if (!sora->AddDataChannel(data_channel)) {
+    return -1;
+  }
+  return 0;
+}
+
+unity_bool_t sora_send_data_channel_message(void* p,
+                                            const char* label,
+                                            const void* data,
+                                            int offset,
+                                            int size) {
+  if (offset < 0 || size < 0) {
+    return false;
+  }
+  auto sora = (sora::Sora*)p;
+  return sora->SendDataChannelMessage(label, (const uint8_t*)data + offset,
+                                      size);
+}
+
+int sora_prepare(void* p,
                  const char* unity_version,
                  const char* signaling_url,
                  const char* channel_id,
                  const char* metadata,
                  const char* role,
                  unity_bool_t multistream,
+                 unity_bool_t video,
                  int capturer_type,
                  void* unity_camera_texture,
+                 int unity_camera_readback_latency,
+                 unity_bool_t unity_camera_static_content,
+                 int unity_camera_static_refresh_ms,
+                 int unity_camera_capture_fps,
                  const char* video_capturer_device,
                  int video_width,
                  int video_height,
+                 int video_fps,
                  const char* video_codec,
                  int video_bitrate,
                  unity_bool_t unity_audio_input,
                  unity_bool_t unity_audio_output,
+                 int unity_audio_sample_rate,
+                 int unity_audio_channels,
+                 unity_bool_t unity_audio_output_per_track,
                  const char* audio_recording_device,
                  const char* audio_playout_device,
                  const char* audio_codec,
-                 int audio_bitrate) {
+                 int audio_bitrate,
+                 const char* audio_profile,
+                 unity_bool_t audio_opus_dtx,
+                 unity_bool_t audio_opus_fec,
+                 int audio_opus_ptime,
+                 unity_bool_t audio_opus_stereo,
+                 int audio_opus_complexity,
+                 const char* video_fec,
+                 unity_bool_t audio_red,
+                 int stats_interval_ms,
+                 int reconnect_max_attempts,
+                 unity_bool_t data_channel_signaling,
+                 unity_bool_t ignore_disconnect_websocket,
+                 unity_bool_t simulcast,
+                 const char* simulcast_rid,
+                 unity_bool_t spotlight,
+                 int spotlight_number,
+                 unity_bool_t adaptive_quality,
+                 float adaptive_quality_target_frame_ms,
+                 int video_start_bitrate,
+                 int video_min_bitrate,
+                 int video_max_bitrate,
+                 const char* field_trials,
+                 int local_preview,
+                 int renderer_convert_threads,
+                 int video_encoder_output_delay,
+                 unity_bool_t video_encoder_intra_refresh,
+                 int video_encoder_threads,
+                 const char* video_scalability_mode,
+                 unity_bool_t video_decoder_texture_output,
+                 unity_bool_t video_decoder_async_output,
+                 int video_playout_delay_min_ms,
+                 int video_playout_delay_max_ms,
+                 int audio_jitter_buffer_min_delay_ms,
+                 unity_bool_t low_latency,
+                 int gpu_adapter_index,
+                 unity_bool_t shared_engine,
+                 const char* recording_directory,
+                 int ice_candidate_pool_size,
+                 const char* ice_transport_policy,
+                 unity_bool_t ice_continual_gathering) {
   auto sora = (sora::Sora*)p;
   sora::Sora::ConnectConfig config;
   config.unity_version = unity_version;
@@ -96,20 +257,77 @@ int sora_connect(void* p,
   config.metadata = metadata;
   config.role = role;
   config.multistream = multistream;
+  config.video = video;
   config.capturer_type = capturer_type;
   config.unity_camera_texture = unity_camera_texture;
+  config.unity_camera_readback_latency = unity_camera_readback_latency;
+  config.unity_camera_static_content = unity_camera_static_content;
+  config.unity_camera_static_refresh_ms = unity_camera_static_refresh_ms;
+  config.unity_camera_capture_fps = unity_camera_capture_fps;
   config.video_capturer_device = video_capturer_device;
   config.video_width = video_width;
   config.video_height = video_height;
+  config.video_fps = video_fps;
   config.video_codec = video_codec;
   config.video_bitrate = video_bitrate;
   config.unity_audio_input = unity_audio_input;
   config.unity_audio_output = unity_audio_output;
+  config.unity_audio_sample_rate = unity_audio_sample_rate;
+  config.unity_audio_channels = unity_audio_channels;
+  config.unity_audio_output_per_track = unity_audio_output_per_track;
   config.audio_recording_device = audio_recording_device;
   config.audio_playout_device = audio_playout_device;
   config.audio_codec = audio_codec;
   config.audio_bitrate = audio_bitrate;
-  if (!sora->Connect(config)) {
+  config.audio_profile = audio_profile;
+  config.audio_opus_dtx = audio_opus_dtx;
+  config.audio_opus_fec = audio_opus_fec;
+  config.audio_opus_ptime = audio_opus_ptime;
+  config.audio_opus_stereo = audio_opus_stereo;
+  config.audio_opus_complexity = audio_opus_complexity;
+  config.video_fec = video_fec;
+  config.audio_red = audio_red;
+  config.stats_interval_ms = stats_interval_ms;
+  config.reconnect_max_attempts = reconnect_max_attempts;
+  config.data_channel_signaling = data_channel_signaling;
+  config.ignore_disconnect_websocket = ignore_disconnect_websocket;
+  config.simulcast = simulcast;
+  config.simulcast_rid = simulcast_rid;
+  config.spotlight = spotlight;
+  config.spotlight_number = spotlight_number;
+  config.adaptive_quality = adaptive_quality;
+  config.adaptive_quality_target_frame_ms = adaptive_quality_target_frame_ms;
+  config.video_start_bitrate = video_start_bitrate;
+  config.video_min_bitrate = video_min_bitrate;
+  config.video_max_bitrate = video_max_bitrate;
+  config.field_trials = field_trials;
+  config.local_preview = local_preview;
+  config.renderer_convert_threads = renderer_convert_threads;
+  config.video_encoder_output_delay = video_encoder_output_delay;
+  config.video_encoder_intra_refresh = video_encoder_intra_refresh;
+  config.video_encoder_threads = video_encoder_threads;
+  config.video_scalability_mode = video_scalability_mode;
+  config.video_decoder_texture_output = video_decoder_texture_output;
+  config.video_decoder_async_output = video_decoder_async_output;
+  config.video_playout_delay_min_ms = video_playout_delay_min_ms;
+  config.video_playout_delay_max_ms = video_playout_delay_max_ms;
+  config.audio_jitter_buffer_min_delay_ms = audio_jitter_buffer_min_delay_ms;
+  config.low_latency = low_latency;
+  config.gpu_adapter_index = gpu_adapter_index;
+  config.shared_engine = shared_engine;
+  config.recording_directory = recording_directory;
+  config.ice_candidate_pool_size = ice_candidate_pool_size;
+  config.ice_transport_policy = ice_transport_policy;
+  config.ice_continual_gathering = ice_continual_gathering;
+  if (!sora->Prepare(config)) {
+    return -1;
+  }
+  return 0;
+}
+
+int sora_connect(void* p) {
+  auto sora = (sora::Sora*)p;
+  if (!sora->Connect()) {
     return -1;
   }
   return 0;
@@ -118,6 +336,152 @@ int sora_connect(void* p,
 void* sora_get_texture_update_callback() {
   return (void*)&sora::UnityRenderer::Sink::TextureUpdateCallback;
 }
+unity_bool_t sora_set_track_native_textures(ptrid_t track_id,
+                                            void* y_texture,
+                                            void* uv_texture) {
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  return sora::UnityRenderer::Sink::SetNativeTextures(track_id, y_texture,
+                                                      uv_texture);
+#else
+  return false;
+#endif
+}
+unity_bool_t sora_set_track_native_texture(ptrid_t track_id, void* texture) {
+#if defined(SORA_UNITY_SDK_ANDROID)
+  return sora::UnityRenderer::Sink::SetNativeTexture(track_id, texture);
+#else
+  return false;
+#endif
+}
+void* sora_get_native_texture_render_callback() {
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_ANDROID)
+  return (void*)&sora::UnityRenderer::Sink::NativeTextureRenderCallback;
+#else
+  return nullptr;
+#endif
+}
+unity_bool_t sora_track_has_new_frame(ptrid_t track_id) {
+  return sora::UnityRenderer::Sink::HasNewFrame(track_id);
+}
+void sora_track_set_max_framerate(ptrid_t track_id, int max_framerate) {
+  sora::UnityRenderer::Sink::SetMaxFramerate(track_id, max_framerate);
+}
+void sora_track_set_paused(ptrid_t track_id, unity_bool_t paused) {
+  sora::UnityRenderer::Sink::SetPaused(track_id, paused);
+}
+void sora_set_render_budget(int64_t time_us,
+                            int64_t bytes,
+                            int max_stale_frames) {
+  sora::RenderScheduler::Instance().SetBudget(time_us, bytes,
+                                              max_stale_frames);
+}
+void* sora_get_render_frame_begin_callback() {
+  return (void*)&sora::RenderScheduler::BeginFrameCallback;
+}
+void sora_set_log_level(int level) {
+  sora::UnityContext::Instance().SetLogLevel(
+      (rtc::LoggingSeverity)std::min(std::max(level, (int)rtc::LS_VERBOSE),
+                                     (int)rtc::LS_NONE));
+}
+ptrid_t sora_create_texture_atlas(int columns, int rows) {
+  return sora::TextureAtlas::Create(columns, rows);
+}
+void sora_destroy_texture_atlas(ptrid_t atlas_id) {
+  sora::TextureAtlas::Destroy(atlas_id);
+}
+unity_bool_t sora_texture_atlas_set_track(ptrid_t atlas_id,
+                                          int tile,
+                                          ptrid_t track_id) {
+  return sora::TextureAtlas::SetTrack(atlas_id, tile, track_id);
+}
+unity_bool_t sora_texture_atlas_get_uv_rect(ptrid_t atlas_id,
+                                            int tile,
+                                            float* rect) {
+  return sora::TextureAtlas::GetUVRect(atlas_id, tile, rect);
+}
+void sora_track_set_render_priority(ptrid_t track_id, int priority) {
+  sora::UnityRenderer::Sink::SetRenderPriority(track_id, priority);
+}
+unity_bool_t sora_get_track_render_stats(ptrid_t track_id,
+                                         sora_track_render_stats_t* stats) {
+  return sora::UnityRenderer::Sink::GetRenderStats(track_id, stats);
+}
+
+int sora_get_rtp_stats(void* p, sora_rtp_stats_t* stats, int max_count) {
+  auto sora = (sora::Sora*)p;
+  return std::max(sora->GetRtpStats(0, stats, max_count), 0);
+}
+
+int sora_get_rtp_stats_history(void* p,
+                               int age,
+                               sora_rtp_stats_t* stats,
+                               int max_count) {
+  auto sora = (sora::Sora*)p;
+  return sora->GetRtpStats(age, stats, max_count);
+}
+
+void sora_mark_unity_camera_dirty(void* p) {
+  auto sora = (sora::Sora*)p;
+  sora->MarkUnityCameraDirty();
+}
+
+unity_bool_t sora_push_encoded_frame(void* p,
+                                     const void* data,
+                                     int size,
+                                     int64_t timestamp_us,
+                                     unity_bool_t is_key_frame) {
+  auto sora = (sora::Sora*)p;
+  return sora->PushEncodedFrame(data, size, timestamp_us, is_key_frame != 0);
+}
+
+void sora_report_frame_time(void* p, float frame_time_ms) {
+  auto sora = (sora::Sora*)p;
+  sora->ReportFrameTime(frame_time_ms);
+}
+
+int sora_get_quality_level(void* p) {
+  auto sora = (sora::Sora*)p;
+  return sora->GetQualityLevel();
+}
+
+int sora_get_stats_implementation_name(int id, char* buf, int size) {
+  std::string name = sora::GetImplementationName(id);
+  if (size > 0) {
+    int n = std::min((int)name.size(), size - 1);
+    std::copy(name.begin(), name.begin() + n, buf);
+    buf[n] = '\0';
+  }
+  return (int)name.size();
+}
+
+void sora_set_perf_counters_enabled(unity_bool_t enabled) {
+  sora::PerfCounters::Instance().SetEnabled(enabled != 0);
+}
+
+int sora_get_perf_counters(sora_perf_counter_t* counters, int max_count) {
+  const int count = (int)sora::PerfStage::kCount;
+  for (int i = 0; i < std::min(count, max_count); i++) {
+    auto c = sora::PerfCounters::Instance().Get((sora::PerfStage)i);
+    counters[i].stage = i;
+    counters[i].count = c.count;
+    counters[i].total_us = c.total_us;
+    counters[i].max_us = c.max_us;
+    counters[i].last_us = c.last_us;
+  }
+  return count;
+}
+
+void sora_reset_perf_counters() {
+  sora::PerfCounters::Instance().Reset();
+}
+
+void sora_start_perf_trace() {
+  sora::PerfCounters::Instance().StartTrace();
+}
+
+unity_bool_t sora_stop_perf_trace(const char* path) {
+  return sora::PerfCounters::Instance().StopTrace(path);
+}
 
 void sora_destroy(void* sora) {
   delete (sora::Sora*)sora;
@@ -135,6 +499,21 @@ void sora_process_audio(void* p, const void* buf, int offset, int samples) {
   auto sora = (sora::Sora*)p;
   sora->ProcessAudio(buf, offset, samples);
 }
+void sora_pull_audio(void* p, float* dst, int frames, int channels) {
+  auto sora = (sora::Sora*)p;
+  sora->PullAudio(dst, frames, channels);
+}
+void sora_pull_track_audio(void* p,
+                           ptrid_t track_id,
+                           float* dst,
+                           int frames,
+                           int channels) {
+  auto sora = (sora::Sora*)p;
+  sora->PullTrackAudio(track_id, dst, frames, channels);
+}
+void sora_convert_audio_to_float(const int16_t* src, float* dst, int samples) {
+  sora::Int16ToFloat(src, dst, samples);
+}
 void sora_set_on_handle_audio(void* p, handle_audio_cb_t f, void* userdata) {
   auto sora = (sora::Sora*)p;
   sora->SetOnHandleAudio(
@@ -174,6 +553,13 @@ unity_bool_t sora_device_enum_audio_playout(device_enum_cb_t f,
 
 unity_bool_t sora_is_h264_supported() {
 #if defined(SORA_UNITY_SDK_WINDOWS)
+  // NVIDIA の GPU が無ければ AMD の AMF や Intel の QSV を使う。
+  // AMF はエンコードだけなので、デコードは NVDEC か QSV が必要
+  return (NvCodecH264Encoder::IsSupported() ||
+          AmfH264Encoder::IsSupported() || MsdkH264Encoder::IsSupported()) &&
+         (NvCodecVideoDecoder::IsSupported(cudaVideoCodec_H264) ||
+          MsdkVideoDecoder::IsSupported(MFX_CODEC_AVC));
+#elif defined(SORA_UNITY_SDK_UBUNTU)
   return NvCodecH264Encoder::IsSupported() && NvCodecVideoDecoder::IsSupported(cudaVideoCodec_H264);
 #elif defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
   // macOS, iOS は VideoToolbox が使えるので常に true
@@ -193,6 +579,23 @@ UnityPluginLoad(IUnityInterfaces* ifs)
 #endif
 {
   sora::UnityContext::Instance().Init(ifs);
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_UBUNTU)
+  // ここでロードした CUDA/NVENC/NVCUVID のライブラリと関数のアドレスは
+  // プロセスが終わるまで保持するので、接続時に再度ロードすることは無い
+  if (!g_codec_probe_thread.joinable()) {
+    g_codec_probe_thread = std::thread([]() {
+      NvCodecH264Encoder::IsSupported();
+      NvCodecVideoDecoder::IsSupported(cudaVideoCodec_H264);
+      NvCodecVideoDecoder::IsSupported(cudaVideoCodec_VP8);
+      NvCodecVideoDecoder::IsSupported(cudaVideoCodec_VP9);
+#if defined(SORA_UNITY_SDK_WINDOWS)
+      AmfH264Encoder::IsSupported();
+      MsdkH264Encoder::IsSupported();
+      MsdkVideoDecoder::IsSupported(MFX_CODEC_AVC);
+#endif
+    });
+  }
+#endif
 }
 
 void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API
@@ -202,6 +605,11 @@ SoraUnitySdk_UnityPluginUnload()
 UnityPluginUnload()
 #endif
 {
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_UBUNTU)
+  if (g_codec_probe_thread.joinable()) {
+    g_codec_probe_thread.join();
+  }
+#endif
   sora::UnityContext::Instance().Shutdown();
 }
 }
@@ -14,6 +14,11 @@ typedef unsigned int ptrid_t;
 typedef void (*track_cb_t)(ptrid_t track_id, void* userdata);
 typedef void (*notify_cb_t)(const char* json, int size, void* userdata);
 typedef void (*stats_cb_t)(const char* json, int size, void* userdata);
+typedef void (*data_channel_message_cb_t)(const char* label,
+                                          const void* data,
+                                          int size,
+                                          void* userdata);
+typedef void (*key_frame_request_cb_t)(void* userdata);
 
 typedef int32_t unity_bool_t;
 
@@ -24,31 +29,294 @@ UNITY_INTERFACE_EXPORT void sora_set_on_add_track(void* p,
 UNITY_INTERFACE_EXPORT void sora_set_on_remove_track(void* p,
                                                      track_cb_t on_remove_track,
                                                      void* userdata);
+// unity_audio_output_per_track の場合に、受信した音声トラックが追加・削除された時に呼ばれる
+UNITY_INTERFACE_EXPORT void sora_set_on_add_audio_track(
+    void* p,
+    track_cb_t on_add_audio_track,
+    void* userdata);
+UNITY_INTERFACE_EXPORT void sora_set_on_remove_audio_track(
+    void* p,
+    track_cb_t on_remove_audio_track,
+    void* userdata);
 UNITY_INTERFACE_EXPORT void sora_set_on_notify(void* p,
                                                notify_cb_t on_notify,
                                                void* userdata);
+// メッセージング用の DataChannel でメッセージを受信した時に sora_dispatch_events から呼ばれる。
+// data はコールバックの中でだけ有効
+UNITY_INTERFACE_EXPORT void sora_set_on_data_channel_message(
+    void* p,
+    data_channel_message_cb_t on_message,
+    void* userdata);
+// capturer_type が 2 の場合に、キーフレームを要求された時に sora_dispatch_events から呼ばれる
+UNITY_INTERFACE_EXPORT void sora_set_on_key_frame_request(
+    void* p,
+    key_frame_request_cb_t on_key_frame_request,
+    void* userdata);
 UNITY_INTERFACE_EXPORT void sora_dispatch_events(void* p);
-UNITY_INTERFACE_EXPORT int sora_connect(void* p,
+// SDK が作るスレッドの優先度と動かす CPU を設定する。sora_prepare より前に呼ぶ。
+// thread_type は sora::Sora::ThreadType、priority は sora::ThreadConfig::Priority の値。
+// affinity_mask が 0 の場合は CPU を固定しない
+UNITY_INTERFACE_EXPORT int sora_set_thread_config(void* p,
+                                                  int thread_type,
+                                                  int priority,
+                                                  uint64_t affinity_mask);
+// Sora に作ってもらうメッセージング用の DataChannel を追加する。sora_prepare より前に呼ぶ。
+// label は # で始め、direction は "sendrecv", "sendonly", "recvonly" のどれか。
+// max_packet_life_time (ミリ秒) と max_retransmits は片方だけ指定でき、使わない方は -1 にする
+UNITY_INTERFACE_EXPORT int sora_add_data_channel(void* p,
+                                                 const char* label,
+                                                 const char* direction,
+                                                 unity_bool_t ordered,
+                                                 int max_packet_life_time,
+                                                 int max_retransmits);
+// メッセージング用の DataChannel で data の offset から size バイトを送る。
+// data は送信キューに直接コピーされる。開いていない場合は false を返す
+UNITY_INTERFACE_EXPORT unity_bool_t
+sora_send_data_channel_message(void* p,
+                               const char* label,
+                               const void* data,
+                               int offset,
+                               int size);
+// 接続の準備をする。ロード画面などで先に呼んでおき、接続する時に sora_connect を呼ぶ
+UNITY_INTERFACE_EXPORT int sora_prepare(void* p,
                                         const char* unity_version,
                                         const char* signaling_url,
                                         const char* channel_id,
                                         const char* metadata,
                                         const char* role,
                                         unity_bool_t multistream,
+                                        unity_bool_t video,
                                         int capturer_type,
                                         void* unity_camera_texture,
+                                        int unity_camera_readback_latency,
+                                        unity_bool_t unity_camera_static_content,
+                                        int unity_camera_static_refresh_ms,
+                                        int unity_camera_capture_fps,
                                         const char* video_capturer_device,
                                         int video_width,
                                         int video_height,
+                                        int video_fps,
                                         const char* video_codec,
                                         int video_bitrate,
                                         unity_bool_t unity_audio_input,
                                         unity_bool_t unity_audio_output,
+                                        int unity_audio_sample_rate,
+                                        int unity_audio_channels,
+                                        unity_bool_t unity_audio_output_per_track,
                                         const char* audio_recording_device,
                                         const char* audio_playout_device,
                                         const char* audio_codec,
-                                        int audio_bitrate);
+                                        int audio_bitrate,
+                                        const char* audio_profile,
+                                        unity_bool_t audio_opus_dtx,
+                                        unity_bool_t audio_opus_fec,
+                                        int audio_opus_ptime,
+                                        unity_bool_t audio_opus_stereo,
+                                        int audio_opus_complexity,
+                                        const char* video_fec,
+                                        unity_bool_t audio_red,
+                                        int stats_interval_ms,
+                                        int reconnect_max_attempts,
+                                        unity_bool_t data_channel_signaling,
+                                        unity_bool_t ignore_disconnect_websocket,
+                                        unity_bool_t simulcast,
+                                        const char* simulcast_rid,
+                                        unity_bool_t spotlight,
+                                        int spotlight_number,
+                                        unity_bool_t adaptive_quality,
+                                        float adaptive_quality_target_frame_ms,
+                                        int video_start_bitrate,
+                                        int video_min_bitrate,
+                                        int video_max_bitrate,
+                                        const char* field_trials,
+                                        int local_preview,
+                                        int renderer_convert_threads,
+                                        int video_encoder_output_delay,
+                                        unity_bool_t video_encoder_intra_refresh,
+                                        int video_encoder_threads,
+                                        const char* video_scalability_mode,
+                                        unity_bool_t video_decoder_texture_output,
+                                        unity_bool_t video_decoder_async_output,
+                                        int video_playout_delay_min_ms,
+                                        int video_playout_delay_max_ms,
+                                        int audio_jitter_buffer_min_delay_ms,
+                                        unity_bool_t low_latency,
+                                        int gpu_adapter_index,
+                                        unity_bool_t shared_engine,
+                                        const char* recording_directory,
+                                        int ice_candidate_pool_size,
+                                        const char* ice_transport_policy,
+                                        unity_bool_t ice_continual_gathering);
+UNITY_INTERFACE_EXPORT int sora_connect(void* p);
 UNITY_INTERFACE_EXPORT void* sora_get_texture_update_callback();
+// 受信した映像を Y (R8) と UV (RG16) のネイティブテクスチャに GPU 上で書き込む。
+// Windows 以外では何もせずに false を返す。
+// 解除する場合は両方に nullptr を渡す。
+UNITY_INTERFACE_EXPORT unity_bool_t sora_set_track_native_textures(
+    ptrid_t track_id,
+    void* y_texture,
+    void* uv_texture);
+// Android で Config の video_decoder_texture_output を有効にした場合に、
+// MediaCodec のデコード結果を CPU を経由せずに RGBA のネイティブテクスチャに書き込む。
+// Unity が Vulkan でない場合や Android 以外では何もせずに false を返す。
+// 解除する場合は nullptr を渡す。
+UNITY_INTERFACE_EXPORT unity_bool_t sora_set_track_native_texture(
+    ptrid_t track_id,
+    void* texture);
+UNITY_INTERFACE_EXPORT void* sora_get_native_texture_render_callback();
+UNITY_INTERFACE_EXPORT unity_bool_t sora_track_has_new_frame(ptrid_t track_id);
+UNITY_INTERFACE_EXPORT void sora_track_set_max_framerate(ptrid_t track_id,
+                                                         int max_framerate);
+// 受信した映像トラックを一時停止する。一時停止中はフレームを Unity 向けに変換しない
+UNITY_INTERFACE_EXPORT void sora_track_set_paused(ptrid_t track_id,
+                                                  unity_bool_t paused);
+
+// 複数の受信した映像を 1 枚の RGBA テクスチャに columns x rows のタイルで並べて転送する。
+// テクスチャの更新は sora_get_texture_update_callback に、
+// userData として atlas_id | (5 << 29) を渡して行う。作れない場合は 0 を返す
+UNITY_INTERFACE_EXPORT ptrid_t sora_create_texture_atlas(int columns, int rows);
+UNITY_INTERFACE_EXPORT void sora_destroy_texture_atlas(ptrid_t atlas_id);
+// tile に track_id の映像を転送する。track_id に 0 を指定するとタイルを空ける
+UNITY_INTERFACE_EXPORT unity_bool_t
+sora_texture_atlas_set_track(ptrid_t atlas_id, int tile, ptrid_t track_id);
+// tile の UV 矩形を rect に x, y, width, height の順で書き込む
+UNITY_INTERFACE_EXPORT unity_bool_t
+sora_texture_atlas_get_uv_rect(ptrid_t atlas_id, int tile, float* rect);
+
+// 受信した映像のテクスチャ転送に、Unity の 1 フレームあたりの時間（マイクロ秒）と
+// バイト数の上限を設ける。両方 0 の場合は制限しない。
+// 上限を超えたトラックは次のフレームに回すが、max_stale_frames フレームより長くは待たせない。
+// フレームの最初に sora_get_render_frame_begin_callback を IssuePluginEvent で呼ぶこと。
+UNITY_INTERFACE_EXPORT void sora_set_render_budget(int64_t time_us,
+                                                   int64_t bytes,
+                                                   int max_stale_frames);
+UNITY_INTERFACE_EXPORT void* sora_get_render_frame_begin_callback();
+
+// 出力するログの重要度の下限。rtc::LoggingSeverity の値で、
+// 0: VERBOSE, 1: INFO, 2: WARNING, 3: ERROR, 4: NONE
+UNITY_INTERFACE_EXPORT void sora_set_log_level(int level);
+// 転送の上限を超えた時に、priority が大きいトラックから先に転送する
+UNITY_INTERFACE_EXPORT void sora_track_set_render_priority(ptrid_t track_id,
+                                                           int priority);
+
+// 受信した映像トラックのレンダリングに関する統計情報
+typedef struct sora_track_render_stats_t {
+  // OnFrame で受け取ったフレーム数
+  uint64_t frames_received;
+  // テクスチャに転送される前に次のフレームで上書きされたフレーム数
+  uint64_t frames_dropped;
+  // テクスチャに転送したフレーム数
+  uint64_t frames_rendered;
+  // kNative から I420 への変換回数と合計時間
+  uint64_t native_convert_count;
+  int64_t native_convert_time_us;
+  // スケーリングと色変換の回数と合計時間
+  uint64_t convert_count;
+  int64_t convert_time_us;
+  // 最後に受け取ったフレームのサイズ
+  int32_t last_frame_width;
+  int32_t last_frame_height;
+  // 送信側でキャプチャしてから、デコードされるまでと
+  // テクスチャに転送するまでの遅延（ミリ秒）の 50/95/99 パーセンタイル。
+  // abs-capture-time ヘッダ拡張が付いたフレームが無い場合は -1。
+  // 送信側と受信側の時計が NTP で合っている必要がある
+  int32_t capture_to_decode_p50_ms;
+  int32_t capture_to_decode_p95_ms;
+  int32_t capture_to_decode_p99_ms;
+  int32_t capture_to_render_p50_ms;
+  int32_t capture_to_render_p95_ms;
+  int32_t capture_to_render_p99_ms;
+  // 遅延を計測したフレーム数と、キャプチャ時刻が付いていなかったフレーム数
+  uint64_t latency_sample_count;
+  uint64_t frames_without_capture_time;
+  // 転送の予算を超えたために、次のフレームに転送を回したフレーム数
+  uint64_t frames_deferred;
+} sora_track_render_stats_t;
+UNITY_INTERFACE_EXPORT unity_bool_t
+sora_get_track_render_stats(ptrid_t track_id, sora_track_render_stats_t* stats);
+
+// 送受信している RTP ストリームごとの統計情報。
+// sora_get_stats の JSON から主な値だけを取り出したもの
+typedef struct sora_rtp_stats_t {
+  // 0: 音声, 1: 映像
+  int32_t kind;
+  // 0: 受信, 1: 送信
+  int32_t direction;
+  uint32_t ssrc;
+  // 映像の場合のエンコーダ・デコーダの名前。
+  // sora_get_stats_implementation_name で文字列にする
+  int32_t implementation;
+  // 送信または受信したバイト数とパケット数
+  uint64_t bytes;
+  uint64_t packets;
+  // 送信の場合は相手から報告された値
+  int64_t packets_lost;
+  double jitter;
+  double round_trip_time;
+  // 以下は映像の場合だけ
+  double frames_per_second;
+  int32_t frame_width;
+  int32_t frame_height;
+  // エンコードまたはデコードしたフレーム数と、その QP の合計
+  uint64_t frames;
+  uint64_t qp_sum;
+  // 統計情報を取得した時刻（マイクロ秒）
+  int64_t timestamp_us;
+  // 前回取得した時からの差分で求めたビットレート (bps) とフレームレート
+  double bitrate;
+  double frame_rate;
+} sora_rtp_stats_t;
+// 最新の統計情報を最大 max_count 個 stats に書き込み、ストリームの数を返す。
+// 毎フレーム呼んでもよい。統計情報は stats_interval_ms ごとに裏で取得している
+UNITY_INTERFACE_EXPORT int sora_get_rtp_stats(void* p,
+                                              sora_rtp_stats_t* stats,
+                                              int max_count);
+// age 回前に取得した統計情報を書き込み、ストリームの数を返す。
+// 履歴に残っていない場合は -1 を返す
+UNITY_INTERFACE_EXPORT int sora_get_rtp_stats_history(void* p,
+                                                      int age,
+                                                      sora_rtp_stats_t* stats,
+                                                      int max_count);
+// adaptive_quality の場合に、Unity の 1 フレームにかかった時間（ミリ秒）を毎フレーム渡す
+UNITY_INTERFACE_EXPORT void sora_report_frame_time(void* p,
+                                                   float frame_time_ms);
+// adaptive_quality で送信する映像を落としている段階。0 が最高品質
+UNITY_INTERFACE_EXPORT int sora_get_quality_level(void* p);
+// unity_camera_static_content の場合に、Unity のカメラの映像が変わったことを知らせる
+UNITY_INTERFACE_EXPORT void sora_mark_unity_camera_dirty(void* p);
+// capturer_type が 2 の場合に、アプリがエンコードした Annex B 形式の H.264 のフレームを送る。
+// timestamp_us はキャプチャした時刻で、単調増加していればどの時計でもいい
+UNITY_INTERFACE_EXPORT unity_bool_t
+sora_push_encoded_frame(void* p,
+                        const void* data,
+                        int size,
+                        int64_t timestamp_us,
+                        unity_bool_t is_key_frame);
+// sora_rtp_stats_t::implementation を文字列にして buf に書き込み、長さを返す
+UNITY_INTERFACE_EXPORT int sora_get_stats_implementation_name(int id,
+                                                              char* buf,
+                                                              int size);
+
+// 処理ごとの回数と時間。stage は sora::PerfStage の番号
+typedef struct sora_perf_counter_t {
+  int32_t stage;
+  uint64_t count;
+  // 合計と最大と最後の 1 回の時間（マイクロ秒）
+  int64_t total_us;
+  int64_t max_us;
+  int64_t last_us;
+} sora_perf_counter_t;
+// 処理ごとの時間の計測を有効にする。無効な場合はほぼコストがかからない
+UNITY_INTERFACE_EXPORT void sora_set_perf_counters_enabled(unity_bool_t enabled);
+// 最大 max_count 個の処理の計測結果を counters に書き込み、処理の数を返す
+UNITY_INTERFACE_EXPORT int sora_get_perf_counters(sora_perf_counter_t* counters,
+                                                  int max_count);
+UNITY_INTERFACE_EXPORT void sora_reset_perf_counters();
+// Chrome の trace 形式のイベントを溜め始める。sora_set_perf_counters_enabled で有効にしておくこと
+UNITY_INTERFACE_EXPORT void sora_start_perf_trace();
+// 溜めるのを止めて、溜めたイベントを path に書き出す
+UNITY_INTERFACE_EXPORT unity_bool_t sora_stop_perf_trace(const char* path);
+
 UNITY_INTERFACE_EXPORT void sora_destroy(void* sora);
 
 UNITY_INTERFACE_EXPORT void* sora_get_render_callback();
@@ -62,6 +330,23 @@ typedef void (*handle_audio_cb_t)(const int16_t* buf,
                                   int samples,
                                   int channels,
                                   void* userdata);
+// OnHandleAudio を設定していない場合に、受信した音声を frames フレーム分 dst に書き込む。
+// Unity の OnAudioFilterRead から呼ぶ。足りない分は無音になる。
+UNITY_INTERFACE_EXPORT void sora_pull_audio(void* p,
+                                            float* dst,
+                                            int frames,
+                                            int channels);
+// unity_audio_output_per_track の場合に、track_id のトラックの音声を frames フレーム分 dst に書き込む。
+// Unity の OnAudioFilterRead から呼ぶ。足りない分は無音になる。
+UNITY_INTERFACE_EXPORT void sora_pull_track_audio(void* p,
+                                                  ptrid_t track_id,
+                                                  float* dst,
+                                                  int frames,
+                                                  int channels);
+// OnHandleAudio で受け取った int16 のサンプルを Unity の float に変換する
+UNITY_INTERFACE_EXPORT void sora_convert_audio_to_float(const int16_t* src,
+                                                        float* dst,
+                                                        int samples);
 UNITY_INTERFACE_EXPORT void sora_set_on_handle_audio(void* p,
                                                      handle_audio_cb_t f,
                                                      void* userdata);
@@ -2,8 +2,11 @@
 #define SORA_UNITY_AUDIO_DEVICE_H_INCLUDED
 
 #include <stddef.h>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <memory>
+#include <thread>
 #include <vector>
 
 // webrtc
@@ -12,6 +15,14 @@
 #include "rtc_base/ref_counted_object.h"
 #include "rtc_base/thread.h"
 
+#include "audio_playout_buffer.h"
+#include "audio_sample_conversion.h"
+#include "log_rate_limiter.h"
+#include "memory_stats.h"
+#include "perf_counters.h"
+#include "rtc/thread_config.h"
+#include "spsc_ring_buffer.h"
+
 namespace sora {
 
 class UnityAudioDevice : public webrtc::AudioDeviceModule {
@@ -22,12 +33,28 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
       bool adm_playout,
       std::function<void(const int16_t* p, int samples, int channels)>
           on_handle_audio,
-      webrtc::TaskQueueFactory* task_queue_factory)
+      int unity_sample_rate,
+      int unity_channels,
+      bool track_output,
+      webrtc::TaskQueueFactory* task_queue_factory,
+      ThreadConfig playout_thread_config = ThreadConfig(),
+      ThreadConfig recording_thread_config = ThreadConfig())
       : adm_(adm),
         adm_recording_(adm_recording),
         adm_playout_(adm_playout),
         on_handle_audio_(on_handle_audio),
-        task_queue_factory_(task_queue_factory) {}
+        unity_sample_rate_(unity_sample_rate > 0 ? unity_sample_rate : 48000),
+        unity_channels_(unity_channels > 0 ? unity_channels : 2),
+        recording_channels_(unity_channels_ == 1 ? 1 : 2),
+        track_output_(track_output),
+        task_queue_factory_(task_queue_factory),
+        playout_thread_config_(playout_thread_config),
+        recording_thread_config_(recording_thread_config),
+        recorded_data_(kRecordingBufferSize),
+        playout_data_(kPlayoutBufferSize) {
+    memory_.Set((kRecordingBufferSize + kPlayoutBufferSize) * sizeof(int16_t),
+                2);
+  }
 
   ~UnityAudioDevice() override {
     RTC_LOG(LS_INFO) << "~UnityAudioDevice";
@@ -40,28 +67,60 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
       bool adm_playout,
       std::function<void(const int16_t* p, int samples, int channels)>
           on_handle_audio,
-      webrtc::TaskQueueFactory* task_queue_factory) {
+      int unity_sample_rate,
+      int unity_channels,
+      bool track_output,
+      webrtc::TaskQueueFactory* task_queue_factory,
+      ThreadConfig playout_thread_config = ThreadConfig(),
+      ThreadConfig recording_thread_config = ThreadConfig()) {
     return new rtc::RefCountedObject<UnityAudioDevice>(
-        adm, adm_recording, adm_playout, on_handle_audio, task_queue_factory);
-  }
-
-  void ProcessAudioData(const float* data, int32_t size) {
-    if (!adm_recording_ && initialized_ && is_recording_) {
-      for (int i = 0; i < size; i++) {
-#pragma warning(suppress : 4244)
-        converted_audio_data_.push_back(data[i] >= 0 ? data[i] * SHRT_MAX
-                                                     : data[i] * -SHRT_MIN);
-      }
-      //opus supports up to 48khz sample rate, enforce 48khz here for quality
-      int chunk_size = 48000 * 2 / 100;
-      while (converted_audio_data_.size() > chunk_size) {
-        device_buffer_->SetRecordedBuffer(converted_audio_data_.data(),
-                                          chunk_size / 2);
-        device_buffer_->DeliverRecordedData();
-        converted_audio_data_.erase(converted_audio_data_.begin(),
-                                    converted_audio_data_.begin() + chunk_size);
-      }
+        adm, adm_recording, adm_playout, on_handle_audio, unity_sample_rate,
+        unity_channels, track_output, task_queue_factory,
+        playout_thread_config, recording_thread_config);
+  }
+
+  // Unity のオーディオスレッドから呼ばれる。
+  // data は Unity のサンプリングレートとチャンネル数の frames フレーム分のデータ。
+  // ここではリングバッファに書き込むだけで、WebRTC への受け渡しは録音スレッドで行う。
+  // 確保やロックをしないので、Unity のオーディオスレッドを待たせない。
+  void ProcessAudioData(const float* data, int32_t frames) {
+    if (adm_recording_ || !initialized_ || !is_recording_) {
+      return;
+    }
+    ScopedPerfTimer timer(PerfStage::kAudioProcess);
+    if (unity_channels_ <= 2) {
+      recorded_data_.Write(
+          frames * unity_channels_,
+          [data](int16_t* dst, size_t offset, size_t count) {
+            FloatToInt16(data + offset, dst, count);
+          });
+      return;
     }
+    // 3 チャンネル以上の場合はステレオに混ぜてから書き込む。
+    // 書き込む位置は常に偶数なので、フレームの途中で分かれることはない。
+    const int channels = unity_channels_;
+    recorded_data_.Write(
+        frames * 2, [data, channels](int16_t* dst, size_t offset, size_t count) {
+          const size_t kChunkFrames = 256;
+          float stereo[kChunkFrames * 2];
+          size_t frame = offset / 2;
+          size_t end = frame + count / 2;
+          while (frame < end) {
+            size_t n = std::min(end - frame, kChunkFrames);
+            DownmixToStereo(data + frame * channels, channels, stereo, n);
+            FloatToInt16(stereo, dst, n * 2);
+            dst += n * 2;
+            frame += n;
+          }
+        });
+  }
+
+  // Unity のオーディオスレッド (OnAudioFilterRead) から呼ばれる。
+  // on_handle_audio を指定しなかった場合、受信した音声はここで取り出す。
+  // 再生スレッドが溜めておいたデータを frames フレーム分 float で dst に書き込み、
+  // 足りない分は無音にする。確保やロックはしない。
+  void PullAudioData(float* dst, int frames, int channels) {
+    playout_data_.Read(dst, frames, channels);
   }
 
   //webrtc::AudioDeviceModule
@@ -93,6 +152,7 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
     RTC_LOG(LS_INFO) << "Terminate";
 
     DoStopPlayout();
+    DoStopRecording();
 
     initialized_ = false;
     is_recording_ = false;
@@ -148,22 +208,125 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
 
   void HandleAudioData() {
     int channels = stereo_playout_ ? 2 : 1;
+    const int chunk_size = unity_sample_rate_ / 100;
+    std::unique_ptr<int16_t[]> audio_buffer(new int16_t[chunk_size * channels]);
     auto next_at = std::chrono::steady_clock::now();
     while (!handle_audio_thread_stopped_) {
       // 10 ミリ秒ごとにオーディオデータを取得する
       next_at += std::chrono::milliseconds(10);
       std::this_thread::sleep_until(next_at);
+      ScopedPerfTimer timer(PerfStage::kAudioHandle);
 
-      int chunk_size = 48000 / 100;
       int samples = device_buffer_->RequestPlayoutData(chunk_size);
 
       //RTC_LOG(LS_INFO) << "handle audio data: chunk_size=" << chunk_size
       //                 << " samples=" << samples;
 
-      std::unique_ptr<int16_t[]> audio_buffer(new int16_t[samples * channels]);
       device_buffer_->GetPlayoutData(audio_buffer.get());
       if (on_handle_audio_) {
         on_handle_audio_(audio_buffer.get(), samples, channels);
+      } else {
+        // PullAudioData で取り出されていなければ捨てる
+        playout_data_.Write(audio_buffer.get(), samples);
+      }
+    }
+  }
+
+  // PullAudioData 向けに、Unity が取り出した分だけ WebRTC から取得して溜めておく。
+  // 自前の時計ではなく Unity の DSP の時計に合わせて取得するので、ずれていかない。
+  // ただし 100 ミリ秒以上取り出されていない間は、NetEq が溜まり続けたり受信の統計が
+  // 止まったりしないように、HandleAudioData と同じく 10 ミリ秒ごとに取得して捨てる。
+  void FillPlayoutData() {
+    int channels = playout_data_.channels();
+    const int chunk_size = unity_sample_rate_ / 100;
+    std::unique_ptr<int16_t[]> audio_buffer(new int16_t[chunk_size * channels]);
+    uint64_t underrun_frames = playout_data_.underrun_frames();
+    auto underrun_logged_at = std::chrono::steady_clock::now();
+    bool reader_idle = false;
+    auto next_at = std::chrono::steady_clock::now();
+    while (!handle_audio_thread_stopped_) {
+      auto now = std::chrono::steady_clock::now();
+      if (now - playout_data_.last_read_at() >= kPlayoutReaderIdleTimeout) {
+        if (!reader_idle) {
+          // 溜まっている古いデータは、次に取り出された時に捨てる
+          reader_idle = true;
+          playout_data_.Reset(channels);
+          next_at = now;
+        }
+        // 長く止まっていた場合にまとめて取得しないようにする
+        if (now - next_at > kPlayoutReaderIdleTimeout) {
+          next_at = now;
+        }
+        while (next_at <= now) {
+          ScopedPerfTimer timer(PerfStage::kAudioHandle);
+          device_buffer_->RequestPlayoutData(chunk_size);
+          device_buffer_->GetPlayoutData(audio_buffer.get());
+          next_at += std::chrono::milliseconds(10);
+        }
+      } else {
+        reader_idle = false;
+        // Unity が 1 回に取り出す量より 10 ミリ秒分多く溜めておく
+        size_t target =
+            std::max(playout_data_.last_read_frames(), chunk_size) +
+            chunk_size;
+        target = std::min(target, playout_data_.CapacityFrames());
+        if (playout_data_.AvailableFrames() < target) {
+          ScopedPerfTimer timer(PerfStage::kAudioHandle);
+          while (playout_data_.AvailableFrames() < target) {
+            device_buffer_->RequestPlayoutData(chunk_size);
+            device_buffer_->GetPlayoutData(audio_buffer.get());
+            if (!playout_data_.Write(audio_buffer.get(), chunk_size)) {
+              break;
+            }
+          }
+        }
+      }
+
+      // 足りなくなっていたら 1 秒に 1 回だけログに出す
+      auto now = std::chrono::steady_clock::now();
+      if (playout_data_.underrun_frames() != underrun_frames &&
+          now - underrun_logged_at >= std::chrono::seconds(1)) {
+        RTC_LOG(LS_WARNING) << "Unity audio output underrun: silent_frames="
+                            << (playout_data_.underrun_frames() -
+                                underrun_frames);
+        underrun_frames = playout_data_.underrun_frames();
+        underrun_logged_at = now;
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  }
+
+  void HandleRecordedData() {
+    // Unity のサンプリングレートのまま渡して、WebRTC の中で 48kHz にリサンプリングさせる
+    const size_t frames = unity_sample_rate_ / 100;
+    const size_t chunk_size = frames * recording_channels_;
+    std::unique_ptr<int16_t[]> chunk(new int16_t[chunk_size]);
+    // 前回の録音で残っていたデータは捨てる
+    recorded_data_.Clear();
+    uint64_t overflow_count = recorded_data_.overflow_count();
+    auto overflow_logged_at = std::chrono::steady_clock::now();
+    auto next_at = std::chrono::steady_clock::now();
+    while (!handle_recording_thread_stopped_) {
+      // 10 ミリ秒ごとに溜まっている分をまとめて渡す
+      next_at += std::chrono::milliseconds(10);
+      std::this_thread::sleep_until(next_at);
+
+      while (recorded_data_.Available() >= chunk_size) {
+        recorded_data_.Read(chunk.get(), chunk_size);
+        device_buffer_->SetRecordedBuffer(chunk.get(), frames);
+        device_buffer_->DeliverRecordedData();
+      }
+
+      // 溢れていたら 1 秒に 1 回だけログに出す
+      auto now = std::chrono::steady_clock::now();
+      if (recorded_data_.overflow_count() != overflow_count &&
+          now - overflow_logged_at >= std::chrono::seconds(1)) {
+        RTC_LOG(LS_WARNING)
+            << "Unity audio input overflowed: dropped_samples="
+            << (recorded_data_.overflow_count() - overflow_count);
+        overflow_count = recorded_data_.overflow_count();
+        overflow_logged_at = now;
       }
     }
   }
@@ -188,12 +351,23 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
       DoStopPlayout();
 
       is_playing_ = true;
-      device_buffer_->SetPlayoutSampleRate(48000);
+      device_buffer_->SetPlayoutSampleRate(unity_sample_rate_);
       device_buffer_->SetPlayoutChannels(stereo_playout_ ? 2 : 1);
 
+      // チャンネル数が変わるかもしれないので、前回の残りは PullAudioData で捨てる
+      playout_data_.Reset(stereo_playout_ ? 2 : 1);
+
       handle_audio_thread_.reset(new std::thread([this]() {
+        ApplyCurrentThreadConfig("Sora Audio Playout Thread",
+                                 playout_thread_config_);
         RTC_LOG(LS_INFO) << "Sora Audio Playout Thread started";
-        HandleAudioData();
+        // トラックごとの音声は WebRTC がミックスする時に届くので、
+        // Unity がミックスを取り出していなくても 10 ミリ秒ごとに取得する
+        if (on_handle_audio_ || track_output_) {
+          HandleAudioData();
+        } else {
+          FillPlayoutData();
+        }
         RTC_LOG(LS_INFO) << "Sora Audio Playout Thread finished";
       }));
 
@@ -203,7 +377,9 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
   virtual bool PlayoutIsInitialized() const override {
     auto result =
         adm_playout_ ? adm_->PlayoutIsInitialized() : (bool)is_playing_;
-    RTC_LOG(LS_INFO) << "PlayoutIsInitialized: result=" << result;
+    // WebRTC から定期的に呼ばれるので間引く
+    SORA_LOG_RATE_LIMITED(LS_INFO, 10000)
+        << "PlayoutIsInitialized: result=" << result;
     return result;
   }
   virtual int32_t RecordingIsAvailable(bool* available) override {
@@ -218,9 +394,19 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
     if (adm_recording_) {
       return adm_->InitRecording();
     } else {
+      DoStopRecording();
+
+      device_buffer_->SetRecordingSampleRate(unity_sample_rate_);
+      device_buffer_->SetRecordingChannels(recording_channels_);
+
+      handle_recording_thread_.reset(new std::thread([this]() {
+        ApplyCurrentThreadConfig("Sora Audio Recording Thread",
+                                 recording_thread_config_);
+        RTC_LOG(LS_INFO) << "Sora Audio Recording Thread started";
+        HandleRecordedData();
+        RTC_LOG(LS_INFO) << "Sora Audio Recording Thread finished";
+      }));
       is_recording_ = true;
-      device_buffer_->SetRecordingSampleRate(48000);
-      device_buffer_->SetRecordingChannels(2);
       return 0;
     }
   }
@@ -263,8 +449,22 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
   virtual int32_t StartRecording() override {
     return adm_recording_ ? adm_->StartRecording() : 0;
   }
+  void DoStopRecording() {
+    is_recording_ = false;
+    if (handle_recording_thread_) {
+      handle_recording_thread_stopped_ = true;
+      handle_recording_thread_->join();
+      handle_recording_thread_.reset();
+      handle_recording_thread_stopped_ = false;
+    }
+  }
   virtual int32_t StopRecording() override {
-    return adm_recording_ ? adm_->StopRecording() : 0;
+    if (adm_recording_) {
+      return adm_->StopRecording();
+    } else {
+      DoStopRecording();
+      return 0;
+    }
   }
   virtual bool Recording() const override {
     return adm_recording_ ? adm_->Recording() : (bool)is_recording_;
@@ -418,7 +618,17 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
   rtc::scoped_refptr<webrtc::AudioDeviceModule> adm_;
   bool adm_recording_;
   bool adm_playout_;
+  // Unity の AudioSettings のサンプリングレートとチャンネル数
+  const int unity_sample_rate_;
+  const int unity_channels_;
+  // WebRTC に渡す録音データのチャンネル数。3 チャンネル以上はステレオに混ぜる
+  const int recording_channels_;
+  // 受信した音声をトラックごとに UnityAudioTrackReceiver で取り出すか
+  const bool track_output_;
   webrtc::TaskQueueFactory* task_queue_factory_;
+  // 10 ミリ秒ごとに動く送受信のスレッドの優先度
+  const ThreadConfig playout_thread_config_;
+  const ThreadConfig recording_thread_config_;
   std::function<void(const int16_t* p, int samples, int channels)>
       on_handle_audio_;
   std::unique_ptr<std::thread> handle_audio_thread_;
@@ -428,7 +638,20 @@ class UnityAudioDevice : public webrtc::AudioDeviceModule {
   std::atomic_bool is_recording_ = {false};
   std::atomic_bool is_playing_ = {false};
   std::atomic_bool stereo_playout_ = {false};
-  std::vector<int16_t> converted_audio_data_;
+
+  // Unity から受け取った録音データ。48kHz ステレオで約 170 ミリ秒分
+  static const size_t kRecordingBufferSize = 16384;
+  SpscRingBuffer<int16_t> recorded_data_;
+  std::unique_ptr<std::thread> handle_recording_thread_;
+  std::atomic_bool handle_recording_thread_stopped_ = {false};
+
+  // PullAudioData で取り出す受信データ。48kHz ステレオで約 170 ミリ秒分
+  static const size_t kPlayoutBufferSize = 16384;
+  AudioPlayoutBuffer playout_data_;
+  // これ以上 PullAudioData が呼ばれなければ、取り出す側がいないとみなす
+  static constexpr std::chrono::milliseconds kPlayoutReaderIdleTimeout{100};
+
+  TrackedMemory memory_{MemoryCategory::kAudioBuffers};
 };  // namespace sora
 
 }  // namespace sora
@@ -0,0 +1,149 @@
+#include "unity_audio_track_receiver.h"
+
+#include <algorithm>
+
+#include <rtc_base/logging.h>
+
+namespace sora {
+
+// 1 トラックあたりに溜めておくサンプル数。48kHz ステレオで約 170 ミリ秒分
+static const size_t kTrackBufferSize = 16384;
+
+// UnityAudioTrackReceiver::Sink
+
+UnityAudioTrackReceiver::Sink::Sink(webrtc::AudioTrackInterface* track,
+                                    int sample_rate)
+    : track_(track), sample_rate_(sample_rate), buffer_(kTrackBufferSize) {
+  ptrid_ = IdPointer::Instance().Register(this, IdPointer::Type::kAudioSink);
+  track_->AddSink(this);
+}
+UnityAudioTrackReceiver::Sink::~Sink() {
+  // RemoveSink が戻った後は OnData が呼ばれない
+  track_->RemoveSink(this);
+  IdPointer::Instance().Unregister(ptrid_);
+}
+ptrid_t UnityAudioTrackReceiver::Sink::GetSinkID() const {
+  return ptrid_;
+}
+
+void UnityAudioTrackReceiver::Sink::Pull(float* dst, int frames, int channels) {
+  buffer_.Read(dst, frames, channels);
+}
+
+void UnityAudioTrackReceiver::Sink::OnData(const void* audio_data,
+                                           int bits_per_sample,
+                                           int sample_rate,
+                                           size_t number_of_channels,
+                                           size_t number_of_frames) {
+  if (bits_per_sample != 16 || number_of_channels == 0) {
+    return;
+  }
+  const int16_t* data = (const int16_t*)audio_data;
+
+  // 3 チャンネル以上の場合は先頭の 2 チャンネルだけ使う
+  size_t channels = std::min(number_of_channels, (size_t)2);
+  if (channels != number_of_channels) {
+    stereo_.resize(number_of_frames * channels);
+    for (size_t i = 0; i < number_of_frames; i++) {
+      stereo_[i * 2 + 0] = data[i * number_of_channels + 0];
+      stereo_[i * 2 + 1] = data[i * number_of_channels + 1];
+    }
+    data = stereo_.data();
+  }
+  if ((int)channels != buffer_.channels()) {
+    buffer_.Reset((int)channels);
+  }
+
+  size_t frames = number_of_frames;
+  if (sample_rate != sample_rate_) {
+    if (resampler_.InitializeIfNeeded(sample_rate, sample_rate_, channels) !=
+        0) {
+      RTC_LOG(LS_ERROR) << "Failed to initialize resampler: from="
+                        << sample_rate << " to=" << sample_rate_;
+      return;
+    }
+    resampled_.resize((size_t)sample_rate_ / 100 * channels);
+    int samples = resampler_.Resample(data, number_of_frames * channels,
+                                      resampled_.data(), resampled_.size());
+    if (samples < 0) {
+      return;
+    }
+    data = resampled_.data();
+    frames = samples / channels;
+  }
+
+  // Unity が取り出していない場合は溢れるので、古いデータは捨てて遅延が溜まらないようにする
+  if (!buffer_.Write(data, frames)) {
+    buffer_.Reset((int)channels);
+  }
+
+  memory_.Set((kTrackBufferSize + stereo_.capacity() + resampled_.capacity()) *
+                  sizeof(int16_t),
+              1);
+}
+
+// UnityAudioTrackReceiver
+
+UnityAudioTrackReceiver::UnityAudioTrackReceiver(
+    int sample_rate,
+    std::function<void(ptrid_t)> on_add_track,
+    std::function<void(ptrid_t)> on_remove_track)
+    : sample_rate_(sample_rate),
+      on_add_track_(on_add_track),
+      on_remove_track_(on_remove_track) {}
+
+void UnityAudioTrackReceiver::AddTrack(webrtc::AudioTrackInterface* track) {
+  std::shared_ptr<Sink> sink(new Sink(track, sample_rate_));
+  auto sink_id = sink->GetSinkID();
+  // IdPointer に登録できなかったトラックは Unity から引けないので再生しない
+  if (sink_id == 0) {
+    RTC_LOG(LS_ERROR) << "Failed to register audio sink";
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(sinks_mutex_);
+    sinks_[track] = sink;
+    sinks_by_id_[sink_id] = sink;
+  }
+  on_add_track_(sink_id);
+}
+
+void UnityAudioTrackReceiver::RemoveTrack(webrtc::AudioTrackInterface* track) {
+  std::shared_ptr<Sink> sink;
+  {
+    std::lock_guard<std::mutex> guard(sinks_mutex_);
+    auto it = sinks_.find(track);
+    if (it == sinks_.end()) {
+      return;
+    }
+    sink = it->second;
+    sinks_.erase(it);
+    sinks_by_id_.erase(sink->GetSinkID());
+  }
+  auto sink_id = sink->GetSinkID();
+  // Pull の途中でなければここで破棄される
+  sink.reset();
+  on_remove_track_(sink_id);
+}
+
+void UnityAudioTrackReceiver::Pull(ptrid_t track_id,
+                                   float* dst,
+                                   int frames,
+                                   int channels) {
+  std::shared_ptr<Sink> sink;
+  {
+    // オーディオスレッドを待たせないように、ロックは Sink を探す間だけにする
+    std::lock_guard<std::mutex> guard(sinks_mutex_);
+    auto it = sinks_by_id_.find(track_id);
+    if (it != sinks_by_id_.end()) {
+      sink = it->second;
+    }
+  }
+  if (sink == nullptr) {
+    std::fill(dst, dst + frames * channels, 0.0f);
+    return;
+  }
+  sink->Pull(dst, frames, channels);
+}
+
+}  // namespace sora
@@ -0,0 +1,78 @@
+#ifndef SORA_UNITY_AUDIO_TRACK_RECEIVER_H_INCLUDED
+#define SORA_UNITY_AUDIO_TRACK_RECEIVER_H_INCLUDED
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// webrtc
+#include "api/media_stream_interface.h"
+#include "common_audio/resampler/include/push_resampler.h"
+
+// sora
+#include "audio_playout_buffer.h"
+#include "id_pointer.h"
+#include "memory_stats.h"
+#include "rtc/audio_track_receiver.h"
+
+namespace sora {
+
+// 受信した音声をミックスせずに、トラックごとに Unity の AudioSource から取り出すためのクラス。
+// Unity 側で空間化などを行いたい場合に使う。
+class UnityAudioTrackReceiver : public AudioTrackReceiver {
+ public:
+  class Sink : public webrtc::AudioTrackSinkInterface {
+    webrtc::AudioTrackInterface* track_;
+    ptrid_t ptrid_;
+    const int sample_rate_;
+    // 以下は OnData を呼ぶ WebRTC のオーディオスレッドからしか触らない
+    webrtc::PushResampler<int16_t> resampler_;
+    std::vector<int16_t> stereo_;
+    std::vector<int16_t> resampled_;
+    AudioPlayoutBuffer buffer_;
+    TrackedMemory memory_{MemoryCategory::kAudioBuffers};
+
+   public:
+    // 受信した音声を sample_rate に変換して溜めておく
+    Sink(webrtc::AudioTrackInterface* track, int sample_rate);
+    ~Sink();
+    ptrid_t GetSinkID() const;
+    // Unity のオーディオスレッドから呼ぶ
+    void Pull(float* dst, int frames, int channels);
+
+   private:
+    void OnData(const void* audio_data,
+                int bits_per_sample,
+                int sample_rate,
+                size_t number_of_channels,
+                size_t number_of_frames) override;
+  };
+
+ private:
+  const int sample_rate_;
+  std::mutex sinks_mutex_;
+  // Pull の途中で RemoveTrack されても大丈夫なように shared_ptr で持つ
+  std::map<webrtc::AudioTrackInterface*, std::shared_ptr<Sink>> sinks_;
+  std::map<ptrid_t, std::shared_ptr<Sink>> sinks_by_id_;
+  std::function<void(ptrid_t)> on_add_track_;
+  std::function<void(ptrid_t)> on_remove_track_;
+
+ public:
+  // sample_rate は Unity の AudioSettings.outputSampleRate
+  UnityAudioTrackReceiver(int sample_rate,
+                          std::function<void(ptrid_t)> on_add_track,
+                          std::function<void(ptrid_t)> on_remove_track);
+
+  void AddTrack(webrtc::AudioTrackInterface* track) override;
+  void RemoveTrack(webrtc::AudioTrackInterface* track) override;
+
+  // track_id のトラックの音声を frames フレーム分、channels チャンネルの float で dst に書き込む。
+  // Unity のオーディオスレッドから呼ぶ。トラックが無い場合や足りない分は無音にする。
+  void Pull(ptrid_t track_id, float* dst, int frames, int channels);
+};
+
+}  // namespace sora
+
+#endif  // SORA_UNITY_AUDIO_TRACK_RECEIVER_H_INCLUDED
@@ -1,15 +1,22 @@
 #include "unity_camera_capturer.h"
 
+#include <algorithm>
+
+#include "perf_counters.h"
+
 namespace sora {
 
 rtc::scoped_refptr<UnityCameraCapturer> UnityCameraCapturer::Create(
     UnityContext* context,
     void* unity_camera_texture,
     int width,
-    int height) {
+    int height,
+    int readback_latency,
+    bool native_texture) {
   rtc::scoped_refptr<UnityCameraCapturer> p(
       new rtc::RefCountedObject<UnityCameraCapturer>());
-  if (!p->Init(context, unity_camera_texture, width, height)) {
+  if (!p->Init(context, unity_camera_texture, width, height, readback_latency,
+               native_texture)) {
     return nullptr;
   }
   return p;
@@ -17,19 +24,133 @@ rtc::scoped_refptr<UnityCameraCapturer> UnityCameraCapturer::Create(
 
 void UnityCameraCapturer::OnRender() {
 #if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_MACOS) || \
-    defined(SORA_UNITY_SDK_IOS) || defined(SORA_UNITY_SDK_ANDROID)
-  auto i420_buffer = capturer_->Capture();
+    defined(SORA_UNITY_SDK_IOS) || defined(SORA_UNITY_SDK_ANDROID) ||   \
+    defined(SORA_UNITY_SDK_UBUNTU)
+  // GPU でコピーする前に、このフレームを使うかどうかと解像度を決める。
+  // 使わない場合でも、前にコピーしたフレームの読み出しは進める。
+  // 縮小が必要な場合は GPU で縮小してから読み出す。
+  ScopedPerfTimer render_timer(PerfStage::kCameraRender);
+  render_time_us_ = clock_->TimeInMicroseconds();
+  int adapted_width = width_;
+  int adapted_height = height_;
+  bool copy;
+  if (capture_interval_us_ > 0 && !AdvanceCaptureCadence()) {
+    // 刻みに当たらないフレームは、変更があっても次の刻みまで持ち越す
+    copy = false;
+  } else if (static_content_) {
+    // 変わっていないフレームは AdaptCapturedFrame にも渡さずに、コピーの前に捨てる
+    bool dirty = content_dirty_.exchange(false);
+    bool refresh = render_time_us_ - last_static_capture_us_ >=
+                   static_refresh_interval_us_;
+    copy = (dirty || refresh) &&
+           AdaptCapturedFrame(width_, height_, render_time_us_,
+                              &adapted_width, &adapted_height);
+    if (copy) {
+      last_static_capture_us_ = render_time_us_;
+    } else if (dirty) {
+      // フレームレートの制限などで送らなかった場合は、変更を次のフレームに持ち越す
+      content_dirty_.store(true);
+    }
+  } else {
+    copy = AdaptCapturedFrame(width_, height_, render_time_us_,
+                              &adapted_width, &adapted_height);
+  }
+  if (copy) {
+    adapted_width_.store(adapted_width);
+    adapted_height_.store(adapted_height);
+  }
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  if (capturer_->use_native_texture()) {
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+    {
+      ScopedPerfTimer timer(PerfStage::kCameraCapture);
+      buffer = capturer_->CaptureNative(copy, adapted_width, adapted_height);
+    }
+    if (buffer) {
+      OnCaptured(buffer, capturer_->last_timestamp_us());
+    }
+    return;
+  }
+#endif
+#if defined(SORA_UNITY_SDK_ANDROID)
+  if (capturer_->use_native_texture()) {
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+    {
+      ScopedPerfTimer timer(PerfStage::kCameraCapture);
+      buffer = capturer_->CaptureNative(copy);
+    }
+    if (buffer) {
+      OnCaptured(buffer, capturer_->last_timestamp_us());
+    }
+    return;
+  }
+#endif
+  rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer;
+  {
+    ScopedPerfTimer timer(PerfStage::kCameraCapture);
+    i420_buffer = capturer_->Capture(copy, adapted_width, adapted_height);
+  }
   if (!i420_buffer) {
     return;
   }
+  OnCaptured(i420_buffer, capturer_->last_timestamp_us());
+#endif
+}
+
+void UnityCameraCapturer::SetStaticContent(bool enabled,
+                                           int refresh_interval_ms) {
+  static_content_ = enabled;
+  static_refresh_interval_us_ =
+      (int64_t)std::max(refresh_interval_ms, 0) * 1000;
+  content_dirty_.store(true);
+}
+
+void UnityCameraCapturer::MarkContentDirty() {
+  content_dirty_.store(true);
+}
+
+void UnityCameraCapturer::SetCaptureFps(int fps) {
+  capture_interval_us_ = fps > 0 ? 1000000 / fps : 0;
+  next_capture_us_ = 0;
+}
+
+bool UnityCameraCapturer::AdvanceCaptureCadence() {
+  if (render_time_us_ < next_capture_us_) {
+    return false;
+  }
+  int64_t capture_us = next_capture_us_;
+  if (capture_us == 0 || render_time_us_ - capture_us >= capture_interval_us_) {
+    // 最初のフレームか、ヒッチで 1 刻み以上遅れた場合は今の時刻から刻み直す
+    capture_us = render_time_us_;
+  }
+  next_capture_us_ = capture_us + capture_interval_us_;
+  render_time_us_ = capture_us;
+  return true;
+}
 
+void UnityCameraCapturer::OnCaptured(
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer,
+    int64_t timestamp_us) {
   auto video_frame = webrtc::VideoFrame::Builder()
-                         .set_video_frame_buffer(i420_buffer)
+                         .set_video_frame_buffer(buffer)
                          .set_rotation(webrtc::kVideoRotation_0)
-                         .set_timestamp_us(clock_->TimeInMicroseconds())
+                         .set_timestamp_us(timestamp_us)
                          .build();
-  this->OnFrame(video_frame);
-#endif
+  // 使うかどうかは OnRender で決めてあるので、AdaptFrame は呼ばない
+  OnAdaptedFrame(video_frame, adapted_width_.load(), adapted_height_.load());
+}
+
+rtc::scoped_refptr<webrtc::I420Buffer> UnityCameraCapturer::CreateI420Buffer(
+    int width,
+    int height) {
+  std::lock_guard<std::mutex> guard(buffer_pool_mutex_);
+  auto buffer = buffer_pool_.CreateI420Buffer(width, height);
+  if (!buffer) {
+    // エンコーダ側で詰まっていてバッファが全て使用中
+    RTC_LOG(LS_WARNING) << "I420 buffer pool is exhausted";
+  }
+  return buffer;
 }
 
 void UnityCameraCapturer::OnFrame(const webrtc::VideoFrame& frame) {
@@ -39,24 +160,39 @@ void UnityCameraCapturer::OnFrame(const webrtc::VideoFrame& frame) {
 bool UnityCameraCapturer::Init(UnityContext* context,
                                void* unity_camera_texture,
                                int width,
-                               int height) {
+                               int height,
+                               int readback_latency,
+                               bool native_texture) {
+  width_ = width;
+  height_ = height;
+  adapted_width_.store(width);
+  adapted_height_.store(height);
+
 #ifdef SORA_UNITY_SDK_WINDOWS
   capturer_.reset(new D3D11Impl());
-  if (!capturer_->Init(context, unity_camera_texture, width, height)) {
+  if (!capturer_->Init(this, context, unity_camera_texture, width, height,
+                       readback_latency, native_texture)) {
     return false;
   }
 #endif
 
 #if defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
   capturer_.reset(new MetalImpl());
-  if (!capturer_->Init(context, unity_camera_texture, width, height)) {
+  if (!capturer_->Init(
+          this, context, unity_camera_texture, width, height, native_texture,
+          [this](rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer,
+                 int64_t timestamp_us) {
+            // ここは Metal のコマンドバッファの完了ハンドラから呼ばれる
+            OnCaptured(buffer, timestamp_us);
+          })) {
     return false;
   }
 #endif
 
-#ifdef SORA_UNITY_SDK_ANDROID
+#if defined(SORA_UNITY_SDK_ANDROID) || defined(SORA_UNITY_SDK_UBUNTU)
   capturer_.reset(new VulkanImpl());
-  if (!capturer_->Init(context, unity_camera_texture, width, height)) {
+  if (!capturer_->Init(this, context, unity_camera_texture, width, height,
+                       native_texture)) {
     return false;
   }
 #endif
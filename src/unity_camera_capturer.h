@@ -1,21 +1,41 @@
 #ifndef SORA_UNITY_CAMERA_CAPTURER_H_INCLUDED
 #define SORA_UNITY_CAMERA_CAPTURER_H_INCLUDED
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 // WebRTC
 #include "api/media_stream_interface.h"
 #include "api/scoped_refptr.h"
 #include "api/video/i420_buffer.h"
+#include "common_video/include/video_frame_buffer_pool.h"
 #include "libyuv.h"
 #include "rtc_base/logging.h"
 #include "rtc_base/ref_counted_object.h"
 #include "system_wrappers/include/clock.h"
 
 // sora
+#include "memory_stats.h"
 #include "rtc/scalable_track_source.h"
 #include "unity_context.h"
 
+#ifdef SORA_UNITY_SDK_WINDOWS
+#include "rtc/d3d11_texture_buffer.h"
+#endif
+
+#if defined(SORA_UNITY_SDK_ANDROID) || defined(SORA_UNITY_SDK_UBUNTU)
 #ifdef SORA_UNITY_SDK_ANDROID
+#define VK_USE_PLATFORM_ANDROID_KHR
+#endif
 #include <vulkan/vulkan.h>
+
+#ifdef SORA_UNITY_SDK_ANDROID
+#include "android_helper/ahardware_buffer_texture.h"
+#endif
+#include "unity/IUnityGraphicsVulkan.h"
 #endif
 
 namespace sora {
@@ -26,77 +46,323 @@ class UnityCameraCapturer : public sora::ScalableVideoTrackSource,
 
 #ifdef SORA_UNITY_SDK_WINDOWS
   class D3D11Impl {
+    UnityCameraCapturer* owner_;
     UnityContext* context_;
     void* camera_texture_;
-    void* frame_texture_;
+    // GPU の処理を待たずに済むように、readback_latency_ フレーム前にコピーした
+    // テクスチャを読み出す。readback_latency_ + 1 個のテクスチャを順番に使う。
+    struct Frame {
+      ID3D11Texture2D* texture = nullptr;
+      ID3D11Query* query = nullptr;
+      bool pending = false;
+      // GPU で縮小した場合はカメラテクスチャより小さくなる
+      int width = 0;
+      int height = 0;
+      // コピーした時の render_time_us_
+      int64_t timestamp_us = 0;
+    };
+    std::vector<Frame> frames_;
+    int write_index_ = 0;
+    int readback_latency_;
     int width_;
     int height_;
 
+    // コンピュートシェーダで縮小と BGRA -> I420 の変換と上下反転をしてから読み出す。
+    // Y プレーンの下に U プレーンと V プレーンを横に並べた R8 テクスチャに書き込む。
+    // 使えない環境では CPU で反転と変換と縮小を行う。
+    bool use_gpu_convert_ = false;
+    ID3D11ComputeShader* convert_shader_ = nullptr;
+    ID3D11ShaderResourceView* camera_srv_ = nullptr;
+    ID3D11SamplerState* convert_sampler_ = nullptr;
+    ID3D11Texture2D* convert_texture_ = nullptr;
+    ID3D11UnorderedAccessView* convert_uav_ = nullptr;
+    ID3D11Buffer* convert_params_ = nullptr;
+    int params_width_ = 0;
+    int params_height_ = 0;
+
+    // use_native_texture_ の場合は CPU に読み出さず、上下反転したカメラ映像を
+    // 共有テクスチャに書き込んで D3D11TextureBuffer のままエンコーダに渡す。
+    // エンコーダが使っている間のテクスチャは書き換えないように、複数のテクスチャを順番に使う。
+    struct NativeFrame {
+      rtc::scoped_refptr<rtc::RefCountedObject<D3D11TextureBuffer>> buffer;
+      ID3D11UnorderedAccessView* uav = nullptr;
+      IDXGIKeyedMutex* keyed_mutex = nullptr;
+    };
+    static const int kNativeFrameCount = 3;
+    bool use_native_texture_ = false;
+    ID3D11ComputeShader* flip_shader_ = nullptr;
+    NativeFrame native_frames_[kNativeFrameCount];
+    int native_index_ = 0;
+    int64_t last_timestamp_us_ = 0;
+
    public:
-    bool Init(UnityContext* context,
+    ~D3D11Impl();
+    // native_texture が true の場合、可能であれば CaptureNative を使う
+    bool Init(UnityCameraCapturer* owner,
+              UnityContext* context,
               void* camera_texture,
               int width,
-              int height);
-    rtc::scoped_refptr<webrtc::I420Buffer> Capture();
+              int height,
+              int readback_latency,
+              bool native_texture);
+    // copy が false の場合はカメラテクスチャをコピーせず、コピー済みのものだけ読み出す。
+    // width, height はコピーする時の解像度で、カメラテクスチャより小さければ GPU で縮小する。
+    rtc::scoped_refptr<webrtc::I420Buffer> Capture(bool copy,
+                                                   int width,
+                                                   int height);
+    bool use_native_texture() const { return use_native_texture_; }
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> CaptureNative(bool copy,
+                                                               int width,
+                                                               int height);
+    // 最後に Capture, CaptureNative が返したフレームをコピーした時の時刻
+    int64_t last_timestamp_us() const { return last_timestamp_us_; }
+
+   private:
+    bool InitGpuConvert(ID3D11Device* device);
+    bool InitNativeTexture(ID3D11Device* device);
+    bool UpdateParams(ID3D11DeviceContext* dc, int width, int height);
+    void Dispatch(ID3D11DeviceContext* dc,
+                  ID3D11ComputeShader* shader,
+                  ID3D11UnorderedAccessView* uav,
+                  int thread_x,
+                  int thread_y);
+    rtc::scoped_refptr<webrtc::I420Buffer> ReadFrame(
+        ID3D11DeviceContext* dc,
+        Frame& frame,
+        bool wait);
   };
   std::unique_ptr<D3D11Impl> capturer_;
 #endif
 
 #if defined(SORA_UNITY_SDK_MACOS) || defined(SORA_UNITY_SDK_IOS)
   class MetalImpl {
+    UnityCameraCapturer* owner_;
     UnityContext* context_;
     void* camera_texture_;
-    void* frame_texture_;
     int width_;
     int height_;
+    // Unity のコマンドバッファでカメラテクスチャを shared storage の MTLBuffer にコピーし、
+    // コマンドバッファの完了ハンドラで I420 に変換して、コピーした時の時刻と一緒に
+    // on_frame_ に渡す。
+    // 全ての MTLBuffer が使用中の場合はそのフレームを捨てる。
+    struct Frame {
+      void* buffer = nullptr;
+      std::atomic<bool> busy{false};
+    };
+    static const int kFrameCount = 3;
+    Frame frames_[kFrameCount];
+    int write_index_ = 0;
+    int bytes_per_row_;
+    std::atomic<int> in_flight_{0};
+    std::function<void(rtc::scoped_refptr<webrtc::VideoFrameBuffer>, int64_t)>
+        on_frame_;
+
+    // use_pixel_buffer_ の場合は CPU に読み出さず、コンピュートシェーダで上下反転と
+    // NV12 への変換をしながら CVPixelBufferPool の IOSurface に書き込み、
+    // RTCCVPixelBuffer のまま VideoToolbox に渡す。
+    bool use_pixel_buffer_ = false;
+    void* pixel_buffer_pool_ = nullptr;  // CVPixelBufferPoolRef
+    int pool_width_ = 0;
+    int pool_height_ = 0;
+    void* texture_cache_ = nullptr;      // CVMetalTextureCacheRef
+    void* convert_pipeline_ = nullptr;   // id<MTLComputePipelineState>
+    void* camera_view_ = nullptr;        // id<MTLTexture>
+
+    // 縮小する場合は、コンピュートシェーダで縮小しながらバッファに書き込む
+    bool use_gpu_scale_ = false;
+    void* scale_pipeline_ = nullptr;  // id<MTLComputePipelineState>
 
    public:
-    bool Init(UnityContext* context,
+    ~MetalImpl();
+    // native_texture が true の場合、可能であれば CVPixelBuffer を使う
+    bool Init(UnityCameraCapturer* owner,
+              UnityContext* context,
               void* camera_texture,
               int width,
-              int height);
-    rtc::scoped_refptr<webrtc::I420Buffer> Capture();
+              int height,
+              bool native_texture,
+              std::function<void(rtc::scoped_refptr<webrtc::VideoFrameBuffer>, int64_t)>
+                  on_frame);
+    // 読み出しは非同期で行うので、常に nullptr を返す。
+    // copy が false の場合は何もしない。
+    // width, height はコピーする時の解像度で、カメラテクスチャより小さければ GPU で縮小する。
+    rtc::scoped_refptr<webrtc::I420Buffer> Capture(bool copy,
+                                                   int width,
+                                                   int height);
+    // 時刻は on_frame_ に渡すので、他の実装とインターフェースを合わせるためだけにある
+    int64_t last_timestamp_us() const { return 0; }
+
+   private:
+    bool InitShader();
+    bool InitPixelBuffer();
+    bool UpdatePixelBufferPool(int width, int height);
+    void CapturePixelBuffer(int width, int height);
   };
   std::unique_ptr<MetalImpl> capturer_;
 #endif
 
-#ifdef SORA_UNITY_SDK_ANDROID
+#if defined(SORA_UNITY_SDK_ANDROID) || defined(SORA_UNITY_SDK_UBUNTU)
+  // Android と Linux の Vulkan。テクスチャのまま渡せるのは Android だけ
   class VulkanImpl {
+    UnityCameraCapturer* owner_;
     UnityContext* context_;
     void* camera_texture_;
-    VkImage image_ = VK_NULL_HANDLE;
-    VkDeviceMemory memory_ = VK_NULL_HANDLE;
-    VkCommandPool pool_ = VK_NULL_HANDLE;
+    // Unity が記録中のコマンドバッファにカメラテクスチャからバッファへのコピーを積み、
+    // Unity の safeFrameNumber がそのフレームに追いついてから読み出す。
+    // キューを待たないので GPU と CPU が直列にならない。
+    struct Frame {
+      VkBuffer buffer = VK_NULL_HANDLE;
+      VkDeviceMemory memory = VK_NULL_HANDLE;
+      uint8_t* mapped = nullptr;
+      bool pending = false;
+      unsigned long long frame_number = 0;
+      int width = 0;
+      int height = 0;
+      int64_t timestamp_us = 0;
+    };
+    static const int kFrameCount = 4;
+    Frame frames_[kFrameCount];
+    int write_index_ = 0;
+    bool host_coherent_ = false;
     int width_;
     int height_;
 
+    // 縮小する場合は、一旦この画像に vkCmdBlitImage で縮小してからバッファにコピーする
+    VkImage scale_image_ = VK_NULL_HANDLE;
+    VkDeviceMemory scale_memory_ = VK_NULL_HANDLE;
+    VkFormat scale_format_ = VK_FORMAT_UNDEFINED;
+    bool scale_failed_ = false;
+
+    bool use_native_texture_ = false;
+#ifdef SORA_UNITY_SDK_ANDROID
+    // エンコーダにテクスチャのまま渡す場合は、AHardwareBuffer を import した
+    // VkImage にコピーして、同じ AHardwareBuffer を GL のテクスチャとして渡す。
+    struct NativeFrame {
+      AHardwareBuffer* hardware_buffer = nullptr;
+      VkImage image = VK_NULL_HANDLE;
+      VkDeviceMemory memory = VK_NULL_HANDLE;
+      std::unique_ptr<AHardwareBufferTexture> texture;
+      bool pending = false;
+      unsigned long long frame_number = 0;
+      int64_t timestamp_us = 0;
+    };
+    static const int kNativeFrameCount = 4;
+    NativeFrame native_frames_[kNativeFrameCount];
+    int native_index_ = 0;
+#endif
+    int64_t last_timestamp_us_ = 0;
+
    public:
     ~VulkanImpl();
-    bool Init(UnityContext* context,
+    bool Init(UnityCameraCapturer* owner,
+              UnityContext* context,
               void* camera_texture,
               int width,
-              int height);
-    rtc::scoped_refptr<webrtc::I420Buffer> Capture();
+              int height,
+              bool native_texture);
+    // copy が false の場合はカメラテクスチャをコピーせず、コピー済みのものだけ読み出す。
+    // width, height はコピーする時の解像度で、カメラテクスチャより小さければ GPU で縮小する。
+    rtc::scoped_refptr<webrtc::I420Buffer> Capture(bool copy,
+                                                   int width,
+                                                   int height);
+    bool use_native_texture() const { return use_native_texture_; }
+#ifdef SORA_UNITY_SDK_ANDROID
+    // AHardwareBuffer のサイズは固定なので、こちらは縮小しない
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> CaptureNative(bool copy);
+#endif
+    // 最後に Capture, CaptureNative が返したフレームをコピーした時の時刻
+    int64_t last_timestamp_us() const { return last_timestamp_us_; }
+
+   private:
+    rtc::scoped_refptr<webrtc::I420Buffer> ReadFrame(VkDevice device,
+                                                     Frame& frame);
+    bool InitScaleImage(const UnityVulkanInstance& instance, VkFormat format);
+    void BlitToScaleImage(VkCommandBuffer command_buffer,
+                          VkImage camera_image,
+                          int width,
+                          int height);
+#ifdef SORA_UNITY_SDK_ANDROID
+    bool InitNativeTexture(const UnityVulkanInstance& instance);
+    void DestroyNativeTexture(VkDevice device);
+#endif
   };
   std::unique_ptr<VulkanImpl> capturer_;
 #endif
 
  public:
+  // readback_latency は GPU からの読み出しを何フレーム遅らせるか。
+  // 0 の場合はその場で GPU の処理が終わるのを待つ。
+  // native_texture が true の場合、CPU に読み出さずにテクスチャのまま渡す。
+  // テクスチャのまま渡せない環境では今まで通り CPU に読み出す。
   static rtc::scoped_refptr<UnityCameraCapturer> Create(
       UnityContext* context,
       void* unity_camera_texture,
       int width,
-      int height);
+      int height,
+      int readback_latency,
+      bool native_texture);
 
   void OnRender();
 
+  // 静止していることが多い映像（メニューや一時停止中の画面など）向けのモード。
+  // 有効な場合は MarkContentDirty() が呼ばれたフレームだけ GPU からコピーして送信し、
+  // それ以外は refresh_interval_ms ごとに 1 回だけ送る
+  void SetStaticContent(bool enabled, int refresh_interval_ms);
+  // 映像が変わったことを知らせる。どのスレッドから呼んでもいい
+  void MarkContentDirty();
+  // Unity の描画のフレームレートに関係なく、fps の刻みに当たるフレームだけ GPU からコピーする。
+  // 送信するフレームには刻みの時刻を付けるので、描画の間隔がばらついても等間隔になる。
+  // 0 の場合は OnRender の度にコピーする
+  void SetCaptureFps(int fps);
+
   void OnFrame(const webrtc::VideoFrame& frame) override;
 
  private:
+  // 今の OnRender が SetCaptureFps の刻みに当たっていれば、render_time_us_ を
+  // 刻みの時刻にして true を返す
+  bool AdvanceCaptureCadence();
+  // timestamp_us はそのフレームをコピーした OnRender の時刻
+  void OnCaptured(rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer,
+                  int64_t timestamp_us);
+  // 毎フレーム確保しないように、プールから I420 バッファを取り出す。
+  // Metal の完了ハンドラなど別スレッドからも呼ばれるのでロックする。
+  rtc::scoped_refptr<webrtc::I420Buffer> CreateI420Buffer(int width,
+                                                          int height);
+
+  std::mutex buffer_pool_mutex_;
+  webrtc::VideoFrameBufferPool buffer_pool_{false, 8};
+  // 各実装が Init で確保した読み出し用のバッファやテクスチャのバイト数
+  TrackedMemory staging_memory_{MemoryCategory::kCapturerStaging};
+
+  int width_ = 0;
+  int height_ = 0;
+  // 最後に AdaptCapturedFrame で決まった解像度。
+  // 読み出しが遅れて届くフレームにも使う。Metal では別スレッドから読む。
+  std::atomic<int> adapted_width_{0};
+  std::atomic<int> adapted_height_{0};
+  // OnRender が呼ばれた時刻。読み出しが何フレームか遅れても、
+  // 送信するフレームにはカメラテクスチャをコピーした時の時刻を付ける。
+  // abs-capture-time が有効ならこの時刻が受信側に伝わる。
+  int64_t render_time_us_ = 0;
+
+  // SetStaticContent の設定。レンダリングスレッドから読むので、Prepare の間に設定すること
+  bool static_content_ = false;
+  int64_t static_refresh_interval_us_ = 0;
+  int64_t last_static_capture_us_ = 0;
+  // 最初のフレームは必ず送る
+  std::atomic<bool> content_dirty_{true};
+
+  // SetCaptureFps の設定。レンダリングスレッドから読むので、Prepare の間に設定すること
+  int64_t capture_interval_us_ = 0;
+  // 次にコピーする刻みの時刻
+  int64_t next_capture_us_ = 0;
+
   bool Init(UnityContext* context,
             void* unity_camera_texture,
             int width,
-            int height);
+            int height,
+            int readback_latency,
+            bool native_texture);
 };
 
 }  // namespace sora
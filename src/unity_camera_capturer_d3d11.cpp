@@ -1,46 +1,435 @@
 #include "unity_camera_capturer.h"
 
+#include <algorithm>
+
+#include <d3dcompiler.h>
+
 namespace sora {
 
-bool UnityCameraCapturer::D3D11Impl::Init(UnityContext* context,
+// BGRA のカメラテクスチャを上下反転しながら width x height に縮小して I420 に変換するシェーダ。
+// 1 スレッドで 2x2 ピクセルを処理し、Y を４つと U, V を１つずつ書き込む。
+// 係数は libyuv の ARGBToI420 と同じ BT.601 (limited range)。
+static const char kConvertShader[] = R"(
+Texture2D<float4> src : register(t0);
+SamplerState samp : register(s0);
+RWTexture2D<unorm float> dst : register(u0);
+cbuffer Params : register(b0) {
+  uint width;
+  uint height;
+  uint chroma_width;
+  uint chroma_height;
+};
+
+float ToY(float3 c) {
+  return 0.257 * c.r + 0.504 * c.g + 0.098 * c.b + 16.0 / 255.0;
+}
+
+// 縮小しない場合はテクセルの中心を読むので、Load と同じ値になる
+float3 Sample(uint x, uint y) {
+  float2 uv = float2((x + 0.5) / width, 1.0 - (y + 0.5) / height);
+  return src.SampleLevel(samp, uv, 0).rgb;
+}
+
+[numthreads(8, 8, 1)]
+void main(uint3 id : SV_DispatchThreadID) {
+  if (id.x >= chroma_width || id.y >= chroma_height) {
+    return;
+  }
+  float3 sum = float3(0, 0, 0);
+  for (uint dy = 0; dy < 2; dy++) {
+    for (uint dx = 0; dx < 2; dx++) {
+      uint x = min(id.x * 2 + dx, width - 1);
+      uint y = min(id.y * 2 + dy, height - 1);
+      float3 c = Sample(x, y);
+      dst[uint2(x, y)] = ToY(c);
+      sum += c;
+    }
+  }
+  float3 c = sum / 4.0;
+  float u = -0.148 * c.r - 0.291 * c.g + 0.439 * c.b + 128.0 / 255.0;
+  float v = 0.439 * c.r - 0.368 * c.g - 0.071 * c.b + 128.0 / 255.0;
+  dst[uint2(id.x, height + id.y)] = u;
+  dst[uint2(chroma_width + id.x, height + id.y)] = v;
+}
+)";
+
+// BGRA のカメラテクスチャを上下反転しながら width x height に縮小して
+// 共有テクスチャに書き込むシェーダ
+static const char kFlipShader[] = R"(
+Texture2D<float4> src : register(t0);
+SamplerState samp : register(s0);
+RWTexture2D<unorm float4> dst : register(u0);
+cbuffer Params : register(b0) {
+  uint width;
+  uint height;
+  uint chroma_width;
+  uint chroma_height;
+};
+
+[numthreads(8, 8, 1)]
+void main(uint3 id : SV_DispatchThreadID) {
+  if (id.x >= width || id.y >= height) {
+    return;
+  }
+  float2 uv = float2((id.x + 0.5) / width, 1.0 - (id.y + 0.5) / height);
+  dst[id.xy] = src.SampleLevel(samp, uv, 0);
+}
+)";
+
+static ID3D11ComputeShader* CompileComputeShader(ID3D11Device* device,
+                                                 const char* source,
+                                                 size_t size) {
+  ID3DBlob* blob = nullptr;
+  ID3DBlob* error = nullptr;
+  HRESULT hr = D3DCompile(source, size, nullptr, nullptr, nullptr, "main",
+                          "cs_5_0", D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &blob,
+                          &error);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_WARNING) << "D3DCompile is failed: hr=" << hr << " error="
+                        << (error != nullptr
+                                ? (const char*)error->GetBufferPointer()
+                                : "");
+    if (error != nullptr) {
+      error->Release();
+    }
+    return nullptr;
+  }
+  ID3D11ComputeShader* shader = nullptr;
+  hr = device->CreateComputeShader(blob->GetBufferPointer(),
+                                   blob->GetBufferSize(), nullptr, &shader);
+  blob->Release();
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_WARNING) << "ID3D11Device::CreateComputeShader is failed: hr="
+                        << hr;
+    return nullptr;
+  }
+  return shader;
+}
+
+static DXGI_FORMAT ToUnormFormat(DXGI_FORMAT format) {
+  switch (format) {
+    case DXGI_FORMAT_B8G8R8A8_TYPELESS:
+    case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+      return DXGI_FORMAT_B8G8R8A8_UNORM;
+    case DXGI_FORMAT_R8G8B8A8_TYPELESS:
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+      return DXGI_FORMAT_R8G8B8A8_UNORM;
+    default:
+      return format;
+  }
+}
+
+UnityCameraCapturer::D3D11Impl::~D3D11Impl() {
+  for (auto& frame : native_frames_) {
+    if (frame.keyed_mutex != nullptr) {
+      frame.keyed_mutex->Release();
+    }
+    if (frame.uav != nullptr) {
+      frame.uav->Release();
+    }
+  }
+  if (flip_shader_ != nullptr) {
+    flip_shader_->Release();
+  }
+  for (auto& frame : frames_) {
+    if (frame.query != nullptr) {
+      frame.query->Release();
+    }
+    if (frame.texture != nullptr) {
+      frame.texture->Release();
+    }
+  }
+  if (convert_params_ != nullptr) {
+    convert_params_->Release();
+  }
+  if (convert_sampler_ != nullptr) {
+    convert_sampler_->Release();
+  }
+  if (convert_uav_ != nullptr) {
+    convert_uav_->Release();
+  }
+  if (convert_texture_ != nullptr) {
+    convert_texture_->Release();
+  }
+  if (camera_srv_ != nullptr) {
+    camera_srv_->Release();
+  }
+  if (convert_shader_ != nullptr) {
+    convert_shader_->Release();
+  }
+}
+
+bool UnityCameraCapturer::D3D11Impl::InitGpuConvert(ID3D11Device* device) {
+  convert_shader_ =
+      CompileComputeShader(device, kConvertShader, sizeof(kConvertShader) - 1);
+  if (convert_shader_ == nullptr) {
+    return false;
+  }
+
+  // sRGB のテクスチャだと勝手にリニアに変換されてしまうので、UNORM として読む
+  D3D11_TEXTURE2D_DESC camera_desc;
+  ((ID3D11Texture2D*)camera_texture_)->GetDesc(&camera_desc);
+  D3D11_SHADER_RESOURCE_VIEW_DESC srv_desc = {};
+  srv_desc.Format = ToUnormFormat(camera_desc.Format);
+  srv_desc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+  srv_desc.Texture2D.MipLevels = 1;
+  HRESULT hr = device->CreateShaderResourceView(
+      (ID3D11Resource*)camera_texture_, &srv_desc, &camera_srv_);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_WARNING)
+        << "ID3D11Device::CreateShaderResourceView is failed: hr=" << hr;
+    return false;
+  }
+
+  int chroma_width = (width_ + 1) / 2;
+  int chroma_height = (height_ + 1) / 2;
+  D3D11_TEXTURE2D_DESC desc = {0};
+  desc.Width = chroma_width * 2;
+  desc.Height = height_ + chroma_height;
+  desc.MipLevels = 1;
+  desc.ArraySize = 1;
+  desc.Format = DXGI_FORMAT_R8_UNORM;
+  desc.SampleDesc.Count = 1;
+  desc.Usage = D3D11_USAGE_DEFAULT;
+  desc.BindFlags = D3D11_BIND_UNORDERED_ACCESS;
+  hr = device->CreateTexture2D(&desc, nullptr, &convert_texture_);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_WARNING) << "ID3D11Device::CreateTexture2D is failed: hr="
+                        << hr;
+    return false;
+  }
+  hr = device->CreateUnorderedAccessView(convert_texture_, nullptr,
+                                         &convert_uav_);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_WARNING)
+        << "ID3D11Device::CreateUnorderedAccessView is failed: hr=" << hr;
+    return false;
+  }
+
+  // 縮小する解像度はフレームごとに変わるので、UpdateParams で書き換える
+  D3D11_BUFFER_DESC buffer_desc = {};
+  buffer_desc.ByteWidth = sizeof(uint32_t) * 4;
+  buffer_desc.Usage = D3D11_USAGE_DYNAMIC;
+  buffer_desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+  buffer_desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+  hr = device->CreateBuffer(&buffer_desc, nullptr, &convert_params_);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_WARNING) << "ID3D11Device::CreateBuffer is failed: hr=" << hr;
+    return false;
+  }
+
+  D3D11_SAMPLER_DESC sampler_desc = {};
+  sampler_desc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+  sampler_desc.AddressU = D3D11_TEXTURE_ADDRESS_CLAMP;
+  sampler_desc.AddressV = D3D11_TEXTURE_ADDRESS_CLAMP;
+  sampler_desc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+  sampler_desc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+  sampler_desc.MaxLOD = D3D11_FLOAT32_MAX;
+  hr = device->CreateSamplerState(&sampler_desc, &convert_sampler_);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_WARNING) << "ID3D11Device::CreateSamplerState is failed: hr="
+                        << hr;
+    return false;
+  }
+
+  return true;
+}
+
+bool UnityCameraCapturer::D3D11Impl::UpdateParams(ID3D11DeviceContext* dc,
+                                                  int width,
+                                                  int height) {
+  if (width == params_width_ && height == params_height_) {
+    return true;
+  }
+  D3D11_MAPPED_SUBRESOURCE resource;
+  HRESULT hr =
+      dc->Map(convert_params_, 0, D3D11_MAP_WRITE_DISCARD, 0, &resource);
+  if (!SUCCEEDED(hr)) {
+    RTC_LOG(LS_ERROR) << "ID3D11DeviceContext::Map is failed: hr=" << hr;
+    return false;
+  }
+  uint32_t params[4] = {(uint32_t)width, (uint32_t)height,
+                        (uint32_t)(width + 1) / 2, (uint32_t)(height + 1) / 2};
+  memcpy(resource.pData, params, sizeof(params));
+  dc->Unmap(convert_params_, 0);
+  params_width_ = width;
+  params_height_ = height;
+  return true;
+}
+
+void UnityCameraCapturer::D3D11Impl::Dispatch(ID3D11DeviceContext* dc,
+                                              ID3D11ComputeShader* shader,
+                                              ID3D11UnorderedAccessView* uav,
+                                              int thread_x,
+                                              int thread_y) {
+  dc->CSSetShader(shader, nullptr, 0);
+  dc->CSSetShaderResources(0, 1, &camera_srv_);
+  dc->CSSetSamplers(0, 1, &convert_sampler_);
+  dc->CSSetUnorderedAccessViews(0, 1, &uav, nullptr);
+  dc->CSSetConstantBuffers(0, 1, &convert_params_);
+  dc->Dispatch((thread_x + 7) / 8, (thread_y + 7) / 8, 1);
+
+  // Unity 側の描画に影響しないようにバインドを外しておく
+  ID3D11ShaderResourceView* null_srv = nullptr;
+  ID3D11SamplerState* null_sampler = nullptr;
+  ID3D11UnorderedAccessView* null_uav = nullptr;
+  ID3D11Buffer* null_buffer = nullptr;
+  dc->CSSetShader(nullptr, nullptr, 0);
+  dc->CSSetShaderResources(0, 1, &null_srv);
+  dc->CSSetSamplers(0, 1, &null_sampler);
+  dc->CSSetUnorderedAccessViews(0, 1, &null_uav, nullptr);
+  dc->CSSetConstantBuffers(0, 1, &null_buffer);
+}
+
+bool UnityCameraCapturer::D3D11Impl::InitNativeTexture(ID3D11Device* device) {
+  // BGRA のテクスチャに UAV で書き込めるかどうかはハードウェア次第なので調べる
+  UINT support = 0;
+  D3D11_FEATURE_DATA_FORMAT_SUPPORT2 support2 = {DXGI_FORMAT_B8G8R8A8_UNORM};
+  if (!SUCCEEDED(device->CheckFormatSupport(DXGI_FORMAT_B8G8R8A8_UNORM,
+                                            &support)) ||
+      (support & D3D11_FORMAT_SUPPORT_TYPED_UNORDERED_ACCESS_VIEW) == 0 ||
+      !SUCCEEDED(device->CheckFeatureSupport(D3D11_FEATURE_FORMAT_SUPPORT2,
+                                             &support2, sizeof(support2))) ||
+      (support2.OutFormatSupport2 & D3D11_FORMAT_SUPPORT2_UAV_TYPED_STORE) ==
+          0) {
+    RTC_LOG(LS_WARNING) << "BGRA UAV typed store is not supported";
+    return false;
+  }
+
+  flip_shader_ =
+      CompileComputeShader(device, kFlipShader, sizeof(kFlipShader) - 1);
+  if (flip_shader_ == nullptr) {
+    return false;
+  }
+
+  for (auto& frame : native_frames_) {
+    D3D11_TEXTURE2D_DESC desc = {0};
+    desc.Width = width_;
+    desc.Height = height_;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_UNORDERED_ACCESS;
+    desc.MiscFlags = D3D11_RESOURCE_MISC_SHARED_KEYEDMUTEX;
+    Microsoft::WRL::ComPtr<ID3D11Texture2D> texture;
+    HRESULT hr =
+        device->CreateTexture2D(&desc, nullptr, texture.GetAddressOf());
+    if (!SUCCEEDED(hr)) {
+      RTC_LOG(LS_WARNING) << "ID3D11Device::CreateTexture2D is failed: hr="
+                          << hr;
+      return false;
+    }
+    hr = device->CreateUnorderedAccessView(texture.Get(), nullptr, &frame.uav);
+    if (!SUCCEEDED(hr)) {
+      RTC_LOG(LS_WARNING)
+          << "ID3D11Device::CreateUnorderedAccessView is failed: hr=" << hr;
+      return false;
+    }
+    hr = texture->QueryInterface(__uuidof(IDXGIKeyedMutex),
+                                 (void**)&frame.keyed_mutex);
+    if (!SUCCEEDED(hr)) {
+      RTC_LOG(LS_WARNING) << "QueryInterface(IDXGIKeyedMutex) is failed: hr="
+                          << hr;
+      return false;
+    }
+    frame.buffer = D3D11TextureBuffer::Create(texture);
+    if (!frame.buffer) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool UnityCameraCapturer::D3D11Impl::Init(UnityCameraCapturer* owner,
+                                          UnityContext* context,
                                           void* camera_texture,
                                           int width,
-                                          int height) {
+                                          int height,
+                                          int readback_latency,
+                                          bool native_texture) {
+  owner_ = owner;
   context_ = context;
   camera_texture_ = camera_texture;
   width_ = width;
   height_ = height;
+  readback_latency_ = std::max(0, readback_latency);
 
   auto device = context->GetDevice();
   if (device == nullptr) {
     return false;
   }
 
-  // ピクセルデータにアクセスする用のテクスチャを用意する
-  ID3D11Texture2D* texture = nullptr;
-  D3D11_TEXTURE2D_DESC desc = {0};
-  desc.Width = width;
-  desc.Height = height;
-  desc.MipLevels = 1;
-  desc.ArraySize = 1;
-  desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-  desc.SampleDesc.Count = 1;
-  desc.Usage = D3D11_USAGE_STAGING;
-  desc.BindFlags = 0;
-  desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-  HRESULT hr = device->CreateTexture2D(&desc, NULL, &texture);
-  if (!SUCCEEDED(hr)) {
-    RTC_LOG(LS_ERROR) << "ID3D11Device::CreateTexture2D is failed: hr=" << hr;
-    return false;
+  use_gpu_convert_ = InitGpuConvert(device);
+  RTC_LOG(LS_INFO) << "D3D11 GPU convert: " << use_gpu_convert_;
+
+  int64_t staging_bytes = 0;
+  if (use_gpu_convert_) {
+    D3D11_TEXTURE2D_DESC desc;
+    convert_texture_->GetDesc(&desc);
+    staging_bytes += (int64_t)desc.Width * desc.Height;
+  }
+
+  // ネイティブテクスチャはカメラテクスチャの SRV とパラメータを GPU 変換と共有している
+  if (native_texture && use_gpu_convert_) {
+    use_native_texture_ = InitNativeTexture(device);
+    RTC_LOG(LS_INFO) << "D3D11 native texture: " << use_native_texture_;
+    if (use_native_texture_) {
+      staging_bytes += (int64_t)width_ * height_ * 4 * kNativeFrameCount;
+      owner_->staging_memory_.Set(staging_bytes, kNativeFrameCount);
+      return true;
+    }
+  }
+
+  frames_.resize(readback_latency_ + 1);
+  for (auto& frame : frames_) {
+    // ピクセルデータにアクセスする用のテクスチャを用意する
+    D3D11_TEXTURE2D_DESC desc = {0};
+    if (use_gpu_convert_) {
+      convert_texture_->GetDesc(&desc);
+    } else {
+      desc.Width = width;
+      desc.Height = height;
+      desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    }
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    HRESULT hr = device->CreateTexture2D(&desc, NULL, &frame.texture);
+    if (!SUCCEEDED(hr)) {
+      RTC_LOG(LS_ERROR) << "ID3D11Device::CreateTexture2D is failed: hr="
+                        << hr;
+      return false;
+    }
+    staging_bytes +=
+        (int64_t)desc.Width * desc.Height * (use_gpu_convert_ ? 1 : 4);
+
+    // コピーが終わったかどうかを調べるためのクエリ
+    D3D11_QUERY_DESC query_desc = {};
+    query_desc.Query = D3D11_QUERY_EVENT;
+    hr = device->CreateQuery(&query_desc, &frame.query);
+    if (!SUCCEEDED(hr)) {
+      RTC_LOG(LS_ERROR) << "ID3D11Device::CreateQuery is failed: hr=" << hr;
+      return false;
+    }
   }
+  owner_->staging_memory_.Set(staging_bytes, frames_.size());
 
-  frame_texture_ = texture;
   return true;
 }
 
-rtc::scoped_refptr<webrtc::I420Buffer>
-UnityCameraCapturer::D3D11Impl::Capture() {
-  D3D11_MAPPED_SUBRESOURCE resource;
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+UnityCameraCapturer::D3D11Impl::CaptureNative(bool copy,
+                                              int width,
+                                              int height) {
+  // その場で書き込んで渡すので、コピーしない場合はやることが無い
+  if (!copy) {
+    return nullptr;
+  }
 
   auto dc = context_->GetDeviceContext();
   if (dc == nullptr) {
@@ -48,45 +437,161 @@ UnityCameraCapturer::D3D11Impl::Capture() {
     return nullptr;
   }
 
-  // ピクセルデータが取れない（と思う）ので、カメラテクスチャから自前のテクスチャにコピーする
-  dc->CopyResource((ID3D11Texture2D*)frame_texture_,
-                   (ID3D11Resource*)camera_texture_);
+  // エンコーダがまだ使っているテクスチャは書き換えられないので、空いているものを探す
+  NativeFrame* frame = nullptr;
+  for (int i = 0; i < kNativeFrameCount; i++) {
+    int index = (native_index_ + i) % kNativeFrameCount;
+    if (native_frames_[index].buffer->HasOneRef()) {
+      frame = &native_frames_[index];
+      native_index_ = (index + 1) % kNativeFrameCount;
+      break;
+    }
+  }
+  if (frame == nullptr) {
+    RTC_LOG(LS_VERBOSE) << "All native textures are in use";
+    return nullptr;
+  }
 
-  HRESULT hr =
-      dc->Map((ID3D11Resource*)frame_texture_, 0, D3D11_MAP_READ, 0, &resource);
+  if (!UpdateParams(dc, width, height)) {
+    return nullptr;
+  }
+  if (frame->keyed_mutex->AcquireSync(0, 0) != S_OK) {
+    RTC_LOG(LS_VERBOSE) << "Native texture is locked";
+    return nullptr;
+  }
+  // 縮小する場合はテクスチャの左上だけを使う
+  Dispatch(dc, flip_shader_, frame->uav, width, height);
+  frame->keyed_mutex->ReleaseSync(0);
+  frame->buffer->SetSize(width, height);
+
+  last_timestamp_us_ = owner_->render_time_us_;
+  return frame->buffer;
+}
+
+rtc::scoped_refptr<webrtc::I420Buffer>
+UnityCameraCapturer::D3D11Impl::Capture(bool copy, int width, int height) {
+  auto dc = context_->GetDeviceContext();
+  if (dc == nullptr) {
+    RTC_LOG(LS_ERROR) << "ID3D11DeviceContext is null";
+    return nullptr;
+  }
+
+  rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer;
+
+  if (copy && use_gpu_convert_ && !UpdateParams(dc, width, height)) {
+    copy = false;
+  }
+
+  if (copy) {
+    // これから書き込むテクスチャがまだ読み出せていない場合は、GPU を待って読み出す
+    Frame& write_frame = frames_[write_index_];
+    if (write_frame.pending) {
+      i420_buffer = ReadFrame(dc, write_frame, true);
+    }
+
+    if (use_gpu_convert_) {
+      // GPU で縮小と I420 への変換をしてから、使う部分だけ読み出し用のテクスチャにコピーする
+      int chroma_width = (width + 1) / 2;
+      int chroma_height = (height + 1) / 2;
+      Dispatch(dc, convert_shader_, convert_uav_, chroma_width, chroma_height);
+      D3D11_BOX box = {0, 0, 0, (UINT)chroma_width * 2,
+                       (UINT)(height + chroma_height), 1};
+      dc->CopySubresourceRegion(write_frame.texture, 0, 0, 0, 0,
+                                convert_texture_, 0, &box);
+      write_frame.width = width;
+      write_frame.height = height;
+    } else {
+      // ピクセルデータが取れない（と思う）ので、カメラテクスチャから自前のテクスチャにコピーする。
+      // この場合の縮小は CPU で行う。
+      dc->CopyResource(write_frame.texture, (ID3D11Resource*)camera_texture_);
+      write_frame.width = width_;
+      write_frame.height = height_;
+    }
+    dc->End(write_frame.query);
+    write_frame.pending = true;
+    write_frame.timestamp_us = owner_->render_time_us_;
+    write_index_ = (write_index_ + 1) % frames_.size();
+
+    if (i420_buffer) {
+      return i420_buffer;
+    }
+  }
+
+  // readback_latency_ フレーム前にコピーしたテクスチャを読み出す。
+  // readback_latency_ == 0 の場合は、今コピーしたテクスチャをその場で待って読み出す。
+  // コピーしなかった場合は、一番古いテクスチャが読めるようになっていれば読み出す。
+  Frame& read_frame = frames_[write_index_];
+  if (!read_frame.pending) {
+    return nullptr;
+  }
+  return ReadFrame(dc, read_frame, copy && readback_latency_ == 0);
+}
+
+rtc::scoped_refptr<webrtc::I420Buffer>
+UnityCameraCapturer::D3D11Impl::ReadFrame(ID3D11DeviceContext* dc,
+                                          Frame& frame,
+                                          bool wait) {
+  if (!wait && dc->GetData(frame.query, nullptr, 0,
+                           D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK) {
+    // まだ GPU の処理が終わっていない
+    return nullptr;
+  }
+
+  D3D11_MAPPED_SUBRESOURCE resource;
+  HRESULT hr = dc->Map(frame.texture, 0, D3D11_MAP_READ,
+                       wait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &resource);
+  if (hr == DXGI_ERROR_WAS_STILL_DRAWING) {
+    return nullptr;
+  }
+  frame.pending = false;
+  last_timestamp_us_ = frame.timestamp_us;
   if (!SUCCEEDED(hr)) {
     RTC_LOG(LS_ERROR) << "ID3D11DeviceContext::Map is failed: hr=" << hr;
     return nullptr;
   }
 
-  // Windows の場合は座標系の関係で上下反転してるので、頑張って元の向きに戻す
-  // TODO(melpon): Graphics.Blit を使って効率よく反転させる
-  // (ref: https://github.com/Unity-Technologies/com.unity.webrtc/blob/a526753e0c18d681d20f3eb9878b9c28442e2bfb/Runtime/Scripts/WebRTC.cs#L264-L268)
-  std::unique_ptr<uint8_t[]> buf(new uint8_t[width_ * height_ * 4]);
-  for (int i = 0; i < height_; i++) {
-    std::memcpy(buf.get() + width_ * 4 * i,
-                ((const uint8_t*)resource.pData) +
-                    resource.RowPitch * (height_ - i - 1),
-                width_ * 4);
+  int width = frame.width;
+  int height = frame.height;
+  if (use_gpu_convert_) {
+    // 既に I420 になっているので、プレーンごとにコピーするだけで良い
+    const uint8_t* data = (const uint8_t*)resource.pData;
+    int pitch = resource.RowPitch;
+    int chroma_width = (width + 1) / 2;
+    int chroma_height = (height + 1) / 2;
+    rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
+        owner_->CreateI420Buffer(width, height);
+    if (!i420_buffer) {
+      dc->Unmap(frame.texture, 0);
+      return nullptr;
+    }
+    libyuv::CopyPlane(data, pitch, i420_buffer->MutableDataY(),
+                      i420_buffer->StrideY(), width, height);
+    libyuv::CopyPlane(data + pitch * height, pitch,
+                      i420_buffer->MutableDataU(), i420_buffer->StrideU(),
+                      chroma_width, chroma_height);
+    libyuv::CopyPlane(data + pitch * height + chroma_width, pitch,
+                      i420_buffer->MutableDataV(), i420_buffer->StrideV(),
+                      chroma_width, chroma_height);
+    dc->Unmap(frame.texture, 0);
+    return i420_buffer;
   }
 
-  // I420 に変換して VideoFrame 作って OnFrame 呼び出し
-  //RTC_LOG(LS_INFO) << "GOT FRAME: pData=0x" << resource.pData
-  //                 << " RowPitch=" << resource.RowPitch
-  //                 << " DepthPitch=" << resource.DepthPitch;
   rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
-      webrtc::I420Buffer::Create(width_, height_);
-  //libyuv::ARGBToI420((const uint8_t*)resource.pData, resource.RowPitch,
-  //                   i420_buffer->MutableDataY(), i420_buffer->StrideY(),
-  //                   i420_buffer->MutableDataU(), i420_buffer->StrideU(),
-  //                   i420_buffer->MutableDataV(), i420_buffer->StrideV(),
-  //                   width_, height_);
-  libyuv::ARGBToI420(buf.get(), width_ * 4, i420_buffer->MutableDataY(),
-                     i420_buffer->StrideY(), i420_buffer->MutableDataU(),
-                     i420_buffer->StrideU(), i420_buffer->MutableDataV(),
-                     i420_buffer->StrideV(), width_, height_);
-
-  dc->Unmap((ID3D11Resource*)frame_texture_, 0);
+      owner_->CreateI420Buffer(width, height);
+  if (!i420_buffer) {
+    dc->Unmap(frame.texture, 0);
+    return nullptr;
+  }
+
+  // Windows の場合は座標系の関係で上下反転してるので、
+  // 高さをマイナスにして反転しながら I420 に変換する
+  libyuv::ARGBToI420((const uint8_t*)resource.pData, resource.RowPitch,
+                     i420_buffer->MutableDataY(), i420_buffer->StrideY(),
+                     i420_buffer->MutableDataU(), i420_buffer->StrideU(),
+                     i420_buffer->MutableDataV(), i420_buffer->StrideV(),
+                     width, -height);
+
+  dc->Unmap(frame.texture, 0);
 
   return i420_buffer;
 }
@@ -1,12 +1,84 @@
 #include "unity_camera_capturer.h"
 
+#include <chrono>
+#include <thread>
+
+#import <CoreVideo/CoreVideo.h>
 #import <MetalKit/MetalKit.h>
 
+#import "sdk/objc/components/video_frame_buffer/RTCCVPixelBuffer.h"
+#import "sdk/objc/native/src/objc_frame_buffer.h"
+
 // .mm ファイルからじゃないと IUnityGraphicsMetal.h を読み込めないので、ここで import する
 #import "unity/IUnityGraphicsMetal.h"
 
 namespace sora {
 
+// convert: BGRA のカメラテクスチャを上下反転しながら width x height に縮小して NV12 に変換する。
+// 1 スレッドで 2x2 ピクセルを処理し、Y を４つと UV を１つ書き込む。
+// 係数は libyuv の ARGBToI420 と同じ BT.601 (limited range)。
+// scale: カメラテクスチャを width x height に縮小して、libyuv の ARGB の並びでバッファに書き込む。
+// 縮小しない場合はテクセルの中心を読むので、どちらも read と同じ値になる。
+static const char kConvertShader[] = R"(
+#include <metal_stdlib>
+using namespace metal;
+
+struct Params {
+  uint width;
+  uint height;
+  uint chroma_width;
+  uint chroma_height;
+};
+
+constexpr sampler kSampler(coord::normalized, address::clamp_to_edge,
+                           filter::linear);
+
+static float ToY(float3 c) {
+  return 0.257 * c.r + 0.504 * c.g + 0.098 * c.b + 16.0 / 255.0;
+}
+
+kernel void convert(texture2d<float, access::sample> src [[texture(0)]],
+                    texture2d<float, access::write> dst_y [[texture(1)]],
+                    texture2d<float, access::write> dst_uv [[texture(2)]],
+                    constant Params& p [[buffer(0)]],
+                    uint2 id [[thread_position_in_grid]]) {
+  if (id.x >= p.chroma_width || id.y >= p.chroma_height) {
+    return;
+  }
+  float3 sum = float3(0, 0, 0);
+  for (uint dy = 0; dy < 2; dy++) {
+    for (uint dx = 0; dx < 2; dx++) {
+      uint x = min(id.x * 2 + dx, p.width - 1);
+      uint y = min(id.y * 2 + dy, p.height - 1);
+      float2 uv = float2((x + 0.5) / p.width, 1.0 - (y + 0.5) / p.height);
+      float3 c = src.sample(kSampler, uv).rgb;
+      dst_y.write(float4(ToY(c)), uint2(x, y));
+      sum += c;
+    }
+  }
+  float3 c = sum / 4.0;
+  float u = -0.148 * c.r - 0.291 * c.g + 0.439 * c.b + 128.0 / 255.0;
+  float v = 0.439 * c.r - 0.368 * c.g - 0.071 * c.b + 128.0 / 255.0;
+  dst_uv.write(float4(u, v, 0, 0), id);
+}
+
+// chroma_width には 1 行のピクセル数を入れる
+kernel void scale(texture2d<float, access::sample> src [[texture(0)]],
+                  device uchar4* dst [[buffer(1)]],
+                  constant Params& p [[buffer(0)]],
+                  uint2 id [[thread_position_in_grid]]) {
+  if (id.x >= p.width || id.y >= p.height) {
+    return;
+  }
+  float2 uv = float2((id.x + 0.5) / p.width, (id.y + 0.5) / p.height);
+  float4 c = src.sample(kSampler, uv);
+  dst[id.y * p.chroma_width + id.x] = uchar4(round(saturate(c.bgra) * 255.0));
+}
+)";
+
+// エンコーダで詰まった時に CVPixelBuffer を作りすぎないようにする
+static const int kPixelBufferThreshold = 4;
+
 static std::string MTLStorageModeToString(MTLStorageMode mode) {
   switch (mode) {
     case MTLStorageModeShared:
@@ -24,91 +96,380 @@ static std::string MTLStorageModeToString(MTLStorageMode mode) {
   }
 }
 
-bool UnityCameraCapturer::MetalImpl::Init(UnityContext* context,
-                                          void* camera_texture,
-                                          int width,
-                                          int height) {
+UnityCameraCapturer::MetalImpl::~MetalImpl() {
+  // 完了ハンドラが呼ばれるまで待つ
+  while (in_flight_.load() != 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (auto& frame : frames_) {
+    if (frame.buffer != nullptr) {
+      [(id<MTLBuffer>)frame.buffer release];
+      frame.buffer = nullptr;
+    }
+  }
+  if (camera_view_ != nullptr) {
+    [(id<MTLTexture>)camera_view_ release];
+  }
+  if (convert_pipeline_ != nullptr) {
+    [(id<MTLComputePipelineState>)convert_pipeline_ release];
+  }
+  if (scale_pipeline_ != nullptr) {
+    [(id<MTLComputePipelineState>)scale_pipeline_ release];
+  }
+  if (texture_cache_ != nullptr) {
+    CFRelease((CVMetalTextureCacheRef)texture_cache_);
+  }
+  if (pixel_buffer_pool_ != nullptr) {
+    CVPixelBufferPoolRelease((CVPixelBufferPoolRef)pixel_buffer_pool_);
+  }
+}
+
+static id<MTLComputePipelineState> CreatePipeline(id<MTLDevice> device,
+                                                  id<MTLLibrary> library,
+                                                  NSString* name) {
+  NSError* error = nil;
+  id<MTLFunction> function = [library newFunctionWithName:name];
+  id<MTLComputePipelineState> pipeline =
+      [device newComputePipelineStateWithFunction:function error:&error];
+  [function release];
+  if (pipeline == nil) {
+    RTC_LOG(LS_WARNING) << "Failed to create MTLComputePipelineState: "
+                        << [[error localizedDescription] UTF8String];
+  }
+  return pipeline;
+}
+
+bool UnityCameraCapturer::MetalImpl::InitShader() {
+  auto graphics = context_->GetInterfaces()->Get<IUnityGraphicsMetal>();
+  id<MTLDevice> device = graphics->MetalDevice();
+
+  NSError* error = nil;
+  id<MTLLibrary> library =
+      [device newLibraryWithSource:[NSString stringWithUTF8String:kConvertShader]
+                           options:nil
+                             error:&error];
+  if (library == nil) {
+    RTC_LOG(LS_WARNING) << "Failed to compile Metal shader: "
+                        << [[error localizedDescription] UTF8String];
+    return false;
+  }
+  convert_pipeline_ = CreatePipeline(device, library, @"convert");
+  scale_pipeline_ = CreatePipeline(device, library, @"scale");
+  [library release];
+  if (convert_pipeline_ == nullptr || scale_pipeline_ == nullptr) {
+    return false;
+  }
+
+  // sRGB のテクスチャだと勝手にリニアに変換されてしまうので、UNORM として読む
+  auto tex = (id<MTLTexture>)camera_texture_;
+  MTLPixelFormat format = tex.pixelFormat;
+  if (format == MTLPixelFormatBGRA8Unorm_sRGB) {
+    format = MTLPixelFormatBGRA8Unorm;
+  } else if (format == MTLPixelFormatRGBA8Unorm_sRGB) {
+    format = MTLPixelFormatRGBA8Unorm;
+  }
+  id<MTLTexture> view = [tex newTextureViewWithPixelFormat:format];
+  if (view == nil) {
+    RTC_LOG(LS_WARNING) << "Failed to create texture view";
+    return false;
+  }
+  camera_view_ = view;
+
+  return true;
+}
+
+bool UnityCameraCapturer::MetalImpl::InitPixelBuffer() {
+  auto graphics = context_->GetInterfaces()->Get<IUnityGraphicsMetal>();
+  id<MTLDevice> device = graphics->MetalDevice();
+
+  CVMetalTextureCacheRef texture_cache = nullptr;
+  if (CVMetalTextureCacheCreate(kCFAllocatorDefault, nil, device, nil,
+                                &texture_cache) != kCVReturnSuccess) {
+    RTC_LOG(LS_WARNING) << "CVMetalTextureCacheCreate failed";
+    return false;
+  }
+  texture_cache_ = texture_cache;
+
+  return UpdatePixelBufferPool(width_, height_);
+}
+
+bool UnityCameraCapturer::MetalImpl::UpdatePixelBufferPool(int width,
+                                                           int height) {
+  if (pixel_buffer_pool_ != nullptr && pool_width_ == width &&
+      pool_height_ == height) {
+    return true;
+  }
+
+  // 解像度が変わったら作り直す。
+  // エンコーダが使っている CVPixelBuffer はプールを解放しても生き残る。
+  if (pixel_buffer_pool_ != nullptr) {
+    CVPixelBufferPoolRelease((CVPixelBufferPoolRef)pixel_buffer_pool_);
+    pixel_buffer_pool_ = nullptr;
+  }
+
+  NSDictionary* attrs = @{
+    (id)kCVPixelBufferPixelFormatTypeKey :
+        @(kCVPixelFormatType_420YpCbCr8BiPlanarVideoRange),
+    (id)kCVPixelBufferWidthKey : @(width),
+    (id)kCVPixelBufferHeightKey : @(height),
+    (id)kCVPixelBufferIOSurfacePropertiesKey : @{},
+    (id)kCVPixelBufferMetalCompatibilityKey : @YES,
+  };
+  CVPixelBufferPoolRef pool = nullptr;
+  if (CVPixelBufferPoolCreate(kCFAllocatorDefault, nil,
+                              (__bridge CFDictionaryRef)attrs,
+                              &pool) != kCVReturnSuccess) {
+    RTC_LOG(LS_WARNING) << "CVPixelBufferPoolCreate failed";
+    return false;
+  }
+  pixel_buffer_pool_ = pool;
+  pool_width_ = width;
+  pool_height_ = height;
+
+  return true;
+}
+
+void UnityCameraCapturer::MetalImpl::CapturePixelBuffer(int width,
+                                                        int height) {
+  if (!UpdatePixelBufferPool(width, height)) {
+    return;
+  }
+
+  // エンコーダがまだ使っていてプールが空いていなければ、このフレームは捨てる
+  NSDictionary* aux_attrs =
+      @{(id)kCVPixelBufferPoolAllocationThresholdKey : @(kPixelBufferThreshold)};
+  CVPixelBufferRef pixel_buffer = nullptr;
+  CVReturn ret = CVPixelBufferPoolCreatePixelBufferWithAuxAttributes(
+      kCFAllocatorDefault, (CVPixelBufferPoolRef)pixel_buffer_pool_,
+      (__bridge CFDictionaryRef)aux_attrs, &pixel_buffer);
+  if (ret != kCVReturnSuccess) {
+    RTC_LOG(LS_VERBOSE) << "CVPixelBufferPoolCreatePixelBuffer failed: ret="
+                        << ret;
+    return;
+  }
+
+  int chroma_width = (width + 1) / 2;
+  int chroma_height = (height + 1) / 2;
+  auto texture_cache = (CVMetalTextureCacheRef)texture_cache_;
+  CVMetalTextureRef y_texture = nullptr;
+  CVMetalTextureRef uv_texture = nullptr;
+  if (CVMetalTextureCacheCreateTextureFromImage(
+          kCFAllocatorDefault, texture_cache, pixel_buffer, nil,
+          MTLPixelFormatR8Unorm, width, height, 0,
+          &y_texture) != kCVReturnSuccess ||
+      CVMetalTextureCacheCreateTextureFromImage(
+          kCFAllocatorDefault, texture_cache, pixel_buffer, nil,
+          MTLPixelFormatRG8Unorm, chroma_width, chroma_height, 1,
+          &uv_texture) != kCVReturnSuccess) {
+    RTC_LOG(LS_ERROR) << "CVMetalTextureCacheCreateTextureFromImage failed";
+    if (y_texture != nullptr) {
+      CFRelease(y_texture);
+    }
+    CVPixelBufferRelease(pixel_buffer);
+    return;
+  }
+
+  auto graphics = context_->GetInterfaces()->Get<IUnityGraphicsMetal>();
+  graphics->EndCurrentCommandEncoder();
+  auto commandBuffer = graphics->CurrentCommandBuffer();
+
+  id<MTLComputeCommandEncoder> encoder = [commandBuffer computeCommandEncoder];
+  if (encoder == nil) {
+    CFRelease(y_texture);
+    CFRelease(uv_texture);
+    CVPixelBufferRelease(pixel_buffer);
+    return;
+  }
+  uint32_t params[4] = {(uint32_t)width, (uint32_t)height,
+                        (uint32_t)chroma_width, (uint32_t)chroma_height};
+  [encoder setComputePipelineState:(id<MTLComputePipelineState>)
+                                       convert_pipeline_];
+  [encoder setTexture:(id<MTLTexture>)camera_view_ atIndex:0];
+  [encoder setTexture:CVMetalTextureGetTexture(y_texture) atIndex:1];
+  [encoder setTexture:CVMetalTextureGetTexture(uv_texture) atIndex:2];
+  [encoder setBytes:params length:sizeof(params) atIndex:0];
+  [encoder dispatchThreadgroups:MTLSizeMake((chroma_width + 7) / 8,
+                                            (chroma_height + 7) / 8, 1)
+          threadsPerThreadgroup:MTLSizeMake(8, 8, 1)];
+  [encoder endEncoding];
+  encoder = nil;
+
+  in_flight_++;
+  int64_t timestamp_us = owner_->render_time_us_;
+  [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> cb) {
+    // GPU が書き込み終わるまでは CVMetalTexture を生かしておく必要がある
+    CFRelease(y_texture);
+    CFRelease(uv_texture);
+    if (cb.status == MTLCommandBufferStatusCompleted) {
+      RTCCVPixelBuffer* buffer =
+          [[RTCCVPixelBuffer alloc] initWithPixelBuffer:pixel_buffer];
+      rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame_buffer =
+          new rtc::RefCountedObject<webrtc::ObjCFrameBuffer>(buffer);
+      [buffer release];
+      on_frame_(frame_buffer, timestamp_us);
+    } else {
+      RTC_LOG(LS_WARNING) << "MTLCommandBuffer is not completed: status="
+                          << (int)cb.status;
+    }
+    CVPixelBufferRelease(pixel_buffer);
+    in_flight_--;
+  }];
+}
+
+bool UnityCameraCapturer::MetalImpl::Init(
+    UnityCameraCapturer* owner,
+    UnityContext* context,
+    void* camera_texture,
+    int width,
+    int height,
+    bool native_texture,
+    std::function<void(rtc::scoped_refptr<webrtc::VideoFrameBuffer>, int64_t)>
+        on_frame) {
+  owner_ = owner;
   context_ = context;
   camera_texture_ = camera_texture;
   width_ = width;
   height_ = height;
+  on_frame_ = std::move(on_frame);
 
   // camera_texture_ は private storage なので、getBytes でピクセルを取り出すことができない
-  // なのでもう一個 shared storage なテクスチャを作り、キャプチャする時はそのテクスチャに転送して利用する
+  // なので shared storage なバッファを作り、キャプチャする時はそのバッファに転送して利用する
   auto tex = (id<MTLTexture>)camera_texture_;
   // 多分 MTLStorageModePrivate になる
   RTC_LOG(LS_INFO) << "Passed Texture width=" << tex.width
                    << " height=" << tex.height << " MTLStorageMode="
                    << MTLStorageModeToString(tex.storageMode);
 
+  // シェーダが使えない場合は縮小も CPU で行う
+  use_gpu_scale_ = InitShader();
+  RTC_LOG(LS_INFO) << "Metal GPU scale: " << use_gpu_scale_;
+
+  if (native_texture && use_gpu_scale_) {
+    use_pixel_buffer_ = InitPixelBuffer();
+    RTC_LOG(LS_INFO) << "Metal CVPixelBuffer: " << use_pixel_buffer_;
+    if (use_pixel_buffer_) {
+      return true;
+    }
+  }
+
   auto graphics = context_->GetInterfaces()->Get<IUnityGraphicsMetal>();
   auto device = graphics->MetalDevice();
 
-  auto descriptor =
-      [MTLTextureDescriptor texture2DDescriptorWithPixelFormat:tex.pixelFormat
-                                                         width:width_
-                                                        height:height_
-                                                     mipmapped:NO];
-  auto tex2 = [device newTextureWithDescriptor:descriptor];
-  // 多分 MTLStorageModeManaged になる
-  RTC_LOG(LS_INFO) << "Created Texture width=" << tex2.width
-                   << " height=" << tex2.height << " MTLStorageMode="
-                   << MTLStorageModeToString(tex2.storageMode);
-  frame_texture_ = tex2;
+  // バッファへのコピーは行のサイズをアラインしておく必要がある
+  bytes_per_row_ = (width_ * 4 + 255) / 256 * 256;
+  for (auto& frame : frames_) {
+    id<MTLBuffer> buffer =
+        [device newBufferWithLength:bytes_per_row_ * height_
+                            options:MTLResourceStorageModeShared];
+    if (buffer == nil) {
+      RTC_LOG(LS_ERROR) << "Failed to create MTLBuffer";
+      return false;
+    }
+    frame.buffer = buffer;
+  }
+  owner_->staging_memory_.Set((int64_t)bytes_per_row_ * height_ * kFrameCount,
+                              kFrameCount);
   return true;
 }
 
 rtc::scoped_refptr<webrtc::I420Buffer>
-UnityCameraCapturer::MetalImpl::Capture() {
+UnityCameraCapturer::MetalImpl::Capture(bool copy, int width, int height) {
+  // 完了ハンドラで読み出すので、コピーしない場合はやることが無い
+  if (!copy) {
+    return nullptr;
+  }
+
+  if (use_pixel_buffer_) {
+    CapturePixelBuffer(width, height);
+    return nullptr;
+  }
+
+  // 空いているバッファが無ければ、このフレームは捨てる
+  Frame* frame = &frames_[write_index_];
+  if (frame->busy.load()) {
+    return nullptr;
+  }
+
   auto camera_tex = (id<MTLTexture>)camera_texture_;
-  auto tex = (id<MTLTexture>)frame_texture_;
+  auto buffer = (id<MTLBuffer>)frame->buffer;
   auto graphics = context_->GetInterfaces()->Get<IUnityGraphicsMetal>();
 
   graphics->EndCurrentCommandEncoder();
 
   auto commandBuffer = graphics->CurrentCommandBuffer();
 
-  id<MTLBlitCommandEncoder> blit = [commandBuffer blitCommandEncoder];
-  if (blit == nil) {
-    return nullptr;
+  int bytes_per_row;
+  if (use_gpu_scale_ && (width != width_ || height != height_)) {
+    // 縮小しながらバッファに書き込む
+    bytes_per_row = width * 4;
+    id<MTLComputeCommandEncoder> encoder =
+        [commandBuffer computeCommandEncoder];
+    if (encoder == nil) {
+      return nullptr;
+    }
+    uint32_t params[4] = {(uint32_t)width, (uint32_t)height, (uint32_t)width,
+                          0};
+    [encoder setComputePipelineState:(id<MTLComputePipelineState>)
+                                         scale_pipeline_];
+    [encoder setTexture:(id<MTLTexture>)camera_view_ atIndex:0];
+    [encoder setBytes:params length:sizeof(params) atIndex:0];
+    [encoder setBuffer:buffer offset:0 atIndex:1];
+    [encoder dispatchThreadgroups:MTLSizeMake((width + 7) / 8,
+                                              (height + 7) / 8, 1)
+            threadsPerThreadgroup:MTLSizeMake(8, 8, 1)];
+    [encoder endEncoding];
+    encoder = nil;
+  } else {
+    width = width_;
+    height = height_;
+    bytes_per_row = bytes_per_row_;
+    id<MTLBlitCommandEncoder> blit = [commandBuffer blitCommandEncoder];
+    if (blit == nil) {
+      return nullptr;
+    }
+    [blit copyFromTexture:camera_tex
+                     sourceSlice:0
+                     sourceLevel:0
+                    sourceOrigin:MTLOriginMake(0, 0, 0)
+                      sourceSize:MTLSizeMake(width_, height_, 1)
+                        toBuffer:buffer
+               destinationOffset:0
+          destinationBytesPerRow:bytes_per_row_
+        destinationBytesPerImage:bytes_per_row_ * height_];
+    [blit endEncoding];
+    blit = nil;
   }
-  // [blit copyFromTexture:camera_tex toTexture:tex];
-  [blit copyFromTexture:camera_tex
-            sourceSlice:0
-            sourceLevel:0
-           sourceOrigin:MTLOriginMake(0, 0, 0)
-             sourceSize:MTLSizeMake(width_, height_, 1)
-              toTexture:tex
-       destinationSlice:0
-       destinationLevel:0
-      destinationOrigin:MTLOriginMake(0, 0, 0)];
-#if defined(SORA_UNITY_SDK_MACOS)
-  [blit synchronizeResource:tex];
-#endif
-  [blit endEncoding];
-  blit = nil;
-
-  std::unique_ptr<uint8_t[]> buf(new uint8_t[width_ * height_ * 4]);
-  auto region = MTLRegionMake2D(0, 0, width_, height_);
-  [tex getBytes:buf.get()
-      bytesPerRow:width_ * 4
-       fromRegion:region
-      mipmapLevel:0];
-
-  // Metal の場合は座標系の関係で上下反転してるので、頑張って元の向きに戻す
-  std::unique_ptr<uint8_t[]> buf2(new uint8_t[width_ * height_ * 4]);
-  for (int i = 0; i < height_; i++) {
-    std::memcpy(buf2.get() + width_ * 4 * i,
-                buf.get() + width_ * 4 * (height_ - i - 1), width_ * 4);
-  }
-
-  rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
-      webrtc::I420Buffer::Create(width_, height_);
-  libyuv::ARGBToI420(buf2.get(), width_ * 4, i420_buffer->MutableDataY(),
-                     i420_buffer->StrideY(), i420_buffer->MutableDataU(),
-                     i420_buffer->StrideU(), i420_buffer->MutableDataV(),
-                     i420_buffer->StrideV(), width_, height_);
-
-  return i420_buffer;
+
+  frame->busy.store(true);
+  in_flight_++;
+  write_index_ = (write_index_ + 1) % kFrameCount;
+
+  int64_t timestamp_us = owner_->render_time_us_;
+  [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> cb) {
+    if (cb.status == MTLCommandBufferStatusCompleted) {
+      // Metal の場合は座標系の関係で上下反転してるので、
+      // 高さをマイナスにして反転しながら I420 に変換する
+      rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
+          owner_->CreateI420Buffer(width, height);
+      if (i420_buffer) {
+        libyuv::ARGBToI420((const uint8_t*)buffer.contents, bytes_per_row,
+                           i420_buffer->MutableDataY(), i420_buffer->StrideY(),
+                           i420_buffer->MutableDataU(), i420_buffer->StrideU(),
+                           i420_buffer->MutableDataV(), i420_buffer->StrideV(),
+                           width, -height);
+      }
+      frame->busy.store(false);
+      if (i420_buffer) {
+        on_frame_(i420_buffer, timestamp_us);
+      }
+    } else {
+      RTC_LOG(LS_WARNING) << "MTLCommandBuffer is not completed: status="
+                          << (int)cb.status;
+      frame->busy.store(false);
+    }
+    in_flight_--;
+  }];
+
+  return nullptr;
 }
 }
@@ -1,8 +1,18 @@
 #include "unity_camera_capturer.h"
 
+#ifdef SORA_UNITY_SDK_ANDROID
+// WebRTC
+#include "sdk/android/native_api/jni/jvm.h"
+#endif
+
 // unity
 #include "unity/IUnityGraphicsVulkan.h"
 
+#ifdef SORA_UNITY_SDK_ANDROID
+// sora
+#include "android_helper/android_vulkan_hook.h"
+#endif
+
 namespace sora {
 
 UnityCameraCapturer::VulkanImpl::~VulkanImpl() {
@@ -10,21 +20,51 @@ UnityCameraCapturer::VulkanImpl::~VulkanImpl() {
       context_->GetInterfaces()->Get<IUnityGraphicsVulkan>()->Instance();
   VkDevice device = instance.device;
 
-  if (pool_ != VK_NULL_HANDLE) {
-    vkDestroyCommandPool(device, pool_, nullptr);
+  // GPU がまだバッファを使っている可能性があるので、終了時だけは待つ
+  bool pending = false;
+  for (auto& frame : frames_) {
+    pending = pending || frame.pending;
+  }
+#ifdef SORA_UNITY_SDK_ANDROID
+  for (auto& frame : native_frames_) {
+    pending = pending || frame.pending;
+  }
+#endif
+  if (pending) {
+    vkDeviceWaitIdle(device);
+  }
+
+#ifdef SORA_UNITY_SDK_ANDROID
+  DestroyNativeTexture(device);
+#endif
+
+  if (scale_image_ != VK_NULL_HANDLE) {
+    vkDestroyImage(device, scale_image_, nullptr);
   }
-  if (memory_ != VK_NULL_HANDLE) {
-    vkFreeMemory(device, memory_, nullptr);
+  if (scale_memory_ != VK_NULL_HANDLE) {
+    vkFreeMemory(device, scale_memory_, nullptr);
   }
-  if (image_ != VK_NULL_HANDLE) {
-    vkDestroyImage(device, image_, nullptr);
+
+  for (auto& frame : frames_) {
+    if (frame.mapped != nullptr) {
+      vkUnmapMemory(device, frame.memory);
+    }
+    if (frame.buffer != VK_NULL_HANDLE) {
+      vkDestroyBuffer(device, frame.buffer, nullptr);
+    }
+    if (frame.memory != VK_NULL_HANDLE) {
+      vkFreeMemory(device, frame.memory, nullptr);
+    }
   }
 }
 
-bool UnityCameraCapturer::VulkanImpl::Init(UnityContext* context,
+bool UnityCameraCapturer::VulkanImpl::Init(UnityCameraCapturer* owner,
+                                          UnityContext* context,
                                           void* camera_texture,
                                           int width,
-                                          int height) {
+                                          int height,
+                                          bool native_texture) {
+  owner_ = owner;
   context_ = context;
   camera_texture_ = camera_texture;
   width_ = width;
@@ -35,330 +75,553 @@ bool UnityCameraCapturer::VulkanImpl::Init(UnityContext* context,
 
   VkDevice device = instance.device;
   VkPhysicalDevice physical_device = instance.physicalDevice;
-  VkQueue queue = instance.graphicsQueue;
   uint32_t queue_family_index = instance.queueFamilyIndex;
 
+  VkPhysicalDeviceMemoryProperties mem_properties;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_properties);
+
+  int64_t staging_bytes = 0;
+  for (auto& frame : frames_) {
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = width * height * 4;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    bufferInfo.queueFamilyIndexCount = 1;
+    bufferInfo.pQueueFamilyIndices = &queue_family_index;
+    if (vkCreateBuffer(device, &bufferInfo, nullptr, &frame.buffer) !=
+        VK_SUCCESS) {
+      RTC_LOG(LS_ERROR) << "vkCreateBuffer failed";
+      return false;
+    }
+
+    VkMemoryRequirements mem_requirements;
+    vkGetBufferMemoryRequirements(device, frame.buffer, &mem_requirements);
+
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = mem_requirements.size;
+
+    // CPU から読むので、できれば HOST_CACHED なメモリを使う
+    int found = -1;
+    int props[] = {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+    };
+    for (int prop : props) {
+      for (uint32_t i = 0; i < mem_properties.memoryTypeCount; ++i) {
+        int flags = mem_properties.memoryTypes[i].propertyFlags;
+        if ((mem_requirements.memoryTypeBits & (1 << i)) &&
+            (flags & prop) == prop) {
+          found = i;
+          break;
+        }
+      }
+      if (found >= 0) {
+        break;
+      }
+    }
+    if (found < 0) {
+      RTC_LOG(LS_ERROR) << "VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT not found";
+      return false;
+    }
+    allocInfo.memoryTypeIndex = found;
+    host_coherent_ = (mem_properties.memoryTypes[found].propertyFlags &
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &frame.memory) !=
+        VK_SUCCESS) {
+      RTC_LOG(LS_ERROR) << "vkAllocateMemory failed";
+      return false;
+    }
+    staging_bytes += allocInfo.allocationSize;
+
+    if (vkBindBufferMemory(device, frame.buffer, frame.memory, 0) !=
+        VK_SUCCESS) {
+      RTC_LOG(LS_ERROR) << "vkBindBufferMemory failed";
+      return false;
+    }
+
+    // 毎フレーム map するのは無駄なので、ずっと map しておく
+    if (vkMapMemory(device, frame.memory, 0, VK_WHOLE_SIZE, 0,
+                    (void**)&frame.mapped) != VK_SUCCESS) {
+      RTC_LOG(LS_ERROR) << "vkMapMemory failed";
+      return false;
+    }
+  }
+
+#ifdef SORA_UNITY_SDK_ANDROID
+  // テクスチャのまま渡せない場合は上の読み出し用のバッファを使う
+  if (native_texture && IsVulkanAHardwareBufferEnabled()) {
+    use_native_texture_ = InitNativeTexture(instance);
+    if (!use_native_texture_) {
+      DestroyNativeTexture(device);
+    }
+  }
+#endif
+  RTC_LOG(LS_INFO) << "Unity camera capture on Vulkan: native_texture="
+                   << use_native_texture_;
+  int64_t staging_count = kFrameCount;
+#ifdef SORA_UNITY_SDK_ANDROID
+  if (use_native_texture_) {
+    staging_bytes += (int64_t)width_ * height_ * 4 * kNativeFrameCount;
+    staging_count += kNativeFrameCount;
+  }
+#endif
+  owner_->staging_memory_.Set(staging_bytes, staging_count);
+
+  return true;
+}
+
+#ifdef SORA_UNITY_SDK_ANDROID
+bool UnityCameraCapturer::VulkanImpl::InitNativeTexture(
+    const UnityVulkanInstance& instance) {
+  VkDevice device = instance.device;
+
+  JNIEnv* env = webrtc::AttachCurrentThreadIfNeeded();
+
+  for (auto& frame : native_frames_) {
+    frame.hardware_buffer =
+        AHardwareBufferTexture::AllocateBuffer(width_, height_);
+    if (frame.hardware_buffer == nullptr) {
+      return false;
+    }
+    if (!ImportAHardwareBufferImage(device, frame.hardware_buffer, width_,
+                                    height_, VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                                    &frame.image, &frame.memory)) {
+      return false;
+    }
+
+    frame.texture = AHardwareBufferTexture::Create(env, frame.hardware_buffer,
+                                                   width_, height_);
+    if (!frame.texture) {
+      return false;
+    }
+  }
+
+  return true;
+}
+#endif
+
+bool UnityCameraCapturer::VulkanImpl::InitScaleImage(
+    const UnityVulkanInstance& instance,
+    VkFormat format) {
+  VkDevice device = instance.device;
+  VkPhysicalDevice physical_device = instance.physicalDevice;
+
+  // 縮小用の画像は最初に縮小が必要になった時に作る。
+  // 作れなかった場合は CPU で縮小する。
+  scale_format_ = format;
+
+  VkFormatProperties format_props;
+  vkGetPhysicalDeviceFormatProperties(physical_device, format, &format_props);
+  VkFormatFeatureFlags required =
+      VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT |
+      VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+  if ((format_props.optimalTilingFeatures & required) != required) {
+    RTC_LOG(LS_WARNING) << "vkCmdBlitImage is not supported: format="
+                        << format;
+    return false;
+  }
+
   VkImageCreateInfo imageInfo = {};
   imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-  imageInfo.pNext = nullptr;
-  imageInfo.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
   imageInfo.imageType = VK_IMAGE_TYPE_2D;
-  imageInfo.format = VK_FORMAT_R8G8B8A8_UINT;
-  imageInfo.extent.width = width;
-  imageInfo.extent.height = height;
-  imageInfo.extent.depth = 1;
+  imageInfo.format = format;
+  imageInfo.extent = {(uint32_t)width_, (uint32_t)height_, 1};
   imageInfo.mipLevels = 1;
   imageInfo.arrayLayers = 1;
   imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-  imageInfo.tiling = VK_IMAGE_TILING_LINEAR;  // VK_IMAGE_TILING_OPTIMAL;
+  imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
   imageInfo.usage =
       VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
   imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  imageInfo.queueFamilyIndexCount = 1;
-  imageInfo.pQueueFamilyIndices = &queue_family_index;
-  if (vkCreateImage(device, &imageInfo, nullptr, &image_) != VK_SUCCESS) {
+  if (vkCreateImage(device, &imageInfo, nullptr, &scale_image_) !=
+      VK_SUCCESS) {
     RTC_LOG(LS_ERROR) << "vkCreateImage failed";
     return false;
   }
 
   VkMemoryRequirements mem_requirements;
-  vkGetImageMemoryRequirements(device, image_, &mem_requirements);
-  RTC_LOG(LS_INFO) << "memoryTypeBits=" << mem_requirements.memoryTypeBits;
-
-  VkMemoryAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = mem_requirements.size;
-
-  bool found = false;
+  vkGetImageMemoryRequirements(device, scale_image_, &mem_requirements);
   VkPhysicalDeviceMemoryProperties mem_properties;
   vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_properties);
-
-  int prop = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+  int found = -1;
   for (uint32_t i = 0; i < mem_properties.memoryTypeCount; ++i) {
-    int flags = mem_properties.memoryTypes[i].propertyFlags;
-    RTC_LOG(LS_INFO) << "type[" << i << "]=" << flags;
-
     if ((mem_requirements.memoryTypeBits & (1 << i)) &&
-        (flags & prop) == prop) {
-      allocInfo.memoryTypeIndex = i;
-      found = true;
+        (mem_properties.memoryTypes[i].propertyFlags &
+         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+      found = i;
       break;
     }
   }
-  if (!found) {
-    RTC_LOG(LS_ERROR) << "VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT not found";
+  if (found < 0) {
+    RTC_LOG(LS_ERROR) << "VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT not found";
     return false;
   }
 
-  if (vkAllocateMemory(device, &allocInfo, nullptr, &memory_) != VK_SUCCESS) {
+  VkMemoryAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = mem_requirements.size;
+  allocInfo.memoryTypeIndex = found;
+  if (vkAllocateMemory(device, &allocInfo, nullptr, &scale_memory_) !=
+      VK_SUCCESS) {
     RTC_LOG(LS_ERROR) << "vkAllocateMemory failed";
     return false;
   }
-
-  if (vkBindImageMemory(device, image_, memory_, 0) != VK_SUCCESS) {
+  if (vkBindImageMemory(device, scale_image_, scale_memory_, 0) !=
+      VK_SUCCESS) {
     RTC_LOG(LS_ERROR) << "vkBindImageMemory failed";
     return false;
   }
+  return true;
+}
 
-  VkCommandPoolCreateInfo cmdPoolInfo = {};
-  cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-  cmdPoolInfo.queueFamilyIndex = queue_family_index;
-  cmdPoolInfo.flags = 0;
-  if (vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &pool_) !=
-      VK_SUCCESS) {
-    RTC_LOG(LS_ERROR) << "vkCreateCommandPool failed";
-    return false;
+#ifdef SORA_UNITY_SDK_ANDROID
+void UnityCameraCapturer::VulkanImpl::DestroyNativeTexture(VkDevice device) {
+  for (auto& frame : native_frames_) {
+    frame.texture.reset();
+    if (frame.image != VK_NULL_HANDLE) {
+      vkDestroyImage(device, frame.image, nullptr);
+      frame.image = VK_NULL_HANDLE;
+    }
+    if (frame.memory != VK_NULL_HANDLE) {
+      vkFreeMemory(device, frame.memory, nullptr);
+      frame.memory = VK_NULL_HANDLE;
+    }
+    if (frame.hardware_buffer != nullptr) {
+      AHardwareBufferTexture::ReleaseBuffer(frame.hardware_buffer);
+      frame.hardware_buffer = nullptr;
+    }
+    frame.pending = false;
   }
-
-  return true;
 }
 
-rtc::scoped_refptr<webrtc::I420Buffer>
-UnityCameraCapturer::VulkanImpl::Capture() {
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+UnityCameraCapturer::VulkanImpl::CaptureNative(bool copy) {
   IUnityGraphicsVulkan* graphics =
       context_->GetInterfaces()->Get<IUnityGraphicsVulkan>();
 
   UnityVulkanInstance instance = graphics->Instance();
   VkDevice device = instance.device;
-  VkQueue queue = instance.graphicsQueue;
 
   UnityVulkanImage image;
-  bool result = graphics->AccessTexture(
-      camera_texture_, UnityVulkanWholeImage,
-      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VK_ACCESS_TRANSFER_READ_BIT, kUnityVulkanResourceAccess_PipelineBarrier,
-      &image);
-  if (!result) {
-    RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::AccessTexture Failed";
+  bool blit = false;
+  if (copy) {
+    bool result = graphics->AccessTexture(
+        camera_texture_, UnityVulkanWholeImage,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_ACCESS_TRANSFER_READ_BIT,
+        kUnityVulkanResourceAccess_PipelineBarrier, &image);
+    if (!result) {
+      RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::AccessTexture Failed";
+      return nullptr;
+    }
+
+    // RGBA ならそのままコピーし、BGRA なら blit で並び替える。
+    // sRGB の BGRA は blit するとリニアに変換されてしまうので、読み出しに切り替える。
+    switch (image.format) {
+      case VK_FORMAT_R8G8B8A8_UNORM:
+      case VK_FORMAT_R8G8B8A8_SRGB:
+        blit = false;
+        break;
+      case VK_FORMAT_B8G8R8A8_UNORM:
+        blit = true;
+        break;
+      default:
+        RTC_LOG(LS_WARNING) << "Unsupported camera texture format: "
+                            << image.format << ", fallback to readback";
+        DestroyNativeTexture(device);
+        use_native_texture_ = false;
+        return nullptr;
+    }
+
+    graphics->EnsureOutsideRenderPass();
+  }
+
+  UnityVulkanRecordingState state;
+  if (!graphics->CommandRecordingState(
+          &state, kUnityVulkanGraphicsQueueAccess_DontCare)) {
+    RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::CommandRecordingState Failed";
     return nullptr;
   }
 
-  VkCommandBuffer command_buffer;
+  // 古い順に見ていって、GPU の処理が終わっているものがあれば渡す
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer;
+  for (int i = 0; i < kNativeFrameCount; i++) {
+    NativeFrame& frame =
+        native_frames_[(native_index_ + i) % kNativeFrameCount];
+    if (!frame.pending) {
+      continue;
+    }
+    if (frame.frame_number > state.safeFrameNumber) {
+      break;
+    }
+    frame.pending = false;
+    buffer = frame.texture->buffer();
+    last_timestamp_us_ = frame.timestamp_us;
+    break;
+  }
 
-  {
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = pool_;
-    allocInfo.commandBufferCount = 1;
+  if (!copy) {
+    return buffer;
+  }
 
-    if (vkAllocateCommandBuffers(device, &allocInfo, &command_buffer) !=
-        VK_SUCCESS) {
-      RTC_LOG(LS_ERROR) << "vkAllocateCommandBuffers failed";
-      return nullptr;
-    }
+  // 書き込み先がまだ GPU かエンコーダで使われている場合はこのフレームを捨てる
+  NativeFrame& write_frame = native_frames_[native_index_];
+  if (write_frame.pending || write_frame.texture->InUse()) {
+    RTC_LOG(LS_VERBOSE) << "Drop captured frame: native texture is in use";
+    return buffer;
+  }
 
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  uint32_t queue_family_index = instance.queueFamilyIndex;
 
-    if (vkBeginCommandBuffer(command_buffer, &beginInfo) != VK_SUCCESS) {
-      vkFreeCommandBuffers(device, pool_, 1, &command_buffer);
-      RTC_LOG(LS_ERROR) << "vkBeginCommandBuffer failed";
-      return nullptr;
-    }
+  // エンコーダの GL 側から所有権を受け取る。前の内容は要らない。
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+  barrier.dstQueueFamilyIndex = queue_family_index;
+  barrier.image = write_frame.image;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  vkCmdPipelineBarrier(state.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+
+  // Vulkan の画像は 1 行目が下端なので、GL のテクスチャとしては反転しなくて良い
+  if (blit) {
+    VkImageBlit region = {};
+    region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.srcOffsets[0] = {0, 0, 0};
+    region.srcOffsets[1] = {width_, height_, 1};
+    region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.dstOffsets[0] = {0, 0, 0};
+    region.dstOffsets[1] = {width_, height_, 1};
+    vkCmdBlitImage(state.commandBuffer, image.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, write_frame.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                   VK_FILTER_NEAREST);
+  } else {
+    VkImageCopy region = {};
+    region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.srcOffset = {0, 0, 0};
+    region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.dstOffset = {0, 0, 0};
+    region.extent = {(uint32_t)width_, (uint32_t)height_, 1};
+    vkCmdCopyImage(state.commandBuffer, image.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, write_frame.image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
   }
 
-  //{
-  //  VkImageMemoryBarrier barrier = {};
-  //  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  //  barrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-  //  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-  //  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  //  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-  //  barrier.image = image.image;
-  //  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  //  barrier.subresourceRange.baseMipLevel = 0;
-  //  barrier.subresourceRange.levelCount = 1;
-  //  barrier.subresourceRange.baseArrayLayer = 0;
-  //  barrier.subresourceRange.layerCount = 1;
-
-  //  barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-  //  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-  //  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
-  //                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
-  //                       nullptr, 1, &barrier);
-  //}
-
-  //{
-  //  VkImageMemoryBarrier barrier = {};
-  //  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  //  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  //  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  //  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  //  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-  //  barrier.image = image_;
-  //  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  //  barrier.subresourceRange.baseMipLevel = 0;
-  //  barrier.subresourceRange.levelCount = 1;
-  //  barrier.subresourceRange.baseArrayLayer = 0;
-  //  barrier.subresourceRange.layerCount = 1;
-
-  //  barrier.srcAccessMask = 0;
-  //  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-  //  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
-  //                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
-  //                       nullptr, 1, &barrier);
-  //}
-
-  VkImageCopy copyRegion{};
-  copyRegion.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
-  copyRegion.srcOffset = {0, 0, 0};
-  copyRegion.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
-  copyRegion.dstOffset = {0, 0, 0};
-  copyRegion.extent = {(uint32_t)width_, (uint32_t)height_, 1};
-  vkCmdCopyImage(command_buffer, image.image,
-                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image_,
-                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-  //{
-  //  VkImageMemoryBarrier barrier = {};
-  //  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  //  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  //  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-  //  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  //  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-  //  barrier.image = image_;
-  //  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  //  barrier.subresourceRange.baseMipLevel = 0;
-  //  barrier.subresourceRange.levelCount = 1;
-  //  barrier.subresourceRange.baseArrayLayer = 0;
-  //  barrier.subresourceRange.layerCount = 1;
-
-  //  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-  //  barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-  //  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
-  //                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
-  //                       nullptr, 1, &barrier);
-  //}
-
-  //{
-  //  VkImageMemoryBarrier barrier = {};
-  //  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  //  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-  //  barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-  //  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  //  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-  //  barrier.image = image.image;
-  //  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  //  barrier.subresourceRange.baseMipLevel = 0;
-  //  barrier.subresourceRange.levelCount = 1;
-  //  barrier.subresourceRange.baseArrayLayer = 0;
-  //  barrier.subresourceRange.layerCount = 1;
-
-  //  barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-  //  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-  //  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
-  //                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
-  //                       nullptr, 1, &barrier);
-  //}
-
-  {
-    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
-      vkFreeCommandBuffers(device, pool_, 1, &command_buffer);
-      RTC_LOG(LS_ERROR) << "vkEndCommandBuffer failed";
-      return nullptr;
-    }
+  // エンコーダの GL 側に所有権を渡す
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = 0;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+  barrier.srcQueueFamilyIndex = queue_family_index;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_FOREIGN_EXT;
+  vkCmdPipelineBarrier(state.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+
+  write_frame.pending = true;
+  write_frame.frame_number = state.currentFrameNumber;
+  write_frame.timestamp_us = owner_->render_time_us_;
+  native_index_ = (native_index_ + 1) % kNativeFrameCount;
+
+  return buffer;
+}
+#endif
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &command_buffer;
+rtc::scoped_refptr<webrtc::I420Buffer>
+UnityCameraCapturer::VulkanImpl::Capture(bool copy, int width, int height) {
+  IUnityGraphicsVulkan* graphics =
+      context_->GetInterfaces()->Get<IUnityGraphicsVulkan>();
 
-    if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
-      vkFreeCommandBuffers(device, pool_, 1, &command_buffer);
-      RTC_LOG(LS_ERROR) << "vkQueueSubmit failed";
-      return nullptr;
-    }
-    if (vkQueueWaitIdle(queue) != VK_SUCCESS) {
-      vkFreeCommandBuffers(device, pool_, 1, &command_buffer);
-      RTC_LOG(LS_ERROR) << "vkQueueWaitIdle failed";
+  UnityVulkanInstance instance = graphics->Instance();
+  VkDevice device = instance.device;
+
+  UnityVulkanImage image;
+  if (copy) {
+    bool result = graphics->AccessTexture(
+        camera_texture_, UnityVulkanWholeImage,
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_ACCESS_TRANSFER_READ_BIT,
+        kUnityVulkanResourceAccess_PipelineBarrier, &image);
+    if (!result) {
+      RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::AccessTexture Failed";
       return nullptr;
     }
 
-    vkFreeCommandBuffers(device, pool_, 1, &command_buffer);
+    graphics->EnsureOutsideRenderPass();
   }
 
-  //UnityVulkanImage image;
-  ////bool result = graphics->AccessTexture(
-  ////    image_, UnityVulkanWholeImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-  ////    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT,
-  ////    kUnityVulkanResourceAccess_PipelineBarrier, &image);
-  //bool result = graphics->AccessTexture(
-  //    image_, UnityVulkanWholeImage, VK_IMAGE_LAYOUT_GENERAL,
-  //    VK_PIPELINE_STAGE_HOST_BIT,
-  //    VK_ACCESS_HOST_READ_BIT | VK_ACCESS_MEMORY_READ_BIT,
-  //    kUnityVulkanResourceAccess_PipelineBarrier, &image);
-  //if (!result) {
-  //  RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::AccessTexture Failed";
-  //  return nullptr;
-  //}
-  //RTC_LOG(LS_INFO) << "memory.memory=" << image.memory.memory;
-  //RTC_LOG(LS_INFO) << "memory.offset=" << image.memory.offset;
-  //RTC_LOG(LS_INFO) << "memory.size=" << image.memory.size;
-  //RTC_LOG(LS_INFO) << "memory.mapped=" << image.memory.mapped;
-  //RTC_LOG(LS_INFO) << "memory.flags=" << image.memory.flags;
-  //RTC_LOG(LS_INFO) << "memory.memoryTypeIndex=" << image.memory.memoryTypeIndex;
-  //RTC_LOG(LS_INFO) << "image=" << image.image;
-  //RTC_LOG(LS_INFO) << "layout=" << image.layout;
-  //RTC_LOG(LS_INFO) << "aspect=" << image.aspect;
-  //RTC_LOG(LS_INFO) << "usage=" << image.usage;
-  //RTC_LOG(LS_INFO) << "format=" << image.format;
-  //RTC_LOG(LS_INFO) << "extent.width=" << image.extent.width;
-  //RTC_LOG(LS_INFO) << "extent.height=" << image.extent.height;
-  //RTC_LOG(LS_INFO) << "extent.depth=" << image.extent.depth;
-  //RTC_LOG(LS_INFO) << "tiling=" << image.tiling;
-  //RTC_LOG(LS_INFO) << "type=" << image.type;
-  //RTC_LOG(LS_INFO) << "samples=" << image.samples;
-  //// memory.flags == 0b1 // VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
-  //// image.usage == 0b10010111 // VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT
-  //// image.format == 41 // VK_FORMAT_R8G8B8A8_UINT
-  //// image.format == 44 // VK_FORMAT_B8G8R8A8_UNORM
-  //if (image.memory.mapped == nullptr) {
-  //  return nullptr;
-  //}
-  //if (image.format != VK_FORMAT_R8G8B8A8_UINT) {
-  //  return nullptr;
-  //}
-  //uint8_t* data = (uint8_t*)image.memory.mapped;
-  //int pitch = image.extent.width * 4;
-
-  VkImageSubresource subresource{VK_IMAGE_ASPECT_COLOR_BIT, 0, 0};
-  VkSubresourceLayout subresource_layout;
-  vkGetImageSubresourceLayout(device, image_, &subresource,
-                              &subresource_layout);
-
-  uint8_t* data;
-  if (vkMapMemory(device, memory_, 0, VK_WHOLE_SIZE, 0, (void**)&data) !=
-      VK_SUCCESS) {
-    RTC_LOG(LS_ERROR) << "vkMapMemory failed";
+  UnityVulkanRecordingState state;
+  if (!graphics->CommandRecordingState(
+          &state, kUnityVulkanGraphicsQueueAccess_DontCare)) {
+    RTC_LOG(LS_ERROR) << "IUnityGraphicsVulkan::CommandRecordingState Failed";
     return nullptr;
   }
-  int pitch = subresource_layout.rowPitch;
 
-  // Vulkan の場合は座標系の関係で上下反転してるので、頑張って元の向きに戻す
-  std::unique_ptr<uint8_t[]> buf(new uint8_t[pitch * height_]);
-  for (int i = 0; i < height_; i++) {
-    std::memcpy(buf.get() + pitch * i, data + pitch * (height_ - i - 1), pitch);
+  rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer;
+
+  if (copy) {
+    // これから書き込むバッファがまだ読み出せていない場合、
+    // GPU が終わっていれば読み出し、終わっていなければそのフレームは捨てる
+    Frame& write_frame = frames_[write_index_];
+    if (write_frame.pending) {
+      if (write_frame.frame_number <= state.safeFrameNumber) {
+        i420_buffer = ReadFrame(device, write_frame);
+      } else {
+        RTC_LOG(LS_VERBOSE) << "Drop captured frame: frame_number="
+                            << write_frame.frame_number
+                            << " safe_frame_number=" << state.safeFrameNumber;
+        write_frame.pending = false;
+      }
+    }
+
+    // 縮小する場合は、縮小用の画像に blit してからその左上をコピーする
+    VkImage src_image = image.image;
+    if ((width != width_ || height != height_) && !scale_failed_) {
+      if (scale_image_ == VK_NULL_HANDLE &&
+          !InitScaleImage(instance, image.format)) {
+        scale_failed_ = true;
+      } else if (scale_format_ != image.format) {
+        RTC_LOG(LS_WARNING) << "Camera texture format is changed";
+        scale_failed_ = true;
+      }
+      if (!scale_failed_) {
+        BlitToScaleImage(state.commandBuffer, image.image, width, height);
+        src_image = scale_image_;
+      }
+    }
+    if (src_image == image.image) {
+      width = width_;
+      height = height_;
+    }
+
+    VkBufferImageCopy region = {};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {(uint32_t)width, (uint32_t)height, 1};
+    vkCmdCopyImageToBuffer(state.commandBuffer, src_image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           write_frame.buffer, 1, &region);
+
+    // CPU から読めるようにする
+    VkBufferMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = write_frame.buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(state.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier,
+                         0, nullptr);
+
+    write_frame.pending = true;
+    write_frame.frame_number = state.currentFrameNumber;
+    write_frame.timestamp_us = owner_->render_time_us_;
+    write_frame.width = width;
+    write_frame.height = height;
+    write_index_ = (write_index_ + 1) % kFrameCount;
+
+    if (i420_buffer) {
+      return i420_buffer;
+    }
+  }
+
+  // 古い順に見ていって、GPU の処理が終わっているバッファがあれば読み出す
+  for (int i = 0; i < kFrameCount; i++) {
+    Frame& frame = frames_[(write_index_ + i) % kFrameCount];
+    if (!frame.pending) {
+      continue;
+    }
+    if (frame.frame_number > state.safeFrameNumber) {
+      break;
+    }
+    return ReadFrame(device, frame);
   }
+  return nullptr;
+}
+
+void UnityCameraCapturer::VulkanImpl::BlitToScaleImage(
+    VkCommandBuffer command_buffer,
+    VkImage camera_image,
+    int width,
+    int height) {
+  // 前のフレームのコピーが終わってから書き込む。前の内容は要らない。
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = scale_image_;
+  barrier.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+
+  VkImageBlit region = {};
+  region.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.srcOffsets[0] = {0, 0, 0};
+  region.srcOffsets[1] = {width_, height_, 1};
+  region.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+  region.dstOffsets[0] = {0, 0, 0};
+  region.dstOffsets[1] = {width, height, 1};
+  vkCmdBlitImage(command_buffer, camera_image,
+                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, scale_image_,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region,
+                 VK_FILTER_LINEAR);
+
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                       nullptr, 1, &barrier);
+}
 
-  vkUnmapMemory(device, memory_);
+rtc::scoped_refptr<webrtc::I420Buffer>
+UnityCameraCapturer::VulkanImpl::ReadFrame(VkDevice device, Frame& frame) {
+  frame.pending = false;
+  last_timestamp_us_ = frame.timestamp_us;
+
+  if (!host_coherent_) {
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = frame.memory;
+    range.offset = 0;
+    range.size = VK_WHOLE_SIZE;
+    vkInvalidateMappedMemoryRanges(device, 1, &range);
+  }
 
+  // Vulkan の場合は座標系の関係で上下反転してるので、
+  // 高さをマイナスにして反転しながら I420 に変換する
   rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
-      webrtc::I420Buffer::Create(width_, height_);
-  libyuv::ARGBToI420(buf.get(), pitch, i420_buffer->MutableDataY(),
-                     i420_buffer->StrideY(), i420_buffer->MutableDataU(),
-                     i420_buffer->StrideU(), i420_buffer->MutableDataV(),
-                     i420_buffer->StrideV(), width_, height_);
+      owner_->CreateI420Buffer(frame.width, frame.height);
+  if (!i420_buffer) {
+    return nullptr;
+  }
+  libyuv::ARGBToI420(frame.mapped, frame.width * 4,
+                     i420_buffer->MutableDataY(), i420_buffer->StrideY(),
+                     i420_buffer->MutableDataU(), i420_buffer->StrideU(),
+                     i420_buffer->MutableDataV(), i420_buffer->StrideV(),
+                     frame.width, -frame.height);
 
   return i420_buffer;
 }
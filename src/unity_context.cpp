@@ -1,5 +1,9 @@
 #include "unity_context.h"
 
+#ifdef SORA_UNITY_SDK_ANDROID
+#include "android_helper/android_vulkan_hook.h"
+#endif
+
 namespace sora {
 
 void UnityContext::OnGraphicsDeviceEventStatic(
@@ -104,33 +108,40 @@ bool UnityContext::IsInitialized() {
 void UnityContext::Init(IUnityInterfaces* ifs) {
   std::lock_guard<std::mutex> guard(mutex_);
 
-#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_MACOS)
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_MACOS) || \
+    defined(SORA_UNITY_SDK_UBUNTU)
   const size_t kDefaultMaxLogFileSize = 10 * 1024 * 1024;
   rtc::LogMessage::LogToDebug((rtc::LoggingSeverity)rtc::LS_NONE);
   rtc::LogMessage::LogTimestamps();
   rtc::LogMessage::LogThreads();
 
-  log_sink_.reset(new rtc::FileRotatingLogSink("./", "webrtc_logs",
-                                               kDefaultMaxLogFileSize, 10));
-  if (!log_sink_->Init()) {
+  std::unique_ptr<rtc::FileRotatingLogSink> file_sink(
+      new rtc::FileRotatingLogSink("./", "webrtc_logs", kDefaultMaxLogFileSize,
+                                   10));
+  if (!file_sink->Init()) {
     RTC_LOG(LS_ERROR) << __FUNCTION__ << ": Failed to open log file";
-    log_sink_.reset();
     return;
   }
-  //log_sink_->DisableBuffering();
+  //file_sink->DisableBuffering();
 
-  rtc::LogMessage::AddLogToStream(log_sink_.get(), rtc::LS_INFO);
+  // ログを出したスレッドでファイルに書き込まないように、専用のスレッドに渡す
+  const size_t kLogQueueCapacity = 4096;
+  log_sink_.reset(new AsyncLogSink(std::move(file_sink), kLogQueueCapacity));
+  rtc::LogMessage::AddLogToStream(log_sink_.get(), log_level_);
 
   RTC_LOG(LS_INFO) << "Log initialized";
 #endif
 
 #if defined(SORA_UNITY_SDK_ANDROID) || defined(SORA_UNITY_SDK_IOS)
-  rtc::LogMessage::LogToDebug((rtc::LoggingSeverity)rtc::LS_INFO);
+  rtc::LogMessage::LogToDebug(log_level_);
   rtc::LogMessage::LogTimestamps();
   rtc::LogMessage::LogThreads();
 #endif
 
   ifs_ = ifs;
+#ifdef SORA_UNITY_SDK_ANDROID
+  InterceptVulkanInitialization(ifs);
+#endif
   OnGraphicsDeviceEvent(kUnityGfxDeviceEventInitialize);
 }
 
@@ -149,6 +160,22 @@ IUnityInterfaces* UnityContext::GetInterfaces() {
   return ifs_;
 }
 
+void UnityContext::SetLogLevel(rtc::LoggingSeverity level) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  RTC_LOG(LS_INFO) << "Set log level: " << (int)level;
+  log_level_ = level;
+  if (log_sink_) {
+    // 重要度の下限は AddLogToStream でしか変えられないので登録し直す
+    rtc::LogMessage::RemoveLogToStream(log_sink_.get());
+    rtc::LogMessage::AddLogToStream(log_sink_.get(), level);
+  }
+#if defined(SORA_UNITY_SDK_ANDROID) || defined(SORA_UNITY_SDK_IOS)
+  if (ifs_ != nullptr) {
+    rtc::LogMessage::LogToDebug(level);
+  }
+#endif
+}
+
 #ifdef SORA_UNITY_SDK_WINDOWS
 ID3D11Device* UnityContext::GetDevice() {
   std::lock_guard<std::mutex> guard(mutex_);
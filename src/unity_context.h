@@ -5,6 +5,7 @@
 
 // webrtc
 #include "rtc_base/log_sinks.h"
+#include "rtc_base/logging.h"
 
 #include "unity/IUnityGraphics.h"
 #include "unity/IUnityInterface.h"
@@ -13,11 +14,15 @@
 #include "unity/IUnityGraphicsD3D11.h"
 #endif
 
+#include "async_log_sink.h"
+
 namespace sora {
 
 class UnityContext {
   std::mutex mutex_;
-  std::unique_ptr<rtc::FileRotatingLogSink> log_sink_;
+  // ファイルへの書き込みは AsyncLogSink のスレッドで行う
+  std::unique_ptr<AsyncLogSink> log_sink_;
+  rtc::LoggingSeverity log_level_ = rtc::LS_INFO;
   IUnityInterfaces* ifs_ = nullptr;
   IUnityGraphics* graphics_ = nullptr;
 
@@ -38,6 +43,9 @@ class UnityContext {
 
   IUnityInterfaces* GetInterfaces();
 
+  // 出力するログの重要度の下限を変える。Init の前に呼んだ場合は Init で反映する
+  void SetLogLevel(rtc::LoggingSeverity level);
+
 #ifdef SORA_UNITY_SDK_WINDOWS
  private:
   ID3D11Device* device_ = nullptr;
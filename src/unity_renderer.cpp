@@ -1,92 +1,1020 @@
 #include "unity_renderer.h"
 
+#include <algorithm>
+
 #include <rtc_base/logging.h>
+#include <rtc_base/time_utils.h>
+#include <system_wrappers/include/clock.h>
+#include <system_wrappers/include/ntp_time.h>
+
+#include "perf_counters.h"
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+#include "rtc/d3d11_nv12_texture_buffer.h"
+#include "unity_context.h"
+#endif
 
 namespace sora {
 
+static size_t I420BufferBytes(const webrtc::I420Buffer* buffer) {
+  if (buffer == nullptr) {
+    return 0;
+  }
+  return buffer->StrideY() * buffer->height() +
+         buffer->StrideU() * buffer->ChromaHeight() +
+         buffer->StrideV() * buffer->ChromaHeight();
+}
+
+// 確保済みのバッファのサイズが違う場合だけ確保し直す
+static void ReserveI420Buffer(rtc::scoped_refptr<webrtc::I420Buffer>* buffer,
+                              int width,
+                              int height) {
+  if (!*buffer || (*buffer)->width() != width ||
+      (*buffer)->height() != height) {
+    *buffer = webrtc::I420Buffer::Create(width, height);
+  }
+}
+
 // UnityRenderer::Sink
 
-UnityRenderer::Sink::Sink(webrtc::VideoTrackInterface* track) : track_(track) {
-  ptrid_ = IdPointer::Instance().Register(this);
+UnityRenderer::Sink::Sink(webrtc::VideoTrackInterface* track,
+                          rtc::Thread* convert_thread)
+    : track_(track),
+      convert_thread_(convert_thread),
+      schedule_([this]() { return HasNewFrame(); }) {
+  ptrid_ = IdPointer::Instance().Register(this, IdPointer::Type::kVideoSink);
   track_->AddOrUpdateSink(this, rtc::VideoSinkWants());
 }
 UnityRenderer::Sink::~Sink() {
   IdPointer::Instance().Unregister(ptrid_);
+
+  rtc::Thread* convert_thread;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    convert_thread = convert_thread_;
+    convert_thread_ = nullptr;
+  }
+  // 変換用スレッドに残っている処理が終わるのを待つ
+  if (convert_thread != nullptr) {
+    convert_thread->Invoke<void>(RTC_FROM_HERE, []() {});
+  }
 }
 ptrid_t UnityRenderer::Sink::GetSinkID() const {
   return ptrid_;
 }
+size_t UnityRenderer::Sink::GetBufferBytes() const {
+  return buffer_bytes_.load() + convert_bytes_.load();
+}
+
+uint8_t* UnityRenderer::Sink::ReserveTempBuffer(size_t size) {
+  // 縮む場合は確保し直さずにそのまま使う
+  if (temp_buf_.size() < size) {
+    temp_buf_.resize(size);
+    UpdateBufferBytes();
+  }
+  return temp_buf_.data();
+}
+void UnityRenderer::Sink::UpdateBufferBytes() {
+  size_t bytes = temp_buf_.capacity() + I420BufferBytes(scale_buffer_.get()) +
+                 I420BufferBytes(nv12_i420_buffer_.get());
+  buffer_bytes_.store(bytes);
+  memory_.Set(GetBufferBytes());
+}
 
 rtc::scoped_refptr<webrtc::VideoFrameBuffer>
-UnityRenderer::Sink::GetFrameBuffer() {
+UnityRenderer::Sink::GetFrameBuffer(uint64_t* seq) {
   std::lock_guard<std::mutex> guard(mutex_);
+  *seq = frame_seq_;
   return frame_buffer_;
 }
+rtc::scoped_refptr<webrtc::VideoFrameBuffer>
+UnityRenderer::Sink::MapFrameBuffer(
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> video_frame_buffer,
+    uint64_t seq) {
+  if (!video_frame_buffer ||
+      video_frame_buffer->type() != webrtc::VideoFrameBuffer::Type::kNative) {
+    return video_frame_buffer;
+  }
+
+  int64_t start_us = rtc::TimeMicros();
+  rtc::scoped_refptr<webrtc::VideoFrameBuffer> i420 =
+      video_frame_buffer->ToI420();
+  native_convert_count_++;
+  native_convert_time_us_ += rtc::TimeMicros() - start_us;
+  if (!i420) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  // 変換している間に次のフレームが来ていなければ差し替える。
+  // GPU 上の NV12 をそのままコピーしている場合は元のフレームを残しておく
+  bool keep_native = false;
+#if defined(SORA_UNITY_SDK_WINDOWS)
+  keep_native = native_y_texture_ != nullptr;
+#elif defined(SORA_UNITY_SDK_ANDROID)
+  keep_native = native_texture_ != nullptr;
+#endif
+  if (frame_seq_ == seq && !keep_native) {
+    frame_buffer_ = i420;
+  }
+  return i420;
+}
 void UnityRenderer::Sink::SetFrameBuffer(
-    rtc::scoped_refptr<webrtc::VideoFrameBuffer> v) {
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> v,
+    int64_t capture_ntp_ms) {
   std::lock_guard<std::mutex> guard(mutex_);
+  // 転送される前に上書きされたフレームを数える
+  if (frame_buffer_ && frame_seq_ != rendered_seq_.load()) {
+    frames_dropped_++;
+  }
   frame_buffer_ = v;
+  frame_seq_ += 1;
+  CaptureTime& t = capture_times_[frame_seq_ % kCaptureTimeCount];
+  t.seq = frame_seq_;
+  t.ntp_ms = capture_ntp_ms;
+  last_frame_width_.store(v->width());
+  last_frame_height_.store(v->height());
+}
+
+void UnityRenderer::Sink::GetRenderStats(sora_track_render_stats_t* stats) {
+  stats->frames_received = frames_received_.load();
+  stats->frames_dropped = frames_dropped_.load();
+  stats->frames_rendered = frames_rendered_.load();
+  stats->native_convert_count = native_convert_count_.load();
+  stats->native_convert_time_us = native_convert_time_us_.load();
+  stats->convert_count = convert_count_.load();
+  stats->convert_time_us = convert_time_us_.load();
+  stats->last_frame_width = last_frame_width_.load();
+  stats->last_frame_height = last_frame_height_.load();
+  stats->capture_to_decode_p50_ms = capture_to_decode_ms_.Percentile(50);
+  stats->capture_to_decode_p95_ms = capture_to_decode_ms_.Percentile(95);
+  stats->capture_to_decode_p99_ms = capture_to_decode_ms_.Percentile(99);
+  stats->capture_to_render_p50_ms = capture_to_render_ms_.Percentile(50);
+  stats->capture_to_render_p95_ms = capture_to_render_ms_.Percentile(95);
+  stats->capture_to_render_p99_ms = capture_to_render_ms_.Percentile(99);
+  stats->latency_sample_count = capture_to_render_ms_.count();
+  stats->frames_without_capture_time = frames_without_capture_time_.load();
+  stats->frames_deferred = schedule_.frames_deferred();
+}
+void UnityRenderer::Sink::AddConvertTime(int64_t start_us) {
+  convert_count_++;
+  convert_time_us_ += rtc::TimeMicros() - start_us;
+}
+
+bool UnityRenderer::Sink::HasNewFrame() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return frame_seq_ != rendered_seq_.load();
+}
+
+void UnityRenderer::Sink::ApplyWants() {
+  int pixel_count = requested_pixel_count_.load();
+  int max_framerate = max_framerate_.load();
+  bool paused = paused_.load();
+  if (pixel_count == applied_pixel_count_ &&
+      max_framerate == applied_framerate_ && paused == applied_paused_) {
+    return;
+  }
+  applied_pixel_count_ = pixel_count;
+  applied_framerate_ = max_framerate;
+  applied_paused_ = paused;
+
+  // 外しておけば、デコード結果の ToI420 や Unity 向けの変換が行われない
+  if (paused) {
+    RTC_LOG(LS_INFO) << "Pause track: sink_id=" << ptrid_;
+    track_->RemoveSink(this);
+    return;
+  }
+
+  rtc::VideoSinkWants wants;
+  if (pixel_count > 0) {
+    wants.max_pixel_count = pixel_count;
+    wants.target_pixel_count = pixel_count;
+  }
+  if (max_framerate > 0) {
+    wants.max_framerate_fps = max_framerate;
+  }
+  RTC_LOG(LS_INFO) << "Update VideoSinkWants: sink_id=" << ptrid_
+                   << " max_pixel_count=" << wants.max_pixel_count
+                   << " max_framerate_fps=" << wants.max_framerate_fps;
+  track_->AddOrUpdateSink(this, wants);
+}
+void UnityRenderer::Sink::SetMaxFramerate(int max_framerate) {
+  max_framerate_.store(max_framerate);
+}
+void UnityRenderer::Sink::SetPaused(bool paused) {
+  paused_.store(paused);
+}
+
+bool UnityRenderer::Sink::MarkRendered(RenderedTarget* target,
+                                       intptr_t texture_id,
+                                       uint64_t seq) {
+  if (target->texture_id != texture_id) {
+    target->texture_id = texture_id;
+    target->seq = 0;
+  }
+  if (target->seq >= seq) {
+    return false;
+  }
+  target->seq = seq;
+  if (seq > rendered_seq_.load()) {
+    rendered_seq_.store(seq);
+    frames_rendered_++;
+
+    int64_t capture_ntp_ms = -1;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      const CaptureTime& t = capture_times_[seq % kCaptureTimeCount];
+      if (t.seq == seq) {
+        capture_ntp_ms = t.ntp_ms;
+      }
+    }
+    if (capture_ntp_ms >= 0) {
+      capture_to_render_ms_.Add(
+          webrtc::Clock::GetRealTimeClock()->CurrentNtpInMilliseconds() -
+          capture_ntp_ms);
+    }
+  }
+  return true;
 }
 
 void UnityRenderer::Sink::OnFrame(const webrtc::VideoFrame& frame) {
   rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame_buffer =
       frame.video_frame_buffer();
+  frames_received_++;
 
-  // kNative の場合は別スレッドで変換が出来ない可能性が高いため、
-  // ここで I420 に変換する。
+  // 送信側のキャプチャ時刻（送信側の NTP 時刻）。
+  // abs-capture-time ヘッダ拡張が付いていないフレームでは -1 になる
+  int64_t capture_ntp_ms = -1;
+  for (const webrtc::RtpPacketInfo& info : frame.packet_infos()) {
+    const auto& act = info.absolute_capture_time();
+    if (!act) {
+      continue;
+    }
+    capture_ntp_ms = webrtc::UQ32x32ToInt64Ms(act->absolute_capture_timestamp);
+    // 中継した場合は元のキャプチャした側の時計とのずれが入っている
+    if (act->estimated_capture_clock_offset) {
+      capture_ntp_ms +=
+          webrtc::Q32x32ToInt64Ms(*act->estimated_capture_clock_offset);
+    }
+    break;
+  }
+  if (capture_ntp_ms >= 0) {
+    capture_to_decode_ms_.Add(
+        webrtc::Clock::GetRealTimeClock()->CurrentNtpInMilliseconds() -
+        capture_ntp_ms);
+  } else {
+    frames_without_capture_time_++;
+  }
+
+  // kNative のフレームは、テクスチャに転送する時に MapFrameBuffer で変換する。
+  // Unity の描画が受信より遅い場合、転送されずに上書きされるフレームは変換しなくて済む。
+  // Android の kNative は JNI 経由で変換するので、デコーダのスレッドで変換しておく。
+  // ネイティブテクスチャが指定されている場合は、OES テクスチャを GPU 上で描画しておく。
+  // OES テクスチャは保持している間は次のフレームがデコードされないので、保持しない。
+#if defined(SORA_UNITY_SDK_ANDROID)
   if (frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative) {
-    frame_buffer = frame_buffer->ToI420();
+    AndroidNativeTextureRenderer* native_renderer = nullptr;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (native_texture_ != nullptr) {
+        native_renderer = native_renderer_.get();
+      }
+    }
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> drawn;
+    if (native_renderer != nullptr) {
+      int64_t start_us = rtc::TimeMicros();
+      drawn = native_renderer->Draw(frame_buffer.get());
+      if (drawn) {
+        AddConvertTime(start_us);
+      }
+    }
+    if (drawn) {
+      frame_buffer = drawn;
+    } else {
+      int64_t start_us = rtc::TimeMicros();
+      frame_buffer = frame_buffer->ToI420();
+      native_convert_count_++;
+      native_convert_time_us_ += rtc::TimeMicros() - start_us;
+    }
+  }
+#endif
+
+  SetFrameBuffer(frame_buffer, capture_ntp_ms);
+
+  // 変換用スレッドがあるなら、そちらで変換しておく。
+  // 変換が間に合っていない場合は、次の変換で最新のフレームを使うので投げ直さない。
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (convert_thread_ != nullptr && target_width_.load() != 0 &&
+      !convert_pending_.exchange(true)) {
+    convert_thread_->PostTask(RTC_FROM_HERE, [this]() { ConvertFrame(); });
+  }
+}
+
+void UnityRenderer::Sink::ConvertToABGR(
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> src,
+    rtc::scoped_refptr<webrtc::I420Buffer>* scale,
+    rtc::scoped_refptr<webrtc::I420Buffer>* nv12_i420,
+    uint8_t* dst,
+    int dst_stride,
+    int width,
+    int height) {
+  int64_t start_us = rtc::TimeMicros();
+  bool same_size = src->width() == width && src->height() == height;
+  rtc::scoped_refptr<webrtc::I420BufferInterface> src_i420;
+  if (src->type() == webrtc::VideoFrameBuffer::Type::kNV12) {
+    const webrtc::NV12BufferInterface* nv12 = src->GetNV12();
+    // NV12 でサイズが同じなら I420 を経由せずに変換する
+    if (same_size) {
+      libyuv::NV12ToABGR(nv12->DataY(), nv12->StrideY(), nv12->DataUV(),
+                         nv12->StrideUV(), dst, dst_stride, width, height);
+      AddConvertTime(start_us);
+      return;
+    }
+    // NV12Buffer::ToI420 は毎回 I420Buffer を確保するので、使い回すバッファに変換する
+    ReserveI420Buffer(nv12_i420, nv12->width(), nv12->height());
+    libyuv::NV12ToI420(nv12->DataY(), nv12->StrideY(), nv12->DataUV(),
+                       nv12->StrideUV(), (*nv12_i420)->MutableDataY(),
+                       (*nv12_i420)->StrideY(), (*nv12_i420)->MutableDataU(),
+                       (*nv12_i420)->StrideU(), (*nv12_i420)->MutableDataV(),
+                       (*nv12_i420)->StrideV(), nv12->width(), nv12->height());
+    src_i420 = *nv12_i420;
+  } else {
+    src_i420 = src->ToI420();
+  }
+  const webrtc::I420BufferInterface* i420_buffer = src_i420.get();
+  // サイズが同じならスケーリングせずにそのまま変換する
+  if (!same_size) {
+    ReserveI420Buffer(scale, width, height);
+    (*scale)->ScaleFrom(*src_i420);
+    i420_buffer = scale->get();
+  }
+  libyuv::I420ToABGR(i420_buffer->DataY(), i420_buffer->StrideY(),
+                     i420_buffer->DataU(), i420_buffer->StrideU(),
+                     i420_buffer->DataV(), i420_buffer->StrideV(), dst,
+                     dst_stride, width, height);
+  AddConvertTime(start_us);
+}
+
+void UnityRenderer::Sink::ConvertFrame() {
+  // ここは変換用スレッドから呼ばれる
+  convert_pending_.store(false);
+
+  uint64_t seq;
+  auto video_frame_buffer = GetFrameBuffer(&seq);
+#if defined(SORA_UNITY_SDK_ANDROID)
+  if (video_frame_buffer &&
+      video_frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative &&
+      HasNativeTexture()) {
+    return;
+  }
+#endif
+  video_frame_buffer = MapFrameBuffer(video_frame_buffer, seq);
+  int width = target_width_.load();
+  int height = target_height_.load();
+  if (!video_frame_buffer || width == 0 || height == 0) {
+    return;
+  }
+
+  size_t size = width * height * 4;
+  if (convert_back_.data.size() < size) {
+    convert_back_.data.resize(size);
+  }
+  ConvertToABGR(video_frame_buffer, &convert_scale_buffer_,
+                &convert_nv12_i420_buffer_, convert_back_.data.data(),
+                width * 4, width, height);
+  convert_back_.seq = seq;
+  convert_back_.width = width;
+  convert_back_.height = height;
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  std::swap(convert_back_, convert_front_);
+  size_t bytes = convert_back_.data.capacity() +
+                 convert_front_.data.capacity() +
+                 convert_rendering_.data.capacity();
+  bytes += I420BufferBytes(convert_scale_buffer_.get()) +
+           I420BufferBytes(convert_nv12_i420_buffer_.get());
+  convert_bytes_.store(bytes);
+  memory_.Set(GetBufferBytes());
+}
+
+uint8_t* UnityRenderer::Sink::TakeConvertedABGR(int width, int height) {
+  // 次に変換するサイズを覚えておく
+  target_width_.store(width);
+  target_height_.store(height);
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (convert_front_.seq > convert_rendering_.seq) {
+      std::swap(convert_front_, convert_rendering_);
+    }
+  }
+  if (convert_rendering_.seq == 0 || convert_rendering_.width != width ||
+      convert_rendering_.height != height) {
+    return nullptr;
+  }
+  return convert_rendering_.data.data();
+}
+
+uint8_t* UnityRenderer::Sink::UpdateABGR(intptr_t texture_id,
+                                         int width,
+                                         int height) {
+  uint64_t seq;
+  auto video_frame_buffer = GetFrameBuffer(&seq);
+  if (!video_frame_buffer) {
+    return nullptr;
+  }
+#if defined(SORA_UNITY_SDK_ANDROID)
+  // AHardwareBuffer に描画したフレームは RenderNativeTexture で GPU 上でコピーする
+  if (video_frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative &&
+      HasNativeTexture()) {
+    return nullptr;
+  }
+#endif
+
+  // 変換用スレッドで変換済みのフレームがあれば、それをそのまま渡す。
+  // まだ無い場合（最初のフレームやサイズが変わった場合）はここで変換する。
+  if (convert_thread_ != nullptr) {
+    uint8_t* buf = TakeConvertedABGR(width, height);
+    if (buf != nullptr) {
+      if (!MarkRendered(&rendered_targets_[(int)RenderPlane::kABGR],
+                        texture_id, convert_rendering_.seq)) {
+        return nullptr;
+      }
+      return buf;
+    }
+  }
+
+  // 前回からフレームが変わっていなければ何もしない
+  if (!MarkRendered(&rendered_targets_[(int)RenderPlane::kABGR], texture_id,
+                    seq)) {
+    return nullptr;
+  }
+  // 転送すると決まってから kNative を変換する
+  video_frame_buffer = MapFrameBuffer(video_frame_buffer, seq);
+  if (!video_frame_buffer) {
+    return nullptr;
+  }
+
+  auto scale_buffer = scale_buffer_;
+  auto nv12_i420_buffer = nv12_i420_buffer_;
+  uint8_t* buf = ReserveTempBuffer(width * height * 4);
+  ConvertToABGR(video_frame_buffer, &scale_buffer_, &nv12_i420_buffer_, buf,
+                width * 4, width, height);
+  if (scale_buffer != scale_buffer_ || nv12_i420_buffer != nv12_i420_buffer_) {
+    UpdateBufferBytes();
+  }
+  return buf;
+}
+
+bool UnityRenderer::Sink::UpdateAtlasTile(RenderedTarget* target,
+                                          uint8_t* dst,
+                                          int dst_stride,
+                                          int width,
+                                          int height) {
+  uint64_t seq;
+  auto video_frame_buffer = GetFrameBuffer(&seq);
+  if (!video_frame_buffer) {
+    return false;
+  }
+#if defined(SORA_UNITY_SDK_ANDROID)
+  // AHardwareBuffer に描画したフレームはアトラスには転送できない
+  if (video_frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative &&
+      HasNativeTexture()) {
+    return false;
+  }
+#endif
+
+  // UpdateABGR と同じく、変換用スレッドで変換済みならタイルにコピーするだけで済む
+  if (convert_thread_ != nullptr) {
+    uint8_t* buf = TakeConvertedABGR(width, height);
+    if (buf != nullptr) {
+      if (!MarkRendered(target, 0, convert_rendering_.seq)) {
+        return false;
+      }
+      libyuv::CopyPlane(buf, width * 4, dst, dst_stride, width * 4, height);
+      return true;
+    }
   }
 
-  SetFrameBuffer(frame_buffer);
+  if (!MarkRendered(target, 0, seq)) {
+    return false;
+  }
+  video_frame_buffer = MapFrameBuffer(video_frame_buffer, seq);
+  if (!video_frame_buffer) {
+    return false;
+  }
+
+  auto scale_buffer = scale_buffer_;
+  auto nv12_i420_buffer = nv12_i420_buffer_;
+  ConvertToABGR(video_frame_buffer, &scale_buffer_, &nv12_i420_buffer_, dst,
+                dst_stride, width, height);
+  if (scale_buffer != scale_buffer_ || nv12_i420_buffer != nv12_i420_buffer_) {
+    UpdateBufferBytes();
+  }
+  return true;
+}
+
+rtc::scoped_refptr<webrtc::I420BufferInterface>
+UnityRenderer::Sink::GetPlanarI420() {
+  if (!planar_i420_) {
+    planar_i420_ = planar_buffer_->ToI420();
+  }
+  return planar_i420_;
+}
+
+uint8_t* UnityRenderer::Sink::UpdatePlane(RenderPlane plane,
+                                          intptr_t texture_id,
+                                          int width,
+                                          int height) {
+  if (plane == RenderPlane::kY || !planar_buffer_) {
+    uint64_t seq;
+    auto video_frame_buffer = GetFrameBuffer(&seq);
+    if (!video_frame_buffer) {
+      return nullptr;
+    }
+    // 前回と同じフレームなら変換済みの planar_buffer_ を使い回す
+    if (!planar_buffer_ || seq != planar_seq_) {
+      // このテクスチャに転送済みのフレームなら kNative の変換もしない
+      const RenderedTarget& target = rendered_targets_[(int)plane];
+      if (target.texture_id == texture_id && target.seq >= seq) {
+        return nullptr;
+      }
+      video_frame_buffer = MapFrameBuffer(video_frame_buffer, seq);
+      if (!video_frame_buffer) {
+        return nullptr;
+      }
+      // NV12 の場合はそのまま転送できるので I420 に変換しない
+      if (video_frame_buffer->type() ==
+          webrtc::VideoFrameBuffer::Type::kNV12) {
+        planar_buffer_ = video_frame_buffer;
+        planar_i420_ = nullptr;
+      } else {
+        planar_i420_ = video_frame_buffer->ToI420();
+        planar_buffer_ = planar_i420_;
+      }
+      planar_seq_ = seq;
+    }
+  }
+  // 前回からフレームが変わっていなければ何もしない
+  if (!MarkRendered(&rendered_targets_[(int)plane], texture_id,
+                    planar_seq_)) {
+    return nullptr;
+  }
+
+  const webrtc::NV12BufferInterface* nv12 = nullptr;
+  if (planar_buffer_->type() == webrtc::VideoFrameBuffer::Type::kNV12) {
+    nv12 = planar_buffer_->GetNV12();
+  }
+
+  // U と V が交互に並んだプレーン（NV12 の UV プレーン）
+  if (plane == RenderPlane::kUV) {
+    if (nv12 != nullptr && nv12->ChromaWidth() == width &&
+        nv12->ChromaHeight() == height) {
+      if (nv12->StrideUV() == width * 2) {
+        return const_cast<uint8_t*>(nv12->DataUV());
+      }
+      uint8_t* buf = ReserveTempBuffer(width * height * 2);
+      libyuv::CopyPlane(nv12->DataUV(), nv12->StrideUV(), buf, width * 2,
+                        width * 2, height);
+      return buf;
+    }
+
+    auto i420 = GetPlanarI420();
+    const uint8_t* src_u = i420->DataU();
+    const uint8_t* src_v = i420->DataV();
+    int stride_u = i420->StrideU();
+    int stride_v = i420->StrideV();
+    uint8_t* buf = ReserveTempBuffer(width * height * 4);
+    if (i420->ChromaWidth() != width || i420->ChromaHeight() != height) {
+      // サイズが違う場合は U と V をそれぞれスケーリングしてから並べる
+      uint8_t* scaled_u = buf + width * height * 2;
+      uint8_t* scaled_v = scaled_u + width * height;
+      libyuv::ScalePlane(src_u, stride_u, i420->ChromaWidth(),
+                         i420->ChromaHeight(), scaled_u, width, width, height,
+                         libyuv::kFilterBox);
+      libyuv::ScalePlane(src_v, stride_v, i420->ChromaWidth(),
+                         i420->ChromaHeight(), scaled_v, width, width, height,
+                         libyuv::kFilterBox);
+      src_u = scaled_u;
+      src_v = scaled_v;
+      stride_u = width;
+      stride_v = width;
+    }
+    libyuv::MergeUVPlane(src_u, stride_u, src_v, stride_v, buf, width * 2,
+                         width, height);
+    return buf;
+  }
+
+  const uint8_t* src;
+  int src_stride;
+  int src_width;
+  int src_height;
+  if (plane == RenderPlane::kY) {
+    if (nv12 != nullptr) {
+      src = nv12->DataY();
+      src_stride = nv12->StrideY();
+    } else {
+      src = planar_i420_->DataY();
+      src_stride = planar_i420_->StrideY();
+    }
+    src_width = planar_buffer_->width();
+    src_height = planar_buffer_->height();
+  } else {
+    auto i420 = GetPlanarI420();
+    src = plane == RenderPlane::kU ? i420->DataU() : i420->DataV();
+    src_stride = plane == RenderPlane::kU ? i420->StrideU() : i420->StrideV();
+    src_width = i420->ChromaWidth();
+    src_height = i420->ChromaHeight();
+  }
+
+  // テクスチャとサイズが一致していて詰まっているなら、コピーせずにそのまま渡す
+  if (src_width == width && src_height == height && src_stride == width) {
+    return const_cast<uint8_t*>(src);
+  }
+
+  uint8_t* buf = ReserveTempBuffer(width * height);
+  libyuv::ScalePlane(src, src_stride, src_width, src_height, buf, width, width,
+                     height, libyuv::kFilterBox);
+  return buf;
 }
 
 void UnityRenderer::Sink::TextureUpdateCallback(int eventID, void* data) {
+  ScopedPerfTimer timer(PerfStage::kTextureUpdate);
   auto event = static_cast<UnityRenderingExtEventType>(eventID);
 
+  // Begin で texData に渡したバッファは End まで Unity が読むので、
+  // その間に Sink やアトラスが破棄されないように Begin で引いた Ref を End まで持っておく。
+  // どちらもレンダリングスレッドから呼ばれる。
+  // 毎回確保しないように、プレーンと ID のスロットの番号で引く固定の表に入れる。
+  // Ref を持っている間はスロットが再利用されないので、他の ID と被ることはない
+  static IdPointer::Ref updating_refs[kRenderPlaneCount][IdPointer::kMaxSlots];
+  auto updating_ref = [](uint32_t user_data) -> IdPointer::Ref* {
+    uint32_t plane = user_data >> kRenderPlaneShift;
+    if (plane >= (uint32_t)kRenderPlaneCount) {
+      return nullptr;
+    }
+    return &updating_refs[plane][IdPointer::SlotIndex(
+        user_data & kRenderSinkIdMask)];
+  };
+
   if (event == kUnityRenderingExtEventUpdateTextureBeginV2) {
     auto params =
         reinterpret_cast<UnityRenderingExtTextureUpdateParamsV2*>(data);
-    Sink* p = (Sink*)IdPointer::Instance().Lookup(params->userData);
+    auto plane = static_cast<RenderPlane>(params->userData >> kRenderPlaneShift);
+    if (plane == RenderPlane::kAtlas) {
+      auto ref = TextureAtlas::UpdateTexture(params);
+      IdPointer::Ref* slot = updating_ref(params->userData);
+      if (ref.get() != nullptr && slot != nullptr) {
+        *slot = std::move(ref);
+      }
+      return;
+    }
+    auto ref = IdPointer::Instance().Lookup(
+        params->userData & kRenderSinkIdMask, IdPointer::Type::kVideoSink);
+    Sink* p = (Sink*)ref.get();
     if (p == nullptr) {
       return;
     }
-    auto video_frame_buffer = p->GetFrameBuffer();
-    if (!video_frame_buffer) {
+
+    // テクスチャのサイズは VideoSinkWants に反映する。
+    // U/V プレーンは Y プレーンと同じ映像なので反映しない。
+    int pixel_count = 0;
+    if (plane == RenderPlane::kABGR || plane == RenderPlane::kY) {
+      pixel_count = params->width * params->height;
+      p->requested_pixel_count_.store(pixel_count);
+    }
+
+    // このフレームの予算を超えている場合は転送しない。
+    // MarkRendered していないので、次のフレームで転送される
+    if (!p->schedule_.Acquire(pixel_count)) {
       return;
     }
 
     // UpdateTextureBegin: Generate and return texture image data.
-    rtc::scoped_refptr<webrtc::I420Buffer> i420_buffer =
-        webrtc::I420Buffer::Create(params->width, params->height);
-    i420_buffer->ScaleFrom(*video_frame_buffer->ToI420());
-    delete[] p->temp_buf_;
-    p->temp_buf_ = new uint8_t[params->width * params->height * 4];
-    libyuv::I420ToABGR(
-        i420_buffer->DataY(), i420_buffer->StrideY(), i420_buffer->DataU(),
-        i420_buffer->StrideU(), i420_buffer->DataV(), i420_buffer->StrideV(),
-        p->temp_buf_, params->width * 4, params->width, params->height);
-    params->texData = p->temp_buf_;
+    uint8_t* tex_data;
+    int64_t start_us = rtc::TimeMicros();
+    int bytes_per_pixel;
+    if (plane == RenderPlane::kABGR) {
+      tex_data =
+          p->UpdateABGR(params->textureID, params->width, params->height);
+      bytes_per_pixel = 4;
+    } else {
+      tex_data = p->UpdatePlane(plane, params->textureID, params->width,
+                                params->height);
+      if (tex_data != nullptr) {
+        p->AddConvertTime(start_us);
+      }
+      bytes_per_pixel = plane == RenderPlane::kUV ? 2 : 1;
+    }
+    if (tex_data == nullptr) {
+      return;
+    }
+    p->schedule_.AddCost(rtc::TimeMicros() - start_us,
+                         (int64_t)params->width * params->height *
+                             bytes_per_pixel);
+    params->texData = tex_data;
+    IdPointer::Ref* slot = updating_ref(params->userData);
+    if (slot != nullptr) {
+      *slot = std::move(ref);
+    }
   } else if (event == kUnityRenderingExtEventUpdateTextureEndV2) {
     auto params =
         reinterpret_cast<UnityRenderingExtTextureUpdateParamsV2*>(data);
-    Sink* p = (Sink*)IdPointer::Instance().Lookup(params->userData);
+    auto plane = static_cast<RenderPlane>(params->userData >> kRenderPlaneShift);
+    // Begin で texData を渡していれば、この関数を抜けるまで Ref を持っておく
+    IdPointer::Ref ref;
+    IdPointer::Ref* slot = updating_ref(params->userData);
+    if (slot != nullptr) {
+      ref = std::move(*slot);
+    }
+    if (plane == RenderPlane::kAtlas) {
+      return;
+    }
+    if (ref.get() == nullptr) {
+      ref = IdPointer::Instance().Lookup(params->userData & kRenderSinkIdMask,
+                                         IdPointer::Type::kVideoSink);
+    }
+    Sink* p = (Sink*)ref.get();
     if (p == nullptr) {
       return;
     }
-    delete[] p->temp_buf_;
-    p->temp_buf_ = nullptr;
+    // V プレーンか UV プレーンまで転送したら保持していたフレームを解放する
+    if (plane == RenderPlane::kV || plane == RenderPlane::kUV) {
+      p->planar_buffer_ = nullptr;
+      p->planar_i420_ = nullptr;
+    }
+  }
+}
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+void UnityRenderer::Sink::RenderNativeTexture() {
+  // ここは Unity のレンダリングスレッドから呼ばれる
+  ID3D11Texture2D* y_texture;
+  ID3D11Texture2D* uv_texture;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    y_texture = native_y_texture_;
+    uv_texture = native_uv_texture_;
+  }
+  if (y_texture == nullptr || uv_texture == nullptr) {
+    return;
+  }
+
+  uint64_t seq;
+  auto video_frame_buffer = GetFrameBuffer(&seq);
+  if (!video_frame_buffer) {
+    return;
+  }
+  // 前回からフレームが変わっていなければ何もしない
+  if (!MarkRendered(&rendered_targets_[kNativeTarget], (intptr_t)y_texture,
+                    seq)) {
+    return;
+  }
+
+  ID3D11DeviceContext* context = UnityContext::Instance().GetDeviceContext();
+  if (context == nullptr) {
+    return;
+  }
+
+  int64_t start_us = rtc::TimeMicros();
+  D3D11_TEXTURE2D_DESC y_desc;
+  D3D11_TEXTURE2D_DESC uv_desc;
+  y_texture->GetDesc(&y_desc);
+  uv_texture->GetDesc(&uv_desc);
+
+  auto texture_buffer =
+      video_frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNative
+          ? dynamic_cast<D3D11NV12TextureBuffer*>(video_frame_buffer.get())
+          : nullptr;
+  if (texture_buffer != nullptr) {
+    // GPU 上でコピーする。テクスチャの方が小さい場合ははみ出た部分を捨てる
+    D3D11_BOX y_box = {0, 0, 0,
+                       std::min<UINT>(y_desc.Width, texture_buffer->width()),
+                       std::min<UINT>(y_desc.Height, texture_buffer->height()),
+                       1};
+    D3D11_BOX uv_box = {
+        0,
+        0,
+        0,
+        std::min<UINT>(uv_desc.Width, (texture_buffer->width() + 1) / 2),
+        std::min<UINT>(uv_desc.Height, (texture_buffer->height() + 1) / 2),
+        1};
+    context->CopySubresourceRegion(y_texture, 0, 0, 0, 0,
+                                   texture_buffer->y_texture(), 0, &y_box);
+    context->CopySubresourceRegion(uv_texture, 0, 0, 0, 0,
+                                   texture_buffer->uv_texture(), 0, &uv_box);
+    AddConvertTime(start_us);
+    return;
+  }
+
+  // GPU に無いフレームは NV12 にしてから転送する
+  if (video_frame_buffer->width() != (int)y_desc.Width ||
+      video_frame_buffer->height() != (int)y_desc.Height) {
+    RTC_LOG(LS_WARNING) << "Native texture size mismatch: texture="
+                        << y_desc.Width << "x" << y_desc.Height
+                        << " frame=" << video_frame_buffer->width() << "x"
+                        << video_frame_buffer->height();
+    return;
+  }
+  const webrtc::NV12BufferInterface* nv12 = nullptr;
+  if (video_frame_buffer->type() == webrtc::VideoFrameBuffer::Type::kNV12) {
+    nv12 = video_frame_buffer->GetNV12();
+  }
+  if (nv12 != nullptr) {
+    context->UpdateSubresource(y_texture, 0, nullptr, nv12->DataY(),
+                               nv12->StrideY(), 0);
+    context->UpdateSubresource(uv_texture, 0, nullptr, nv12->DataUV(),
+                               nv12->StrideUV(), 0);
+  } else {
+    auto i420 = video_frame_buffer->ToI420();
+    int chroma_width = i420->ChromaWidth();
+    int chroma_height = i420->ChromaHeight();
+    uint8_t* buf = ReserveTempBuffer(chroma_width * chroma_height * 2);
+    libyuv::MergeUVPlane(i420->DataU(), i420->StrideU(), i420->DataV(),
+                         i420->StrideV(), buf, chroma_width * 2, chroma_width,
+                         chroma_height);
+    context->UpdateSubresource(y_texture, 0, nullptr, i420->DataY(),
+                               i420->StrideY(), 0);
+    context->UpdateSubresource(uv_texture, 0, nullptr, buf, chroma_width * 2,
+                               0);
+  }
+  AddConvertTime(start_us);
+}
+
+bool UnityRenderer::Sink::SetNativeTextures(ptrid_t track_id,
+                                            void* y_texture,
+                                            void* uv_texture) {
+  auto ref =
+      IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(p->mutex_);
+  p->native_y_texture_ = (ID3D11Texture2D*)y_texture;
+  p->native_uv_texture_ = (ID3D11Texture2D*)uv_texture;
+  return true;
+}
+#endif
+
+#if defined(SORA_UNITY_SDK_ANDROID)
+void UnityRenderer::Sink::RenderNativeTexture() {
+  // ここは Unity のレンダリングスレッドから呼ばれる
+  void* texture;
+  AndroidNativeTextureRenderer* native_renderer;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    texture = native_texture_;
+    native_renderer = native_renderer_.get();
+  }
+  if (texture == nullptr || native_renderer == nullptr) {
+    return;
+  }
+
+  native_renderer->Update();
+
+  uint64_t seq;
+  auto video_frame_buffer = GetFrameBuffer(&seq);
+  // AHardwareBuffer に描画できなかったフレームは CPU のメモリにあるので、
+  // TextureUpdateCallback で転送する
+  if (!video_frame_buffer ||
+      video_frame_buffer->type() != webrtc::VideoFrameBuffer::Type::kNative) {
+    return;
+  }
+  // 前回からフレームが変わっていなければ何もしない
+  if (!MarkRendered(&rendered_targets_[kNativeTarget], (intptr_t)texture,
+                    seq)) {
+    return;
+  }
+
+  int64_t start_us = rtc::TimeMicros();
+  if (native_renderer->Render(video_frame_buffer.get(), texture)) {
+    AddConvertTime(start_us);
   }
 }
 
+bool UnityRenderer::Sink::HasNativeTexture() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return native_texture_ != nullptr;
+}
+
+bool UnityRenderer::Sink::SetNativeTexture(ptrid_t track_id, void* texture) {
+  if (texture != nullptr && !AndroidNativeTextureRenderer::IsSupported()) {
+    return false;
+  }
+  auto ref =
+      IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(p->mutex_);
+  if (texture != nullptr && !p->native_renderer_) {
+    p->native_renderer_.reset(new AndroidNativeTextureRenderer());
+  }
+  p->native_texture_ = texture;
+  return true;
+}
+#endif
+
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_ANDROID)
+void UnityRenderer::Sink::NativeTextureRenderCallback(int eventID) {
+  auto ref = IdPointer::Instance().Lookup(eventID, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return;
+  }
+  p->RenderNativeTexture();
+}
+#endif
+
+bool UnityRenderer::Sink::HasNewFrame(ptrid_t track_id) {
+  auto ref =
+      IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return false;
+  }
+  return p->HasNewFrame();
+}
+
+void UnityRenderer::Sink::SetMaxFramerate(ptrid_t track_id,
+                                          int max_framerate) {
+  auto ref =
+      IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return;
+  }
+  p->SetMaxFramerate(max_framerate);
+}
+
+void UnityRenderer::Sink::SetPaused(ptrid_t track_id, bool paused) {
+  auto ref =
+      IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return;
+  }
+  p->SetPaused(paused);
+}
+
+bool UnityRenderer::Sink::GetRenderStats(ptrid_t track_id,
+                                         sora_track_render_stats_t* stats) {
+  auto ref =
+      IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return false;
+  }
+  p->GetRenderStats(stats);
+  return true;
+}
+
+void UnityRenderer::Sink::SetRenderPriority(ptrid_t track_id, int priority) {
+  auto ref =
+      IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+  Sink* p = (Sink*)ref.get();
+  if (p == nullptr) {
+    return;
+  }
+  p->schedule_.SetPriority(priority);
+}
+
 UnityRenderer::UnityRenderer(std::function<void(ptrid_t)> on_add_track,
-                             std::function<void(ptrid_t)> on_remove_track)
-    : on_add_track_(on_add_track), on_remove_track_(on_remove_track) {}
+                             std::function<void(ptrid_t)> on_remove_track,
+                             int convert_threads)
+    : on_add_track_(on_add_track), on_remove_track_(on_remove_track) {
+  for (int i = 0; i < convert_threads; i++) {
+    std::unique_ptr<rtc::Thread> thread = rtc::Thread::Create();
+    thread->SetName("Sora Convert Thread", nullptr);
+    if (!thread->Start()) {
+      RTC_LOG(LS_ERROR) << "Failed to start convert thread";
+      break;
+    }
+    convert_threads_.push_back(std::move(thread));
+  }
+}
 
 void UnityRenderer::AddTrack(webrtc::VideoTrackInterface* track) {
-  std::unique_ptr<Sink> sink(new Sink(track));
+  // 変換用スレッドは Sink ごとに順番に割り当てる
+  rtc::Thread* convert_thread = nullptr;
+  if (!convert_threads_.empty()) {
+    convert_thread =
+        convert_threads_[next_convert_thread_++ % convert_threads_.size()]
+            .get();
+  }
+  std::unique_ptr<Sink> sink(new Sink(track, convert_thread));
   auto sink_id = sink->GetSinkID();
-  sinks_.push_back(std::make_pair(track, std::move(sink)));
+  // IdPointer に登録できなかったトラックは Unity から引けないので描画しない
+  if (sink_id == 0) {
+    RTC_LOG(LS_ERROR) << "Failed to register video sink";
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(sinks_mutex_);
+    sinks_.push_back(std::make_pair(track, std::move(sink)));
+  }
   on_add_track_(sink_id);
 }
 
@@ -94,13 +1022,226 @@ void UnityRenderer::RemoveTrack(webrtc::VideoTrackInterface* track) {
   auto f = [track](const VideoSinkVector::value_type& sink) {
     return sink.first == track;
   };
-  auto it = std::find_if(sinks_.begin(), sinks_.end(), f);
-  if (it == sinks_.end()) {
-    return;
+  ptrid_t sink_id;
+  {
+    std::lock_guard<std::mutex> guard(sinks_mutex_);
+    auto it = std::find_if(sinks_.begin(), sinks_.end(), f);
+    if (it == sinks_.end()) {
+      return;
+    }
+    sink_id = it->second->GetSinkID();
+    sinks_.erase(std::remove_if(sinks_.begin(), sinks_.end(), f),
+                 sinks_.end());
   }
-  auto sink_id = it->second->GetSinkID();
-  sinks_.erase(std::remove_if(sinks_.begin(), sinks_.end(), f), sinks_.end());
   on_remove_track_(sink_id);
 }
 
+void UnityRenderer::ApplySinkWants() {
+  std::lock_guard<std::mutex> guard(sinks_mutex_);
+  for (const auto& sink : sinks_) {
+    sink.second->ApplyWants();
+  }
+}
+
+size_t UnityRenderer::GetBufferBytes() {
+  std::lock_guard<std::mutex> guard(sinks_mutex_);
+  size_t bytes = 0;
+  for (const auto& sink : sinks_) {
+    bytes += sink.second->GetBufferBytes();
+  }
+  return bytes;
+}
+
+// TextureAtlas
+
+ptrid_t TextureAtlas::Create(int columns, int rows) {
+  if (columns <= 0 || rows <= 0) {
+    RTC_LOG(LS_ERROR) << "Invalid texture atlas size: " << columns << "x"
+                      << rows;
+    return 0;
+  }
+  TextureAtlas* p = new TextureAtlas(columns, rows);
+  if (p->ptrid_ == 0) {
+    delete p;
+    return 0;
+  }
+  return p->ptrid_;
+}
+
+void TextureAtlas::Destroy(ptrid_t atlas_id) {
+  TextureAtlas* p;
+  {
+    auto ref =
+        IdPointer::Instance().Lookup(atlas_id, IdPointer::Type::kTextureAtlas);
+    p = (TextureAtlas*)ref.get();
+  }
+  // アトラス以外の ID を渡された場合は Lookup で引けないので何もしない
+  if (p == nullptr) {
+    RTC_LOG(LS_WARNING) << "Texture atlas not found: atlas_id=" << atlas_id;
+    return;
+  }
+  // デストラクタの Unregister で、レンダリングスレッドが使い終わるのを待つ
+  delete p;
+}
+
+bool TextureAtlas::SetTrack(ptrid_t atlas_id, int tile, ptrid_t track_id) {
+  auto ref =
+      IdPointer::Instance().Lookup(atlas_id, IdPointer::Type::kTextureAtlas);
+  TextureAtlas* p = (TextureAtlas*)ref.get();
+  if (p == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(p->mutex_);
+  if (tile < 0 || tile >= (int)p->track_ids_.size()) {
+    return false;
+  }
+  p->track_ids_[tile] = track_id;
+  return true;
+}
+
+bool TextureAtlas::GetUVRect(ptrid_t atlas_id, int tile, float* rect) {
+  auto ref =
+      IdPointer::Instance().Lookup(atlas_id, IdPointer::Type::kTextureAtlas);
+  TextureAtlas* p = (TextureAtlas*)ref.get();
+  if (p == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(p->mutex_);
+  if (tile < 0 || tile >= (int)p->track_ids_.size()) {
+    return false;
+  }
+  // まだ転送していない場合は、サイズが割り切れるものとして返す
+  int width = p->width_ > 0 ? p->width_ : p->columns_;
+  int height = p->height_ > 0 ? p->height_ : p->rows_;
+  int x, y, w, h;
+  p->GetTileRect(tile, width, height, &x, &y, &w, &h);
+  rect[0] = (float)x / width;
+  rect[1] = (float)y / height;
+  rect[2] = (float)w / width;
+  rect[3] = (float)h / height;
+  return true;
+}
+
+IdPointer::Ref TextureAtlas::UpdateTexture(
+    UnityRenderingExtTextureUpdateParamsV2* params) {
+  auto ref = IdPointer::Instance().Lookup(
+      params->userData & kRenderSinkIdMask, IdPointer::Type::kTextureAtlas);
+  TextureAtlas* p = (TextureAtlas*)ref.get();
+  if (p == nullptr) {
+    return IdPointer::Ref();
+  }
+  uint8_t* tex_data = p->Update(params->width, params->height);
+  if (tex_data == nullptr) {
+    return IdPointer::Ref();
+  }
+  params->texData = tex_data;
+  return ref;
+}
+
+TextureAtlas::TextureAtlas(int columns, int rows)
+    : columns_(columns),
+      rows_(rows),
+      track_ids_(columns * rows),
+      states_(columns * rows) {
+  ptrid_ = IdPointer::Instance().Register(this, IdPointer::Type::kTextureAtlas);
+}
+
+TextureAtlas::~TextureAtlas() {
+  if (ptrid_ != 0) {
+    IdPointer::Instance().Unregister(ptrid_);
+  }
+}
+
+void TextureAtlas::GetTileRect(int tile,
+                               int width,
+                               int height,
+                               int* x,
+                               int* y,
+                               int* w,
+                               int* h) const {
+  int column = tile % columns_;
+  int row = tile / columns_;
+  *x = column * width / columns_;
+  *y = row * height / rows_;
+  *w = (column + 1) * width / columns_ - *x;
+  *h = (row + 1) * height / rows_ - *y;
+}
+
+uint8_t* TextureAtlas::Update(int width, int height) {
+  std::vector<ptrid_t> track_ids;
+  bool resized = false;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    // サイズが変わったらタイルの位置も変わるので、全て転送し直す
+    if (width != width_ || height != height_) {
+      width_ = width;
+      height_ = height;
+      resized = true;
+    }
+    track_ids = track_ids_;
+  }
+
+  bool updated = false;
+  size_t size = (size_t)width * height * 4;
+  if (data_.size() != size) {
+    data_.assign(size, 0);
+    memory_.Set(data_.capacity(), 1);
+    updated = true;
+  }
+
+  const int stride = width * 4;
+  for (int i = 0; i < (int)track_ids.size(); i++) {
+    TileState& state = states_[i];
+    ptrid_t track_id = track_ids[i];
+    // 転送済みの記録を消して、新しいトラックでは必ず転送する
+    bool stale = resized || track_id != state.track_id;
+    if (stale) {
+      state.rendered = UnityRenderer::Sink::RenderedTarget();
+      state.track_id = track_id;
+    }
+
+    int x, y, w, h;
+    GetTileRect(i, width, height, &x, &y, &w, &h);
+    if (w <= 0 || h <= 0) {
+      continue;
+    }
+    uint8_t* dst = data_.data() + (size_t)y * stride + x * 4;
+    // 新しいトラックのフレームが来るまで前のトラックの絵を残さない
+    if (stale) {
+      libyuv::ARGBRect(dst, stride, 0, 0, w, h, 0xff000000);
+      state.cleared = true;
+      updated = true;
+    }
+    auto ref =
+        IdPointer::Instance().Lookup(track_id, IdPointer::Type::kVideoSink);
+    UnityRenderer::Sink* sink = (UnityRenderer::Sink*)ref.get();
+    // 空いたタイルや、トラックが削除されたタイルは前のフレームを残さずに黒で塗る
+    if (sink == nullptr) {
+      if (!state.cleared) {
+        libyuv::ARGBRect(dst, stride, 0, 0, w, h, 0xff000000);
+        state.cleared = true;
+        updated = true;
+      }
+      continue;
+    }
+    // タイルのサイズを VideoSinkWants に反映して、必要以上の解像度で受信しない
+    int pixel_count = w * h;
+    sink->requested_pixel_count_.store(pixel_count);
+    // 予算を超えたタイルは前のフレームのまま残し、次のフレームで転送する
+    if (!sink->schedule_.Acquire(pixel_count)) {
+      continue;
+    }
+    int64_t start_us = rtc::TimeMicros();
+    if (!sink->UpdateAtlasTile(&state.rendered, dst, stride, w, h)) {
+      continue;
+    }
+    state.cleared = false;
+    sink->schedule_.AddCost(rtc::TimeMicros() - start_us,
+                            (int64_t)pixel_count * 4);
+    updated = true;
+  }
+  // どのタイルも変わっていなければテクスチャを転送しない
+  return updated ? data_.data() : nullptr;
+}
+
 }  // namespace sora
@@ -1,55 +1,350 @@
 #ifndef SORA_UNITY_RENDERER_H_INCLUDED
 #define SORA_UNITY_RENDERER_H_INCLUDED
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 // webrtc
 #include "api/video/i420_buffer.h"
+#include "api/video/nv12_buffer.h"
 #include "libyuv.h"
+#include "rtc_base/thread.h"
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+#include <d3d11.h>
+#endif
+
+#if defined(SORA_UNITY_SDK_ANDROID)
+#include "android_helper/android_native_texture_renderer.h"
+#endif
 
 // sora
 #include "id_pointer.h"
+#include "latency_histogram.h"
+#include "memory_stats.h"
+#include "render_scheduler.h"
 #include "rtc/video_track_receiver.h"
 #include "unity/IUnityRenderingExtensions.h"
 
 namespace sora {
 
+class TextureAtlas;
+
+// TextureUpdateCallback の userData の上位ビットで、どのプレーンを転送するかを指定する。
+// 上位ビットが 0 の場合は従来通り ABGR に変換して転送する。
+// Y/U/V を指定した場合は R8 テクスチャに、UV を指定した場合は RG16 テクスチャに
+// プレーンをそのまま転送し、YUV -> RGB の変換はシェーダ側で行う。
+// I420 の場合は Y, U, V、NV12 の場合は Y, UV の順に転送すること。
+// kAtlas の場合は下位ビットが TextureAtlas の ID で、ABGR テクスチャに複数のトラックを並べて転送する。
+enum class RenderPlane : uint32_t {
+  kABGR = 0,
+  kY = 1,
+  kU = 2,
+  kV = 3,
+  kUV = 4,
+  kAtlas = 5,
+};
+static const int kRenderPlaneShift = 29;
+static const int kRenderPlaneCount = static_cast<int>(RenderPlane::kAtlas) + 1;
+static const uint32_t kRenderSinkIdMask = (1u << kRenderPlaneShift) - 1;
+
 class UnityRenderer : public VideoTrackReceiver {
  public:
   class Sink : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
+   public:
+    // 転送先に最後に転送したテクスチャとフレームの番号
+    struct RenderedTarget {
+      intptr_t texture_id = 0;
+      uint64_t seq = 0;
+    };
+
+   private:
     webrtc::VideoTrackInterface* track_;
     ptrid_t ptrid_;
     std::mutex mutex_;
     rtc::scoped_refptr<webrtc::VideoFrameBuffer> frame_buffer_;
-    uint8_t* temp_buf_ = nullptr;
+    // OnFrame が呼ばれるたびに増える番号
+    uint64_t frame_seq_ = 0;
+    // 最後にテクスチャに転送したフレームの番号
+    std::atomic<uint64_t> rendered_seq_{0};
+    // プレーンごとの転送先。kNativeTarget は RenderNativeTexture の転送先。
+    // 転送先のテクスチャが変わったら番号を捨てるので、テクスチャを作り直しても記録は増えず、
+    // 解放したテクスチャと同じアドレスに作られたテクスチャにも古い番号は引き継がれない。
+    // レンダリングスレッドからしか触らない
+    static const int kNativeTarget = kRenderPlaneCount;
+    RenderedTarget rendered_targets_[kRenderPlaneCount + 1];
+    // レンダリングスレッドで毎フレーム確保しないように使い回すバッファ。
+    // テクスチャのサイズが変わった時だけ確保し直す。
+    rtc::scoped_refptr<webrtc::I420Buffer> scale_buffer_;
+    // NV12 をスケーリングする前に I420 に変換しておくバッファ
+    rtc::scoped_refptr<webrtc::I420Buffer> nv12_i420_buffer_;
+    std::vector<uint8_t> temp_buf_;
+    std::atomic<size_t> buffer_bytes_{0};
+    // buffer_bytes_ と convert_bytes_ の合計を MemoryStats に反映する
+    TrackedMemory memory_{MemoryCategory::kRendererBuffers};
+    // Y/U/V を別々のテクスチャに転送する場合、途中でフレームが変わると
+    // プレーン間でずれが出るので、Y プレーンの転送時に保持しておく。
+    // planar_buffer_ は I420 か NV12 のどちらか。
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> planar_buffer_;
+    rtc::scoped_refptr<webrtc::I420BufferInterface> planar_i420_;
+    uint64_t planar_seq_ = 0;
+
+    // 変換用スレッドが指定されている場合、OnFrame の時点で
+    // 最後に要求されたテクスチャサイズの ABGR に変換しておく。
+    // 変換中、変換済み、レンダリング中の３つのバッファを入れ替えて使う。
+    struct ConvertedFrame {
+      uint64_t seq = 0;
+      int width = 0;
+      int height = 0;
+      std::vector<uint8_t> data;
+    };
+    rtc::Thread* convert_thread_;
+    std::atomic<bool> convert_pending_{false};
+    std::atomic<int> target_width_{0};
+    std::atomic<int> target_height_{0};
+    rtc::scoped_refptr<webrtc::I420Buffer> convert_scale_buffer_;
+    rtc::scoped_refptr<webrtc::I420Buffer> convert_nv12_i420_buffer_;
+    ConvertedFrame convert_back_;
+    ConvertedFrame convert_front_;
+    ConvertedFrame convert_rendering_;
+    std::atomic<size_t> convert_bytes_{0};
+
+    // 最後に要求されたテクスチャのピクセル数と最大フレームレート。
+    // 変わった時だけ VideoSinkWants に反映する。
+    std::atomic<int> requested_pixel_count_{0};
+    std::atomic<int> max_framerate_{0};
+    int applied_pixel_count_ = 0;
+    int applied_framerate_ = 0;
+    // 一時停止中はトラックから外して、フレームを受け取らない
+    std::atomic<bool> paused_{false};
+    bool applied_paused_ = false;
+
+    // パイプラインのどこでフレームが落ちているかを調べるためのカウンタ
+    std::atomic<uint64_t> frames_received_{0};
+    std::atomic<uint64_t> frames_dropped_{0};
+    std::atomic<uint64_t> frames_rendered_{0};
+    std::atomic<uint64_t> native_convert_count_{0};
+    std::atomic<int64_t> native_convert_time_us_{0};
+    std::atomic<uint64_t> convert_count_{0};
+    std::atomic<int64_t> convert_time_us_{0};
+    std::atomic<int> last_frame_width_{0};
+    std::atomic<int> last_frame_height_{0};
+
+    // abs-capture-time から求めた、送信側でキャプチャしてからの遅延。
+    // 送信側と受信側の NTP 時刻が合っている前提の値になる。
+    // キャプチャ時刻はフレームの番号ごとに capture_times_ に入れておき、
+    // テクスチャに転送した時に取り出す。mutex_ で保護する。
+    struct CaptureTime {
+      uint64_t seq = 0;
+      int64_t ntp_ms = -1;
+    };
+    static const int kCaptureTimeCount = 16;
+    CaptureTime capture_times_[kCaptureTimeCount];
+    LatencyHistogram capture_to_decode_ms_;
+    LatencyHistogram capture_to_render_ms_;
+    std::atomic<uint64_t> frames_without_capture_time_{0};
+
+#if defined(SORA_UNITY_SDK_WINDOWS)
+    // SetNativeTextures で指定された Unity のテクスチャ（Y は R8、UV は RG16）。
+    // 指定されている間は、NVDEC が GPU に置いたフレームを I420 に変換せずに保持し、
+    // RenderNativeTexture で GPU 上でコピーする。mutex_ で保護する。
+    ID3D11Texture2D* native_y_texture_ = nullptr;
+    ID3D11Texture2D* native_uv_texture_ = nullptr;
+#endif
+#if defined(SORA_UNITY_SDK_ANDROID)
+    // SetNativeTexture で指定された Unity の RGBA テクスチャ。mutex_ で保護する。
+    // 指定されている間は、MediaCodec が出力した OES テクスチャを OnFrame で
+    // AHardwareBuffer に描画し、RenderNativeTexture で GPU 上でコピーする。
+    // native_renderer_ は最初に指定された時に作り、Sink と同じだけ生きる
+    void* native_texture_ = nullptr;
+    std::unique_ptr<AndroidNativeTextureRenderer> native_renderer_;
+#endif
+
+    // 1 フレームあたりの転送の予算。HasNewFrame を呼ぶので最後に置いて最初に破棄する
+    RenderScheduler::Entry schedule_;
 
    public:
-    Sink(webrtc::VideoTrackInterface* track);
+    Sink(webrtc::VideoTrackInterface* track, rtc::Thread* convert_thread);
     ~Sink();
     ptrid_t GetSinkID() const;
+    // テクスチャ転送用に確保しているバッファのサイズ（バイト）
+    size_t GetBufferBytes() const;
+    // 最後にテクスチャに転送してから新しいフレームが来ているかどうか
+    bool HasNewFrame();
+    // テクスチャのサイズや最大フレームレートが変わっていたら VideoSinkWants に反映する
+    void ApplyWants();
+    void SetMaxFramerate(int max_framerate);
+    void SetPaused(bool paused);
+    void GetRenderStats(sora_track_render_stats_t* stats);
 
    private:
-    rtc::scoped_refptr<webrtc::VideoFrameBuffer> GetFrameBuffer();
-    void SetFrameBuffer(rtc::scoped_refptr<webrtc::VideoFrameBuffer> v);
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> GetFrameBuffer(
+        uint64_t* seq);
+    // GetFrameBuffer で取り出したフレームが kNative なら I420 に変換する。
+    // 変換したものは次のフレームが来るまで他の転送でも使い回す
+    rtc::scoped_refptr<webrtc::VideoFrameBuffer> MapFrameBuffer(
+        rtc::scoped_refptr<webrtc::VideoFrameBuffer> video_frame_buffer,
+        uint64_t seq);
+    void SetFrameBuffer(rtc::scoped_refptr<webrtc::VideoFrameBuffer> v,
+                        int64_t capture_ntp_ms);
+    // target にまだ転送していないフレームなら true を返して転送済みにする。
+    // texture_id が前回と違う場合は、前のテクスチャの記録を捨てて転送する
+    bool MarkRendered(RenderedTarget* target, intptr_t texture_id, uint64_t seq);
+    uint8_t* UpdateABGR(intptr_t texture_id, int width, int height);
+    uint8_t* UpdatePlane(RenderPlane plane,
+                         intptr_t texture_id,
+                         int width,
+                         int height);
+    rtc::scoped_refptr<webrtc::I420BufferInterface> GetPlanarI420();
+    void AddConvertTime(int64_t start_us);
+    uint8_t* ReserveTempBuffer(size_t size);
+    void UpdateBufferBytes();
+    void ConvertFrame();
+    uint8_t* TakeConvertedABGR(int width, int height);
+    // TextureAtlas のタイルに転送する。新しいフレームが無ければ false を返す。
+    // target はタイルごとの転送済みの記録
+    bool UpdateAtlasTile(RenderedTarget* target,
+                         uint8_t* dst,
+                         int dst_stride,
+                         int width,
+                         int height);
+    // src が NV12 の場合、サイズが同じなら I420 を経由せずに変換し、
+    // 違う場合は nv12_i420 に I420 に変換してからスケーリングする。
+    // scale と nv12_i420 はサイズが変わった時だけ確保し直す
+    void ConvertToABGR(rtc::scoped_refptr<webrtc::VideoFrameBuffer> src,
+                       rtc::scoped_refptr<webrtc::I420Buffer>* scale,
+                       rtc::scoped_refptr<webrtc::I420Buffer>* nv12_i420,
+                       uint8_t* dst,
+                       int dst_stride,
+                       int width,
+                       int height);
+    friend class TextureAtlas;
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_ANDROID)
+    void RenderNativeTexture();
+#endif
+#if defined(SORA_UNITY_SDK_ANDROID)
+    // kNative のフレームを RenderNativeTexture で転送するかどうか
+    bool HasNativeTexture();
+#endif
 
    public:
     void OnFrame(const webrtc::VideoFrame& frame) override;
     static void UNITY_INTERFACE_API TextureUpdateCallback(int eventID,
                                                           void* data);
+    static bool HasNewFrame(ptrid_t track_id);
+    static void SetMaxFramerate(ptrid_t track_id, int max_framerate);
+    // 画面外のトラックなどを一時停止する。最後に受け取ったフレームは残しておく
+    static void SetPaused(ptrid_t track_id, bool paused);
+    static bool GetRenderStats(ptrid_t track_id,
+                               sora_track_render_stats_t* stats);
+    // RenderScheduler で予算を超えた時に、大きいほど先に転送する
+    static void SetRenderPriority(ptrid_t track_id, int priority);
+#if defined(SORA_UNITY_SDK_WINDOWS)
+    // y_texture と uv_texture に nullptr を渡すと解除する
+    static bool SetNativeTextures(ptrid_t track_id,
+                                  void* y_texture,
+                                  void* uv_texture);
+#endif
+#if defined(SORA_UNITY_SDK_ANDROID)
+    // texture に nullptr を渡すと解除する。Unity が Vulkan でない場合は false を返す
+    static bool SetNativeTexture(ptrid_t track_id, void* texture);
+#endif
+#if defined(SORA_UNITY_SDK_WINDOWS) || defined(SORA_UNITY_SDK_ANDROID)
+    // IssuePluginEvent で eventID にトラック ID を指定して呼ぶ
+    static void UNITY_INTERFACE_API NativeTextureRenderCallback(int eventID);
+#endif
   };
 
  private:
   typedef std::vector<
       std::pair<webrtc::VideoTrackInterface*, std::unique_ptr<Sink>>>
       VideoSinkVector;
+  // Sink より後に破棄する必要があるので、sinks_ より前に置く
+  std::vector<std::unique_ptr<rtc::Thread>> convert_threads_;
+  size_t next_convert_thread_ = 0;
+  std::mutex sinks_mutex_;
   VideoSinkVector sinks_;
   std::function<void(ptrid_t)> on_add_track_;
   std::function<void(ptrid_t)> on_remove_track_;
 
  public:
+  // convert_threads が 1 以上の場合、受信したフレームの変換を
+  // Unity のレンダリングスレッドではなく変換用のスレッドで行う
   UnityRenderer(std::function<void(ptrid_t)> on_add_track,
-                std::function<void(ptrid_t)> on_remove_track);
+                std::function<void(ptrid_t)> on_remove_track,
+                int convert_threads = 0);
 
   void AddTrack(webrtc::VideoTrackInterface* track) override;
   void RemoveTrack(webrtc::VideoTrackInterface* track) override;
+
+  // 全ての Sink がテクスチャ転送用に確保しているバッファのサイズ（バイト）
+  size_t GetBufferBytes();
+
+  // レンダリング先のテクスチャのサイズを各トラックの VideoSinkWants に反映する。
+  // ワーカースレッドを待つことがあるので、レンダリングスレッドからは呼ばないこと。
+  void ApplySinkWants();
+};
+
+// 複数のトラックを 1 枚の ABGR テクスチャにタイル状に並べて転送する。
+// ギャラリー表示でトラックごとにテクスチャを更新するとテクスチャの転送と
+// マテリアルの切り替えがトラックの数だけ必要になるが、これなら 1 回の転送と
+// 1 回の描画で済む。
+//
+// テクスチャを columns x rows に等分して、タイルの番号は転送するデータの先頭から行ごとに数える。
+// 新しいフレームが来ているタイルだけを変換して、どれかが変わった場合だけテクスチャ全体を転送する。
+// タイルのサイズは各トラックの VideoSinkWants に反映する。
+class TextureAtlas {
+ public:
+  // 登録に失敗した場合は 0 を返す
+  static ptrid_t Create(int columns, int rows);
+  static void Destroy(ptrid_t atlas_id);
+  // track_id に 0 を指定するとタイルを空ける。空いたタイルは黒で塗る
+  static bool SetTrack(ptrid_t atlas_id, int tile, ptrid_t track_id);
+  // タイルの UV 矩形 (x, y, width, height) を rect に書き込む。
+  // 向きは RenderTrackToTexture でトラックごとのテクスチャに転送した場合と同じ
+  static bool GetUVRect(ptrid_t atlas_id, int tile, float* rect);
+  // params->texData にアトラスのバッファを渡す。
+  // 戻り値の Ref は Unity が texData を読み終わる UpdateTextureEnd まで持っておくこと
+  static IdPointer::Ref UpdateTexture(
+      UnityRenderingExtTextureUpdateParamsV2* params);
+
+ private:
+  TextureAtlas(int columns, int rows);
+  ~TextureAtlas();
+
+  // レンダリングスレッドから見たタイルの状態
+  struct TileState {
+    // Sink::MarkRendered に渡すタイルの転送済みの記録。
+    // トラックやテクスチャのサイズが変わったら消して転送し直す
+    UnityRenderer::Sink::RenderedTarget rendered;
+    // 最後に転送したトラック
+    ptrid_t track_id = 0;
+    // 黒で塗ってから何も転送していない
+    bool cleared = false;
+  };
+  // レンダリングスレッドから呼ぶ
+  uint8_t* Update(int width, int height);
+  void GetTileRect(int tile,
+                   int width,
+                   int height,
+                   int* x,
+                   int* y,
+                   int* w,
+                   int* h) const;
+
+  const int columns_;
+  const int rows_;
+  ptrid_t ptrid_ = 0;
+  std::mutex mutex_;
+  std::vector<ptrid_t> track_ids_;
+  // 最後に転送したテクスチャのサイズ
+  int width_ = 0;
+  int height_ = 0;
+  // 以下はレンダリングスレッドからしか触らない
+  std::vector<uint8_t> data_;
+  std::vector<TileState> states_;
+  TrackedMemory memory_{MemoryCategory::kRendererBuffers};
 };
 
 }  // namespace sora
@@ -6,7 +6,6 @@
 #include <boost/asio/bind_executor.hpp>
 #include <boost/asio/connect.hpp>
 #include <boost/asio/post.hpp>
-#include <boost/beast/core/buffers_to_string.hpp>
 #include <boost/beast/websocket/stream.hpp>
 
 // WebRTC
@@ -229,27 +228,28 @@ void Websocket::OnRead(read_callback_t on_read,
     RTC_LOG(LS_ERROR) << __FUNCTION__ << ": " << ec.message();
   }
 
-  const auto text = boost::beast::buffers_to_string(read_buffer_.data());
+  // 文字列にコピーせずにバッファを直接渡して、コールバックから戻ってから捨てる
+  const auto data = read_buffer_.data();
+  std::move(on_read)(
+      ec, bytes_transferred,
+      boost::beast::string_view(static_cast<const char*>(data.data()),
+                                data.size()));
   read_buffer_.consume(read_buffer_.size());
-
-  std::move(on_read)(ec, bytes_transferred, std::move(text));
 }
 
 void Websocket::WriteText(std::string text, write_callback_t on_write) {
-  boost::asio::post(strand_, std::bind(&Websocket::DoWriteText, this,
-                                       std::move(text), std::move(on_write)));
+  // std::bind だと DoWriteText に渡す時にコピーされるので、ラムダでムーブする
+  boost::asio::post(strand_, [this, text = std::move(text),
+                              on_write = std::move(on_write)]() mutable {
+    DoWriteText(std::move(text), std::move(on_write));
+  });
 }
 
 void Websocket::DoWriteText(std::string text, write_callback_t on_write) {
   bool empty = write_data_.empty();
-  boost::beast::flat_buffer buffer;
-
-  const auto n = boost::asio::buffer_copy(buffer.prepare(text.size()),
-                                          boost::asio::buffer(text));
-  buffer.commit(n);
-
-  write_data_.emplace_back(
-      new WriteData{std::move(buffer), std::move(on_write), true});
+  write_data_bytes_ += text.size();
+  write_data_.push_back(WriteData{std::move(text), std::move(on_write)});
+  write_data_memory_.Set(write_data_bytes_, write_data_.size());
 
   if (empty) {
     DoWrite();
@@ -258,17 +258,16 @@ void Websocket::DoWriteText(std::string text, write_callback_t on_write) {
 void Websocket::DoWrite() {
   auto& data = write_data_.front();
 
-  RTC_LOG(LS_VERBOSE) << __FUNCTION__ << ": "
-                      << boost::beast::buffers_to_string(data->buffer.data());
+  RTC_LOG(LS_VERBOSE) << __FUNCTION__ << ": " << data.text;
 
   if (IsSSL()) {
-    wss_->text(data->text);
-    wss_->async_write(data->buffer.data(),
+    wss_->text(true);
+    wss_->async_write(boost::asio::buffer(data.text),
                       std::bind(&Websocket::OnWrite, this,
                                 std::placeholders::_1, std::placeholders::_2));
   } else {
-    ws_->text(data->text);
-    ws_->async_write(data->buffer.data(),
+    ws_->text(true);
+    ws_->async_write(boost::asio::buffer(data.text),
                      std::bind(&Websocket::OnWrite, this, std::placeholders::_1,
                                std::placeholders::_2));
   }
@@ -281,11 +280,13 @@ void Websocket::OnWrite(boost::system::error_code ec,
   }
 
   auto& data = write_data_.front();
-  if (data->callback) {
-    std::move(data->callback)(ec, bytes_transferred);
+  if (data.callback) {
+    std::move(data.callback)(ec, bytes_transferred);
   }
 
-  write_data_.erase(write_data_.begin());
+  write_data_bytes_ -= data.text.size();
+  write_data_.pop_front();
+  write_data_memory_.Set(write_data_bytes_, write_data_.size());
 
   if (!write_data_.empty()) {
     DoWrite();
@@ -1,8 +1,10 @@
 #ifndef WEBSOCKET_H_
 #define WEBSOCKET_H_
 
+#include <deque>
 #include <functional>
 #include <memory>
+#include <string>
 
 // Boost
 #include <boost/asio/io_context.hpp>
@@ -11,10 +13,11 @@
 #include <boost/asio/ssl/stream.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
-#include <boost/beast/core/multi_buffer.hpp>
+#include <boost/beast/core/string.hpp>
 #include <boost/beast/websocket/ssl.hpp>
 #include <boost/beast/websocket/stream.hpp>
 
+#include "memory_stats.h"
 #include "url_parts.h"
 
 namespace sora {
@@ -31,9 +34,10 @@ class Websocket {
       boost::asio::ssl::stream<boost::asio::ip::tcp::socket>>
       ssl_websocket_t;
   typedef std::function<void(boost::system::error_code ec)> connect_callback_t;
+  // text は読み込みバッファを直接指しているので、コールバックの中でのみ有効
   typedef std::function<void(boost::system::error_code ec,
                              std::size_t bytes_transferred,
-                             std::string text)>
+                             boost::beast::string_view text)>
       read_callback_t;
   typedef std::function<void(boost::system::error_code ec,
                              std::size_t bytes_transferred)>
@@ -108,13 +112,18 @@ class Websocket {
 
   boost::asio::strand<websocket_t::executor_type> strand_;
 
-  boost::beast::multi_buffer read_buffer_;
+  // 連続した領域に読み込んで、確保した領域はメッセージ間で使い回す
+  boost::beast::flat_buffer read_buffer_;
+  // 書き込むテキストはコピーせずにそのまま送る。
+  // std::deque は末尾に追加しても先頭の要素を移動しないので、書き込み中のバッファが無効にならない
   struct WriteData {
-    boost::beast::flat_buffer buffer;
+    std::string text;
     write_callback_t callback;
-    bool text;
   };
-  std::vector<std::unique_ptr<WriteData>> write_data_;
+  std::deque<WriteData> write_data_;
+  // write_data_ に溜まっているテキストのバイト数
+  size_t write_data_bytes_ = 0;
+  TrackedMemory write_data_memory_{MemoryCategory::kWebSocketWriteQueue};
 };
 
 }  // namespace sora